@@ -4,6 +4,8 @@ import cv2
 import numpy as np
 import matplotlib.pyplot as plt
 
+import picamproc
+
 fps = 10
 
 parser = ap.ArgumentParser()
@@ -21,14 +23,14 @@ shape = (rows, cols)
 #ax.set_xlim(0, cols)
 #ax.set_ylim(0, rows)
 
-out_image = np.zeros(shape)
+stacker = picamproc.Stacker(width, height, frames=0)
 ok = True
 while ok:
     ok, rgb_img = vid.read()
     if ok:
         # Convert to grayscale 
-        img_l = rgb_img.sum(axis=2, dtype=np.float)
-        out_image += img_l
+        stacker.add(picamproc.luma_sum(rgb_img))
+out_image = stacker.flush()
 
 
 print(out_image.min(), out_image.mean(), out_image.std(), out_image.max())
@@ -0,0 +1,336 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Checks BackgroundEstimator on a synthetic sky with a skyglow gradient, a
+ * glow from the Moon just out of frame, a saturated blob and a star field:
+ * the interpolated background and RMS against the truth, and that adaptive
+ * thresholds find the stars a single threshold can't. Also checks the
+ * labeller's per-pixel thresholds against its fixed one, then times it all
+ * at full resolution.
+ *
+ * USAGE: background_bench [threads]
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "background.hpp"
+#include "connected_components.hpp"
+
+#include "fixtures.hpp"
+
+static const int RUNS = 5;
+static const float NOISE = 5.0f;
+static const float STAR_SIGMA = 1.2f;
+
+struct Star {
+  float x;
+  float y;
+  float peak;
+};
+
+/**
+ * The sky without noise or stars.
+ */
+static float skyLevel(uint32_t width, uint32_t height, float x, float y) {
+  const float mx = x - 1.1f * width;
+  const float my = y + 0.2f * height;
+  const float moon = 150.0f * std::exp(-(mx * mx + my * my) /
+                                       (1.0f * width * width));
+  return 60.0f + 40.0f * y / height + moon;
+}
+
+class Sky {
+  public:
+    Sky(uint32_t width, uint32_t height)
+      : mWidth{width}
+      , mHeight{height}
+      , mPixels(static_cast<size_t>(width) * height)
+      , mStars{}
+    {
+      uint64_t rng = 7;
+      for (size_t i = 0; i < mPixels.size(); i++) {
+        // Four uniforms make a passable Gaussian
+        const uint64_t r = nextRandom(rng);
+        float noise = 0.0f;
+        for (int k = 0; k < 4; k++) {
+          noise += static_cast<float>((r >> (16 * k)) & 0xFFFF) / 65535.0f;
+        }
+        noise = (noise - 2.0f) * NOISE * std::sqrt(3.0f);
+        mPixels[i] = skyLevel(width, height, i % width, i / width) + noise;
+      }
+
+      for (size_t i = 0; i < mPixels.size() / 5000; i++) {
+        const float u = static_cast<float>(nextRandom(rng) % 10000) / 10000.0f;
+        Star star{static_cast<float>(nextRandom(rng) % (width - 8)) + 4.0f,
+                  static_cast<float>(nextRandom(rng) % (height - 8)) + 4.0f,
+                  15.0f * NOISE + 2000.0f * u * u * u};
+        mStars.push_back(star);
+        for (int dy = -4; dy <= 4; dy++) {
+          for (int dx = -4; dx <= 4; dx++) {
+            const size_t p = static_cast<size_t>(star.y + dy) * width +
+              static_cast<size_t>(star.x + dx);
+            mPixels[p] += star.peak * std::exp(-(dx * dx + dy * dy) /
+                                               (2.0f * STAR_SIGMA * STAR_SIGMA));
+          }
+        }
+      }
+
+      // Something big and saturated, covering a few tiles
+      const float bx = 0.3f * width, by = 0.6f * height, r = 90.0f;
+      for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+          if ((x - bx) * (x - bx) + (y - by) * (y - by) < r * r) {
+            mPixels[static_cast<size_t>(y) * width + x] = 765.0f;
+          }
+        }
+      }
+    }
+
+    template <typename T>
+    std::vector<T> frame(float scale) const {
+      std::vector<T> out(mPixels.size());
+      for (size_t i = 0; i < out.size(); i++) {
+        out[i] = static_cast<T>(std::min(std::max(mPixels[i] * scale, 0.0f),
+                                         765.0f * scale) + 0.5f);
+      }
+      return out;
+    }
+
+    bool inBlob(float x, float y, float margin) const {
+      const float bx = 0.3f * mWidth, by = 0.6f * mHeight, r = 90.0f + margin;
+      return (x - bx) * (x - bx) + (y - by) * (y - by) < r * r;
+    }
+
+    const std::vector<Star>& stars() const {
+      return mStars;
+    }
+
+  private:
+    const uint32_t mWidth;
+    const uint32_t mHeight;
+    std::vector<float> mPixels;
+    std::vector<Star> mStars;
+};
+
+/**
+ * Stars brighter than minPeak that have a component within 2 pixels, and
+ * components with no star within 3 pixels.
+ */
+static void score(const Sky& sky, const std::vector<Component>& found,
+                  float minPeak, size_t& missed, size_t& spurious) {
+  missed = 0;
+  spurious = 0;
+  for (const Star& star : sky.stars()) {
+    if ((star.peak < minPeak) || sky.inBlob(star.x, star.y, 10.0f)) {
+      continue;
+    }
+    bool hit = false;
+    for (const Component& c : found) {
+      hit = hit || ((std::fabs(c.x - star.x) < 2.0) &&
+                    (std::fabs(c.y - star.y) < 2.0));
+    }
+    missed += hit ? 0 : 1;
+  }
+  for (const Component& c : found) {
+    if (sky.inBlob(c.x, c.y, 10.0f)) {
+      continue;
+    }
+    bool star = false;
+    for (const Star& s : sky.stars()) {
+      star = star || ((std::fabs(c.x - s.x) < 3.0) &&
+                      (std::fabs(c.y - s.y) < 3.0));
+    }
+    spurious += star ? 0 : 1;
+  }
+}
+
+template <typename T>
+static bool checkSky(const Sky& sky, uint32_t width, uint32_t height,
+                     float scale, WorkerPool* pool) {
+  const auto frame = sky.frame<T>(scale);
+  const Plane<const T> in{frame.data(), width, height};
+  BackgroundEstimator estimator{BackgroundEstimator::Config{}, pool};
+  estimator.estimate(in);
+
+  const size_t pixels = static_cast<size_t>(width) * height;
+  std::vector<float> background(pixels), rms(pixels);
+  estimator.background(Plane<float>{background.data(), width, height});
+  estimator.rms(Plane<float>{rms.data(), width, height});
+
+  // Against the truth, away from the blob
+  double sumError = 0.0, worst = 0.0, sumRms = 0.0;
+  size_t counted = 0;
+  for (uint32_t y = 0; y < height; y++) {
+    for (uint32_t x = 0; x < width; x++) {
+      if (sky.inBlob(x, y, 64.0f)) {
+        continue;
+      }
+      const size_t i = static_cast<size_t>(y) * width + x;
+      const double error = background[i] -
+        scale * skyLevel(width, height, x, y);
+      sumError += std::fabs(error);
+      worst = std::max(worst, std::fabs(error));
+      sumRms += rms[i];
+      counted++;
+    }
+  }
+  const double meanError = sumError / counted / scale;
+  const double meanRms = sumRms / counted / scale;
+  const bool levels = (meanError < 0.5) && (worst / scale < 3.0) &&
+    (std::fabs(meanRms - NOISE) < 0.1 * NOISE);
+  printf("  %2zu-bit background: mean error %.2f, worst %.2f, rms %.2f "
+         "(%.2f), %zu tiles replaced: %s\n", 8 * sizeof(T), meanError,
+         worst / scale, meanRms, NOISE, estimator.replacedTiles(),
+         levels ? "ok" : "BAD");
+
+  // 5 sigma per pixel against one threshold for the whole frame, the same
+  // distance above the mean sky
+  std::vector<uint16_t> thresholds(pixels);
+  estimator.threshold(Plane<uint16_t>{thresholds.data(), width, height},
+                      5.0f);
+  ComponentLabeller::Config config{};
+  config.minArea = 3;
+  std::vector<Component> adaptive, fixed;
+  ComponentLabeller{config, pool}.label(
+    in, Plane<const uint16_t>{thresholds.data(), width, height}, adaptive);
+  double meanSky = 0.0;
+  for (float b : background) {
+    meanSky += b;
+  }
+  config.threshold = static_cast<uint32_t>(meanSky / pixels +
+                                           5.0f * NOISE * scale);
+  ComponentLabeller{config, pool}.label(in, fixed);
+
+  const float minPeak = 12.0f * NOISE;
+  size_t missed, spurious, fixedMissed, fixedSpurious;
+  score(sky, adaptive, minPeak, missed, spurious);
+  score(sky, fixed, minPeak, fixedMissed, fixedSpurious);
+  size_t bright = 0;
+  for (const Star& star : sky.stars()) {
+    bright += ((star.peak >= minPeak) && !sky.inBlob(star.x, star.y, 10.0f));
+  }
+  const bool detected = (missed <= bright / 50) && (spurious <= 5);
+  printf("  %2zu-bit detection of %zu stars: adaptive missed %zu, %zu "
+         "spurious; fixed missed %zu, %zu spurious: %s\n", 8 * sizeof(T),
+         bright, missed, spurious, fixedMissed, fixedSpurious,
+         detected ? "ok" : "BAD");
+  return levels && detected;
+}
+
+/**
+ * The per-pixel labeller with every threshold the same finds what the fixed
+ * one does, and the mesh doesn't depend on the pool.
+ */
+static bool checkConsistent(const Sky& sky, uint32_t width, uint32_t height,
+                            WorkerPool* pool) {
+  const auto frame = sky.frame<uint16_t>(1.0f);
+  const Plane<const uint16_t> in{frame.data(), width, height};
+  const size_t pixels = static_cast<size_t>(width) * height;
+
+  bool same = true;
+  for (uint32_t threshold : {1u, 90u, 200u, 800u}) {
+    ComponentLabeller::Config config{};
+    config.threshold = threshold;
+    std::vector<Component> fixed, adaptive;
+    std::vector<uint32_t> fixedLabels(pixels), adaptiveLabels(pixels);
+    const Plane<uint32_t> fixedPlane{fixedLabels.data(), width, height};
+    const Plane<uint32_t> adaptivePlane{adaptiveLabels.data(), width, height};
+    ComponentLabeller labeller{config, pool};
+    labeller.label(in, fixed, &fixedPlane);
+    const std::vector<uint16_t> thresholds(pixels, threshold);
+    labeller.label(in, Plane<const uint16_t>{thresholds.data(), width, height},
+                   adaptive, &adaptivePlane);
+    same = same && (fixed.size() == adaptive.size()) &&
+      (fixedLabels == adaptiveLabels);
+  }
+
+  BackgroundEstimator serial{BackgroundEstimator::Config{}};
+  BackgroundEstimator parallel{BackgroundEstimator::Config{}, pool};
+  serial.estimate(in);
+  parallel.estimate(in);
+  const auto a = serial.meshBackground(), b = parallel.meshBackground();
+  for (uint32_t y = 0; y < a.height; y++) {
+    same = same && std::equal(a.row(y), a.row(y) + a.width, b.row(y));
+  }
+  printf("  per-pixel thresholds and pool: %s\n", same ? "ok" : "BAD");
+  return same;
+}
+
+int main(int argc, char* argv[]) {
+  unsigned threads = 0;
+  if (argc > 1) {
+    threads = std::max(std::atoi(argv[1]), 0);
+  }
+  WorkerPool pool{threads};
+  bool ok = true;
+
+  {
+    const uint32_t width = 1640, height = 1232;
+    const Sky sky{width, height};
+    printf("%ux%u sky:\n", width, height);
+    ok = checkSky<uint16_t>(sky, width, height, 1.0f, &pool) && ok;
+    ok = checkSky<uint8_t>(sky, width, height, 1.0f / 3.0f, &pool) && ok;
+    ok = checkConsistent(sky, width, height, &pool) && ok;
+  }
+
+  //
+  // Timing at full resolution
+  //
+  const uint32_t width = 3280, height = 2464;
+  const size_t pixels = static_cast<size_t>(width) * height;
+  const Sky sky{width, height};
+  const auto frame = sky.frame<uint16_t>(1.0f);
+  const Plane<const uint16_t> in{frame.data(), width, height};
+  std::vector<uint16_t> thresholds(pixels);
+  std::vector<float> background(pixels);
+  std::vector<Component> found;
+  ComponentLabeller::Config config{};
+  config.minArea = 3;
+
+  printf("\n%ux%u, ms per frame\n", width, height);
+  printf("%-8s %9s %9s %9s %9s\n", "threads", "estimate", "threshold",
+         "subtract", "label");
+  for (WorkerPool* p : {static_cast<WorkerPool*>(nullptr), &pool}) {
+    BackgroundEstimator estimator{BackgroundEstimator::Config{}, p};
+    ComponentLabeller labeller{config, p};
+    std::vector<uint16_t> subtracted(pixels);
+    const double estimateMs = timeIt(RUNS, [&] { estimator.estimate(in); });
+    const double thresholdMs = timeIt(RUNS, [&] {
+      estimator.threshold(Plane<uint16_t>{thresholds.data(), width, height},
+                          5.0f);
+    });
+    const double subtractMs = timeIt(RUNS, [&] {
+      estimator.subtract(in, Plane<uint16_t>{subtracted.data(), width,
+                                             height});
+    });
+    const double labelMs = timeIt(RUNS, [&] {
+      labeller.label(in, Plane<const uint16_t>{thresholds.data(), width,
+                                               height}, found);
+    });
+    printf("%-8u %9.1f %9.1f %9.1f %9.1f\n", p ? p->size() : 1, estimateMs,
+           thresholdMs, subtractMs, labelMs);
+  }
+
+  printf("%s\n", ok ? "all ok" : "FAILED");
+  return ok ? 0 : 1;
+}
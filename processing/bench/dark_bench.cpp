@@ -0,0 +1,319 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Checks the dark-frame kernels this CPU supports against the scalar ones,
+ * then builds a master dark from synthetic exposures (with hot pixels and a
+ * cosmic ray) and checks the master, its hot pixels, the file round trip,
+ * picking masters from a library, and calibrating a frame. Then times
+ * opening a master and calibrating full-resolution frames.
+ *
+ * USAGE: dark_bench [threads]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "dark_frame.hpp"
+
+#include "fixtures.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+static const int RUNS = 7;
+static const size_t MAX_ROW = 100;
+
+template <typename T>
+static std::vector<T> noise(size_t count, unsigned base, unsigned spread,
+                            uint64_t seed) {
+  std::vector<T> values(count);
+  uint64_t rng = seed;
+  for (auto& value : values) {
+    value = base + (nextRandom(rng) >> 32) % (spread + 1);
+  }
+  return values;
+}
+
+static bool checkKernels(const DarkKernels& k) {
+  const DarkKernels& ref = scalarDarkKernels();
+  for (size_t n = 0; n <= MAX_ROW; n++) {
+    for (size_t offset = 0; offset < 3; offset++) {
+      const uint64_t seed = n * 10 + offset + 1;
+      // Darks go above 255 and above the frames
+      const auto dark = noise<uint16_t>(MAX_ROW + 3, 0, 400, seed);
+      const auto in8 = noise<uint8_t>(MAX_ROW + 3, 0, 255, seed + 1000);
+      const auto in16 = noise<uint16_t>(MAX_ROW + 3, 0, 65535, seed + 2000);
+      std::vector<uint8_t> out8(MAX_ROW + 3, 7), ref8(MAX_ROW + 3, 7);
+      std::vector<uint16_t> out16(MAX_ROW + 3, 7), ref16(MAX_ROW + 3, 7);
+      k.subtract8(in8.data() + offset, dark.data() + offset,
+                  out8.data() + offset, n);
+      ref.subtract8(in8.data() + offset, dark.data() + offset,
+                    ref8.data() + offset, n);
+      k.subtract16(in16.data() + offset, dark.data() + offset,
+                   out16.data() + offset, n);
+      ref.subtract16(in16.data() + offset, dark.data() + offset,
+                     ref16.data() + offset, n);
+      if ((out8 != ref8) || (out16 != ref16)) {
+        fprintf(stderr, "%s: kernels differ at %zu pixels, offset %zu\n",
+                k.name, n, offset);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * Whether a master has to be there, and its hot pixels and the calibrated
+ * frame come out right, at this size. Everything goes in dir.
+ */
+static bool checkCalibration(const std::string& dir, WorkerPool* pool) {
+  const uint32_t width = 203, height = 151;
+  const size_t pixels = static_cast<size_t>(width) * height;
+  const unsigned frameCount = 9;
+  const uint16_t hotThreshold = 40;
+
+  // Hot pixels well inside, one on the edge, and a pair side by side
+  std::vector<uint32_t> hot;
+  for (uint32_t i = 0; i < 25; i++) {
+    hot.push_back((17 + i * 5) * width + 11 + i * 6);
+  }
+  hot.push_back(width * 3);
+  hot.push_back(width * 100 + 150);
+  hot.push_back(width * 100 + 151);
+  std::sort(hot.begin(), hot.end());
+
+  DarkFrameBuilder builder{width, height, pool};
+  std::vector<std::vector<uint16_t>> frames;
+  for (unsigned f = 0; f < frameCount; f++) {
+    auto frame = noise<uint16_t>(pixels, 60, 10, f + 1);
+    for (uint32_t i : hot) {
+      frame[i] += 400;
+    }
+    if (f == 4) {
+      // A cosmic ray, only in one exposure
+      for (uint32_t x = 40; x < 60; x++) {
+        frame[70 * width + x] = 3000;
+      }
+    }
+    builder.add(Plane<const uint16_t>{frame.data(), width, height});
+    frames.push_back(frame);
+  }
+
+  bool ok = true;
+  auto check = [&](bool good, const char* what) {
+    printf("  %-28s %s\n", what, good ? "ok" : "BAD");
+    ok = ok && good;
+  };
+
+  const std::string path = dir + "/iso800-60s-t3.dark";
+  const DarkKey key{800, 60000000, 3};
+  const long hotCount = builder.write(path, key, hotThreshold);
+  check(hotCount == static_cast<long>(hot.size()), "hot pixel count");
+
+  DarkFrame dark;
+  check(dark.open(path) && (dark.width() == width) &&
+        (dark.height() == height) && (dark.frames() == frameCount) &&
+        (dark.key().iso == key.iso) &&
+        (dark.key().shutterUs == key.shutterUs) &&
+        (dark.key().temperature == key.temperature), "file round trip");
+  if (!dark.isOpen()) {
+    return false;
+  }
+
+  bool median = true;
+  for (size_t i = 0; median && (i < pixels); i++) {
+    std::vector<uint16_t> values;
+    for (const auto& frame : frames) {
+      values.push_back(frame[i]);
+    }
+    std::nth_element(values.begin(), values.begin() + frameCount / 2,
+                     values.end());
+    median = dark.master().row(i / width)[i % width] ==
+      values[frameCount / 2];
+  }
+  check(median, "master is the median");
+  check(std::equal(hot.begin(), hot.end(), dark.hotPixels()) &&
+        (dark.hotPixelCount() == hot.size()), "hot pixels found");
+  check(dark.master().row(70)[50] < 100, "cosmic ray left out");
+
+  // A light frame: the dark signal plus sky, and a star
+  std::vector<uint16_t> light = noise<uint16_t>(pixels, 60, 10, 99);
+  for (size_t i = 0; i < pixels; i++) {
+    light[i] += 30;
+  }
+  for (uint32_t i : hot) {
+    light[i] += 400;
+  }
+  light[80 * width + 80] += 500;
+  std::vector<uint16_t> out(pixels);
+  check(calibrate(Plane<const uint16_t>{light.data(), width, height},
+                  Plane<uint16_t>{out.data(), width, height}, dark, pool),
+        "calibrate");
+  bool calibrated = true;
+  for (size_t i = 0; calibrated && (i < pixels); i++) {
+    const uint32_t x = i % width, y = i / width;
+    if (dark.isHot(x, y)) {
+      // Repaired from the neighbours: sky
+      calibrated = (out[i] <= 50);
+    } else {
+      const uint16_t d = dark.master().row(y)[x];
+      calibrated = out[i] == ((light[i] > d) ? light[i] - d : 0);
+    }
+  }
+  check(calibrated && (out[80 * width + 80] > 450), "calibrated frame");
+
+  std::vector<uint8_t> light8(pixels), out8(pixels);
+  for (size_t i = 0; i < pixels; i++) {
+    light8[i] = std::min<uint16_t>(light[i], 255);
+  }
+  const bool wrongSize = !calibrate(
+    Plane<const uint8_t>{light8.data(), width - 1, height},
+    Plane<uint8_t>{out8.data(), width - 1, height}, dark, pool);
+  calibrate(Plane<const uint8_t>{light8.data(), width, height},
+            Plane<uint8_t>{light8.data(), width, height}, dark, pool);
+  calibrated = true;
+  for (size_t i = 0; calibrated && (i < pixels); i++) {
+    const uint32_t x = i % width, y = i / width;
+    const uint8_t in = std::min<uint16_t>(light[i], 255);
+    const uint16_t d = dark.master().row(y)[x];
+    calibrated = dark.isHot(x, y) ? (light8[i] <= 50) :
+      (light8[i] == ((in > d) ? in - d : 0));
+  }
+  check(calibrated && wrongSize, "8-bit, in place");
+
+  // Other masters: another temperature, another ISO, and a broken file
+  builder.write(dir + "/iso800-60s-t6.dark", DarkKey{800, 60000000, 6},
+                hotThreshold);
+  builder.write(dir + "/iso400-60s-t3.dark", DarkKey{400, 60000000, 3},
+                hotThreshold);
+  FILE* broken = fopen((dir + "/broken.dark").c_str(), "wb");
+  if (broken != nullptr) {
+    fwrite("PICAMDK1", 1, 8, broken);
+    fclose(broken);
+  }
+  DarkLibrary library;
+  check(library.load(dir) == 3, "library skips broken files");
+  const DarkFrame* warm = library.find(DarkKey{800, 60000000, 5}, width,
+                                       height);
+  const DarkFrame* cold = library.find(DarkKey{800, 60000000, -2}, width,
+                                       height);
+  check((warm != nullptr) && (warm->key().temperature == 6) &&
+        (cold != nullptr) && (cold->key().temperature == 3) &&
+        (library.find(DarkKey{1600, 60000000, 3}, width, height) ==
+         nullptr) &&
+        (library.find(DarkKey{800, 30000000, 3}, width, height) ==
+         nullptr) &&
+        (library.find(DarkKey{800, 60000000, 3}, width, height + 1) ==
+         nullptr), "library picks the nearest");
+  return ok;
+}
+
+static void removeDir(const std::string& dir, const char* const* names,
+                      size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    unlink((dir + "/" + names[i]).c_str());
+  }
+  rmdir(dir.c_str());
+}
+
+int main(int argc, char* argv[]) {
+  unsigned threads = 0;
+  if (argc > 1) {
+    threads = std::max(std::atoi(argv[1]), 0);
+  }
+  WorkerPool pool{threads};
+  bool ok = true;
+
+  char dirTemplate[] = "/tmp/dark_bench.XXXXXX";
+  if (mkdtemp(dirTemplate) == nullptr) {
+    perror("mkdtemp");
+    return 1;
+  }
+  const std::string dir = dirTemplate;
+  static const char* const FILES[] = {
+    "iso800-60s-t3.dark", "iso800-60s-t6.dark", "iso400-60s-t3.dark",
+    "broken.dark", "full.dark",
+  };
+
+  const auto kernelSets = supportedDarkKernels();
+  printf("picked: %s\n", darkKernels().name);
+  for (const DarkKernels* kernels : kernelSets) {
+    if (kernels != &scalarDarkKernels()) {
+      const bool same = checkKernels(*kernels);
+      ok = ok && same;
+      printf("%-8s matches scalar: %s\n", kernels->name, same ? "ok" : "BAD");
+    }
+  }
+  printf("calibration:\n");
+  ok = checkCalibration(dir, &pool) && ok;
+
+  //
+  // Timing at full resolution
+  //
+  const uint32_t width = 3280, height = 2464;
+  const size_t pixels = static_cast<size_t>(width) * height;
+  const unsigned frameCount = 16;
+  DarkFrameBuilder builder{width, height, &pool};
+  for (unsigned f = 0; f < frameCount; f++) {
+    const auto frame = noise<uint16_t>(pixels, 60, 10, f + 1);
+    builder.add(Plane<const uint16_t>{frame.data(), width, height});
+  }
+  const std::string path = dir + "/full.dark";
+  auto start = Clock::now();
+  const long hot = builder.write(path, DarkKey{800, 60000000, 3}, 40);
+  const double buildMs = std::chrono::duration<double, std::milli>(
+    Clock::now() - start).count();
+  DarkFrame dark;
+  const double openMs = timeIt(RUNS, [&] { dark.open(path); });
+  ok = ok && (hot >= 0) && dark.isOpen();
+
+  printf("\n%ux%u, %u threads\n", width, height, pool.size());
+  printf("master of %u frames: %.1f ms, open: %.3f ms\n", frameCount,
+         buildMs, openMs);
+  const auto light16 = noise<uint16_t>(pixels, 60, 400, 7);
+  const auto light8 = noise<uint8_t>(pixels, 60, 100, 8);
+  std::vector<uint16_t> out16(pixels);
+  std::vector<uint8_t> out8(pixels);
+  printf("%-8s %8s %8s  ms per frame calibrated\n", "kernels", "16-bit",
+         "8-bit");
+  for (const DarkKernels* kernels : kernelSets) {
+    const double ms16 = timeIt(RUNS, [&] {
+      calibrate(Plane<const uint16_t>{light16.data(), width, height},
+                Plane<uint16_t>{out16.data(), width, height}, dark, &pool,
+                *kernels);
+    });
+    const double ms8 = timeIt(RUNS, [&] {
+      calibrate(Plane<const uint8_t>{light8.data(), width, height},
+                Plane<uint8_t>{out8.data(), width, height}, dark, &pool,
+                *kernels);
+    });
+    printf("%-8s %8.2f %8.2f\n", kernels->name, ms16, ms8);
+  }
+  dark.close();
+
+  removeDir(dir, FILES, sizeof(FILES) / sizeof(FILES[0]));
+  printf("%s\n", ok ? "all ok" : "FAILED");
+  return ok ? 0 : 1;
+}
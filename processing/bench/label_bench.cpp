@@ -0,0 +1,318 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Checks ComponentLabeller against a straightforward flood fill and times it
+ * on a full-resolution (3280x2464) synthetic star field: a summed-RGB
+ * luminance plane, like the processing scripts use, with a few thousand
+ * stars, some saturated blobs and a satellite streak.
+ *
+ * USAGE: label_bench [threads [threshold]]
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "connected_components.hpp"
+#include "worker_pool.hpp"
+
+#include "fixtures.hpp"
+
+static const uint32_t WIDTH = 3280;
+static const uint32_t HEIGHT = 2464;
+static const unsigned STARS = 3000;
+static const int RUNS = 7;
+
+/**
+ * R + G + B of a night sky: noise around a dark background, Gaussian stars.
+ */
+static std::vector<uint16_t> starField(uint32_t width, uint32_t height,
+                                       unsigned stars) {
+  std::vector<uint16_t> image(static_cast<size_t>(width) * height);
+  uint64_t rng = 0x853c49e6748fea9bULL;
+  for (auto& pixel : image) {
+    pixel = 3 * 14 + nextRandom(rng) % 13;
+  }
+
+  auto add = [&](double cx, double cy, double peak, double sigma) {
+    const int r = static_cast<int>(std::ceil(sigma * 3));
+    for (int y = static_cast<int>(cy) - r; y <= static_cast<int>(cy) + r; y++) {
+      for (int x = static_cast<int>(cx) - r; x <= static_cast<int>(cx) + r;
+           x++) {
+        if ((x < 0) || (y < 0) || (x >= static_cast<int>(width)) ||
+            (y >= static_cast<int>(height))) {
+          continue;
+        }
+        const double d2 = (x - cx) * (x - cx) + (y - cy) * (y - cy);
+        uint16_t& pixel = image[static_cast<size_t>(y) * width + x];
+        pixel = static_cast<uint16_t>(std::min(
+            pixel + peak * std::exp(-d2 / (2 * sigma * sigma)), 765.0));
+      }
+    }
+  };
+
+  for (unsigned i = 0; i < stars; i++) {
+    const double x = nextRandom(rng) % (width * 16) / 16.0;
+    const double y = nextRandom(rng) % (height * 16) / 16.0;
+    const double u = nextRandom(rng) % 10000 / 10000.0;
+    add(x, y, 40 + 700 * u * u * u, 0.8 + u);
+  }
+  // A few big saturated blobs (planets, the moon's glare)
+  for (int i = 0; i < 5; i++) {
+    add(nextRandom(rng) % width, nextRandom(rng) % height, 2000, 12);
+  }
+  // A satellite streak
+  for (double t = 0; t < 1; t += 0.0002) {
+    add(200 + t * 2800, 300 + t * 1900, 120, 0.7);
+  }
+  return image;
+}
+
+/**
+ * Flood fill from each unvisited pixel in raster order, with an explicit
+ * stack.
+ */
+template <typename T>
+static std::vector<Component> floodFill(const std::vector<T>& image,
+                                        uint32_t width, uint32_t height,
+                                        uint32_t threshold,
+                                        bool eightConnected,
+                                        std::vector<uint32_t>* labels) {
+  std::vector<Component> components;
+  std::vector<uint32_t> seen(image.size(), 0);
+  std::vector<uint32_t> stack;
+  for (uint32_t y0 = 0; y0 < height; y0++) {
+    for (uint32_t x0 = 0; x0 < width; x0++) {
+      const size_t start = static_cast<size_t>(y0) * width + x0;
+      if ((image[start] < threshold) || (seen[start] != 0)) {
+        continue;
+      }
+      Component c{};
+      c.minX = c.maxX = x0;
+      c.minY = c.maxY = y0;
+      c.peak = image[start];
+      c.peakX = x0;
+      c.peakY = y0;
+      double sumX = 0.0, sumY = 0.0;
+      const uint32_t label = components.size() + 1;
+      seen[start] = label;
+      stack.push_back(start);
+      while (!stack.empty()) {
+        const size_t i = stack.back();
+        stack.pop_back();
+        const uint32_t x = i % width;
+        const uint32_t y = i / width;
+        const uint32_t v = image[i];
+        c.area++;
+        c.flux += v;
+        sumX += static_cast<double>(v) * x;
+        sumY += static_cast<double>(v) * y;
+        c.minX = std::min(c.minX, x);
+        c.maxX = std::max(c.maxX, x);
+        c.minY = std::min(c.minY, y);
+        c.maxY = std::max(c.maxY, y);
+        // Ties go to the first pixel in raster order
+        if ((v > c.peak) ||
+            ((v == c.peak) && ((y < c.peakY) ||
+                               ((y == c.peakY) && (x < c.peakX))))) {
+          c.peak = v;
+          c.peakX = x;
+          c.peakY = y;
+        }
+        for (int dy = -1; dy <= 1; dy++) {
+          for (int dx = -1; dx <= 1; dx++) {
+            if (((dx == 0) && (dy == 0)) ||
+                (!eightConnected && (dx != 0) && (dy != 0))) {
+              continue;
+            }
+            const int nx = static_cast<int>(x) + dx;
+            const int ny = static_cast<int>(y) + dy;
+            if ((nx < 0) || (ny < 0) || (nx >= static_cast<int>(width)) ||
+                (ny >= static_cast<int>(height))) {
+              continue;
+            }
+            const size_t n = static_cast<size_t>(ny) * width + nx;
+            if ((image[n] >= threshold) && (seen[n] == 0)) {
+              seen[n] = label;
+              stack.push_back(n);
+            }
+          }
+        }
+      }
+      c.x = sumX / c.flux;
+      c.y = sumY / c.flux;
+      components.push_back(c);
+    }
+  }
+  if (labels != nullptr) {
+    *labels = std::move(seen);
+  }
+  return components;
+}
+
+static bool sameComponents(const std::vector<Component>& a,
+                           const std::vector<Component>& b) {
+  if (a.size() != b.size()) {
+    fprintf(stderr, "%zu components, expected %zu\n", a.size(), b.size());
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); i++) {
+    const Component& p = a[i];
+    const Component& q = b[i];
+    if ((p.area != q.area) || (p.minX != q.minX) || (p.minY != q.minY) ||
+        (p.maxX != q.maxX) || (p.maxY != q.maxY) || (p.flux != q.flux) ||
+        (p.peak != q.peak) || (p.peakX != q.peakX) || (p.peakY != q.peakY) ||
+        (std::fabs(p.x - q.x) > 1e-6) || (std::fabs(p.y - q.y) > 1e-6)) {
+      fprintf(stderr, "component %zu differs: area %u/%u at (%u,%u)/(%u,%u)\n",
+              i, p.area, q.area, p.minX, p.minY, q.minX, q.minY);
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Median time to label image, in ms.
+ */
+template <typename T>
+static double timeLabel(ComponentLabeller& labeller, Plane<const T> image,
+                        std::vector<Component>& components) {
+  return timeIt(RUNS, [&] { labeller.label(image, components); });
+}
+
+int main(int argc, char* argv[]) {
+  unsigned threads = 0;
+  uint32_t threshold = 100;
+  if (argc > 1) {
+    threads = std::max(std::atoi(argv[1]), 0);
+  }
+  if (argc > 2) {
+    threshold = std::max(std::atoi(argv[2]), 0);
+  }
+
+  const auto image = starField(WIDTH, HEIGHT, STARS);
+  const Plane<const uint16_t> plane{image.data(), WIDTH, HEIGHT};
+  std::vector<uint8_t> image8(image.size());
+  for (size_t i = 0; i < image.size(); i++) {
+    image8[i] = static_cast<uint8_t>(image[i] / 3);
+  }
+  const Plane<const uint8_t> plane8{image8.data(), WIDTH, HEIGHT};
+
+  WorkerPool pool{threads};
+  bool ok = true;
+
+  //
+  // Against the flood fill
+  //
+  struct Check {
+    const char* name;
+    bool eightConnected;
+    bool gray8;
+    WorkerPool* pool;
+  };
+  const Check checks[] = {
+    {"16-bit, 8-connected", true, false, nullptr},
+    {"16-bit, 4-connected", false, false, nullptr},
+    {"8-bit, 8-connected", true, true, nullptr},
+    {"16-bit, 8-connected, pool", true, false, &pool},
+    {"8-bit, 4-connected, pool", false, true, &pool},
+  };
+  for (const auto& check : checks) {
+    ComponentLabeller::Config config{};
+    config.threshold = check.gray8 ? threshold / 3 : threshold;
+    config.eightConnected = check.eightConnected;
+    ComponentLabeller labeller{config, check.pool};
+
+    std::vector<Component> components;
+    std::vector<uint32_t> labels(image.size());
+    const Plane<uint32_t> labelPlane{labels.data(), WIDTH, HEIGHT};
+    std::vector<uint32_t> expectedLabels;
+    std::vector<Component> expected;
+    if (check.gray8) {
+      labeller.label(plane8, components, &labelPlane);
+      expected = floodFill(image8, WIDTH, HEIGHT, config.threshold,
+                           config.eightConnected, &expectedLabels);
+    } else {
+      labeller.label(plane, components, &labelPlane);
+      expected = floodFill(image, WIDTH, HEIGHT, config.threshold,
+                           config.eightConnected, &expectedLabels);
+    }
+    const bool same = sameComponents(components, expected) &&
+      (labels == expectedLabels);
+    ok = ok && same;
+    printf("%-28s %6zu components, %7zu runs: %s\n", check.name,
+           components.size(), labeller.runs(), same ? "ok" : "BAD");
+  }
+
+  {
+    // minArea drops components and renumbers the labels
+    ComponentLabeller::Config config{};
+    config.threshold = threshold;
+    config.minArea = 5;
+    ComponentLabeller labeller{config, &pool};
+    std::vector<Component> components;
+    std::vector<uint32_t> labels(image.size());
+    const Plane<uint32_t> labelPlane{labels.data(), WIDTH, HEIGHT};
+    labeller.label(plane, components, &labelPlane);
+
+    std::vector<uint32_t> expectedLabels;
+    auto all = floodFill(image, WIDTH, HEIGHT, threshold, true,
+                         &expectedLabels);
+    std::vector<Component> expected;
+    std::vector<uint32_t> remap(all.size() + 1, 0);
+    for (size_t i = 0; i < all.size(); i++) {
+      if (all[i].area >= config.minArea) {
+        expected.push_back(all[i]);
+        remap[i + 1] = expected.size();
+      }
+    }
+    for (auto& label : expectedLabels) {
+      label = remap[label];
+    }
+    const bool same = sameComponents(components, expected) &&
+      (labels == expectedLabels);
+    ok = ok && same;
+    printf("%-28s %6zu components: %s\n", "minimum area 5",
+           components.size(), same ? "ok" : "BAD");
+  }
+
+  //
+  // Timing
+  //
+  ComponentLabeller::Config config{};
+  config.threshold = threshold;
+  ComponentLabeller serial{config};
+  ComponentLabeller parallel{config, &pool};
+  std::vector<Component> components;
+  const double serialMs = timeLabel(serial, plane, components);
+  const double parallelMs = timeLabel(parallel, plane, components);
+  const size_t found = components.size();
+  config.threshold = threshold / 3;
+  ComponentLabeller serial8{config};
+  const double serial8Ms = timeLabel(serial8, plane8, components);
+
+  printf("%ux%u, threshold %u: %zu components\n", WIDTH, HEIGHT, threshold,
+         found);
+  printf("1 thread: %.1f ms (16-bit), %.1f ms (8-bit); %u threads: %.1f ms\n",
+         serialMs, serial8Ms, pool.size(), parallelMs);
+
+  return ok ? 0 : 1;
+}
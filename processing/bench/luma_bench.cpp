@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks every kernel set this CPU supports against the scalar reference,
+ * over odd lengths, unaligned buffers and edge thresholds, then times each
+ * on a full-resolution (3280x2464) frame.
+ *
+ * USAGE: luma_bench
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include "luma_kernels.hpp"
+
+#include "fixtures.hpp"
+
+static const size_t FRAME_PIXELS = 3280 * 2464;
+static const size_t MAX_CHECK_PIXELS = 300;
+static const int RUNS = 7;
+
+template <typename T>
+static std::vector<T> randomData(size_t count, uint64_t seed, T max) {
+  std::vector<T> data(count);
+  uint64_t rng = seed;
+  for (auto& value : data) {
+    value = nextRandom(rng) % (static_cast<uint64_t>(max) + 1);
+  }
+  return data;
+}
+
+/**
+ * Run sum on every length up to MAX_CHECK_PIXELS at every alignment, and
+ * compare with the reference. The output is poisoned first so unwritten
+ * pixels show up.
+ */
+static bool checkSum(const char* name,
+                     void (*sum)(const uint8_t*, uint16_t*, size_t),
+                     void (*reference)(const uint8_t*, uint16_t*, size_t),
+                     size_t channels, const std::vector<uint8_t>& input) {
+  std::vector<uint16_t> out(MAX_CHECK_PIXELS + 8);
+  std::vector<uint16_t> expected(MAX_CHECK_PIXELS + 8);
+  for (size_t offset = 0; offset < 4; offset++) {
+    for (size_t pixels = 0; pixels <= MAX_CHECK_PIXELS; pixels++) {
+      // Copy to a buffer of exactly the right size so overreads are caught
+      // by sanitizers
+      std::vector<uint8_t> in(input.begin() + offset,
+                              input.begin() + offset + pixels * channels);
+      std::fill(out.begin(), out.end(), 0xBEEF);
+      std::fill(expected.begin(), expected.end(), 0xBEEF);
+      sum(in.data(), out.data() + offset, pixels);
+      reference(in.data(), expected.data() + offset, pixels);
+      if (out != expected) {
+        fprintf(stderr, "%s: differs at %zu pixels, offset %zu\n", name,
+                pixels, offset);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+template <typename T>
+static bool checkMask(const char* name,
+                      size_t (*mask)(const T*, uint64_t*, size_t, T),
+                      size_t (*reference)(const T*, uint64_t*, size_t, T),
+                      const std::vector<T>& input,
+                      const std::vector<T>& thresholds) {
+  std::vector<uint64_t> out(maskWords(MAX_CHECK_PIXELS));
+  std::vector<uint64_t> expected(out.size());
+  for (T threshold : thresholds) {
+    for (size_t offset = 0; offset < 4; offset++) {
+      for (size_t pixels = 0; pixels <= MAX_CHECK_PIXELS; pixels++) {
+        const T* in = input.data() + offset;
+        std::fill(out.begin(), out.end(), 0x5555555555555555ULL);
+        std::fill(expected.begin(), expected.end(), 0x5555555555555555ULL);
+        const size_t count = mask(in, out.data(), pixels, threshold);
+        const size_t expectedCount = reference(in, expected.data(), pixels,
+                                               threshold);
+        if ((count != expectedCount) || (out != expected)) {
+          fprintf(stderr, "%s: differs at %zu pixels, offset %zu, "
+                  "threshold %u (count %zu, expected %zu)\n", name, pixels,
+                  offset, threshold, count, expectedCount);
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+int main() {
+  const LumaKernels& reference = scalarLumaKernels();
+  const auto kernelSets = supportedLumaKernels();
+  printf("picked: %s\n", lumaKernels().name);
+
+  //
+  // Against the scalar kernels
+  //
+  const auto bytes = randomData<uint8_t>(4 * MAX_CHECK_PIXELS + 4, 1, 255);
+  const auto words = randomData<uint16_t>(MAX_CHECK_PIXELS + 4, 2, 765);
+  const std::vector<uint8_t> thresholds8{0, 1, 50, 128, 254, 255};
+  const std::vector<uint16_t> thresholds16{0, 1, 150, 384, 765, 766, 65535};
+  bool ok = true;
+  for (const LumaKernels* kernels : kernelSets) {
+    if (kernels == &reference) {
+      continue;
+    }
+    const bool same =
+      checkSum("rgbaLumaSum", kernels->rgbaLumaSum, reference.rgbaLumaSum, 4,
+               bytes) &&
+      checkSum("rgbLumaSum", kernels->rgbLumaSum, reference.rgbLumaSum, 3,
+               bytes) &&
+      checkMask("thresholdMask8", kernels->thresholdMask8,
+                reference.thresholdMask8, bytes, thresholds8) &&
+      checkMask("thresholdMask16", kernels->thresholdMask16,
+                reference.thresholdMask16, words, thresholds16);
+    ok = ok && same;
+    printf("%-8s matches scalar: %s\n", kernels->name, same ? "ok" : "BAD");
+  }
+
+  //
+  // Timing, on a frame with stars' worth of bright pixels
+  //
+  const auto rgba = randomData<uint8_t>(4 * FRAME_PIXELS, 3, 255);
+  const auto gray = randomData<uint8_t>(FRAME_PIXELS, 4, 60);
+  std::vector<uint16_t> luma(FRAME_PIXELS);
+  std::vector<uint64_t> mask(maskWords(FRAME_PIXELS));
+  printf("%-8s %10s %10s %10s %10s  (ms per frame)\n", "kernels", "rgba",
+         "rgb", "mask8", "mask16");
+  for (const LumaKernels* kernels : kernelSets) {
+    const double rgbaMs = timeIt(RUNS, [&] {
+      kernels->rgbaLumaSum(rgba.data(), luma.data(), FRAME_PIXELS);
+    });
+    const double rgbMs = timeIt(RUNS, [&] {
+      kernels->rgbLumaSum(rgba.data(), luma.data(), FRAME_PIXELS);
+    });
+    const double mask8Ms = timeIt(RUNS, [&] {
+      kernels->thresholdMask8(gray.data(), mask.data(), FRAME_PIXELS, 58);
+    });
+    const double mask16Ms = timeIt(RUNS, [&] {
+      kernels->thresholdMask16(luma.data(), mask.data(), FRAME_PIXELS, 700);
+    });
+    printf("%-8s %10.2f %10.2f %10.2f %10.2f\n", kernels->name, rgbaMs,
+           rgbMs, mask8Ms, mask16Ms);
+  }
+
+  printf("%s\n", ok ? "all ok" : "FAILED");
+  return ok ? 0 : 1;
+}
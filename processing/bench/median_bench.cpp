@@ -0,0 +1,303 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the median filter: the selection networks exhaustively (by the 0-1
+ * principle, a comparator network picks the median of any input iff it does
+ * for every input of 0s and 1s), then every kernel set this CPU supports
+ * against a naive filter built on std::nth_element, and their medians across
+ * frames likewise. Then times both at each SensorMode resolution.
+ *
+ * USAGE: median_bench [threads]
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "median_filter.hpp"
+#include "median_network.hpp"
+#include "sensor_mode.hpp"
+
+#include "fixtures.hpp"
+
+static const int RUNS = 5;
+
+/**
+ * 64 0-1 inputs at once, one per bit: min is AND and max is OR.
+ */
+struct BitOps {
+  using Vector = uint64_t;
+  static Vector min(Vector a, Vector b) {
+    return a & b;
+  }
+  static Vector max(Vector a, Vector b) {
+    return a | b;
+  }
+};
+
+template <unsigned SIZE>
+static bool checkNetwork() {
+  const unsigned n = SIZE * SIZE;
+  // Input i of every block of 64 inputs is the bits of its index; wires
+  // 0-5 come from the position within the block, the rest from the block
+  static const uint64_t LOW_WIRES[6] = {
+    0xAAAAAAAAAAAAAAAAULL, 0xCCCCCCCCCCCCCCCCULL, 0xF0F0F0F0F0F0F0F0ULL,
+    0xFF00FF00FF00FF00ULL, 0xFFFF0000FFFF0000ULL, 0xFFFFFFFF00000000ULL,
+  };
+  for (uint64_t block = 0; block < (1ULL << (n - 6)); block++) {
+    uint64_t v[n];
+    for (unsigned w = 0; w < n; w++) {
+      v[w] = (w < 6) ? LOW_WIRES[w] : (((block >> (w - 6)) & 1) ? ~0ULL : 0);
+    }
+    const uint64_t got = median<BitOps, SIZE>(v);
+    for (unsigned bit = 0; bit < 64; bit++) {
+      const uint64_t input = (block << 6) | bit;
+      const bool expected = __builtin_popcountll(input) > static_cast<int>(n / 2);
+      if (((got >> bit) & 1) != expected) {
+        fprintf(stderr, "%ux%u network wrong for input %llx\n", SIZE, SIZE,
+                static_cast<unsigned long long>(input));
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+template <typename T>
+static void naiveMedian(Plane<const T> in, Plane<T> out, unsigned size) {
+  const int half = size / 2;
+  std::vector<T> window(size * size);
+  for (uint32_t y = 0; y < in.height; y++) {
+    for (uint32_t x = 0; x < in.width; x++) {
+      size_t i = 0;
+      for (int dy = -half; dy <= half; dy++) {
+        for (int dx = -half; dx <= half; dx++) {
+          const int wx = static_cast<int>(x) + dx;
+          const int wy = static_cast<int>(y) + dy;
+          const bool inside = (wx >= 0) && (wy >= 0) &&
+            (wx < static_cast<int>(in.width)) &&
+            (wy < static_cast<int>(in.height));
+          window[i++] = inside ? in.row(wy)[wx] : 0;
+        }
+      }
+      std::nth_element(window.begin(), window.begin() + window.size() / 2,
+                       window.end());
+      out.row(y)[x] = window[window.size() / 2];
+    }
+  }
+}
+
+/**
+ * A dark frame: background noise with a sprinkling of hot pixels, and
+ * max-valued ones to catch overflow.
+ */
+template <typename T>
+static std::vector<T> noisyFrame(size_t stride, uint32_t height, T max,
+                                 uint64_t seed) {
+  std::vector<T> image(stride * height);
+  uint64_t rng = seed;
+  for (auto& pixel : image) {
+    const uint64_t r = nextRandom(rng);
+    if (r % 1000 == 0) {
+      pixel = max;
+    } else if (r % 100 == 1) {
+      pixel = max / 2 + (r >> 32) % (max / 2);
+    } else {
+      pixel = max / 20 + (r >> 32) % (max / 16);
+    }
+  }
+  return image;
+}
+
+template <typename T>
+static bool checkFilter(const MedianKernels& kernels, uint32_t width,
+                        uint32_t height, size_t stride, unsigned size,
+                        WorkerPool* pool, T max) {
+  const auto image = noisyFrame<T>(stride, height, max, width * 31 + height);
+  const Plane<const T> in{image.data(), width, height, stride};
+  std::vector<T> result(image.size(), 0);
+  std::vector<T> expected(image.size(), 0);
+  if (!medianFilter(in, Plane<T>{result.data(), width, height, stride}, size,
+                    pool, kernels)) {
+    fprintf(stderr, "%s: medianFilter failed\n", kernels.name);
+    return false;
+  }
+  naiveMedian(in, Plane<T>{expected.data(), width, height, stride}, size);
+  if (result != expected) {
+    fprintf(stderr, "%s: %ux%u median of %ux%u (%zu-bit) differs\n",
+            kernels.name, size, size, width, height, 8 * sizeof(T));
+    return false;
+  }
+  return true;
+}
+
+/**
+ * medianAcross16 against std::nth_element, for every number of rows and
+ * counts either side of a vector.
+ */
+static bool checkAcross(const MedianKernels& kernels) {
+  const size_t maxCount = 70;
+  uint64_t rng = 1;
+  std::vector<std::vector<uint16_t>> frames(MAX_MEDIAN_ROWS);
+  for (auto& frame : frames) {
+    frame.resize(maxCount);
+    for (auto& pixel : frame) {
+      // Few distinct values, so there are ties
+      pixel = (nextRandom(rng) >> 32) % 50 * 1300;
+    }
+  }
+  const uint16_t* rows[MAX_MEDIAN_ROWS];
+  for (unsigned n = 1; n <= MAX_MEDIAN_ROWS; n++) {
+    for (size_t count = 0; count <= maxCount; count++) {
+      for (unsigned r = 0; r < n; r++) {
+        rows[r] = frames[r].data();
+      }
+      std::vector<uint16_t> out(maxCount + 1, 0xABCD);
+      kernels.medianAcross16(rows, n, out.data(), count);
+      for (size_t i = 0; i <= maxCount; i++) {
+        uint16_t expected = 0xABCD;
+        if (i < count) {
+          std::vector<uint16_t> values;
+          for (unsigned r = 0; r < n; r++) {
+            values.push_back(frames[r][i]);
+          }
+          std::nth_element(values.begin(), values.begin() + n / 2,
+                           values.end());
+          expected = values[n / 2];
+        }
+        if (out[i] != expected) {
+          fprintf(stderr, "%s: median across %u rows of %zu differs at %zu\n",
+                  kernels.name, n, count, i);
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  unsigned threads = 0;
+  if (argc > 1) {
+    threads = std::max(std::atoi(argv[1]), 0);
+  }
+  WorkerPool pool{threads};
+  bool ok = true;
+
+  //
+  // The networks
+  //
+  const bool net3 = checkNetwork<3>();
+  const bool net5 = checkNetwork<5>();
+  ok = ok && net3 && net5;
+  printf("3x3 network: %2zu steps, %s\n", MedianNetwork<3>::STEPS.size,
+         net3 ? "ok" : "BAD");
+  printf("5x5 network: %2zu steps, %s\n", MedianNetwork<5>::STEPS.size,
+         net5 ? "ok" : "BAD");
+
+  //
+  // Against the naive filter: shapes smaller than the window, tails shorter
+  // than a vector, padded strides, tile boundaries, and a whole frame
+  //
+  struct Shape {
+    uint32_t width;
+    uint32_t height;
+    size_t stride;
+  };
+  const Shape shapes[] = {
+    {1, 1, 1}, {2, 3, 2}, {4, 5, 7}, {7, 9, 7}, {37, 23, 40}, {130, 11, 130},
+    {1030, 6, 1056}, {2100, 4, 2100},
+  };
+  const auto kernelSets = supportedMedianKernels();
+  for (const MedianKernels* kernels : kernelSets) {
+    bool same = true;
+    for (unsigned size : {3u, 5u}) {
+      for (const auto& shape : shapes) {
+        for (WorkerPool* p : {static_cast<WorkerPool*>(nullptr), &pool}) {
+          same = same &&
+            checkFilter<uint8_t>(*kernels, shape.width, shape.height,
+                                 shape.stride, size, p, 255) &&
+            checkFilter<uint16_t>(*kernels, shape.width, shape.height,
+                                  shape.stride, size, p, 765);
+        }
+      }
+    }
+    ok = ok && same;
+    printf("%-8s matches naive: %s\n", kernels->name, same ? "ok" : "BAD");
+    const bool across = checkAcross(*kernels);
+    ok = ok && across;
+    printf("%-8s median across rows: %s\n", kernels->name,
+           across ? "ok" : "BAD");
+  }
+  {
+    const bool same =
+      checkFilter<uint16_t>(medianKernels(), 1640, 1232, 1664, 3, &pool,
+                            65535) &&
+      checkFilter<uint16_t>(medianKernels(), 1640, 1232, 1664, 5, &pool,
+                            765);
+    ok = ok && same;
+    printf("%-8s 1640x1232 frame: %s\n", medianKernels().name,
+           same ? "ok" : "BAD");
+  }
+
+  //
+  // Timing, at each sensor mode
+  //
+  printf("\n%u threads, ms per frame\n", pool.size());
+  printf("%-10s %4s %10s", "mode", "size", "naive-16");
+  for (const MedianKernels* kernels : kernelSets) {
+    printf(" %6s-16", kernels->name);
+  }
+  printf(" %7s-8\n", medianKernels().name);
+  for (int mode = SM_INVALID + 1; mode < NUM_SENSOR_MODES; mode++) {
+    const uint32_t width = SENSOR_MODE_WIDTH[mode];
+    const uint32_t height = SENSOR_MODE_HEIGHT[mode];
+    if ((mode > 1) && (width == SENSOR_MODE_WIDTH[mode - 1]) &&
+        (height == SENSOR_MODE_HEIGHT[mode - 1])) {
+      continue;
+    }
+    const auto image16 = noisyFrame<uint16_t>(width, height, 765, mode);
+    const auto image8 = noisyFrame<uint8_t>(width, height, 255, mode);
+    std::vector<uint16_t> out16(image16.size());
+    std::vector<uint8_t> out8(image8.size());
+    const Plane<const uint16_t> in16{image16.data(), width, height};
+    const Plane<const uint8_t> in8{image8.data(), width, height};
+    const Plane<uint16_t> outPlane16{out16.data(), width, height};
+    const Plane<uint8_t> outPlane8{out8.data(), width, height};
+
+    for (unsigned size : {3u, 5u}) {
+      char name[32];
+      snprintf(name, sizeof(name), "%ux%u", width, height);
+      printf("%-10s %4u %10.1f", name, size, timeIt(1, [&] {
+        naiveMedian(in16, outPlane16, size);
+      }));
+      for (const MedianKernels* kernels : kernelSets) {
+        printf(" %9.2f", timeIt(RUNS, [&] {
+          medianFilter(in16, outPlane16, size, &pool, *kernels);
+        }));
+      }
+      printf(" %9.2f\n", timeIt(RUNS, [&] {
+        medianFilter(in8, outPlane8, size, &pool);
+      }));
+    }
+  }
+
+  printf("%s\n", ok ? "all ok" : "FAILED");
+  return ok ? 0 : 1;
+}
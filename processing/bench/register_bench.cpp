@@ -0,0 +1,231 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the FFT against a direct DFT, then that Registrar recovers a known
+ * shift and rotation between two synthetic star fields and that warping the
+ * second back lines it up with the first. Times each step at full
+ * resolution.
+ *
+ * USAGE: register_bench [threads]
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "registration.hpp"
+
+#include "fixtures.hpp"
+
+static const int RUNS = 5;
+
+static bool checkFft(uint32_t size, WorkerPool* pool) {
+  using Complex = Fft2d::Complex;
+  Fft2d fft{size, pool};
+  std::vector<Complex> data(static_cast<size_t>(size) * size);
+  uint64_t rng = size;
+  for (auto& v : data) {
+    v = Complex(static_cast<float>(nextRandom(rng) % 2001) / 1000.0f - 1.0f,
+                static_cast<float>(nextRandom(rng) % 2001) / 1000.0f - 1.0f);
+  }
+  const auto original = data;
+  fft.forward(data.data());
+
+  // A few bins against the DFT, summed in double
+  double worst = 0.0;
+  for (uint32_t probe = 0; probe < 8; probe++) {
+    const uint32_t u = (probe * 7 + 1) % size;
+    const uint32_t v = (probe * 3 + 2) % size;
+    std::complex<double> sum{};
+    for (uint32_t y = 0; y < size; y++) {
+      for (uint32_t x = 0; x < size; x++) {
+        const double angle = -2.0 * M_PI *
+          (static_cast<double>(u) * x + static_cast<double>(v) * y) / size;
+        sum += std::complex<double>(original[y * size + x]) *
+          std::polar(1.0, angle);
+      }
+    }
+    worst = std::max(worst, std::abs(sum -
+      std::complex<double>(data[v * size + u])) / size);
+  }
+
+  fft.inverse(data.data());
+  double roundTrip = 0.0;
+  for (size_t i = 0; i < data.size(); i++) {
+    roundTrip = std::max<double>(roundTrip, std::abs(data[i] - original[i]));
+  }
+  const bool ok = (worst < 1e-4) && (roundTrip < 1e-4);
+  printf("fft %4u: dft error %.2g, round trip %.2g, %s\n", size, worst,
+         roundTrip, ok ? "ok" : "BAD");
+  return ok;
+}
+
+struct Star {
+  double x;
+  double y;
+  float peak;
+};
+
+static std::vector<Star> starField(uint32_t width, uint32_t height,
+                                   size_t count) {
+  std::vector<Star> stars;
+  uint64_t rng = 12345;
+  for (size_t i = 0; i < count; i++) {
+    const float u = static_cast<float>(nextRandom(rng) % 10000) / 10000.0f;
+    stars.push_back(Star{
+      static_cast<double>(nextRandom(rng) % (width * 16)) / 16.0,
+      static_cast<double>(nextRandom(rng) % (height * 16)) / 16.0,
+      40.0f + 215.0f * u * u});
+  }
+  return stars;
+}
+
+/**
+ * Noisy background with the stars drawn as Gaussians where transform puts
+ * them.
+ */
+static std::vector<uint8_t> render(uint32_t width, uint32_t height,
+                                   const std::vector<Star>& stars,
+                                   const RigidTransform& transform,
+                                   uint64_t seed) {
+  std::vector<uint8_t> frame(static_cast<size_t>(width) * height);
+  std::vector<float> light(frame.size(), 0.0f);
+  for (const auto& star : stars) {
+    double sx, sy;
+    transform.apply(star.x, star.y, sx, sy);
+    const int cx = static_cast<int>(std::lround(sx));
+    const int cy = static_cast<int>(std::lround(sy));
+    for (int y = cy - 3; y <= cy + 3; y++) {
+      for (int x = cx - 3; x <= cx + 3; x++) {
+        if ((x < 0) || (y < 0) || (x >= static_cast<int>(width)) ||
+            (y >= static_cast<int>(height))) {
+          continue;
+        }
+        const double rx = x - sx, ry = y - sy;
+        light[static_cast<size_t>(y) * width + x] +=
+          star.peak * std::exp(-(rx * rx + ry * ry) / (2.0 * 1.2 * 1.2));
+      }
+    }
+  }
+  uint64_t rng = seed;
+  for (size_t i = 0; i < frame.size(); i++) {
+    const float value = 16.0f + (nextRandom(rng) >> 32) % 9 + light[i];
+    frame[i] = static_cast<uint8_t>(std::min(value, 255.0f));
+  }
+  return frame;
+}
+
+static bool checkRegistration(uint32_t width, uint32_t height,
+                              const RigidTransform& truth, double tolerance,
+                              WorkerPool* pool, bool timed) {
+  const auto stars = starField(width, height, width * height / 5000);
+  const auto reference = render(width, height, stars, RigidTransform{}, 1);
+  const auto shifted = render(width, height, stars, truth, 2);
+  const Plane<const uint8_t> referencePlane{reference.data(), width, height,
+                                            width};
+  const Plane<const uint8_t> shiftedPlane{shifted.data(), width, height,
+                                          width};
+
+  Registrar registrar{Registrar::Config{}, pool};
+  registrar.setReference(referencePlane);
+  Registrar::Result result = registrar.align(shiftedPlane);
+
+  // Worst disagreement with the true transform over the frame, which at
+  // the corners includes any error in the rotation
+  double error = 0.0;
+  for (double y : {0.0, height / 2.0, height - 1.0}) {
+    for (double x : {0.0, width / 2.0, width - 1.0}) {
+      double gx, gy, tx, ty;
+      result.transform.apply(x, y, gx, gy);
+      truth.apply(x, y, tx, ty);
+      error = std::max(error, std::hypot(gx - tx, gy - ty));
+    }
+  }
+  bool ok = result.ok && (error < tolerance);
+
+  // Warped back, the frames should differ by little more than their noise
+  std::vector<uint8_t> warped(reference.size());
+  const Plane<uint8_t> warpedPlane{warped.data(), width, height, width};
+  ok = warpBilinear(shiftedPlane, warpedPlane, result.transform, pool) && ok;
+  double difference = 0.0;
+  size_t compared = 0;
+  const uint32_t margin = 32;
+  for (uint32_t y = margin; y < height - margin; y++) {
+    for (uint32_t x = margin; x < width - margin; x++) {
+      const size_t i = static_cast<size_t>(y) * width + x;
+      difference += std::abs(warped[i] - reference[i]);
+      compared++;
+    }
+  }
+  difference /= compared;
+  ok = ok && (difference < 4.0);
+
+  printf("%4ux%-4u: coarse (%.2f, %.2f), peak %.2f, %zu/%zu stars matched, "
+         "rms %.3f\n", width, height, result.coarseDx, result.coarseDy,
+         result.peak, result.matched, result.stars, result.rms);
+  printf("           error %.4f px, warped difference %.2f, %s\n", error,
+         difference,
+         ok ? "ok" : "BAD");
+
+  if (timed) {
+    const double setMs = timeIt(RUNS, [&] {
+      registrar.setReference(referencePlane);
+    });
+    const double alignMs = timeIt(RUNS, [&] {
+      result = registrar.align(shiftedPlane);
+    });
+    const double warpMs = timeIt(RUNS, [&] {
+      warpBilinear(shiftedPlane, warpedPlane, result.transform, pool);
+    });
+    printf("           setReference %.1f ms, align %.1f ms, warp %.1f ms\n",
+           setMs, alignMs, warpMs);
+  }
+  return ok;
+}
+
+int main(int argc, char* argv[]) {
+  unsigned threads = 0;
+  if (argc > 1) {
+    threads = std::max(std::atoi(argv[1]), 0);
+  }
+  WorkerPool pool{threads};
+  bool ok = true;
+
+  ok = checkFft(8, &pool) && ok;
+  ok = checkFft(64, &pool) && ok;
+  ok = checkFft(512, &pool) && ok;
+  {
+    Fft2d fft{512, &pool};
+    std::vector<Fft2d::Complex> data(512 * 512, Fft2d::Complex{1.0f, 0.0f});
+    printf("fft  512: forward %.1f ms\n", timeIt(RUNS, [&] {
+      fft.forward(data.data());
+    }));
+  }
+
+  // Few stars in a small frame, so the rotation is less certain
+  ok = checkRegistration(640, 480, RigidTransform{3.25, -1.5, 0.0}, 0.25,
+                         &pool, false) && ok;
+  ok = checkRegistration(1640, 1232, RigidTransform{13.37, -7.21, 0.002},
+                         0.05, &pool, false) && ok;
+  ok = checkRegistration(3280, 2464, RigidTransform{-41.6, 22.9, -0.001},
+                         0.05, &pool, true) && ok;
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the stacking kernels this CPU supports against the scalar ones and
+ * Stacker against straightforward per-pixel loops (including that sigma
+ * clipping removes a satellite streak), then times adding frames in each
+ * mode at full resolution.
+ *
+ * USAGE: stack_bench [threads]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "stacker.hpp"
+
+#include "fixtures.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+static const int RUNS = 7;
+static const size_t MAX_ROW = 100;
+
+/**
+ * Noise around a background level, with the odd outlier.
+ */
+template <typename T>
+static std::vector<T> noisyFrame(size_t pixels, T background, T noise,
+                                 T max, uint64_t seed) {
+  std::vector<T> frame(pixels);
+  uint64_t rng = seed;
+  for (auto& pixel : frame) {
+    const uint64_t r = nextRandom(rng);
+    pixel = (r % 200 == 0) ? max : background + (r >> 32) % (noise + 1);
+  }
+  return frame;
+}
+
+static bool close(float a, float b) {
+  return std::fabs(a - b) <= 1e-5f * std::max(1.0f, std::fabs(b));
+}
+
+template <typename T>
+static bool checkKernels(const StackKernels& k, T max) {
+  const StackKernels& ref = scalarStackKernels();
+  const bool wide = sizeof(T) == 2;
+  auto add = wide ? reinterpret_cast<void (*)(const T*, uint32_t*, size_t)>(k.add16)
+    : reinterpret_cast<void (*)(const T*, uint32_t*, size_t)>(k.add8);
+  auto refAdd = wide ? reinterpret_cast<void (*)(const T*, uint32_t*, size_t)>(ref.add16)
+    : reinterpret_cast<void (*)(const T*, uint32_t*, size_t)>(ref.add8);
+  auto peak = wide ? reinterpret_cast<void (*)(const T*, uint32_t*, size_t)>(k.max16)
+    : reinterpret_cast<void (*)(const T*, uint32_t*, size_t)>(k.max8);
+  auto refPeak = wide ? reinterpret_cast<void (*)(const T*, uint32_t*, size_t)>(ref.max16)
+    : reinterpret_cast<void (*)(const T*, uint32_t*, size_t)>(ref.max8);
+  using Clip = void (*)(const T*, float*, float*, float*, size_t,
+                        const StackClip&);
+  auto clip = wide ? reinterpret_cast<Clip>(k.clip16)
+    : reinterpret_cast<Clip>(k.clip8);
+  auto refClip = wide ? reinterpret_cast<Clip>(ref.clip16)
+    : reinterpret_cast<Clip>(ref.clip8);
+
+  StackClip params{};
+  for (size_t n = 0; n <= MAX_ROW; n++) {
+    for (size_t offset = 0; offset < 3; offset++) {
+      std::vector<uint32_t> sum(MAX_ROW + 3, 7), refSum(MAX_ROW + 3, 7);
+      std::vector<uint32_t> top(MAX_ROW + 3, 0), refTop(MAX_ROW + 3, 0);
+      std::vector<float> mean(MAX_ROW + 3, 0), m2(MAX_ROW + 3, 0),
+        count(MAX_ROW + 3, 0);
+      auto refMean = mean, refM2 = m2, refCount = count;
+      for (int frame = 0; frame < 12; frame++) {
+        const auto in = noisyFrame<T>(MAX_ROW + 3, max / 10, max / 20, max,
+                                      n * 100 + offset * 10 + frame);
+        add(in.data() + offset, sum.data() + offset, n);
+        refAdd(in.data() + offset, refSum.data() + offset, n);
+        peak(in.data() + offset, top.data() + offset, n);
+        refPeak(in.data() + offset, refTop.data() + offset, n);
+        clip(in.data() + offset, mean.data() + offset, m2.data() + offset,
+             count.data() + offset, n, params);
+        refClip(in.data() + offset, refMean.data() + offset,
+                refM2.data() + offset, refCount.data() + offset, n, params);
+      }
+      bool same = (sum == refSum) && (top == refTop) && (count == refCount);
+      for (size_t i = 0; same && (i < mean.size()); i++) {
+        same = close(mean[i], refMean[i]) && close(m2[i], refM2[i]);
+      }
+
+      std::vector<float> out(MAX_ROW + 3, -1), refOut(MAX_ROW + 3, -1);
+      k.toFloat(sum.data() + offset, out.data() + offset, n, 0.25f);
+      ref.toFloat(refSum.data() + offset, refOut.data() + offset, n, 0.25f);
+      same = same && (out == refOut) && (sum == refSum);
+      if (!same) {
+        fprintf(stderr, "%s: %zu-bit kernels differ at %zu pixels, "
+                "offset %zu\n", k.name, 8 * sizeof(T), n, offset);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * Stack 20 noisy 16-bit frames with a satellite crossing frame 7 and check
+ * every mode against per-pixel loops.
+ */
+static bool checkStacker(WorkerPool* pool, const StackKernels& kernels) {
+  const uint32_t width = 321, height = 203;
+  const size_t pixels = static_cast<size_t>(width) * height;
+  const unsigned frameCount = 20;
+  std::vector<std::vector<uint16_t>> frames;
+  for (unsigned f = 0; f < frameCount; f++) {
+    auto frame = noisyFrame<uint16_t>(pixels, 60, 12, 60, f + 1);
+    if (f == 7) {
+      for (uint32_t x = 0; x < width; x++) {
+        frame[(x * height / width) * width + x] = 700;
+      }
+    }
+    frames.push_back(frame);
+  }
+
+  bool ok = true;
+  for (auto mode : {Stacker::Mode::SUM, Stacker::Mode::MEAN,
+                    Stacker::Mode::MAX, Stacker::Mode::SIGMA_CLIP}) {
+    Stacker::Config config{};
+    config.width = width;
+    config.height = height;
+    config.mode = mode;
+    config.frames = frameCount;
+    std::vector<float> result;
+    unsigned stacks = 0;
+    Stacker stacker{config, [&](const Stacker::Stack& stack) {
+      stacks++;
+      result.assign(stack.pixels.data, stack.pixels.data + pixels);
+    }, pool};
+    stacker.setKernels(kernels);
+    for (const auto& frame : frames) {
+      stacker.add(Plane<const uint16_t>{frame.data(), width, height});
+    }
+
+    bool same = (stacks == 1);
+    double streak = 0.0;
+    for (size_t i = 0; same && (i < pixels); i++) {
+      uint32_t sum = 0, top = 0;
+      for (const auto& frame : frames) {
+        sum += frame[i];
+        top = std::max<uint32_t>(top, frame[i]);
+      }
+      switch (mode) {
+        case Stacker::Mode::SUM:
+          same = result[i] == sum;
+          break;
+        case Stacker::Mode::MEAN:
+          same = close(result[i], static_cast<float>(sum) / frameCount);
+          break;
+        case Stacker::Mode::MAX:
+          same = result[i] == top;
+          break;
+        case Stacker::Mode::SIGMA_CLIP:
+          // Within the noise of the background
+          same = (result[i] >= 55.0f) && (result[i] <= 78.0f);
+          break;
+      }
+    }
+    for (uint32_t x = 0; x < width; x++) {
+      streak += result[(x * height / width) * width + x];
+    }
+    static const char* const NAMES[] = {"sum", "mean", "max", "sigma clip"};
+    printf("  %-10s %s, mean along the streak %.1f\n",
+           NAMES[static_cast<int>(mode)], same ? "ok" : "BAD",
+           streak / width / ((mode == Stacker::Mode::SUM) ? frameCount : 1));
+    ok = ok && same;
+  }
+
+  // Stacks by time: one every 100 ms of frames
+  Stacker::Config config{};
+  config.width = width;
+  config.height = height;
+  config.frames = 0;
+  config.period = std::chrono::milliseconds{100};
+  std::vector<unsigned> sizes;
+  Stacker stacker{config, [&](const Stacker::Stack& stack) {
+    sizes.push_back(stack.frames);
+  }, pool};
+  const auto start = Clock::now();
+  for (unsigned f = 0; f < frameCount; f++) {
+    stacker.add(Plane<const uint16_t>{frames[f].data(), width, height},
+                start + std::chrono::milliseconds{f * 30});
+  }
+  stacker.flush();
+  // The frame that's 100 ms after the first closes the stack:
+  // 0 ... 120 | 150 ... 270 | 300 ... 420 | 450 ... 570
+  const bool timed = (sizes == std::vector<unsigned>{5, 5, 5, 5});
+  printf("  %-10s %s\n", "by time", timed ? "ok" : "BAD");
+  return ok && timed;
+}
+
+int main(int argc, char* argv[]) {
+  unsigned threads = 0;
+  if (argc > 1) {
+    threads = std::max(std::atoi(argv[1]), 0);
+  }
+  WorkerPool pool{threads};
+  bool ok = true;
+
+  const auto kernelSets = supportedStackKernels();
+  printf("picked: %s\n", stackKernels().name);
+  for (const StackKernels* kernels : kernelSets) {
+    if (kernels != &scalarStackKernels()) {
+      const bool same = checkKernels<uint8_t>(*kernels, 255) &&
+        checkKernels<uint16_t>(*kernels, 765);
+      ok = ok && same;
+      printf("%-8s matches scalar: %s\n", kernels->name, same ? "ok" : "BAD");
+    }
+    printf("%s stacker:\n", kernels->name);
+    ok = checkStacker(&pool, *kernels) && ok;
+  }
+
+  //
+  // Timing: ms to add one frame
+  //
+  const uint32_t width = 3280, height = 2464;
+  const size_t pixels = static_cast<size_t>(width) * height;
+  const auto frame16 = noisyFrame<uint16_t>(pixels, 60, 12, 765, 1);
+  const auto frame8 = noisyFrame<uint8_t>(pixels, 20, 4, 255, 2);
+  printf("\n%ux%u, %u threads, ms per frame added\n", width, height,
+         pool.size());
+  printf("%-8s %-10s %8s %8s\n", "kernels", "mode", "16-bit", "8-bit");
+  for (const StackKernels* kernels : kernelSets) {
+    for (auto mode : {Stacker::Mode::SUM, Stacker::Mode::MAX,
+                      Stacker::Mode::SIGMA_CLIP}) {
+      Stacker::Config config{};
+      config.width = width;
+      config.height = height;
+      config.mode = mode;
+      config.frames = 0;
+      Stacker stacker{config, nullptr, &pool};
+      stacker.setKernels(*kernels);
+      const double ms16 = timeIt(RUNS, [&] {
+        stacker.add(Plane<const uint16_t>{frame16.data(), width, height});
+      });
+      const double ms8 = timeIt(RUNS, [&] {
+        stacker.add(Plane<const uint8_t>{frame8.data(), width, height});
+      });
+      static const char* const NAMES[] = {"sum", "mean", "max", "sigma clip"};
+      printf("%-8s %-10s %8.2f %8.2f\n", kernels->name,
+             NAMES[static_cast<int>(mode)], ms16, ms8);
+    }
+  }
+
+  printf("%s\n", ok ? "all ok" : "FAILED");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,255 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs StreakDetector over a sequence of synthetic star fields with trails
+ * drawn into some frames (a meteor, a blinking aircraft, two crossing
+ * satellites, and a line that doesn't move from frame to frame) and checks
+ * it finds the right ones, then times it at full resolution.
+ *
+ * USAGE: streak_bench [threads]
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "streak_detector.hpp"
+
+#include "fixtures.hpp"
+
+static const int RUNS = 5;
+
+struct Line {
+  float x0;
+  float y0;
+  float x1;
+  float y1;
+  float peak;
+  // Lit for on pixels then dark for off, e.g. an aircraft's strobe; 0 for
+  // always on
+  float on;
+  float off;
+};
+
+/**
+ * A noisy background, stars that drift by drift pixels per frame, and
+ * lines.
+ */
+class Sky {
+  public:
+    Sky(uint32_t width, uint32_t height)
+      : mWidth{width}
+      , mHeight{height}
+      , mLight(static_cast<size_t>(width) * height)
+    {
+      uint64_t rng = 99;
+      for (size_t i = 0; i < width * height / 4000; i++) {
+        const float u = static_cast<float>(nextRandom(rng) % 10000) / 10000.0f;
+        mStars.push_back(Line{
+          static_cast<float>(nextRandom(rng) % (width * 16)) / 16.0f,
+          static_cast<float>(nextRandom(rng) % (height * 16)) / 16.0f,
+          0.0f, 0.0f, 40.0f + 215.0f * u * u, 0.0f, 0.0f});
+      }
+    }
+
+    std::vector<uint8_t> frame(unsigned index, const std::vector<Line>& lines,
+                               float drift = 0.5f) {
+      std::fill(mLight.begin(), mLight.end(), 0.0f);
+      for (const auto& star : mStars) {
+        const float sx = star.x0 + drift * index;
+        const float sy = star.y0 + 0.3f * drift * index;
+        draw(sx, sy, sx, sy, star.peak, 0.0f, 0.0f, 1.2f);
+      }
+      for (const auto& l : lines) {
+        draw(l.x0, l.y0, l.x1, l.y1, l.peak, l.on, l.off, 0.8f);
+      }
+      std::vector<uint8_t> out(mLight.size());
+      uint64_t rng = index + 1;
+      for (size_t i = 0; i < out.size(); i++) {
+        const float value = 16.0f + (nextRandom(rng) >> 32) % 9 + mLight[i];
+        out[i] = static_cast<uint8_t>(std::min(value, 255.0f));
+      }
+      return out;
+    }
+
+  private:
+    void draw(float x0, float y0, float x1, float y1, float peak, float on,
+              float off, float sigma) {
+      const float dx = x1 - x0;
+      const float dy = y1 - y0;
+      const float length2 = dx * dx + dy * dy;
+      const int reach = static_cast<int>(std::ceil(3.0f * sigma));
+      const int left = std::max(static_cast<int>(std::min(x0, x1)) - reach, 0);
+      const int right = std::min(static_cast<int>(std::max(x0, x1)) + reach,
+                                 static_cast<int>(mWidth) - 1);
+      const int top = std::max(static_cast<int>(std::min(y0, y1)) - reach, 0);
+      const int bottom = std::min(static_cast<int>(std::max(y0, y1)) + reach,
+                                  static_cast<int>(mHeight) - 1);
+      for (int y = top; y <= bottom; y++) {
+        for (int x = left; x <= right; x++) {
+          float t = (length2 > 0.0f) ? ((x - x0) * dx + (y - y0) * dy) /
+            length2 : 0.0f;
+          t = std::min(std::max(t, 0.0f), 1.0f);
+          if (on > 0.0f) {
+            const float along = t * std::sqrt(length2);
+            if (std::fmod(along, on + off) > on) {
+              continue;
+            }
+          }
+          const float ex = x - (x0 + t * dx);
+          const float ey = y - (y0 + t * dy);
+          mLight[static_cast<size_t>(y) * mWidth + x] += peak *
+            std::exp(-(ex * ex + ey * ey) / (2.0f * sigma * sigma));
+        }
+      }
+    }
+
+    const uint32_t mWidth;
+    const uint32_t mHeight;
+    std::vector<Line> mStars;
+    std::vector<float> mLight;
+};
+
+static bool matches(const Streak& s, const Line& l, float tolerance) {
+  auto near = [&](float ax, float ay, float bx, float by) {
+    return std::hypot(ax - bx, ay - by) <= tolerance;
+  };
+  return (near(s.x0, s.y0, l.x0, l.y0) && near(s.x1, s.y1, l.x1, l.y1)) ||
+    (near(s.x0, s.y0, l.x1, l.y1) && near(s.x1, s.y1, l.x0, l.y0));
+}
+
+static void print(const std::vector<Streak>& streaks) {
+  for (const auto& s : streaks) {
+    printf("    (%.1f, %.1f)-(%.1f, %.1f) length %.1f angle %.2f deg "
+           "width %.2f brightness %.1f pixels %u\n", s.x0, s.y0, s.x1, s.y1,
+           s.length, s.angle * 180.0 / M_PI, s.width, s.brightness, s.pixels);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  unsigned threads = 0;
+  if (argc > 1) {
+    threads = std::max(std::atoi(argv[1]), 0);
+  }
+  WorkerPool pool{threads};
+  bool ok = true;
+
+  const uint32_t width = 1640;
+  const uint32_t height = 1232;
+  Sky sky{width, height};
+  StreakDetector::Config config{};
+  config.width = width;
+  config.height = height;
+  StreakDetector detector{config, &pool};
+  std::vector<Streak> streaks;
+
+  const Line meteor{210.0f, 130.5f, 1190.0f, 707.0f, 160.0f, 0.0f, 0.0f};
+  const Line aircraft{1500.0f, 90.0f, 620.0f, 1100.0f, 200.0f, 24.0f, 6.0f};
+  const Line satellite1{50.0f, 1000.0f, 1600.0f, 980.0f, 110.0f, 0.0f, 0.0f};
+  const Line satellite2{800.0f, 50.0f, 830.0f, 1200.0f, 120.0f, 0.0f, 0.0f};
+  // Only a few pixels of it in the tile it ends in
+  const Line shortStreak{1010.0f, 300.0f, 1100.0f, 330.0f, 180.0f, 0.0f, 0.0f};
+  const Line wire{0.0f, 600.0f, 1639.0f, 450.0f, 140.0f, 0.0f, 0.0f};
+
+  struct Case {
+    const char* name;
+    std::vector<Line> lines;
+    // Which of lines should be found
+    std::vector<Line> expected;
+    // How far off their ends can be
+    float tolerance;
+  };
+  const std::vector<Case> cases{
+    {"stars only", {}, {}, 4.0f},
+    {"stars only again", {}, {}, 4.0f},
+    {"meteor", {meteor}, {meteor}, 4.0f},
+    // An end can fall in a dark spell, or over a star that was there last
+    // frame too, so allow a whole strobe cycle
+    {"blinking aircraft", {aircraft}, {aircraft}, 30.0f},
+    {"crossing satellites", {satellite1, satellite2},
+     {satellite1, satellite2}, 4.0f},
+    {"short streak", {shortStreak}, {shortStreak}, 4.0f},
+    {"wire appears", {wire}, {wire}, 4.0f},
+    {"wire stays", {wire}, {}, 4.0f},
+    {"meteor past the wire", {wire, meteor}, {meteor}, 4.0f},
+  };
+  for (unsigned i = 0; i < cases.size(); i++) {
+    const Case& c = cases[i];
+    const auto frame = sky.frame(i, c.lines);
+    if (!detector.detect(Plane<const uint8_t>{frame.data(), width, height},
+                         streaks)) {
+      printf("%s: detect failed\n", c.name);
+      ok = false;
+      continue;
+    }
+    bool good = streaks.size() == c.expected.size();
+    for (const auto& line : c.expected) {
+      good = good && std::any_of(streaks.begin(), streaks.end(),
+                                 [&](const Streak& s) {
+                                   return matches(s, line, c.tolerance);
+                                 });
+    }
+    printf("%-22s %zu streak%s, %s\n", c.name, streaks.size(),
+           (streaks.size() == 1) ? "" : "s", good ? "ok" : "BAD");
+    print(streaks);
+    ok = ok && good;
+  }
+
+  //
+  // Full resolution
+  //
+  {
+    const uint32_t fullWidth = 3280;
+    const uint32_t fullHeight = 2464;
+    Sky fullSky{fullWidth, fullHeight};
+    StreakDetector::Config fullConfig{};
+    fullConfig.width = fullWidth;
+    fullConfig.height = fullHeight;
+    StreakDetector full{fullConfig, &pool};
+    const auto quiet = fullSky.frame(0, {});
+    const auto busy = fullSky.frame(1, {
+      Line{100.0f, 200.0f, 3100.0f, 2300.0f, 150.0f, 0.0f, 0.0f},
+      Line{3000.0f, 100.0f, 1200.0f, 2400.0f, 200.0f, 24.0f, 6.0f}});
+    const Plane<const uint8_t> quietPlane{quiet.data(), fullWidth, fullHeight};
+    const Plane<const uint8_t> busyPlane{busy.data(), fullWidth, fullHeight};
+    // With nothing to compare against, every star goes through the Hough
+    // transform; after that, most are masked out
+    const double firstMs = timeIt(RUNS, [&] {
+      full.reset();
+      full.detect(quietPlane, streaks);
+    });
+    const double nextMs = timeIt(RUNS, [&] {
+      full.detect(quietPlane, streaks);
+    });
+    size_t found = 0;
+    const double busyMs = timeIt(RUNS, [&] {
+      full.reset();
+      full.detect(quietPlane, streaks);
+      full.detect(busyPlane, streaks);
+      found = streaks.size();
+    }) - firstMs;
+    printf("%ux%u: first frame %.1f ms, next %.1f ms, with %zu streaks "
+           "%.1f ms\n", fullWidth, fullHeight, firstMs, nextMs, found,
+           busyMs);
+    ok = ok && (found == 2);
+  }
+
+  return ok ? 0 : 1;
+}
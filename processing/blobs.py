@@ -11,9 +11,15 @@ import matplotlib.pyplot as plt
 #import skimage.feature as skfeature
 import scipy.signal as spsignal
 
+import picamproc
+
 parser = ap.ArgumentParser()
 parser.add_argument('input_file', nargs='?', default='./out/469_smaller_cropped.png')
 parser.add_argument('-c', '--color-map', default='gray')
+parser.add_argument('-s', '--sigma', type=float, default=5.0,
+                    help='Threshold, in background RMS above the background')
+parser.add_argument('-t', '--threshold', type=int, default=None,
+                    help='Fixed threshold on R + G + B instead')
 
 args = parser.parse_args()
 
@@ -24,49 +30,20 @@ if unprocessed_rgb.shape[2] == 2:
     unprocessed = np.delete(unprocessed_rgb, 1, 2).squeeze()
 elif unprocessed_rgb.shape[2] == 4:
     # RGBA image
-    unprocessed_rgb = np.delete(unprocessed_rgb, 3, 2) 
-    unprocessed = unprocessed_rgb.sum(axis=2, dtype=np.float)
-
-threshold_lo = 50
+    unprocessed = picamproc.luma_sum(unprocessed_rgb)
+
+if args.threshold is not None:
+    threshold_lo = args.threshold
+else:
+    # One threshold per pixel, following skyglow and moonlight gradients
+    threshold_lo = picamproc.Background().estimate(unprocessed).threshold(
+        args.sigma)
 unprocessed = np.ma.array(unprocessed, mask=unprocessed < threshold_lo).filled(0)
 
 
-def is_in_bounds(mat, row, col):
-    return row > 0 and row < mat.shape[0] - 1 and col > 0 and col < mat.shape[1] - 1
-
-NEIGHBORS = (
-    (-1, 0),
-    (1, 0),
-    (0, -1),
-    (0, 1),
-    (-1, -1),
-    (-1, 1),
-    (1, 1),
-    (1, -1),
-)
-def flood_fill(fill_color, mat, out, start):
-    q = [start]
-    while len(q) > 0:
-        row, col = q.pop()
-        if mat[row][col] > 0:
-            out[row][col] = fill_color
-
-        for dr, dc in zip(range(-2, 2), range(-2, 2)):
-        #for dr, dc in NEIGHBORS:
-            r, c = (row+dr, col+dc)
-            if is_in_bounds(mat, r, c) and out[r][c] == 0 and mat[r][c] > 0:
-                q.append((r, c))
-
-shape = unprocessed.shape
-flood = np.zeros(shape)
-fill_color = 1
-for r in range(shape[0]):
-    for c in range(shape[1]):
-        if unprocessed[r][c] > 0 and flood[r][c] == 0:
-            flood_fill(fill_color, unprocessed, flood, (r, c))
-            fill_color += 1
+flood, regions = picamproc.label(unprocessed, threshold_lo)
 
-print(f'Identified {fill_color} regions')
+print(f'Identified {len(regions)} regions')
 
 ax = plt.subplot(1, 1, 1)
 ax.imshow(flood, cmap='gist_ncar')
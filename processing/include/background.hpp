@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef BACKGROUND_HPP
+#define BACKGROUND_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "plane.hpp"
+#include "worker_pool.hpp"
+
+/**
+ * Estimates the sky background and its noise across a frame, so detection
+ * thresholds can follow skyglow and moonlight gradients, the way SExtractor
+ * does.
+ *
+ * The frame is cut into a mesh of tiles, handed to the pool a row of tiles
+ * at a time. Each tile's pixels are sigma-clipped until nothing more is
+ * clipped, and what's left gives the tile's background (the mode, estimated
+ * as 2.5 * median - 1.5 * mean, or the median if the two disagree too much)
+ * and RMS. Tiles that lose too many pixels to clipping (a bright star or the
+ * Moon) are filled in from their neighbours, and the mesh is median
+ * filtered. Full-resolution maps are bicubic (Catmull-Rom) interpolations of
+ * the mesh, with the mesh extended linearly past the edges; they're made on
+ * demand, a band of rows at a time, into the caller's planes.
+ */
+class BackgroundEstimator {
+  public:
+    struct Config {
+      // Largest tile side, in pixels; tiles are spread evenly over the frame
+      uint32_t tileSize = 64;
+      // Clip pixels more than this many standard deviations from the mean
+      float clipSigma = 3.0f;
+      unsigned maxIterations = 10;
+      // Tiles keeping less than this fraction of their pixels are replaced
+      float minKeep = 0.5f;
+      // Median filter over this many tiles square (odd; 1 for none)
+      unsigned filterSize = 3;
+    };
+
+    explicit BackgroundEstimator(const Config& config,
+                                 WorkerPool* pool = nullptr);
+
+    BackgroundEstimator(const BackgroundEstimator&) = delete;
+    BackgroundEstimator& operator=(const BackgroundEstimator&) = delete;
+
+    /**
+     * Build the mesh for frame; the maps below are then for its size.
+     *
+     * @return false if frame is empty.
+     */
+    bool estimate(Plane<const uint8_t> frame);
+    bool estimate(Plane<const uint16_t> frame);
+
+    /**
+     * Size of the frame the mesh is for.
+     */
+    uint32_t width() const;
+    uint32_t height() const;
+
+    /**
+     * Per-tile background and RMS, after filling in and filtering.
+     */
+    Plane<const float> meshBackground() const;
+    Plane<const float> meshRms() const;
+
+    /**
+     * Tiles that were filled in from their neighbours in the last frame.
+     */
+    size_t replacedTiles() const;
+
+    /**
+     * Interpolated maps, the size of the last frame.
+     *
+     * @return false if out is the wrong size.
+     */
+    bool background(Plane<float> out) const;
+    bool rms(Plane<float> out) const;
+
+    /**
+     * The lowest value that's more than sigma RMS above the background at
+     * each pixel, for ComponentLabeller.
+     */
+    bool threshold(Plane<uint16_t> out, float sigma) const;
+
+    /**
+     * in minus the (rounded) background, clamped at 0. in and out may be the
+     * same.
+     */
+    bool subtract(Plane<const uint8_t> in, Plane<uint8_t> out) const;
+    bool subtract(Plane<const uint16_t> in, Plane<uint16_t> out) const;
+
+    const Config& config() const;
+
+  private:
+    // Extra mesh nodes past each edge, for the interpolation
+    static const uint32_t GHOSTS = 2;
+
+    struct Taps {
+      // Index of the first of four nodes (counting the ghosts), and their
+      // weights
+      uint32_t first;
+      float weights[4];
+    };
+
+    template <typename T>
+    bool estimateImpl(Plane<const T> frame);
+    template <typename T>
+    bool subtractImpl(Plane<const T> in, Plane<T> out) const;
+
+    void fillTiles();
+    void filterMesh();
+    void extendMesh();
+
+    /**
+     * Interpolation taps for each of count pixels, with nodes spacing pixels
+     * apart.
+     */
+    static void makeTaps(uint32_t count, uint32_t nodes,
+                         std::vector<Taps>& taps);
+
+    /**
+     * Call fn(y, background, rms) with each row of the interpolated maps,
+     * bands of rows in parallel. rms is null unless wantRms.
+     */
+    template <typename F>
+    void forRows(bool wantRms, F fn) const;
+
+    const Config mConfig;
+    WorkerPool* const mPool;
+
+    uint32_t mWidth;
+    uint32_t mHeight;
+    uint32_t mMeshWidth;
+    uint32_t mMeshHeight;
+    // (mMeshWidth + 2 * GHOSTS) x (mMeshHeight + 2 * GHOSTS), the mesh in
+    // the middle; NaN marks a tile to fill in until fillTiles()
+    std::vector<float> mBackground;
+    std::vector<float> mRms;
+    std::vector<Taps> mTapsX;
+    std::vector<Taps> mTapsY;
+    size_t mReplaced;
+};
+
+#endif // BACKGROUND_HPP
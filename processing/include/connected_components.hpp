@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONNECTED_COMPONENTS_HPP
+#define CONNECTED_COMPONENTS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "plane.hpp"
+#include "worker_pool.hpp"
+
+/**
+ * A connected region of pixels at or above the threshold: a star, a
+ * satellite streak, a hot pixel...
+ */
+struct Component {
+  uint32_t area;
+  // Bounding box, inclusive
+  uint32_t minX;
+  uint32_t minY;
+  uint32_t maxX;
+  uint32_t maxY;
+  // Sum of the pixel values
+  uint64_t flux;
+  // Flux-weighted centroid; pixel (x, y) is centred on (x, y)
+  double x;
+  double y;
+  // Brightest pixel (the first one, if there's a tie)
+  uint32_t peak;
+  uint32_t peakX;
+  uint32_t peakY;
+};
+
+/**
+ * Finds the connected components of a thresholded luminance plane.
+ *
+ * Each row is cut into runs of pixels at or above the threshold, and runs
+ * that touch a run on the row above are merged with union-find, so the work
+ * is proportional to the number of runs rather than pixels once the rows
+ * have been scanned. With a WorkerPool, bands of rows are labelled in
+ * parallel and then stitched together where they meet.
+ *
+ * Components come out in raster order of their first pixel. Buffers are kept
+ * between calls, so labelling frames of the same size doesn't allocate
+ * (apart from growing the output).
+ */
+class ComponentLabeller {
+  public:
+    struct Config {
+      // Pixels at or above this are part of a component
+      uint32_t threshold = 50;
+      // Leave out components with fewer pixels than this
+      uint32_t minArea = 1;
+      // Diagonal neighbours are connected too
+      bool eightConnected = true;
+    };
+
+    explicit ComponentLabeller(const Config& config,
+                               WorkerPool* pool = nullptr);
+
+    ComponentLabeller(const ComponentLabeller&) = delete;
+    ComponentLabeller& operator=(const ComponentLabeller&) = delete;
+
+    /**
+     * Label image, replacing the contents of components.
+     *
+     * @param labels If not null, filled in with each pixel's component index
+     *               plus one, or 0 for background. Must be the same size as
+     *               image.
+     */
+    void label(Plane<const uint8_t> image, std::vector<Component>& components,
+               const Plane<uint32_t>* labels = nullptr);
+    void label(Plane<const uint16_t> image, std::vector<Component>& components,
+               const Plane<uint32_t>* labels = nullptr);
+
+    /**
+     * label() with a threshold for each pixel instead of the configured
+     * one, e.g. from BackgroundEstimator::threshold(). thresholds must be
+     * the same size as image; if it isn't, nothing is found.
+     */
+    void label(Plane<const uint8_t> image, Plane<const uint16_t> thresholds,
+               std::vector<Component>& components,
+               const Plane<uint32_t>* labels = nullptr);
+    void label(Plane<const uint16_t> image, Plane<const uint16_t> thresholds,
+               std::vector<Component>& components,
+               const Plane<uint32_t>* labels = nullptr);
+
+    /**
+     * Runs found in the last frame.
+     */
+    size_t runs() const;
+
+  private:
+    struct Run {
+      uint32_t x0;
+      // Exclusive
+      uint32_t x1;
+      uint32_t y;
+      uint32_t peak;
+      uint32_t peakX;
+      uint64_t flux;
+      // Sum of value * x
+      uint64_t fluxX;
+    };
+
+    struct Band {
+      uint32_t y0;
+      uint32_t y1;
+      std::vector<Run> runs;
+      // Index of each row's first run, plus one past the end
+      std::vector<uint32_t> rowStart;
+      std::vector<uint32_t> parent;
+    };
+
+    template <typename T>
+    void labelImpl(Plane<const T> image,
+                   const Plane<const uint16_t>* thresholds,
+                   std::vector<Component>& components,
+                   const Plane<uint32_t>* labels);
+    template <typename T>
+    void scanBand(Plane<const T> image,
+                  const Plane<const uint16_t>* thresholds, Band& band);
+    template <typename Link>
+    void linkRows(const Run* above, size_t aboveCount, const Run* row,
+                  size_t rowCount, uint32_t aboveBase, uint32_t rowBase,
+                  Link link) const;
+    void writeLabels(const Band& band, uint32_t base,
+                     const Plane<uint32_t>& labels) const;
+
+    const Config mConfig;
+    WorkerPool* mPool;
+
+    std::vector<Band> mBands;
+    // Union-find over all runs, band by band
+    std::vector<uint32_t> mParent;
+    // For each root run, its component index (or NONE)
+    std::vector<uint32_t> mComponentOf;
+    std::vector<uint32_t> mBandBase;
+};
+
+#endif // CONNECTED_COMPONENTS_HPP
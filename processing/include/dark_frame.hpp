@@ -0,0 +1,274 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef DARK_FRAME_HPP
+#define DARK_FRAME_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "plane.hpp"
+#include "worker_pool.hpp"
+
+/**
+ * Dark-frame calibration: master darks median-stacked from exposures taken
+ * with the lens covered, kept on disk in a form that's used straight from an
+ * mmap, and subtracted from frames along with a repair of the hot pixels.
+ *
+ * A master dark only fits frames taken with the same gain and exposure, and
+ * at about the same sensor temperature, so each is filed under a DarkKey.
+ */
+
+// Degrees C per temperature bucket
+static const int DARK_TEMPERATURE_STEP = 5;
+
+/**
+ * Temperature bucket a reading in degrees C falls in.
+ */
+int32_t darkTemperatureBucket(float celsius);
+
+struct DarkKey {
+  uint32_t iso;
+  uint32_t shutterUs;
+  // See darkTemperatureBucket()
+  int32_t temperature;
+};
+
+/**
+ * Layout of a master dark file, all in native byte order (files are made on
+ * the camera that uses them):
+ *
+ *   DarkFileHeader
+ *   master:     width * height uint16_t, row by row, at masterOffset
+ *   hot pixels: hotPixels uint32_t pixel indexes (y * width + x), ascending,
+ *               at hotOffset
+ *
+ * Both offsets are multiples of DARK_FILE_ALIGN so the rows can be read
+ * with aligned vector loads.
+ */
+struct DarkFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t iso;
+  uint32_t shutterUs;
+  int32_t temperature;
+  // Dark frames that went into the master
+  uint32_t frames;
+  // How far above its neighbourhood a pixel had to be to count as hot
+  uint32_t hotThreshold;
+  uint32_t hotPixels;
+  uint32_t reserved;
+  uint64_t masterOffset;
+  uint64_t hotOffset;
+};
+
+static const char DARK_FILE_MAGIC[8] = {'P', 'I', 'C', 'A', 'M', 'D', 'K',
+                                        '1'};
+static const uint32_t DARK_FILE_VERSION = 1;
+static const size_t DARK_FILE_ALIGN = 64;
+
+/**
+ * Row kernels behind calibrate(), picked at runtime like StackKernels.
+ * Both set out[i] = max(in[i] - dark[i], 0); in and out may be the same.
+ */
+struct DarkKernels {
+  const char* name;
+  void (*subtract8)(const uint8_t* in, const uint16_t* dark, uint8_t* out,
+                    size_t count);
+  void (*subtract16)(const uint16_t* in, const uint16_t* dark, uint16_t* out,
+                     size_t count);
+};
+
+const DarkKernels& darkKernels();
+
+const DarkKernels& scalarDarkKernels();
+
+/**
+ * Every set of kernels this CPU can run, scalar first.
+ */
+std::vector<const DarkKernels*> supportedDarkKernels();
+
+// Per-architecture kernel sets, built with their own -m flags; null when not
+// built for this CPU. supportedDarkKernels() checks the CPU.
+const DarkKernels* sse2DarkKernels();
+const DarkKernels* avx2DarkKernels();
+const DarkKernels* neonDarkKernels();
+
+/**
+ * Collects dark exposures and writes their per-pixel median as a master
+ * dark.
+ *
+ * Every frame is kept (as 16 bits) until write(), since a median needs them
+ * all at once, so MAX_MEDIAN_ROWS frames at 1640x1232 take about 130 MB.
+ */
+class DarkFrameBuilder {
+  public:
+    DarkFrameBuilder(uint32_t width, uint32_t height,
+                     WorkerPool* pool = nullptr);
+
+    DarkFrameBuilder(const DarkFrameBuilder&) = delete;
+    DarkFrameBuilder& operator=(const DarkFrameBuilder&) = delete;
+
+    /**
+     * @return false if the frame isn't the configured size, or there are
+     *         already MAX_MEDIAN_ROWS frames.
+     */
+    bool add(Plane<const uint8_t> frame);
+    bool add(Plane<const uint16_t> frame);
+
+    unsigned frames() const;
+
+    /**
+     * Median-stack the frames, find the hot pixels, and write the master to
+     * path (by way of a temporary file, so a reader never sees half of one).
+     * A pixel is hot if the master is more than hotThreshold above the
+     * median of its 3x3 neighbourhood, or of the whole master near the
+     * edges.
+     *
+     * @return The number of hot pixels, or -1 if there are no frames or the
+     *         file couldn't be written.
+     */
+    long write(const std::string& path, const DarkKey& key,
+               uint16_t hotThreshold) const;
+
+    /**
+     * Drop the frames, to start on another master.
+     */
+    void reset();
+
+  private:
+    template <typename T>
+    bool addImpl(Plane<const T> frame);
+
+    const uint32_t mWidth;
+    const uint32_t mHeight;
+    WorkerPool* const mPool;
+    // Frame after frame, each width * height
+    std::vector<uint16_t> mFrames;
+    unsigned mCount;
+};
+
+/**
+ * A master dark file, mapped into memory. Opening one only reads the header;
+ * the pixels are paged in as they're used.
+ */
+class DarkFrame {
+  public:
+    DarkFrame();
+    ~DarkFrame();
+
+    DarkFrame(DarkFrame&& other);
+    DarkFrame& operator=(DarkFrame&& other);
+    DarkFrame(const DarkFrame&) = delete;
+    DarkFrame& operator=(const DarkFrame&) = delete;
+
+    /**
+     * Map a file written by DarkFrameBuilder, replacing whatever this had.
+     *
+     * @return false if it can't be mapped or isn't a valid master dark.
+     */
+    bool open(const std::string& path);
+
+    void close();
+
+    bool isOpen() const;
+
+    const std::string& path() const;
+
+    DarkKey key() const;
+
+    /**
+     * Dark frames that went into the master.
+     */
+    uint32_t frames() const;
+
+    uint32_t width() const;
+    uint32_t height() const;
+
+    Plane<const uint16_t> master() const;
+
+    /**
+     * Indexes (y * width + x) of the hot pixels, ascending.
+     */
+    const uint32_t* hotPixels() const;
+    uint32_t hotPixelCount() const;
+
+    bool isHot(uint32_t x, uint32_t y) const;
+
+  private:
+    std::string mPath;
+    void* mMap;
+    size_t mMapSize;
+    const DarkFileHeader* mHeader;
+};
+
+/**
+ * The master darks in a directory, for picking the one that fits a frame.
+ */
+class DarkLibrary {
+  public:
+    /**
+     * Map every *.dark file in dir, replacing what was loaded before. Files
+     * that aren't valid are skipped.
+     *
+     * @return The number of masters loaded.
+     */
+    size_t load(const std::string& dir);
+
+    /**
+     * The master for a width x height frame with this ISO and shutter speed,
+     * from the nearest temperature bucket.
+     *
+     * @return Null if there isn't one for the ISO, shutter speed and size.
+     */
+    const DarkFrame* find(const DarkKey& key, uint32_t width,
+                          uint32_t height) const;
+
+    size_t size() const;
+
+  private:
+    std::vector<DarkFrame> mFrames;
+};
+
+/**
+ * Subtract a master dark from a frame, clamping at 0, and replace each hot
+ * pixel with the median of its neighbours that aren't hot. in and out may be
+ * the same plane.
+ *
+ * @return false if the planes aren't the master's size.
+ */
+bool calibrate(Plane<const uint8_t> in, Plane<uint8_t> out,
+               const DarkFrame& dark, WorkerPool* pool = nullptr);
+bool calibrate(Plane<const uint16_t> in, Plane<uint16_t> out,
+               const DarkFrame& dark, WorkerPool* pool = nullptr);
+
+/**
+ * calibrate() with a particular set of kernels, e.g. to compare them.
+ */
+bool calibrate(Plane<const uint8_t> in, Plane<uint8_t> out,
+               const DarkFrame& dark, WorkerPool* pool,
+               const DarkKernels& kernels);
+bool calibrate(Plane<const uint16_t> in, Plane<uint16_t> out,
+               const DarkFrame& dark, WorkerPool* pool,
+               const DarkKernels& kernels);
+
+#endif // DARK_FRAME_HPP
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef DARK_ROWS_HPP
+#define DARK_ROWS_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#include "dark_frame.hpp"
+#include "stack_rows.hpp"
+
+/**
+ * Row kernels for calibrate(), built per instruction set by the
+ * dark_frame_*.cpp files the same way as stack_rows.hpp, whose vector
+ * helpers they use. With VECTOR 0 they're plain loops.
+ */
+namespace {
+
+template <size_t VECTOR>
+struct DarkVectors {
+  static const size_t LANES = VECTOR / 2;
+  using U16 = typename VectorOf<uint16_t, VECTOR>::Type;
+  using U8 = typename VectorOf<uint8_t, LANES>::Type;
+};
+
+/**
+ * max(in - dark, 0), which compilers turn into a saturating subtract.
+ */
+template <size_t VECTOR>
+inline void subtractVector(typename DarkVectors<VECTOR>::U16& in,
+                           const typename DarkVectors<VECTOR>::U16& dark) {
+  using U16 = typename DarkVectors<VECTOR>::U16;
+  in = (in - dark) & (U16)(in > dark);
+}
+
+template <size_t VECTOR>
+void subtractRow16(const uint16_t* in, const uint16_t* dark, uint16_t* out,
+                   size_t count) {
+  size_t i = 0;
+  if constexpr (VECTOR > 0) {
+    using V = DarkVectors<VECTOR>;
+    for (; i + V::LANES <= count; i += V::LANES) {
+      typename V::U16 a, d;
+      loadVector(a, in + i);
+      loadVector(d, dark + i);
+      subtractVector<VECTOR>(a, d);
+      storeVector(out + i, a);
+    }
+  }
+  for (; i < count; i++) {
+    out[i] = (in[i] > dark[i]) ? in[i] - dark[i] : 0;
+  }
+}
+
+template <size_t VECTOR>
+void subtractRow8(const uint8_t* in, const uint16_t* dark, uint8_t* out,
+                  size_t count) {
+  size_t i = 0;
+  if constexpr (VECTOR > 0) {
+    // Widened to 16 bits; the result is no more than the input, so it
+    // narrows back without clamping
+    using V = DarkVectors<VECTOR>;
+    for (; i + V::LANES <= count; i += V::LANES) {
+      typename V::U8 narrow;
+      typename V::U16 d;
+      loadVector(narrow, in + i);
+      loadVector(d, dark + i);
+      typename V::U16 a = __builtin_convertvector(narrow, typename V::U16);
+      subtractVector<VECTOR>(a, d);
+      narrow = __builtin_convertvector(a, typename V::U8);
+      storeVector(out + i, narrow);
+    }
+  }
+  for (; i < count; i++) {
+    out[i] = (in[i] > dark[i]) ? in[i] - dark[i] : 0;
+  }
+}
+
+template <size_t VECTOR>
+constexpr DarkKernels makeDarkKernels(const char* name) {
+  return DarkKernels{
+    name,
+    subtractRow8<VECTOR>,
+    subtractRow16<VECTOR>,
+  };
+}
+
+} // namespace
+
+#endif // DARK_ROWS_HPP
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FFT_HPP
+#define FFT_HPP
+
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "worker_pool.hpp"
+
+/**
+ * In-place 2D FFT of a square, power-of-two-sized grid of complex floats,
+ * stored row by row.
+ *
+ * Rows are transformed directly, a band per worker. Columns are copied out a
+ * block at a time into a contiguous scratch buffer, transformed there and
+ * copied back, so every butterfly works on memory that's in cache rather
+ * than striding a whole row apart.
+ */
+class Fft2d {
+  public:
+    using Complex = std::complex<float>;
+
+    /**
+     * @param size Width and height; a power of two.
+     */
+    explicit Fft2d(uint32_t size, WorkerPool* pool = nullptr);
+
+    uint32_t size() const {
+      return mSize;
+    }
+
+    void forward(Complex* data);
+
+    /**
+     * Inverse transform, scaled so inverse(forward(x)) == x.
+     */
+    void inverse(Complex* data);
+
+  private:
+    void transform(Complex* data, bool inverse);
+    void transform1d(Complex* data, bool inverse) const;
+
+    const uint32_t mSize;
+    WorkerPool* const mPool;
+    // e^(-2 pi i k / size) for k < size / 2
+    std::vector<Complex> mTwiddles;
+    std::vector<uint32_t> mBitReverse;
+    // Column blocks, one per task
+    std::vector<std::vector<Complex>> mScratch;
+};
+
+#endif // FFT_HPP
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LUMA_KERNELS_HPP
+#define LUMA_KERNELS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "plane.hpp"
+
+/**
+ * The kernels at the front of every analysis: turning decoded camera output
+ * into a luminance plane, and thresholding that into a bitmask.
+ *
+ * Each set has the same kernels; the scalar set is the reference the SIMD
+ * ones (SSE2 and AVX2 on x86, NEON on ARM) have to match bit for bit.
+ * lumaKernels() picks the best set the CPU supports, once.
+ *
+ * Masks are 64 pixels per word, least significant bit first.
+ */
+struct LumaKernels {
+  const char* name;
+
+  /**
+   * out[i] = R + G + B of pixel i of packed RGBA; alpha is ignored.
+   */
+  void (*rgbaLumaSum)(const uint8_t* rgba, uint16_t* out, size_t pixels);
+
+  /**
+   * out[i] = R + G + B of pixel i of packed RGB.
+   */
+  void (*rgbLumaSum)(const uint8_t* rgb, uint16_t* out, size_t pixels);
+
+  /**
+   * Set bit i of mask iff in[i] >= threshold, clearing the rest of the last
+   * word.
+   *
+   * @return The number of bits set.
+   */
+  size_t (*thresholdMask8)(const uint8_t* in, uint64_t* mask, size_t pixels,
+                           uint8_t threshold);
+  size_t (*thresholdMask16)(const uint16_t* in, uint64_t* mask,
+                            size_t pixels, uint16_t threshold);
+};
+
+/**
+ * The fastest kernels this CPU can run.
+ */
+const LumaKernels& lumaKernels();
+
+const LumaKernels& scalarLumaKernels();
+
+/**
+ * Every set of kernels this CPU can run, scalar first.
+ */
+std::vector<const LumaKernels*> supportedLumaKernels();
+
+/**
+ * Words in a mask of pixels bits.
+ */
+inline size_t maskWords(size_t pixels) {
+  return (pixels + 63) / 64;
+}
+
+/**
+ * The Y plane of an I420 buffer from the camera, in place: MMAL pads the
+ * width to a multiple of 32 and the height to a multiple of 16, so that's the
+ * row stride and where the chroma planes start.
+ */
+Plane<const uint8_t> i420LumaPlane(const uint8_t* buffer, uint32_t width,
+                                   uint32_t height);
+
+// Per-architecture kernel sets; null when not built for this CPU, or not
+// supported by it
+const LumaKernels* sse2LumaKernels();
+const LumaKernels* avx2LumaKernels();
+const LumaKernels* neonLumaKernels();
+
+#endif // LUMA_KERNELS_HPP
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MEDIAN_FILTER_HPP
+#define MEDIAN_FILTER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "plane.hpp"
+#include "worker_pool.hpp"
+
+/**
+ * Median of each pixel's size x size neighbourhood (size 3 or 5), to knock
+ * out hot pixels before detection. Pixels past the edges count as 0, like
+ * scipy's medfilt2d.
+ *
+ * The image is split into bands of rows for the pool (if any), and each band
+ * into tiles of columns narrow enough that the rows a window spans stay in
+ * cache.
+ *
+ * @return false if size isn't 3 or 5, or out isn't the same size as in.
+ */
+bool medianFilter(Plane<const uint8_t> in, Plane<uint8_t> out, unsigned size,
+                  WorkerPool* pool = nullptr);
+bool medianFilter(Plane<const uint16_t> in, Plane<uint16_t> out,
+                  unsigned size, WorkerPool* pool = nullptr);
+
+/**
+ * Row kernels behind medianFilter(), in a scalar reference version and SIMD
+ * versions picked at runtime like LumaKernels.
+ *
+ * Each sets out[i] to the median of the window whose top left is rows[0][i],
+ * rows[r] being the window's row r, for i in [0, count).
+ */
+struct MedianKernels {
+  const char* name;
+  void (*median3Row8)(const uint8_t* const* rows, uint8_t* out, size_t count);
+  void (*median5Row8)(const uint8_t* const* rows, uint8_t* out, size_t count);
+  void (*median3Row16)(const uint16_t* const* rows, uint16_t* out,
+                       size_t count);
+  void (*median5Row16)(const uint16_t* const* rows, uint16_t* out,
+                       size_t count);
+
+  /**
+   * out[i] = the median of rows[0][i], ..., rows[n - 1][i] (the upper middle
+   * value for even n), e.g. to median-stack frames. n is at most
+   * MAX_MEDIAN_ROWS.
+   */
+  void (*medianAcross16)(const uint16_t* const* rows, unsigned n,
+                         uint16_t* out, size_t count);
+};
+
+// Most rows medianAcross16 takes
+static const unsigned MAX_MEDIAN_ROWS = 32;
+
+/**
+ * The fastest kernels this CPU can run.
+ */
+const MedianKernels& medianKernels();
+
+const MedianKernels& scalarMedianKernels();
+
+/**
+ * Every set of kernels this CPU can run, scalar first.
+ */
+std::vector<const MedianKernels*> supportedMedianKernels();
+
+/**
+ * medianFilter() with a particular set of kernels, e.g. to compare them.
+ */
+bool medianFilter(Plane<const uint8_t> in, Plane<uint8_t> out, unsigned size,
+                  WorkerPool* pool, const MedianKernels& kernels);
+bool medianFilter(Plane<const uint16_t> in, Plane<uint16_t> out,
+                  unsigned size, WorkerPool* pool,
+                  const MedianKernels& kernels);
+
+// Per-architecture kernel sets, built with their own -m flags; null when not
+// built for this CPU. They don't check the CPU has the instructions (that
+// check can't be compiled with the flags), supportedMedianKernels() does.
+const MedianKernels* sse2MedianKernels();
+const MedianKernels* avx2MedianKernels();
+const MedianKernels* neonMedianKernels();
+
+#endif // MEDIAN_FILTER_HPP
@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MEDIAN_NETWORK_HPP
+#define MEDIAN_NETWORK_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+/**
+ * Branchless median selection for the median filter kernels: a Batcher
+ * odd-even merge sorting network, built at compile time and pruned down to
+ * the comparisons the middle output depends on. Every step is a min and/or a
+ * max, so the same network runs on scalars or on SIMD vectors (one window per
+ * lane) given an Ops type:
+ *
+ *   struct Ops {
+ *     using Vector = ...;
+ *     using Scalar = ...;
+ *     static const size_t LANES = ...;
+ *     static Vector min(Vector a, Vector b);
+ *     static Vector max(Vector a, Vector b);
+ *     static Vector load(const Scalar* p);
+ *     static void store(Scalar* p, Vector v);
+ *   };
+ *
+ * Everything here has internal linkage: the SIMD kernel files are built with
+ * their own -m flags, and must not share instantiations with the rest of the
+ * library.
+ */
+namespace {
+
+struct MedianStep {
+  enum Kind : uint8_t {
+    // a = min(a, b), b = max(a, b)
+    EXCHANGE,
+    // Only the min is used later
+    MIN_ONLY,
+    // Only the max is used later
+    MAX_ONLY,
+  };
+
+  uint8_t a;
+  uint8_t b;
+  Kind kind;
+};
+
+struct MedianSteps {
+  // Batcher's network for 32 inputs has 191 comparisons
+  MedianStep steps[192];
+  size_t size;
+};
+
+// Most inputs medianSteps() can take
+constexpr size_t MAX_MEDIAN_INPUTS = 32;
+
+/**
+ * The steps that select the median of n inputs (at most MAX_MEDIAN_INPUTS):
+ * output n / 2 of the sort, which for even n is the upper of the middle two.
+ */
+constexpr MedianSteps medianSteps(size_t n) {
+  // Sort a power of two inputs, the extra ones being +infinity: comparisons
+  // with them never move anything, so they're dropped
+  size_t padded = 1;
+  while (padded < n) {
+    padded <<= 1;
+  }
+  MedianSteps all{};
+  for (size_t p = 1; p < padded; p <<= 1) {
+    for (size_t k = p; k >= 1; k >>= 1) {
+      for (size_t j = k % p; j + k < padded; j += 2 * k) {
+        for (size_t i = 0; i < k; i++) {
+          const size_t a = i + j;
+          const size_t b = i + j + k;
+          if ((a / (2 * p) == b / (2 * p)) && (b < n)) {
+            all.steps[all.size++] = MedianStep{static_cast<uint8_t>(a),
+                                               static_cast<uint8_t>(b),
+                                               MedianStep::EXCHANGE};
+          }
+        }
+      }
+    }
+  }
+
+  // Walk back from the median, keeping the steps it depends on
+  bool needed[MAX_MEDIAN_INPUTS]{};
+  needed[n / 2] = true;
+  MedianSteps reversed{};
+  for (size_t s = all.size; s-- > 0;) {
+    MedianStep step = all.steps[s];
+    const bool a = needed[step.a];
+    const bool b = needed[step.b];
+    if (!a && !b) {
+      continue;
+    }
+    step.kind = (a && b) ? MedianStep::EXCHANGE
+      : (a ? MedianStep::MIN_ONLY : MedianStep::MAX_ONLY);
+    needed[step.a] = true;
+    needed[step.b] = true;
+    reversed.steps[reversed.size++] = step;
+  }
+
+  MedianSteps kept{};
+  for (size_t s = reversed.size; s-- > 0;) {
+    kept.steps[kept.size++] = reversed.steps[s];
+  }
+  return kept;
+}
+
+template <size_t INPUTS>
+struct MedianOf {
+  static constexpr MedianSteps STEPS = medianSteps(INPUTS);
+};
+
+/**
+ * The network for a SIZE x SIZE window.
+ */
+template <unsigned SIZE>
+struct MedianNetwork {
+  static constexpr size_t INPUTS = SIZE * SIZE;
+  static constexpr MedianSteps STEPS = MedianOf<INPUTS>::STEPS;
+};
+
+template <typename Ops, size_t INPUTS, size_t I>
+__attribute__((always_inline))
+inline void medianStep(typename Ops::Vector* v) {
+  constexpr MedianStep step = MedianOf<INPUTS>::STEPS.steps[I];
+  if constexpr (step.kind == MedianStep::EXCHANGE) {
+    const auto low = Ops::min(v[step.a], v[step.b]);
+    v[step.b] = Ops::max(v[step.a], v[step.b]);
+    v[step.a] = low;
+  } else if constexpr (step.kind == MedianStep::MIN_ONLY) {
+    v[step.a] = Ops::min(v[step.a], v[step.b]);
+  } else {
+    v[step.b] = Ops::max(v[step.a], v[step.b]);
+  }
+}
+
+template <typename Ops, size_t INPUTS, size_t... I>
+__attribute__((always_inline))
+inline void applyMedianSteps(typename Ops::Vector* v,
+                             std::index_sequence<I...>) {
+  // One input has no steps
+  (void)v;
+  (medianStep<Ops, INPUTS, I>(v), ...);
+}
+
+/**
+ * The median of the INPUTS values in v, which it scrambles.
+ */
+template <typename Ops, size_t INPUTS>
+__attribute__((always_inline))
+inline typename Ops::Vector medianOf(typename Ops::Vector* v) {
+  applyMedianSteps<Ops, INPUTS>(
+    v, std::make_index_sequence<MedianOf<INPUTS>::STEPS.size>{});
+  return v[INPUTS / 2];
+}
+
+/**
+ * The median of the SIZE * SIZE values in v, which it scrambles.
+ */
+template <typename Ops, unsigned SIZE>
+__attribute__((always_inline))
+inline typename Ops::Vector median(typename Ops::Vector* v) {
+  return medianOf<Ops, SIZE * SIZE>(v);
+}
+
+template <typename T>
+struct ScalarMedianOps {
+  using Vector = T;
+  using Scalar = T;
+  static const size_t LANES = 1;
+
+  static T min(T a, T b) {
+    return (a < b) ? a : b;
+  }
+  static T max(T a, T b) {
+    return (a < b) ? b : a;
+  }
+  static T load(const T* p) {
+    return *p;
+  }
+  static void store(T* p, T v) {
+    *p = v;
+  }
+};
+
+/**
+ * out[i] = the median of the SIZE x SIZE window whose top left is rows[0][i]
+ * (rows[r] is that window's row r), for i in [0, count).
+ */
+template <typename Ops, unsigned SIZE>
+void medianRow(const typename Ops::Scalar* const* rows,
+               typename Ops::Scalar* out, size_t count) {
+  using Scalar = ScalarMedianOps<typename Ops::Scalar>;
+  size_t x = 0;
+  for (; x + Ops::LANES <= count; x += Ops::LANES) {
+    typename Ops::Vector v[SIZE * SIZE];
+    for (unsigned r = 0; r < SIZE; r++) {
+      for (unsigned c = 0; c < SIZE; c++) {
+        v[r * SIZE + c] = Ops::load(rows[r] + x + c);
+      }
+    }
+    Ops::store(out + x, median<Ops, SIZE>(v));
+  }
+  for (; x < count; x++) {
+    typename Scalar::Vector v[SIZE * SIZE];
+    for (unsigned r = 0; r < SIZE; r++) {
+      for (unsigned c = 0; c < SIZE; c++) {
+        v[r * SIZE + c] = rows[r][x + c];
+      }
+    }
+    out[x] = median<Scalar, SIZE>(v);
+  }
+}
+
+/**
+ * out[i] = the median of rows[0][i], ..., rows[N - 1][i], for i in [0,
+ * count): e.g. each pixel's median over N frames.
+ */
+template <typename Ops, size_t N>
+void medianAcross(const typename Ops::Scalar* const* rows,
+                  typename Ops::Scalar* out, size_t count) {
+  using Scalar = ScalarMedianOps<typename Ops::Scalar>;
+  size_t x = 0;
+  for (; x + Ops::LANES <= count; x += Ops::LANES) {
+    typename Ops::Vector v[N];
+    for (size_t r = 0; r < N; r++) {
+      v[r] = Ops::load(rows[r] + x);
+    }
+    Ops::store(out + x, medianOf<Ops, N>(v));
+  }
+  for (; x < count; x++) {
+    typename Scalar::Vector v[N];
+    for (size_t r = 0; r < N; r++) {
+      v[r] = rows[r][x];
+    }
+    out[x] = medianOf<Scalar, N>(v);
+  }
+}
+
+template <typename Ops>
+using MedianAcrossFn = void (*)(const typename Ops::Scalar* const*,
+                                typename Ops::Scalar*, size_t);
+
+template <typename Ops, size_t... I>
+constexpr std::array<MedianAcrossFn<Ops>, sizeof...(I)>
+medianAcrossTable(std::index_sequence<I...>) {
+  return {{medianAcross<Ops, I + 1>...}};
+}
+
+/**
+ * medianAcross() for n rows, n in [1, MAX_MEDIAN_INPUTS]; other n do
+ * nothing.
+ */
+template <typename Ops>
+void medianAcrossRows(const typename Ops::Scalar* const* rows, unsigned n,
+                      typename Ops::Scalar* out, size_t count) {
+  static constexpr auto TABLE = medianAcrossTable<Ops>(
+    std::make_index_sequence<MAX_MEDIAN_INPUTS>{});
+  if ((n >= 1) && (n <= MAX_MEDIAN_INPUTS)) {
+    TABLE[n - 1](rows, out, count);
+  }
+}
+
+} // namespace
+
+#endif // MEDIAN_NETWORK_HPP
@@ -0,0 +1,377 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * C interface to the processing library, for calling it from Python with
+ * ctypes (see picamproc.py).
+ */
+
+#ifndef PICAMPROC_H
+#define PICAMPROC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Same fields and layout as Component.
+ */
+typedef struct {
+  uint32_t area;
+  uint32_t min_x;
+  uint32_t min_y;
+  uint32_t max_x;
+  uint32_t max_y;
+  uint64_t flux;
+  double x;
+  double y;
+  uint32_t peak;
+  uint32_t peak_x;
+  uint32_t peak_y;
+} picam_component;
+
+/**
+ * Find the connected components of pixels at or above threshold (see
+ * ComponentLabeller). stride is in pixels. labels may be null; otherwise it
+ * gets width x height labels, tightly packed.
+ *
+ * @return The number of components, which may be more than max_components;
+ *         only the first max_components are written.
+ */
+size_t picam_label_u8(const uint8_t* data, uint32_t width, uint32_t height,
+                      size_t stride, uint32_t threshold, uint32_t min_area,
+                      int eight_connected, uint32_t* labels,
+                      picam_component* components, size_t max_components);
+size_t picam_label_u16(const uint16_t* data, uint32_t width, uint32_t height,
+                       size_t stride, uint32_t threshold, uint32_t min_area,
+                       int eight_connected, uint32_t* labels,
+                       picam_component* components, size_t max_components);
+
+/**
+ * picam_label_u8/u16 with a threshold for each pixel: thresholds is width x
+ * height, tightly packed, e.g. from picam_background_threshold.
+ */
+size_t picam_label_adaptive_u8(const uint8_t* data, uint32_t width,
+                               uint32_t height, size_t stride,
+                               const uint16_t* thresholds, uint32_t min_area,
+                               int eight_connected, uint32_t* labels,
+                               picam_component* components,
+                               size_t max_components);
+size_t picam_label_adaptive_u16(const uint16_t* data, uint32_t width,
+                                uint32_t height, size_t stride,
+                                const uint16_t* thresholds, uint32_t min_area,
+                                int eight_connected, uint32_t* labels,
+                                picam_component* components,
+                                size_t max_components);
+
+/**
+ * Sum R, G and B of each of pixels packed pixels with channels (3 or 4)
+ * bytes each into out.
+ *
+ * @return 0, or -1 if channels isn't 3 or 4.
+ */
+int picam_luma_sum(const uint8_t* data, size_t pixels, uint32_t channels,
+                   uint16_t* out);
+
+/**
+ * Set bit i of mask (64 pixels per word, least significant bit first) iff
+ * data[i] >= threshold.
+ *
+ * @return The number of bits set.
+ */
+size_t picam_threshold_mask_u8(const uint8_t* data, size_t pixels,
+                               uint32_t threshold, uint64_t* mask);
+size_t picam_threshold_mask_u16(const uint16_t* data, size_t pixels,
+                                uint32_t threshold, uint64_t* mask);
+
+/**
+ * size x size median filter (size 3 or 5) with zero padding, like
+ * medfilt2d. Both planes are width x height with the same stride, in pixels.
+ *
+ * @return 0, or -1 if size isn't 3 or 5.
+ */
+int picam_median_u8(const uint8_t* data, uint32_t width, uint32_t height,
+                    size_t stride, uint32_t size, uint8_t* out);
+int picam_median_u16(const uint16_t* data, uint32_t width, uint32_t height,
+                     size_t stride, uint32_t size, uint16_t* out);
+
+/**
+ * Stacker, for co-adding frames; see stacker.hpp. Modes are
+ * Stacker::Mode's, in order: 0 sum, 1 mean, 2 max, 3 sigma-clipped mean.
+ * frames and period_ms of 0 mean no limit.
+ *
+ * @return Null if mode is out of range.
+ */
+typedef struct picam_stacker picam_stacker;
+picam_stacker* picam_stacker_new(uint32_t width, uint32_t height, int mode,
+                                 uint32_t frames, uint32_t period_ms,
+                                 float sigma);
+void picam_stacker_free(picam_stacker* stacker);
+
+/**
+ * Add a frame (width x height, stride in pixels).
+ *
+ * @return 1 if that completed a stack (see picam_stacker_take), 0 if not, or
+ *         -1 if the frame is the wrong size.
+ */
+int picam_stacker_add_u8(picam_stacker* stacker, const uint8_t* data,
+                         size_t stride);
+int picam_stacker_add_u16(picam_stacker* stacker, const uint16_t* data,
+                          size_t stride);
+
+/**
+ * Finish the current stack early.
+ *
+ * @return 1 if there was anything in it.
+ */
+int picam_stacker_flush(picam_stacker* stacker);
+
+/**
+ * Copy the latest completed stack (width x height floats) to out.
+ *
+ * @return The number of frames in it, or 0 if there isn't one.
+ */
+uint32_t picam_stacker_take(picam_stacker* stacker, float* out);
+
+/**
+ * RigidTransform: where a point of the reference lands in a frame. Rotate by
+ * theta radians about the origin, then shift by (dx, dy).
+ */
+typedef struct picam_transform {
+  double dx;
+  double dy;
+  double theta;
+} picam_transform;
+
+/**
+ * Registrar, for lining frames up with a reference; see registration.hpp.
+ * threshold and min_area are for finding the stars.
+ *
+ * @return Null if fft_size isn't a power of two.
+ */
+typedef struct picam_registrar picam_registrar;
+picam_registrar* picam_registrar_new(uint32_t fft_size, uint32_t threshold,
+                                     uint32_t min_area);
+void picam_registrar_free(picam_registrar* registrar);
+
+/**
+ * Make this frame (width x height, stride in pixels) the reference.
+ */
+void picam_registrar_reference_u8(picam_registrar* registrar,
+                                  const uint8_t* data, uint32_t width,
+                                  uint32_t height, size_t stride);
+void picam_registrar_reference_u16(picam_registrar* registrar,
+                                   const uint16_t* data, uint32_t width,
+                                   uint32_t height, size_t stride);
+
+/**
+ * Find the transform from the reference to this frame.
+ *
+ * @return The number of stars the fit used, 0 if it fell back on phase
+ *         correlation alone, or -1 if there's no reference or the frame is a
+ *         different size.
+ */
+int picam_registrar_align_u8(picam_registrar* registrar, const uint8_t* data,
+                             uint32_t width, uint32_t height, size_t stride,
+                             picam_transform* transform);
+int picam_registrar_align_u16(picam_registrar* registrar,
+                              const uint16_t* data, uint32_t width,
+                              uint32_t height, size_t stride,
+                              picam_transform* transform);
+
+/**
+ * Resample a frame onto the reference's grid: out(x, y) = data(transform(x,
+ * y)), bilinear, 0 outside. Both planes are width x height with the same
+ * stride, in pixels.
+ */
+void picam_warp_u8(const uint8_t* data, uint32_t width, uint32_t height,
+                   size_t stride, const picam_transform* transform,
+                   uint8_t* out);
+void picam_warp_u16(const uint16_t* data, uint32_t width, uint32_t height,
+                    size_t stride, const picam_transform* transform,
+                    uint16_t* out);
+
+/**
+ * Streak, from StreakDetector; see streak_detector.hpp.
+ */
+typedef struct picam_streak {
+  float x0;
+  float y0;
+  float x1;
+  float y1;
+  float length;
+  float angle;
+  float width;
+  float brightness;
+  uint32_t pixels;
+} picam_streak;
+
+/**
+ * StreakDetector, for finding aircraft, satellite and meteor trails in a
+ * sequence of width x height frames. The rest of its settings are the
+ * defaults.
+ */
+typedef struct picam_streak_detector picam_streak_detector;
+picam_streak_detector* picam_streak_detector_new(uint32_t width,
+                                                 uint32_t height,
+                                                 uint32_t threshold,
+                                                 float min_length);
+void picam_streak_detector_free(picam_streak_detector* detector);
+
+/**
+ * Look for streaks in the next frame (stride in pixels).
+ *
+ * @return The number of streaks (see picam_streak_detector_take), or -1 if
+ *         the frame is the wrong size.
+ */
+int picam_streak_detector_detect_u8(picam_streak_detector* detector,
+                                    const uint8_t* data, size_t stride);
+int picam_streak_detector_detect_u16(picam_streak_detector* detector,
+                                     const uint16_t* data, size_t stride);
+
+/**
+ * Copy the streaks the last frame had, longest first, to out.
+ */
+void picam_streak_detector_take(picam_streak_detector* detector,
+                                picam_streak* out);
+
+/**
+ * Forget the previous frame, e.g. after the camera has moved.
+ */
+void picam_streak_detector_reset(picam_streak_detector* detector);
+
+/**
+ * DarkKey: the settings a master dark fits; see dark_frame.hpp.
+ * temperature is a bucket, see picam_dark_temperature_bucket.
+ */
+typedef struct picam_dark_key {
+  uint32_t iso;
+  uint32_t shutter_us;
+  int32_t temperature;
+} picam_dark_key;
+
+/**
+ * Temperature bucket a reading in degrees C falls in.
+ */
+int32_t picam_dark_temperature_bucket(float celsius);
+
+/**
+ * DarkFrameBuilder, for median-stacking width x height dark exposures into a
+ * master dark.
+ */
+typedef struct picam_dark_builder picam_dark_builder;
+picam_dark_builder* picam_dark_builder_new(uint32_t width, uint32_t height);
+void picam_dark_builder_free(picam_dark_builder* builder);
+
+/**
+ * Add a dark exposure (stride in pixels).
+ *
+ * @return The number of frames so far, or -1 if the frame is the wrong size
+ *         or there are already as many as a master can take.
+ */
+int picam_dark_builder_add_u8(picam_dark_builder* builder,
+                              const uint8_t* data, size_t stride);
+int picam_dark_builder_add_u16(picam_dark_builder* builder,
+                               const uint16_t* data, size_t stride);
+
+/**
+ * Write the master to path, and drop the frames.
+ *
+ * @return The number of hot pixels, or -1 if there were no frames or the
+ *         file couldn't be written.
+ */
+long picam_dark_builder_write(picam_dark_builder* builder, const char* path,
+                              const picam_dark_key* key,
+                              uint16_t hot_threshold);
+
+/**
+ * DarkFrame: a master dark file, mapped into memory.
+ *
+ * @return Null if path can't be mapped or isn't a master dark.
+ */
+typedef struct picam_dark picam_dark;
+picam_dark* picam_dark_open(const char* path);
+void picam_dark_free(picam_dark* dark);
+
+/**
+ * What a master dark is for, and how many hot pixels it has.
+ */
+void picam_dark_info(const picam_dark* dark, picam_dark_key* key,
+                     uint32_t* width, uint32_t* height, uint32_t* frames,
+                     uint32_t* hot_pixels);
+
+/**
+ * Subtract the master dark from a frame and repair its hot pixels. Both
+ * planes are the master's size, with the same stride (in pixels); data and
+ * out may be the same.
+ *
+ * @return 0, or -1 if width and height aren't the master's.
+ */
+int picam_calibrate_u8(const picam_dark* dark, const uint8_t* data,
+                       uint32_t width, uint32_t height, size_t stride,
+                       uint8_t* out);
+int picam_calibrate_u16(const picam_dark* dark, const uint16_t* data,
+                        uint32_t width, uint32_t height, size_t stride,
+                        uint16_t* out);
+
+/**
+ * BackgroundEstimator, for the sky background and noise under a frame; see
+ * background.hpp. The rest of its settings are the defaults.
+ */
+typedef struct picam_background picam_background;
+picam_background* picam_background_new(uint32_t tile_size, float clip_sigma);
+void picam_background_free(picam_background* background);
+
+/**
+ * Estimate the background of a frame (stride in pixels).
+ *
+ * @return 0, or -1 if the frame is empty.
+ */
+int picam_background_estimate_u8(picam_background* background,
+                                 const uint8_t* data, uint32_t width,
+                                 uint32_t height, size_t stride);
+int picam_background_estimate_u16(picam_background* background,
+                                  const uint16_t* data, uint32_t width,
+                                  uint32_t height, size_t stride);
+
+/**
+ * The interpolated background and RMS of the last frame, width x height,
+ * tightly packed. Either may be null.
+ */
+void picam_background_maps(const picam_background* background, float* level,
+                           float* rms);
+
+/**
+ * The lowest value more than sigma RMS above the background at each pixel of
+ * the last frame, width x height, tightly packed.
+ */
+void picam_background_threshold(const picam_background* background,
+                                float sigma, uint16_t* out);
+
+/**
+ * Name of the kernel set picked for this CPU, e.g. "avx2".
+ */
+const char* picam_kernels(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PICAMPROC_H
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PLANE_HPP
+#define PLANE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+/**
+ * A 2D array of pixels in memory owned by someone else, e.g. a luminance
+ * plane. stride is the distance between rows, in pixels.
+ *
+ * Plane<T> converts to Plane<const T>, so functions that only read take the
+ * latter.
+ */
+template <typename T>
+struct Plane {
+  T* data;
+  uint32_t width;
+  uint32_t height;
+  size_t stride;
+
+  Plane()
+    : data{nullptr}
+    , width{0}
+    , height{0}
+    , stride{0}
+  { }
+
+  Plane(T* data, uint32_t width, uint32_t height, size_t stride)
+    : data{data}
+    , width{width}
+    , height{height}
+    , stride{stride}
+  { }
+
+  Plane(T* data, uint32_t width, uint32_t height)
+    : Plane{data, width, height, width}
+  { }
+
+  template <typename U,
+            typename = std::enable_if_t<std::is_same<const U, T>::value>>
+  Plane(const Plane<U>& other)
+    : Plane{other.data, other.width, other.height, other.stride}
+  { }
+
+  T* row(uint32_t y) const {
+    return data + y * stride;
+  }
+};
+
+#endif // PLANE_HPP
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REGISTRATION_HPP
+#define REGISTRATION_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "connected_components.hpp"
+#include "fft.hpp"
+#include "plane.hpp"
+#include "worker_pool.hpp"
+
+/**
+ * Where a point of the reference ends up in another frame: rotate by theta
+ * (radians, about the reference's origin) then shift by (dx, dy).
+ */
+struct RigidTransform {
+  double dx = 0.0;
+  double dy = 0.0;
+  double theta = 0.0;
+
+  void apply(double x, double y, double& outX, double& outY) const;
+};
+
+/**
+ * Works out how each frame has drifted from a reference frame, so it can be
+ * warped back before stacking.
+ *
+ * First, phase correlation on copies of both frames shrunk to fit a small
+ * FFT gives the shift to within a downsampled pixel, however far the sky
+ * has moved. That's enough to pair up the brightest stars in each frame, and
+ * a least-squares fit of their centroids gives the sub-pixel shift and any
+ * small rotation. If there aren't enough stars to pair up, the phase
+ * correlation shift is used on its own.
+ */
+class Registrar {
+  public:
+    struct Config {
+      // Side of the phase correlation FFT; a power of two
+      uint32_t fftSize = 512;
+      // Star detection
+      uint32_t threshold = 100;
+      uint32_t minArea = 2;
+      // Brightest stars to match
+      size_t maxStars = 200;
+      // Stars pair up if they're this close once the frame is shifted back
+      double matchRadius = 4.0;
+      // Fewer pairs than this and the star fit isn't trusted
+      size_t minMatches = 6;
+    };
+
+    struct Result {
+      // False if neither method found an answer; transform is then the
+      // identity
+      bool ok;
+      RigidTransform transform;
+      // From phase correlation alone
+      double coarseDx;
+      double coarseDy;
+      // Height of the correlation peak, from 0 to 1
+      double peak;
+      // Stars in the frame, and how many were paired with the reference's
+      size_t stars;
+      size_t matched;
+      // RMS distance between paired stars after the fit, in pixels
+      double rms;
+    };
+
+    explicit Registrar(const Config& config, WorkerPool* pool = nullptr);
+
+    Registrar(const Registrar&) = delete;
+    Registrar& operator=(const Registrar&) = delete;
+
+    /**
+     * Align later frames with this one. They have to be the same size.
+     */
+    void setReference(Plane<const uint8_t> frame);
+    void setReference(Plane<const uint16_t> frame);
+
+    /**
+     * Find the transform from the reference to frame.
+     */
+    Result align(Plane<const uint8_t> frame);
+    Result align(Plane<const uint16_t> frame);
+
+  private:
+    struct Star {
+      double x;
+      double y;
+      uint64_t flux;
+    };
+
+    template <typename T>
+    void setReferenceImpl(Plane<const T> frame);
+    template <typename T>
+    Result alignImpl(Plane<const T> frame);
+
+    /**
+     * Shrink frame into mSpectrum, windowed and without its mean, and
+     * transform it.
+     */
+    template <typename T>
+    void spectrum(Plane<const T> frame, std::vector<Fft2d::Complex>& out);
+    template <typename T>
+    void findStars(Plane<const T> frame, std::vector<Star>& stars);
+
+    /**
+     * Pair each reference star with the nearest star in the frame to where
+     * transform puts it, and fit a new transform to the pairs.
+     *
+     * @return Pairs used.
+     */
+    size_t fit(const std::vector<Star>& stars, double radius,
+               RigidTransform& transform, double& rms) const;
+
+    const Config mConfig;
+    WorkerPool* const mPool;
+    Fft2d mFft;
+    ComponentLabeller mLabeller;
+
+    uint32_t mWidth;
+    uint32_t mHeight;
+    // Downsampling factor to fit the FFT
+    uint32_t mFactor;
+    std::vector<float> mWindowX;
+    std::vector<float> mWindowY;
+    std::vector<Fft2d::Complex> mReferenceSpectrum;
+    std::vector<Star> mReferenceStars;
+
+    // Scratch, kept between frames
+    std::vector<Fft2d::Complex> mSpectrum;
+    std::vector<Component> mComponents;
+    std::vector<Star> mStars;
+};
+
+/**
+ * Resample frame onto the reference's pixel grid with bilinear
+ * interpolation: out(x, y) = in(transform(x, y)). Pixels that map outside
+ * in are 0. Rows are split into bands for the pool, and each band is done in
+ * tiles so the rows of in being read stay in cache.
+ *
+ * @return false if out isn't the same size as in.
+ */
+bool warpBilinear(Plane<const uint8_t> in, Plane<uint8_t> out,
+                  const RigidTransform& transform, WorkerPool* pool = nullptr);
+bool warpBilinear(Plane<const uint16_t> in, Plane<uint16_t> out,
+                  const RigidTransform& transform, WorkerPool* pool = nullptr);
+
+#endif // REGISTRATION_HPP
@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STACK_ROWS_HPP
+#define STACK_ROWS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "stacker.hpp"
+
+/**
+ * Row kernels for Stacker, written once with GCC vector extensions and built
+ * per instruction set by the stacker_*.cpp files, with VECTOR the register
+ * size in bytes: 16 for SSE2 and NEON, 32 for AVX2. With VECTOR 0 they're
+ * plain loops, the reference the others are checked against.
+ *
+ * Pixels are widened to signed 32-bit lanes, which is all SSE2 can compare
+ * or convert to float; they're 16 bits at most.
+ *
+ * Everything here has internal linkage, like median_network.hpp, so
+ * instantiations built with different -m flags don't get mixed up.
+ */
+namespace {
+
+template <typename T, size_t BYTES>
+struct VectorOf {
+  typedef T Type __attribute__((vector_size(BYTES)));
+};
+
+template <size_t VECTOR>
+struct StackVectors {
+  static const size_t LANES = VECTOR / 4;
+  using I32 = typename VectorOf<int32_t, VECTOR>::Type;
+  using U32 = typename VectorOf<uint32_t, VECTOR>::Type;
+  using F32 = typename VectorOf<float, VECTOR>::Type;
+  using U8 = typename VectorOf<uint8_t, LANES>::Type;
+  using U16 = typename VectorOf<uint16_t, 2 * LANES>::Type;
+};
+
+// Vectors go by reference: passing 32 bytes by value is a different ABI with
+// and without AVX, which GCC warns about even though these never leave the
+// file
+
+template <typename V>
+inline void loadVector(V& v, const void* p) {
+  memcpy(&v, p, sizeof(v));
+}
+
+template <typename V>
+inline void storeVector(void* p, const V& v) {
+  memcpy(p, &v, sizeof(v));
+}
+
+/**
+ * A vector of pixels, widened to 32-bit lanes.
+ */
+template <size_t VECTOR, typename T>
+inline void loadWide(typename StackVectors<VECTOR>::I32& v, const T* p) {
+  using Narrow = std::conditional_t<sizeof(T) == 1,
+                                    typename StackVectors<VECTOR>::U8,
+                                    typename StackVectors<VECTOR>::U16>;
+  Narrow narrow;
+  loadVector(narrow, p);
+  v = __builtin_convertvector(narrow, typename StackVectors<VECTOR>::I32);
+}
+
+/**
+ * mask ? a : b, lane by lane, with plain bitwise operations; ?: on vectors
+ * turns into scalar code without SSE4.1's blend.
+ */
+template <typename V, typename M>
+inline void select(V& out, const M& mask, const V& a, const V& b) {
+  out = (V)((mask & (M)a) | (~mask & (M)b));
+}
+
+template <typename T, size_t VECTOR>
+void addRow(const T* in, uint32_t* sum, size_t count) {
+  size_t i = 0;
+  if constexpr (VECTOR > 0) {
+    using V = StackVectors<VECTOR>;
+    for (; i + V::LANES <= count; i += V::LANES) {
+      typename V::I32 a, b;
+      loadVector(a, sum + i);
+      loadWide<VECTOR>(b, in + i);
+      a += b;
+      storeVector(sum + i, a);
+    }
+  }
+  for (; i < count; i++) {
+    sum[i] += in[i];
+  }
+}
+
+template <typename T, size_t VECTOR>
+void maxRow(const T* in, uint32_t* peak, size_t count) {
+  size_t i = 0;
+  if constexpr (VECTOR > 0) {
+    using V = StackVectors<VECTOR>;
+    for (; i + V::LANES <= count; i += V::LANES) {
+      // Peaks are pixel values too, so signed is fine
+      typename V::I32 a, b;
+      loadVector(a, peak + i);
+      loadWide<VECTOR>(b, in + i);
+      select(a, a > b, a, b);
+      storeVector(peak + i, a);
+    }
+  }
+  for (; i < count; i++) {
+    peak[i] = (peak[i] > in[i]) ? peak[i] : in[i];
+  }
+}
+
+/**
+ * One sigma-clipping step: Welford's running mean and sum of squared
+ * deviations over the samples kept so far, skipping the new sample if it's
+ * too far out. d^2 > sigma^2 * variance is tested as d^2 * n > sigma^2 * M2
+ * so there's no division, and the variance has a floor so a pixel that's
+ * been perfectly steady doesn't reject everything after.
+ */
+template <typename T, size_t VECTOR>
+void clipRow(const T* in, float* mean, float* m2, float* count, size_t n,
+             const StackClip& clip) {
+  const float sigma2 = clip.sigma * clip.sigma;
+  const float floor2 = clip.minSigma * clip.minSigma;
+  const float warmup = static_cast<float>(clip.warmup);
+  size_t i = 0;
+  if constexpr (VECTOR > 0) {
+    using V = StackVectors<VECTOR>;
+    for (; i + V::LANES <= n; i += V::LANES) {
+      typename V::I32 wide;
+      typename V::F32 m, q, c;
+      loadWide<VECTOR>(wide, in + i);
+      loadVector(m, mean + i);
+      loadVector(q, m2 + i);
+      loadVector(c, count + i);
+      const typename V::F32 x = __builtin_convertvector(wide,
+                                                        typename V::F32);
+      const typename V::F32 d = x - m;
+      typename V::F32 spread;
+      select(spread, q > c * floor2, q, c * floor2);
+      const typename V::I32 keep =
+        (c < warmup) | (d * d * c <= sigma2 * spread);
+      const typename V::F32 c1 = c + 1.0f;
+      const typename V::F32 m1 = m + d / c1;
+      const typename V::F32 q1 = q + d * (x - m1);
+      select(c, keep, c1, c);
+      select(m, keep, m1, m);
+      select(q, keep, q1, q);
+      storeVector(count + i, c);
+      storeVector(mean + i, m);
+      storeVector(m2 + i, q);
+    }
+  }
+  for (; i < n; i++) {
+    const float x = in[i];
+    const float c = count[i];
+    const float d = x - mean[i];
+    const float spread = (m2[i] > c * floor2) ? m2[i] : c * floor2;
+    if ((c < warmup) || (d * d * c <= sigma2 * spread)) {
+      count[i] = c + 1.0f;
+      mean[i] += d / (c + 1.0f);
+      m2[i] += d * (x - mean[i]);
+    }
+  }
+}
+
+template <size_t VECTOR>
+void toFloatRow(uint32_t* acc, float* out, size_t count, float scale) {
+  size_t i = 0;
+  if constexpr (VECTOR > 0) {
+    using V = StackVectors<VECTOR>;
+    const typename V::U32 zero = {};
+    for (; i + V::LANES <= count; i += V::LANES) {
+      // Sums can use all 32 bits; convert the halves separately (both
+      // exact) so there's one rounding, like the scalar conversion
+      typename V::U32 a;
+      loadVector(a, acc + i);
+      const auto high = __builtin_convertvector(
+        (typename V::I32)(a >> 16), typename V::F32);
+      const auto low = __builtin_convertvector(
+        (typename V::I32)(a & 0xFFFF), typename V::F32);
+      const typename V::F32 f = (high * 65536.0f + low) * scale;
+      storeVector(out + i, f);
+      storeVector(acc + i, zero);
+    }
+  }
+  for (; i < count; i++) {
+    out[i] = static_cast<float>(acc[i]) * scale;
+    acc[i] = 0;
+  }
+}
+
+template <size_t VECTOR>
+constexpr StackKernels makeStackKernels(const char* name) {
+  return StackKernels{
+    name,
+    addRow<uint8_t, VECTOR>,
+    addRow<uint16_t, VECTOR>,
+    maxRow<uint8_t, VECTOR>,
+    maxRow<uint16_t, VECTOR>,
+    clipRow<uint8_t, VECTOR>,
+    clipRow<uint16_t, VECTOR>,
+    toFloatRow<VECTOR>,
+  };
+}
+
+} // namespace
+
+#endif // STACK_ROWS_HPP
@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STACKER_HPP
+#define STACKER_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "plane.hpp"
+#include "worker_pool.hpp"
+
+/**
+ * Sigma-clipping parameters; see Stacker::Mode::SIGMA_CLIP.
+ */
+struct StackClip {
+  // Keep samples within this many standard deviations of the running mean
+  float sigma = 3.0f;
+  // Standard deviation to assume at least, in pixel values
+  float minSigma = 1.0f;
+  // Samples always kept at the start of each stack, to get the mean and
+  // deviation going
+  unsigned warmup = 3;
+};
+
+/**
+ * Row kernels behind Stacker: the plain-loop reference, and SIMD versions
+ * picked at runtime like MedianKernels.
+ */
+struct StackKernels {
+  const char* name;
+  // sum[i] += in[i]
+  void (*add8)(const uint8_t* in, uint32_t* sum, size_t count);
+  void (*add16)(const uint16_t* in, uint32_t* sum, size_t count);
+  // peak[i] = max(peak[i], in[i])
+  void (*max8)(const uint8_t* in, uint32_t* peak, size_t count);
+  void (*max16)(const uint16_t* in, uint32_t* peak, size_t count);
+  // One streaming sigma-clip step
+  void (*clip8)(const uint8_t* in, float* mean, float* m2, float* n,
+                size_t count, const StackClip& clip);
+  void (*clip16)(const uint16_t* in, float* mean, float* m2, float* n,
+                 size_t count, const StackClip& clip);
+  // out[i] = acc[i] * scale, acc[i] = 0
+  void (*toFloat)(uint32_t* acc, float* out, size_t count, float scale);
+};
+
+const StackKernels& stackKernels();
+
+const StackKernels& scalarStackKernels();
+
+/**
+ * Every set of kernels this CPU can run, scalar first.
+ */
+std::vector<const StackKernels*> supportedStackKernels();
+
+// Per-architecture kernel sets, built with their own -m flags; null when not
+// built for this CPU. supportedStackKernels() checks the CPU.
+const StackKernels* sse2StackKernels();
+const StackKernels* avx2StackKernels();
+const StackKernels* neonStackKernels();
+
+/**
+ * Co-adds frames as they arrive, and hands over a stack every so many frames
+ * or seconds.
+ *
+ * Frames are accumulated into 32-bit planes (floats for sigma clipping) a
+ * band of rows per worker, so memory use depends only on the frame size, not
+ * on how many frames go into a stack. Stacks are handed to the callback as a
+ * float plane that's only valid during the call.
+ */
+class Stacker {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    enum class Mode {
+      // Total of every frame
+      SUM,
+      // SUM divided by the number of frames
+      MEAN,
+      // Brightest value each pixel has had, e.g. to show streaks
+      MAX,
+      // Mean of each pixel's values, leaving out ones that are more than
+      // clip.sigma standard deviations from the mean of those before it
+      // (satellites, planes, cosmic rays)
+      SIGMA_CLIP,
+    };
+
+    struct Config {
+      uint32_t width = 0;
+      uint32_t height = 0;
+      Mode mode = Mode::SUM;
+      // Frames per stack; 0 for no limit
+      unsigned frames = 30;
+      // Hand over a stack once its first frame is this old; 0 for no limit
+      std::chrono::milliseconds period{0};
+      StackClip clip{};
+    };
+
+    struct Stack {
+      Mode mode;
+      unsigned frames;
+      // When the first and last frames were added
+      Clock::time_point start;
+      Clock::time_point end;
+      Plane<const float> pixels;
+    };
+
+    using StackCallback = std::function<void(const Stack&)>;
+
+    Stacker(const Config& config, StackCallback callback,
+            WorkerPool* pool = nullptr);
+
+    Stacker(const Stacker&) = delete;
+    Stacker& operator=(const Stacker&) = delete;
+
+    /**
+     * Add a frame, and hand over the stack if it's complete.
+     *
+     * @return false if the frame isn't the configured size.
+     */
+    bool add(Plane<const uint8_t> frame, Clock::time_point when = Clock::now());
+    bool add(Plane<const uint16_t> frame,
+             Clock::time_point when = Clock::now());
+
+    /**
+     * Hand over the frames added so far as a stack, if there are any.
+     */
+    void flush();
+
+    /**
+     * Frames in the current stack.
+     */
+    unsigned frames() const;
+
+    const Config& config() const;
+
+    /**
+     * Use particular kernels rather than the fastest, e.g. to compare them.
+     */
+    void setKernels(const StackKernels& kernels);
+
+  private:
+    template <typename T>
+    bool addImpl(Plane<const T> frame, Clock::time_point when);
+
+    const Config mConfig;
+    const StackCallback mCallback;
+    WorkerPool* const mPool;
+    const StackKernels* mKernels;
+
+    // SUM, MEAN and MAX accumulate here
+    std::vector<uint32_t> mAccumulator;
+    // SIGMA_CLIP keeps each pixel's mean, sum of squared deviations and
+    // sample count
+    std::vector<float> mMean;
+    std::vector<float> mM2;
+    std::vector<float> mCount;
+    // The stack handed to the callback (SIGMA_CLIP's is mMean)
+    std::vector<float> mOutput;
+
+    unsigned mFrames;
+    Clock::time_point mStart;
+    Clock::time_point mEnd;
+};
+
+#endif // STACKER_HPP
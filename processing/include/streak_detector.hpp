@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAK_DETECTOR_HPP
+#define STREAK_DETECTOR_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "plane.hpp"
+#include "worker_pool.hpp"
+
+/**
+ * A straight trail across a frame: an aircraft, satellite or meteor.
+ */
+struct Streak {
+  // Ends, in pixels
+  float x0;
+  float y0;
+  float x1;
+  float y1;
+  float length;
+  // Of the line from (x0, y0) to (x1, y1), from the x axis towards y, in
+  // [0, pi) radians
+  float angle;
+  // Across the streak, in pixels: sqrt(12) times the RMS distance of its
+  // pixels from the centre line, which is exact for an evenly lit band
+  float width;
+  // Mean value of its pixels, and how many there are
+  float brightness;
+  uint32_t pixels;
+};
+
+/**
+ * Finds streaks in each frame of a sequence, e.g. so only frames with
+ * something in them are kept at full resolution.
+ *
+ * Pixels at or above the threshold are found with the luma kernels. Any
+ * that were also above it in the previous frame (give or take
+ * staticRadius pixels) are dropped, so the horizon, lit windows and the
+ * stars don't keep turning up.
+ *
+ * Then each tile of the frame gets its own Hough transform, on the pool:
+ * the strongest line's pixels are pulled out, split into runs at gaps
+ * wider than maxGap, and their votes withdrawn before looking for the next
+ * line. Finally, runs that line up across tiles are joined, and the results
+ * at least minLength long are streaks.
+ */
+class StreakDetector {
+  public:
+    struct Config {
+      uint32_t width = 0;
+      uint32_t height = 0;
+      uint32_t threshold = 100;
+      // Pixels that were above threshold this close to them in the previous
+      // frame are ignored; 0 to not look at the previous frame at all. At
+      // most 63
+      uint32_t staticRadius = 2;
+      // Side of the tiles the Hough transform works on
+      uint32_t tileSize = 256;
+      // Hough angle steps over 180 degrees
+      uint32_t angles = 180;
+      // Pixels in one Hough bin for a tile to have a line
+      uint32_t minVotes = 25;
+      // Pixels this far either side of a line belong to it
+      float lineWidth = 2.5f;
+      // Runs of a line's pixels split where they're further apart than this
+      // along it; runs shorter than this are dropped (they're usually stars)
+      float maxGap = 8.0f;
+      // Joined runs need to be this long to be a streak
+      float minLength = 60.0f;
+      // Tiles with more of their pixels above threshold than this (e.g. the
+      // moon, or clouds lit from below) are skipped
+      float maxFill = 0.05f;
+      // Runs join into one streak if they're within this angle (radians),
+      // the shorter one's ends are this close to the longer one's line, and
+      // there's no more than joinGap between them: across tile edges, an
+      // aircraft's strobe going dark, or where a streak crosses something
+      // masked out
+      float mergeAngle = 0.05f;
+      float mergeDistance = 4.0f;
+      float joinGap = 40.0f;
+    };
+
+    StreakDetector(const Config& config, WorkerPool* pool = nullptr);
+
+    StreakDetector(const StreakDetector&) = delete;
+    StreakDetector& operator=(const StreakDetector&) = delete;
+
+    /**
+     * Look for streaks in the next frame of the sequence, longest first.
+     *
+     * @return false if the frame isn't the configured size.
+     */
+    bool detect(Plane<const uint8_t> frame, std::vector<Streak>& streaks);
+    bool detect(Plane<const uint16_t> frame, std::vector<Streak>& streaks);
+
+    /**
+     * Forget the previous frame, e.g. after the camera has moved.
+     */
+    void reset();
+
+    const Config& config() const;
+
+  private:
+    /**
+     * Sums over a set of pixels, enough for the line through them.
+     */
+    struct Moments {
+      double n = 0.0;
+      double x = 0.0;
+      double y = 0.0;
+      double xx = 0.0;
+      double xy = 0.0;
+      double yy = 0.0;
+      double value = 0.0;
+
+      void add(double px, double py, double pv);
+      void add(const Moments& other);
+      /**
+       * Centroid, direction of the principal axis, and the variance across
+       * it.
+       */
+      void line(double& cx, double& cy, double& dx, double& dy,
+                double& across) const;
+    };
+
+    /**
+     * A run of pixels along a line, and where it starts and ends.
+     */
+    struct Segment {
+      Moments moments;
+      double x0;
+      double y0;
+      double x1;
+      double y1;
+    };
+
+    template <typename T>
+    bool detectImpl(Plane<const T> frame, std::vector<Streak>& streaks);
+
+    /**
+     * Hough transform one tile, appending runs to segments.
+     */
+    template <typename T>
+    void houghTile(Plane<const T> frame, uint32_t tileX, uint32_t tileY,
+                   std::vector<Segment>& segments) const;
+
+    /**
+     * Join segments that continue each other, then keep the long ones.
+     */
+    template <typename T>
+    void join(Plane<const T> frame, std::vector<Segment>& segments,
+              std::vector<Streak>& streaks) const;
+
+    /**
+     * Follow a segment's line out from each end for as long as there are
+     * pixels on it, e.g. into a tile with too little of it for a Hough peak.
+     */
+    template <typename T>
+    void extend(Plane<const T> frame, Segment& segment) const;
+
+    const Config mConfig;
+    WorkerPool* const mPool;
+    const size_t mWords;
+    const uint32_t mTilesX;
+    const uint32_t mTilesY;
+    std::vector<float> mCos;
+    std::vector<float> mSin;
+
+    // Pixels above threshold this frame and last, mWords per row, and the
+    // ones that weren't above it last time
+    std::vector<uint64_t> mMask;
+    std::vector<uint64_t> mPrevious;
+    std::vector<uint64_t> mForeground;
+    bool mHavePrevious;
+
+    std::vector<std::vector<Segment>> mTileSegments;
+    std::vector<Segment> mSegments;
+};
+
+#endif // STREAK_DETECTOR_HPP
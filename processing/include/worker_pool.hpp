@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WORKER_POOL_HPP
+#define WORKER_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed set of threads for splitting one frame's work into pieces, e.g.
+ * bands of rows.
+ *
+ * run() hands out task indexes to the workers and the calling thread until
+ * they're all taken, and returns once every task has finished. The threads
+ * sleep between calls, so a pool can be kept around for the life of the
+ * program.
+ */
+class WorkerPool {
+  public:
+    // runBands()'s default: a few bands per thread, so one slow band
+    // doesn't hold up the rest
+    static const unsigned BANDS_PER_THREAD = 4;
+
+    /**
+     * @param threads Threads to run tasks on, counting the one that calls
+     *                run(). 0 means one per CPU.
+     */
+    explicit WorkerPool(unsigned threads = 0);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    /**
+     * Threads that run tasks, including the caller.
+     */
+    unsigned size() const {
+      return mThreads.size() + 1;
+    }
+
+    /**
+     * Call task(i) for every i in [0, count), in no particular order and
+     * possibly in parallel. Only one thread may call run() at a time.
+     */
+    void run(size_t count, const std::function<void(size_t)>& task);
+
+    /**
+     * Call task(y0, y1) for bands of rows covering [0, height), in parallel
+     * like run(), bandsPerThread of them per thread.
+     */
+    void runBands(uint32_t height,
+                  const std::function<void(uint32_t, uint32_t)>& task,
+                  unsigned bandsPerThread = BANDS_PER_THREAD);
+
+    /**
+     * runBands() on pool, or task(0, height) on the calling thread if pool
+     * is null.
+     */
+    static void runBands(WorkerPool* pool, uint32_t height,
+                         const std::function<void(uint32_t, uint32_t)>& task,
+                         unsigned bandsPerThread = BANDS_PER_THREAD);
+
+    /**
+     * How many bands runBands() would split height rows into; 1 if pool is
+     * null.
+     */
+    static size_t bandCount(const WorkerPool* pool, uint32_t height,
+                            unsigned bandsPerThread = BANDS_PER_THREAD);
+
+    /**
+     * First row of band b of count, out of height rows. Band b ends where
+     * band b + 1 starts.
+     */
+    static uint32_t bandStart(uint32_t height, size_t count, size_t b) {
+      return static_cast<uint32_t>(height * b / count);
+    }
+
+  private:
+    void work();
+    void drain();
+
+    std::vector<std::thread> mThreads;
+
+    std::mutex mMutex;
+    std::condition_variable mStartCv;
+    std::condition_variable mDoneCv;
+    const std::function<void(size_t)>* mTask;
+    size_t mCount;
+    std::atomic<size_t> mNext;
+    // Workers still busy with the current call
+    unsigned mActive;
+    uint64_t mGeneration;
+    bool mStopping;
+};
+
+#endif // WORKER_POOL_HPP
@@ -0,0 +1,45 @@
+#!/usr/bin/env python
+# coding: utf-8
+
+# Median-stack dark exposures (lens covered, same ISO and shutter speed as
+# the frames they're for) into a master dark for picamproc.DarkFrame.
+
+import argparse as ap
+import os
+
+import numpy as np
+from PIL import Image
+
+import picamproc
+
+parser = ap.ArgumentParser()
+parser.add_argument('input_files', type=str, nargs='+',
+                    help='Dark exposures, at most 32')
+parser.add_argument('-o', '--output-dir', type=str, default='darks',
+                    help='Directory to put the master dark in')
+parser.add_argument('--iso', type=int, default=800)
+parser.add_argument('--shutter-us', type=int, default=60000000,
+                    help='Shutter speed, in microseconds')
+parser.add_argument('--temperature', type=float, required=True,
+                    help='Sensor temperature while the darks were taken, '
+                    'degrees C')
+parser.add_argument('--hot-threshold', type=int, default=40,
+                    help='How far above its neighbours a pixel has to be '
+                    'to count as hot, on R + G + B')
+args = parser.parse_args()
+
+builder = None
+for path in args.input_files:
+    img_l = picamproc.luma_sum(np.array(Image.open(path).convert('RGB')))
+    if builder is None:
+        height, width = img_l.shape
+        builder = picamproc.DarkFrameBuilder(width, height)
+    builder.add(img_l)
+
+bucket = picamproc.temperature_bucket(args.temperature)
+os.makedirs(args.output_dir, exist_ok=True)
+output = os.path.join(args.output_dir,
+                      f'iso{args.iso}-{args.shutter_us}us-t{bucket}.dark')
+hot = builder.write(output, args.iso, args.shutter_us, args.temperature,
+                    args.hot_threshold)
+print(f'{output}: {len(args.input_files)} frames, {hot} hot pixels')
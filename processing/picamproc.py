@@ -0,0 +1,693 @@
+#!/usr/bin/env python
+# coding: utf-8
+
+# ctypes bindings for the native processing library. Run `make` in this
+# directory first to build libpicamproc.so.
+
+import ctypes
+import os
+
+import numpy as np
+
+_lib = ctypes.CDLL(os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                'libpicamproc.so'))
+
+# Matches picam_component in include/picamproc.h
+COMPONENT_DTYPE = np.dtype([
+    ('area', np.uint32),
+    ('min_x', np.uint32),
+    ('min_y', np.uint32),
+    ('max_x', np.uint32),
+    ('max_y', np.uint32),
+    ('flux', np.uint64),
+    ('x', np.float64),
+    ('y', np.float64),
+    ('peak', np.uint32),
+    ('peak_x', np.uint32),
+    ('peak_y', np.uint32),
+], align=True)
+
+# Matches picam_streak in include/picamproc.h
+STREAK_DTYPE = np.dtype([
+    ('x0', np.float32),
+    ('y0', np.float32),
+    ('x1', np.float32),
+    ('y1', np.float32),
+    ('length', np.float32),
+    ('angle', np.float32),
+    ('width', np.float32),
+    ('brightness', np.float32),
+    ('pixels', np.uint32),
+], align=True)
+
+_LABEL_ARGTYPES = [
+    ctypes.c_void_p,   # data
+    ctypes.c_uint32,   # width
+    ctypes.c_uint32,   # height
+    ctypes.c_size_t,   # stride
+    ctypes.c_uint32,   # threshold
+    ctypes.c_uint32,   # min_area
+    ctypes.c_int,      # eight_connected
+    ctypes.c_void_p,   # labels
+    ctypes.c_void_p,   # components
+    ctypes.c_size_t,   # max_components
+]
+for _f in (_lib.picam_label_u8, _lib.picam_label_u16):
+    _f.argtypes = _LABEL_ARGTYPES
+    _f.restype = ctypes.c_size_t
+
+for _f in (_lib.picam_label_adaptive_u8, _lib.picam_label_adaptive_u16):
+    _f.argtypes = [
+        ctypes.c_void_p,   # data
+        ctypes.c_uint32,   # width
+        ctypes.c_uint32,   # height
+        ctypes.c_size_t,   # stride
+        ctypes.c_void_p,   # thresholds
+        ctypes.c_uint32,   # min_area
+        ctypes.c_int,      # eight_connected
+        ctypes.c_void_p,   # labels
+        ctypes.c_void_p,   # components
+        ctypes.c_size_t,   # max_components
+    ]
+    _f.restype = ctypes.c_size_t
+
+_lib.picam_luma_sum.argtypes = [
+    ctypes.c_void_p,   # data
+    ctypes.c_size_t,   # pixels
+    ctypes.c_uint32,   # channels
+    ctypes.c_void_p,   # out
+]
+_lib.picam_luma_sum.restype = ctypes.c_int
+
+for _f in (_lib.picam_threshold_mask_u8, _lib.picam_threshold_mask_u16):
+    _f.argtypes = [
+        ctypes.c_void_p,   # data
+        ctypes.c_size_t,   # pixels
+        ctypes.c_uint32,   # threshold
+        ctypes.c_void_p,   # mask
+    ]
+    _f.restype = ctypes.c_size_t
+
+for _f in (_lib.picam_median_u8, _lib.picam_median_u16):
+    _f.argtypes = [
+        ctypes.c_void_p,   # data
+        ctypes.c_uint32,   # width
+        ctypes.c_uint32,   # height
+        ctypes.c_size_t,   # stride
+        ctypes.c_uint32,   # size
+        ctypes.c_void_p,   # out
+    ]
+    _f.restype = ctypes.c_int
+
+_lib.picam_stacker_new.argtypes = [
+    ctypes.c_uint32,   # width
+    ctypes.c_uint32,   # height
+    ctypes.c_int,      # mode
+    ctypes.c_uint32,   # frames
+    ctypes.c_uint32,   # period_ms
+    ctypes.c_float,    # sigma
+]
+_lib.picam_stacker_new.restype = ctypes.c_void_p
+_lib.picam_stacker_free.argtypes = [ctypes.c_void_p]
+_lib.picam_stacker_free.restype = None
+for _f in (_lib.picam_stacker_add_u8, _lib.picam_stacker_add_u16):
+    _f.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t]
+    _f.restype = ctypes.c_int
+_lib.picam_stacker_flush.argtypes = [ctypes.c_void_p]
+_lib.picam_stacker_flush.restype = ctypes.c_int
+_lib.picam_stacker_take.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+_lib.picam_stacker_take.restype = ctypes.c_uint32
+
+
+class Transform(ctypes.Structure):
+    # Matches picam_transform in include/picamproc.h
+    _fields_ = [
+        ('dx', ctypes.c_double),
+        ('dy', ctypes.c_double),
+        ('theta', ctypes.c_double),
+    ]
+
+    def __repr__(self):
+        return f'Transform(dx={self.dx}, dy={self.dy}, theta={self.theta})'
+
+_lib.picam_registrar_new.argtypes = [
+    ctypes.c_uint32,   # fft_size
+    ctypes.c_uint32,   # threshold
+    ctypes.c_uint32,   # min_area
+]
+_lib.picam_registrar_new.restype = ctypes.c_void_p
+_lib.picam_registrar_free.argtypes = [ctypes.c_void_p]
+_lib.picam_registrar_free.restype = None
+for _f in (_lib.picam_registrar_reference_u8,
+           _lib.picam_registrar_reference_u16):
+    _f.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint32,
+                   ctypes.c_uint32, ctypes.c_size_t]
+    _f.restype = None
+for _f in (_lib.picam_registrar_align_u8, _lib.picam_registrar_align_u16):
+    _f.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint32,
+                   ctypes.c_uint32, ctypes.c_size_t,
+                   ctypes.POINTER(Transform)]
+    _f.restype = ctypes.c_int
+for _f in (_lib.picam_warp_u8, _lib.picam_warp_u16):
+    _f.argtypes = [ctypes.c_void_p, ctypes.c_uint32, ctypes.c_uint32,
+                   ctypes.c_size_t, ctypes.POINTER(Transform),
+                   ctypes.c_void_p]
+    _f.restype = None
+
+_lib.picam_streak_detector_new.argtypes = [
+    ctypes.c_uint32,   # width
+    ctypes.c_uint32,   # height
+    ctypes.c_uint32,   # threshold
+    ctypes.c_float,    # min_length
+]
+_lib.picam_streak_detector_new.restype = ctypes.c_void_p
+_lib.picam_streak_detector_free.argtypes = [ctypes.c_void_p]
+_lib.picam_streak_detector_free.restype = None
+for _f in (_lib.picam_streak_detector_detect_u8,
+           _lib.picam_streak_detector_detect_u16):
+    _f.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t]
+    _f.restype = ctypes.c_int
+_lib.picam_streak_detector_take.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+_lib.picam_streak_detector_take.restype = None
+_lib.picam_streak_detector_reset.argtypes = [ctypes.c_void_p]
+_lib.picam_streak_detector_reset.restype = None
+
+class DarkKey(ctypes.Structure):
+    '''
+    Matches picam_dark_key: the settings a master dark fits, temperature
+    being a bucket (see temperature_bucket).
+    '''
+    _fields_ = [
+        ('iso', ctypes.c_uint32),
+        ('shutter_us', ctypes.c_uint32),
+        ('temperature', ctypes.c_int32),
+    ]
+
+    def __repr__(self):
+        return (f'DarkKey(iso={self.iso}, shutter_us={self.shutter_us}, '
+                f'temperature={self.temperature})')
+
+_lib.picam_dark_temperature_bucket.argtypes = [ctypes.c_float]
+_lib.picam_dark_temperature_bucket.restype = ctypes.c_int32
+_lib.picam_dark_builder_new.argtypes = [ctypes.c_uint32, ctypes.c_uint32]
+_lib.picam_dark_builder_new.restype = ctypes.c_void_p
+_lib.picam_dark_builder_free.argtypes = [ctypes.c_void_p]
+_lib.picam_dark_builder_free.restype = None
+for _f in (_lib.picam_dark_builder_add_u8, _lib.picam_dark_builder_add_u16):
+    _f.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t]
+    _f.restype = ctypes.c_int
+_lib.picam_dark_builder_write.argtypes = [
+    ctypes.c_void_p,   # builder
+    ctypes.c_char_p,   # path
+    ctypes.POINTER(DarkKey),
+    ctypes.c_uint16,   # hot_threshold
+]
+_lib.picam_dark_builder_write.restype = ctypes.c_long
+_lib.picam_dark_open.argtypes = [ctypes.c_char_p]
+_lib.picam_dark_open.restype = ctypes.c_void_p
+_lib.picam_dark_free.argtypes = [ctypes.c_void_p]
+_lib.picam_dark_free.restype = None
+_lib.picam_dark_info.argtypes = [
+    ctypes.c_void_p,   # dark
+    ctypes.POINTER(DarkKey),
+    ctypes.POINTER(ctypes.c_uint32),   # width
+    ctypes.POINTER(ctypes.c_uint32),   # height
+    ctypes.POINTER(ctypes.c_uint32),   # frames
+    ctypes.POINTER(ctypes.c_uint32),   # hot_pixels
+]
+_lib.picam_dark_info.restype = None
+for _f in (_lib.picam_calibrate_u8, _lib.picam_calibrate_u16):
+    _f.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint32,
+                   ctypes.c_uint32, ctypes.c_size_t, ctypes.c_void_p]
+    _f.restype = ctypes.c_int
+
+_lib.picam_background_new.argtypes = [ctypes.c_uint32, ctypes.c_float]
+_lib.picam_background_new.restype = ctypes.c_void_p
+_lib.picam_background_free.argtypes = [ctypes.c_void_p]
+_lib.picam_background_free.restype = None
+for _f in (_lib.picam_background_estimate_u8,
+           _lib.picam_background_estimate_u16):
+    _f.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint32,
+                   ctypes.c_uint32, ctypes.c_size_t]
+    _f.restype = ctypes.c_int
+_lib.picam_background_maps.argtypes = [ctypes.c_void_p, ctypes.c_void_p,
+                                       ctypes.c_void_p]
+_lib.picam_background_maps.restype = None
+_lib.picam_background_threshold.argtypes = [ctypes.c_void_p, ctypes.c_float,
+                                            ctypes.c_void_p]
+_lib.picam_background_threshold.restype = None
+
+_lib.picam_kernels.argtypes = []
+_lib.picam_kernels.restype = ctypes.c_char_p
+
+
+def kernels():
+    '''
+    Name of the SIMD kernels picked for this CPU.
+    '''
+    return _lib.picam_kernels().decode()
+
+
+def luma_sum(image):
+    '''
+    R + G + B of each pixel of an RGB or RGBA image, as uint16; the same as
+    np.delete(image, 3, 2).sum(axis=2) for RGBA.
+    '''
+    image = np.ascontiguousarray(image, dtype=np.uint8)
+    height, width, channels = image.shape
+    out = np.empty((height, width), dtype=np.uint16)
+    if _lib.picam_luma_sum(image.ctypes.data, width * height, channels,
+                           out.ctypes.data) != 0:
+        raise ValueError(f'Expected 3 or 4 channels, got {channels}')
+    return out
+
+
+def threshold_mask(image, threshold):
+    '''
+    Boolean mask of the pixels >= threshold in a uint8 or uint16 image.
+    '''
+    image = np.asarray(image)
+    if image.dtype == np.uint8:
+        fn = _lib.picam_threshold_mask_u8
+    else:
+        image = np.clip(image, 0, 65535).astype(np.uint16)
+        fn = _lib.picam_threshold_mask_u16
+    image = np.ascontiguousarray(image)
+    words = np.empty((image.size + 63) // 64, dtype=np.uint64)
+    fn(image.ctypes.data, image.size, int(threshold), words.ctypes.data)
+    bits = np.unpackbits(words.view(np.uint8), bitorder='little')
+    return bits[:image.size].reshape(image.shape).astype(bool)
+
+
+def label(image, threshold, min_area=1, eight_connected=True):
+    '''
+    Find the connected regions of pixels >= threshold in a 2D luminance image.
+    threshold is a number, or an array of one per pixel (see
+    Background.threshold).
+
+    Returns (labels, components): labels holds each pixel's region number
+    (index into components plus one, 0 for background), and components is an
+    array of COMPONENT_DTYPE with each region's area, bounding box, flux,
+    flux-weighted centroid and peak, in raster order.
+    '''
+    image = np.asarray(image)
+    adaptive = np.ndim(threshold) > 0
+    if image.dtype == np.uint8:
+        fn = _lib.picam_label_adaptive_u8 if adaptive else _lib.picam_label_u8
+    else:
+        # e.g. the float sums of R, G and B the scripts work with
+        image = np.clip(image, 0, 65535).astype(np.uint16)
+        fn = _lib.picam_label_adaptive_u16 if adaptive else _lib.picam_label_u16
+    image = np.ascontiguousarray(image)
+    height, width = image.shape
+    if adaptive:
+        threshold = np.ascontiguousarray(np.clip(threshold, 0, 65535),
+                                         dtype=np.uint16)
+        if threshold.shape != image.shape:
+            raise ValueError(f'Expected {image.shape} thresholds, got '
+                             f'{threshold.shape}')
+        threshold_arg = threshold.ctypes.data
+    else:
+        threshold_arg = int(threshold)
+
+    labels = np.empty(image.shape, dtype=np.uint32)
+    capacity = 4096
+    while True:
+        components = np.empty(capacity, dtype=COMPONENT_DTYPE)
+        count = fn(image.ctypes.data, width, height, width, threshold_arg,
+                   int(min_area), int(eight_connected), labels.ctypes.data,
+                   components.ctypes.data, capacity)
+        if count <= capacity:
+            return labels, components[:count]
+        capacity = count
+
+
+def median_filter(image, size=3):
+    '''
+    size x size (3 or 5) median filter of a 2D uint8 or uint16 image, with
+    zero padding like scipy.signal.medfilt2d. Other types are clipped to
+    uint16.
+    '''
+    image = np.asarray(image)
+    if image.dtype == np.uint8:
+        fn = _lib.picam_median_u8
+    else:
+        image = np.clip(image, 0, 65535).astype(np.uint16)
+        fn = _lib.picam_median_u16
+    image = np.ascontiguousarray(image)
+    height, width = image.shape
+    out = np.empty_like(image)
+    if fn(image.ctypes.data, width, height, width, size, out.ctypes.data) != 0:
+        raise ValueError(f'Unsupported median size {size}')
+    return out
+
+
+class Background:
+    '''
+    The sky background and its noise under a frame, estimated per tile and
+    interpolated, so detection thresholds can follow gradients from skyglow
+    and moonlight. See background.hpp.
+    '''
+
+    def __init__(self, tile_size=64, clip_sigma=3.0):
+        self._background = _lib.picam_background_new(tile_size, clip_sigma)
+        self.shape = None
+
+    def __del__(self):
+        if getattr(self, '_background', None):
+            _lib.picam_background_free(self._background)
+            self._background = None
+
+    def estimate(self, image):
+        '''
+        Estimate the background of a 2D uint8 or uint16 image (others are
+        clipped to uint16). The methods below are then for its shape.
+        '''
+        image, fn = _u8_or_u16(image, _lib.picam_background_estimate_u8,
+                               _lib.picam_background_estimate_u16)
+        height, width = image.shape
+        if fn(self._background, image.ctypes.data, width, height, width) != 0:
+            raise ValueError('Empty image')
+        self.shape = image.shape
+        return self
+
+    def background(self):
+        '''
+        The background level at each pixel, as float32.
+        '''
+        level = np.empty(self.shape, dtype=np.float32)
+        _lib.picam_background_maps(self._background, level.ctypes.data, None)
+        return level
+
+    def rms(self):
+        '''
+        The background noise (standard deviation) at each pixel, as float32.
+        '''
+        rms = np.empty(self.shape, dtype=np.float32)
+        _lib.picam_background_maps(self._background, None, rms.ctypes.data)
+        return rms
+
+    def threshold(self, sigma=5.0):
+        '''
+        Per-pixel detection thresholds, sigma RMS above the background, as
+        uint16; pass to label().
+        '''
+        out = np.empty(self.shape, dtype=np.uint16)
+        _lib.picam_background_threshold(self._background, sigma,
+                                        out.ctypes.data)
+        return out
+
+
+class Stacker:
+    '''
+    Co-adds frames in native code, handing back a stack every `frames`
+    frames or `period` seconds (0 for no limit on either). See stacker.hpp.
+    '''
+
+    SUM = 0
+    MEAN = 1
+    MAX = 2
+    SIGMA_CLIP = 3
+
+    def __init__(self, width, height, mode=SUM, frames=30, period=0,
+                 sigma=3.0):
+        self.shape = (height, width)
+        self._stacker = _lib.picam_stacker_new(width, height, mode, frames,
+                                               int(period * 1000), sigma)
+        if not self._stacker:
+            raise ValueError(f'Unknown stacking mode {mode}')
+
+    def __del__(self):
+        if getattr(self, '_stacker', None):
+            _lib.picam_stacker_free(self._stacker)
+            self._stacker = None
+
+    def add(self, image):
+        '''
+        Add a 2D luminance frame (uint8, or anything else as uint16). Returns
+        the stack as a float32 array if this frame completed one, else None.
+        '''
+        image = np.asarray(image)
+        if image.dtype == np.uint8:
+            fn = _lib.picam_stacker_add_u8
+        else:
+            image = np.clip(image, 0, 65535).astype(np.uint16)
+            fn = _lib.picam_stacker_add_u16
+        image = np.ascontiguousarray(image)
+        rc = fn(self._stacker, image.ctypes.data, image.shape[1])
+        if rc < 0:
+            raise ValueError(f'Expected a {self.shape} frame, got {image.shape}')
+        return self._take() if rc > 0 else None
+
+    def flush(self):
+        '''
+        The frames added since the last stack, stacked, or None if there
+        aren't any.
+        '''
+        if _lib.picam_stacker_flush(self._stacker) > 0:
+            return self._take()
+        return None
+
+    def _take(self):
+        stack = np.empty(self.shape, dtype=np.float32)
+        _lib.picam_stacker_take(self._stacker, stack.ctypes.data)
+        return stack
+
+
+def _u8_or_u16(image, u8_fn, u16_fn):
+    image = np.asarray(image)
+    if image.dtype == np.uint8:
+        return np.ascontiguousarray(image), u8_fn
+    image = np.clip(image, 0, 65535).astype(np.uint16)
+    return np.ascontiguousarray(image), u16_fn
+
+
+def warp(image, transform):
+    '''
+    Resample a 2D uint8 or uint16 image (others are clipped to uint16) so
+    it lines up with the reference transform was measured against.
+    '''
+    image, fn = _u8_or_u16(image, _lib.picam_warp_u8, _lib.picam_warp_u16)
+    height, width = image.shape
+    out = np.empty_like(image)
+    fn(image.ctypes.data, width, height, width, ctypes.byref(transform),
+       out.ctypes.data)
+    return out
+
+
+class Registrar:
+    '''
+    Measures how frames have drifted and rotated from a reference frame, to
+    sub-pixel accuracy, so they can be warped back before stacking. See
+    registration.hpp.
+    '''
+
+    def __init__(self, fft_size=512, threshold=100, min_area=2):
+        self._registrar = _lib.picam_registrar_new(fft_size, threshold,
+                                                   min_area)
+        if not self._registrar:
+            raise ValueError(f'fft_size {fft_size} isn\'t a power of two')
+        self.shape = None
+
+    def __del__(self):
+        if getattr(self, '_registrar', None):
+            _lib.picam_registrar_free(self._registrar)
+            self._registrar = None
+
+    def set_reference(self, image):
+        image, fn = _u8_or_u16(image, _lib.picam_registrar_reference_u8,
+                               _lib.picam_registrar_reference_u16)
+        height, width = image.shape
+        fn(self._registrar, image.ctypes.data, width, height, width)
+        self.shape = image.shape
+
+    def align(self, image):
+        '''
+        The Transform from the reference to image, and the number of stars
+        that went into it (0 if it's from phase correlation alone).
+        '''
+        image, fn = _u8_or_u16(image, _lib.picam_registrar_align_u8,
+                               _lib.picam_registrar_align_u16)
+        height, width = image.shape
+        transform = Transform()
+        matched = fn(self._registrar, image.ctypes.data, width, height, width,
+                     ctypes.byref(transform))
+        if matched < 0:
+            raise ValueError(f'Expected a {self.shape} frame, got {image.shape}')
+        return transform, matched
+
+    def register(self, image):
+        '''
+        image, warped to line up with the reference. The first frame becomes
+        the reference.
+        '''
+        if self.shape is None:
+            self.set_reference(image)
+            return image
+        transform, _ = self.align(image)
+        return warp(image, transform)
+
+
+class StreakDetector:
+    '''
+    Finds aircraft, satellite and meteor trails in a sequence of frames,
+    ignoring anything that was already there in the previous frame. See
+    streak_detector.hpp.
+    '''
+
+    def __init__(self, width, height, threshold=100, min_length=60):
+        self.shape = (height, width)
+        self._detector = _lib.picam_streak_detector_new(width, height,
+                                                        int(threshold),
+                                                        min_length)
+
+    def __del__(self):
+        if getattr(self, '_detector', None):
+            _lib.picam_streak_detector_free(self._detector)
+            self._detector = None
+
+    def detect(self, image):
+        '''
+        The streaks in the next 2D luminance frame, longest first, as an array
+        of STREAK_DTYPE: ends, length, angle (radians), width, brightness and
+        pixel count.
+        '''
+        image, fn = _u8_or_u16(image, _lib.picam_streak_detector_detect_u8,
+                               _lib.picam_streak_detector_detect_u16)
+        count = fn(self._detector, image.ctypes.data, image.shape[1])
+        if count < 0:
+            raise ValueError(f'Expected a {self.shape} frame, got {image.shape}')
+        streaks = np.empty(count, dtype=STREAK_DTYPE)
+        _lib.picam_streak_detector_take(self._detector, streaks.ctypes.data)
+        return streaks
+
+    def reset(self):
+        '''
+        Forget the previous frame, e.g. after the camera has moved.
+        '''
+        _lib.picam_streak_detector_reset(self._detector)
+
+
+def temperature_bucket(celsius):
+    '''
+    The temperature bucket master darks are filed under for a reading in
+    degrees C.
+    '''
+    return _lib.picam_dark_temperature_bucket(celsius)
+
+
+class DarkFrameBuilder:
+    '''
+    Median-stacks dark exposures (taken with the lens covered) into a master
+    dark. See dark_frame.hpp.
+    '''
+
+    def __init__(self, width, height):
+        self.shape = (height, width)
+        self._builder = _lib.picam_dark_builder_new(width, height)
+
+    def __del__(self):
+        if getattr(self, '_builder', None):
+            _lib.picam_dark_builder_free(self._builder)
+            self._builder = None
+
+    def add(self, image):
+        '''
+        Add a 2D uint8 or uint16 dark exposure, and return how many there are
+        now.
+        '''
+        image, fn = _u8_or_u16(image, _lib.picam_dark_builder_add_u8,
+                               _lib.picam_dark_builder_add_u16)
+        count = fn(self._builder, image.ctypes.data, image.shape[1])
+        if count < 0:
+            raise ValueError(f'Expected a {self.shape} frame, got '
+                             f'{image.shape}, or too many frames')
+        return count
+
+    def write(self, path, iso, shutter_us, temperature, hot_threshold=40):
+        '''
+        Write the master for frames taken at this ISO, shutter speed and
+        temperature (degrees C) to path, and start over. Returns the number
+        of hot pixels.
+        '''
+        key = DarkKey(iso, shutter_us, temperature_bucket(temperature))
+        hot = _lib.picam_dark_builder_write(self._builder,
+                                            os.fsencode(path),
+                                            ctypes.byref(key), hot_threshold)
+        if hot < 0:
+            raise OSError(f'Couldn\'t write a master dark to {path}')
+        return hot
+
+
+class DarkFrame:
+    '''
+    A master dark file, mapped into memory, for calibrating frames.
+    '''
+
+    def __init__(self, path):
+        self.path = path
+        self._dark = _lib.picam_dark_open(os.fsencode(path))
+        if not self._dark:
+            raise ValueError(f'{path} isn\'t a master dark')
+        self.key = DarkKey()
+        width, height = ctypes.c_uint32(), ctypes.c_uint32()
+        frames, hot = ctypes.c_uint32(), ctypes.c_uint32()
+        _lib.picam_dark_info(self._dark, ctypes.byref(self.key),
+                             ctypes.byref(width), ctypes.byref(height),
+                             ctypes.byref(frames), ctypes.byref(hot))
+        self.shape = (height.value, width.value)
+        self.frames = frames.value
+        self.hot_pixels = hot.value
+
+    def __del__(self):
+        if getattr(self, '_dark', None):
+            _lib.picam_dark_free(self._dark)
+            self._dark = None
+
+    def calibrate(self, image):
+        '''
+        image (2D uint8 or uint16) with the master dark subtracted and its
+        hot pixels filled in from their neighbours.
+        '''
+        image, fn = _u8_or_u16(image, _lib.picam_calibrate_u8,
+                               _lib.picam_calibrate_u16)
+        height, width = image.shape
+        out = np.empty_like(image)
+        if fn(self._dark, image.ctypes.data, width, height, width,
+              out.ctypes.data) < 0:
+            raise ValueError(f'Expected a {self.shape} frame, got '
+                             f'{image.shape}')
+        return out
+
+
+class DarkLibrary:
+    '''
+    The master darks (*.dark) in a directory. Like DarkLibrary in
+    dark_frame.hpp, a master only fits frames with the same ISO, shutter
+    speed and size, and the nearest temperature wins.
+    '''
+
+    def __init__(self, directory):
+        self.darks = []
+        for name in sorted(os.listdir(directory)):
+            if name.endswith('.dark'):
+                try:
+                    self.darks.append(DarkFrame(os.path.join(directory, name)))
+                except ValueError:
+                    pass
+
+    def find(self, iso, shutter_us, temperature, shape):
+        '''
+        The DarkFrame for frames of this shape taken at this ISO, shutter
+        speed and temperature (degrees C), or None.
+        '''
+        bucket = temperature_bucket(temperature)
+        best = None
+        for dark in self.darks:
+            if (dark.key.iso != iso or dark.key.shutter_us != shutter_us or
+                    dark.shape != tuple(shape)):
+                continue
+            distance = abs(dark.key.temperature - bucket)
+            if best is None or distance < best[0]:
+                best = (distance, dark)
+        return None if best is None else best[1]
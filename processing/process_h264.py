@@ -5,6 +5,8 @@ import numpy as np
 import matplotlib.pyplot as plt
 from matplotlib.animation import FuncAnimation
 
+import picamproc
+
 fps = 10
 
 parser = ap.ArgumentParser()
@@ -50,28 +52,21 @@ coadd_img = coadd_ax.imshow(np.zeros(shape, dtype=np.uint32), cmap='gray')
 #            count = 0
 
 
-coadd = np.zeros(shape)
-count = 0
 coadd_frames = 30
+stacker = picamproc.Stacker(width, height, frames=coadd_frames)
 def update(frame):
-    global coadd
-    global count
-    global coadd_frames
     ok, rgb_img = vid.read()
     print(frame)
-    img_l = rgb_img.sum(axis=2, dtype=np.uint32)
+    img_l = picamproc.luma_sum(rgb_img)
     #raw_images.append(img_l)
-    coadd += img_l
-    count += 1
+    coadd = stacker.add(img_l)
     #ax.imshow(coadd_images[frame], cmap='gray')
     #plt.draw()
     raw_img.set_data(img_l)
     raw_img.autoscale()
-    if count == coadd_frames:
+    if coadd is not None:
         coadd_img.set_data(coadd)
         coadd_img.autoscale()
-        coadd = np.zeros(shape)
-        count = 0
     #plt.draw()
     return raw_img, coadd_img
 
@@ -5,10 +5,15 @@ import matplotlib.pyplot as plt
 from matplotlib.animation import FuncAnimation
 from PIL import Image
 
+import picamproc
+
 fps = 10
 
 parser = ap.ArgumentParser()
 parser.add_argument('input_files', type=str, nargs='*')
+parser.add_argument('--dark', type=str, default=None,
+                    help='Master dark to calibrate frames with (see '
+                    'make_dark.py)')
 #parser.add_argument('output_file', type=str)
 args = parser.parse_args()
 
@@ -24,15 +29,15 @@ raw_img = raw_ax.imshow(np.zeros(shape, dtype=np.uint32), cmap='gray')
 coadd_ax = fig.add_subplot(gs[0, 1])
 coadd_img = coadd_ax.imshow(np.zeros(shape, dtype=np.uint32), cmap='gray')
 
-coadd = np.zeros(shape, dtype=np.uint32)
-count = 0
+dark = picamproc.DarkFrame(args.dark) if args.dark is not None else None
+
 coadd_frames = 5
+stacker = picamproc.Stacker(width, height, frames=coadd_frames)
+# Line every frame up with the first, so stars don't trail as the sky turns
+registrar = picamproc.Registrar()
 files = args.input_files
 i = 0
 def update(frame):
-    global coadd
-    global count
-    global coadd_frames
     global i
 
     print(frame)
@@ -41,19 +46,18 @@ def update(frame):
     print(rgb_img.shape)
     i += 1
 
-    img_l = rgb_img.sum(axis=2, dtype=np.uint32)
+    img_l = picamproc.luma_sum(rgb_img)
+    if dark is not None:
+        img_l = dark.calibrate(img_l)
     #raw_images.append(img_l)
-    coadd += img_l
-    count += 1
+    coadd = stacker.add(registrar.register(img_l))
     #ax.imshow(coadd_images[frame], cmap='gray')
     #plt.draw()
     raw_img.set_data(img_l)
     raw_img.autoscale()
-    if count == coadd_frames:
+    if coadd is not None:
         coadd_img.set_data(coadd)
         coadd_img.autoscale()
-        coadd = np.zeros(shape)
-        count = 0
     #plt.draw()
     return raw_img, coadd_img
 
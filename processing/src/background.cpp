@@ -0,0 +1,493 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+
+#include "background.hpp"
+
+// Histogram bins for a tile's median; wider ranges share bins
+static const uint32_t MEDIAN_BINS = 4096;
+// SExtractor's limit on (mean - median) / sigma for trusting the mode
+// estimate over the median
+static const float MODE_SKEW = 0.3f;
+
+
+struct TileStats {
+  float background;
+  float rms;
+  // Enough pixels survived clipping
+  bool ok;
+};
+
+/**
+ * Sigma-clipped background and RMS of the pixels in [x0, x1) x [y0, y1).
+ */
+template <typename T>
+static TileStats tileStats(Plane<const T> frame, uint32_t x0, uint32_t x1,
+                           uint32_t y0, uint32_t y1,
+                           const BackgroundEstimator::Config& config) {
+  const uint64_t total = static_cast<uint64_t>(x1 - x0) * (y1 - y0);
+  uint64_t n = 0;
+  double mean = 0.0;
+  double sigma = 0.0;
+  // Count, mean and standard deviation of the pixels in [lo, hi]
+  auto clipped = [&](uint32_t lo, uint32_t hi, uint64_t& count, double& m,
+                     double& s) {
+    uint64_t sum = 0, sumSq = 0;
+    count = 0;
+    for (uint32_t y = y0; y < y1; y++) {
+      const T* row = frame.row(y);
+      for (uint32_t x = x0; x < x1; x++) {
+        const uint64_t v = row[x];
+        const uint64_t in = (v >= lo) & (v <= hi);
+        count += in;
+        sum += in * v;
+        sumSq += in * v * v;
+      }
+    }
+    if (count > 0) {
+      m = static_cast<double>(sum) / count;
+      s = std::sqrt(std::max(static_cast<double>(sumSq) / count - m * m,
+                             0.0));
+    }
+  };
+
+  uint32_t lo = 0;
+  uint32_t hi = std::numeric_limits<T>::max();
+  clipped(lo, hi, n, mean, sigma);
+  for (unsigned i = 1; i < config.maxIterations; i++) {
+    const double spread = config.clipSigma * sigma;
+    const uint32_t nextLo = static_cast<uint32_t>(
+      std::max(std::ceil(mean - spread), 0.0));
+    const uint32_t nextHi = static_cast<uint32_t>(
+      std::max(std::floor(mean + spread), 0.0));
+    if (nextHi < nextLo) {
+      break;
+    }
+    uint64_t count = 0;
+    double m = mean, s = sigma;
+    clipped(nextLo, nextHi, count, m, s);
+    if (count == 0) {
+      break;
+    }
+    lo = nextLo;
+    hi = nextHi;
+    mean = m;
+    sigma = s;
+    if (count == n) {
+      break;
+    }
+    n = count;
+  }
+  if (n == 0) {
+    return TileStats{0.0f, 0.0f, false};
+  }
+
+  // Median of what's left, from a histogram, interpolated within the bin
+  // (value v covering [v - 0.5, v + 0.5))
+  const uint32_t binWidth = (hi - lo) / MEDIAN_BINS + 1;
+  uint32_t histogram[MEDIAN_BINS] = {};
+  for (uint32_t y = y0; y < y1; y++) {
+    const T* row = frame.row(y);
+    for (uint32_t x = x0; x < x1; x++) {
+      const uint32_t v = row[x];
+      if ((v >= lo) && (v <= hi)) {
+        histogram[(v - lo) / binWidth]++;
+      }
+    }
+  }
+  const double half = n / 2.0;
+  double below = 0.0;
+  double median = mean;
+  for (uint32_t b = 0; b < MEDIAN_BINS; b++) {
+    if (below + histogram[b] >= half) {
+      median = lo - 0.5 + binWidth * (b + (half - below) / histogram[b]);
+      break;
+    }
+    below += histogram[b];
+  }
+
+  double background = median;
+  if ((sigma > 0.0) && (std::fabs(mean - median) < MODE_SKEW * sigma)) {
+    background = 2.5 * median - 1.5 * mean;
+  } else if (sigma == 0.0) {
+    background = mean;
+  }
+  return TileStats{static_cast<float>(background),
+                   static_cast<float>(sigma),
+                   n >= config.minKeep * total};
+}
+
+
+BackgroundEstimator::BackgroundEstimator(const Config& config,
+                                         WorkerPool* pool)
+  : mConfig{config}
+  , mPool{pool}
+  , mWidth{0}
+  , mHeight{0}
+  , mMeshWidth{0}
+  , mMeshHeight{0}
+  , mBackground{}
+  , mRms{}
+  , mTapsX{}
+  , mTapsY{}
+  , mReplaced{0}
+{ }
+
+bool BackgroundEstimator::estimate(Plane<const uint8_t> frame) {
+  return estimateImpl(frame);
+}
+
+bool BackgroundEstimator::estimate(Plane<const uint16_t> frame) {
+  return estimateImpl(frame);
+}
+
+uint32_t BackgroundEstimator::width() const {
+  return mWidth;
+}
+
+uint32_t BackgroundEstimator::height() const {
+  return mHeight;
+}
+
+Plane<const float> BackgroundEstimator::meshBackground() const {
+  const size_t stride = mMeshWidth + 2 * GHOSTS;
+  return Plane<const float>{mBackground.data() + GHOSTS * stride + GHOSTS,
+                            mMeshWidth, mMeshHeight, stride};
+}
+
+Plane<const float> BackgroundEstimator::meshRms() const {
+  const size_t stride = mMeshWidth + 2 * GHOSTS;
+  return Plane<const float>{mRms.data() + GHOSTS * stride + GHOSTS,
+                            mMeshWidth, mMeshHeight, stride};
+}
+
+size_t BackgroundEstimator::replacedTiles() const {
+  return mReplaced;
+}
+
+const BackgroundEstimator::Config& BackgroundEstimator::config() const {
+  return mConfig;
+}
+
+template <typename T>
+bool BackgroundEstimator::estimateImpl(Plane<const T> frame) {
+  if ((frame.width == 0) || (frame.height == 0)) {
+    return false;
+  }
+
+  const uint32_t tile = std::max<uint32_t>(mConfig.tileSize, 1);
+  if ((frame.width != mWidth) || (frame.height != mHeight)) {
+    mWidth = frame.width;
+    mHeight = frame.height;
+    mMeshWidth = (mWidth + tile - 1) / tile;
+    mMeshHeight = (mHeight + tile - 1) / tile;
+    const size_t nodes = static_cast<size_t>(mMeshWidth + 2 * GHOSTS) *
+      (mMeshHeight + 2 * GHOSTS);
+    mBackground.assign(nodes, 0.0f);
+    mRms.assign(nodes, 0.0f);
+    makeTaps(mWidth, mMeshWidth, mTapsX);
+    makeTaps(mHeight, mMeshHeight, mTapsY);
+  }
+
+  // A row of tiles per task, so a task reads whole rows of the frame
+  const size_t stride = mMeshWidth + 2 * GHOSTS;
+  auto tileRow = [&](size_t ty) {
+    const uint32_t y0 = static_cast<uint32_t>(
+      static_cast<uint64_t>(mHeight) * ty / mMeshHeight);
+    const uint32_t y1 = static_cast<uint32_t>(
+      static_cast<uint64_t>(mHeight) * (ty + 1) / mMeshHeight);
+    for (uint32_t tx = 0; tx < mMeshWidth; tx++) {
+      const uint32_t x0 = static_cast<uint32_t>(
+        static_cast<uint64_t>(mWidth) * tx / mMeshWidth);
+      const uint32_t x1 = static_cast<uint32_t>(
+        static_cast<uint64_t>(mWidth) * (tx + 1) / mMeshWidth);
+      const TileStats stats = tileStats(frame, x0, x1, y0, y1, mConfig);
+      const size_t i = (ty + GHOSTS) * stride + tx + GHOSTS;
+      mBackground[i] = stats.ok ? stats.background : NAN;
+      mRms[i] = stats.ok ? stats.rms : NAN;
+    }
+  };
+  if (mPool != nullptr) {
+    mPool->run(mMeshHeight, tileRow);
+  } else {
+    for (uint32_t ty = 0; ty < mMeshHeight; ty++) {
+      tileRow(ty);
+    }
+  }
+
+  fillTiles();
+  filterMesh();
+  extendMesh();
+  return true;
+}
+
+void BackgroundEstimator::fillTiles() {
+  const size_t stride = mMeshWidth + 2 * GHOSTS;
+  auto at = [&](std::vector<float>& mesh, uint32_t tx, uint32_t ty) -> float& {
+    return mesh[(ty + GHOSTS) * stride + tx + GHOSTS];
+  };
+
+  mReplaced = 0;
+  for (uint32_t ty = 0; ty < mMeshHeight; ty++) {
+    for (uint32_t tx = 0; tx < mMeshWidth; tx++) {
+      mReplaced += std::isnan(at(mBackground, tx, ty)) ? 1 : 0;
+    }
+  }
+  if (mReplaced == static_cast<size_t>(mMeshWidth) * mMeshHeight) {
+    // Nothing to go on
+    std::fill(mBackground.begin(), mBackground.end(), 0.0f);
+    std::fill(mRms.begin(), mRms.end(), 0.0f);
+    return;
+  }
+
+  // Grow the good tiles into the gaps, a ring at a time: each gap next to a
+  // good tile gets the mean of its good neighbours
+  size_t left = mReplaced;
+  std::vector<float> background, rms;
+  while (left > 0) {
+    background = mBackground;
+    rms = mRms;
+    for (uint32_t ty = 0; ty < mMeshHeight; ty++) {
+      for (uint32_t tx = 0; tx < mMeshWidth; tx++) {
+        if (!std::isnan(at(background, tx, ty))) {
+          continue;
+        }
+        float sumBackground = 0.0f, sumRms = 0.0f;
+        unsigned count = 0;
+        for (int dy = -1; dy <= 1; dy++) {
+          for (int dx = -1; dx <= 1; dx++) {
+            const uint32_t nx = tx + dx;
+            const uint32_t ny = ty + dy;
+            // Out of range wraps around to a large value
+            if ((nx >= mMeshWidth) || (ny >= mMeshHeight) ||
+                std::isnan(at(background, nx, ny))) {
+              continue;
+            }
+            sumBackground += at(background, nx, ny);
+            sumRms += at(rms, nx, ny);
+            count++;
+          }
+        }
+        if (count > 0) {
+          at(mBackground, tx, ty) = sumBackground / count;
+          at(mRms, tx, ty) = sumRms / count;
+          left--;
+        }
+      }
+    }
+  }
+}
+
+void BackgroundEstimator::filterMesh() {
+  const int radius = static_cast<int>(mConfig.filterSize / 2);
+  if (radius == 0) {
+    return;
+  }
+
+  // Windows shrink to stay centred near the edges; cut off, a window on a
+  // slope would pull the edge tiles towards the middle
+  const int meshWidth = static_cast<int>(mMeshWidth);
+  const int meshHeight = static_cast<int>(mMeshHeight);
+  const size_t stride = mMeshWidth + 2 * GHOSTS;
+  std::vector<float> window;
+  for (std::vector<float>* mesh : {&mBackground, &mRms}) {
+    const std::vector<float> in = *mesh;
+    for (int ty = 0; ty < meshHeight; ty++) {
+      const int ry = std::min({radius, ty, meshHeight - 1 - ty});
+      for (int tx = 0; tx < meshWidth; tx++) {
+        const int rx = std::min({radius, tx, meshWidth - 1 - tx});
+        window.clear();
+        for (int y = ty - ry; y <= ty + ry; y++) {
+          for (int x = tx - rx; x <= tx + rx; x++) {
+            window.push_back(in[(y + GHOSTS) * stride + x + GHOSTS]);
+          }
+        }
+        std::nth_element(window.begin(), window.begin() + window.size() / 2,
+                         window.end());
+        (*mesh)[(ty + GHOSTS) * stride + tx + GHOSTS] =
+          window[window.size() / 2];
+      }
+    }
+  }
+}
+
+void BackgroundEstimator::extendMesh() {
+  // Carry the slope at each edge on past it, so a gradient doesn't flatten
+  // out over the outer half of the edge tiles
+  const size_t stride = mMeshWidth + 2 * GHOSTS;
+  const uint32_t rows = mMeshHeight + 2 * GHOSTS;
+  for (std::vector<float>* mesh : {&mBackground, &mRms}) {
+    float* m = mesh->data();
+    for (uint32_t y = GHOSTS; y < GHOSTS + mMeshHeight; y++) {
+      float* row = m + y * stride;
+      const float first = row[GHOSTS];
+      const float last = row[GHOSTS + mMeshWidth - 1];
+      const float firstSlope = (mMeshWidth > 1) ? first - row[GHOSTS + 1] :
+        0.0f;
+      const float lastSlope = (mMeshWidth > 1) ?
+        last - row[GHOSTS + mMeshWidth - 2] : 0.0f;
+      for (uint32_t k = 1; k <= GHOSTS; k++) {
+        row[GHOSTS - k] = first + k * firstSlope;
+        row[GHOSTS + mMeshWidth - 1 + k] = last + k * lastSlope;
+      }
+    }
+    for (uint32_t x = 0; x < stride; x++) {
+      const float first = m[GHOSTS * stride + x];
+      const float last = m[(GHOSTS + mMeshHeight - 1) * stride + x];
+      const float firstSlope = (mMeshHeight > 1) ?
+        first - m[(GHOSTS + 1) * stride + x] : 0.0f;
+      const float lastSlope = (mMeshHeight > 1) ?
+        last - m[(GHOSTS + mMeshHeight - 2) * stride + x] : 0.0f;
+      for (uint32_t k = 1; k <= GHOSTS; k++) {
+        m[(GHOSTS - k) * stride + x] = first + k * firstSlope;
+        m[(rows - GHOSTS - 1 + k) * stride + x] = last + k * lastSlope;
+      }
+    }
+  }
+}
+
+void BackgroundEstimator::makeTaps(uint32_t count, uint32_t nodes,
+                                   std::vector<Taps>& taps) {
+  // Node i sits in the middle of tile i, spacing pixels apart
+  const double spacing = static_cast<double>(count) / nodes;
+  taps.resize(count);
+  for (uint32_t p = 0; p < count; p++) {
+    const double t = (p + 0.5) / spacing - 0.5;
+    const double i = std::floor(t);
+    const float f = static_cast<float>(t - i);
+    const float f2 = f * f;
+    const float f3 = f2 * f;
+    Taps& tap = taps[p];
+    tap.first = static_cast<uint32_t>(static_cast<int64_t>(i) - 1 + GHOSTS);
+    tap.weights[0] = 0.5f * (-f3 + 2.0f * f2 - f);
+    tap.weights[1] = 0.5f * (3.0f * f3 - 5.0f * f2 + 2.0f);
+    tap.weights[2] = 0.5f * (-3.0f * f3 + 4.0f * f2 + f);
+    tap.weights[3] = 0.5f * (f3 - f2);
+  }
+}
+
+template <typename F>
+void BackgroundEstimator::forRows(bool wantRms, F fn) const {
+  const size_t stride = mMeshWidth + 2 * GHOSTS;
+  WorkerPool::runBands(mPool, mHeight, [&](uint32_t y0, uint32_t y1) {
+    // Interpolate down the mesh's columns, then along the row
+    std::vector<float> columnBackground(stride), columnRms(stride);
+    std::vector<float> background(mWidth), rms(wantRms ? mWidth : 0);
+    for (uint32_t y = y0; y < y1; y++) {
+      const Taps& ty = mTapsY[y];
+      const float* b = &mBackground[ty.first * stride];
+      const float* r = &mRms[ty.first * stride];
+      for (size_t k = 0; k < stride; k++) {
+        columnBackground[k] = ty.weights[0] * b[k] +
+          ty.weights[1] * b[k + stride] + ty.weights[2] * b[k + 2 * stride] +
+          ty.weights[3] * b[k + 3 * stride];
+      }
+      if (wantRms) {
+        for (size_t k = 0; k < stride; k++) {
+          columnRms[k] = ty.weights[0] * r[k] +
+            ty.weights[1] * r[k + stride] +
+            ty.weights[2] * r[k + 2 * stride] +
+            ty.weights[3] * r[k + 3 * stride];
+        }
+      }
+      for (uint32_t x = 0; x < mWidth; x++) {
+        const Taps& tx = mTapsX[x];
+        const float* c = &columnBackground[tx.first];
+        background[x] = tx.weights[0] * c[0] + tx.weights[1] * c[1] +
+          tx.weights[2] * c[2] + tx.weights[3] * c[3];
+      }
+      if (wantRms) {
+        for (uint32_t x = 0; x < mWidth; x++) {
+          const Taps& tx = mTapsX[x];
+          const float* c = &columnRms[tx.first];
+          // Overshoot can take it below 0 near a sharp drop
+          rms[x] = std::max(tx.weights[0] * c[0] + tx.weights[1] * c[1] +
+                            tx.weights[2] * c[2] + tx.weights[3] * c[3],
+                            0.0f);
+        }
+      }
+      fn(y, background.data(), rms.data());
+    }
+  });
+}
+
+bool BackgroundEstimator::background(Plane<float> out) const {
+  if ((mWidth == 0) || (out.width != mWidth) || (out.height != mHeight)) {
+    return false;
+  }
+  forRows(false, [&](uint32_t y, const float* background, const float*) {
+    std::copy_n(background, mWidth, out.row(y));
+  });
+  return true;
+}
+
+bool BackgroundEstimator::rms(Plane<float> out) const {
+  if ((mWidth == 0) || (out.width != mWidth) || (out.height != mHeight)) {
+    return false;
+  }
+  forRows(true, [&](uint32_t y, const float*, const float* rms) {
+    std::copy_n(rms, mWidth, out.row(y));
+  });
+  return true;
+}
+
+bool BackgroundEstimator::threshold(Plane<uint16_t> out, float sigma) const {
+  if ((mWidth == 0) || (out.width != mWidth) || (out.height != mHeight)) {
+    return false;
+  }
+  forRows(true, [&](uint32_t y, const float* background, const float* rms) {
+    uint16_t* row = out.row(y);
+    for (uint32_t x = 0; x < mWidth; x++) {
+      const float level = std::floor(background[x] + sigma * rms[x]) + 1.0f;
+      row[x] = static_cast<uint16_t>(std::min(std::max(level, 1.0f),
+                                              65535.0f));
+    }
+  });
+  return true;
+}
+
+bool BackgroundEstimator::subtract(Plane<const uint8_t> in,
+                                   Plane<uint8_t> out) const {
+  return subtractImpl(in, out);
+}
+
+bool BackgroundEstimator::subtract(Plane<const uint16_t> in,
+                                   Plane<uint16_t> out) const {
+  return subtractImpl(in, out);
+}
+
+template <typename T>
+bool BackgroundEstimator::subtractImpl(Plane<const T> in, Plane<T> out) const {
+  if ((mWidth == 0) || (in.width != mWidth) || (in.height != mHeight) ||
+      (out.width != mWidth) || (out.height != mHeight)) {
+    return false;
+  }
+  forRows(false, [&](uint32_t y, const float* background, const float*) {
+    const T* src = in.row(y);
+    T* dst = out.row(y);
+    for (uint32_t x = 0; x < mWidth; x++) {
+      const int level = static_cast<int>(std::lround(background[x]));
+      dst[x] = static_cast<T>(std::max(static_cast<int>(src[x]) - level, 0));
+    }
+  });
+  return true;
+}
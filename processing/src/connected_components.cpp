@@ -0,0 +1,385 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include "connected_components.hpp"
+
+static const uint32_t NONE = UINT32_MAX;
+
+// Bands per worker thread: fewer than WorkerPool's default, since every
+// boundary between bands has to be stitched afterwards
+static const unsigned BANDS_PER_THREAD = 2;
+
+
+static uint32_t findRoot(std::vector<uint32_t>& parent, uint32_t i) {
+  while (parent[i] != i) {
+    // Path halving
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+  return i;
+}
+
+/**
+ * Merge the sets containing a and b. The root is always the lowest index,
+ * i.e. the first run in raster order.
+ */
+static void unite(std::vector<uint32_t>& parent, uint32_t a, uint32_t b) {
+  a = findRoot(parent, a);
+  b = findRoot(parent, b);
+  if (a < b) {
+    parent[b] = a;
+  } else if (b < a) {
+    parent[a] = b;
+  }
+}
+
+/**
+ * First x at or after x where row[x] >= threshold, or width if there isn't
+ * one. Background is skipped a word at a time: with n = threshold - 1, a lane
+ * is above n iff its top bit is set, or adding (lane max / 2 - n) sets it.
+ * Only a lane whose top bit is already set can carry into the next one, and
+ * that stops the word loop anyway, so the carry is harmless: the loop below
+ * rechecks those pixels one at a time.
+ */
+static uint32_t nextAbove(const uint8_t* row, uint32_t x, uint32_t width,
+                          uint32_t threshold) {
+  if ((threshold >= 1) && (threshold <= 128)) {
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t high = 0x8080808080808080ULL;
+    const uint64_t add = ones * (127 - (threshold - 1));
+    for (; x + 8 <= width; x += 8) {
+      uint64_t word;
+      memcpy(&word, row + x, sizeof(word));
+      if ((((word + add) | word) & high) != 0) {
+        break;
+      }
+    }
+  }
+  while ((x < width) && (row[x] < threshold)) {
+    x++;
+  }
+  return x;
+}
+
+static uint32_t nextAbove(const uint16_t* row, uint32_t x, uint32_t width,
+                          uint32_t threshold) {
+  if ((threshold >= 1) && (threshold <= 32768)) {
+    const uint64_t ones = 0x0001000100010001ULL;
+    const uint64_t high = 0x8000800080008000ULL;
+    const uint64_t add = ones * (32767 - (threshold - 1));
+    for (; x + 4 <= width; x += 4) {
+      uint64_t word;
+      memcpy(&word, row + x, sizeof(word));
+      if ((((word + add) | word) & high) != 0) {
+        break;
+      }
+    }
+  }
+  while ((x < width) && (row[x] < threshold)) {
+    x++;
+  }
+  return x;
+}
+
+/**
+ * First x at or after x where row[x] >= thresholds[x], or width.
+ */
+template <typename T>
+static uint32_t nextAbove(const T* row, const uint16_t* thresholds,
+                          uint32_t x, uint32_t width) {
+  while ((x < width) && (row[x] < thresholds[x])) {
+    x++;
+  }
+  return x;
+}
+
+
+ComponentLabeller::ComponentLabeller(const Config& config, WorkerPool* pool)
+  : mConfig{config}
+  , mPool{pool}
+  , mBands{}
+  , mParent{}
+  , mComponentOf{}
+  , mBandBase{}
+{ }
+
+void ComponentLabeller::label(Plane<const uint8_t> image,
+                              std::vector<Component>& components,
+                              const Plane<uint32_t>* labels) {
+  labelImpl(image, nullptr, components, labels);
+}
+
+void ComponentLabeller::label(Plane<const uint16_t> image,
+                              std::vector<Component>& components,
+                              const Plane<uint32_t>* labels) {
+  labelImpl(image, nullptr, components, labels);
+}
+
+void ComponentLabeller::label(Plane<const uint8_t> image,
+                              Plane<const uint16_t> thresholds,
+                              std::vector<Component>& components,
+                              const Plane<uint32_t>* labels) {
+  labelImpl(image, &thresholds, components, labels);
+}
+
+void ComponentLabeller::label(Plane<const uint16_t> image,
+                              Plane<const uint16_t> thresholds,
+                              std::vector<Component>& components,
+                              const Plane<uint32_t>* labels) {
+  labelImpl(image, &thresholds, components, labels);
+}
+
+size_t ComponentLabeller::runs() const {
+  return mParent.size();
+}
+
+template <typename T>
+void ComponentLabeller::labelImpl(Plane<const T> image,
+                                  const Plane<const uint16_t>* thresholds,
+                                  std::vector<Component>& components,
+                                  const Plane<uint32_t>* labels) {
+  components.clear();
+  mParent.clear();
+  if ((image.width == 0) || (image.height == 0)) {
+    return;
+  }
+  if ((thresholds != nullptr) && ((thresholds->width != image.width) ||
+                                  (thresholds->height != image.height))) {
+    return;
+  }
+
+  // 1. Find runs and link them within each band
+  const size_t bandCount = WorkerPool::bandCount(mPool, image.height,
+                                                 BANDS_PER_THREAD);
+  mBands.resize(bandCount);
+  for (size_t b = 0; b < bandCount; b++) {
+    mBands[b].y0 = WorkerPool::bandStart(image.height, bandCount, b);
+    mBands[b].y1 = WorkerPool::bandStart(image.height, bandCount, b + 1);
+  }
+  auto scan = [this, image, thresholds](size_t b) {
+    scanBand(image, thresholds, mBands[b]);
+  };
+  if (mPool != nullptr) {
+    mPool->run(bandCount, scan);
+  } else {
+    scan(0);
+  }
+
+  // 2. Stitch the bands together where they meet
+  mBandBase.resize(bandCount);
+  uint32_t total = 0;
+  for (size_t b = 0; b < bandCount; b++) {
+    mBandBase[b] = total;
+    total += mBands[b].runs.size();
+  }
+  mParent.resize(total);
+  for (size_t b = 0; b < bandCount; b++) {
+    const Band& band = mBands[b];
+    const uint32_t base = mBandBase[b];
+    for (size_t i = 0; i < band.parent.size(); i++) {
+      mParent[base + i] = base + band.parent[i];
+    }
+  }
+  for (size_t b = 1; b < bandCount; b++) {
+    const Band& above = mBands[b - 1];
+    const Band& below = mBands[b];
+    const uint32_t aboveLast = above.rowStart[above.rowStart.size() - 2];
+    linkRows(above.runs.data() + aboveLast, above.runs.size() - aboveLast,
+             below.runs.data(), below.rowStart[1],
+             mBandBase[b - 1] + aboveLast, mBandBase[b],
+             [this](uint32_t a, uint32_t c) { unite(mParent, a, c); });
+  }
+
+  // 3. Add up each component, in raster order. A root is always the first
+  //    run of its component, so it's seen before the rest. Point every run
+  //    straight at its root first, since mParent gets reused on the way.
+  for (uint32_t g = 0; g < total; g++) {
+    mParent[g] = findRoot(mParent, g);
+  }
+  mComponentOf.resize(total);
+  for (size_t b = 0; b < bandCount; b++) {
+    const Band& band = mBands[b];
+    const uint32_t base = mBandBase[b];
+    for (size_t i = 0; i < band.runs.size(); i++) {
+      const Run& run = band.runs[i];
+      const uint32_t g = base + i;
+      const uint32_t root = mParent[g];
+      if (root == g) {
+        mComponentOf[g] = components.size();
+        Component c{};
+        c.minX = run.x0;
+        c.minY = run.y;
+        c.maxX = run.x1 - 1;
+        c.maxY = run.y;
+        c.peak = run.peak;
+        c.peakX = run.peakX;
+        c.peakY = run.y;
+        components.push_back(c);
+      }
+
+      const uint32_t index = mComponentOf[root];
+      Component& c = components[index];
+      c.area += run.x1 - run.x0;
+      c.minX = std::min(c.minX, run.x0);
+      c.maxX = std::max(c.maxX, run.x1 - 1);
+      c.maxY = run.y;
+      c.flux += run.flux;
+      // Sums for now; divided by the flux below
+      c.x += run.fluxX;
+      c.y += static_cast<double>(run.flux) * run.y;
+      if (run.peak > c.peak) {
+        c.peak = run.peak;
+        c.peakX = run.peakX;
+        c.peakY = run.y;
+      }
+      // Done with the union-find; remember the component for the labels
+      mParent[g] = index;
+    }
+  }
+
+  // 4. Finish the centroids and drop anything too small
+  size_t kept = 0;
+  for (size_t i = 0; i < components.size(); i++) {
+    Component& c = components[i];
+    if (c.flux > 0) {
+      c.x /= c.flux;
+      c.y /= c.flux;
+    } else {
+      c.x = (c.minX + c.maxX) / 2.0;
+      c.y = (c.minY + c.maxY) / 2.0;
+    }
+
+    if (c.area >= mConfig.minArea) {
+      mComponentOf[i] = kept;
+      components[kept++] = c;
+    } else {
+      mComponentOf[i] = NONE;
+    }
+  }
+  components.resize(kept);
+
+  if (labels == nullptr) {
+    return;
+  }
+  // mComponentOf now maps each component to its index after filtering
+  auto write = [this, labels](size_t b) {
+    writeLabels(mBands[b], mBandBase[b], *labels);
+  };
+  if (mPool != nullptr) {
+    mPool->run(bandCount, write);
+  } else {
+    write(0);
+  }
+}
+
+template <typename T>
+void ComponentLabeller::scanBand(Plane<const T> image,
+                                 const Plane<const uint16_t>* thresholds,
+                                 Band& band) {
+  band.runs.clear();
+  band.rowStart.clear();
+  band.parent.clear();
+
+  const uint32_t threshold = mConfig.threshold;
+  const uint32_t width = image.width;
+  uint32_t previous = 0;
+  for (uint32_t y = band.y0; y < band.y1; y++) {
+    const T* row = image.row(y);
+    const uint16_t* levels = (thresholds != nullptr) ? thresholds->row(y) :
+      nullptr;
+    const uint32_t start = band.runs.size();
+    band.rowStart.push_back(start);
+
+    uint32_t x = 0;
+    for (;;) {
+      x = (levels != nullptr) ? nextAbove(row, levels, x, width) :
+        nextAbove(row, x, width, threshold);
+      if (x >= width) {
+        break;
+      }
+
+      Run run{};
+      run.x0 = x;
+      run.y = y;
+      run.peak = row[x];
+      run.peakX = x;
+      for (; (x < width) &&
+           (row[x] >= ((levels != nullptr) ? levels[x] : threshold)); x++) {
+        const uint32_t value = row[x];
+        run.flux += value;
+        run.fluxX += static_cast<uint64_t>(value) * x;
+        if (value > run.peak) {
+          run.peak = value;
+          run.peakX = x;
+        }
+      }
+      run.x1 = x;
+      band.parent.push_back(band.runs.size());
+      band.runs.push_back(run);
+    }
+
+    if (y > band.y0) {
+      linkRows(band.runs.data() + previous, start - previous,
+               band.runs.data() + start, band.runs.size() - start,
+               previous, start,
+               [&band](uint32_t a, uint32_t b) { unite(band.parent, a, b); });
+    }
+    previous = start;
+  }
+  band.rowStart.push_back(band.runs.size());
+}
+
+template <typename Link>
+void ComponentLabeller::linkRows(const Run* above, size_t aboveCount,
+                                 const Run* row, size_t rowCount,
+                                 uint32_t aboveBase, uint32_t rowBase,
+                                 Link link) const {
+  // With 8-connectivity, runs that only touch at a corner count too
+  const uint32_t reach = mConfig.eightConnected ? 1 : 0;
+  size_t first = 0;
+  for (size_t i = 0; i < rowCount; i++) {
+    const Run& run = row[i];
+    // Skip runs above that end before this one starts. Both rows are sorted,
+    // so they can't touch any later run either.
+    while ((first < aboveCount) && (above[first].x1 + reach <= run.x0)) {
+      first++;
+    }
+    for (size_t j = first;
+         (j < aboveCount) && (above[j].x0 < run.x1 + reach); j++) {
+      link(aboveBase + j, rowBase + i);
+    }
+  }
+}
+
+void ComponentLabeller::writeLabels(const Band& band, uint32_t base,
+                                    const Plane<uint32_t>& labels) const {
+  for (uint32_t y = band.y0; y < band.y1; y++) {
+    memset(labels.row(y), 0, labels.width * sizeof(uint32_t));
+  }
+  for (size_t i = 0; i < band.runs.size(); i++) {
+    const Run& run = band.runs[i];
+    const uint32_t component = mComponentOf[mParent[base + i]];
+    if (component == NONE) {
+      continue;
+    }
+    uint32_t* out = labels.row(run.y);
+    std::fill(out + run.x0, out + run.x1, component + 1);
+  }
+}
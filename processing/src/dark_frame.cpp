@@ -0,0 +1,500 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <functional>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__arm__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+#include "dark_frame.hpp"
+#include "dark_rows.hpp"
+#include "median_filter.hpp"
+
+// Every this many pixels goes into the estimate of the master's median
+static const size_t GLOBAL_MEDIAN_SAMPLE = 7;
+
+static const DarkKernels SCALAR_KERNELS = makeDarkKernels<0>("scalar");
+
+
+const DarkKernels& scalarDarkKernels() {
+  return SCALAR_KERNELS;
+}
+
+std::vector<const DarkKernels*> supportedDarkKernels() {
+  std::vector<const DarkKernels*> kernels{&SCALAR_KERNELS};
+  auto add = [&](const DarkKernels* k, bool supported) {
+    if ((k != nullptr) && supported) {
+      kernels.push_back(k);
+    }
+  };
+#if defined(__x86_64__) || defined(__i386__)
+  add(sse2DarkKernels(), __builtin_cpu_supports("sse2"));
+  add(avx2DarkKernels(), __builtin_cpu_supports("avx2"));
+#elif defined(__aarch64__)
+  add(neonDarkKernels(), true);
+#elif defined(__arm__)
+  add(neonDarkKernels(), (getauxval(AT_HWCAP) & HWCAP_NEON) != 0);
+#endif
+  return kernels;
+}
+
+const DarkKernels& darkKernels() {
+  // Later sets are faster
+  static const DarkKernels& best = *supportedDarkKernels().back();
+  return best;
+}
+
+int32_t darkTemperatureBucket(float celsius) {
+  return static_cast<int32_t>(std::floor(celsius / DARK_TEMPERATURE_STEP));
+}
+
+static uint64_t alignUp(uint64_t offset) {
+  return (offset + DARK_FILE_ALIGN - 1) / DARK_FILE_ALIGN * DARK_FILE_ALIGN;
+}
+
+/**
+ * Write all of data at offset, retrying short writes.
+ */
+static bool writeAt(int fd, const void* data, size_t size, uint64_t offset) {
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  while (size > 0) {
+    ssize_t rc = pwrite(fd, p, size, static_cast<off_t>(offset));
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += rc;
+    size -= rc;
+    offset += rc;
+  }
+  return true;
+}
+
+
+DarkFrameBuilder::DarkFrameBuilder(uint32_t width, uint32_t height,
+                                   WorkerPool* pool)
+  : mWidth{width}
+  , mHeight{height}
+  , mPool{pool}
+  , mFrames{}
+  , mCount{0}
+{ }
+
+bool DarkFrameBuilder::add(Plane<const uint8_t> frame) {
+  return addImpl(frame);
+}
+
+bool DarkFrameBuilder::add(Plane<const uint16_t> frame) {
+  return addImpl(frame);
+}
+
+unsigned DarkFrameBuilder::frames() const {
+  return mCount;
+}
+
+void DarkFrameBuilder::reset() {
+  mFrames.clear();
+  mFrames.shrink_to_fit();
+  mCount = 0;
+}
+
+template <typename T>
+bool DarkFrameBuilder::addImpl(Plane<const T> frame) {
+  if ((frame.width != mWidth) || (frame.height != mHeight) ||
+      (mCount >= MAX_MEDIAN_ROWS)) {
+    return false;
+  }
+
+  const size_t pixels = static_cast<size_t>(mWidth) * mHeight;
+  mFrames.resize(pixels * (mCount + 1));
+  uint16_t* out = &mFrames[pixels * mCount];
+  for (uint32_t y = 0; y < mHeight; y++) {
+    std::copy_n(frame.row(y), mWidth, out + static_cast<size_t>(y) * mWidth);
+  }
+  mCount++;
+  return true;
+}
+
+long DarkFrameBuilder::write(const std::string& path, const DarkKey& key,
+                             uint16_t hotThreshold) const {
+  if (mCount == 0) {
+    return -1;
+  }
+
+  const size_t pixels = static_cast<size_t>(mWidth) * mHeight;
+  std::vector<uint16_t> master(pixels);
+  const MedianKernels& median = medianKernels();
+  WorkerPool::runBands(mPool, mHeight, [&](uint32_t y0, uint32_t y1) {
+    const uint16_t* rows[MAX_MEDIAN_ROWS];
+    for (uint32_t y = y0; y < y1; y++) {
+      const size_t offset = static_cast<size_t>(y) * mWidth;
+      for (unsigned f = 0; f < mCount; f++) {
+        rows[f] = &mFrames[pixels * f + offset];
+      }
+      median.medianAcross16(rows, mCount, &master[offset], mWidth);
+    }
+  });
+
+  // Hot pixels stand out from their neighbourhood. The 3x3 median counts
+  // pixels past the edges as 0, so the edges go by the whole frame's
+  std::vector<uint16_t> local(pixels);
+  medianFilter(Plane<const uint16_t>{master.data(), mWidth, mHeight},
+               Plane<uint16_t>{local.data(), mWidth, mHeight}, 3, mPool);
+  std::vector<uint16_t> sample;
+  sample.reserve(pixels / GLOBAL_MEDIAN_SAMPLE + 1);
+  for (size_t i = 0; i < pixels; i += GLOBAL_MEDIAN_SAMPLE) {
+    sample.push_back(master[i]);
+  }
+  std::nth_element(sample.begin(), sample.begin() + sample.size() / 2,
+                   sample.end());
+  const uint32_t global = sample[sample.size() / 2];
+
+  std::vector<uint32_t> hot;
+  for (uint32_t y = 0; y < mHeight; y++) {
+    const bool edgeRow = (y == 0) || (y + 1 == mHeight);
+    for (uint32_t x = 0; x < mWidth; x++) {
+      const size_t i = static_cast<size_t>(y) * mWidth + x;
+      const bool edge = edgeRow || (x == 0) || (x + 1 == mWidth);
+      const uint32_t reference = edge ? global : local[i];
+      if (master[i] > reference + hotThreshold) {
+        hot.push_back(static_cast<uint32_t>(i));
+      }
+    }
+  }
+
+  DarkFileHeader header{};
+  memcpy(header.magic, DARK_FILE_MAGIC, sizeof(header.magic));
+  header.version = DARK_FILE_VERSION;
+  header.width = mWidth;
+  header.height = mHeight;
+  header.iso = key.iso;
+  header.shutterUs = key.shutterUs;
+  header.temperature = key.temperature;
+  header.frames = mCount;
+  header.hotThreshold = hotThreshold;
+  header.hotPixels = static_cast<uint32_t>(hot.size());
+  header.masterOffset = alignUp(sizeof(header));
+  header.hotOffset = alignUp(header.masterOffset + pixels * sizeof(uint16_t));
+  const uint64_t size = header.hotOffset + hot.size() * sizeof(uint32_t);
+
+  const std::string temporary = path + ".tmp";
+  int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0644);
+  if (fd < 0) {
+    return -1;
+  }
+  // Sizing the file first leaves the padding as zeros
+  bool ok = (ftruncate(fd, static_cast<off_t>(size)) == 0) &&
+    writeAt(fd, &header, sizeof(header), 0) &&
+    writeAt(fd, master.data(), pixels * sizeof(uint16_t),
+            header.masterOffset) &&
+    writeAt(fd, hot.data(), hot.size() * sizeof(uint32_t), header.hotOffset) &&
+    (fsync(fd) == 0);
+  ok = (close(fd) == 0) && ok;
+  if (!ok || (rename(temporary.c_str(), path.c_str()) != 0)) {
+    unlink(temporary.c_str());
+    return -1;
+  }
+  return static_cast<long>(hot.size());
+}
+
+
+DarkFrame::DarkFrame()
+  : mPath{}
+  , mMap{nullptr}
+  , mMapSize{0}
+  , mHeader{nullptr}
+{ }
+
+DarkFrame::~DarkFrame() {
+  close();
+}
+
+DarkFrame::DarkFrame(DarkFrame&& other)
+  : DarkFrame{}
+{
+  *this = std::move(other);
+}
+
+DarkFrame& DarkFrame::operator=(DarkFrame&& other) {
+  if (this != &other) {
+    close();
+    mPath = std::move(other.mPath);
+    mMap = other.mMap;
+    mMapSize = other.mMapSize;
+    mHeader = other.mHeader;
+    other.mMap = nullptr;
+    other.mMapSize = 0;
+    other.mHeader = nullptr;
+  }
+  return *this;
+}
+
+bool DarkFrame::open(const std::string& path) {
+  close();
+
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if ((fstat(fd, &st) != 0) ||
+      (static_cast<uint64_t>(st.st_size) < sizeof(DarkFileHeader))) {
+    ::close(fd);
+    return false;
+  }
+  const size_t size = static_cast<size_t>(st.st_size);
+  void* map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+
+  const DarkFileHeader* header = static_cast<const DarkFileHeader*>(map);
+  const uint64_t pixels = static_cast<uint64_t>(header->width) *
+    header->height;
+  const bool valid =
+    (memcmp(header->magic, DARK_FILE_MAGIC, sizeof(header->magic)) == 0) &&
+    (header->version == DARK_FILE_VERSION) &&
+    (pixels > 0) &&
+    (header->masterOffset % DARK_FILE_ALIGN == 0) &&
+    (header->hotOffset % DARK_FILE_ALIGN == 0) &&
+    (header->masterOffset >= sizeof(DarkFileHeader)) &&
+    (header->masterOffset <= size) &&
+    (pixels * sizeof(uint16_t) <= size - header->masterOffset) &&
+    (header->hotOffset <= size) &&
+    (static_cast<uint64_t>(header->hotPixels) * sizeof(uint32_t) <=
+     size - header->hotOffset);
+  if (!valid) {
+    munmap(map, size);
+    return false;
+  }
+
+  mPath = path;
+  mMap = map;
+  mMapSize = size;
+  mHeader = header;
+  return true;
+}
+
+void DarkFrame::close() {
+  if (mMap != nullptr) {
+    munmap(mMap, mMapSize);
+  }
+  mPath.clear();
+  mMap = nullptr;
+  mMapSize = 0;
+  mHeader = nullptr;
+}
+
+bool DarkFrame::isOpen() const {
+  return mHeader != nullptr;
+}
+
+const std::string& DarkFrame::path() const {
+  return mPath;
+}
+
+DarkKey DarkFrame::key() const {
+  return DarkKey{mHeader->iso, mHeader->shutterUs, mHeader->temperature};
+}
+
+uint32_t DarkFrame::frames() const {
+  return mHeader->frames;
+}
+
+uint32_t DarkFrame::width() const {
+  return mHeader->width;
+}
+
+uint32_t DarkFrame::height() const {
+  return mHeader->height;
+}
+
+Plane<const uint16_t> DarkFrame::master() const {
+  const uint8_t* base = static_cast<const uint8_t*>(mMap);
+  return Plane<const uint16_t>{
+    reinterpret_cast<const uint16_t*>(base + mHeader->masterOffset),
+    mHeader->width, mHeader->height};
+}
+
+const uint32_t* DarkFrame::hotPixels() const {
+  const uint8_t* base = static_cast<const uint8_t*>(mMap);
+  return reinterpret_cast<const uint32_t*>(base + mHeader->hotOffset);
+}
+
+uint32_t DarkFrame::hotPixelCount() const {
+  return mHeader->hotPixels;
+}
+
+bool DarkFrame::isHot(uint32_t x, uint32_t y) const {
+  const uint32_t* hot = hotPixels();
+  return std::binary_search(hot, hot + mHeader->hotPixels,
+                            y * mHeader->width + x);
+}
+
+
+size_t DarkLibrary::load(const std::string& dir) {
+  mFrames.clear();
+
+  DIR* d = opendir(dir.c_str());
+  if (d == nullptr) {
+    return 0;
+  }
+  static const char SUFFIX[] = ".dark";
+  const size_t suffixLength = sizeof(SUFFIX) - 1;
+  std::vector<std::string> paths;
+  while (struct dirent* entry = readdir(d)) {
+    const size_t length = strlen(entry->d_name);
+    if ((length > suffixLength) &&
+        (strcmp(entry->d_name + length - suffixLength, SUFFIX) == 0)) {
+      paths.push_back(dir + "/" + entry->d_name);
+    }
+  }
+  closedir(d);
+
+  // Sorted, so ties in find() always go the same way
+  std::sort(paths.begin(), paths.end());
+  for (const auto& path : paths) {
+    DarkFrame frame;
+    if (frame.open(path)) {
+      mFrames.push_back(std::move(frame));
+    }
+  }
+  return mFrames.size();
+}
+
+const DarkFrame* DarkLibrary::find(const DarkKey& key, uint32_t width,
+                                   uint32_t height) const {
+  const DarkFrame* best = nullptr;
+  int32_t bestDistance = 0;
+  for (const auto& frame : mFrames) {
+    const DarkKey k = frame.key();
+    if ((k.iso != key.iso) || (k.shutterUs != key.shutterUs) ||
+        (frame.width() != width) || (frame.height() != height)) {
+      continue;
+    }
+    const int32_t distance = std::abs(k.temperature - key.temperature);
+    if ((best == nullptr) || (distance < bestDistance)) {
+      best = &frame;
+      bestDistance = distance;
+    }
+  }
+  return best;
+}
+
+size_t DarkLibrary::size() const {
+  return mFrames.size();
+}
+
+
+/**
+ * Replace each hot pixel with the (upper) median of its neighbours that
+ * aren't hot. Neighbours that are hot are never written here, so the order
+ * doesn't matter.
+ */
+template <typename T>
+static void repairHotPixels(Plane<T> out, const DarkFrame& dark) {
+  const uint32_t* hot = dark.hotPixels();
+  const uint32_t count = dark.hotPixelCount();
+  const uint32_t width = out.width;
+  const uint32_t height = out.height;
+  for (uint32_t h = 0; h < count; h++) {
+    const uint32_t x = hot[h] % width;
+    const uint32_t y = hot[h] / width;
+    T neighbours[8];
+    unsigned n = 0;
+    for (int dy = -1; dy <= 1; dy++) {
+      for (int dx = -1; dx <= 1; dx++) {
+        const uint32_t nx = x + dx;
+        const uint32_t ny = y + dy;
+        // Out of range wraps around to a large value
+        if (((dx == 0) && (dy == 0)) || (nx >= width) || (ny >= height) ||
+            dark.isHot(nx, ny)) {
+          continue;
+        }
+        neighbours[n++] = out.row(ny)[nx];
+      }
+    }
+    if (n > 0) {
+      std::nth_element(neighbours, neighbours + n / 2, neighbours + n);
+      out.row(y)[x] = neighbours[n / 2];
+    }
+  }
+}
+
+template <typename T>
+static bool calibrateImpl(Plane<const T> in, Plane<T> out,
+                          const DarkFrame& dark, WorkerPool* pool,
+                          const DarkKernels& kernels) {
+  if (!dark.isOpen() || (in.width != dark.width()) ||
+      (in.height != dark.height()) || (out.width != in.width) ||
+      (out.height != in.height)) {
+    return false;
+  }
+
+  const Plane<const uint16_t> master = dark.master();
+  WorkerPool::runBands(pool, in.height, [&](uint32_t y0, uint32_t y1) {
+    for (uint32_t y = y0; y < y1; y++) {
+      if constexpr (sizeof(T) == 1) {
+        kernels.subtract8(in.row(y), master.row(y), out.row(y), in.width);
+      } else {
+        kernels.subtract16(in.row(y), master.row(y), out.row(y), in.width);
+      }
+    }
+  });
+  // A few thousand pixels at most; not worth the pool
+  repairHotPixels(out, dark);
+  return true;
+}
+
+bool calibrate(Plane<const uint8_t> in, Plane<uint8_t> out,
+               const DarkFrame& dark, WorkerPool* pool) {
+  return calibrateImpl(in, out, dark, pool, darkKernels());
+}
+
+bool calibrate(Plane<const uint16_t> in, Plane<uint16_t> out,
+               const DarkFrame& dark, WorkerPool* pool) {
+  return calibrateImpl(in, out, dark, pool, darkKernels());
+}
+
+bool calibrate(Plane<const uint8_t> in, Plane<uint8_t> out,
+               const DarkFrame& dark, WorkerPool* pool,
+               const DarkKernels& kernels) {
+  return calibrateImpl(in, out, dark, pool, kernels);
+}
+
+bool calibrate(Plane<const uint16_t> in, Plane<uint16_t> out,
+               const DarkFrame& dark, WorkerPool* pool,
+               const DarkKernels& kernels) {
+  return calibrateImpl(in, out, dark, pool, kernels);
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "fft.hpp"
+
+// Columns transformed together: 8 complex floats is one 64-byte cache line
+// of each row
+static const uint32_t COLUMN_BLOCK = 8;
+// Tasks per worker thread
+static const size_t TASKS_PER_THREAD = 4;
+
+
+Fft2d::Fft2d(uint32_t size, WorkerPool* pool)
+  : mSize{size}
+  , mPool{pool}
+  , mTwiddles(size / 2)
+  , mBitReverse(size)
+  , mScratch{}
+{
+  for (uint32_t k = 0; k < size / 2; k++) {
+    const double angle = -2.0 * M_PI * k / size;
+    mTwiddles[k] = Complex(std::cos(angle), std::sin(angle));
+  }
+  unsigned bits = 0;
+  while ((1u << bits) < size) {
+    bits++;
+  }
+  for (uint32_t i = 0; i < size; i++) {
+    uint32_t r = 0;
+    for (unsigned b = 0; b < bits; b++) {
+      r |= ((i >> b) & 1) << (bits - 1 - b);
+    }
+    mBitReverse[i] = r;
+  }
+}
+
+void Fft2d::forward(Complex* data) {
+  transform(data, false);
+}
+
+void Fft2d::inverse(Complex* data) {
+  transform(data, true);
+  const float scale = 1.0f / (static_cast<float>(mSize) * mSize);
+  for (size_t i = 0; i < static_cast<size_t>(mSize) * mSize; i++) {
+    data[i] *= scale;
+  }
+}
+
+/**
+ * Iterative radix-2 decimation in time.
+ */
+void Fft2d::transform1d(Complex* data, bool inverse) const {
+  const uint32_t n = mSize;
+  for (uint32_t i = 0; i < n; i++) {
+    const uint32_t j = mBitReverse[i];
+    if (i < j) {
+      std::swap(data[i], data[j]);
+    }
+  }
+  for (uint32_t half = 1; half < n; half <<= 1) {
+    const uint32_t step = n / (2 * half);
+    for (uint32_t start = 0; start < n; start += 2 * half) {
+      for (uint32_t k = 0; k < half; k++) {
+        Complex w = mTwiddles[k * step];
+        if (inverse) {
+          w = std::conj(w);
+        }
+        const Complex a = data[start + k];
+        const Complex b = data[start + k + half] * w;
+        data[start + k] = a + b;
+        data[start + k + half] = a - b;
+      }
+    }
+  }
+}
+
+void Fft2d::transform(Complex* data, bool inverse) {
+  const uint32_t n = mSize;
+  size_t tasks = 1;
+  if (mPool != nullptr) {
+    tasks = std::min<size_t>(mPool->size() * TASKS_PER_THREAD,
+                             std::max<uint32_t>(n / COLUMN_BLOCK, 1));
+  }
+  auto run = [&](const std::function<void(size_t)>& task) {
+    if (tasks == 1) {
+      task(0);
+    } else {
+      mPool->run(tasks, task);
+    }
+  };
+
+  // Rows
+  run([&](size_t t) {
+    const uint32_t y0 = n * t / tasks;
+    const uint32_t y1 = n * (t + 1) / tasks;
+    for (uint32_t y = y0; y < y1; y++) {
+      transform1d(data + static_cast<size_t>(y) * n, inverse);
+    }
+  });
+
+  // Columns, COLUMN_BLOCK at a time through scratch
+  mScratch.resize(tasks);
+  const uint32_t blocks = (n + COLUMN_BLOCK - 1) / COLUMN_BLOCK;
+  run([&](size_t t) {
+    std::vector<Complex>& scratch = mScratch[t];
+    scratch.resize(static_cast<size_t>(n) * COLUMN_BLOCK);
+    const uint32_t b0 = blocks * t / tasks;
+    const uint32_t b1 = blocks * (t + 1) / tasks;
+    for (uint32_t b = b0; b < b1; b++) {
+      const uint32_t x0 = b * COLUMN_BLOCK;
+      const uint32_t width = std::min(COLUMN_BLOCK, n - x0);
+      for (uint32_t y = 0; y < n; y++) {
+        const Complex* row = data + static_cast<size_t>(y) * n + x0;
+        for (uint32_t c = 0; c < width; c++) {
+          scratch[static_cast<size_t>(c) * n + y] = row[c];
+        }
+      }
+      for (uint32_t c = 0; c < width; c++) {
+        transform1d(&scratch[static_cast<size_t>(c) * n], inverse);
+      }
+      for (uint32_t y = 0; y < n; y++) {
+        Complex* row = data + static_cast<size_t>(y) * n + x0;
+        for (uint32_t c = 0; c < width; c++) {
+          row[c] = scratch[static_cast<size_t>(c) * n + y];
+        }
+      }
+    }
+  });
+}
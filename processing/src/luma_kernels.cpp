@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "luma_kernels.hpp"
+
+// The scalar kernels, which the others are checked against. The SIMD sets
+// use the tail helpers here for whatever's left over after their last full
+// vector.
+
+static void rgbaLumaSumScalar(const uint8_t* rgba, uint16_t* out,
+                              size_t pixels) {
+  for (size_t i = 0; i < pixels; i++) {
+    out[i] = rgba[4 * i] + rgba[4 * i + 1] + rgba[4 * i + 2];
+  }
+}
+
+static void rgbLumaSumScalar(const uint8_t* rgb, uint16_t* out,
+                             size_t pixels) {
+  for (size_t i = 0; i < pixels; i++) {
+    out[i] = rgb[3 * i] + rgb[3 * i + 1] + rgb[3 * i + 2];
+  }
+}
+
+template <typename T>
+static size_t thresholdMaskScalar(const T* in, uint64_t* mask, size_t pixels,
+                                  T threshold) {
+  size_t count = 0;
+  for (size_t w = 0; w < maskWords(pixels); w++) {
+    uint64_t word = 0;
+    const size_t end = (pixels - w * 64 < 64) ? pixels - w * 64 : 64;
+    for (size_t b = 0; b < end; b++) {
+      word |= static_cast<uint64_t>(in[w * 64 + b] >= threshold) << b;
+    }
+    mask[w] = word;
+    count += __builtin_popcountll(word);
+  }
+  return count;
+}
+
+static size_t thresholdMask8Scalar(const uint8_t* in, uint64_t* mask,
+                                   size_t pixels, uint8_t threshold) {
+  return thresholdMaskScalar(in, mask, pixels, threshold);
+}
+
+static size_t thresholdMask16Scalar(const uint16_t* in, uint64_t* mask,
+                                    size_t pixels, uint16_t threshold) {
+  return thresholdMaskScalar(in, mask, pixels, threshold);
+}
+
+static const LumaKernels SCALAR_KERNELS = {
+  "scalar",
+  rgbaLumaSumScalar,
+  rgbLumaSumScalar,
+  thresholdMask8Scalar,
+  thresholdMask16Scalar,
+};
+
+
+const LumaKernels& scalarLumaKernels() {
+  return SCALAR_KERNELS;
+}
+
+std::vector<const LumaKernels*> supportedLumaKernels() {
+  std::vector<const LumaKernels*> kernels{&SCALAR_KERNELS};
+  for (auto* k : {sse2LumaKernels(), avx2LumaKernels(), neonLumaKernels()}) {
+    if (k != nullptr) {
+      kernels.push_back(k);
+    }
+  }
+  return kernels;
+}
+
+const LumaKernels& lumaKernels() {
+  // Later sets are faster
+  static const LumaKernels& best = *supportedLumaKernels().back();
+  return best;
+}
+
+Plane<const uint8_t> i420LumaPlane(const uint8_t* buffer, uint32_t width,
+                                   uint32_t height) {
+  const uint32_t stride = (width + 31) & ~31u;
+  return Plane<const uint8_t>{buffer, width, height, stride};
+}
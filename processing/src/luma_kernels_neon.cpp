@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "luma_kernels.hpp"
+
+#if defined(__ARM_NEON)
+
+#include <arm_neon.h>
+#if !defined(__aarch64__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+// NEON kernels. On 32-bit ARM this file is built with -mfpu=neon on its own
+// (the Pi Zero and 1 don't have NEON), and only used if the kernel says the
+// CPU has it.
+//
+// vld3/vld4 deinterleave the channels for us, so the sums are just widening
+// adds. NEON has no movemask, so thresholds AND each 0xFF/0x00 lane with its
+// bit's weight and add neighbouring lanes together until there's a byte per
+// 8 pixels.
+
+static inline void rgbaTail(const uint8_t* rgba, uint16_t* out, size_t i,
+                            size_t pixels) {
+  for (; i < pixels; i++) {
+    out[i] = rgba[4 * i] + rgba[4 * i + 1] + rgba[4 * i + 2];
+  }
+}
+
+static inline void rgbTail(const uint8_t* rgb, uint16_t* out, size_t i,
+                           size_t pixels) {
+  for (; i < pixels; i++) {
+    out[i] = rgb[3 * i] + rgb[3 * i + 1] + rgb[3 * i + 2];
+  }
+}
+
+template <typename T>
+static inline size_t maskTail(const T* in, uint64_t* mask, size_t i,
+                              size_t pixels, T threshold) {
+  size_t count = 0;
+  uint64_t word = (i % 64 == 0) ? 0 : mask[i / 64];
+  for (; i < pixels; i++) {
+    const uint64_t bit = in[i] >= threshold;
+    word |= bit << (i % 64);
+    count += bit;
+    if ((i % 64 == 63) || (i + 1 == pixels)) {
+      mask[i / 64] = word;
+      word = 0;
+    }
+  }
+  return count;
+}
+
+static inline void storeSums(uint16_t* out, uint8x16_t r, uint8x16_t g,
+                             uint8x16_t b) {
+  uint16x8_t low = vaddw_u8(vaddl_u8(vget_low_u8(r), vget_low_u8(g)),
+                            vget_low_u8(b));
+  uint16x8_t high = vaddw_u8(vaddl_u8(vget_high_u8(r), vget_high_u8(g)),
+                             vget_high_u8(b));
+  vst1q_u16(out, low);
+  vst1q_u16(out + 8, high);
+}
+
+/**
+ * 16 bits, one per lane of ge (all ones or all zeroes).
+ */
+static inline uint64_t movemask(uint8x16_t ge) {
+  static const uint8_t WEIGHTS[16] = {
+    1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128,
+  };
+  uint8x16_t bits = vandq_u8(ge, vld1q_u8(WEIGHTS));
+  uint8x8_t sum = vpadd_u8(vget_low_u8(bits), vget_high_u8(bits));
+  sum = vpadd_u8(sum, sum);
+  sum = vpadd_u8(sum, sum);
+  return vget_lane_u16(vreinterpret_u16_u8(sum), 0);
+}
+
+static inline size_t depositBits(uint64_t* mask, size_t i, uint64_t bits) {
+  const size_t shift = i % 64;
+  if (shift == 0) {
+    mask[i / 64] = bits;
+  } else {
+    mask[i / 64] |= bits << shift;
+  }
+  return __builtin_popcountll(bits);
+}
+
+
+static void rgbaLumaSumNEON(const uint8_t* rgba, uint16_t* out,
+                            size_t pixels) {
+  size_t i = 0;
+  for (; i + 16 <= pixels; i += 16) {
+    uint8x16x4_t v = vld4q_u8(rgba + 4 * i);
+    storeSums(out + i, v.val[0], v.val[1], v.val[2]);
+  }
+  rgbaTail(rgba, out, i, pixels);
+}
+
+static void rgbLumaSumNEON(const uint8_t* rgb, uint16_t* out,
+                           size_t pixels) {
+  size_t i = 0;
+  for (; i + 16 <= pixels; i += 16) {
+    uint8x16x3_t v = vld3q_u8(rgb + 3 * i);
+    storeSums(out + i, v.val[0], v.val[1], v.val[2]);
+  }
+  rgbTail(rgb, out, i, pixels);
+}
+
+static size_t thresholdMask8NEON(const uint8_t* in, uint64_t* mask,
+                                 size_t pixels, uint8_t threshold) {
+  const uint8x16_t t = vdupq_n_u8(threshold);
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 16 <= pixels; i += 16) {
+    count += depositBits(mask, i, movemask(vcgeq_u8(vld1q_u8(in + i), t)));
+  }
+  return count + maskTail(in, mask, i, pixels, threshold);
+}
+
+static size_t thresholdMask16NEON(const uint16_t* in, uint64_t* mask,
+                                  size_t pixels, uint16_t threshold) {
+  const uint16x8_t t = vdupq_n_u16(threshold);
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 16 <= pixels; i += 16) {
+    uint8x8_t a = vmovn_u16(vcgeq_u16(vld1q_u16(in + i), t));
+    uint8x8_t b = vmovn_u16(vcgeq_u16(vld1q_u16(in + i + 8), t));
+    count += depositBits(mask, i, movemask(vcombine_u8(a, b)));
+  }
+  return count + maskTail(in, mask, i, pixels, threshold);
+}
+
+
+const LumaKernels* neonLumaKernels() {
+  static const LumaKernels kernels = {
+    "neon",
+    rgbaLumaSumNEON,
+    rgbLumaSumNEON,
+    thresholdMask8NEON,
+    thresholdMask16NEON,
+  };
+#if defined(__aarch64__)
+  return &kernels;
+#else
+  return (getauxval(AT_HWCAP) & HWCAP_NEON) ? &kernels : nullptr;
+#endif
+}
+
+#else
+
+const LumaKernels* neonLumaKernels() {
+  return nullptr;
+}
+
+#endif
@@ -0,0 +1,291 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "luma_kernels.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+// SSE2 and AVX2 kernels. They're compiled with target attributes rather than
+// -m flags so the rest of the library still runs on any x86; lumaKernels()
+// only hands them out when the CPU has the instructions.
+//
+// Sums are R + G + B per 32-bit pixel, masking out the other channels after
+// shifting each into the low byte, then packed down to 16 bits (at most 765,
+// so signed saturation never kicks in). Thresholds are x >= t, computed as
+// "t - x saturates to zero" since there's no unsigned compare, then packed
+// into bits with movemask.
+
+#define SSE2 __attribute__((target("sse2")))
+#define SSSE3 __attribute__((target("ssse3")))
+#define AVX2 __attribute__((target("avx2")))
+
+SSE2 static inline __m128i rgbxSum128(__m128i v) {
+  const __m128i lowByte = _mm_set1_epi32(0xFF);
+  __m128i sum = _mm_and_si128(v, lowByte);
+  sum = _mm_add_epi32(sum, _mm_and_si128(_mm_srli_epi32(v, 8), lowByte));
+  return _mm_add_epi32(sum, _mm_and_si128(_mm_srli_epi32(v, 16), lowByte));
+}
+
+AVX2 static inline __m256i rgbxSum256(__m256i v) {
+  const __m256i lowByte = _mm256_set1_epi32(0xFF);
+  __m256i sum = _mm256_and_si256(v, lowByte);
+  sum = _mm256_add_epi32(sum, _mm256_and_si256(_mm256_srli_epi32(v, 8), lowByte));
+  return _mm256_add_epi32(sum, _mm256_and_si256(_mm256_srli_epi32(v, 16), lowByte));
+}
+
+/**
+ * Store 16 pixel sums, from two vectors of 8 (whose 128-bit lanes packs
+ * interleaves).
+ */
+AVX2 static inline void storeSums256(uint16_t* out, __m256i a, __m256i b) {
+  __m256i packed = _mm256_packs_epi32(a, b);
+  packed = _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0));
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), packed);
+}
+
+static inline void rgbaTail(const uint8_t* rgba, uint16_t* out, size_t i,
+                            size_t pixels) {
+  for (; i < pixels; i++) {
+    out[i] = rgba[4 * i] + rgba[4 * i + 1] + rgba[4 * i + 2];
+  }
+}
+
+static inline void rgbTail(const uint8_t* rgb, uint16_t* out, size_t i,
+                           size_t pixels) {
+  for (; i < pixels; i++) {
+    out[i] = rgb[3 * i] + rgb[3 * i + 1] + rgb[3 * i + 2];
+  }
+}
+
+/**
+ * Finish a mask from pixel i on, returning the number of bits it set.
+ */
+template <typename T>
+static inline size_t maskTail(const T* in, uint64_t* mask, size_t i,
+                              size_t pixels, T threshold) {
+  size_t count = 0;
+  uint64_t word = (i % 64 == 0) ? 0 : mask[i / 64];
+  for (; i < pixels; i++) {
+    const uint64_t bit = in[i] >= threshold;
+    word |= bit << (i % 64);
+    count += bit;
+    if ((i % 64 == 63) || (i + 1 == pixels)) {
+      mask[i / 64] = word;
+      word = 0;
+    }
+  }
+  return count;
+}
+
+/**
+ * Deposit the bits for the pixels from i on, all in the same word, and
+ * return how many were set.
+ */
+static inline size_t depositBits(uint64_t* mask, size_t i, uint64_t bits) {
+  const size_t shift = i % 64;
+  if (shift == 0) {
+    mask[i / 64] = bits;
+  } else {
+    mask[i / 64] |= bits << shift;
+  }
+  return __builtin_popcountll(bits);
+}
+
+
+SSE2 static void rgbaLumaSumSSE2(const uint8_t* rgba, uint16_t* out,
+                                 size_t pixels) {
+  size_t i = 0;
+  for (; i + 8 <= pixels; i += 8) {
+    const __m128i* p = reinterpret_cast<const __m128i*>(rgba + 4 * i);
+    __m128i a = rgbxSum128(_mm_loadu_si128(p));
+    __m128i b = rgbxSum128(_mm_loadu_si128(p + 1));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+                     _mm_packs_epi32(a, b));
+  }
+  rgbaTail(rgba, out, i, pixels);
+}
+
+/**
+ * Spread 4 packed RGB pixels (the low 12 bytes) out to RGBx.
+ */
+SSSE3 static inline __m128i rgbToRgbx128(__m128i v) {
+  const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+                                       6, 7, 8, -1, 9, 10, 11, -1);
+  return _mm_shuffle_epi8(v, spread);
+}
+
+SSSE3 static void rgbLumaSumSSSE3(const uint8_t* rgb, uint16_t* out,
+                                  size_t pixels) {
+  size_t i = 0;
+  // Each load reads 16 bytes for 12 bytes of pixels; stop while the last one
+  // is still inside the buffer
+  for (; (i + 8) * 3 + 4 <= pixels * 3; i += 8) {
+    const uint8_t* p = rgb + 3 * i;
+    __m128i a = rgbxSum128(rgbToRgbx128(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(p))));
+    __m128i b = rgbxSum128(rgbToRgbx128(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 12))));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+                     _mm_packs_epi32(a, b));
+  }
+  rgbTail(rgb, out, i, pixels);
+}
+
+SSE2 static size_t thresholdMask8SSE2(const uint8_t* in, uint64_t* mask,
+                                      size_t pixels, uint8_t threshold) {
+  const __m128i t = _mm_set1_epi8(static_cast<char>(threshold));
+  const __m128i zero = _mm_setzero_si128();
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 16 <= pixels; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    __m128i ge = _mm_cmpeq_epi8(_mm_subs_epu8(t, v), zero);
+    count += depositBits(mask, i,
+                         static_cast<uint16_t>(_mm_movemask_epi8(ge)));
+  }
+  return count + maskTail(in, mask, i, pixels, threshold);
+}
+
+SSE2 static size_t thresholdMask16SSE2(const uint16_t* in, uint64_t* mask,
+                                       size_t pixels, uint16_t threshold) {
+  const __m128i t = _mm_set1_epi16(static_cast<short>(threshold));
+  const __m128i zero = _mm_setzero_si128();
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 16 <= pixels; i += 16) {
+    const __m128i* p = reinterpret_cast<const __m128i*>(in + i);
+    __m128i a = _mm_cmpeq_epi16(_mm_subs_epu16(t, _mm_loadu_si128(p)), zero);
+    __m128i b = _mm_cmpeq_epi16(_mm_subs_epu16(t, _mm_loadu_si128(p + 1)), zero);
+    __m128i ge = _mm_packs_epi16(a, b);
+    count += depositBits(mask, i,
+                         static_cast<uint16_t>(_mm_movemask_epi8(ge)));
+  }
+  return count + maskTail(in, mask, i, pixels, threshold);
+}
+
+
+AVX2 static void rgbaLumaSumAVX2(const uint8_t* rgba, uint16_t* out,
+                                 size_t pixels) {
+  size_t i = 0;
+  for (; i + 16 <= pixels; i += 16) {
+    const __m256i* p = reinterpret_cast<const __m256i*>(rgba + 4 * i);
+    storeSums256(out + i, rgbxSum256(_mm256_loadu_si256(p)),
+                 rgbxSum256(_mm256_loadu_si256(p + 1)));
+  }
+  rgbaTail(rgba, out, i, pixels);
+}
+
+/**
+ * Load 8 packed RGB pixels as RGBx, 4 from each 128-bit lane.
+ */
+AVX2 static inline __m256i loadRgbx256(const uint8_t* p) {
+  const __m256i spread = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+                                          6, 7, 8, -1, 9, 10, 11, -1,
+                                          0, 1, 2, -1, 3, 4, 5, -1,
+                                          6, 7, 8, -1, 9, 10, 11, -1);
+  __m256i v = _mm256_castsi128_si256(
+    _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+  v = _mm256_inserti128_si256(
+    v, _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 12)), 1);
+  return _mm256_shuffle_epi8(v, spread);
+}
+
+AVX2 static void rgbLumaSumAVX2(const uint8_t* rgb, uint16_t* out,
+                                size_t pixels) {
+  size_t i = 0;
+  // As with SSSE3, the last load overreads by 4 bytes
+  for (; (i + 16) * 3 + 4 <= pixels * 3; i += 16) {
+    const uint8_t* p = rgb + 3 * i;
+    storeSums256(out + i, rgbxSum256(loadRgbx256(p)),
+                 rgbxSum256(loadRgbx256(p + 24)));
+  }
+  rgbTail(rgb, out, i, pixels);
+}
+
+AVX2 static size_t thresholdMask8AVX2(const uint8_t* in, uint64_t* mask,
+                                      size_t pixels, uint8_t threshold) {
+  const __m256i t = _mm256_set1_epi8(static_cast<char>(threshold));
+  const __m256i zero = _mm256_setzero_si256();
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 64 <= pixels; i += 64) {
+    const __m256i* p = reinterpret_cast<const __m256i*>(in + i);
+    __m256i a = _mm256_cmpeq_epi8(_mm256_subs_epu8(t, _mm256_loadu_si256(p)), zero);
+    __m256i b = _mm256_cmpeq_epi8(_mm256_subs_epu8(t, _mm256_loadu_si256(p + 1)), zero);
+    uint64_t bits = static_cast<uint32_t>(_mm256_movemask_epi8(a)) |
+      (static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(b))) << 32);
+    mask[i / 64] = bits;
+    count += __builtin_popcountll(bits);
+  }
+  return count + maskTail(in, mask, i, pixels, threshold);
+}
+
+AVX2 static size_t thresholdMask16AVX2(const uint16_t* in, uint64_t* mask,
+                                       size_t pixels, uint16_t threshold) {
+  const __m256i t = _mm256_set1_epi16(static_cast<short>(threshold));
+  const __m256i zero = _mm256_setzero_si256();
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 32 <= pixels; i += 32) {
+    const __m256i* p = reinterpret_cast<const __m256i*>(in + i);
+    __m256i a = _mm256_cmpeq_epi16(_mm256_subs_epu16(t, _mm256_loadu_si256(p)), zero);
+    __m256i b = _mm256_cmpeq_epi16(_mm256_subs_epu16(t, _mm256_loadu_si256(p + 1)), zero);
+    // packs works within 128-bit lanes; put the pixels back in order
+    __m256i ge = _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b),
+                                          _MM_SHUFFLE(3, 1, 2, 0));
+    uint64_t bits = static_cast<uint32_t>(_mm256_movemask_epi8(ge));
+    count += depositBits(mask, i, bits);
+  }
+  return count + maskTail(in, mask, i, pixels, threshold);
+}
+
+
+const LumaKernels* sse2LumaKernels() {
+  static const LumaKernels kernels = {
+    "sse2",
+    rgbaLumaSumSSE2,
+    __builtin_cpu_supports("ssse3") ? rgbLumaSumSSSE3 : scalarLumaKernels().rgbLumaSum,
+    thresholdMask8SSE2,
+    thresholdMask16SSE2,
+  };
+  return __builtin_cpu_supports("sse2") ? &kernels : nullptr;
+}
+
+const LumaKernels* avx2LumaKernels() {
+  static const LumaKernels kernels = {
+    "avx2",
+    rgbaLumaSumAVX2,
+    rgbLumaSumAVX2,
+    thresholdMask8AVX2,
+    thresholdMask16AVX2,
+  };
+  return __builtin_cpu_supports("avx2") ? &kernels : nullptr;
+}
+
+#else
+
+const LumaKernels* sse2LumaKernels() {
+  return nullptr;
+}
+
+const LumaKernels* avx2LumaKernels() {
+  return nullptr;
+}
+
+#endif
@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#if defined(__arm__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+#include "median_filter.hpp"
+#include "median_network.hpp"
+
+// Columns per tile: five rows of 16-bit pixels fit in a 32 KiB L1
+static const uint32_t TILE_WIDTH = 1024;
+
+static const MedianKernels SCALAR_KERNELS = {
+  "scalar",
+  medianRow<ScalarMedianOps<uint8_t>, 3>,
+  medianRow<ScalarMedianOps<uint8_t>, 5>,
+  medianRow<ScalarMedianOps<uint16_t>, 3>,
+  medianRow<ScalarMedianOps<uint16_t>, 5>,
+  medianAcrossRows<ScalarMedianOps<uint16_t>>,
+};
+
+static_assert(MAX_MEDIAN_ROWS == MAX_MEDIAN_INPUTS,
+              "medianAcross16 takes as many rows as the networks have inputs");
+
+
+const MedianKernels& scalarMedianKernels() {
+  return SCALAR_KERNELS;
+}
+
+std::vector<const MedianKernels*> supportedMedianKernels() {
+  std::vector<const MedianKernels*> kernels{&SCALAR_KERNELS};
+  auto add = [&](const MedianKernels* k, bool supported) {
+    if ((k != nullptr) && supported) {
+      kernels.push_back(k);
+    }
+  };
+#if defined(__x86_64__) || defined(__i386__)
+  add(sse2MedianKernels(), __builtin_cpu_supports("sse2"));
+  add(avx2MedianKernels(), __builtin_cpu_supports("avx2"));
+#elif defined(__aarch64__)
+  add(neonMedianKernels(), true);
+#elif defined(__arm__)
+  add(neonMedianKernels(), (getauxval(AT_HWCAP) & HWCAP_NEON) != 0);
+#endif
+  return kernels;
+}
+
+const MedianKernels& medianKernels() {
+  // Later sets are faster
+  static const MedianKernels& best = *supportedMedianKernels().back();
+  return best;
+}
+
+/**
+ * The median at (x, y) where the window hangs off the edge of the image.
+ */
+template <typename T, unsigned SIZE>
+static T edgeMedian(Plane<const T> in, uint32_t x, uint32_t y) {
+  const int half = SIZE / 2;
+  T v[SIZE * SIZE];
+  for (int r = 0; r < static_cast<int>(SIZE); r++) {
+    for (int c = 0; c < static_cast<int>(SIZE); c++) {
+      const int wx = static_cast<int>(x) + c - half;
+      const int wy = static_cast<int>(y) + r - half;
+      const bool inside = (wx >= 0) && (wy >= 0) &&
+        (wx < static_cast<int>(in.width)) && (wy < static_cast<int>(in.height));
+      v[r * SIZE + c] = inside ? in.row(wy)[wx] : 0;
+    }
+  }
+  return median<ScalarMedianOps<T>, SIZE>(v);
+}
+
+template <typename T, unsigned SIZE>
+static void filterBand(Plane<const T> in, Plane<T> out, uint32_t y0,
+                       uint32_t y1,
+                       void (*kernel)(const T* const*, T*, size_t)) {
+  const uint32_t half = SIZE / 2;
+  for (uint32_t x0 = 0; x0 < in.width; x0 += TILE_WIDTH) {
+    const uint32_t x1 = std::min(in.width, x0 + TILE_WIDTH);
+    // Columns whose windows are all inside the image
+    const uint32_t left = std::min(std::max(x0, half), x1);
+    const uint32_t right = std::max(
+      std::min(x1, (in.width > half) ? in.width - half : 0), left);
+    for (uint32_t y = y0; y < y1; y++) {
+      T* o = out.row(y);
+      if ((y < half) || (y + half >= in.height)) {
+        for (uint32_t x = x0; x < x1; x++) {
+          o[x] = edgeMedian<T, SIZE>(in, x, y);
+        }
+        continue;
+      }
+
+      for (uint32_t x = x0; x < left; x++) {
+        o[x] = edgeMedian<T, SIZE>(in, x, y);
+      }
+      if (left < right) {
+        const T* rows[SIZE];
+        for (uint32_t r = 0; r < SIZE; r++) {
+          rows[r] = in.row(y - half + r) + (left - half);
+        }
+        kernel(rows, o + left, right - left);
+      }
+      for (uint32_t x = right; x < x1; x++) {
+        o[x] = edgeMedian<T, SIZE>(in, x, y);
+      }
+    }
+  }
+}
+
+template <typename T, unsigned SIZE>
+static void filter(Plane<const T> in, Plane<T> out, WorkerPool* pool,
+                   void (*kernel)(const T* const*, T*, size_t)) {
+  WorkerPool::runBands(pool, in.height, [&](uint32_t y0, uint32_t y1) {
+    filterBand<T, SIZE>(in, out, y0, y1, kernel);
+  });
+}
+
+template <typename T>
+static bool filter(Plane<const T> in, Plane<T> out, unsigned size,
+                   WorkerPool* pool,
+                   void (*kernel3)(const T* const*, T*, size_t),
+                   void (*kernel5)(const T* const*, T*, size_t)) {
+  if ((out.width != in.width) || (out.height != in.height)) {
+    return false;
+  }
+  if (size == 3) {
+    filter<T, 3>(in, out, pool, kernel3);
+  } else if (size == 5) {
+    filter<T, 5>(in, out, pool, kernel5);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool medianFilter(Plane<const uint8_t> in, Plane<uint8_t> out, unsigned size,
+                  WorkerPool* pool, const MedianKernels& kernels) {
+  return filter(in, out, size, pool, kernels.median3Row8,
+                kernels.median5Row8);
+}
+
+bool medianFilter(Plane<const uint16_t> in, Plane<uint16_t> out,
+                  unsigned size, WorkerPool* pool,
+                  const MedianKernels& kernels) {
+  return filter(in, out, size, pool, kernels.median3Row16,
+                kernels.median5Row16);
+}
+
+bool medianFilter(Plane<const uint8_t> in, Plane<uint8_t> out, unsigned size,
+                  WorkerPool* pool) {
+  return medianFilter(in, out, size, pool, medianKernels());
+}
+
+bool medianFilter(Plane<const uint16_t> in, Plane<uint16_t> out,
+                  unsigned size, WorkerPool* pool) {
+  return medianFilter(in, out, size, pool, medianKernels());
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "median_filter.hpp"
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+#include "median_network.hpp"
+
+namespace {
+
+struct AVX2Ops8 {
+  using Vector = __m256i;
+  using Scalar = uint8_t;
+  static const size_t LANES = 32;
+
+  static Vector min(Vector a, Vector b) {
+    return _mm256_min_epu8(a, b);
+  }
+  static Vector max(Vector a, Vector b) {
+    return _mm256_max_epu8(a, b);
+  }
+  static Vector load(const Scalar* p) {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+  }
+  static void store(Scalar* p, Vector v) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v);
+  }
+};
+
+struct AVX2Ops16 {
+  using Vector = __m256i;
+  using Scalar = uint16_t;
+  static const size_t LANES = 16;
+
+  static Vector min(Vector a, Vector b) {
+    return _mm256_min_epu16(a, b);
+  }
+  static Vector max(Vector a, Vector b) {
+    return _mm256_max_epu16(a, b);
+  }
+  static Vector load(const Scalar* p) {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+  }
+  static void store(Scalar* p, Vector v) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v);
+  }
+};
+
+} // namespace
+
+const MedianKernels* avx2MedianKernels() {
+  static const MedianKernels kernels = {
+    "avx2",
+    medianRow<AVX2Ops8, 3>,
+    medianRow<AVX2Ops8, 5>,
+    medianRow<AVX2Ops16, 3>,
+    medianRow<AVX2Ops16, 5>,
+    medianAcrossRows<AVX2Ops16>,
+  };
+  return &kernels;
+}
+
+#else
+
+const MedianKernels* avx2MedianKernels() {
+  return nullptr;
+}
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "median_filter.hpp"
+
+#if defined(__ARM_NEON)
+
+#include <arm_neon.h>
+
+#include "median_network.hpp"
+
+namespace {
+
+struct NEONOps8 {
+  using Vector = uint8x16_t;
+  using Scalar = uint8_t;
+  static const size_t LANES = 16;
+
+  static Vector min(Vector a, Vector b) {
+    return vminq_u8(a, b);
+  }
+  static Vector max(Vector a, Vector b) {
+    return vmaxq_u8(a, b);
+  }
+  static Vector load(const Scalar* p) {
+    return vld1q_u8(p);
+  }
+  static void store(Scalar* p, Vector v) {
+    vst1q_u8(p, v);
+  }
+};
+
+struct NEONOps16 {
+  using Vector = uint16x8_t;
+  using Scalar = uint16_t;
+  static const size_t LANES = 8;
+
+  static Vector min(Vector a, Vector b) {
+    return vminq_u16(a, b);
+  }
+  static Vector max(Vector a, Vector b) {
+    return vmaxq_u16(a, b);
+  }
+  static Vector load(const Scalar* p) {
+    return vld1q_u16(p);
+  }
+  static void store(Scalar* p, Vector v) {
+    vst1q_u16(p, v);
+  }
+};
+
+} // namespace
+
+const MedianKernels* neonMedianKernels() {
+  static const MedianKernels kernels = {
+    "neon",
+    medianRow<NEONOps8, 3>,
+    medianRow<NEONOps8, 5>,
+    medianRow<NEONOps16, 3>,
+    medianRow<NEONOps16, 5>,
+    medianAcrossRows<NEONOps16>,
+  };
+  return &kernels;
+}
+
+#else
+
+const MedianKernels* neonMedianKernels() {
+  return nullptr;
+}
+
+#endif
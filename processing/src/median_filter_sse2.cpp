@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "median_filter.hpp"
+
+#if defined(__SSE2__)
+
+#include <emmintrin.h>
+
+#include "median_network.hpp"
+
+// SSE2 has unsigned min and max for bytes but not for 16-bit words; those
+// come from saturating subtraction instead.
+
+namespace {
+
+struct SSE2Ops8 {
+  using Vector = __m128i;
+  using Scalar = uint8_t;
+  static const size_t LANES = 16;
+
+  static Vector min(Vector a, Vector b) {
+    return _mm_min_epu8(a, b);
+  }
+  static Vector max(Vector a, Vector b) {
+    return _mm_max_epu8(a, b);
+  }
+  static Vector load(const Scalar* p) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+  }
+  static void store(Scalar* p, Vector v) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v);
+  }
+};
+
+struct SSE2Ops16 {
+  using Vector = __m128i;
+  using Scalar = uint16_t;
+  static const size_t LANES = 8;
+
+  static Vector min(Vector a, Vector b) {
+    return _mm_sub_epi16(a, _mm_subs_epu16(a, b));
+  }
+  static Vector max(Vector a, Vector b) {
+    return _mm_add_epi16(b, _mm_subs_epu16(a, b));
+  }
+  static Vector load(const Scalar* p) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+  }
+  static void store(Scalar* p, Vector v) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v);
+  }
+};
+
+} // namespace
+
+const MedianKernels* sse2MedianKernels() {
+  static const MedianKernels kernels = {
+    "sse2",
+    medianRow<SSE2Ops8, 3>,
+    medianRow<SSE2Ops8, 5>,
+    medianRow<SSE2Ops16, 3>,
+    medianRow<SSE2Ops16, 5>,
+    medianAcrossRows<SSE2Ops16>,
+  };
+  return &kernels;
+}
+
+#else
+
+const MedianKernels* sse2MedianKernels() {
+  return nullptr;
+}
+
+#endif
@@ -0,0 +1,548 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+#include "background.hpp"
+#include "connected_components.hpp"
+#include "dark_frame.hpp"
+#include "luma_kernels.hpp"
+#include "median_filter.hpp"
+#include "registration.hpp"
+#include "stacker.hpp"
+#include "streak_detector.hpp"
+#include "picamproc.h"
+#include "worker_pool.hpp"
+
+static_assert(sizeof(picam_component) == sizeof(Component),
+              "picam_component must match Component");
+static_assert(offsetof(picam_component, flux) == offsetof(Component, flux),
+              "picam_component must match Component");
+static_assert(offsetof(picam_component, peak_y) ==
+              offsetof(Component, peakY),
+              "picam_component must match Component");
+
+static_assert(sizeof(picam_transform) == sizeof(RigidTransform),
+              "picam_transform must match RigidTransform");
+static_assert(offsetof(picam_transform, theta) ==
+              offsetof(RigidTransform, theta),
+              "picam_transform must match RigidTransform");
+
+static_assert(sizeof(picam_streak) == sizeof(Streak),
+              "picam_streak must match Streak");
+static_assert(offsetof(picam_streak, pixels) == offsetof(Streak, pixels),
+              "picam_streak must match Streak");
+
+static_assert(sizeof(picam_dark_key) == sizeof(DarkKey),
+              "picam_dark_key must match DarkKey");
+static_assert(offsetof(picam_dark_key, temperature) ==
+              offsetof(DarkKey, temperature),
+              "picam_dark_key must match DarkKey");
+
+static WorkerPool& pool() {
+  static WorkerPool pool{};
+  return pool;
+}
+
+struct picam_stacker {
+  picam_stacker(const Stacker::Config& config, WorkerPool* pool)
+    : stacker{config, [this](const Stacker::Stack& stack) {
+        const size_t pixels = static_cast<size_t>(stack.pixels.width) *
+          stack.pixels.height;
+        latest.assign(stack.pixels.data, stack.pixels.data + pixels);
+        latestFrames = stack.frames;
+        fresh = true;
+      }, pool}
+    , latest{}
+    , latestFrames{0}
+    , fresh{false}
+  { }
+
+  Stacker stacker;
+  // The last stack handed over, until the next
+  std::vector<float> latest;
+  unsigned latestFrames;
+  // Whether the last call handed one over
+  bool fresh;
+};
+
+struct picam_registrar {
+  picam_registrar(const Registrar::Config& config, WorkerPool* pool)
+    : registrar{config, pool}
+  { }
+
+  Registrar registrar;
+};
+
+struct picam_streak_detector {
+  picam_streak_detector(const StreakDetector::Config& config,
+                        WorkerPool* pool)
+    : detector{config, pool}
+    , streaks{}
+  { }
+
+  StreakDetector detector;
+  // What the last frame had
+  std::vector<Streak> streaks;
+};
+
+struct picam_dark_builder {
+  picam_dark_builder(uint32_t width, uint32_t height, WorkerPool* pool)
+    : builder{width, height, pool}
+    , width{width}
+    , height{height}
+  { }
+
+  DarkFrameBuilder builder;
+  const uint32_t width;
+  const uint32_t height;
+};
+
+struct picam_dark {
+  DarkFrame frame;
+};
+
+struct picam_background {
+  picam_background(const BackgroundEstimator::Config& config,
+                   WorkerPool* pool)
+    : estimator{config, pool}
+  { }
+
+  BackgroundEstimator estimator;
+};
+
+/**
+ * With thresholds null, every pixel's threshold is threshold.
+ */
+template <typename T>
+static size_t label(const T* data, uint32_t width, uint32_t height,
+                    size_t stride, uint32_t threshold,
+                    const uint16_t* thresholds, uint32_t minArea,
+                    int eightConnected, uint32_t* labels,
+                    picam_component* components, size_t maxComponents) {
+  ComponentLabeller::Config config{};
+  config.threshold = threshold;
+  config.minArea = minArea;
+  config.eightConnected = eightConnected != 0;
+  ComponentLabeller labeller{config, &pool()};
+
+  std::vector<Component> found;
+  const Plane<const T> image{data, width, height, stride};
+  const Plane<uint32_t> labelPlane{labels, width, height};
+  const Plane<uint32_t>* labelsOut = (labels != nullptr) ? &labelPlane :
+    nullptr;
+  if (thresholds != nullptr) {
+    labeller.label(image, Plane<const uint16_t>{thresholds, width, height},
+                   found, labelsOut);
+  } else {
+    labeller.label(image, found, labelsOut);
+  }
+
+  const size_t count = std::min(found.size(), maxComponents);
+  std::copy_n(found.begin(), count,
+              reinterpret_cast<Component*>(components));
+  return found.size();
+}
+
+size_t picam_label_u8(const uint8_t* data, uint32_t width, uint32_t height,
+                      size_t stride, uint32_t threshold, uint32_t min_area,
+                      int eight_connected, uint32_t* labels,
+                      picam_component* components, size_t max_components) {
+  return label(data, width, height, stride, threshold, nullptr, min_area,
+               eight_connected, labels, components, max_components);
+}
+
+size_t picam_label_u16(const uint16_t* data, uint32_t width, uint32_t height,
+                       size_t stride, uint32_t threshold, uint32_t min_area,
+                       int eight_connected, uint32_t* labels,
+                       picam_component* components, size_t max_components) {
+  return label(data, width, height, stride, threshold, nullptr, min_area,
+               eight_connected, labels, components, max_components);
+}
+
+size_t picam_label_adaptive_u8(const uint8_t* data, uint32_t width,
+                               uint32_t height, size_t stride,
+                               const uint16_t* thresholds, uint32_t min_area,
+                               int eight_connected, uint32_t* labels,
+                               picam_component* components,
+                               size_t max_components) {
+  return label(data, width, height, stride, 0, thresholds, min_area,
+               eight_connected, labels, components, max_components);
+}
+
+size_t picam_label_adaptive_u16(const uint16_t* data, uint32_t width,
+                                uint32_t height, size_t stride,
+                                const uint16_t* thresholds, uint32_t min_area,
+                                int eight_connected, uint32_t* labels,
+                                picam_component* components,
+                                size_t max_components) {
+  return label(data, width, height, stride, 0, thresholds, min_area,
+               eight_connected, labels, components, max_components);
+}
+
+int picam_luma_sum(const uint8_t* data, size_t pixels, uint32_t channels,
+                   uint16_t* out) {
+  if (channels == 4) {
+    lumaKernels().rgbaLumaSum(data, out, pixels);
+  } else if (channels == 3) {
+    lumaKernels().rgbLumaSum(data, out, pixels);
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+size_t picam_threshold_mask_u8(const uint8_t* data, size_t pixels,
+                               uint32_t threshold, uint64_t* mask) {
+  if (threshold > UINT8_MAX) {
+    std::fill_n(mask, maskWords(pixels), 0);
+    return 0;
+  }
+  return lumaKernels().thresholdMask8(data, mask, pixels, threshold);
+}
+
+size_t picam_threshold_mask_u16(const uint16_t* data, size_t pixels,
+                                uint32_t threshold, uint64_t* mask) {
+  if (threshold > UINT16_MAX) {
+    std::fill_n(mask, maskWords(pixels), 0);
+    return 0;
+  }
+  return lumaKernels().thresholdMask16(data, mask, pixels, threshold);
+}
+
+int picam_median_u8(const uint8_t* data, uint32_t width, uint32_t height,
+                    size_t stride, uint32_t size, uint8_t* out) {
+  return medianFilter(Plane<const uint8_t>{data, width, height, stride},
+                      Plane<uint8_t>{out, width, height, stride}, size,
+                      &pool()) ? 0 : -1;
+}
+
+int picam_median_u16(const uint16_t* data, uint32_t width, uint32_t height,
+                     size_t stride, uint32_t size, uint16_t* out) {
+  return medianFilter(Plane<const uint16_t>{data, width, height, stride},
+                      Plane<uint16_t>{out, width, height, stride}, size,
+                      &pool()) ? 0 : -1;
+}
+
+picam_stacker* picam_stacker_new(uint32_t width, uint32_t height, int mode,
+                                 uint32_t frames, uint32_t period_ms,
+                                 float sigma) {
+  if ((mode < 0) || (mode > static_cast<int>(Stacker::Mode::SIGMA_CLIP))) {
+    return nullptr;
+  }
+  Stacker::Config config{};
+  config.width = width;
+  config.height = height;
+  config.mode = static_cast<Stacker::Mode>(mode);
+  config.frames = frames;
+  config.period = std::chrono::milliseconds{period_ms};
+  config.clip.sigma = sigma;
+  return new picam_stacker{config, &pool()};
+}
+
+void picam_stacker_free(picam_stacker* stacker) {
+  delete stacker;
+}
+
+template <typename T>
+static int stackerAdd(picam_stacker* stacker, const T* data, size_t stride) {
+  const Stacker::Config& config = stacker->stacker.config();
+  stacker->fresh = false;
+  if (!stacker->stacker.add(Plane<const T>{data, config.width, config.height,
+                                           stride})) {
+    return -1;
+  }
+  return stacker->fresh ? 1 : 0;
+}
+
+int picam_stacker_add_u8(picam_stacker* stacker, const uint8_t* data,
+                         size_t stride) {
+  return stackerAdd(stacker, data, stride);
+}
+
+int picam_stacker_add_u16(picam_stacker* stacker, const uint16_t* data,
+                          size_t stride) {
+  return stackerAdd(stacker, data, stride);
+}
+
+int picam_stacker_flush(picam_stacker* stacker) {
+  stacker->fresh = false;
+  stacker->stacker.flush();
+  return stacker->fresh ? 1 : 0;
+}
+
+uint32_t picam_stacker_take(picam_stacker* stacker, float* out) {
+  std::copy(stacker->latest.begin(), stacker->latest.end(), out);
+  return stacker->latestFrames;
+}
+
+picam_registrar* picam_registrar_new(uint32_t fft_size, uint32_t threshold,
+                                     uint32_t min_area) {
+  if ((fft_size < 2) || ((fft_size & (fft_size - 1)) != 0)) {
+    return nullptr;
+  }
+  Registrar::Config config{};
+  config.fftSize = fft_size;
+  config.threshold = threshold;
+  config.minArea = min_area;
+  return new picam_registrar{config, &pool()};
+}
+
+void picam_registrar_free(picam_registrar* registrar) {
+  delete registrar;
+}
+
+void picam_registrar_reference_u8(picam_registrar* registrar,
+                                  const uint8_t* data, uint32_t width,
+                                  uint32_t height, size_t stride) {
+  registrar->registrar.setReference(
+    Plane<const uint8_t>{data, width, height, stride});
+}
+
+void picam_registrar_reference_u16(picam_registrar* registrar,
+                                   const uint16_t* data, uint32_t width,
+                                   uint32_t height, size_t stride) {
+  registrar->registrar.setReference(
+    Plane<const uint16_t>{data, width, height, stride});
+}
+
+template <typename T>
+static int registrarAlign(picam_registrar* registrar, const T* data,
+                          uint32_t width, uint32_t height, size_t stride,
+                          picam_transform* transform) {
+  const Registrar::Result result = registrar->registrar.align(
+    Plane<const T>{data, width, height, stride});
+  if (!result.ok) {
+    return -1;
+  }
+  transform->dx = result.transform.dx;
+  transform->dy = result.transform.dy;
+  transform->theta = result.transform.theta;
+  return static_cast<int>(result.matched);
+}
+
+int picam_registrar_align_u8(picam_registrar* registrar, const uint8_t* data,
+                             uint32_t width, uint32_t height, size_t stride,
+                             picam_transform* transform) {
+  return registrarAlign(registrar, data, width, height, stride, transform);
+}
+
+int picam_registrar_align_u16(picam_registrar* registrar,
+                              const uint16_t* data, uint32_t width,
+                              uint32_t height, size_t stride,
+                              picam_transform* transform) {
+  return registrarAlign(registrar, data, width, height, stride, transform);
+}
+
+void picam_warp_u8(const uint8_t* data, uint32_t width, uint32_t height,
+                   size_t stride, const picam_transform* transform,
+                   uint8_t* out) {
+  warpBilinear(Plane<const uint8_t>{data, width, height, stride},
+               Plane<uint8_t>{out, width, height, stride},
+               RigidTransform{transform->dx, transform->dy, transform->theta},
+               &pool());
+}
+
+void picam_warp_u16(const uint16_t* data, uint32_t width, uint32_t height,
+                    size_t stride, const picam_transform* transform,
+                    uint16_t* out) {
+  warpBilinear(Plane<const uint16_t>{data, width, height, stride},
+               Plane<uint16_t>{out, width, height, stride},
+               RigidTransform{transform->dx, transform->dy, transform->theta},
+               &pool());
+}
+
+picam_streak_detector* picam_streak_detector_new(uint32_t width,
+                                                 uint32_t height,
+                                                 uint32_t threshold,
+                                                 float min_length) {
+  StreakDetector::Config config{};
+  config.width = width;
+  config.height = height;
+  config.threshold = threshold;
+  config.minLength = min_length;
+  return new picam_streak_detector{config, &pool()};
+}
+
+void picam_streak_detector_free(picam_streak_detector* detector) {
+  delete detector;
+}
+
+template <typename T>
+static int detectStreaks(picam_streak_detector* detector, const T* data,
+                         size_t stride) {
+  const StreakDetector::Config& config = detector->detector.config();
+  if (!detector->detector.detect(Plane<const T>{data, config.width,
+                                                config.height, stride},
+                                 detector->streaks)) {
+    return -1;
+  }
+  return static_cast<int>(detector->streaks.size());
+}
+
+int picam_streak_detector_detect_u8(picam_streak_detector* detector,
+                                    const uint8_t* data, size_t stride) {
+  return detectStreaks(detector, data, stride);
+}
+
+int picam_streak_detector_detect_u16(picam_streak_detector* detector,
+                                     const uint16_t* data, size_t stride) {
+  return detectStreaks(detector, data, stride);
+}
+
+void picam_streak_detector_take(picam_streak_detector* detector,
+                                picam_streak* out) {
+  std::copy(detector->streaks.begin(), detector->streaks.end(),
+            reinterpret_cast<Streak*>(out));
+}
+
+void picam_streak_detector_reset(picam_streak_detector* detector) {
+  detector->detector.reset();
+}
+
+picam_background* picam_background_new(uint32_t tile_size, float clip_sigma) {
+  BackgroundEstimator::Config config{};
+  config.tileSize = tile_size;
+  config.clipSigma = clip_sigma;
+  return new picam_background{config, &pool()};
+}
+
+void picam_background_free(picam_background* background) {
+  delete background;
+}
+
+int picam_background_estimate_u8(picam_background* background,
+                                 const uint8_t* data, uint32_t width,
+                                 uint32_t height, size_t stride) {
+  return background->estimator.estimate(
+    Plane<const uint8_t>{data, width, height, stride}) ? 0 : -1;
+}
+
+int picam_background_estimate_u16(picam_background* background,
+                                  const uint16_t* data, uint32_t width,
+                                  uint32_t height, size_t stride) {
+  return background->estimator.estimate(
+    Plane<const uint16_t>{data, width, height, stride}) ? 0 : -1;
+}
+
+void picam_background_maps(const picam_background* background, float* level,
+                           float* rms) {
+  const BackgroundEstimator& estimator = background->estimator;
+  if (level != nullptr) {
+    estimator.background(
+      Plane<float>{level, estimator.width(), estimator.height()});
+  }
+  if (rms != nullptr) {
+    estimator.rms(Plane<float>{rms, estimator.width(), estimator.height()});
+  }
+}
+
+void picam_background_threshold(const picam_background* background,
+                                float sigma, uint16_t* out) {
+  const BackgroundEstimator& estimator = background->estimator;
+  estimator.threshold(
+    Plane<uint16_t>{out, estimator.width(), estimator.height()}, sigma);
+}
+
+int32_t picam_dark_temperature_bucket(float celsius) {
+  return darkTemperatureBucket(celsius);
+}
+
+picam_dark_builder* picam_dark_builder_new(uint32_t width, uint32_t height) {
+  return new picam_dark_builder{width, height, &pool()};
+}
+
+void picam_dark_builder_free(picam_dark_builder* builder) {
+  delete builder;
+}
+
+template <typename T>
+static int darkBuilderAdd(picam_dark_builder* builder, const T* data,
+                          size_t stride) {
+  if (!builder->builder.add(Plane<const T>{data, builder->width,
+                                           builder->height, stride})) {
+    return -1;
+  }
+  return static_cast<int>(builder->builder.frames());
+}
+
+int picam_dark_builder_add_u8(picam_dark_builder* builder,
+                              const uint8_t* data, size_t stride) {
+  return darkBuilderAdd(builder, data, stride);
+}
+
+int picam_dark_builder_add_u16(picam_dark_builder* builder,
+                               const uint16_t* data, size_t stride) {
+  return darkBuilderAdd(builder, data, stride);
+}
+
+long picam_dark_builder_write(picam_dark_builder* builder, const char* path,
+                              const picam_dark_key* key,
+                              uint16_t hot_threshold) {
+  const long hot = builder->builder.write(
+    path, DarkKey{key->iso, key->shutter_us, key->temperature}, hot_threshold);
+  builder->builder.reset();
+  return hot;
+}
+
+picam_dark* picam_dark_open(const char* path) {
+  picam_dark* dark = new picam_dark{};
+  if (!dark->frame.open(path)) {
+    delete dark;
+    return nullptr;
+  }
+  return dark;
+}
+
+void picam_dark_free(picam_dark* dark) {
+  delete dark;
+}
+
+void picam_dark_info(const picam_dark* dark, picam_dark_key* key,
+                     uint32_t* width, uint32_t* height, uint32_t* frames,
+                     uint32_t* hot_pixels) {
+  const DarkKey k = dark->frame.key();
+  key->iso = k.iso;
+  key->shutter_us = k.shutterUs;
+  key->temperature = k.temperature;
+  *width = dark->frame.width();
+  *height = dark->frame.height();
+  *frames = dark->frame.frames();
+  *hot_pixels = dark->frame.hotPixelCount();
+}
+
+int picam_calibrate_u8(const picam_dark* dark, const uint8_t* data,
+                       uint32_t width, uint32_t height, size_t stride,
+                       uint8_t* out) {
+  return calibrate(Plane<const uint8_t>{data, width, height, stride},
+                   Plane<uint8_t>{out, width, height, stride}, dark->frame,
+                   &pool()) ? 0 : -1;
+}
+
+int picam_calibrate_u16(const picam_dark* dark, const uint16_t* data,
+                        uint32_t width, uint32_t height, size_t stride,
+                        uint16_t* out) {
+  return calibrate(Plane<const uint16_t>{data, width, height, stride},
+                   Plane<uint16_t>{out, width, height, stride}, dark->frame,
+                   &pool()) ? 0 : -1;
+}
+
+const char* picam_kernels(void) {
+  return lumaKernels().name;
+}
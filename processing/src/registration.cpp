@@ -0,0 +1,372 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <type_traits>
+
+#include "registration.hpp"
+
+// Warp tile width; rows of the source a tile reads stay in cache even when
+// rotation makes an output row cross several of them
+static const uint32_t WARP_TILE_WIDTH = 256;
+
+
+/**
+ * Offset of a peak from its middle sample, from a parabola through it and
+ * its neighbours.
+ */
+static double parabolicPeak(double before, double at, double after) {
+  const double curve = before - 2.0 * at + after;
+  if (curve >= 0.0) {
+    return 0.0;
+  }
+  return std::max(-0.5, std::min(0.5, 0.5 * (before - after) / curve));
+}
+
+
+void RigidTransform::apply(double x, double y, double& outX,
+                           double& outY) const {
+  const double c = std::cos(theta);
+  const double s = std::sin(theta);
+  outX = c * x - s * y + dx;
+  outY = s * x + c * y + dy;
+}
+
+
+Registrar::Registrar(const Config& config, WorkerPool* pool)
+  : mConfig{config}
+  , mPool{pool}
+  , mFft{config.fftSize, pool}
+  , mLabeller{ComponentLabeller::Config{config.threshold, config.minArea, true},
+              pool}
+  , mWidth{0}
+  , mHeight{0}
+  , mFactor{1}
+  , mWindowX{}
+  , mWindowY{}
+  , mReferenceSpectrum{}
+  , mReferenceStars{}
+  , mSpectrum{}
+  , mComponents{}
+  , mStars{}
+{ }
+
+void Registrar::setReference(Plane<const uint8_t> frame) {
+  setReferenceImpl(frame);
+}
+
+void Registrar::setReference(Plane<const uint16_t> frame) {
+  setReferenceImpl(frame);
+}
+
+Registrar::Result Registrar::align(Plane<const uint8_t> frame) {
+  return alignImpl(frame);
+}
+
+Registrar::Result Registrar::align(Plane<const uint16_t> frame) {
+  return alignImpl(frame);
+}
+
+template <typename T>
+void Registrar::setReferenceImpl(Plane<const T> frame) {
+  mWidth = frame.width;
+  mHeight = frame.height;
+  const uint32_t n = mConfig.fftSize;
+  mFactor = std::max<uint32_t>({(mWidth + n - 1) / n, (mHeight + n - 1) / n,
+                                1});
+
+  // Hann window over the downsampled frame, so its edges don't correlate
+  auto hann = [](std::vector<float>& window, uint32_t size) {
+    window.resize(size);
+    for (uint32_t i = 0; i < size; i++) {
+      window[i] = 0.5f - 0.5f * std::cos(2.0f * static_cast<float>(M_PI) *
+                                         (i + 0.5f) / size);
+    }
+  };
+  hann(mWindowX, mWidth / mFactor);
+  hann(mWindowY, mHeight / mFactor);
+
+  spectrum(frame, mReferenceSpectrum);
+  findStars(frame, mReferenceStars);
+}
+
+template <typename T>
+void Registrar::spectrum(Plane<const T> frame,
+                         std::vector<Fft2d::Complex>& out) {
+  const uint32_t n = mConfig.fftSize;
+  const uint32_t f = mFactor;
+  const uint32_t width = mWindowX.size();
+  const uint32_t height = mWindowY.size();
+  out.assign(static_cast<size_t>(n) * n, Fft2d::Complex{});
+
+  // Box-filter down, then take out the mean (or the window itself would
+  // dominate the correlation) and apply the window
+  WorkerPool::runBands(mPool, height, [&](uint32_t y0, uint32_t y1) {
+    for (uint32_t y = y0; y < y1; y++) {
+      Fft2d::Complex* row = &out[static_cast<size_t>(y) * n];
+      for (uint32_t dy = 0; dy < f; dy++) {
+        const T* in = frame.row(y * f + dy);
+        for (uint32_t x = 0; x < width; x++) {
+          uint32_t sum = 0;
+          for (uint32_t dx = 0; dx < f; dx++) {
+            sum += in[x * f + dx];
+          }
+          row[x] += static_cast<float>(sum);
+        }
+      }
+    }
+  });
+  double total = 0.0;
+  for (uint32_t y = 0; y < height; y++) {
+    for (uint32_t x = 0; x < width; x++) {
+      total += out[static_cast<size_t>(y) * n + x].real();
+    }
+  }
+  const float mean = (width * height > 0) ? total / (width * height) : 0.0;
+  WorkerPool::runBands(mPool, height, [&](uint32_t y0, uint32_t y1) {
+    for (uint32_t y = y0; y < y1; y++) {
+      Fft2d::Complex* row = &out[static_cast<size_t>(y) * n];
+      for (uint32_t x = 0; x < width; x++) {
+        row[x] = (row[x].real() - mean) * mWindowX[x] * mWindowY[y];
+      }
+    }
+  });
+
+  mFft.forward(out.data());
+}
+
+template <typename T>
+void Registrar::findStars(Plane<const T> frame, std::vector<Star>& stars) {
+  mLabeller.label(frame, mComponents);
+  stars.clear();
+  for (const auto& c : mComponents) {
+    stars.push_back(Star{c.x, c.y, c.flux});
+  }
+  const size_t keep = std::min(stars.size(), mConfig.maxStars);
+  std::partial_sort(stars.begin(), stars.begin() + keep, stars.end(),
+                    [](const Star& a, const Star& b) {
+                      return a.flux > b.flux;
+                    });
+  stars.resize(keep);
+}
+
+template <typename T>
+Registrar::Result Registrar::alignImpl(Plane<const T> frame) {
+  Result result{};
+  if ((mReferenceSpectrum.empty()) || (frame.width != mWidth) ||
+      (frame.height != mHeight)) {
+    return result;
+  }
+
+  //
+  // Phase correlation: the normalized cross-power spectrum transforms back
+  // to a spike at the shift
+  //
+  const uint32_t n = mConfig.fftSize;
+  spectrum(frame, mSpectrum);
+  WorkerPool::runBands(mPool, n, [&](uint32_t y0, uint32_t y1) {
+    for (size_t i = static_cast<size_t>(y0) * n;
+         i < static_cast<size_t>(y1) * n; i++) {
+      const Fft2d::Complex cross = mSpectrum[i] *
+        std::conj(mReferenceSpectrum[i]);
+      const float magnitude = std::abs(cross);
+      mSpectrum[i] = (magnitude > 1e-20f) ? cross / magnitude
+        : Fft2d::Complex{};
+    }
+  });
+  mFft.inverse(mSpectrum.data());
+
+  size_t best = 0;
+  for (size_t i = 1; i < mSpectrum.size(); i++) {
+    if (mSpectrum[i].real() > mSpectrum[best].real()) {
+      best = i;
+    }
+  }
+  const uint32_t px = best % n;
+  const uint32_t py = best / n;
+  auto at = [&](uint32_t x, uint32_t y) {
+    return static_cast<double>(
+      mSpectrum[static_cast<size_t>(y % n) * n + (x % n)].real());
+  };
+  const double subX = parabolicPeak(at(px + n - 1, py), at(px, py),
+                                    at(px + 1, py));
+  const double subY = parabolicPeak(at(px, py + n - 1), at(px, py),
+                                    at(px, py + 1));
+  // Past half way round is a negative shift
+  const double shiftX = ((px > n / 2) ? static_cast<double>(px) - n : px) +
+    subX;
+  const double shiftY = ((py > n / 2) ? static_cast<double>(py) - n : py) +
+    subY;
+
+  result.ok = true;
+  result.peak = at(px, py);
+  result.coarseDx = shiftX * mFactor;
+  result.coarseDy = shiftY * mFactor;
+  result.transform.dx = result.coarseDx;
+  result.transform.dy = result.coarseDy;
+
+  //
+  // Refine with the stars, tightening the match radius as the fit improves
+  //
+  findStars(frame, mStars);
+  result.stars = mStars.size();
+  if ((mReferenceStars.size() < mConfig.minMatches) ||
+      (mStars.size() < mConfig.minMatches)) {
+    return result;
+  }
+  RigidTransform transform = result.transform;
+  double rms = 0.0;
+  size_t matched = fit(mStars, mConfig.matchRadius + mFactor, transform, rms);
+  if (matched >= mConfig.minMatches) {
+    matched = fit(mStars, mConfig.matchRadius, transform, rms);
+  }
+  if (matched >= mConfig.minMatches) {
+    matched = fit(mStars, std::max(3.0 * rms, 1.0), transform, rms);
+  }
+  if (matched >= mConfig.minMatches) {
+    result.transform = transform;
+    result.matched = matched;
+    result.rms = rms;
+  }
+  return result;
+}
+
+size_t Registrar::fit(const std::vector<Star>& stars, double radius,
+                      RigidTransform& transform, double& rms) const {
+  struct Pair {
+    double ax, ay;
+    double bx, by;
+  };
+  std::vector<Pair> pairs;
+  const double radius2 = radius * radius;
+  for (const Star& ref : mReferenceStars) {
+    double px, py;
+    transform.apply(ref.x, ref.y, px, py);
+    const Star* nearest = nullptr;
+    double nearest2 = radius2;
+    for (const Star& star : stars) {
+      const double d2 = (star.x - px) * (star.x - px) +
+        (star.y - py) * (star.y - py);
+      if (d2 <= nearest2) {
+        nearest2 = d2;
+        nearest = &star;
+      }
+    }
+    if (nearest != nullptr) {
+      pairs.push_back(Pair{ref.x, ref.y, nearest->x, nearest->y});
+    }
+  }
+  if (pairs.size() < 2) {
+    return pairs.size();
+  }
+
+  // Least-squares rotation and shift (2D Kabsch): the angle comes from the
+  // cross-covariance of the centred point sets
+  double ax = 0, ay = 0, bx = 0, by = 0;
+  for (const auto& p : pairs) {
+    ax += p.ax;
+    ay += p.ay;
+    bx += p.bx;
+    by += p.by;
+  }
+  ax /= pairs.size();
+  ay /= pairs.size();
+  bx /= pairs.size();
+  by /= pairs.size();
+  double dot = 0, cross = 0;
+  for (const auto& p : pairs) {
+    const double x0 = p.ax - ax, y0 = p.ay - ay;
+    const double x1 = p.bx - bx, y1 = p.by - by;
+    dot += x0 * x1 + y0 * y1;
+    cross += x0 * y1 - y0 * x1;
+  }
+  transform.theta = std::atan2(cross, dot);
+  const double c = std::cos(transform.theta);
+  const double s = std::sin(transform.theta);
+  transform.dx = bx - (c * ax - s * ay);
+  transform.dy = by - (s * ax + c * ay);
+
+  double sum2 = 0.0;
+  for (const auto& p : pairs) {
+    double x, y;
+    transform.apply(p.ax, p.ay, x, y);
+    sum2 += (x - p.bx) * (x - p.bx) + (y - p.by) * (y - p.by);
+  }
+  rms = std::sqrt(sum2 / pairs.size());
+  return pairs.size();
+}
+
+
+template <typename T>
+static bool warp(Plane<const T> in, Plane<T> out,
+                 const RigidTransform& transform, WorkerPool* pool) {
+  if ((in.width != out.width) || (in.height != out.height)) {
+    return false;
+  }
+  // Source coordinates in 16.16 fixed point, and 8-bit interpolation
+  // weights; 16-bit pixels need the wider sums
+  using Sum = typename std::conditional<sizeof(T) == 1, uint32_t,
+                                        uint64_t>::type;
+  const double c = std::cos(transform.theta);
+  const double s = std::sin(transform.theta);
+  const int64_t stepX = std::llround(c * 65536.0);
+  const int64_t stepY = std::llround(s * 65536.0);
+  const int64_t maxX = static_cast<int64_t>(in.width - 1) << 16;
+  const int64_t maxY = static_cast<int64_t>(in.height - 1) << 16;
+  WorkerPool::runBands(pool, out.height, [&](uint32_t y0, uint32_t y1) {
+    for (uint32_t x0 = 0; x0 < out.width; x0 += WARP_TILE_WIDTH) {
+      const uint32_t x1 = std::min(out.width, x0 + WARP_TILE_WIDTH);
+      for (uint32_t y = y0; y < y1; y++) {
+        T* o = out.row(y);
+        // Step along the row rather than transforming every pixel; starting
+        // afresh each tile keeps the rounding in the steps from adding up
+        int64_t sx = std::llround((c * x0 - s * y + transform.dx) * 65536.0);
+        int64_t sy = std::llround((s * x0 + c * y + transform.dy) * 65536.0);
+        for (uint32_t x = x0; x < x1; x++, sx += stepX, sy += stepY) {
+          if ((sx < 0) || (sy < 0) || (sx > maxX) || (sy > maxY)) {
+            o[x] = 0;
+            continue;
+          }
+          const uint32_t ix = static_cast<uint32_t>(sx >> 16);
+          const uint32_t iy = static_cast<uint32_t>(sy >> 16);
+          const Sum fx = (sx >> 8) & 0xFF;
+          const Sum fy = (sy >> 8) & 0xFF;
+          // At the last column or row the weight on the one past it is 0
+          const uint32_t ix1 = ix + (ix + 1 < in.width);
+          const T* r0 = in.row(iy);
+          const T* r1 = in.row(iy + (iy + 1 < in.height));
+          const Sum top = r0[ix] * (256 - fx) + r0[ix1] * fx;
+          const Sum bottom = r1[ix] * (256 - fx) + r1[ix1] * fx;
+          o[x] = static_cast<T>((top * (256 - fy) + bottom * fy + 32768) >> 16);
+        }
+      }
+    }
+  });
+  return true;
+}
+
+bool warpBilinear(Plane<const uint8_t> in, Plane<uint8_t> out,
+                  const RigidTransform& transform, WorkerPool* pool) {
+  return warp(in, out, transform, pool);
+}
+
+bool warpBilinear(Plane<const uint16_t> in, Plane<uint16_t> out,
+                  const RigidTransform& transform, WorkerPool* pool) {
+  return warp(in, out, transform, pool);
+}
@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#if defined(__arm__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+#include "stack_rows.hpp"
+#include "stacker.hpp"
+
+
+static const StackKernels SCALAR_KERNELS = makeStackKernels<0>("scalar");
+
+
+const StackKernels& scalarStackKernels() {
+  return SCALAR_KERNELS;
+}
+
+std::vector<const StackKernels*> supportedStackKernels() {
+  std::vector<const StackKernels*> kernels{&SCALAR_KERNELS};
+  auto add = [&](const StackKernels* k, bool supported) {
+    if ((k != nullptr) && supported) {
+      kernels.push_back(k);
+    }
+  };
+#if defined(__x86_64__) || defined(__i386__)
+  add(sse2StackKernels(), __builtin_cpu_supports("sse2"));
+  add(avx2StackKernels(), __builtin_cpu_supports("avx2"));
+#elif defined(__aarch64__)
+  add(neonStackKernels(), true);
+#elif defined(__arm__)
+  add(neonStackKernels(), (getauxval(AT_HWCAP) & HWCAP_NEON) != 0);
+#endif
+  return kernels;
+}
+
+const StackKernels& stackKernels() {
+  // Later sets are faster
+  static const StackKernels& best = *supportedStackKernels().back();
+  return best;
+}
+
+
+Stacker::Stacker(const Config& config, StackCallback callback,
+                 WorkerPool* pool)
+  : mConfig{config}
+  , mCallback{std::move(callback)}
+  , mPool{pool}
+  , mKernels{&stackKernels()}
+  , mAccumulator{}
+  , mMean{}
+  , mM2{}
+  , mCount{}
+  , mOutput{}
+  , mFrames{0}
+  , mStart{}
+  , mEnd{}
+{
+  const size_t pixels = static_cast<size_t>(config.width) * config.height;
+  if (config.mode == Mode::SIGMA_CLIP) {
+    mMean.resize(pixels, 0.0f);
+    mM2.resize(pixels, 0.0f);
+    mCount.resize(pixels, 0.0f);
+  } else {
+    mAccumulator.resize(pixels, 0);
+    mOutput.resize(pixels);
+  }
+}
+
+bool Stacker::add(Plane<const uint8_t> frame, Clock::time_point when) {
+  return addImpl(frame, when);
+}
+
+bool Stacker::add(Plane<const uint16_t> frame, Clock::time_point when) {
+  return addImpl(frame, when);
+}
+
+unsigned Stacker::frames() const {
+  return mFrames;
+}
+
+const Stacker::Config& Stacker::config() const {
+  return mConfig;
+}
+
+void Stacker::setKernels(const StackKernels& kernels) {
+  mKernels = &kernels;
+}
+
+template <typename T>
+bool Stacker::addImpl(Plane<const T> frame, Clock::time_point when) {
+  if ((frame.width != mConfig.width) || (frame.height != mConfig.height)) {
+    return false;
+  }
+
+  const uint32_t width = mConfig.width;
+  const StackKernels& k = *mKernels;
+  constexpr bool wide = sizeof(T) == 2;
+  WorkerPool::runBands(mPool, mConfig.height, [&](uint32_t y0, uint32_t y1) {
+    for (uint32_t y = y0; y < y1; y++) {
+      const T* in = frame.row(y);
+      const size_t offset = static_cast<size_t>(y) * width;
+      switch (mConfig.mode) {
+        case Mode::SUM:
+        case Mode::MEAN:
+          if constexpr (wide) {
+            k.add16(in, &mAccumulator[offset], width);
+          } else {
+            k.add8(in, &mAccumulator[offset], width);
+          }
+          break;
+        case Mode::MAX:
+          if constexpr (wide) {
+            k.max16(in, &mAccumulator[offset], width);
+          } else {
+            k.max8(in, &mAccumulator[offset], width);
+          }
+          break;
+        case Mode::SIGMA_CLIP:
+          if constexpr (wide) {
+            k.clip16(in, &mMean[offset], &mM2[offset], &mCount[offset], width,
+                     mConfig.clip);
+          } else {
+            k.clip8(in, &mMean[offset], &mM2[offset], &mCount[offset], width,
+                    mConfig.clip);
+          }
+          break;
+      }
+    }
+  });
+
+  if (mFrames == 0) {
+    mStart = when;
+  }
+  mEnd = when;
+  mFrames++;
+
+  const bool full = (mConfig.frames > 0) && (mFrames >= mConfig.frames);
+  const bool old = (mConfig.period.count() > 0) &&
+    (when - mStart >= mConfig.period);
+  if (full || old) {
+    flush();
+  }
+  return true;
+}
+
+void Stacker::flush() {
+  if (mFrames == 0) {
+    return;
+  }
+
+  const uint32_t width = mConfig.width;
+  const float* pixels = mMean.data();
+  if (mConfig.mode != Mode::SIGMA_CLIP) {
+    // Converting also clears the accumulator for the next stack
+    const float scale = (mConfig.mode == Mode::MEAN) ? 1.0f / mFrames : 1.0f;
+    WorkerPool::runBands(mPool, mConfig.height, [&](uint32_t y0, uint32_t y1) {
+      const size_t offset = static_cast<size_t>(y0) * width;
+      mKernels->toFloat(&mAccumulator[offset], &mOutput[offset],
+                        static_cast<size_t>(y1 - y0) * width, scale);
+    });
+    pixels = mOutput.data();
+  }
+
+  Stack stack;
+  stack.mode = mConfig.mode;
+  stack.frames = mFrames;
+  stack.start = mStart;
+  stack.end = mEnd;
+  stack.pixels = Plane<const float>{pixels, width, mConfig.height};
+  if (mCallback) {
+    mCallback(stack);
+  }
+
+  if (mConfig.mode == Mode::SIGMA_CLIP) {
+    WorkerPool::runBands(mPool, mConfig.height, [&](uint32_t y0, uint32_t y1) {
+      const size_t offset = static_cast<size_t>(y0) * width;
+      const size_t count = static_cast<size_t>(y1 - y0) * width;
+      std::fill_n(&mMean[offset], count, 0.0f);
+      std::fill_n(&mM2[offset], count, 0.0f);
+      std::fill_n(&mCount[offset], count, 0.0f);
+    });
+  }
+  mFrames = 0;
+}
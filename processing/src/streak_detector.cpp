@@ -0,0 +1,564 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+#include "luma_kernels.hpp"
+#include "streak_detector.hpp"
+
+// Lines to pull out of one tile before giving up on it
+static const unsigned MAX_LINES_PER_TILE = 16;
+static const uint32_t MAX_STATIC_RADIUS = 63;
+
+namespace {
+
+struct Point {
+  uint32_t x;
+  uint32_t y;
+};
+
+/**
+ * Per-thread scratch for houghTile(), kept between tiles and frames.
+ */
+struct HoughScratch {
+  std::vector<Point> points;
+  std::vector<uint8_t> alive;
+  std::vector<uint32_t> votes;
+  std::vector<uint32_t> band;
+  std::vector<std::pair<double, uint32_t>> along;
+};
+
+}
+
+
+void StreakDetector::Moments::add(double px, double py, double pv) {
+  n += 1.0;
+  x += px;
+  y += py;
+  xx += px * px;
+  xy += px * py;
+  yy += py * py;
+  value += pv;
+}
+
+void StreakDetector::Moments::add(const Moments& other) {
+  n += other.n;
+  x += other.x;
+  y += other.y;
+  xx += other.xx;
+  xy += other.xy;
+  yy += other.yy;
+  value += other.value;
+}
+
+void StreakDetector::Moments::line(double& cx, double& cy, double& dx,
+                                   double& dy, double& across) const {
+  cx = x / n;
+  cy = y / n;
+  const double sxx = xx / n - cx * cx;
+  const double sxy = xy / n - cx * cy;
+  const double syy = yy / n - cy * cy;
+  const double theta = 0.5 * std::atan2(2.0 * sxy, sxx - syy);
+  dx = std::cos(theta);
+  dy = std::sin(theta);
+  const double half = 0.5 * (sxx - syy);
+  across = std::max(0.0, 0.5 * (sxx + syy) -
+                    std::sqrt(half * half + sxy * sxy));
+}
+
+
+StreakDetector::StreakDetector(const Config& config, WorkerPool* pool)
+  : mConfig{config}
+  , mPool{pool}
+  , mWords{maskWords(config.width)}
+  , mTilesX{(config.width + std::max(config.tileSize, 1u) - 1) /
+            std::max(config.tileSize, 1u)}
+  , mTilesY{(config.height + std::max(config.tileSize, 1u) - 1) /
+            std::max(config.tileSize, 1u)}
+  , mCos(std::max(config.angles, 1u))
+  , mSin(std::max(config.angles, 1u))
+  , mMask(mWords * config.height)
+  , mPrevious(mWords * config.height)
+  , mForeground(mWords * config.height)
+  , mHavePrevious{false}
+  , mTileSegments(static_cast<size_t>(mTilesX) * mTilesY)
+  , mSegments{}
+{
+  for (size_t a = 0; a < mCos.size(); a++) {
+    const double theta = M_PI * a / mCos.size();
+    mCos[a] = std::cos(theta);
+    mSin[a] = std::sin(theta);
+  }
+}
+
+bool StreakDetector::detect(Plane<const uint8_t> frame,
+                            std::vector<Streak>& streaks) {
+  return detectImpl(frame, streaks);
+}
+
+bool StreakDetector::detect(Plane<const uint16_t> frame,
+                            std::vector<Streak>& streaks) {
+  return detectImpl(frame, streaks);
+}
+
+void StreakDetector::reset() {
+  mHavePrevious = false;
+}
+
+const StreakDetector::Config& StreakDetector::config() const {
+  return mConfig;
+}
+
+template <typename T>
+static size_t thresholdMask(const T* in, uint64_t* mask, size_t pixels,
+                            uint32_t threshold);
+
+template <>
+size_t thresholdMask(const uint8_t* in, uint64_t* mask, size_t pixels,
+                     uint32_t threshold) {
+  return lumaKernels().thresholdMask8(in, mask, pixels, threshold);
+}
+
+template <>
+size_t thresholdMask(const uint16_t* in, uint64_t* mask, size_t pixels,
+                     uint32_t threshold) {
+  return lumaKernels().thresholdMask16(in, mask, pixels, threshold);
+}
+
+template <typename T>
+bool StreakDetector::detectImpl(Plane<const T> frame,
+                                std::vector<Streak>& streaks) {
+  streaks.clear();
+  if ((frame.width != mConfig.width) || (frame.height != mConfig.height)) {
+    return false;
+  }
+
+  const uint32_t height = mConfig.height;
+  const size_t words = mWords;
+  const bool above = mConfig.threshold <= std::numeric_limits<T>::max();
+  const bool suppress = mHavePrevious && (mConfig.staticRadius > 0);
+  const int radius = std::min(mConfig.staticRadius, MAX_STATIC_RADIUS);
+  auto band = [&](uint32_t y0, uint32_t y1) {
+    for (uint32_t y = y0; y < y1; y++) {
+      uint64_t* mask = &mMask[y * words];
+      if (above) {
+        thresholdMask(frame.row(y), mask, frame.width, mConfig.threshold);
+      } else {
+        std::fill_n(mask, words, 0);
+      }
+    }
+    // The previous frame's mask, grown by radius in every direction, masks
+    // out this one's
+    for (uint32_t y = y0; y < y1; y++) {
+      const uint64_t* mask = &mMask[y * words];
+      uint64_t* out = &mForeground[y * words];
+      if (!suppress) {
+        std::copy_n(mask, words, out);
+        continue;
+      }
+      const uint32_t first = (y > static_cast<uint32_t>(radius)) ? y - radius
+        : 0;
+      const uint32_t last = std::min(y + radius, height - 1);
+      for (size_t w = 0; w < words; w++) {
+        uint64_t near = 0;
+        for (uint32_t yy = first; yy <= last; yy++) {
+          const uint64_t* previous = &mPrevious[yy * words];
+          const uint64_t bits = previous[w];
+          const uint64_t lower = (w > 0) ? previous[w - 1] : 0;
+          const uint64_t upper = (w + 1 < words) ? previous[w + 1] : 0;
+          near |= bits;
+          for (int s = 1; s <= radius; s++) {
+            near |= (bits << s) | (lower >> (64 - s)) | (bits >> s) |
+              (upper << (64 - s));
+          }
+        }
+        out[w] = mask[w] & ~near;
+      }
+    }
+  };
+  WorkerPool::runBands(mPool, height, band);
+  std::swap(mMask, mPrevious);
+  mHavePrevious = true;
+
+  auto tile = [&](size_t t) {
+    auto& segments = mTileSegments[t];
+    segments.clear();
+    houghTile(frame, t % mTilesX, t / mTilesX, segments);
+  };
+  const size_t tiles = mTileSegments.size();
+  if (mPool == nullptr) {
+    for (size_t t = 0; t < tiles; t++) {
+      tile(t);
+    }
+  } else {
+    mPool->run(tiles, tile);
+  }
+
+  mSegments.clear();
+  for (const auto& segments : mTileSegments) {
+    mSegments.insert(mSegments.end(), segments.begin(), segments.end());
+  }
+  join(frame, mSegments, streaks);
+  return true;
+}
+
+template <typename T>
+void StreakDetector::houghTile(Plane<const T> frame, uint32_t tileX,
+                               uint32_t tileY,
+                               std::vector<Segment>& segments) const {
+  thread_local HoughScratch scratch{};
+  auto& points = scratch.points;
+
+  const uint32_t x0 = tileX * mConfig.tileSize;
+  const uint32_t y0 = tileY * mConfig.tileSize;
+  const uint32_t x1 = std::min(x0 + mConfig.tileSize, mConfig.width);
+  const uint32_t y1 = std::min(y0 + mConfig.tileSize, mConfig.height);
+  const size_t maxPoints = static_cast<size_t>(
+    mConfig.maxFill * (x1 - x0) * (y1 - y0));
+
+  points.clear();
+  for (uint32_t y = y0; y < y1; y++) {
+    const uint64_t* row = &mForeground[y * mWords];
+    for (uint32_t w = x0 / 64; w <= (x1 - 1) / 64; w++) {
+      uint64_t bits = row[w];
+      if (w * 64 < x0) {
+        bits &= ~0ULL << (x0 - w * 64);
+      }
+      if (x1 - w * 64 < 64) {
+        bits &= (1ULL << (x1 - w * 64)) - 1;
+      }
+      while (bits != 0) {
+        points.push_back(Point{w * 64 + __builtin_ctzll(bits), y});
+        bits &= bits - 1;
+      }
+    }
+    if (points.size() > maxPoints) {
+      return;
+    }
+  }
+  if (points.size() < mConfig.minVotes) {
+    return;
+  }
+
+  //
+  // Vote, with rho measured from the middle of the tile
+  //
+  const float cx = 0.5f * (x0 + x1);
+  const float cy = 0.5f * (y0 + y1);
+  const int maxRho = static_cast<int>(
+    std::ceil(0.5f * std::hypot(x1 - x0, y1 - y0))) + 1;
+  const size_t rhos = 2 * maxRho + 1;
+  const size_t angles = mCos.size();
+  auto& votes = scratch.votes;
+  votes.assign(angles * rhos, 0);
+  auto vote = [&](const Point& p, int delta) {
+    const float px = p.x - cx;
+    const float py = p.y - cy;
+    for (size_t a = 0; a < angles; a++) {
+      const int rho = static_cast<int>(std::lrint(px * mCos[a] +
+                                                  py * mSin[a]));
+      votes[a * rhos + rho + maxRho] += delta;
+    }
+  };
+  for (const auto& p : points) {
+    vote(p, 1);
+  }
+  auto& alive = scratch.alive;
+  alive.assign(points.size(), 1);
+
+  auto& band = scratch.band;
+  auto& along = scratch.along;
+  const double lineWidth = mConfig.lineWidth;
+  for (unsigned line = 0; line < MAX_LINES_PER_TILE; line++) {
+    const size_t best = std::max_element(votes.begin(), votes.end()) -
+      votes.begin();
+    if (votes[best] < mConfig.minVotes) {
+      break;
+    }
+
+    // The points near the strongest line, then those near the line through
+    // them, since the Hough bins are coarse
+    const size_t a = best / rhos;
+    const double rho = static_cast<double>(best % rhos) - maxRho;
+    band.clear();
+    Moments near{};
+    for (uint32_t i = 0; i < points.size(); i++) {
+      const double px = points[i].x - cx;
+      const double py = points[i].y - cy;
+      if (alive[i] && (std::fabs(px * mCos[a] + py * mSin[a] - rho) <=
+                       lineWidth)) {
+        band.push_back(i);
+        near.add(points[i].x, points[i].y, 0.0);
+      }
+    }
+    double lx, ly, dx, dy, across;
+    near.line(lx, ly, dx, dy, across);
+    along.clear();
+    for (uint32_t i = 0; i < points.size(); i++) {
+      const double px = points[i].x - lx;
+      const double py = points[i].y - ly;
+      if (alive[i] && (std::fabs(px * dy - py * dx) <= lineWidth)) {
+        along.emplace_back(px * dx + py * dy, i);
+      }
+    }
+
+    // Withdraw both sets' votes, so the next line is a different one
+    for (uint32_t i : band) {
+      if (alive[i]) {
+        alive[i] = 0;
+        vote(points[i], -1);
+      }
+    }
+    for (const auto& entry : along) {
+      if (alive[entry.second]) {
+        alive[entry.second] = 0;
+        vote(points[entry.second], -1);
+      }
+    }
+
+    // Split into runs at the gaps
+    std::sort(along.begin(), along.end());
+    size_t start = 0;
+    for (size_t i = 1; i <= along.size(); i++) {
+      if ((i < along.size()) &&
+          (along[i].first - along[i - 1].first <= mConfig.maxGap)) {
+        continue;
+      }
+      const double t0 = along[start].first;
+      const double t1 = along[i - 1].first;
+      if (t1 - t0 >= mConfig.maxGap) {
+        Segment segment{};
+        for (size_t j = start; j < i; j++) {
+          const Point& p = points[along[j].second];
+          segment.moments.add(p.x, p.y, frame.row(p.y)[p.x]);
+        }
+        // Ends on the line through the run's centroid
+        const double rx = segment.moments.x / segment.moments.n;
+        const double ry = segment.moments.y / segment.moments.n;
+        const double rt = (rx - lx) * dx + (ry - ly) * dy;
+        segment.x0 = rx + (t0 - rt) * dx;
+        segment.y0 = ry + (t0 - rt) * dy;
+        segment.x1 = rx + (t1 - rt) * dx;
+        segment.y1 = ry + (t1 - rt) * dy;
+        segments.push_back(segment);
+      }
+      start = i;
+    }
+  }
+}
+
+template <typename T>
+void StreakDetector::join(Plane<const T> frame,
+                          std::vector<Segment>& segments,
+                          std::vector<Streak>& streaks) const {
+  struct Line {
+    double cx;
+    double cy;
+    double dx;
+    double dy;
+  };
+  auto lineOf = [](const Segment& s) {
+    Line l;
+    double across;
+    s.moments.line(l.cx, l.cy, l.dx, l.dy, across);
+    return l;
+  };
+  auto offset = [](const Line& l, double x, double y) {
+    return std::fabs((x - l.cx) * l.dy - (y - l.cy) * l.dx);
+  };
+  auto position = [](const Line& l, double x, double y) {
+    return (x - l.cx) * l.dx + (y - l.cy) * l.dy;
+  };
+
+  std::vector<Line> lines;
+  for (const auto& s : segments) {
+    lines.push_back(lineOf(s));
+  }
+  const double maxSin = std::sin(mConfig.mergeAngle);
+  auto joins = [&](size_t i, size_t j) {
+    const Segment& a = segments[i];
+    const Segment& b = segments[j];
+    const Line& la = lines[i];
+    const Line& lb = lines[j];
+    if (std::fabs(la.dx * lb.dy - la.dy * lb.dx) > maxSin) {
+      return false;
+    }
+    // The longer one's line is the better fit, so measure from that
+    const bool aLonger = std::hypot(a.x1 - a.x0, a.y1 - a.y0) >=
+      std::hypot(b.x1 - b.x0, b.y1 - b.y0);
+    const Line& longer = aLonger ? la : lb;
+    const Segment& shorter = aLonger ? b : a;
+    if ((offset(longer, shorter.x0, shorter.y0) > mConfig.mergeDistance) ||
+        (offset(longer, shorter.x1, shorter.y1) > mConfig.mergeDistance)) {
+      return false;
+    }
+    const double a0 = position(la, a.x0, a.y0);
+    const double a1 = position(la, a.x1, a.y1);
+    const double b0 = position(la, b.x0, b.y0);
+    const double b1 = position(la, b.x1, b.y1);
+    const double gap = std::max(std::min(b0, b1) - std::max(a0, a1),
+                                std::min(a0, a1) - std::max(b0, b1));
+    return gap <= mConfig.joinGap;
+  };
+
+  // Whether b lies within a's ends, i.e. it's made of a's pixels
+  auto inside = [&](size_t i, size_t j) {
+    const Segment& a = segments[i];
+    const Segment& b = segments[j];
+    const double a0 = position(lines[i], a.x0, a.y0);
+    const double a1 = position(lines[i], a.x1, a.y1);
+    const double b0 = position(lines[i], b.x0, b.y0);
+    const double b1 = position(lines[i], b.x1, b.y1);
+    return (std::min(b0, b1) >= std::min(a0, a1) - mConfig.mergeDistance) &&
+      (std::max(b0, b1) <= std::max(a0, a1) + mConfig.mergeDistance);
+  };
+
+  // Joining can bring a segment into reach of others, so go round until
+  // nothing changes. Once segments have been extended they can overlap, and
+  // then one inside another is dropped rather than counting its pixels twice.
+  auto joinAll = [&](bool extended) {
+    for (bool joined = true; joined; ) {
+      joined = false;
+      for (size_t i = 0; i < segments.size(); i++) {
+        for (size_t j = i + 1; j < segments.size(); ) {
+          if (!joins(i, j)) {
+            j++;
+            continue;
+          }
+          if (extended && inside(j, i)) {
+            std::swap(segments[i], segments[j]);
+            std::swap(lines[i], lines[j]);
+          }
+          Segment& a = segments[i];
+          const Segment& b = segments[j];
+          if (!extended || !inside(i, j)) {
+            a.moments.add(b.moments);
+          }
+          const Line l = lineOf(a);
+          double lo = std::numeric_limits<double>::max();
+          double hi = std::numeric_limits<double>::lowest();
+          for (const auto& end : {std::make_pair(a.x0, a.y0),
+                                  std::make_pair(a.x1, a.y1),
+                                  std::make_pair(b.x0, b.y0),
+                                  std::make_pair(b.x1, b.y1)}) {
+            const double t = position(l, end.first, end.second);
+            lo = std::min(lo, t);
+            hi = std::max(hi, t);
+          }
+          a.x0 = l.cx + lo * l.dx;
+          a.y0 = l.cy + lo * l.dy;
+          a.x1 = l.cx + hi * l.dx;
+          a.y1 = l.cy + hi * l.dy;
+          lines[i] = l;
+          segments[j] = segments.back();
+          lines[j] = lines.back();
+          segments.pop_back();
+          lines.pop_back();
+          joined = true;
+        }
+      }
+    }
+  };
+  joinAll(false);
+  for (size_t i = 0; i < segments.size(); i++) {
+    extend(frame, segments[i]);
+    lines[i] = lineOf(segments[i]);
+  }
+  joinAll(true);
+
+  for (const auto& s : segments) {
+    const double length = std::hypot(s.x1 - s.x0, s.y1 - s.y0);
+    if (length < mConfig.minLength) {
+      continue;
+    }
+    double cx, cy, dx, dy, across;
+    s.moments.line(cx, cy, dx, dy, across);
+    Streak streak{};
+    streak.x0 = s.x0;
+    streak.y0 = s.y0;
+    streak.x1 = s.x1;
+    streak.y1 = s.y1;
+    double angle = std::atan2(s.y1 - s.y0, s.x1 - s.x0);
+    if (angle < 0.0) {
+      // Same streak, the other way round
+      angle += M_PI;
+      std::swap(streak.x0, streak.x1);
+      std::swap(streak.y0, streak.y1);
+    }
+    streak.angle = (angle >= M_PI) ? 0.0 : angle;
+    streak.length = length;
+    streak.width = std::sqrt(12.0 * across);
+    streak.brightness = s.moments.value / s.moments.n;
+    streak.pixels = static_cast<uint32_t>(s.moments.n);
+    streaks.push_back(streak);
+  }
+  std::sort(streaks.begin(), streaks.end(),
+            [](const Streak& a, const Streak& b) {
+              return a.length > b.length;
+            });
+}
+
+template <typename T>
+void StreakDetector::extend(Plane<const T> frame, Segment& segment) const {
+  double cx, cy, dx, dy, across;
+  segment.moments.line(cx, cy, dx, dy, across);
+
+  // Walk one column (or row, for steep lines) at a time, so each pixel is
+  // looked at once
+  const bool steep = std::fabs(dy) > std::fabs(dx);
+  const double slope = steep ? dx / dy : dy / dx;
+  const int majorSize = steep ? mConfig.height : mConfig.width;
+  const int minorSize = steep ? mConfig.width : mConfig.height;
+  auto walk = [&](double& ex, double& ey, double ox, double oy) {
+    const double endMajor = steep ? ey : ex;
+    const double endMinor = steep ? ex : ey;
+    const int step = ((steep ? ey - oy : ex - ox) >= 0.0) ? 1 : -1;
+    int lastHit = static_cast<int>(std::lround(endMajor));
+    bool hit = false;
+    for (int major = lastHit + step;
+         (major >= 0) && (major < majorSize) &&
+           (std::abs(major - lastHit) <= mConfig.maxGap);
+         major += step) {
+      const double centre = endMinor + (major - endMajor) * slope;
+      const int first = std::max(
+        static_cast<int>(std::ceil(centre - mConfig.lineWidth)), 0);
+      const int last = std::min(
+        static_cast<int>(std::floor(centre + mConfig.lineWidth)),
+        minorSize - 1);
+      for (int minor = first; minor <= last; minor++) {
+        const uint32_t x = steep ? minor : major;
+        const uint32_t y = steep ? major : minor;
+        if ((mForeground[y * mWords + x / 64] >> (x % 64)) & 1) {
+          segment.moments.add(x, y, frame.row(y)[x]);
+          lastHit = major;
+          hit = true;
+        }
+      }
+    }
+    if (hit) {
+      const double delta = lastHit - endMajor;
+      ex += steep ? delta * slope : delta;
+      ey += steep ? delta : delta * slope;
+    }
+  };
+  const double x0 = segment.x0, y0 = segment.y0;
+  walk(segment.x0, segment.y0, segment.x1, segment.y1);
+  walk(segment.x1, segment.y1, x0, y0);
+}
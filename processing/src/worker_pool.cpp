@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include "worker_pool.hpp"
+
+
+WorkerPool::WorkerPool(unsigned threads)
+  : mThreads{}
+  , mMutex{}
+  , mStartCv{}
+  , mDoneCv{}
+  , mTask{nullptr}
+  , mCount{0}
+  , mNext{0}
+  , mActive{0}
+  , mGeneration{0}
+  , mStopping{false}
+{
+  if (threads == 0) {
+    threads = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+  for (unsigned i = 1; i < threads; i++) {
+    mThreads.emplace_back(&WorkerPool::work, this);
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock{mMutex};
+    mStopping = true;
+  }
+  mStartCv.notify_all();
+  for (auto& thread : mThreads) {
+    thread.join();
+  }
+}
+
+void WorkerPool::run(size_t count, const std::function<void(size_t)>& task) {
+  if (mThreads.empty() || (count <= 1)) {
+    for (size_t i = 0; i < count; i++) {
+      task(i);
+    }
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock{mMutex};
+    mTask = &task;
+    mCount = count;
+    mNext = 0;
+    mActive = mThreads.size();
+    mGeneration++;
+  }
+  mStartCv.notify_all();
+
+  drain();
+
+  std::unique_lock<std::mutex> lock{mMutex};
+  mDoneCv.wait(lock, [this] { return mActive == 0; });
+  mTask = nullptr;
+}
+
+void WorkerPool::runBands(uint32_t height,
+                          const std::function<void(uint32_t, uint32_t)>& task,
+                          unsigned bandsPerThread) {
+  runBands(this, height, task, bandsPerThread);
+}
+
+void WorkerPool::runBands(WorkerPool* pool, uint32_t height,
+                          const std::function<void(uint32_t, uint32_t)>& task,
+                          unsigned bandsPerThread) {
+  const size_t count = bandCount(pool, height, bandsPerThread);
+  if (count == 1) {
+    task(0, height);
+    return;
+  }
+  pool->run(count, [&](size_t b) {
+    task(bandStart(height, count, b), bandStart(height, count, b + 1));
+  });
+}
+
+size_t WorkerPool::bandCount(const WorkerPool* pool, uint32_t height,
+                             unsigned bandsPerThread) {
+  if (pool == nullptr) {
+    return 1;
+  }
+  return std::min<size_t>(pool->size() * bandsPerThread,
+                          std::max<uint32_t>(height, 1));
+}
+
+void WorkerPool::work() {
+  uint64_t generation = 0;
+  std::unique_lock<std::mutex> lock{mMutex};
+  for (;;) {
+    mStartCv.wait(lock, [this, generation] {
+      return mStopping || (mGeneration != generation);
+    });
+    if (mStopping) {
+      return;
+    }
+    generation = mGeneration;
+
+    lock.unlock();
+    drain();
+    lock.lock();
+
+    if (--mActive == 0) {
+      mDoneCv.notify_one();
+    }
+  }
+}
+
+void WorkerPool::drain() {
+  for (;;) {
+    const size_t i = mNext.fetch_add(1);
+    if (i >= mCount) {
+      return;
+    }
+    (*mTask)(i);
+  }
+}
@@ -0,0 +1,47 @@
+#!/usr/bin/env python
+# coding: utf-8
+
+# Look for aircraft, satellite and meteor trails in a sequence of frames,
+# and list (or copy out) the ones that have any.
+
+import argparse as ap
+import math
+import os
+import shutil
+
+import numpy as np
+from PIL import Image
+
+import picamproc
+
+parser = ap.ArgumentParser()
+parser.add_argument('input_files', type=str, nargs='+',
+                    help='Frames, in the order they were captured')
+parser.add_argument('-t', '--threshold', type=int, default=100,
+                    help='Threshold on R + G + B')
+parser.add_argument('-l', '--min-length', type=float, default=60,
+                    help='Shortest streak, in pixels')
+parser.add_argument('-k', '--keep', type=str, default=None,
+                    help='Copy frames with streaks into this directory')
+args = parser.parse_args()
+
+detector = None
+for path in args.input_files:
+    img_l = picamproc.luma_sum(np.array(Image.open(path).convert('RGB')))
+    if detector is None:
+        height, width = img_l.shape
+        detector = picamproc.StreakDetector(width, height, args.threshold,
+                                            args.min_length)
+
+    streaks = detector.detect(img_l)
+    if len(streaks) == 0:
+        continue
+
+    print(f'{path}: {len(streaks)} streak(s)')
+    for s in streaks:
+        print(f'    ({s["x0"]:.0f}, {s["y0"]:.0f})-({s["x1"]:.0f}, {s["y1"]:.0f})'
+              f' length {s["length"]:.0f} angle {math.degrees(s["angle"]):.1f}'
+              f' width {s["width"]:.1f} brightness {s["brightness"]:.0f}')
+    if args.keep is not None:
+        os.makedirs(args.keep, exist_ok=True)
+        shutil.copy2(path, args.keep)
@@ -9,24 +9,34 @@ from PIL import Image
 import scipy.signal as spsignal
 import matplotlib.pyplot as plt
 
+import picamproc
+
 parser = ap.ArgumentParser()
 parser.add_argument('input_file', nargs='?', default='./out/469_bright_region.png')
 parser.add_argument('-c', '--color-map', default='gray')
+parser.add_argument('-s', '--sigma', type=float, default=5.0,
+                    help='Threshold, in background RMS above the background')
+parser.add_argument('-t', '--threshold', type=int, default=None,
+                    help='Fixed threshold on R + G + B instead')
 
 args = parser.parse_args()
 
 unprocessed_rgb = np.array(Image.open(args.input_file))
 
-unprocessed_rgb = np.delete(unprocessed_rgb, 3, 2) 
-unprocessed = unprocessed_rgb.sum(axis=2, dtype=np.float)
+unprocessed = picamproc.luma_sum(unprocessed_rgb)
 
 ax1 = plt.subplot(1, 2, 1)
 ax1.imshow(unprocessed, cmap=args.color_map)
 
 
-thresh_hi = 200
+if args.threshold is not None:
+    above = picamproc.threshold_mask(unprocessed, args.threshold + 1)
+else:
+    # Follows skyglow and moonlight gradients
+    background = picamproc.Background().estimate(unprocessed)
+    above = unprocessed >= background.threshold(args.sigma)
 
-filtered = np.ma.array(unprocessed, mask=unprocessed > thresh_hi).filled(0)
+filtered = np.ma.array(unprocessed, mask=above).filled(0)
 
 
 ax2 = plt.subplot(1, 2, 2)
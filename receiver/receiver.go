@@ -100,6 +100,13 @@ func handleConnection(db *sql.DB, conn net.Conn) {
 		if meta != nil {
 			fmt.Printf("Image time (%v, %v)\n", meta.TimeS, meta.TimeUs)
 		}
+		// In event mode, most messages carry only what was detected
+		if detections := imageMessage.Detections; detections != nil {
+			fmt.Printf("Frame %v: %v stars, %v streaks, background %.1f, triggers %v\n",
+				detections.Sequence, detections.StarCount,
+				len(detections.Streaks), detections.Background,
+				detections.Triggers)
+		}
 
 		if imageData := imageMessage.Data; imageData != nil {
 			var id int
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Counts heap allocations by replacing the global operator new, for the
+ * benchmarks that report allocations per frame. Include it from exactly one
+ * file of a benchmark.
+ */
+
+#ifndef BENCH_ALLOCATIONS_HPP
+#define BENCH_ALLOCATIONS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<uint64_t> gAllocations{0};
+// Cleared by threads that stand in for the far end of a connection, so only
+// the sensor's own allocations are counted
+static thread_local bool tCountAllocations = true;
+
+void* operator new(size_t size) {
+  if (tCountAllocations) {
+    gAllocations.fetch_add(1, std::memory_order_relaxed);
+  }
+  void* p = malloc(size == 0 ? 1 : size);
+  if (p == nullptr) {
+    throw std::bad_alloc{};
+  }
+  return p;
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete[](void* p) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+  free(p);
+}
+
+#endif // BENCH_ALLOCATIONS_HPP
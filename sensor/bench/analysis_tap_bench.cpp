@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Checks and times AnalysisTap without a camera: offers 1640x1232 I420
+ * frames at a steady rate, once to an analysis callback that keeps up and
+ * once to one that's much slower, and checks that
+ *
+ * - offer() never waited on the analysis thread and never allocated,
+ * - every frame delivered is intact, in order, and no older than the tap's
+ *   buffers allow,
+ * - a callback that keeps up sees every frame, and a slow one sees the
+ *   freshest ones with the rest counted as dropped.
+ *
+ * USAGE: analysis_tap_bench [fps [frames]]
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "analysis_tap.hpp"
+
+#include "allocations.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+// What the camera's splitter hands out in sensor mode 4: width rounded up to
+// 32, height to 16
+static const uint32_t WIDTH = 1640;
+static const uint32_t HEIGHT = 1232;
+static const uint32_t STRIDE = 1664;
+static const uint32_t SLICE_HEIGHT = 1232;
+
+/**
+ * Each luma row starts and ends with a byte derived from the frame number
+ * and row, so a frame overwritten while it's analysed shows up.
+ */
+static void drawFrame(std::vector<uint8_t>& frame, uint64_t number) {
+  for (uint32_t y = 0; y < SLICE_HEIGHT; y++) {
+    memset(&frame[static_cast<size_t>(y) * STRIDE],
+           static_cast<int>((number + y) & 0xFF), STRIDE);
+  }
+  memset(&frame[static_cast<size_t>(STRIDE) * SLICE_HEIGHT], 128,
+         frame.size() - static_cast<size_t>(STRIDE) * SLICE_HEIGHT);
+}
+
+static bool frameIntact(const RawFrame& frame) {
+  for (uint32_t y = 0; y < frame.height; y++) {
+    const uint8_t* row = frame.luma() + static_cast<size_t>(y) * frame.stride;
+    const uint8_t expected = static_cast<uint8_t>(frame.sequence + y);
+    if ((row[0] != expected) || (row[frame.width - 1] != expected)) {
+      return false;
+    }
+  }
+  return (frame.u()[0] == 128) && (frame.v()[0] == 128);
+}
+
+static bool run(const char* name, double fps, unsigned frames,
+                std::chrono::milliseconds analysisTime) {
+  AnalysisTap::Config config{};
+  config.bufferSize = RawFrame::sizeFor(STRIDE, SLICE_HEIGHT);
+
+  std::atomic<uint64_t> lastOffered{0};
+  uint64_t lastDelivered = 0, worstLag = 0, corrupt = 0, outOfOrder = 0;
+  bool first = true;
+  AnalysisTap tap{config, [&](const RawFrame& frame) {
+    if (!frameIntact(frame)) {
+      corrupt++;
+    }
+    if (!first && (frame.sequence <= lastDelivered)) {
+      outOfOrder++;
+    }
+    first = false;
+    lastDelivered = frame.sequence;
+    worstLag = std::max(worstLag, lastOffered.load() - frame.sequence);
+    std::this_thread::sleep_for(analysisTime);
+  }};
+  tap.start();
+
+  std::vector<uint8_t> pixels(config.bufferSize);
+  RawFrame frame{WIDTH, HEIGHT, STRIDE, SLICE_HEIGHT, 0, 0, pixels.data(),
+                 pixels.size()};
+  const auto period = std::chrono::duration_cast<Clock::duration>(
+    std::chrono::duration<double>(1.0 / fps));
+  auto next = Clock::now();
+  double worstOffer = 0.0, totalOffer = 0.0;
+  uint64_t offerAllocations = 0;
+  for (unsigned i = 0; i < frames; i++) {
+    std::this_thread::sleep_until(next);
+    next += period;
+    drawFrame(pixels, i);
+    frame.pts = static_cast<int64_t>(i * 1e6 / fps);
+
+    lastOffered.store(i);
+    const uint64_t allocations = gAllocations.load();
+    const auto start = Clock::now();
+    tap.offer(frame);
+    const double seconds =
+      std::chrono::duration<double>(Clock::now() - start).count();
+    offerAllocations += gAllocations.load() - allocations;
+    worstOffer = std::max(worstOffer, seconds);
+    totalOffer += seconds;
+  }
+  // Let the analysis thread finish what's waiting
+  std::this_thread::sleep_for(analysisTime * (config.bufferCount + 1) +
+                              std::chrono::milliseconds{50});
+  tap.stop();
+
+  const auto stats = tap.stats();
+  const bool keepsUp = analysisTime.count() * fps < 500.0;
+  const bool accounted =
+    (stats.offered == frames) &&
+    (stats.delivered + stats.dropped + stats.oversized == stats.offered);
+  const bool ok = accounted && (corrupt == 0) && (outOfOrder == 0) &&
+    (offerAllocations == 0) && (worstLag < config.bufferCount + 1) &&
+    (keepsUp ? (stats.dropped == 0) : (stats.dropped > 0));
+
+  printf("%-12s %5.0f fps, %3lld ms analysis: %4llu delivered, %4llu dropped,"
+         " worst lag %llu\n", name, fps,
+         static_cast<long long>(analysisTime.count()),
+         static_cast<unsigned long long>(stats.delivered),
+         static_cast<unsigned long long>(stats.dropped),
+         static_cast<unsigned long long>(worstLag));
+  printf("             offer: %.0f us mean, %.0f us worst, %llu allocations;"
+         " %llu corrupt, %llu out of order: %s\n",
+         totalOffer * 1e6 / frames, worstOffer * 1e6,
+         static_cast<unsigned long long>(offerAllocations),
+         static_cast<unsigned long long>(corrupt),
+         static_cast<unsigned long long>(outOfOrder), ok ? "ok" : "BAD");
+  return ok;
+}
+
+int main(int argc, char* argv[]) {
+  const double fps = (argc > 1) ? std::max(std::atof(argv[1]), 1.0) : 30.0;
+  const unsigned frames = (argc > 2)
+    ? static_cast<unsigned>(std::max(std::atoi(argv[2]), 1)) : 90;
+
+  printf("%ux%u I420, %zu bytes per frame\n", WIDTH, HEIGHT,
+         RawFrame::sizeFor(STRIDE, SLICE_HEIGHT));
+  bool ok = run("keeping up", fps, frames, std::chrono::milliseconds{2});
+  ok = run("falling behind", fps, frames,
+           std::chrono::milliseconds{static_cast<int>(4000 / fps)}) && ok;
+  printf("%s\n", ok ? "all ok" : "BAD");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,450 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Checks the chunked transfer protocol (ChunkFraming) end to end:
+ *
+ * 1. CRC32C: the standard check value, and hardware against table speed.
+ * 2. A record with a corrupt payload is caught by its CRC and asked for
+ *    again, and the frame completes once it's resent.
+ * 3. A big frame, encoded an encoder buffer at a time, goes to a local
+ *    listener through a chunked ImageSender, first whole and then streamed
+ *    with FrameStreamer. Reports when the first byte arrived, when the frame
+ *    was complete, and how much frame memory the sensor needed.
+ * 4. The listener is killed partway through a streamed frame and restarted.
+ *    The frame has to arrive intact. Only what the listener never got is
+ *    sent again: at most a send window's worth, whatever the frame size.
+ *
+ * USAGE: chunk_bench [frame_size]
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "chunk_framing.hpp"
+#include "crc32c.hpp"
+#include "frame_assembler.hpp"
+#include "frame_streamer.hpp"
+#include "image_sender.hpp"
+#include "loopback.hpp"
+
+#include "picam.pb.h"
+
+using Clock = std::chrono::steady_clock;
+
+// Roughly what the image encoder's output port recommends
+static const size_t ENCODER_BUFFER_SIZE = 81920;
+// How often the "encoder" hands over a buffer
+static const std::chrono::microseconds BUFFER_INTERVAL{1000};
+
+/**
+ * Accepts connections one at a time on a loopback port, feeds them to a
+ * ChunkFraming::Receiver that outlives the listener (as the real receiver
+ * would outlive a connection), and sends the acks back.
+ */
+class Listener {
+  public:
+    struct Shared {
+      std::mutex mutex;
+      ChunkFraming::Receiver receiver;
+      // Frame indexes received intact, and when
+      std::vector<uint32_t> frames;
+      std::vector<Clock::time_point> completedAt;
+      unsigned corrupt = 0;
+      // When the first bytes came in since this was last reset
+      Clock::time_point firstByte{};
+
+      Shared()
+        : receiver{[this](uint64_t, Image&& image) { frameReceived(image); }}
+      { }
+
+      void frameReceived(const Image& image) {
+        // Before checking it, which takes a while
+        const auto now = Clock::now();
+        const uint32_t index = image.metadata().time_us();
+        const std::string& data = image.data();
+        bool ok = data.size() ==
+          static_cast<size_t>(image.metadata().time_s());
+        for (size_t i = 0; ok && (i < data.size()); i++) {
+          ok = static_cast<uint8_t>(data[i]) == payloadByte(index, i);
+        }
+        if (!ok) {
+          corrupt++;
+          return;
+        }
+        frames.push_back(index);
+        completedAt.push_back(now);
+      }
+    };
+
+    Listener(uint16_t port, Shared& shared)
+      : mShared{shared}
+      , mListener{port, [this](int fd) { serve(fd); }}
+    { }
+
+    uint16_t port() const {
+      return mListener.port();
+    }
+
+    bool start() {
+      return mListener.start();
+    }
+
+    /**
+     * Stop listening and drop the connection, unread data and all.
+     */
+    void kill() {
+      mListener.kill();
+    }
+
+  private:
+    void serve(int fd) {
+      std::string acks;
+      {
+        std::lock_guard<std::mutex> lock{mShared.mutex};
+        mShared.receiver.newConnection(acks);
+      }
+      if (::send(fd, acks.data(), acks.size(), MSG_NOSIGNAL) >= 0) {
+        receive(fd);
+      }
+    }
+
+    void receive(int fd) {
+      std::vector<uint8_t> buf(256 * 1024);
+      std::string acks;
+      for (;;) {
+        ssize_t rc = read(fd, buf.data(), buf.size());
+        if (rc <= 0) {
+          return;
+        }
+        acks.clear();
+        {
+          std::lock_guard<std::mutex> lock{mShared.mutex};
+          if (mShared.firstByte == Clock::time_point{}) {
+            mShared.firstByte = Clock::now();
+          }
+          mShared.receiver.feed(buf.data(), rc, acks);
+        }
+        if (!acks.empty() &&
+            (::send(fd, acks.data(), acks.size(), MSG_NOSIGNAL) < 0)) {
+          return;
+        }
+      }
+    }
+
+    Shared& mShared;
+    LoopbackListener mListener;
+};
+
+/**
+ * "Encode" frame index: hand it over an encoder buffer at a time, at
+ * BUFFER_INTERVAL, to assembler (which may pass it on to a stream).
+ * onBuffer is called after each buffer.
+ */
+static void encode(uint32_t index, size_t frameSize, FrameAssembler& assembler,
+                   const std::function<void(size_t)>& onBuffer = nullptr) {
+  std::vector<uint8_t> buffer(ENCODER_BUFFER_SIZE);
+  auto next = Clock::now();
+  for (size_t offset = 0; offset < frameSize;) {
+    const size_t n = std::min(ENCODER_BUFFER_SIZE, frameSize - offset);
+    for (size_t i = 0; i < n; i++) {
+      buffer[i] = payloadByte(index, offset + i);
+    }
+    assembler.append(buffer.data(), n);
+    offset += n;
+    if (onBuffer) {
+      onBuffer(offset);
+    }
+    next += BUFFER_INTERVAL;
+    std::this_thread::sleep_until(next);
+  }
+}
+
+static Image::Metadata frameMetadata(uint32_t index, size_t frameSize) {
+  Image::Metadata metadata{};
+  // time_s carries the size, so the listener can check it
+  metadata.set_time_s(frameSize);
+  metadata.set_time_us(index);
+  metadata.set_encoding("RAW");
+  return metadata;
+}
+
+static bool crcChecks() {
+  const uint8_t check[] = "123456789";
+  const uint32_t expected = 0xE3069283;
+  const uint32_t hardware = crc32c(check, 9);
+  const uint32_t portable = crc32cPortable(check, 9);
+  // In two pieces, as for a record header and its payload
+  const uint32_t split = crc32c(check + 4, 5, crc32c(check, 4));
+
+  std::vector<uint8_t> data(16 << 20);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = payloadByte(1, i);
+  }
+  auto rate = [&data](uint32_t (*fn)(const uint8_t*, size_t, uint32_t),
+                      uint32_t& result) {
+    const auto start = Clock::now();
+    const int passes = 8;
+    for (int i = 0; i < passes; i++) {
+      result = fn(data.data(), data.size(), 0);
+    }
+    return passes * data.size() / seconds(Clock::now() - start) / 1e9;
+  };
+  uint32_t fastResult = 0, portableResult = 0;
+  const double fastRate = rate(crc32c, fastResult);
+  const double portableRate = rate(crc32cPortable, portableResult);
+
+  const bool ok = (hardware == expected) && (portable == expected) &&
+    (split == expected) && (fastResult == portableResult);
+  printf("crc32c: check value %08x, %s: %.2f GB/s, table: %.2f GB/s: %s\n",
+         hardware, crc32cAccelerated() ? "hardware" : "table (no hardware)",
+         fastRate, portableRate, ok ? "ok" : "BAD");
+  return ok;
+}
+
+static bool corruptionCheck() {
+  const size_t frameSize = 4 * ENCODER_BUFFER_SIZE;
+  std::vector<uint8_t> payload(frameSize);
+  for (size_t i = 0; i < frameSize; i++) {
+    payload[i] = payloadByte(7, i);
+  }
+  // A frame of four chunks, so four DATA records
+  FrameAssembler assembler{ENCODER_BUFFER_SIZE, 4};
+  assembler.append(payload.data(), payload.size());
+  FramePtr frame = assembler.finish();
+
+  std::deque<ChunkFraming::Record> records;
+  const uint32_t count = ChunkFraming::appendData(42, 0, 0, frame, records);
+  ChunkFraming::appendEnd(42, count, frameSize, frameMetadata(7, frameSize),
+                          nullptr, records);
+  auto serialize = [&records](size_t first) {
+    std::string out;
+    for (size_t i = first; i < records.size(); i++) {
+      out.append(reinterpret_cast<const char*>(records[i].encoded),
+                 ChunkFraming::HEADER_SIZE);
+      out.append(reinterpret_cast<const char*>(records[i].payload()),
+                 records[i].header.payloadSize);
+    }
+    return out;
+  };
+
+  Listener::Shared shared;
+  std::string wire = serialize(0);
+  // Flip a bit in the second record's payload
+  const size_t recordSize = ChunkFraming::HEADER_SIZE + ENCODER_BUFFER_SIZE;
+  wire[recordSize + ChunkFraming::HEADER_SIZE + 100] ^= 0x10;
+  std::string acks;
+  shared.receiver.feed(reinterpret_cast<const uint8_t*>(wire.data()),
+                       wire.size(), acks);
+
+  // One ack for the first record, then one RESEND for the gap
+  bool resendAsked = false;
+  for (size_t i = 0; i + ChunkFraming::ACK_SIZE <= acks.size();
+       i += ChunkFraming::ACK_SIZE) {
+    ChunkFraming::Ack ack{};
+    if (ChunkFraming::decodeAck(
+          reinterpret_cast<const uint8_t*>(acks.data()) + i, ack) &&
+        (ack.flags & ChunkFraming::RESEND)) {
+      resendAsked = resendAsked || (ack.offset == ENCODER_BUFFER_SIZE);
+    }
+  }
+  const bool heldBack = shared.frames.empty();
+
+  // Resend from the second record, as the sender would
+  wire = serialize(1);
+  acks.clear();
+  shared.receiver.feed(reinterpret_cast<const uint8_t*>(wire.data()),
+                       wire.size(), acks);
+  const auto& stats = shared.receiver.stats();
+  const bool ok = (stats.crcErrors == 1) && resendAsked && heldBack &&
+    (shared.frames.size() == 1) && (shared.corrupt == 0);
+  printf("corrupt record: %llu CRC errors, resend %s, frame %s: %s\n",
+         static_cast<unsigned long long>(stats.crcErrors),
+         resendAsked ? "asked for" : "NOT asked for",
+         (shared.frames.size() == 1) ? "complete after resend" : "LOST",
+         ok ? "ok" : "BAD");
+  return ok;
+}
+
+int main(int argc, char* argv[]) {
+  size_t frameSize = 15000000;
+  if (argc > 1) {
+    frameSize = std::max(std::atoi(argv[1]), 1);
+  }
+
+  bool ok = crcChecks();
+  ok = corruptionCheck() && ok;
+
+  Listener::Shared shared;
+  auto listener = std::make_unique<Listener>(0, shared);
+  if (!listener->start()) {
+    return 1;
+  }
+  const uint16_t port = listener->port();
+
+  ImageSender::Config config{};
+  config.serverHostname = "127.0.0.1";
+  config.serverPort = port;
+  config.queueCapacity = 256;
+  config.overflowPolicy = ImageSender::OverflowPolicy::DROP_NEWEST;
+  config.chunked = true;
+  config.reconnectDelay = std::chrono::milliseconds{50};
+  config.maxReconnectDelay = std::chrono::milliseconds{400};
+  ImageSender sender{config};
+  if (!sender.connect() || !sender.start()) {
+    fprintf(stderr, "Failed to connect to the listener\n");
+    return 1;
+  }
+
+  auto framesReceived = [&shared] {
+    std::lock_guard<std::mutex> lock{shared.mutex};
+    return shared.frames.size();
+  };
+  auto resetFirstByte = [&shared] {
+    std::lock_guard<std::mutex> lock{shared.mutex};
+    shared.firstByte = Clock::time_point{};
+  };
+
+  struct Timing {
+    double firstByte;
+    double complete;
+    double encoded;
+    size_t memory;
+    bool received;
+  };
+  // Time from the start of encoding to the first byte and the whole frame
+  // arriving
+  auto timing = [&](Clock::time_point start, Clock::time_point encoded,
+                    size_t expected) {
+    Timing t{};
+    t.received = waitFor([&] { return framesReceived() >= expected; },
+                         std::chrono::seconds{30});
+    std::lock_guard<std::mutex> lock{shared.mutex};
+    t.firstByte = seconds(shared.firstByte - start);
+    t.complete = t.received ? seconds(shared.completedAt.back() - start) : 0.0;
+    t.encoded = seconds(encoded - start);
+    return t;
+  };
+
+  //
+  // Whole frame: nothing goes out until the encoder is done
+  //
+  resetFirstByte();
+  FrameAssembler assembler{ENCODER_BUFFER_SIZE * 16, 1};
+  auto start = Clock::now();
+  encode(0, frameSize, assembler);
+  const auto wholeEncoded = Clock::now();
+  {
+    QueuedImage image{};
+    image.metadata = frameMetadata(0, frameSize);
+    image.frame = assembler.finish();
+    sender.enqueue(std::move(image));
+  }
+  Timing whole = timing(start, wholeEncoded, 1);
+  whole.memory = assembler.pool().allocated() * ENCODER_BUFFER_SIZE * 16;
+
+  //
+  // Streamed: each buffer goes out as soon as it's encoded
+  //
+  resetFirstByte();
+  FrameStreamer streamer{sender, ENCODER_BUFFER_SIZE, 4};
+  FrameAssembler streamAssembler{ENCODER_BUFFER_SIZE, 1};
+  streamAssembler.setStream(&streamer);
+  start = Clock::now();
+  encode(1, frameSize, streamAssembler);
+  const auto streamEncoded = Clock::now();
+  streamer.finish(frameMetadata(1, frameSize));
+  Timing streamed = timing(start, streamEncoded, 2);
+  streamed.memory = streamer.stats().piecesAllocated * ENCODER_BUFFER_SIZE;
+
+  const bool latencyOk = whole.received && streamed.received &&
+    (streamed.firstByte < whole.firstByte) &&
+    (streamed.complete < whole.complete) && (streamed.memory < frameSize);
+  ok = ok && latencyOk;
+  printf("%.1f MB frame, encoded in %.0f ms:\n", frameSize / 1e6,
+         whole.encoded * 1e3);
+  printf("  whole:    first byte %7.1f ms, complete %7.1f ms, "
+         "%6.1f MB of frame memory\n",
+         whole.firstByte * 1e3, whole.complete * 1e3, whole.memory / 1e6);
+  printf("  streamed: first byte %7.1f ms, complete %7.1f ms, "
+         "%6.1f MB of frame memory: %s\n",
+         streamed.firstByte * 1e3, streamed.complete * 1e3,
+         streamed.memory / 1e6, latencyOk ? "ok" : "BAD");
+
+  //
+  // Resume: the listener dies a third of the way through a frame
+  //
+  const auto before = sender.stats();
+  const size_t killAt = frameSize / 3;
+  bool killed = false;
+  encode(2, frameSize, streamAssembler, [&](size_t offset) {
+      if (killed || (offset < killAt)) {
+        return;
+      }
+      listener->kill();
+      killed = true;
+      listener = std::make_unique<Listener>(port, shared);
+      listener->start();
+    });
+  streamer.finish(frameMetadata(2, frameSize));
+  const bool resumed = waitFor([&] { return framesReceived() >= 3; },
+                               std::chrono::seconds{30});
+  const auto after = sender.stats();
+  const uint64_t resent = after.chunkResentBytes - before.chunkResentBytes;
+  unsigned corrupt;
+  {
+    std::lock_guard<std::mutex> lock{shared.mutex};
+    corrupt = shared.corrupt;
+  }
+  const bool resumeOk = resumed && (after.reconnects > before.reconnects) &&
+    (resent <= config.chunkWindow + 2 * ENCODER_BUFFER_SIZE) &&
+    (after.chunkFramesAborted == before.chunkFramesAborted) && (corrupt == 0);
+  ok = ok && resumeOk;
+  printf("resume: %llu reconnects, frame %s, %.2f MB of %.1f MB sent again "
+         "(window %.2f MB): %s\n",
+         static_cast<unsigned long long>(after.reconnects - before.reconnects),
+         resumed ? "complete" : "LOST", resent / 1e6, frameSize / 1e6,
+         config.chunkWindow / 1e6, resumeOk ? "ok" : "BAD");
+
+  sender.stop();
+  listener->kill();
+  const auto stats = sender.stats();
+  const auto streamStats = streamer.stats();
+  printf("sender: %llu frames, %llu bytes, %llu acks, %llu syscalls; "
+         "streamer: %llu pieces, %llu dropped\n",
+         static_cast<unsigned long long>(stats.sent),
+         static_cast<unsigned long long>(stats.bytesSent),
+         static_cast<unsigned long long>(stats.chunkAcks),
+         static_cast<unsigned long long>(stats.syscalls),
+         static_cast<unsigned long long>(streamStats.pieces),
+         static_cast<unsigned long long>(streamStats.dropped));
+  printf("%s\n", ok ? "all ok" : "BAD");
+  return ok ? 0 : 1;
+}
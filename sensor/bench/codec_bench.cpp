@@ -0,0 +1,271 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Measures PayloadEncoder on synthetic 1640x1232 I420 frames of a fixed star
+ * field, with more or less sensor noise changing from frame to frame:
+ *
+ * - for each codec compiled in, with and without delta frames: how small
+ *   frames get and how fast they're compressed, checking that every one
+ *   decodes back to the frame that went in,
+ * - with -z auto's adaptive choice, over simulated links of different
+ *   speeds with frames coming in at a fixed rate: what it settles on, and
+ *   that it leaves frames alone when the link keeps up and compresses them
+ *   when it doesn't.
+ *
+ * USAGE: codec_bench [frames [fps]]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "frame_assembler.hpp"
+#include "payload_codec.hpp"
+#include "payload_encoder.hpp"
+
+#include "synthetic_sky.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+static const uint32_t WIDTH = 1640;
+static const uint32_t HEIGHT = 1232;
+static const size_t LUMA_SIZE = static_cast<size_t>(WIDTH) * HEIGHT;
+static const size_t FRAME_SIZE = LUMA_SIZE + LUMA_SIZE / 2;
+static const unsigned STAR_COUNT = 400;
+static const int BACKGROUND = 16;
+static const int NOISE_LEVELS[] = {0, 1, 4};
+
+static const size_t SLAB_SIZE = 1 << 20;
+
+// Simulated links for the adaptive runs, in bytes/s
+static const double LINK_RATES[] = {1e9 / 8, 100e6 / 8, 10e6 / 8};
+
+/**
+ * The sky without noise: background, stars and neutral chroma.
+ */
+static std::vector<uint8_t> drawSky() {
+  std::vector<uint8_t> sky(FRAME_SIZE, BACKGROUND);
+  std::fill(sky.begin() + LUMA_SIZE, sky.end(), 128);
+  for (const Star& star : randomStars(STAR_COUNT, WIDTH, HEIGHT)) {
+    drawStar(sky.data(), WIDTH, HEIGHT, star.x, star.y, star.peak);
+  }
+  return sky;
+}
+
+/**
+ * The sky with +/- noise on the luma, different for every frame number.
+ */
+static void drawFrame(const std::vector<uint8_t>& sky, int noise,
+                      uint64_t number, std::vector<uint8_t>& pixels) {
+  pixels = sky;
+  addNoise(pixels.data(), LUMA_SIZE, noise, number);
+}
+
+static QueuedImage makeImage(FrameAssembler& assembler,
+                             const std::vector<uint8_t>& pixels) {
+  assembler.append(pixels.data(), pixels.size());
+  QueuedImage image{};
+  image.frame = assembler.finish();
+  image.metadata.set_width(WIDTH);
+  image.metadata.set_height(HEIGHT);
+  image.metadata.set_encoding("I420");
+  return image;
+}
+
+/**
+ * Checks what comes out of an encoder against the frames that went in, in
+ * order.
+ */
+struct Checker {
+  PayloadCodec::Decoder decoder;
+  std::vector<std::vector<uint8_t>> expected;
+  size_t next = 0;
+  uint64_t bytes = 0;
+  unsigned bad = 0;
+  std::map<std::string, unsigned> encodings;
+  std::string data;
+
+  bool check(QueuedImage&& image) {
+    bytes += image.frame->size();
+    encodings[image.metadata.encoding()]++;
+    Image decoded{};
+    *decoded.mutable_metadata() = image.metadata;
+    image.frame->copyTo(*decoded.mutable_data());
+    const std::vector<uint8_t>& want = expected[next++];
+    if (!decoder.decode(decoded) ||
+        (decoded.metadata().encoding() != "I420") ||
+        (decoded.data().size() != want.size()) ||
+        !std::equal(want.begin(), want.end(),
+                    reinterpret_cast<const uint8_t*>(decoded.data().data()))) {
+      bad++;
+    }
+    return true;
+  }
+};
+
+/**
+ * Compress frames frames with one codec as fast as they go, and check they
+ * all come back.
+ */
+static bool runFixed(const std::vector<uint8_t>& sky, unsigned frames,
+                     PayloadCodec::Codec codec, bool delta, int noise) {
+  Checker checker;
+  PayloadEncoder::Config config{};
+  config.codec = codec;
+  config.delta = delta;
+  config.queueCapacity = frames;
+  PayloadEncoder encoder{config, [&checker](QueuedImage&& image) {
+    return checker.check(std::move(image));
+  }};
+  FrameAssembler assembler{SLAB_SIZE, 0};
+  if (!encoder.start()) {
+    return false;
+  }
+
+  // The sink reads these from the encoding thread, so they mustn't move
+  checker.expected.reserve(frames);
+  std::vector<uint8_t> pixels;
+  for (unsigned i = 0; i < frames; i++) {
+    drawFrame(sky, noise, i, pixels);
+    checker.expected.push_back(pixels);
+    encoder.enqueue(makeImage(assembler, pixels));
+  }
+  encoder.stop();
+
+  const auto stats = encoder.stats();
+  const bool ok = (checker.next == frames) && (checker.bad == 0) &&
+    (stats.encoded == frames) && (stats.dropped == 0);
+  printf("  %-8s %-5s noise %d: %5.1f%% of raw, %6.1f MB/s, %llu key + "
+         "%llu delta frames, decoded: %s\n",
+         PayloadCodec::name(codec), delta ? "delta" : "key", noise,
+         100.0 * stats.encodedBytes / stats.rawBytes,
+         stats.rawBytes / std::max<double>(stats.encodeUs, 1.0),
+         static_cast<unsigned long long>(stats.keyFrames),
+         static_cast<unsigned long long>(stats.deltaFrames),
+         ok ? "ok" : "BAD");
+  return ok;
+}
+
+/**
+ * Feed frames at fps to an adaptive encoder whose frames go out over a
+ * simulated link of linkRate bytes/s. Returns false if frames don't come
+ * back intact; compressed says whether it settled on compressing.
+ */
+static bool runAdaptive(const std::vector<uint8_t>& sky, unsigned frames,
+                        double fps, double linkRate, int noise,
+                        bool& compressed) {
+  Checker checker;
+  // The link is busy for as long as it takes to send what it's been given
+  PayloadEncoder::LinkStats link{};
+  std::mutex linkMutex;
+  PayloadEncoder::Config config{};
+  config.adaptive = true;
+  config.delta = true;
+  config.queueCapacity = frames;
+  config.probeInterval = 10;
+  PayloadEncoder encoder{config,
+    [&](QueuedImage&& image) {
+      std::lock_guard<std::mutex> lock{linkMutex};
+      link.bytesSent += image.frame->size();
+      link.busyUs += static_cast<uint64_t>(image.frame->size() * 1e6 /
+                                           linkRate);
+      return checker.check(std::move(image));
+    },
+    [&] {
+      std::lock_guard<std::mutex> lock{linkMutex};
+      return link;
+    }};
+  FrameAssembler assembler{SLAB_SIZE, 0};
+  if (!encoder.start()) {
+    return false;
+  }
+
+  checker.expected.reserve(frames);
+  std::vector<uint8_t> pixels;
+  const auto started = Clock::now();
+  for (unsigned i = 0; i < frames; i++) {
+    std::this_thread::sleep_until(started + std::chrono::duration_cast<
+      Clock::duration>(std::chrono::duration<double>(i / fps)));
+    drawFrame(sky, noise, i, pixels);
+    checker.expected.push_back(pixels);
+    encoder.enqueue(makeImage(assembler, pixels));
+  }
+  encoder.stop();
+
+  const auto stats = encoder.stats();
+  compressed = stats.codec != PayloadCodec::Codec::NONE;
+  const bool ok = (checker.next == frames) && (checker.bad == 0);
+  printf("  link %7.1f Mb/s: settled on %s%s after %llu switches; %.2f MB "
+         "per frame; frames:", linkRate * 8 / 1e6,
+         PayloadCodec::name(stats.codec), stats.delta ? "+delta" : "",
+         static_cast<unsigned long long>(stats.switches),
+         checker.bytes / 1e6 / frames);
+  for (const auto& encoding : checker.encodings) {
+    printf(" %s x%u", encoding.first.c_str(), encoding.second);
+  }
+  printf("; decoded: %s\n", ok ? "ok" : "BAD");
+  return ok;
+}
+
+int main(int argc, char* argv[]) {
+  const unsigned frames = (argc > 1)
+    ? static_cast<unsigned>(std::max(std::atoi(argv[1]), 4)) : 20;
+  const double fps = (argc > 2) ? std::max(std::atof(argv[2]), 0.1) : 5.0;
+  const std::vector<uint8_t> sky = drawSky();
+
+  bool ok = true;
+  printf("%u frames of %ux%u I420, %zu bytes each\n", frames, WIDTH, HEIGHT,
+         FRAME_SIZE);
+  const auto codecs = PayloadCodec::availableCodecs();
+  if (codecs.empty()) {
+    printf("no codecs compiled in\n");
+    return 1;
+  }
+  for (PayloadCodec::Codec codec : codecs) {
+    for (int noise : NOISE_LEVELS) {
+      for (bool delta : {false, true}) {
+        ok = runFixed(sky, frames, codec, delta, noise) && ok;
+      }
+    }
+  }
+
+  // Noise that changes every frame, so delta frames don't come for free
+  const int noise = NOISE_LEVELS[1];
+  printf("adaptive, noise %d, %.1f frames/s (%.1f MB/s raw):\n", noise, fps,
+         fps * FRAME_SIZE / 1e6);
+  for (double linkRate : LINK_RATES) {
+    bool compressed = false;
+    ok = runAdaptive(sky, frames, fps, linkRate, noise, compressed) && ok;
+    // Compress only when the link can't take the frames as they are
+    const bool wanted = linkRate < fps * FRAME_SIZE;
+    if (compressed != wanted) {
+      printf("  expected it to %s\n", wanted ? "compress" : "leave frames be");
+      ok = false;
+    }
+  }
+
+  printf("%s\n", ok ? "all ok" : "BAD");
+  return ok ? 0 : 1;
+}
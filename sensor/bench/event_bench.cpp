@@ -0,0 +1,280 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Checks event mode end to end without a camera: runs SkyAnalyser and
+ * EventDispatcher over a sequence of synthetic 1640x1232 frames of a fixed
+ * star field, with a satellite streak in one frame, a flash in another and
+ * most of the sky clouding over part way through, and checks that
+ *
+ * - every frame gets exactly one message (its detections, or the frame with
+ *   its detections attached), matched up whichever of the encoded frame and
+ *   the analysis comes first,
+ * - a frame the encoder loses, and one the analysis never sees, don't throw
+ *   off which frame the later frames' detections are attached to,
+ * - the streak and the clouds send their frames in full, and nothing else
+ *   does,
+ * - the flash sends a crop around it,
+ * - quiet frames cost at least 100 times less than sending them,
+ * - and so does the whole run, full frames and crop included. The streak
+ *   and the clouds each send a whole frame however long the run is, so it
+ *   takes at least 250 frames for that.
+ *
+ * USAGE: event_bench [frames]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "event_dispatcher.hpp"
+#include "frame_assembler.hpp"
+#include "image_framing.hpp"
+#include "sky_analyser.hpp"
+#include "worker_pool.hpp"
+
+#include "synthetic_sky.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+static const uint32_t WIDTH = 1640;
+static const uint32_t HEIGHT = 1232;
+static const unsigned STAR_COUNT = 400;
+static const int BACKGROUND = 16;
+static const int NOISE = 6;
+
+// What happens when, as fractions of the way through
+static const double STREAK_AT = 0.25;
+static const double FLASH_AT = 0.45;
+static const double CLOUDS_AT = 0.65;
+// Clouds cover everything left of this fraction of the width
+static const double CLOUD_COVER = 0.7;
+
+static const float FLASH_X = 1000.0f;
+static const float FLASH_Y = 500.0f;
+
+static const double MIN_REDUCTION = 100.0;
+// Shorter runs can't reach MIN_REDUCTION overall: two frames go out in full
+static const unsigned MIN_FRAMES = 250;
+
+static void drawStreak(std::vector<uint8_t>& pixels, float x0, float y0,
+                       float x1, float y1, int brightness) {
+  const int steps = static_cast<int>(std::hypot(x1 - x0, y1 - y0));
+  for (int i = 0; i <= steps; i++) {
+    const float t = static_cast<float>(i) / steps;
+    const int x = static_cast<int>(x0 + t * (x1 - x0));
+    const int y = static_cast<int>(y0 + t * (y1 - y0));
+    for (int dy = 0; dy < 2; dy++) {
+      uint8_t& pixel = pixels[static_cast<size_t>(y + dy) * WIDTH + x];
+      pixel = static_cast<uint8_t>(std::min(pixel + brightness, 255));
+    }
+  }
+}
+
+static void drawFrame(std::vector<uint8_t>& pixels,
+                      const std::vector<Star>& stars, uint64_t number,
+                      bool streak, bool flash, bool clouds) {
+  std::fill(pixels.begin(), pixels.end(), BACKGROUND);
+  addNoise(pixels.data(), pixels.size(), NOISE, number);
+  for (const auto& star : stars) {
+    if (clouds && (star.x < CLOUD_COVER * WIDTH)) {
+      continue;
+    }
+    drawStar(pixels.data(), WIDTH, HEIGHT, star.x, star.y, star.peak);
+  }
+  if (streak) {
+    drawStreak(pixels, 200.0f, 300.0f, 900.0f, 700.0f, 80);
+  }
+  if (flash) {
+    drawStar(pixels.data(), WIDTH, HEIGHT, FLASH_X, FLASH_Y, 220.0f);
+  }
+}
+
+static bool hasTrigger(const Detections& detections,
+                       Detections::Trigger trigger) {
+  const auto& triggers = detections.triggers();
+  return std::find(triggers.begin(), triggers.end(), trigger) != triggers.end();
+}
+
+int main(int argc, char* argv[]) {
+  const unsigned frames = (argc > 1)
+    ? static_cast<unsigned>(std::max<int>(std::atoi(argv[1]), MIN_FRAMES))
+    : MIN_FRAMES;
+  const uint64_t streakFrame = static_cast<uint64_t>(frames * STREAK_AT);
+  const uint64_t flashFrame = static_cast<uint64_t>(frames * FLASH_AT);
+  const uint64_t cloudFrame = static_cast<uint64_t>(frames * CLOUDS_AT);
+  // Lost before they reach the dispatcher, like a failed encoder buffer and
+  // a raw frame the analysis tap had no room for
+  const uint64_t unencodedFrame = streakFrame - 2;
+  const uint64_t unanalysedFrame = (streakFrame + flashFrame) / 2;
+
+  const std::vector<Star> stars = randomStars(STAR_COUNT, WIDTH, HEIGHT);
+
+  // Everything the dispatcher sends, by what it is
+  std::vector<uint64_t> messages(frames, 0);
+  std::vector<uint64_t> fullFrames;
+  std::vector<uint64_t> streakFrames, cloudFrames, flashFrames;
+  unsigned crops = 0, cropsOnFlash = 0, bad = 0;
+  uint64_t quietBytes = 0, quietFrames = 0;
+  EventDispatcher dispatcher{EventDispatcher::Config{},
+    [&](QueuedImage&& image) {
+      if (!image.detections) {
+        bad++;
+        return true;
+      }
+      const Detections& detections = *image.detections;
+      const uint64_t sequence = detections.sequence();
+      if (image.metadata.roi_w() > 0) {
+        crops++;
+        const auto& meta = image.metadata;
+        if ((sequence == flashFrame) && (FLASH_X >= meta.roi_x()) &&
+            (FLASH_X < meta.roi_x() + meta.roi_w()) &&
+            (FLASH_Y >= meta.roi_y()) && (FLASH_Y < meta.roi_y() + meta.roi_h()) &&
+            image.frame && (image.frame->size() == static_cast<size_t>(meta.roi_w() * meta.roi_h()))) {
+          cropsOnFlash++;
+        }
+        return true;
+      }
+
+      if (sequence >= frames) {
+        bad++;
+        return true;
+      }
+      messages[sequence]++;
+      if (image.frame) {
+        fullFrames.push_back(sequence);
+        // The frame has to be the one the detections are for
+        if (image.frame->pts() != static_cast<int64_t>(sequence) * 1000000) {
+          bad++;
+        }
+      } else if (detections.triggers_size() == 0) {
+        quietFrames++;
+        quietBytes += sizeof(uint32_t) + ImageFraming::messageSize(
+          image.metadata.ByteSizeLong(), 0, detections.ByteSizeLong());
+      }
+      if (hasTrigger(detections, Detections::STREAK)) {
+        streakFrames.push_back(sequence);
+      }
+      if (hasTrigger(detections, Detections::STAR_COUNT)) {
+        cloudFrames.push_back(sequence);
+      }
+      if (hasTrigger(detections, Detections::TRANSIENT)) {
+        flashFrames.push_back(sequence);
+      }
+      return true;
+    }};
+
+  WorkerPool pool;
+  SkyAnalyser analyser{SkyAnalyser::Config{}, &pool};
+  SkyAnalyser::Result result;
+  FrameAssembler assembler{WIDTH * HEIGHT, 2};
+  std::vector<uint8_t> pixels(static_cast<size_t>(WIDTH) * HEIGHT);
+  Image::Metadata metadata{};
+  metadata.set_width(WIDTH);
+  metadata.set_height(HEIGHT);
+  metadata.set_encoding("GRAY8");
+  metadata.set_exposure_speed(1000000);
+
+  double analysisSeconds = 0.0, dispatchSeconds = 0.0;
+  size_t sentIfNotEvents = 0;
+  for (unsigned i = 0; i < frames; i++) {
+    drawFrame(pixels, stars, i, i == streakFrame, i == flashFrame,
+              i >= cloudFrame);
+    assembler.append(pixels.data(), pixels.size());
+    QueuedImage image{};
+    image.metadata = metadata;
+    image.frame = assembler.finish(static_cast<int64_t>(i) * 1000000);
+    sentIfNotEvents += sizeof(uint32_t) + ImageFraming::messageSize(
+      metadata.ByteSizeLong(), image.frame->size());
+
+    RawFrame raw{WIDTH, HEIGHT, WIDTH, HEIGHT, static_cast<int64_t>(i) * 1000000,
+                 i, pixels.data(), pixels.size()};
+    auto start = Clock::now();
+    analyser.analyse(Plane<const uint8_t>{pixels.data(), WIDTH, HEIGHT}, result);
+    analysisSeconds += std::chrono::duration<double>(Clock::now() - start).count();
+
+    // Either side can come first
+    start = Clock::now();
+    const int64_t pts = image.frame->pts();
+    if (i == unencodedFrame) {
+      dispatcher.frameAnalysed(raw, result, metadata);
+    } else if (i == unanalysedFrame) {
+      dispatcher.frameEncoded(pts, std::move(image));
+    } else if (i % 2 == 0) {
+      dispatcher.frameEncoded(pts, std::move(image));
+      dispatcher.frameAnalysed(raw, result, metadata);
+    } else {
+      dispatcher.frameAnalysed(raw, result, metadata);
+      dispatcher.frameEncoded(pts, std::move(image));
+    }
+    dispatchSeconds += std::chrono::duration<double>(Clock::now() - start).count();
+  }
+
+  const auto stats = dispatcher.stats();
+  // Except the frame the analysis never saw, which gets none
+  bool oneEach = true;
+  for (uint64_t i = 0; i < frames; i++) {
+    oneEach = oneEach && (messages[i] == ((i == unanalysedFrame) ? 0 : 1));
+  }
+  const std::vector<uint64_t> expectedFull{streakFrame, cloudFrame};
+  std::sort(fullFrames.begin(), fullFrames.end());
+  const bool fullOk = (fullFrames == expectedFull) &&
+    (streakFrames == std::vector<uint64_t>{streakFrame}) &&
+    (cloudFrames == std::vector<uint64_t>{cloudFrame});
+  const bool flashOk = (flashFrames == std::vector<uint64_t>{flashFrame}) &&
+    (cropsOnFlash == 1) && (crops == 1);
+  const double quietReduction = (quietBytes > 0)
+    ? static_cast<double>(sentIfNotEvents) / frames / (static_cast<double>(quietBytes) / quietFrames)
+    : 0.0;
+  const double reduction = static_cast<double>(sentIfNotEvents) / stats.bytes;
+  const bool accounted = (stats.analysed == frames - 1) &&
+    (stats.fullFrames == fullFrames.size()) && (stats.crops == crops) &&
+    (stats.framesSkipped == frames - 1 - fullFrames.size());
+  const bool ok = (bad == 0) && oneEach && fullOk && flashOk && accounted &&
+    (quietReduction >= MIN_REDUCTION) && (reduction >= MIN_REDUCTION);
+
+  printf("%u frames of %ux%u GRAY8, %zu bytes each; analysis %.1f ms, "
+         "dispatch %.3f ms per frame\n", frames, WIDTH, HEIGHT,
+         pixels.size(), analysisSeconds * 1e3 / frames,
+         dispatchSeconds * 1e3 / frames);
+  printf("last frame: %zu stars, %zu streaks, background %.1f +/- %.1f\n",
+         result.stars.size(), result.streaks.size(), result.background,
+         result.rms);
+  printf("one message per frame: %s; full frames:", oneEach ? "yes" : "NO");
+  for (auto sequence : fullFrames) {
+    printf(" %llu", static_cast<unsigned long long>(sequence));
+  }
+  printf(" (expected %llu for the streak, %llu for the clouds): %s\n",
+         static_cast<unsigned long long>(streakFrame),
+         static_cast<unsigned long long>(cloudFrame), fullOk ? "ok" : "BAD");
+  printf("flash in frame %llu: %u crops, %u on it: %s\n",
+         static_cast<unsigned long long>(flashFrame), crops, cropsOnFlash,
+         flashOk ? "ok" : "BAD");
+  printf("quiet frames: %.0f bytes each, %.0fx less than the frame: %s\n",
+         quietFrames > 0 ? static_cast<double>(quietBytes) / quietFrames : 0.0,
+         quietReduction, (quietReduction >= MIN_REDUCTION) ? "ok" : "BAD");
+  printf("overall: %llu bytes instead of %zu, %.1fx less: %s%s\n",
+         static_cast<unsigned long long>(stats.bytes), sentIfNotEvents,
+         reduction, (reduction >= MIN_REDUCTION) ? "ok" : "BAD",
+         accounted ? "" : " (stats don't add up: BAD)");
+  printf("%s\n", ok ? "all ok" : "BAD");
+  return ok ? 0 : 1;
+}
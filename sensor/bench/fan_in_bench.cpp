@@ -0,0 +1,255 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs several synthetic cameras, each in its own Pipeline with a different
+ * sensor mode and star field, into one ImageSender, which sends over
+ * loopback TCP to a receiver thread in this process.
+ *
+ * The receiver sorts frames by their metadata's sensor_id and checks that
+ * every sensor's frames all arrived, at that sensor's size. In the last run
+ * the pipelines compress (deflate, with delta frames) and the receiver decodes
+ * each sensor's frames with its own decoder, since delta frames only make
+ * sense against the same sensor's last frame.
+ *
+ * Reports frames/s and MB/s for each number of sensors from 1 up, so the
+ * cost of sharing the sender shows up as the count grows.
+ *
+ * USAGE: fan_in_bench [frames per sensor [sensors]]
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "payload_codec.hpp"
+#include "pipeline.hpp"
+#include "sensor_mode.hpp"
+#include "synthetic_frame_source.hpp"
+
+#include "picam.pb.h"
+
+#include "loopback.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+// Cycled through for each sensor; the small ones, to keep the run short
+static const SensorMode MODES[] = {SM_640x480, SM_1282x720, SM_1640x922};
+static const size_t NUM_MODES = sizeof(MODES) / sizeof(MODES[0]);
+
+/**
+ * What the receiver saw from one sensor.
+ */
+struct SensorReceived {
+  unsigned frames = 0;
+  unsigned wrongSize = 0;
+  unsigned undecodable = 0;
+  PayloadCodec::Decoder decoder;
+};
+
+struct Run {
+  bool compress = false;
+  std::map<uint32_t, SensorReceived> received;
+  uint64_t bytes = 0;
+  bool receiveError = false;
+};
+
+/**
+ * Accept one connection and sort the Image messages on it by sensor until
+ * it closes.
+ */
+static void receive(int listenFd, Run& run) {
+  int fd = accept(listenFd, nullptr, nullptr);
+  if (fd < 0) {
+    perror("accept");
+    run.receiveError = true;
+    return;
+  }
+
+  std::vector<uint8_t> buf;
+  Image image;
+  for (;;) {
+    const ImageRead read = readImage(fd, buf, image);
+    if (read != ImageRead::OK) {
+      run.receiveError = read != ImageRead::CLOSED;
+      break;
+    }
+    run.bytes += sizeof(uint32_t) + buf.size();
+
+    const uint32_t id = image.metadata().sensor_id();
+    SensorReceived& sensor = run.received[id];
+    sensor.frames++;
+    if (run.compress && !sensor.decoder.decode(image)) {
+      sensor.undecodable++;
+      continue;
+    }
+    const SensorMode mode = MODES[id % NUM_MODES];
+    const size_t pixels = static_cast<size_t>(SENSOR_MODE_WIDTH[mode]) *
+      SENSOR_MODE_HEIGHT[mode];
+    const size_t expected = run.compress ? pixels + pixels / 2 : pixels;
+    if ((static_cast<uint32_t>(image.metadata().width()) !=
+         SENSOR_MODE_WIDTH[mode]) ||
+        (static_cast<uint32_t>(image.metadata().height()) !=
+         SENSOR_MODE_HEIGHT[mode]) ||
+        (image.data().size() != expected)) {
+      sensor.wrongSize++;
+    }
+  }
+
+  close(fd);
+}
+
+/**
+ * Run frames from each of sensors pipelines through one sender and print
+ * what arrived.
+ */
+static bool benchSensors(unsigned sensors, unsigned frames, bool compress) {
+  int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  socklen_t addrLen = sizeof(addr);
+  if ((listenFd < 0) ||
+      (bind(listenFd, reinterpret_cast<struct sockaddr*>(&addr),
+            sizeof(addr)) != 0) ||
+      (listen(listenFd, 1) != 0) ||
+      (getsockname(listenFd, reinterpret_cast<struct sockaddr*>(&addr),
+                   &addrLen) != 0)) {
+    perror("listen");
+    return false;
+  }
+
+  Run run;
+  run.compress = compress;
+  std::thread receiver{receive, listenFd, std::ref(run)};
+
+  // As main sets it up: the same room for every sensor, and nothing
+  // dropped, so every frame can be accounted for
+  ImageSender::Config senderConfig{};
+  senderConfig.serverHostname = "127.0.0.1";
+  senderConfig.serverPort = ntohs(addr.sin_port);
+  senderConfig.queueCapacity = 4 * sensors;
+  senderConfig.overflowPolicy = ImageSender::OverflowPolicy::BLOCK;
+  auto sender = std::make_unique<ImageSender>(senderConfig);
+  if (!sender->connect() || !sender->start()) {
+    fprintf(stderr, "Failed to connect to the receiver\n");
+    // Wakes the receiver up if it's still waiting in accept()
+    shutdown(listenFd, SHUT_RDWR);
+    receiver.join();
+    close(listenFd);
+    return false;
+  }
+
+  Pipeline::Config pipelineConfig{};
+  pipelineConfig.scheduler.initialDelay = std::chrono::milliseconds{0};
+  pipelineConfig.scheduler.interval = std::chrono::milliseconds{0};
+  pipelineConfig.scheduler.settleTime = std::chrono::milliseconds{0};
+  pipelineConfig.frameCount = frames;
+  pipelineConfig.compress = compress;
+  pipelineConfig.codec.codec = PayloadCodec::Codec::DEFLATE;
+  pipelineConfig.codec.delta = true;
+  pipelineConfig.codec.keyInterval = 10;
+  // The encoder drops frames it has no room for; this bench wants them all
+  pipelineConfig.codec.queueCapacity = frames;
+
+  std::vector<std::unique_ptr<Pipeline>> pipelines;
+  for (unsigned i = 0; i < sensors; i++) {
+    pipelineConfig.sensorId = i;
+    auto pipeline = std::make_unique<Pipeline>(pipelineConfig, *sender);
+    SyntheticFrameSource::Config sourceConfig{};
+    sourceConfig.sensorMode = MODES[i % NUM_MODES];
+    sourceConfig.encoding = compress ? SyntheticFrameSource::Encoding::I420
+                                     : SyntheticFrameSource::Encoding::GRAY8;
+    // Deliver each requested frame as soon as it's rendered
+    sourceConfig.pacing.frameRate = 0.0;
+    sourceConfig.seed = i + 1;
+    pipeline->setSource(std::make_unique<SyntheticFrameSource>(sourceConfig));
+    pipelines.push_back(std::move(pipeline));
+  }
+
+  const auto start = Clock::now();
+  bool ok = true;
+  for (auto& pipeline : pipelines) {
+    ok = pipeline->start() && ok;
+  }
+  for (auto& pipeline : pipelines) {
+    ok = pipeline->wait() && ok;
+  }
+  sender->stop();
+  const auto stats = sender->stats();
+  // Closes the connection, so the receiver sees EOF
+  sender.reset();
+  receiver.join();
+  close(listenFd);
+  const double elapsed = seconds(Clock::now() - start);
+
+  unsigned total = 0;
+  for (unsigned i = 0; i < sensors; i++) {
+    const SensorReceived& sensor = run.received[i];
+    total += sensor.frames;
+    if ((sensor.frames != frames) || (sensor.wrongSize != 0) ||
+        (sensor.undecodable != 0)) {
+      fprintf(stderr, "sensor %u: received %u of %u frames, %u the wrong "
+              "size, %u undecodable\n", i, sensor.frames, frames,
+              sensor.wrongSize, sensor.undecodable);
+      ok = false;
+    }
+  }
+  if (run.received.size() != sensors) {
+    fprintf(stderr, "frames from %zu sensors, expected %u\n",
+            run.received.size(), sensors);
+    ok = false;
+  }
+  ok = ok && !run.receiveError && (stats.sendFailures == 0);
+
+  printf("%u sensor%s%s: %u frames in %.2f s, %.1f frames/s, %.1f MB/s "
+         "sent: %s\n", sensors, (sensors == 1) ? "" : "s",
+         compress ? ", compressed" : "", total, elapsed, total / elapsed,
+         run.bytes / elapsed / 1e6, ok ? "ok" : "BAD");
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  const unsigned frames = (argc > 1) ? atoi(argv[1]) : 30;
+  const unsigned maxSensors = (argc > 2) ? atoi(argv[2]) : 3;
+  if ((frames == 0) || (maxSensors == 0)) {
+    fprintf(stderr, "USAGE: %s [frames per sensor [sensors]]\n", argv[0]);
+    return 1;
+  }
+
+  bool ok = true;
+  for (unsigned sensors = 1; sensors <= maxSensors; sensors++) {
+    ok = benchSensors(sensors, frames, false) && ok;
+  }
+  if (PayloadCodec::available(PayloadCodec::Codec::DEFLATE)) {
+    ok = benchSensors(maxSensors, frames, true) && ok;
+  } else {
+    printf("compressed: skipped, built without deflate\n");
+  }
+
+  printf("%s\n", ok ? "all ok" : "FAILED");
+  return ok ? 0 : 1;
+}
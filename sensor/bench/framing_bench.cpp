@@ -0,0 +1,311 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compares the old send path (append buffers to a string, set_data(),
+ * SerializeToString(), two send() calls) against ImageFraming::writeImage()
+ * on frames assembled from encoder-sized buffers. Frames go over a local
+ * socketpair to a thread that throws the bytes away. Also checks that Images
+ * carrying detections (with and without data) frame the same as
+ * SerializeToString().
+ *
+ * USAGE: framing_bench [frames per mode]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "frame_assembler.hpp"
+#include "image_framing.hpp"
+#include "sensor_mode.hpp"
+
+#include "picam.pb.h"
+
+// Roughly what the image encoder's output port recommends
+static const size_t ENCODER_BUFFER_SIZE = 81920;
+
+struct Result {
+  uint64_t bytesCopied;
+  uint64_t syscalls;
+  double cpuSeconds;
+};
+
+static double threadCpuSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void fillMetadata(Image::Metadata& meta, unsigned width,
+                         unsigned height) {
+  meta.set_time_s(1546300800);
+  meta.set_time_us(123456);
+  meta.set_width(width);
+  meta.set_height(height);
+  meta.set_encoding("PNG");
+  meta.set_analog_gain(1.5f);
+  meta.set_digital_gain(1.0f);
+  meta.set_awb_gain_red(1.2f);
+  meta.set_awb_gain_blue(1.7f);
+  meta.set_iso(800);
+  meta.set_brightness(0.5f);
+  meta.set_shutter_speed(60000000);
+}
+
+/**
+ * The path main.cpp used to take: the encoder callback appends into a static
+ * string, which is copied into the message and then serialized.
+ */
+static Result legacySend(int fd, const std::string& encoded,
+                         const Image::Metadata& meta, std::string* wire) {
+  static std::string imageBuffer{};
+  Result result{};
+
+  double start = threadCpuSeconds();
+  for (size_t off = 0; off < encoded.size(); off += ENCODER_BUFFER_SIZE) {
+    size_t n = std::min(ENCODER_BUFFER_SIZE, encoded.size() - off);
+    size_t capacity = imageBuffer.capacity();
+    imageBuffer.append(encoded.data() + off, n);
+    result.bytesCopied += n;
+    if (imageBuffer.capacity() != capacity) {
+      // Growing moved everything that was already there
+      result.bytesCopied += imageBuffer.size() - n;
+    }
+  }
+
+  Image message{};
+  *message.mutable_metadata() = meta;
+  message.set_data(imageBuffer);
+  result.bytesCopied += imageBuffer.size();
+
+  std::string buffer{};
+  message.SerializeToString(&buffer);
+  result.bytesCopied += buffer.size();
+
+  uint32_t size = htonl(buffer.size());
+  ::send(fd, &size, sizeof(size), 0);
+  result.syscalls++;
+  size_t sent = 0;
+  while (sent < buffer.size()) {
+    ssize_t rc = ::send(fd, buffer.data() + sent, buffer.size() - sent, 0);
+    result.syscalls++;
+    if (rc < 0) {
+      perror("send");
+      exit(1);
+    }
+    sent += rc;
+  }
+  result.cpuSeconds = threadCpuSeconds() - start;
+
+  if (wire != nullptr) {
+    wire->assign(reinterpret_cast<const char*>(&size), sizeof(size));
+    wire->append(buffer);
+  }
+  imageBuffer.clear();
+  return result;
+}
+
+static Result framedSend(int fd, FrameAssembler& assembler,
+                         const std::string& encoded,
+                         const Image::Metadata& meta, std::string* wire) {
+  Result result{};
+
+  double start = threadCpuSeconds();
+  for (size_t off = 0; off < encoded.size(); off += ENCODER_BUFFER_SIZE) {
+    size_t n = std::min(ENCODER_BUFFER_SIZE, encoded.size() - off);
+    assembler.append(reinterpret_cast<const uint8_t*>(encoded.data()) + off,
+                     n);
+    result.bytesCopied += n;
+  }
+  FramePtr frame = assembler.finish();
+
+  ssize_t written = ImageFraming::writeImage(fd, meta, frame.get(),
+                                             &result.syscalls);
+  if (written < 0) {
+    exit(1);
+  }
+  // Only the header is copied in userspace
+  result.bytesCopied += written - frame->size();
+  result.cpuSeconds = threadCpuSeconds() - start;
+
+  if (wire != nullptr) {
+    uint8_t header[ImageFraming::MAX_HEADER_SIZE];
+    size_t headerSize = ImageFraming::encodeHeader(meta, frame->size(), header,
+                                                   sizeof(header));
+    wire->assign(reinterpret_cast<const char*>(header), headerSize);
+    for (const auto& chunk : frame->chunks()) {
+      wire->append(reinterpret_cast<const char*>(chunk.data), chunk.size);
+    }
+  }
+  return result;
+}
+
+/**
+ * Compare the framing of an Image with detections, and data of the given
+ * size, against SerializeToString().
+ */
+static bool detectionsIdentical(FrameAssembler& assembler,
+                                const Image::Metadata& meta,
+                                size_t dataSize) {
+  Detections detections{};
+  detections.set_sequence(1234);
+  detections.set_width(1640);
+  detections.set_height(1232);
+  detections.set_background(21.5f);
+  detections.set_background_rms(3.25f);
+  detections.set_star_count(417);
+  for (int i = 0; i < 20; i++) {
+    Detections::Star* star = detections.add_stars();
+    star->set_x(10.5f * i);
+    star->set_y(7.25f * i);
+    star->set_flux(1000 + 37 * i);
+    star->set_peak(200 - i);
+    star->set_area(9);
+  }
+  Detections::Streak* streak = detections.add_streaks();
+  streak->set_x0(100.0f);
+  streak->set_y0(200.0f);
+  streak->set_x1(900.0f);
+  streak->set_y1(250.0f);
+  streak->set_width(2.5f);
+  streak->set_brightness(80.0f);
+  detections.add_triggers(Detections::STREAK);
+
+  std::string data(dataSize, '\0');
+  unsigned seed = static_cast<unsigned>(dataSize);
+  for (auto& c : data) {
+    c = static_cast<char>(rand_r(&seed));
+  }
+
+  Image message{};
+  *message.mutable_metadata() = meta;
+  message.set_data(data);
+  *message.mutable_detections() = detections;
+  std::string expected{};
+  message.SerializeToString(&expected);
+  const uint32_t size = htonl(expected.size());
+  expected.insert(0, reinterpret_cast<const char*>(&size), sizeof(size));
+
+  assembler.append(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+  FramePtr frame = assembler.finish();
+  uint8_t header[ImageFraming::MAX_HEADER_SIZE];
+  size_t headerSize = ImageFraming::encodeHeader(meta, frame->size(), header,
+                                                 sizeof(header), &detections);
+  std::string wire(reinterpret_cast<const char*>(header), headerSize);
+  for (const auto& chunk : frame->chunks()) {
+    wire.append(reinterpret_cast<const char*>(chunk.data), chunk.size);
+  }
+  std::string trailer{};
+  ImageFraming::encodeTrailer(detections, trailer);
+  wire.append(trailer);
+  return wire == expected;
+}
+
+int main(int argc, char* argv[]) {
+  int framesPerMode = 20;
+  if (argc > 1) {
+    framesPerMode = std::atoi(argv[1]);
+    if (framesPerMode < 1) {
+      framesPerMode = 1;
+    }
+  }
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    perror("socketpair");
+    return 1;
+  }
+
+  std::thread sink{[fd = fds[1]] {
+    std::vector<char> buf(1 << 20);
+    while (read(fd, buf.data(), buf.size()) > 0) {
+    }
+  }};
+
+  FrameAssembler assembler{ENCODER_BUFFER_SIZE * 16, 4};
+
+  printf("%-10s %12s %14s %14s %10s %10s %10s %10s\n", "mode", "frame B",
+         "copied/old", "copied/new", "sys/old", "sys/new", "ms/old",
+         "ms/new");
+
+  bool identical = true;
+  for (int mode = SM_1920x1080; mode < NUM_SENSOR_MODES; mode++) {
+    unsigned width = SENSOR_MODE_WIDTH[mode];
+    unsigned height = SENSOR_MODE_HEIGHT[mode];
+    // About what a PNG of a noisy night sky comes out at
+    std::string encoded(static_cast<size_t>(width) * height * 3 / 2, '\0');
+    unsigned seed = mode;
+    for (auto& c : encoded) {
+      c = static_cast<char>(rand_r(&seed));
+    }
+
+    Image::Metadata meta{};
+    fillMetadata(meta, width, height);
+
+    std::string oldWire, newWire;
+    legacySend(fds[0], encoded, meta, &oldWire);
+    framedSend(fds[0], assembler, encoded, meta, &newWire);
+    identical = identical && (oldWire == newWire);
+
+    Result oldTotal{}, newTotal{};
+    for (int i = 0; i < framesPerMode; i++) {
+      Result r = legacySend(fds[0], encoded, meta, nullptr);
+      oldTotal.bytesCopied += r.bytesCopied;
+      oldTotal.syscalls += r.syscalls;
+      oldTotal.cpuSeconds += r.cpuSeconds;
+
+      r = framedSend(fds[0], assembler, encoded, meta, nullptr);
+      newTotal.bytesCopied += r.bytesCopied;
+      newTotal.syscalls += r.syscalls;
+      newTotal.cpuSeconds += r.cpuSeconds;
+    }
+
+    char name[16];
+    snprintf(name, sizeof(name), "%ux%u", width, height);
+    printf("%-10s %12zu %14.0f %14.0f %10.1f %10.1f %10.3f %10.3f\n", name,
+           encoded.size(),
+           static_cast<double>(oldTotal.bytesCopied) / framesPerMode,
+           static_cast<double>(newTotal.bytesCopied) / framesPerMode,
+           static_cast<double>(oldTotal.syscalls) / framesPerMode,
+           static_cast<double>(newTotal.syscalls) / framesPerMode,
+           oldTotal.cpuSeconds * 1e3 / framesPerMode,
+           newTotal.cpuSeconds * 1e3 / framesPerMode);
+  }
+
+  printf("wire bytes identical: %s\n", identical ? "yes" : "NO");
+
+  Image::Metadata meta{};
+  fillMetadata(meta, 1640, 1232);
+  const bool withDetections = detectionsIdentical(assembler, meta, 0) &&
+    detectionsIdentical(assembler, meta, 128 * 128);
+  printf("with detections, identical: %s\n", withDetections ? "yes" : "NO");
+  identical = identical && withDetections;
+
+  shutdown(fds[0], SHUT_WR);
+  sink.join();
+  close(fds[0]);
+  close(fds[1]);
+  return identical ? 0 : 1;
+}
@@ -0,0 +1,274 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks and times the H.264 streaming path without a camera:
+ *
+ * 1. Splits an Annex B stream into access units, fed in encoder-sized
+ *    buffers and again in tiny odd-sized ones so start codes straddle
+ *    buffer boundaries, and checks both give the same units.
+ * 2. Frames every unit with VideoFraming over a socketpair and parses it back
+ *    with StreamParser, checking the payloads add up to the original stream.
+ * 3. Starts the parser in the middle of a record, as a receiver joining a
+ *    live stream would, and checks it resyncs at the next keyframe.
+ *
+ * With no file, a synthetic 1080p30 stream at H264EncoderConfig's default
+ * bitrate is used (SPS/PPS before every IDR, two slices per picture), and
+ * the units are also checked against where the generator put them.
+ *
+ * USAGE: h264_stream_bench [stream.h264 [buffer_size]]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "h264_stream.hpp"
+#include "video_framing.hpp"
+
+#include "synthetic_h264.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+// Roughly what the video encoder's output port recommends
+static const size_t ENCODER_BUFFER_SIZE = 65536;
+
+// Length of the synthetic stream
+static const unsigned FPS = 30;
+static const unsigned SECONDS = 10;
+
+/**
+ * Split stream, appending bufferSize bytes at a time.
+ */
+static std::vector<H264::AccessUnit> split(const std::string& stream,
+                                           size_t bufferSize,
+                                           double* seconds) {
+  std::vector<H264::AccessUnit> units;
+  units.reserve(FPS * SECONDS);
+  AccessUnitSplitter splitter{ENCODER_BUFFER_SIZE * 16, 4,
+    [&units](H264::AccessUnit&& unit) {
+      units.push_back(std::move(unit));
+    }};
+
+  const auto start = Clock::now();
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(stream.data());
+  for (size_t off = 0; off < stream.size(); off += bufferSize) {
+    splitter.append(data + off, std::min(bufferSize, stream.size() - off));
+  }
+  splitter.endAccessUnit();
+  if (seconds != nullptr) {
+    *seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  }
+  return units;
+}
+
+static bool sameUnits(const std::vector<H264::AccessUnit>& a,
+                      const std::vector<H264::AccessUnit>& b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); i++) {
+    if ((a[i].keyframe != b[i].keyframe) || (a[i].config != b[i].config) ||
+        (frameBytes(*a[i].data) != frameBytes(*b[i].data))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  std::string stream;
+  std::vector<Unit> expected;
+  if (argc > 1) {
+    if (!readFile(argv[1], stream)) {
+      return 1;
+    }
+  } else {
+    stream = syntheticStream(expected, FPS * SECONDS);
+  }
+
+  size_t bufferSize = ENCODER_BUFFER_SIZE;
+  if (argc > 2) {
+    bufferSize = std::max(std::atoi(argv[2]), 1);
+  }
+
+  bool ok = true;
+
+  //
+  // 1. Splitting
+  //
+  double splitSeconds = 0.0;
+  auto units = split(stream, bufferSize, &splitSeconds);
+  auto unitsSmall = split(stream, 7, nullptr);
+  const bool boundariesOk = sameUnits(units, unitsSmall);
+  ok = ok && boundariesOk;
+
+  size_t keyframes = 0;
+  std::string joined;
+  joined.reserve(stream.size());
+  for (const auto& unit : units) {
+    keyframes += unit.keyframe ? 1 : 0;
+    joined += frameBytes(*unit.data);
+  }
+  const bool lossless = (joined == stream);
+  ok = ok && lossless;
+
+  bool matchesGenerator = true;
+  if (!expected.empty()) {
+    matchesGenerator = (units.size() == expected.size());
+    for (size_t i = 0; matchesGenerator && (i < units.size()); i++) {
+      matchesGenerator = (units[i].data->size() == expected[i].size) &&
+        (units[i].keyframe == expected[i].keyframe) &&
+        (units[i].config == expected[i].config);
+    }
+    ok = ok && matchesGenerator;
+  }
+
+  printf("stream: %zu bytes, %zu access units, %zu keyframes\n",
+         stream.size(), units.size(), keyframes);
+  printf("split: %.1f MB/s (%zu B buffers), %.1f us per unit\n",
+         stream.size() / splitSeconds / 1e6, bufferSize,
+         splitSeconds * 1e6 / std::max<size_t>(units.size(), 1));
+  printf("split lossless: %s, same units with 7 B buffers: %s",
+         lossless ? "yes" : "NO", boundariesOk ? "yes" : "NO");
+  if (!expected.empty()) {
+    printf(", matches generator: %s", matchesGenerator ? "yes" : "NO");
+  }
+  printf("\n");
+
+  //
+  // 2. Framing over a socket
+  //
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    perror("socketpair");
+    return 1;
+  }
+
+  std::string received;
+  uint64_t receivedRecords = 0;
+  std::thread receiver{[fd = fds[1], &received, &receivedRecords] {
+    VideoFraming::StreamParser parser{
+      [&received](const VideoFraming::RecordHeader& header,
+                  const uint8_t* payload) {
+        received.append(reinterpret_cast<const char*>(payload),
+                        header.payloadSize);
+      }};
+    std::vector<uint8_t> buf(1 << 16);
+    ssize_t n;
+    while ((n = read(fd, buf.data(), buf.size())) > 0) {
+      parser.feed(buf.data(), n);
+    }
+    receivedRecords = parser.records();
+  }};
+
+  uint64_t syscalls = 0;
+  size_t wireBytes = 0;
+  const auto sendStart = Clock::now();
+  for (size_t i = 0; i < units.size(); i++) {
+    const auto header = VideoFraming::headerFor(units[i], i);
+    ssize_t rc = VideoFraming::writeRecord(fds[0], header, units[i].data.get(),
+                                           &syscalls);
+    if (rc < 0) {
+      ok = false;
+      break;
+    }
+    wireBytes += rc;
+  }
+  shutdown(fds[0], SHUT_WR);
+  receiver.join();
+  const double sendSeconds =
+    std::chrono::duration<double>(Clock::now() - sendStart).count();
+  close(fds[0]);
+  close(fds[1]);
+
+  const bool framedOk = (received == stream) &&
+    (receivedRecords == units.size());
+  ok = ok && framedOk;
+  printf("framed: %.1f MB/s, %.2f%% overhead, %.2f syscalls per unit, "
+         "round trip: %s\n",
+         wireBytes / sendSeconds / 1e6,
+         100.0 * (wireBytes - stream.size()) / stream.size(),
+         static_cast<double>(syscalls) / std::max<size_t>(units.size(), 1),
+         framedOk ? "yes" : "NO");
+
+  //
+  // 3. Joining mid-stream
+  //
+  std::string wire;
+  std::vector<size_t> recordOffsets;
+  for (size_t i = 0; i < units.size(); i++) {
+    recordOffsets.push_back(wire.size());
+    uint8_t header[VideoFraming::HEADER_SIZE];
+    VideoFraming::encodeHeader(VideoFraming::headerFor(units[i], i), header);
+    wire.append(reinterpret_cast<const char*>(header), sizeof(header));
+    wire += frameBytes(*units[i].data);
+  }
+
+  const size_t joinAt = wire.size() / 3 + 5;
+  // The first unit a late receiver can use
+  size_t firstUsable = units.size();
+  for (size_t i = 0; i < units.size(); i++) {
+    if ((recordOffsets[i] >= joinAt) && units[i].keyframe) {
+      firstUsable = i;
+      break;
+    }
+  }
+
+  std::string late;
+  bool lateStartsAtKeyframe = true;
+  bool lateFirst = true;
+  VideoFraming::StreamParser lateParser{
+    [&](const VideoFraming::RecordHeader& header, const uint8_t* payload) {
+      if (lateFirst) {
+        lateStartsAtKeyframe = (header.flags & VideoFraming::KEYFRAME) &&
+          (header.sequence == firstUsable);
+        lateFirst = false;
+      }
+      late.append(reinterpret_cast<const char*>(payload), header.payloadSize);
+    }};
+  uint64_t rng = 42;
+  for (size_t off = joinAt; off < wire.size(); ) {
+    size_t n = std::min<size_t>(1 + nextRandom(rng) % 9000, wire.size() - off);
+    lateParser.feed(reinterpret_cast<const uint8_t*>(wire.data()) + off, n);
+    off += n;
+  }
+
+  bool lateOk = lateStartsAtKeyframe;
+  if (firstUsable < units.size()) {
+    size_t streamOffset = 0;
+    for (size_t i = 0; i < firstUsable; i++) {
+      streamOffset += units[i].data->size();
+    }
+    lateOk = lateOk && (late == stream.substr(streamOffset));
+  }
+  ok = ok && lateOk;
+  printf("mid-stream join: skipped %llu bytes and %llu records, "
+         "resumed at keyframe: %s\n",
+         static_cast<unsigned long long>(lateParser.skippedBytes()),
+         static_cast<unsigned long long>(lateParser.droppedRecords()),
+         lateOk ? "yes" : "NO");
+
+  return ok ? 0 : 1;
+}
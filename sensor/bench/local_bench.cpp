@@ -0,0 +1,497 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Compares ways of getting frames to readers on the same host:
+ *
+ * 1. TCP loopback, each reader with a connection of its own: the frame is
+ *    copied into the kernel once per reader, and out again by each one.
+ * 2. LocalTransport RING: copied once, into a shared-memory slot that every
+ *    reader reads in place.
+ * 3. LocalTransport FD: copied once, into a (reused) memfd that's passed
+ *    to every reader.
+ *
+ * Each sends the same big frames to two readers, which touch every page of
+ * what they get. Reports throughput per reader and CPU time (publisher and
+ * readers together) per frame.
+ *
+ * Then, through an ImageSender as the sensor uses it, checks that readers
+ * get every one of a run of frames of assorted sizes intact and in order,
+ * and that a reader that stops reading and goes away doesn't hold up the
+ * others for good.
+ *
+ * USAGE: local_bench [frame_size [frame_count]]
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "frame_assembler.hpp"
+#include "image_framing.hpp"
+#include "image_sender.hpp"
+#include "local_transport.hpp"
+#include "loopback.hpp"
+
+#include "picam.pb.h"
+
+using Clock = std::chrono::steady_clock;
+
+static const size_t READERS = 2;
+static const size_t PAGE_SIZE = 4096;
+static const size_t SLAB_SIZE = 81920 * 16;
+
+static double cpuSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static FramePtr makeFrame(FrameAssembler& assembler, uint32_t index,
+                          size_t size) {
+  std::vector<uint8_t> buffer(std::min<size_t>(size, SLAB_SIZE));
+  for (size_t offset = 0; offset < size;) {
+    const size_t n = std::min(buffer.size(), size - offset);
+    for (size_t i = 0; i < n; i++) {
+      buffer[i] = payloadByte(index, offset + i);
+    }
+    assembler.append(buffer.data(), n);
+    offset += n;
+  }
+  return assembler.finish();
+}
+
+static Image::Metadata frameMetadata(uint32_t index, size_t frameSize) {
+  Image::Metadata metadata{};
+  // time_s carries the size, so readers can check it
+  metadata.set_time_s(frameSize);
+  metadata.set_time_us(index);
+  metadata.set_encoding("RAW");
+  return metadata;
+}
+
+/**
+ * What a reader does with a frame it's not going to parse: look at every
+ * page of it.
+ */
+static uint64_t touch(const uint8_t* data, size_t size) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < size; i += PAGE_SIZE) {
+    sum += data[i];
+  }
+  return sum + data[size - 1];
+}
+
+/**
+ * Parse a framed Image and check its payload. Returns its index, or -1.
+ */
+static int64_t checkFramed(const uint8_t* data, size_t size) {
+  if (size < 4) {
+    return -1;
+  }
+  const uint32_t length = (static_cast<uint32_t>(data[0]) << 24) |
+    (data[1] << 16) | (data[2] << 8) | data[3];
+  Image image;
+  if ((length != size - 4) || !image.ParseFromArray(data + 4, length)) {
+    return -1;
+  }
+  const uint32_t index = image.metadata().time_us();
+  const std::string& payload = image.data();
+  if (payload.size() != static_cast<size_t>(image.metadata().time_s())) {
+    return -1;
+  }
+  for (size_t i = 0; i < payload.size(); i++) {
+    if (static_cast<uint8_t>(payload[i]) != payloadByte(index, i)) {
+      return -1;
+    }
+  }
+  return index;
+}
+
+struct Result {
+  double wall = 0.0;
+  double cpu = 0.0;
+  std::atomic<size_t> received[READERS] = {};
+
+  size_t least() const {
+    size_t n = received[0].load();
+    for (const auto& r : received) {
+      n = std::min(n, r.load());
+    }
+    return n;
+  }
+};
+
+static void printResult(const char* name, const Result& r, size_t frameCount,
+                        size_t frameSize) {
+  const size_t least = r.least();
+  printf("  %-16s %6.0f MB/s per reader, %6.1f ms CPU per frame, "
+         "%zu/%zu frames\n", name, least * frameSize / r.wall / 1e6,
+         r.cpu * 1e3 / frameCount, least, frameCount);
+}
+
+/**
+ * TCP loopback: a connection per reader, the frame written to each in turn.
+ */
+static void runTcp(const Image::Metadata& metadata, const Frame& frame,
+                   size_t frameCount, Result& result) {
+  int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addrLen = sizeof(addr);
+  if ((listenFd < 0) ||
+      (bind(listenFd, reinterpret_cast<struct sockaddr*>(&addr),
+            sizeof(addr)) != 0) ||
+      (listen(listenFd, READERS) != 0) ||
+      (getsockname(listenFd, reinterpret_cast<struct sockaddr*>(&addr),
+                   &addrLen) != 0)) {
+    perror("listen");
+    return;
+  }
+
+  std::vector<std::thread> readers;
+  for (size_t r = 0; r < READERS; r++) {
+    readers.emplace_back([&result, addr, r] {
+      int fd = socket(AF_INET, SOCK_STREAM, 0);
+      if (connect(fd, reinterpret_cast<const struct sockaddr*>(&addr),
+                  sizeof(addr)) != 0) {
+        close(fd);
+        return;
+      }
+      std::vector<uint8_t> buffer;
+      auto readAll = [fd](uint8_t* out, size_t size) {
+        for (size_t got = 0; got < size;) {
+          ssize_t rc = read(fd, out + got, size - got);
+          if (rc <= 0) {
+            return false;
+          }
+          got += rc;
+        }
+        return true;
+      };
+      for (;;) {
+        uint8_t prefix[4];
+        if (!readAll(prefix, sizeof(prefix))) {
+          break;
+        }
+        const uint32_t length = (static_cast<uint32_t>(prefix[0]) << 24) |
+          (prefix[1] << 16) | (prefix[2] << 8) | prefix[3];
+        buffer.resize(length);
+        if (!readAll(buffer.data(), length)) {
+          break;
+        }
+        touch(buffer.data(), buffer.size());
+        result.received[r]++;
+      }
+      close(fd);
+    });
+  }
+  std::vector<int> connections;
+  for (size_t r = 0; r < READERS; r++) {
+    connections.push_back(accept(listenFd, nullptr, nullptr));
+  }
+
+  const auto start = Clock::now();
+  const double cpuStart = cpuSeconds();
+  for (size_t i = 0; i < frameCount; i++) {
+    for (int fd : connections) {
+      ImageFraming::writeImage(fd, metadata, &frame);
+    }
+  }
+  for (int fd : connections) {
+    shutdown(fd, SHUT_WR);
+  }
+  for (auto& reader : readers) {
+    reader.join();
+  }
+  result.wall = seconds(Clock::now() - start);
+  result.cpu = cpuSeconds() - cpuStart;
+
+  for (int fd : connections) {
+    close(fd);
+  }
+  close(listenFd);
+}
+
+/**
+ * A LocalTransport publisher, and READERS subscribers in threads.
+ */
+static void runLocal(LocalTransport::Mode mode, const std::string& path,
+                     const Image::Metadata& metadata, const Frame& frame,
+                     size_t frameCount, Result& result) {
+  LocalTransport::Publisher::Config config{};
+  config.path = path;
+  config.mode = mode;
+  config.slotSize = frame.size() + 4096;
+  LocalTransport::Publisher publisher{config};
+  if (!publisher.open() || (publisher.mode() != mode)) {
+    fprintf(stderr, "Failed to open %s\n", path.c_str());
+    return;
+  }
+
+  std::atomic<bool> done{false};
+  std::vector<std::thread> readers;
+  for (size_t r = 0; r < READERS; r++) {
+    readers.emplace_back([&result, &done, &path, r] {
+      LocalTransport::Subscriber subscriber;
+      if (!subscriber.connect(path)) {
+        return;
+      }
+      auto callback = [&result, r](uint64_t, const uint8_t* data,
+                                   size_t size) {
+        touch(data, size);
+        result.received[r]++;
+      };
+      while (subscriber.receive(callback, std::chrono::milliseconds{20}) >= 0) {
+        if (done.load()) {
+          // One last look, for anything published just before
+          subscriber.receive(callback, std::chrono::milliseconds{0});
+          break;
+        }
+      }
+    });
+  }
+  if (!waitFor([&publisher] { return publisher.refreshReaders() == READERS; },
+               std::chrono::seconds{5})) {
+    fprintf(stderr, "Readers didn't connect\n");
+  }
+
+  const auto start = Clock::now();
+  const double cpuStart = cpuSeconds();
+  for (size_t i = 0; i < frameCount; i++) {
+    publisher.publish(metadata, &frame);
+  }
+  // Until they've read it all
+  waitFor([&result, frameCount] { return result.least() >= frameCount; },
+          std::chrono::seconds{10});
+  result.wall = seconds(Clock::now() - start);
+  result.cpu = cpuSeconds() - cpuStart;
+
+  done = true;
+  for (auto& reader : readers) {
+    reader.join();
+  }
+}
+
+/**
+ * Frames of assorted sizes through an ImageSender with a local transport,
+ * to READERS readers that parse and check each one.
+ */
+static bool integrityCheck(ImageSender::Transport transport,
+                           const std::string& path, const char* name) {
+  const size_t frameCount = 200;
+  ImageSender::Config config{};
+  config.transport = transport;
+  config.localPath = path;
+  config.localSlotSize = 1 << 20;
+  config.overflowPolicy = ImageSender::OverflowPolicy::BLOCK;
+  ImageSender sender{config};
+  if (!sender.connect() || !sender.start()) {
+    fprintf(stderr, "Failed to start the sender\n");
+    return false;
+  }
+
+  // Index 0 is a warm-up frame, sent until the readers are there
+  std::atomic<size_t> received[READERS] = {};
+  std::atomic<size_t> bad{0};
+  std::atomic<bool> done{false};
+  std::vector<std::thread> readers;
+  for (size_t r = 0; r < READERS; r++) {
+    readers.emplace_back([&, r] {
+      LocalTransport::Subscriber subscriber;
+      if (!subscriber.connect(path)) {
+        return;
+      }
+      int64_t last = 0;
+      auto callback = [&](uint64_t, const uint8_t* data, size_t size) {
+        const int64_t index = checkFramed(data, size);
+        if ((index < 0) || ((index > 0) && (index != last + 1))) {
+          bad++;
+        }
+        if (index > 0) {
+          last = index;
+          received[r]++;
+        }
+      };
+      while (!done.load() && (received[r].load() < frameCount)) {
+        if (subscriber.receive(callback, std::chrono::milliseconds{20}) < 0) {
+          break;
+        }
+      }
+    });
+  }
+
+  FrameAssembler assembler{SLAB_SIZE, 1};
+  auto warmUp = [&] {
+    QueuedImage image{};
+    image.metadata = frameMetadata(0, 0);
+    sender.enqueue(std::move(image));
+    std::this_thread::sleep_for(std::chrono::milliseconds{5});
+    return sender.stats().localReaders == READERS;
+  };
+  bool ok = waitFor(warmUp, std::chrono::seconds{5});
+  for (uint32_t index = 1; ok && (index <= frameCount); index++) {
+    // Up to most of a slot
+    const size_t size = (index * 7919u) % (900 << 10);
+    QueuedImage image{};
+    image.metadata = frameMetadata(index, size);
+    image.frame = makeFrame(assembler, index, size);
+    sender.enqueue(std::move(image));
+  }
+  ok = ok && waitFor([&] {
+    for (const auto& n : received) {
+      if (n.load() < frameCount) {
+        return false;
+      }
+    }
+    return true;
+  }, std::chrono::seconds{10});
+  done = true;
+  for (auto& reader : readers) {
+    reader.join();
+  }
+  sender.stop();
+
+  ok = ok && (bad.load() == 0);
+  printf("integrity (%s): %zu and %zu of %zu frames, %zu bad: %s\n", name,
+         received[0].load(), received[1].load(), frameCount, bad.load(),
+         ok ? "ok" : "BAD");
+  return ok;
+}
+
+/**
+ * A reader that stops reading holds on to every slot, so frames are dropped
+ * after the publisher's wait; once it goes away, the other reader gets
+ * everything again.
+ */
+static bool stalledReaderCheck(const std::string& path) {
+  LocalTransport::Publisher::Config config{};
+  config.path = path;
+  config.slotSize = 1 << 20;
+  config.waitTimeout = std::chrono::milliseconds{50};
+  LocalTransport::Publisher publisher{config};
+  if (!publisher.open()) {
+    return false;
+  }
+
+  std::atomic<size_t> received{0};
+  std::atomic<bool> done{false};
+  std::thread reader{[&] {
+    LocalTransport::Subscriber subscriber;
+    if (!subscriber.connect(path)) {
+      return;
+    }
+    auto callback = [&received](uint64_t, const uint8_t*, size_t) {
+      received++;
+    };
+    while (!done.load()) {
+      subscriber.receive(callback, std::chrono::milliseconds{5});
+    }
+  }};
+  auto stalled = std::make_unique<LocalTransport::Subscriber>();
+  std::thread stalledConnect{[&] { stalled->connect(path); }};
+  waitFor([&publisher] { return publisher.refreshReaders() == 2; },
+          std::chrono::seconds{5});
+  stalledConnect.join();
+
+  const Image::Metadata metadata = frameMetadata(0, 0);
+  const size_t before = 3 * config.slots;
+  for (size_t i = 0; i < before; i++) {
+    publisher.publish(metadata, nullptr);
+  }
+  const auto droppedWhileStalled = publisher.stats().dropped;
+
+  stalled.reset();
+  const size_t after = 3 * config.slots;
+  size_t publishedAfter = 0;
+  for (size_t i = 0; i < after; i++) {
+    publishedAfter += publisher.publish(metadata, nullptr) > 0;
+  }
+  waitFor([&] { return received.load() >= config.slots + after; },
+          std::chrono::seconds{2});
+  done = true;
+  reader.join();
+
+  const auto stats = publisher.stats();
+  const bool ok = (droppedWhileStalled == before - config.slots) &&
+    (publishedAfter == after) && (stats.readers == 1) &&
+    (received.load() == config.slots + after);
+  printf("stalled reader: %llu of %zu frames dropped while it held every "
+         "slot, %zu of %zu published after it left, the other got %zu: %s\n",
+         static_cast<unsigned long long>(droppedWhileStalled), before,
+         publishedAfter, after, received.load(), ok ? "ok" : "BAD");
+  return ok;
+}
+
+int main(int argc, char* argv[]) {
+  size_t frameSize = 15000000;
+  size_t frameCount = 30;
+  if (argc > 1) {
+    frameSize = std::max(std::atoi(argv[1]), 1);
+  }
+  if (argc > 2) {
+    frameCount = std::max(std::atoi(argv[2]), 1);
+  }
+
+  char dir[] = "/tmp/local_benchXXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    perror("mkdtemp");
+    return 1;
+  }
+  const std::string path = std::string{dir} + "/sensor.sock";
+
+  FrameAssembler assembler{SLAB_SIZE, 1};
+  const Image::Metadata metadata = frameMetadata(1, frameSize);
+  FramePtr frame = makeFrame(assembler, 1, frameSize);
+
+  printf("%.1f MB frames x %zu to %zu readers:\n", frameSize / 1e6,
+         frameCount, READERS);
+  Result tcp, ring, fds;
+  runTcp(metadata, *frame, frameCount, tcp);
+  printResult("tcp loopback", tcp, frameCount, frameSize);
+  runLocal(LocalTransport::Mode::RING, path, metadata, *frame, frameCount,
+           ring);
+  printResult("shm ring", ring, frameCount, frameSize);
+  runLocal(LocalTransport::Mode::FD, path, metadata, *frame, frameCount, fds);
+  printResult("memfd passing", fds, frameCount, frameSize);
+
+  bool ok = (tcp.least() == frameCount) && (ring.least() == frameCount) &&
+    (fds.least() == frameCount) && (ring.cpu < tcp.cpu) && (fds.cpu < tcp.cpu);
+
+  ok = integrityCheck(ImageSender::Transport::SHM_RING, path, "ring") && ok;
+  ok = integrityCheck(ImageSender::Transport::UNIX_FD, path, "fds") && ok;
+  ok = stalledReaderCheck(path) && ok;
+
+  rmdir(dir);
+  printf("%s\n", ok ? "all ok" : "BAD");
+  return ok ? 0 : 1;
+}
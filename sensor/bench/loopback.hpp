@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Fixtures for the benchmarks that send frames to themselves: payloads the
+ * receiving end can check byte by byte, reading the length-prefixed Image
+ * messages ImageSender sends, a loopback TCP listener that takes connections
+ * one at a time and can be killed mid-frame, and waiting on a condition.
+ */
+
+#ifndef BENCH_LOOPBACK_HPP
+#define BENCH_LOOPBACK_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "picam.pb.h"
+
+/**
+ * Byte i of frame index's payload, so the receiver can check it.
+ */
+static inline uint8_t payloadByte(uint32_t index, size_t i) {
+  return static_cast<uint8_t>(index * 31 + i * 7 + (i >> 8));
+}
+
+static inline double seconds(std::chrono::steady_clock::duration d) {
+  return std::chrono::duration<double>(d).count();
+}
+
+/**
+ * Poll done() until it's true or timeout runs out.
+ *
+ * @return whether done() came true.
+ */
+static inline bool waitFor(const std::function<bool()>& done,
+                           std::chrono::seconds timeout) {
+  const auto deadline = std::chrono::steady_clock::now() + timeout;
+  while (!done()) {
+    if (std::chrono::steady_clock::now() > deadline) {
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds{1});
+  }
+  return true;
+}
+
+/**
+ * Read exactly size bytes, or fail on EOF or an error.
+ *
+ * @param firstByte If not null, set to when the first of them arrived.
+ */
+static inline bool readFully(int fd, uint8_t* buf, size_t size,
+                             std::chrono::steady_clock::time_point* firstByte =
+                               nullptr) {
+  size_t got = 0;
+  while (got < size) {
+    ssize_t rc = read(fd, buf + got, size - got);
+    if (rc <= 0) {
+      return false;
+    }
+    if ((got == 0) && (firstByte != nullptr)) {
+      *firstByte = std::chrono::steady_clock::now();
+    }
+    got += rc;
+  }
+  return true;
+}
+
+enum class ImageRead {
+  // image holds the next message
+  OK,
+  // The connection closed between messages
+  CLOSED,
+  // The connection closed partway through a message
+  CUT_OFF,
+  // A whole message arrived, but doesn't parse
+  CORRUPT,
+};
+
+/**
+ * Read the next Image message, with its big-endian length prefix. The
+ * serialised message is left in buf.
+ *
+ * @param firstByte If not null, set to when the prefix started arriving.
+ * @param lastByte If not null, set to when the message was all in, before
+ *   it's parsed.
+ */
+static inline ImageRead readImage(int fd, std::vector<uint8_t>& buf,
+                                  Image& image,
+                                  std::chrono::steady_clock::time_point*
+                                    firstByte = nullptr,
+                                  std::chrono::steady_clock::time_point*
+                                    lastByte = nullptr) {
+  uint8_t prefix[4];
+  if (!readFully(fd, prefix, sizeof(prefix), firstByte)) {
+    return ImageRead::CLOSED;
+  }
+  const uint32_t size = (prefix[0] << 24) | (prefix[1] << 16) |
+    (prefix[2] << 8) | prefix[3];
+  buf.resize(size);
+  if (!readFully(fd, buf.data(), size)) {
+    return ImageRead::CUT_OFF;
+  }
+  if (lastByte != nullptr) {
+    *lastByte = std::chrono::steady_clock::now();
+  }
+  if (!image.ParseFromArray(buf.data(), static_cast<int>(size))) {
+    return ImageRead::CORRUPT;
+  }
+  return ImageRead::OK;
+}
+
+/**
+ * Accepts connections one at a time on a loopback port, and hands each to a
+ * handler on the listener's own thread.
+ */
+class LoopbackListener {
+  public:
+    /**
+     * Serves one connection until it closes or fails. The listener closes
+     * fd afterwards.
+     */
+    typedef std::function<void(int fd)> Handler;
+
+    /**
+     * @param port Port to listen on; 0 for any, which port() then tells.
+     */
+    LoopbackListener(uint16_t port, Handler handler)
+      : mPort{port}
+      , mHandler{std::move(handler)}
+      , mListenFd{-1}
+      , mConnFd{-1}
+      , mThread{}
+      , mMutex{}
+      , mConnections{0}
+    { }
+
+    ~LoopbackListener() {
+      kill();
+    }
+
+    LoopbackListener(const LoopbackListener&) = delete;
+    LoopbackListener& operator=(const LoopbackListener&) = delete;
+
+    uint16_t port() const {
+      return mPort;
+    }
+
+    unsigned connections() const {
+      return mConnections;
+    }
+
+    bool start() {
+      mListenFd = socket(AF_INET, SOCK_STREAM, 0);
+      int one = 1;
+      setsockopt(mListenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      struct sockaddr_in addr{};
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      addr.sin_port = htons(mPort);
+      socklen_t addrLen = sizeof(addr);
+      if ((mListenFd < 0) ||
+          (bind(mListenFd, reinterpret_cast<struct sockaddr*>(&addr),
+                sizeof(addr)) != 0) ||
+          (listen(mListenFd, 1) != 0) ||
+          (getsockname(mListenFd, reinterpret_cast<struct sockaddr*>(&addr),
+                       &addrLen) != 0)) {
+        perror("listen");
+        return false;
+      }
+      mPort = ntohs(addr.sin_port);
+      mThread = std::thread{&LoopbackListener::run, this};
+      return true;
+    }
+
+    /**
+     * Stop listening and drop the connection, unread data and all.
+     */
+    void kill() {
+      if (mListenFd < 0) {
+        return;
+      }
+      shutdown(mListenFd, SHUT_RDWR);
+      {
+        std::lock_guard<std::mutex> lock{mMutex};
+        if (mConnFd >= 0) {
+          shutdown(mConnFd, SHUT_RDWR);
+        }
+      }
+      mThread.join();
+      close(mListenFd);
+      mListenFd = -1;
+    }
+
+  private:
+    void run() {
+      for (;;) {
+        int fd = accept(mListenFd, nullptr, nullptr);
+        if (fd < 0) {
+          return;
+        }
+        {
+          std::lock_guard<std::mutex> lock{mMutex};
+          mConnFd = fd;
+        }
+        mConnections++;
+        mHandler(fd);
+        {
+          std::lock_guard<std::mutex> lock{mMutex};
+          mConnFd = -1;
+        }
+        close(fd);
+      }
+    }
+
+    uint16_t mPort;
+    const Handler mHandler;
+    int mListenFd;
+    int mConnFd;
+    std::thread mThread;
+    // Guards mConnFd, which kill() shuts down from another thread
+    std::mutex mMutex;
+    std::atomic<unsigned> mConnections;
+};
+
+#endif // BENCH_LOOPBACK_HPP
@@ -0,0 +1,411 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Drives the sensor pipeline end to end with synthetic frames: the capture
+ * scheduler requests a frame, the synthetic source renders and assembles it,
+ * the frame callback fills in metadata and enqueues it, and ImageSender sends
+ * it over loopback TCP to a receiver thread in this process that parses each
+ * Image message.
+ *
+ * For every SensorMode, reports throughput, per-stage latency percentiles,
+ * CPU time, bytes copied, heap allocations and syscalls per frame as JSON on
+ * stdout, so runs can be diffed between commits.
+ *
+ * Stages:
+ * - produce: capture requested -> frame callback (render, encode, assemble)
+ * - metadata: fillImageMetadata()
+ * - schedule: CaptureScheduler::frameCaptured(), which may request the next
+ *   frame
+ * - enqueue: ImageSender::enqueue()
+ * - queue: handed to enqueue() -> first byte at the receiver (the sender
+ *   thread may pick a frame up before enqueue() returns)
+ * - transfer: first byte -> last byte at the receiver
+ * - end_to_end: capture requested -> last byte at the receiver
+ *
+ * USAGE: pipeline_bench [frames per mode [encoding]]
+ *   encoding is one of GRAY8, I420, RGB24, PNG (default PNG)
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "capture_scheduler.hpp"
+#include "image_metadata.hpp"
+#include "image_sender.hpp"
+#include "sensor_mode.hpp"
+#include "synthetic_frame_source.hpp"
+
+#include "picam.pb.h"
+
+#include "allocations.hpp"
+#include "loopback.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+enum Stage {
+  PRODUCE,
+  METADATA,
+  SCHEDULE,
+  ENQUEUE,
+  QUEUE,
+  TRANSFER,
+  END_TO_END,
+  NUM_STAGES,
+};
+
+static const char* STAGE_NAMES[NUM_STAGES] = {
+  "produce",
+  "metadata",
+  "schedule",
+  "enqueue",
+  "queue",
+  "transfer",
+  "end_to_end",
+};
+
+/**
+ * Timestamps for one frame, filled in as it moves down the pipeline.
+ */
+struct FrameTimes {
+  Clock::time_point requested;
+  Clock::time_point callback;
+  Clock::time_point metadataDone;
+  Clock::time_point scheduled;
+  Clock::time_point enqueued;
+  Clock::time_point firstByte;
+  Clock::time_point lastByte;
+};
+
+/**
+ * State shared between the scheduler trigger, the frame callback and the
+ * receiver. Frames are indexed in capture order; the sender uses the BLOCK
+ * policy, so they arrive in the same order.
+ */
+struct Run {
+  std::vector<FrameTimes> times;
+  std::atomic<size_t> requested{0};
+  std::atomic<size_t> captured{0};
+  std::atomic<size_t> received{0};
+  std::atomic<uint64_t> frameBytes{0};
+  std::atomic<bool> receiveError{false};
+  double receiverCpuSeconds = 0.0;
+};
+
+static double processCpuSeconds() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 +
+    usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+}
+
+static double threadCpuSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double elapsedUs(Clock::time_point from, Clock::time_point to) {
+  return std::chrono::duration<double, std::micro>(to - from).count();
+}
+
+/**
+ * Accept one connection and time the Image messages on it until it closes.
+ */
+static void receive(int listenFd, Run& run) {
+  tCountAllocations = false;
+  const double cpuStart = threadCpuSeconds();
+
+  int fd = accept(listenFd, nullptr, nullptr);
+  if (fd < 0) {
+    perror("accept");
+    run.receiveError = true;
+    return;
+  }
+
+  std::vector<uint8_t> buf;
+  Image image;
+  for (;;) {
+    Clock::time_point firstByte, lastByte;
+    const ImageRead read = readImage(fd, buf, image, &firstByte, &lastByte);
+    if (read != ImageRead::OK) {
+      run.receiveError = read != ImageRead::CLOSED;
+      break;
+    }
+
+    size_t index = run.received++;
+    if (index < run.times.size()) {
+      run.times[index].firstByte = firstByte;
+      run.times[index].lastByte = lastByte;
+    }
+  }
+
+  close(fd);
+  run.receiverCpuSeconds = threadCpuSeconds() - cpuStart;
+}
+
+struct Percentiles {
+  double p50;
+  double p99;
+  double p999;
+  double max;
+};
+
+static Percentiles percentiles(std::vector<double> samples) {
+  Percentiles p{};
+  if (samples.empty()) {
+    return p;
+  }
+  std::sort(samples.begin(), samples.end());
+  auto at = [&samples](double q) {
+    size_t i = static_cast<size_t>(q * (samples.size() - 1) + 0.5);
+    return samples[std::min(i, samples.size() - 1)];
+  };
+  p.p50 = at(0.50);
+  p.p99 = at(0.99);
+  p.p999 = at(0.999);
+  p.max = samples.back();
+  return p;
+}
+
+static bool parseEncoding(const char* name,
+                          SyntheticFrameSource::Encoding& encoding) {
+  const SyntheticFrameSource::Encoding all[] = {
+    SyntheticFrameSource::Encoding::GRAY8,
+    SyntheticFrameSource::Encoding::I420,
+    SyntheticFrameSource::Encoding::RGB24,
+    SyntheticFrameSource::Encoding::PNG,
+  };
+  for (auto e : all) {
+    if (SyntheticFrameSource::encodingName(e) == name) {
+      encoding = e;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Run frameCount frames of one sensor mode through the pipeline and print its
+ * JSON object.
+ */
+static bool benchMode(SensorMode mode, SyntheticFrameSource::Encoding encoding,
+                      int frameCount, bool first) {
+  int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  socklen_t addrLen = sizeof(addr);
+  if ((listenFd < 0) ||
+      (bind(listenFd, reinterpret_cast<struct sockaddr*>(&addr),
+            sizeof(addr)) != 0) ||
+      (listen(listenFd, 1) != 0) ||
+      (getsockname(listenFd, reinterpret_cast<struct sockaddr*>(&addr),
+                   &addrLen) != 0)) {
+    perror("listen");
+    return false;
+  }
+
+  Run run;
+  run.times.resize(frameCount);
+  std::thread receiver{receive, listenFd, std::ref(run)};
+
+  ImageSender::Config senderConfig{};
+  senderConfig.serverHostname = "127.0.0.1";
+  senderConfig.serverPort = ntohs(addr.sin_port);
+  senderConfig.queueCapacity = 4;
+  senderConfig.overflowPolicy = ImageSender::OverflowPolicy::BLOCK;
+  auto pSender = std::make_unique<ImageSender>(senderConfig);
+  ImageSender& sender = *pSender;
+  if (!sender.connect() || !sender.start()) {
+    fprintf(stderr, "Failed to connect to the receiver\n");
+    // Wakes the receiver up if it's still waiting in accept()
+    shutdown(listenFd, SHUT_RDWR);
+    receiver.join();
+    close(listenFd);
+    return false;
+  }
+
+  SyntheticFrameSource::Config sourceConfig{};
+  sourceConfig.sensorMode = mode;
+  sourceConfig.encoding = encoding;
+  // Deliver each requested frame as soon as it's rendered
+  sourceConfig.pacing.frameRate = 0.0;
+  SyntheticFrameSource source{sourceConfig};
+
+  CaptureScheduler::Config schedulerConfig{};
+  schedulerConfig.initialDelay = std::chrono::milliseconds{0};
+  schedulerConfig.interval = std::chrono::milliseconds{0};
+  schedulerConfig.settleTime = std::chrono::milliseconds{0};
+  CaptureScheduler scheduler{schedulerConfig, [&run, &source, frameCount] {
+    size_t index = run.requested++;
+    if (index < static_cast<size_t>(frameCount)) {
+      run.times[index].requested = Clock::now();
+    }
+    return source.requestCapture();
+  }};
+
+  // Same steps as the encoder callback in main.cpp
+  auto callback = [&run, &sender, &scheduler, frameCount]
+    (FrameSource& frameSource, const FramePtr& frame) -> size_t {
+    size_t index = run.captured++;
+    FrameTimes* times = (index < static_cast<size_t>(frameCount))
+      ? &run.times[index] : nullptr;
+    if (times != nullptr) {
+      times->callback = Clock::now();
+    }
+
+    QueuedImage image{};
+    fillImageMetadata(image.metadata, frameSource);
+    image.frame = frame;
+    if (times != nullptr) {
+      times->metadataDone = Clock::now();
+    }
+
+    scheduler.frameCaptured();
+    run.frameBytes += frame->size();
+    if (times != nullptr) {
+      times->scheduled = Clock::now();
+    }
+    sender.enqueue(std::move(image));
+    if (times != nullptr) {
+      times->enqueued = Clock::now();
+    }
+    return frame->size();
+  };
+
+  const uint64_t allocationsStart = gAllocations.load();
+  const double cpuStart = processCpuSeconds();
+  const auto wallStart = Clock::now();
+
+  bool ok = source.start(callback) && scheduler.run(frameCount);
+  source.stop();
+  sender.stop();
+  const auto stats = sender.stats();
+  // Closes the connection, so the receiver sees EOF
+  pSender.reset();
+
+  receiver.join();
+  close(listenFd);
+  const auto wallEnd = Clock::now();
+  const double cpuSeconds = processCpuSeconds() - cpuStart -
+    run.receiverCpuSeconds;
+  const uint64_t allocations = gAllocations.load() - allocationsStart;
+
+  ok = ok && !run.receiveError &&
+    (run.received == static_cast<size_t>(frameCount));
+  if (!ok) {
+    fprintf(stderr, "%ux%u: received %zu of %d frames\n",
+            SENSOR_MODE_WIDTH[mode], SENSOR_MODE_HEIGHT[mode],
+            run.received.load(), frameCount);
+    return false;
+  }
+
+  std::vector<double> samples[NUM_STAGES];
+  for (const auto& t : run.times) {
+    samples[PRODUCE].push_back(elapsedUs(t.requested, t.callback));
+    samples[METADATA].push_back(elapsedUs(t.callback, t.metadataDone));
+    samples[SCHEDULE].push_back(elapsedUs(t.metadataDone, t.scheduled));
+    samples[ENQUEUE].push_back(elapsedUs(t.scheduled, t.enqueued));
+    samples[QUEUE].push_back(elapsedUs(t.scheduled, t.firstByte));
+    samples[TRANSFER].push_back(elapsedUs(t.firstByte, t.lastByte));
+    samples[END_TO_END].push_back(elapsedUs(t.requested, t.lastByte));
+  }
+
+  const double wallSeconds =
+    std::chrono::duration<double>(wallEnd - wallStart).count();
+  const double frames = frameCount;
+  const double frameBytes = run.frameBytes.load() / frames;
+  // The assembler copies each frame once; beyond that only the hand-encoded
+  // header is written in userspace, the frame goes out by scatter/gather
+  const double headerBytes = (stats.bytesSent - run.frameBytes.load()) / frames;
+
+  printf("%s    {\n", first ? "" : ",\n");
+  printf("      \"mode\": \"%ux%u\",\n", SENSOR_MODE_WIDTH[mode],
+         SENSOR_MODE_HEIGHT[mode]);
+  printf("      \"sensor_mode\": %d,\n", static_cast<int>(mode));
+  printf("      \"frames\": %d,\n", frameCount);
+  printf("      \"frame_bytes\": %.0f,\n", frameBytes);
+  printf("      \"wall_s\": %.6f,\n", wallSeconds);
+  printf("      \"frames_per_s\": %.3f,\n", frames / wallSeconds);
+  printf("      \"mb_per_s\": %.3f,\n",
+         stats.bytesSent / wallSeconds / (1024.0 * 1024.0));
+  printf("      \"cpu_ms_per_frame\": %.3f,\n", cpuSeconds * 1e3 / frames);
+  printf("      \"bytes_copied_per_frame\": %.0f,\n", frameBytes + headerBytes);
+  printf("      \"allocations_per_frame\": %.2f,\n", allocations / frames);
+  printf("      \"syscalls_per_frame\": %.2f,\n", stats.syscalls / frames);
+  printf("      \"latency_us\": {\n");
+  for (int stage = 0; stage < NUM_STAGES; stage++) {
+    const Percentiles p = percentiles(samples[stage]);
+    printf("        \"%s\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, "
+           "\"max\": %.1f}%s\n", STAGE_NAMES[stage], p.p50, p.p99, p.p999,
+           p.max, (stage + 1 < NUM_STAGES) ? "," : "");
+  }
+  printf("      }\n");
+  printf("    }");
+  fflush(stdout);
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  int framesPerMode = 20;
+  if (argc > 1) {
+    framesPerMode = std::max(std::atoi(argv[1]), 1);
+  }
+
+  auto encoding = SyntheticFrameSource::Encoding::PNG;
+  if ((argc > 2) && !parseEncoding(argv[2], encoding)) {
+    fprintf(stderr, "Unknown encoding %s\n", argv[2]);
+    return 1;
+  }
+
+  printf("{\n");
+  printf("  \"benchmark\": \"pipeline\",\n");
+  printf("  \"encoding\": \"%s\",\n",
+         SyntheticFrameSource::encodingName(encoding).c_str());
+  printf("  \"frames_per_mode\": %d,\n", framesPerMode);
+  printf("  \"modes\": [\n");
+
+  bool ok = true;
+  bool first = true;
+  for (int mode = SM_1920x1080; mode < NUM_SENSOR_MODES; mode++) {
+    if (!benchMode(static_cast<SensorMode>(mode), encoding, framesPerMode,
+                   first)) {
+      ok = false;
+      break;
+    }
+    first = false;
+  }
+
+  printf("\n  ]\n");
+  printf("}\n");
+  return ok ? 0 : 1;
+}
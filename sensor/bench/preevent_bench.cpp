@@ -0,0 +1,235 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Checks and times PreEventBuffer without a camera: plays an H.264 stream
+ * into the buffer at 30 fps (by PTS), and at several points along the way
+ * pulls out the last N seconds and checks the clip
+ *
+ * - starts at an IDR, with parameter sets,
+ * - starts at the latest IDR that covers N seconds, or the oldest IDR still
+ *   buffered if none does,
+ * - is the original units, byte for byte, up to the newest one,
+ *
+ * and that push() never allocated.
+ *
+ * With no file, a synthetic 1080p30 stream at H264EncoderConfig's default
+ * bitrate is used.
+ *
+ * USAGE: preevent_bench [stream.h264 [buffer_seconds]]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "h264_stream.hpp"
+#include "preevent_buffer.hpp"
+
+#include "allocations.hpp"
+#include "synthetic_h264.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+static const size_t ENCODER_BUFFER_SIZE = 65536;
+
+static const unsigned FPS = 30;
+static const unsigned SECONDS = 30;
+
+// Clip lengths to ask for, in seconds
+static const unsigned CLIP_SECONDS[] = {0, 1, 3, 5, 10, 20};
+
+static int64_t ptsFor(size_t index) {
+  return static_cast<int64_t>(index) * 1000000 / FPS;
+}
+
+/**
+ * Check a clip of the last clipSeconds, taken just after units[newest] was
+ * pushed, when the oldest unit still buffered was units[oldest].
+ */
+static bool checkClip(const std::vector<H264::AccessUnit>& units,
+                      size_t oldest, size_t newest, unsigned clipSeconds,
+                      const std::vector<H264::AccessUnit>& clip) {
+  // Where the clip should start
+  const int64_t cutoff = ptsFor(newest) - clipSeconds * 1000000LL;
+  size_t expected = units.size();
+  for (size_t i = oldest; i <= newest; i++) {
+    if (!units[i].keyframe) {
+      continue;
+    }
+    if ((ptsFor(i) <= cutoff) || (expected == units.size())) {
+      expected = i;
+    }
+    if (ptsFor(i) > cutoff) {
+      break;
+    }
+  }
+
+  if (clip.empty()) {
+    return expected == units.size();
+  }
+
+  // Parameter sets first, either in the keyframe or just in front of it
+  size_t first = 0;
+  if (clip[0].config && !clip[0].hasPicture) {
+    first = 1;
+  }
+  if ((first >= clip.size()) || !clip[first].keyframe ||
+      !(clip[0].config || clip[first].config)) {
+    fprintf(stderr, "clip of %us at %zu doesn't start with an IDR\n",
+            clipSeconds, newest);
+    return false;
+  }
+
+  const size_t start = newest + 1 - (clip.size() - first);
+  if (start != expected) {
+    fprintf(stderr, "clip of %us at %zu starts at %zu, expected %zu\n",
+            clipSeconds, newest, start, expected);
+    return false;
+  }
+  for (size_t i = first; i < clip.size(); i++) {
+    const auto& unit = units[start + i - first];
+    if ((clip[i].ptsUs != unit.ptsUs) ||
+        (frameBytes(*clip[i].data) != frameBytes(*unit.data))) {
+      fprintf(stderr, "clip of %us at %zu differs at unit %zu\n",
+              clipSeconds, newest, start + i - first);
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  std::string stream;
+  if (argc > 1) {
+    if (!readFile(argv[1], stream)) {
+      return 1;
+    }
+  } else {
+    std::vector<Unit> generated;
+    stream = syntheticStream(generated, FPS * SECONDS);
+  }
+
+  PreEventBuffer::Config config{};
+  if (argc > 2) {
+    config.seconds = std::max(std::atof(argv[2]), 0.1);
+  }
+  config.frameRate = FPS;
+
+  std::vector<H264::AccessUnit> units;
+  AccessUnitSplitter splitter{ENCODER_BUFFER_SIZE * 16, 4,
+    [&units](H264::AccessUnit&& unit) {
+      unit.ptsUs = ptsFor(units.size());
+      units.push_back(std::move(unit));
+    }};
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(stream.data());
+  for (size_t off = 0; off < stream.size(); off += ENCODER_BUFFER_SIZE) {
+    splitter.append(data + off,
+                    std::min(ENCODER_BUFFER_SIZE, stream.size() - off));
+  }
+  splitter.endAccessUnit();
+  if (units.empty()) {
+    fprintf(stderr, "no access units in stream\n");
+    return 1;
+  }
+
+  // Take clips early on (before anything's been evicted), partway through,
+  // and at the end
+  std::vector<size_t> triggers = {
+    std::min<size_t>(FPS * 3 + 7, units.size() - 1),
+    units.size() / 2,
+    units.size() * 4 / 5 + 13,
+    units.size() - 1,
+  };
+  for (auto& trigger : triggers) {
+    trigger = std::min(trigger, units.size() - 1);
+  }
+
+  PreEventBuffer buffer{config};
+  FrameAssembler assembler{ENCODER_BUFFER_SIZE * 16, 4};
+
+  bool ok = true;
+  uint64_t pushAllocations = 0;
+  double pushSeconds = 0.0;
+  double extractSeconds = 0.0;
+  size_t clips = 0;
+  size_t clipUnits = 0;
+  size_t bytes = 0;
+  for (size_t i = 0; i < units.size(); i++) {
+    const uint64_t allocationsStart = gAllocations.load();
+    const auto pushStart = Clock::now();
+    buffer.push(units[i]);
+    pushSeconds +=
+      std::chrono::duration<double>(Clock::now() - pushStart).count();
+    pushAllocations += gAllocations.load() - allocationsStart;
+    bytes += units[i].data->size();
+
+    if (std::find(triggers.begin(), triggers.end(), i) == triggers.end()) {
+      continue;
+    }
+
+    const auto stats = buffer.stats();
+    const size_t oldest = i + 1 - stats.units;
+    for (unsigned clipSeconds : CLIP_SECONDS) {
+      const auto extractStart = Clock::now();
+      auto clip = buffer.extract(std::chrono::seconds{clipSeconds}, assembler);
+      extractSeconds +=
+        std::chrono::duration<double>(Clock::now() - extractStart).count();
+      clips++;
+      clipUnits += clip.size();
+
+      const bool clipOk = checkClip(units, oldest, i, clipSeconds, clip);
+      ok = ok && clipOk;
+      if (!clip.empty()) {
+        const size_t first = (clip[0].config && !clip[0].hasPicture) ? 1 : 0;
+        const double covered = (clip.back().ptsUs - clip[first].ptsUs) / 1e6;
+        printf("at %5.2fs: last %2us -> %3zu units, %5.2fs from IDR: %s\n",
+               ptsFor(i) / 1e6, clipSeconds, clip.size(), covered,
+               clipOk ? "ok" : "BAD");
+      } else {
+        printf("at %5.2fs: last %2us -> empty: %s\n", ptsFor(i) / 1e6,
+               clipSeconds, clipOk ? "ok" : "BAD");
+      }
+    }
+  }
+
+  const auto stats = buffer.stats();
+  const bool noAllocations = (pushAllocations == 0);
+  ok = ok && noAllocations && (stats.rejected == 0) &&
+    (stats.bytesUsed <= stats.arenaSize);
+
+  printf("stream: %zu bytes, %zu access units\n", stream.size(), units.size());
+  printf("buffer: %.1f MB for %.1fs, holding %zu units (%zu keyframes, "
+         "%.1f MB), %llu evicted, %llu rejected\n",
+         stats.arenaSize / 1e6, config.seconds, stats.units, stats.keyframes,
+         stats.bytesUsed / 1e6,
+         static_cast<unsigned long long>(stats.evicted),
+         static_cast<unsigned long long>(stats.rejected));
+  printf("push: %.2f us per unit, %.1f MB/s, %llu allocations\n",
+         pushSeconds * 1e6 / units.size(), bytes / pushSeconds / 1e6,
+         static_cast<unsigned long long>(pushAllocations));
+  printf("extract: %.1f us per clip, %.2f us per unit\n",
+         extractSeconds * 1e6 / std::max<size_t>(clips, 1),
+         extractSeconds * 1e6 / std::max<size_t>(clipUnits, 1));
+  printf("clips: %s\n", ok ? "ok" : "BAD");
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * A seeded generator for the benchmarks' synthetic data, so every run sees
+ * the same frames and streams.
+ */
+
+#ifndef BENCH_RANDOM_HPP
+#define BENCH_RANDOM_HPP
+
+#include <cstdint>
+
+/**
+ * xorshift64*. Not for anything but test data.
+ */
+static inline uint64_t nextRandom(uint64_t& state) {
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 0x2545F4914F6CDD1DULL;
+}
+
+#endif // BENCH_RANDOM_HPP
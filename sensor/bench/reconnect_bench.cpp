@@ -0,0 +1,431 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Checks ImageSender's reconnect, spool and backfill against a local
+ * listener that gets killed and restarted:
+ *
+ * 1. Frames go out live, then the listener is killed. Frames keep coming and
+ *    go to the spool; once the listener is back, the sender reconnects and
+ *    backfills the spool (rate limited) alongside new live frames.
+ * 2. The listener is killed again, and the sender is shut down with frames
+ *    still spooled. A new sender picks the spool up from disk and sends it
+ *    once the listener is back.
+ *
+ * Every frame has to arrive intact, apart from the few that were on their
+ * way to a listener as it died (TCP can't tell us about those). Also reports
+ * the backfill rate and how often live frames got through during backfill.
+ *
+ * USAGE: reconnect_bench [frame_size [backfill_bytes_per_s]]
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "frame_assembler.hpp"
+#include "image_sender.hpp"
+#include "loopback.hpp"
+
+#include "picam.pb.h"
+
+using Clock = std::chrono::steady_clock;
+
+// Frames per second while "capturing"
+static const int FRAME_RATE = 100;
+
+static const unsigned LIVE_FRAMES = 100;
+static const unsigned OUTAGE_FRAMES = 200;
+
+// Frames that can be lost each time the listener dies: written to the socket
+// before the sender finds out
+static const unsigned MAX_LOST_PER_KILL = 2;
+
+/**
+ * Accepts connections one at a time on a fixed loopback port and keeps track
+ * of which frames came in.
+ */
+class Listener {
+  public:
+    explicit Listener(uint16_t port)
+      : mMutex{}
+      , mSeen{}
+      , mArrivals{}
+      , mCorrupt{0}
+      , mListener{port, [this](int fd) { receive(fd); }}
+    { }
+
+    uint16_t port() const {
+      return mListener.port();
+    }
+
+    bool start() {
+      return mListener.start();
+    }
+
+    /**
+     * Stop listening and drop the connection, unread data and all.
+     */
+    void kill() {
+      mListener.kill();
+    }
+
+    /**
+     * Times each frame index was received.
+     */
+    std::vector<unsigned> seen() {
+      std::lock_guard<std::mutex> lock{mMutex};
+      return mSeen;
+    }
+
+    /**
+     * Frame indexes in the order they arrived.
+     */
+    std::vector<uint32_t> arrivals() {
+      std::lock_guard<std::mutex> lock{mMutex};
+      return mArrivals;
+    }
+
+    unsigned corrupt() const {
+      return mCorrupt;
+    }
+
+    unsigned connections() const {
+      return mListener.connections();
+    }
+
+  private:
+    void receive(int fd) {
+      std::vector<uint8_t> buf;
+      Image image;
+      for (;;) {
+        const ImageRead read = readImage(fd, buf, image);
+        // A message cut off by a dropped connection is just thrown away
+        if ((read == ImageRead::CLOSED) || (read == ImageRead::CUT_OFF)) {
+          return;
+        }
+
+        bool ok = read == ImageRead::OK;
+        const uint32_t index = image.metadata().time_us();
+        const std::string& data = image.data();
+        for (size_t i = 0; ok && (i < data.size()); i++) {
+          ok = static_cast<uint8_t>(data[i]) == payloadByte(index, i);
+        }
+        if (!ok) {
+          mCorrupt++;
+          continue;
+        }
+
+        std::lock_guard<std::mutex> lock{mMutex};
+        if (index >= mSeen.size()) {
+          mSeen.resize(index + 1);
+        }
+        mSeen[index]++;
+        mArrivals.push_back(index);
+      }
+    }
+
+    std::mutex mMutex;
+    std::vector<unsigned> mSeen;
+    std::vector<uint32_t> mArrivals;
+    std::atomic<unsigned> mCorrupt;
+    // Last, so its thread is stopped before the rest goes away
+    LoopbackListener mListener;
+};
+
+/**
+ * Hands frames to a sender at FRAME_RATE.
+ */
+class Producer {
+  public:
+    explicit Producer(size_t frameSize)
+      : mFrameSize{frameSize}
+      , mAssembler{65536, 4}
+      , mPayload(frameSize)
+      , mNext{0}
+    { }
+
+    uint32_t produced() const {
+      return mNext;
+    }
+
+    void produce(ImageSender& sender, unsigned count) {
+      auto next = Clock::now();
+      for (unsigned n = 0; n < count; n++) {
+        const uint32_t index = mNext++;
+        for (size_t i = 0; i < mFrameSize; i++) {
+          mPayload[i] = payloadByte(index, i);
+        }
+        mAssembler.append(mPayload.data(), mPayload.size());
+
+        QueuedImage image{};
+        image.metadata.set_time_s(1);
+        image.metadata.set_time_us(index);
+        image.metadata.set_encoding("RAW");
+        image.frame = mAssembler.finish();
+        sender.enqueue(std::move(image));
+
+        next += std::chrono::microseconds{1000000 / FRAME_RATE};
+        std::this_thread::sleep_until(next);
+      }
+    }
+
+  private:
+    const size_t mFrameSize;
+    FrameAssembler mAssembler;
+    std::vector<uint8_t> mPayload;
+    uint32_t mNext;
+};
+
+/**
+ * Add up what a listener received before it's replaced.
+ */
+static void tally(Listener& listener, std::vector<unsigned>& seen,
+                  unsigned& corrupt) {
+  const auto counts = listener.seen();
+  if (counts.size() > seen.size()) {
+    seen.resize(counts.size());
+  }
+  for (size_t i = 0; i < counts.size(); i++) {
+    seen[i] += counts[i];
+  }
+  corrupt += listener.corrupt();
+}
+
+static size_t spoolFiles(const std::string& directory) {
+  size_t count = 0;
+  DIR* dir = opendir(directory.c_str());
+  if (dir == nullptr) {
+    return 0;
+  }
+  while (struct dirent* entry = readdir(dir)) {
+    if (entry->d_name[0] != '.') {
+      count++;
+    }
+  }
+  closedir(dir);
+  return count;
+}
+
+static void removeSpool(const std::string& directory) {
+  DIR* dir = opendir(directory.c_str());
+  if (dir != nullptr) {
+    while (struct dirent* entry = readdir(dir)) {
+      if (entry->d_name[0] != '.') {
+        unlink((directory + "/" + entry->d_name).c_str());
+      }
+    }
+    closedir(dir);
+  }
+  rmdir(directory.c_str());
+}
+
+int main(int argc, char* argv[]) {
+  size_t frameSize = 65536;
+  uint64_t backfillRate = 4 << 20;
+  if (argc > 1) {
+    frameSize = std::max(std::atoi(argv[1]), 1);
+  }
+  if (argc > 2) {
+    backfillRate = std::strtoull(argv[2], nullptr, 10);
+  }
+
+  char directory[] = "/tmp/picam-spool-XXXXXX";
+  if (mkdtemp(directory) == nullptr) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  auto listener = std::make_unique<Listener>(0);
+  if (!listener->start()) {
+    return 1;
+  }
+  const uint16_t port = listener->port();
+
+  ImageSender::Config config{};
+  config.serverHostname = "127.0.0.1";
+  config.serverPort = port;
+  config.queueCapacity = 8;
+  config.overflowPolicy = ImageSender::OverflowPolicy::BLOCK;
+  config.spoolDirectory = directory;
+  // Small segments, so a run goes through a few of them
+  config.spoolSegmentSize = 1 << 20;
+  config.backfillRate = backfillRate;
+  config.reconnectDelay = std::chrono::milliseconds{50};
+  config.maxReconnectDelay = std::chrono::milliseconds{400};
+
+  Producer producer{frameSize};
+  bool ok = true;
+  std::vector<unsigned> seen;
+  unsigned corrupt = 0;
+  unsigned kills = 0;
+
+  //
+  // 1. Outage while running
+  //
+  auto sender = std::make_unique<ImageSender>(config);
+  if (!sender->connect() || !sender->start()) {
+    fprintf(stderr, "Failed to connect to the listener\n");
+    return 1;
+  }
+  producer.produce(*sender, LIVE_FRAMES);
+
+  listener->kill();
+  kills++;
+  tally(*listener, seen, corrupt);
+  const uint32_t outageStart = producer.produced();
+  producer.produce(*sender, OUTAGE_FRAMES);
+  const uint32_t outageEnd = producer.produced();
+  const auto spooledDuringOutage = sender->stats().spooled;
+
+  // Back up: backfill and live frames share the connection
+  listener = std::make_unique<Listener>(port);
+  if (!listener->start()) {
+    return 1;
+  }
+  const auto backfillStart = Clock::now();
+  const auto bytesBefore = sender->stats().bytesSent;
+  const uint32_t liveStart = producer.produced();
+  producer.produce(*sender, LIVE_FRAMES);
+  const bool drained = waitFor([&sender] {
+      return sender->stats().spoolBytes == 0;
+    }, std::chrono::seconds{60});
+  const double backfillSeconds =
+    std::chrono::duration<double>(Clock::now() - backfillStart).count();
+  const auto stats = sender->stats();
+  const uint64_t liveBytes = static_cast<uint64_t>(LIVE_FRAMES) * frameSize;
+  const double backfillRateSeen =
+    (stats.bytesSent - bytesBefore - std::min(liveBytes,
+        stats.bytesSent - bytesBefore)) / backfillSeconds;
+
+  // How many live frames arrived before the backfill was done
+  size_t liveDuringBackfill = 0;
+  size_t backfilledSeen = 0;
+  for (uint32_t index : listener->arrivals()) {
+    if ((index >= outageStart) && (index < outageEnd)) {
+      backfilledSeen++;
+    } else if ((index >= liveStart) &&
+               (backfilledSeen < spooledDuringOutage)) {
+      liveDuringBackfill++;
+    }
+  }
+
+  ok = ok && drained && (stats.backfilled == stats.spooled) &&
+    (spoolFiles(directory) == 0);
+  printf("outage: %llu frames spooled, %llu backfilled in %.2fs "
+         "(%.2f MB/s, limit %.2f MB/s), %zu of %u live frames in between, "
+         "%llu reconnects: %s\n",
+         static_cast<unsigned long long>(stats.spooled),
+         static_cast<unsigned long long>(stats.backfilled), backfillSeconds,
+         backfillRateSeen / 1e6, backfillRate / 1e6, liveDuringBackfill,
+         LIVE_FRAMES, static_cast<unsigned long long>(stats.reconnects),
+         (drained && (stats.backfilled == stats.spooled)) ? "ok" : "BAD");
+
+  //
+  // 2. Restart with a spool on disk
+  //
+  listener->kill();
+  kills++;
+  tally(*listener, seen, corrupt);
+  // Let the sender notice, so these frames go to the spool
+  producer.produce(*sender, 1);
+  waitFor([&sender] { return !sender->connected(); }, std::chrono::seconds{5});
+  const uint32_t restartStart = producer.produced();
+  producer.produce(*sender, LIVE_FRAMES / 2);
+  sender.reset();
+  const size_t filesLeft = spoolFiles(directory);
+
+  listener = std::make_unique<Listener>(port);
+  if (!listener->start()) {
+    return 1;
+  }
+  sender = std::make_unique<ImageSender>(config);
+  sender->connect();
+  sender->start();
+  const bool restartDrained = waitFor([&sender] {
+      return sender->stats().spoolBytes == 0;
+    }, std::chrono::seconds{60});
+  const auto restartStats = sender->stats();
+  // Sent isn't received yet; give the listener time to read it all
+  const uint32_t produced = producer.produced();
+  auto restartReceived = [&listener, restartStart, produced] {
+    const auto counts = listener->seen();
+    size_t n = 0;
+    for (uint32_t i = restartStart; i < std::min<size_t>(produced, counts.size());
+         i++) {
+      n += counts[i] > 0;
+    }
+    return n;
+  };
+  waitFor([&] { return restartReceived() == produced - restartStart; },
+          std::chrono::seconds{10});
+  const size_t restartSeen = restartReceived();
+  sender.reset();
+  listener->kill();
+  tally(*listener, seen, corrupt);
+
+  const bool restartOk = restartDrained && (filesLeft > 0) &&
+    (restartSeen == produced - restartStart) && (spoolFiles(directory) == 0);
+  ok = ok && restartOk;
+  printf("restart: %zu segments left on disk, %llu frames backfilled by the "
+         "new sender, %zu of %u received: %s\n",
+         filesLeft, static_cast<unsigned long long>(restartStats.backfilled),
+         restartSeen, produced - restartStart, restartOk ? "ok" : "BAD");
+
+  //
+  // Overall
+  //
+  seen.resize(producer.produced());
+  std::vector<uint32_t> lost;
+  unsigned duplicates = 0;
+  for (uint32_t i = 0; i < seen.size(); i++) {
+    if (seen[i] == 0) {
+      lost.push_back(i);
+    } else {
+      duplicates += seen[i] - 1;
+    }
+  }
+  const bool allOk = (corrupt == 0) &&
+    (lost.size() <= kills * MAX_LOST_PER_KILL);
+  ok = ok && allOk;
+  printf("%u frames: %zu lost in flight, %u duplicates, %u corrupt: %s\n",
+         producer.produced(), lost.size(), duplicates, corrupt,
+         allOk ? "ok" : "BAD");
+  if (!lost.empty()) {
+    printf("lost:");
+    for (uint32_t i : lost) {
+      printf(" %u", i);
+    }
+    printf("\n");
+  }
+  removeSpool(directory);
+
+  printf("result: %s\n", ok ? "ok" : "BAD");
+  return ok ? 0 : 1;
+}
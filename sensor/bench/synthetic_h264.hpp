@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Synthetic Annex B H.264 elementary streams for the benchmarks, so they can
+ * run without a recording. The NAL payloads are random bytes (with emulation
+ * prevention), so the stream only makes sense to a parser, not a decoder.
+ *
+ * Also reads a recording, for when there is one, and flattens the Frames a
+ * stream is split into so they can be compared with it.
+ */
+
+#ifndef BENCH_SYNTHETIC_H264_HPP
+#define BENCH_SYNTHETIC_H264_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "frame_assembler.hpp"
+
+#include "random.hpp"
+
+/**
+ * Where the generator put an access unit.
+ */
+struct Unit {
+  size_t offset;
+  size_t size;
+  bool keyframe;
+  bool config;
+};
+
+/**
+ * Append a NAL unit: start code, header, the first payload byte, then random
+ * bytes with emulation prevention, like a real encoder's output.
+ */
+static inline void appendNal(std::string& stream, bool longStartCode,
+                             uint8_t header, uint8_t first, size_t size,
+                             uint64_t& rng) {
+  if (longStartCode) {
+    stream.push_back('\0');
+  }
+  stream.append("\0\0\1", 3);
+  stream.push_back(static_cast<char>(header));
+  stream.push_back(static_cast<char>(first));
+
+  unsigned zeros = 0;
+  for (size_t i = 0; i < size; i++) {
+    // Plenty of zeros, to exercise emulation prevention
+    uint8_t byte = static_cast<uint8_t>(nextRandom(rng));
+    if ((byte & 0x0F) == 0) {
+      byte = 0;
+    }
+    if ((zeros >= 2) && (byte <= 3)) {
+      stream.push_back('\3');
+      zeros = 0;
+    }
+    stream.push_back(static_cast<char>(byte));
+    zeros = (byte == 0) ? zeros + 1 : 0;
+  }
+  // A NAL can't end in a zero byte
+  if (zeros > 0) {
+    stream.push_back('\x80');
+  }
+}
+
+/**
+ * A stream shaped like the camera's: one IDR every gop frames with SPS/PPS in
+ * front of it, two slices per picture.
+ */
+static inline std::string syntheticStream(std::vector<Unit>& units,
+                                          unsigned frames, unsigned fps = 30,
+                                          unsigned gop = 30,
+                                          uint32_t bitrate = 17000000) {
+  std::string stream;
+  uint64_t rng = 0x853c49e6748fea9bULL;
+  const size_t frameBytes = bitrate / 8 / fps;
+
+  for (unsigned frame = 0; frame < frames; frame++) {
+    Unit unit{};
+    unit.offset = stream.size();
+    unit.keyframe = (frame % gop) == 0;
+    unit.config = unit.keyframe;
+
+    // IDR frames are about four times as big as the rest
+    const size_t size = unit.keyframe ? frameBytes * 4 : frameBytes * 9 / 10;
+    if (unit.keyframe) {
+      appendNal(stream, true, 0x67, 0x64, 12, rng);
+      appendNal(stream, true, 0x68, 0xEE, 3, rng);
+    }
+    const uint8_t sliceHeader = unit.keyframe ? 0x65 : 0x41;
+    // first_mb_in_slice = 0, then some other macroblock
+    appendNal(stream, true, sliceHeader, 0x88, size / 2, rng);
+    appendNal(stream, false, sliceHeader, 0x20, size / 2, rng);
+
+    unit.size = stream.size() - unit.offset;
+    units.push_back(unit);
+  }
+  return stream;
+}
+
+/**
+ * Append the whole of the file at path to out.
+ */
+static inline bool readFile(const char* path, std::string& out) {
+  FILE* f = fopen(path, "rb");
+  if (f == nullptr) {
+    perror(path);
+    return false;
+  }
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    out.append(buf, n);
+  }
+  fclose(f);
+  return true;
+}
+
+/**
+ * A frame's chunks, joined.
+ */
+static inline std::string frameBytes(const Frame& frame) {
+  std::string bytes;
+  bytes.reserve(frame.size());
+  for (const auto& chunk : frame.chunks()) {
+    bytes.append(reinterpret_cast<const char*>(chunk.data), chunk.size);
+  }
+  return bytes;
+}
+
+#endif // BENCH_SYNTHETIC_H264_HPP
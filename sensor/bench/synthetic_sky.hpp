@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Synthetic night sky for the benchmarks that feed luma straight to the
+ * codecs or the analysis: a fixed star field, drawn over a flat background
+ * with sensor noise that changes from frame to frame.
+ */
+
+#ifndef BENCH_SYNTHETIC_SKY_HPP
+#define BENCH_SYNTHETIC_SKY_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "random.hpp"
+
+struct Star {
+  float x;
+  float y;
+  float peak;
+};
+
+/**
+ * count stars anywhere in a width x height frame, most of them faint.
+ */
+static inline std::vector<Star> randomStars(unsigned count, uint32_t width,
+                                            uint32_t height) {
+  std::vector<Star> stars;
+  uint64_t state = 1;
+  for (unsigned i = 0; i < count; i++) {
+    Star star;
+    star.x = static_cast<float>(nextRandom(state) % (width * 16)) / 16.0f;
+    star.y = static_cast<float>(nextRandom(state) % (height * 16)) / 16.0f;
+    const float u = static_cast<float>(nextRandom(state) % 10000) / 10000.0f;
+    star.peak = 20.0f + 235.0f * u * u * u;
+    stars.push_back(star);
+  }
+  return stars;
+}
+
+/**
+ * Add a star centred on (sx, sy) to a width x height luma plane, saturating
+ * at 255.
+ */
+static inline void drawStar(uint8_t* luma, uint32_t width, uint32_t height,
+                            float sx, float sy, float peak) {
+  const int cx = static_cast<int>(std::lround(sx));
+  const int cy = static_cast<int>(std::lround(sy));
+  for (int y = std::max(cy - 2, 0); y <= std::min(cy + 2, int(height) - 1); y++) {
+    for (int x = std::max(cx - 2, 0); x <= std::min(cx + 2, int(width) - 1); x++) {
+      const float r2 = (x - sx) * (x - sx) + (y - sy) * (y - sy);
+      uint8_t& pixel = luma[static_cast<size_t>(y) * width + x];
+      pixel = static_cast<uint8_t>(std::min(
+        pixel + static_cast<int>(peak * std::exp(-r2 / 1.62f)), 255));
+    }
+  }
+}
+
+/**
+ * Add up to +/- noise to each of size luma pixels, different for every frame
+ * number.
+ */
+static inline void addNoise(uint8_t* luma, size_t size, int noise,
+                            uint64_t number) {
+  if (noise == 0) {
+    return;
+  }
+  uint64_t state = (number + 1) * 0x9E3779B97F4A7C15ULL;
+  for (size_t i = 0; i < size; i += 8) {
+    const uint64_t r = nextRandom(state);
+    for (size_t j = 0; (j < 8) && (i + j < size); j++) {
+      const int value = luma[i + j] - noise +
+        static_cast<int>((r >> (8 * j)) & 0xFF) % (2 * noise + 1);
+      luma[i + j] = static_cast<uint8_t>(std::min(std::max(value, 0), 255));
+    }
+  }
+}
+
+#endif // BENCH_SYNTHETIC_SKY_HPP
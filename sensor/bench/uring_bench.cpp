@@ -0,0 +1,339 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Compares ImageSender's blocking sends with its io_uring path (with and
+ * without SQPOLL), streaming synthetic H.264 access units over TCP loopback
+ * to a receiver that checks every record with StreamParser:
+ *
+ * 1. Paced at 30 and 60 fps, like the camera: send syscalls per second, CPU
+ *    and context switches. Keyframes span several 64 KB slabs, which go out
+ *    zero-copy from registered buffers.
+ * 2. A burst of access units enqueued all at once, as after a stall: with
+ *    io_uring, whatever's queued up goes out in one batch.
+ *
+ * CPU and context switches are for the whole process (the producer and
+ * receiver threads, and the SQPOLL thread, included), so only the
+ * differences between modes mean much.
+ *
+ * USAGE: uring_bench [seconds [burst_units]]
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "frame_assembler.hpp"
+#include "image_sender.hpp"
+#include "video_framing.hpp"
+
+#include "synthetic_h264.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+// Roughly what the video encoder's output port recommends, and the slab size
+static const size_t ENCODER_BUFFER_SIZE = 65536;
+
+enum class Mode {
+  BLOCKING,
+  URING,
+  SQPOLL,
+};
+
+static const char* modeName(Mode mode) {
+  switch (mode) {
+    case Mode::BLOCKING:
+      return "blocking";
+    case Mode::URING:
+      return "io_uring";
+    case Mode::SQPOLL:
+      return "io_uring+sqpoll";
+  }
+  return "";
+}
+
+struct Result {
+  unsigned units;
+  uint64_t received;
+  uint64_t bad;
+  double seconds;
+  double cpu;
+  long switches;
+  ImageSender::Stats stats;
+};
+
+/**
+ * Accepts one connection and checks each record's payload against the
+ * access unit its PTS says it is.
+ */
+class Receiver {
+  public:
+    Receiver(const std::string& stream, const std::vector<Unit>& units)
+      : mStream{stream}
+      , mUnits{units}
+      , mListenFd{-1}
+      , mPort{0}
+      , mThread{}
+      , mReceived{0}
+      , mBad{0}
+    { }
+
+    ~Receiver() {
+      if (mThread.joinable()) {
+        mThread.join();
+      }
+      if (mListenFd >= 0) {
+        close(mListenFd);
+      }
+    }
+
+    bool start() {
+      mListenFd = socket(AF_INET, SOCK_STREAM, 0);
+      struct sockaddr_in addr{};
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      socklen_t addrLen = sizeof(addr);
+      if ((mListenFd < 0) ||
+          (bind(mListenFd, reinterpret_cast<struct sockaddr*>(&addr),
+                sizeof(addr)) != 0) ||
+          (listen(mListenFd, 1) != 0) ||
+          (getsockname(mListenFd, reinterpret_cast<struct sockaddr*>(&addr),
+                       &addrLen) != 0)) {
+        perror("listen");
+        return false;
+      }
+      mPort = ntohs(addr.sin_port);
+      mThread = std::thread{&Receiver::run, this};
+      return true;
+    }
+
+    /**
+     * Wait for the sender to hang up.
+     */
+    void join() {
+      mThread.join();
+    }
+
+    uint16_t port() const {
+      return mPort;
+    }
+
+    uint64_t received() const {
+      return mReceived;
+    }
+
+    uint64_t bad() const {
+      return mBad;
+    }
+
+  private:
+    void run() {
+      int fd = accept(mListenFd, nullptr, nullptr);
+      if (fd < 0) {
+        return;
+      }
+      VideoFraming::StreamParser parser{
+        [this](const VideoFraming::RecordHeader& header,
+               const uint8_t* payload) {
+          check(header, payload);
+        }};
+      std::vector<uint8_t> buf(1 << 16);
+      for (;;) {
+        ssize_t n = read(fd, buf.data(), buf.size());
+        if (n <= 0) {
+          break;
+        }
+        parser.feed(buf.data(), n);
+      }
+      mBad += parser.droppedRecords() + parser.skippedBytes();
+      close(fd);
+    }
+
+    void check(const VideoFraming::RecordHeader& header,
+               const uint8_t* payload) {
+      const size_t index = static_cast<size_t>(header.ptsUs);
+      if ((header.ptsUs < 0) || (index >= mUnits.size()) ||
+          (header.payloadSize != mUnits[index].size) ||
+          (memcmp(payload, mStream.data() + mUnits[index].offset,
+                  header.payloadSize) != 0) ||
+          (header.flags & VideoFraming::DISCONTINUITY)) {
+        mBad++;
+        return;
+      }
+      mReceived++;
+    }
+
+    const std::string& mStream;
+    const std::vector<Unit>& mUnits;
+    int mListenFd;
+    uint16_t mPort;
+    std::thread mThread;
+    std::atomic<uint64_t> mReceived;
+    std::atomic<uint64_t> mBad;
+};
+
+static double processCpu() {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long contextSwitches() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+/**
+ * Stream units through a sender in the given mode, fps apart, or all at
+ * once if fps is 0.
+ *
+ * @return false if the sender couldn't be set up.
+ */
+static bool run(Mode mode, const std::string& stream,
+                const std::vector<Unit>& units, unsigned fps,
+                Result& result) {
+  Receiver receiver{stream, units};
+  if (!receiver.start()) {
+    return false;
+  }
+
+  ImageSender::Config config{};
+  config.serverHostname = "127.0.0.1";
+  config.serverPort = receiver.port();
+  config.queueCapacity = std::max<size_t>(fps, units.size());
+  config.overflowPolicy = ImageSender::OverflowPolicy::BLOCK;
+  config.ioUring = mode != Mode::BLOCKING;
+  config.ioUringSqPoll = mode == Mode::SQPOLL;
+  ImageSender sender{config};
+  if (!sender.connect() || !sender.start()) {
+    fprintf(stderr, "Failed to start the sender\n");
+    return false;
+  }
+
+  // The units are copied into slabs up front, as the encoder callback would
+  // have done, so the producer doesn't get in the way of the measurements
+  FrameAssembler assembler{ENCODER_BUFFER_SIZE, 8};
+  std::vector<FramePtr> frames;
+  for (const auto& unit : units) {
+    for (size_t off = 0; off < unit.size; off += ENCODER_BUFFER_SIZE) {
+      assembler.append(
+          reinterpret_cast<const uint8_t*>(stream.data()) + unit.offset + off,
+          std::min(ENCODER_BUFFER_SIZE, unit.size - off));
+    }
+    frames.push_back(assembler.finish());
+  }
+
+  const double cpuStart = processCpu();
+  const long switchesStart = contextSwitches();
+  const auto start = Clock::now();
+  auto next = start;
+  for (size_t i = 0; i < units.size(); i++) {
+    QueuedImage image{};
+    image.isVideo = true;
+    image.frame = frames[i];
+    image.videoHeader.sequence = static_cast<uint32_t>(i);
+    image.videoHeader.ptsUs = static_cast<int64_t>(i);
+    if (units[i].keyframe) {
+      image.videoHeader.flags = VideoFraming::KEYFRAME | VideoFraming::CONFIG;
+    }
+    sender.enqueue(std::move(image));
+    if (fps > 0) {
+      next += std::chrono::microseconds{1000000 / fps};
+      std::this_thread::sleep_until(next);
+    }
+  }
+  frames.clear();
+  sender.stop();
+  result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  result.cpu = processCpu() - cpuStart;
+  result.switches = contextSwitches() - switchesStart;
+  result.stats = sender.stats();
+
+  sender.disconnect();
+  receiver.join();
+  result.units = units.size();
+  result.received = receiver.received();
+  result.bad = receiver.bad();
+  return true;
+}
+
+static bool report(Mode mode, const Result& result) {
+  const bool ok = (result.received == result.units) && (result.bad == 0);
+  const bool uring = result.stats.uringBatches > 0;
+  printf("  %-16s %7.0f syscalls/s, %5.1f%% CPU, %6.0f switches/s, "
+         "%4.2f units/syscall, %5.1f MB zero-copy, %llu/%u ok%s%s\n",
+         modeName(mode), result.stats.syscalls / result.seconds,
+         100.0 * result.cpu / result.seconds,
+         result.switches / result.seconds,
+         result.stats.syscalls
+           ? static_cast<double>(result.units) / result.stats.syscalls : 0.0,
+         result.stats.uringZeroCopyBytes / 1e6,
+         static_cast<unsigned long long>(result.received), result.units,
+         ((mode != Mode::BLOCKING) && !uring) ? " (io_uring unavailable)" : "",
+         ok ? "" : " BAD");
+  return ok;
+}
+
+int main(int argc, char* argv[]) {
+  unsigned seconds = 3;
+  unsigned burstUnits = 300;
+  if (argc > 1) {
+    seconds = std::max(std::atoi(argv[1]), 1);
+  }
+  if (argc > 2) {
+    burstUnits = std::max(std::atoi(argv[2]), 1);
+  }
+
+  bool ok = true;
+  const Mode modes[] = {Mode::BLOCKING, Mode::URING, Mode::SQPOLL};
+  for (unsigned fps : {30u, 60u}) {
+    std::vector<Unit> units;
+    const std::string stream = syntheticStream(units, fps * seconds, fps);
+    printf("%u fps for %u s:\n", fps, seconds);
+    for (Mode mode : modes) {
+      Result result{};
+      ok = run(mode, stream, units, fps, result) && report(mode, result) &&
+        ok;
+    }
+  }
+
+  std::vector<Unit> units;
+  const std::string stream = syntheticStream(units, burstUnits);
+  printf("burst of %u units:\n", burstUnits);
+  for (Mode mode : modes) {
+    Result result{};
+    ok = run(mode, stream, units, 0, result) && report(mode, result) && ok;
+  }
+
+  printf("%s\n", ok ? "all ok" : "BAD");
+  return ok ? 0 : 1;
+}
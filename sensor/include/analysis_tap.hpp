@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef ANALYSIS_TAP_HPP
+#define ANALYSIS_TAP_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "bounded_queue.hpp"
+
+/**
+ * An uncompressed I420 frame: a full-resolution luma plane followed by
+ * half-resolution U and V planes. Rows are stride bytes apart (stride / 2 for
+ * chroma) and each plane has sliceHeight rows (sliceHeight / 2 for chroma),
+ * of which the first width x height pixels are the picture.
+ */
+struct RawFrame {
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;
+  uint32_t sliceHeight;
+  // Presentation timestamp in microseconds, as the camera reported it
+  int64_t pts;
+  // Counts every frame offered to the tap, so gaps show where frames were
+  // dropped
+  uint64_t sequence;
+  const uint8_t* data;
+  size_t size;
+
+  const uint8_t* luma() const {
+    return data;
+  }
+
+  const uint8_t* u() const {
+    return data + static_cast<size_t>(stride) * sliceHeight;
+  }
+
+  const uint8_t* v() const {
+    return u() + static_cast<size_t>(stride / 2) * (sliceHeight / 2);
+  }
+
+  /**
+   * Bytes an I420 frame with this layout takes up.
+   */
+  static size_t sizeFor(uint32_t stride, uint32_t sliceHeight) {
+    return static_cast<size_t>(stride) * sliceHeight +
+      2 * static_cast<size_t>(stride / 2) * (sliceHeight / 2);
+  }
+};
+
+/**
+ * Hands raw frames to analysis code (detection, background estimation,
+ * stacking) on a thread of its own.
+ *
+ * offer() copies a frame into one of a fixed number of buffers allocated up
+ * front and returns straight away: it never waits and never allocates, so it
+ * can be called from an MMAL callback without holding up the encoder. When
+ * the analysis thread falls behind, the oldest frame still waiting is
+ * dropped to make room, so the callback always sees the freshest frames
+ * there are.
+ */
+class AnalysisTap {
+  public:
+    /**
+     * Called on the analysis thread. The frame is only valid for the
+     * duration of the call.
+     */
+    typedef std::function<void(const RawFrame&)> Callback;
+
+    struct Config {
+      // Buffers to preallocate. One is being analysed at any time; the rest
+      // hold frames waiting for it.
+      size_t bufferCount = 3;
+      // Size of each buffer; bigger frames are dropped
+      size_t bufferSize = 0;
+    };
+
+    struct Stats {
+      uint64_t offered;
+      uint64_t delivered;
+      // Evicted while waiting, because newer frames came in
+      uint64_t dropped;
+      // Didn't fit in a buffer
+      uint64_t oversized;
+    };
+
+    AnalysisTap(const Config& config, Callback callback);
+    ~AnalysisTap();
+
+    AnalysisTap(const AnalysisTap&) = delete;
+    AnalysisTap& operator=(const AnalysisTap&) = delete;
+
+    /**
+     * Start the analysis thread.
+     */
+    bool start();
+
+    /**
+     * Stop the analysis thread once it's done with the frame it's on. Frames
+     * still waiting are dropped.
+     */
+    void stop();
+
+    /**
+     * Copy a frame for the analysis thread. frame.sequence is ignored; the
+     * tap numbers frames itself. Returns false if the frame was dropped.
+     */
+    bool offer(const RawFrame& frame);
+
+    Stats stats() const;
+
+    size_t bufferSize() const {
+      return mConfig.bufferSize;
+    }
+
+  private:
+    struct Slot {
+      RawFrame frame;
+      std::unique_ptr<uint8_t[]> data;
+    };
+
+    void run();
+
+    const Config mConfig;
+    Callback mCallback;
+
+    // Slots are owned by whichever side holds their index: free ones by the
+    // producer, ready ones by whoever pops them next
+    std::vector<Slot> mSlots;
+    BoundedQueue<size_t> mFree;
+    BoundedQueue<size_t> mReady;
+
+    std::thread mThread;
+    std::atomic<bool> mRunning;
+
+    // Only used to put the analysis thread to sleep
+    std::mutex mWaitMutex;
+    std::condition_variable mReadyCv;
+    std::atomic<bool> mWaiting;
+
+    uint64_t mSequence;
+    std::atomic<uint64_t> mOffered;
+    std::atomic<uint64_t> mDelivered;
+    std::atomic<uint64_t> mDropped;
+    std::atomic<uint64_t> mOversized;
+};
+
+#endif // ANALYSIS_TAP_HPP
@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BOUNDED_QUEUE_HPP
+#define BOUNDED_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+/**
+ * A fixed-capacity, lock-free FIFO. All storage is allocated up front.
+ *
+ * Any number of threads may push and pop at once. Each cell carries a
+ * sequence number that says whether it is ready to be written or read for a
+ * given position, and a thread claims a position with a CAS on the enqueue or
+ * dequeue index (D. Vyukov's bounded MPMC queue). This is what lets a
+ * producer pop the oldest entry to make room while the consumer is popping
+ * too.
+ *
+ * Nothing here puts a thread to sleep; callers that want to wait for an item
+ * or for room bring their own mutex and condition variable.
+ */
+template <typename T>
+class BoundedQueue {
+  public:
+    explicit BoundedQueue(size_t capacity)
+      : mCapacity{capacity > 0 ? capacity : 1}
+      , mCells{new Cell[mCapacity]}
+      , mEnqueuePos{0}
+      , mDequeuePos{0}
+    {
+      for (size_t i = 0; i < mCapacity; i++) {
+        mCells[i].sequence.store(i, std::memory_order_relaxed);
+      }
+    }
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    /**
+     * Append value to the queue. Returns false (leaving value untouched) if
+     * the queue is full.
+     */
+    bool tryPush(T&& value) {
+      size_t pos = mEnqueuePos.load(std::memory_order_relaxed);
+      for (;;) {
+        Cell& cell = mCells[pos % mCapacity];
+        size_t seq = cell.sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+        if (diff == 0) {
+          if (mEnqueuePos.compare_exchange_weak(pos, pos + 1,
+                                                std::memory_order_relaxed)) {
+            cell.value = std::move(value);
+            cell.sequence.store(pos + 1, std::memory_order_release);
+            return true;
+          }
+        } else if (diff < 0) {
+          return false;
+        } else {
+          pos = mEnqueuePos.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    /**
+     * Remove the oldest value from the queue. Returns false if the queue is
+     * empty.
+     */
+    bool tryPop(T& value) {
+      size_t pos = mDequeuePos.load(std::memory_order_relaxed);
+      for (;;) {
+        Cell& cell = mCells[pos % mCapacity];
+        size_t seq = cell.sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(seq) -
+          static_cast<intptr_t>(pos + 1);
+        if (diff == 0) {
+          if (mDequeuePos.compare_exchange_weak(pos, pos + 1,
+                                                std::memory_order_relaxed)) {
+            value = std::move(cell.value);
+            // Don't keep whatever the value owns alive until the cell is
+            // reused
+            cell.value = T{};
+            cell.sequence.store(pos + mCapacity, std::memory_order_release);
+            return true;
+          }
+        } else if (diff < 0) {
+          return false;
+        } else {
+          pos = mDequeuePos.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    /**
+     * Approximate number of values in the queue.
+     */
+    size_t size() const {
+      size_t enqueued = mEnqueuePos.load(std::memory_order_acquire);
+      size_t dequeued = mDequeuePos.load(std::memory_order_acquire);
+      return enqueued > dequeued ? enqueued - dequeued : 0;
+    }
+
+    bool empty() const {
+      return size() == 0;
+    }
+
+    size_t capacity() const {
+      return mCapacity;
+    }
+
+  private:
+    struct Cell {
+      std::atomic<size_t> sequence;
+      T value;
+    };
+
+    const size_t mCapacity;
+    std::unique_ptr<Cell[]> mCells;
+    // Keep the producer and consumer indices on separate cache lines
+    alignas(64) std::atomic<size_t> mEnqueuePos;
+    alignas(64) std::atomic<size_t> mDequeuePos;
+};
+
+#endif // BOUNDED_QUEUE_HPP
@@ -20,6 +20,9 @@
 
 #include <ostream>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
 
 #include <interface/mmal/mmal.h>
 #include <interface/mmal/mmal_parameters_camera.h>
@@ -28,7 +31,13 @@
 #include <interface/mmal/util/mmal_default_components.h>
 #include <interface/mmal/util/mmal_connection.h>
 
+#include "analysis_tap.hpp"
+#include "camera_state.hpp"
 #include "encoder_config.hpp"
+#include "frame_assembler.hpp"
+#include "frame_source.hpp"
+#include "h264_stream.hpp"
+#include "sensor_mode.hpp"
 
 enum class PortType {
   PREVIEW,
@@ -37,30 +46,11 @@ enum class PortType {
 };
 
 
-// Assuming camera module v2
-// TODO
-// See https://picamera.readthedocs.io/en/release-1.13/fov.html
-typedef enum {
-  SM_INVALID = 0,
-  SM_1920x1080 = 1,
-  SM_3280x2464_0 = 2,
-  SM_3280x2464_1 = 3,
-  SM_1640x1232 = 4,
-  SM_1640x922 = 5,
-  SM_1282x720 = 6,
-  SM_640x480 = 7,
-  NUM_SENSOR_MODES,
-} SensorMode;
-
 enum class CaptureMode {
   VIDEO,
   STILL,
 };
 
-extern const unsigned int SENSOR_MODE_WIDTH[NUM_SENSOR_MODES];
-extern const unsigned int SENSOR_MODE_HEIGHT[NUM_SENSOR_MODES];
-
-
 
 const int CAMERA_MAX_STILL_WIDTH = 3280;
 const int CAMERA_MAX_STILL_HEIGHT = 2464;
@@ -89,10 +79,27 @@ struct Rational {
  *
  * @note Getters and setters are named after corresponding MMAL_PARAMETERs.
  */
-class Camera {
+class Camera : public FrameSource {
 
   public:
-    typedef std::function<size_t(Camera&, std::string& data)> encoderCallbackType;
+    /**
+     * Called once per complete encoded frame. The frame is a scatter/gather
+     * view over pooled slabs, so it can be kept alive past the callback
+     * without copying.
+     */
+    typedef FrameSource::FrameCallback encoderCallbackType;
+
+    /**
+     * Shape of the frames the analysis tap delivers. A width and height of 0
+     * take frames at the capture resolution; anything else has the ISP scale
+     * them first.
+     */
+    struct AnalysisConfig {
+      uint32_t width = 0;
+      uint32_t height = 0;
+      // Frames the tap can hold while the analysis thread is busy
+      size_t bufferCount = 3;
+    };
 
     explicit Camera(int cameraNum);
     ~Camera();
@@ -113,11 +120,32 @@ class Camera {
     MMAL_PORT_T* encoderOutputPort() const;
 
     /**
-     * Create buffer pools for the video output, the two splitter outputs, and
-     * the encoder output.
+     * Port the analysis tap's frames come out of, or nullptr without one.
+     */
+    MMAL_PORT_T* analysisOutputPort() const;
+
+    /**
+     * Put a splitter between the capture port and the encoder, and hand a raw
+     * I420 copy of every frame to callback, on a thread of its own, through
+     * an AnalysisTap. The encoder branch never waits for the analysis: frames
+     * the callback can't keep up with are dropped.
+     *
+     * Call after the capture format is set, and before createBufferPools().
+     */
+    MMAL_STATUS_T enableAnalysisTap(const AnalysisConfig& config,
+                                    AnalysisTap::Callback callback);
+
+    /**
+     * The analysis tap, or nullptr if it isn't enabled.
+     */
+    const AnalysisTap* analysisTap() const;
+
+    /**
+     * Create buffer pools for the encoder output and, with the analysis tap
+     * enabled, its output port. This also sizes the frame assembler's slabs
+     * from the encoder output buffer size.
      */
     MMAL_STATUS_T createBufferPools();
-    MMAL_POOL_T* getVideoBufferPool();
     MMAL_POOL_T* getEncoderBufferPool();
 
     /**
@@ -127,17 +155,35 @@ class Camera {
     MMAL_STATUS_T enableEncoder();
 
     /**
-     * Enable the callbacks for the second splitter output (the first splitter
-     * output will be connected to the encoder input) and the encoder output.
+     * Enable the callbacks for the encoder output and, with the analysis tap
+     * enabled, the second splitter output (the first one feeds the encoder).
      */
     MMAL_STATUS_T enableCallbacks(encoderCallbackType encoderCallback);
 
+    /**
+     * Like enableCallbacks(), for an H.264 encoder: output is split into
+     * access units as buffers arrive, and each one is passed to callback as
+     * soon as it's complete, instead of being collected into whole frames.
+     */
+    MMAL_STATUS_T enableVideoCallbacks(AccessUnitSplitter::Callback callback);
+
     MMAL_STATUS_T disableCallbacks();
 
     /**
-     * Set up and enable connections. By default,
-     * - camera video output -> splitter input
-     * - splitter output[1] -> encoder input
+     * FrameSource interface: enableCallbacks(), disableCapture() followed by
+     * disableCallbacks(), and enableCapture().
+     */
+    bool start(FrameCallback callback) override;
+    bool stop() override;
+    bool requestCapture() override;
+    void setStream(FrameAssembler::Stream* stream) override;
+
+    /**
+     * Set up and enable connections. By default, the capture port feeds the
+     * encoder input directly. With the analysis tap enabled,
+     * - capture output -> splitter input
+     * - splitter output[0] -> encoder input
+     * - splitter output[1] -> ISP input, if the tap frames are scaled
      */
     MMAL_STATUS_T setUpConnections();
 
@@ -152,8 +198,13 @@ class Camera {
     SensorMode sensorMode() const;
     MMAL_STATUS_T setSensorMode(SensorMode mode);
 
-    uint32_t width() const;
-    uint32_t height() const;
+    uint32_t width() const override;
+    uint32_t height() const override;
+
+    /**
+     * Name of the encoder output format, e.g. "PNG".
+     */
+    std::string encoding() const override;
 
     MMAL_STATUS_T setVideoFormat(MMAL_FOURCC_T encoding,
                                  MMAL_FOURCC_T encodingVariant,
@@ -311,6 +362,20 @@ class Camera {
      */
     MMAL_STATUS_T setDigitalGain(Rational gain);
     MMAL_STATUS_T getDigitalGain(Rational& gain);
+
+    /**
+     * Get a copy of the cached camera state. This doesn't talk to the
+     * VideoCore, so it's cheap enough to call for every frame.
+     */
+    CameraState stateSnapshot() const override;
+
+    /**
+     * Query the values the firmware adjusts on its own (analog/digital gain
+     * and AWB gains) and update the cached state. Camera settings events
+     * normally keep these current; this seeds the cache, or can be polled
+     * from a low-priority thread.
+     */
+    MMAL_STATUS_T refreshVolatileState();
     
     encoderCallbackType encoderCallback();
 
@@ -321,6 +386,34 @@ class Camera {
      */
     static void controlCallback(MMAL_PORT_T* port, MMAL_BUFFER_HEADER_T* buffer);
     static void encoderCallback(MMAL_PORT_T* port, MMAL_BUFFER_HEADER_T* buffer);
+    static void analysisCallback(MMAL_PORT_T* port, MMAL_BUFFER_HEADER_T* buffer);
+
+    /**
+     * Record a value we know the camera is using.
+     */
+    template <typename T>
+    void cacheValue(CameraState::Field field, T CameraState::* member,
+                    T value);
+
+    void handleSettingsEvent(const MMAL_PARAMETER_CAMERA_SETTINGS_T& settings);
+
+    /**
+     * Enable the encoder output port and give it all the pool's buffers.
+     */
+    MMAL_STATUS_T enableEncoderOutput();
+
+    /**
+     * Start the analysis thread, then enable the analysis output port and
+     * give it all the pool's buffers. Does nothing without the tap.
+     */
+    MMAL_STATUS_T enableAnalysisOutput();
+    MMAL_STATUS_T disableAnalysisOutput();
+
+    /**
+     * Connect output to input, tunnelled, and enable the connection.
+     */
+    static MMAL_STATUS_T connectPorts(MMAL_CONNECTION_T*& connection,
+                                      MMAL_PORT_T* output, MMAL_PORT_T* input);
 
     int mCameraNum;
     SensorMode mSensorMode;
@@ -330,15 +423,32 @@ class Camera {
     MMAL_COMPONENT_T* mCamera;
     MMAL_COMPONENT_T* mEncoder;
     MMAL_COMPONENT_T* mPreview;
+    // Only with the analysis tap; the ISP only when it scales
+    MMAL_COMPONENT_T* mSplitter;
+    MMAL_COMPONENT_T* mResizer;
 
     // Buffer pools
     MMAL_POOL_T* mEncoderPool;
+    std::unique_ptr<FrameAssembler> mFrameAssembler;
+    // Where the assembler passes encoder output, if it's streamed
+    FrameAssembler::Stream* mStream;
+    // Only set in video mode
+    std::unique_ptr<AccessUnitSplitter> mAccessUnitSplitter;
+    MMAL_POOL_T* mAnalysisPool;
+    std::unique_ptr<AnalysisTap> mAnalysisTap;
+    AnalysisConfig mAnalysisConfig;
+    AnalysisTap::Callback mAnalysisCallback;
 
     // Connections
     MMAL_CONNECTION_T* mVideoEncoderConnection;
     MMAL_CONNECTION_T* mPreviewNullConnection;
+    MMAL_CONNECTION_T* mCaptureSplitterConnection;
+    MMAL_CONNECTION_T* mSplitterResizerConnection;
 
     encoderCallbackType mEncoderCallback;
+
+    mutable std::mutex mStateMutex;
+    CameraState mState;
 };
 
 #endif // CAMERA_HPP
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CAMERA_STATE_HPP
+#define CAMERA_STATE_HPP
+
+#include <chrono>
+#include <cstdint>
+
+/**
+ * A snapshot of the camera settings that go into each frame's metadata.
+ *
+ * Values we set ourselves (ISO, brightness, ...) are recorded by the Camera
+ * setters. Values the firmware changes on its own (gains, exposure) are
+ * updated from camera settings events. Building a frame's metadata is then
+ * just a copy of this struct instead of a round trip to the VideoCore per
+ * value.
+ *
+ * Each field remembers when it was last updated, so consumers can tell how
+ * fresh it is.
+ */
+struct CameraState {
+  using Clock = std::chrono::steady_clock;
+
+  enum Field {
+    ANALOG_GAIN,
+    DIGITAL_GAIN,
+    AWB_GAIN_RED,
+    AWB_GAIN_BLUE,
+    EXPOSURE_SPEED,
+    ISO,
+    BRIGHTNESS,
+    CONTRAST,
+    SATURATION,
+    SHARPNESS,
+    SHUTTER_SPEED,
+    NUM_FIELDS,
+  };
+
+  float analogGain = 0.0f;
+  float digitalGain = 0.0f;
+  float awbGainRed = 0.0f;
+  float awbGainBlue = 0.0f;
+  // Exposure time actually used, in microseconds
+  uint32_t exposureSpeed = 0;
+  uint32_t iso = 0;
+  float brightness = 0.0f;
+  float contrast = 0.0f;
+  float saturation = 0.0f;
+  float sharpness = 0.0f;
+  // Requested shutter speed, in microseconds
+  uint32_t shutterSpeed = 0;
+
+  // When each field was last updated. A default-constructed time point means
+  // the field has never been set.
+  Clock::time_point updated[NUM_FIELDS] = {};
+
+  bool valid(Field field) const {
+    return updated[field] != Clock::time_point{};
+  }
+
+  /**
+   * How long ago field was updated, in microseconds, or -1 if it never was.
+   */
+  int64_t ageUs(Field field, Clock::time_point now = Clock::now()) const {
+    if (!valid(field)) {
+      return -1;
+    }
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        now - updated[field]).count();
+  }
+
+  void touch(Field field, Clock::time_point now = Clock::now()) {
+    updated[field] = now;
+  }
+};
+
+#endif // CAMERA_STATE_HPP
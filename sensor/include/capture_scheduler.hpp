@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CAPTURE_SCHEDULER_HPP
+#define CAPTURE_SCHEDULER_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+
+/**
+ * Decides when to start each still capture.
+ *
+ * Captures are taken in bursts of burstCount frames. Within a burst, the next
+ * capture is triggered as soon as the previous frame comes back from the
+ * encoder (frameCaptured()), so there is no polling delay between frames.
+ * After each burst the scheduler waits settleTime, and bursts start no more
+ * often than once per interval.
+ *
+ * The trigger is any callable that starts a capture (Camera::enableCapture()
+ * on the Pi), so the scheduler can be driven by a simulated frame source.
+ */
+class CaptureScheduler {
+  public:
+    using Clock = std::chrono::steady_clock;
+    using Duration = std::chrono::milliseconds;
+    using Trigger = std::function<bool()>;
+
+    struct Config {
+      // Wait before the first capture, e.g. for exposure to settle
+      Duration initialDelay = Duration{0};
+      // Minimum time from the start of one burst to the start of the next
+      Duration interval = Duration{0};
+      // Frames per burst
+      unsigned burstCount = 1;
+      // Wait after the last frame of a burst
+      Duration settleTime = Duration{0};
+      // Give up if a triggered frame doesn't arrive within this long
+      Duration frameTimeout = Duration{120000};
+    };
+
+    CaptureScheduler(const Config& config, Trigger trigger);
+
+    CaptureScheduler(const CaptureScheduler&) = delete;
+    CaptureScheduler& operator=(const CaptureScheduler&) = delete;
+
+    /**
+     * Signal that a frame has been handed back by the encoder. Safe to call
+     * from the encoder callback thread.
+     */
+    void frameCaptured();
+
+    /**
+     * Trigger captures until frameCount frames have arrived, stop() is called,
+     * the trigger fails, or a frame times out.
+     *
+     * @return true if frameCount frames were captured.
+     */
+    bool run(unsigned frameCount);
+
+    /**
+     * Make run() return as soon as possible.
+     */
+    void stop();
+
+    unsigned framesCaptured() const;
+
+  private:
+    /**
+     * Sleep until deadline or stop(). Returns false if stopped.
+     */
+    bool sleepUntil(std::unique_lock<std::mutex>& lock,
+                    Clock::time_point deadline);
+
+    const Config mConfig;
+    Trigger mTrigger;
+
+    mutable std::mutex mMutex;
+    std::condition_variable mCv;
+    unsigned mCaptured;
+    bool mStopped;
+};
+
+#endif // CAPTURE_SCHEDULER_HPP
@@ -0,0 +1,258 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CHUNK_FRAMING_HPP
+#define CHUNK_FRAMING_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "frame_assembler.hpp"
+
+#include "picam.pb.h"
+
+/**
+ * Chunked wire framing for Image messages, so a frame can go out while it's
+ * still being encoded, and a transfer cut short by a dropped connection can
+ * pick up where it left off.
+ *
+ * A frame goes out as DATA records, each carrying the bytes at some offset
+ * in the frame, followed by an END record carrying the rest of the Image
+ * (metadata and detections) serialized without its data. ABORT tells the
+ * receiver to forget a frame. Records have a fixed 36-byte header, then the
+ * payload. All fields are big-endian.
+ *
+ *   0  magic "PCCH"
+ *   4  version (1)
+ *   5  type (see Type)
+ *   6  reserved, 0
+ *   8  index of the record within its frame
+ *  12  frame id, unique to the sensor
+ *  20  DATA: offset of the payload in the frame; END and ABORT: frame size
+ *  28  payload size
+ *  32  CRC32C of bytes 0-31 and the payload
+ *
+ * The receiver acknowledges on the same connection with 24-byte acks:
+ *
+ *   0  magic "PCAK"
+ *   4  version (1)
+ *   5  flags (see AckFlags)
+ *   6  reserved, 0
+ *   8  frame id
+ *  16  bytes of the frame received so far, in order
+ *
+ * The sender keeps every record until it's acknowledged. The receiver keeps
+ * partly received frames across connections, and starts each connection
+ * with an ack for every one of them, then one for frame id 0 to say that's
+ * all, so after a reconnect the sender only sends again what's missing.
+ * Bytes the receiver already has are skipped. A record that
+ * doesn't follow on from what the receiver has (because one went missing or
+ * failed its CRC) gets an ack with RESEND set, once per gap.
+ */
+namespace ChunkFraming {
+
+enum Type : uint8_t {
+  DATA = 0,
+  END = 1,
+  ABORT = 2,
+};
+
+enum AckFlags : uint8_t {
+  // The frame is complete (or was aborted); forget it
+  COMPLETE = 0x01,
+  // Something went missing: send the frame again from the ack's offset
+  RESEND = 0x02,
+};
+
+const size_t HEADER_SIZE = 36;
+const size_t ACK_SIZE = 24;
+const uint8_t VERSION = 1;
+const uint32_t MAX_PAYLOAD_SIZE = 16 * 1024 * 1024;
+
+struct RecordHeader {
+  uint8_t type;
+  uint32_t index;
+  uint64_t frameId;
+  uint64_t offset;
+  uint32_t payloadSize;
+};
+
+struct Ack {
+  uint8_t flags;
+  uint64_t frameId;
+  uint64_t offset;
+};
+
+/**
+ * A record ready to be (re)sent: its encoded header, and a reference to
+ * the frame so the payload stays put until it's acknowledged.
+ */
+struct Record {
+  RecordHeader header;
+  uint8_t encoded[HEADER_SIZE];
+  FramePtr frame;
+  // DATA: payload, inside frame
+  const uint8_t* data;
+  // END: payload
+  std::string trailer;
+
+  const uint8_t* payload() const {
+    return (header.type == END)
+      ? reinterpret_cast<const uint8_t*>(trailer.data()) : data;
+  }
+};
+
+/**
+ * Encode header (including the CRC over it and payload, which must be
+ * header.payloadSize bytes) into out.
+ */
+void encodeHeader(const RecordHeader& header, const uint8_t* payload,
+                  uint8_t* out);
+
+/**
+ * @return false if in doesn't look like a record header.
+ */
+bool decodeHeader(const uint8_t* in, RecordHeader& header);
+
+/**
+ * Check the CRC in the encoded header in against it and its payload.
+ */
+bool checkCrc(const uint8_t* in, const uint8_t* payload, size_t payloadSize);
+
+void encodeAck(const Ack& ack, uint8_t* out);
+
+/**
+ * @return false if in doesn't look like an ack.
+ */
+bool decodeAck(const uint8_t* in, Ack& ack);
+
+/**
+ * The END payload: an Image with metadata and detections and no data.
+ */
+void encodeTrailer(const Image::Metadata& metadata,
+                   const Detections* detections, std::string& out);
+
+/**
+ * Append DATA records for all of frame, which goes at offset in the frame
+ * being sent: one per chunk, numbered from index. Returns the number of
+ * records added.
+ */
+size_t appendData(uint64_t frameId, uint32_t index, uint64_t offset,
+                  const FramePtr& frame, std::deque<Record>& out);
+
+/**
+ * Append the END record of a frame of frameSize bytes.
+ */
+void appendEnd(uint64_t frameId, uint32_t index, uint64_t frameSize,
+               const Image::Metadata& metadata, const Detections* detections,
+               std::deque<Record>& out);
+
+/**
+ * Append an ABORT record.
+ */
+void appendAbort(uint64_t frameId, std::deque<Record>& out);
+
+/**
+ * Add iovecs for record (header, then payload) to iov.
+ */
+void appendIov(const Record& record, std::vector<struct iovec>& iov);
+
+/**
+ * The receiving end. Feed it bytes as they come off the connection; each
+ * complete frame is passed to the callback as an Image, and the acks to
+ * send back are appended to a buffer. Partly received frames are kept
+ * across connections, up to maxFrames of them.
+ */
+class Receiver {
+  public:
+    typedef std::function<void(uint64_t frameId, Image&& image)> Callback;
+
+    struct Stats {
+      uint64_t records;
+      uint64_t frames;
+      uint64_t aborted;
+      uint64_t crcErrors;
+      // Bytes that arrived again after a resend or reconnect
+      uint64_t duplicateBytes;
+      // Bytes that arrived after a gap, and had to be sent again
+      uint64_t gapBytes;
+      // Bytes skipped looking for the next record header
+      uint64_t skippedBytes;
+    };
+
+    explicit Receiver(Callback callback, size_t maxFrames = 4);
+
+    /**
+     * @param acks Acks to send back are appended to this.
+     */
+    void feed(const uint8_t* data, size_t size, std::string& acks);
+
+    /**
+     * The connection dropped and a new one is starting: forget any partly
+     * received record. Partly received frames are kept.
+     *
+     * @param acks The acks to start the new connection with are appended to
+     *             this.
+     */
+    void newConnection(std::string& acks);
+
+    /**
+     * Bytes of frameId received so far, or 0 if it isn't in progress.
+     */
+    uint64_t received(uint64_t frameId) const;
+
+    const Stats& stats() const {
+      return mStats;
+    }
+
+  private:
+    struct Partial {
+      uint64_t frameId;
+      std::string data;
+      // A RESEND went out for the current gap
+      bool resendRequested;
+    };
+
+    void handleRecord(const RecordHeader& header, const uint8_t* payload,
+                      std::string& acks);
+    Partial* find(uint64_t frameId);
+    Partial& start(uint64_t frameId);
+    void forget(uint64_t frameId);
+    bool completed(uint64_t frameId) const;
+    void resync();
+
+    Callback mCallback;
+    const size_t mMaxFrames;
+    std::vector<uint8_t> mBuffer;
+    size_t mStart;
+    std::deque<Partial> mFrames;
+    // Recently completed frames, so records sent again after their END get
+    // a COMPLETE ack instead of starting the frame over
+    std::deque<uint64_t> mCompleted;
+    Stats mStats;
+};
+
+} // namespace ChunkFraming
+
+#endif // CHUNK_FRAMING_HPP
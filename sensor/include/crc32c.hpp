@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CRC32C_HPP
+#define CRC32C_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * CRC-32C (Castagnoli), as used by iSCSI and ext4. Uses the CPU's CRC
+ * instructions where there are any (SSE4.2 on x86, the CRC extension on
+ * ARMv8), and a table otherwise.
+ *
+ * Pass the previous result as crc to continue a CRC over more data; start
+ * with 0.
+ */
+uint32_t crc32c(const uint8_t* data, size_t size, uint32_t crc = 0);
+
+/**
+ * The table-driven version, whatever the CPU can do.
+ */
+uint32_t crc32cPortable(const uint8_t* data, size_t size, uint32_t crc = 0);
+
+/**
+ * Whether crc32c() has CPU instructions to use.
+ */
+bool crc32cAccelerated();
+
+#endif // CRC32C_HPP
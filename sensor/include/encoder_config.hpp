@@ -99,7 +99,9 @@ struct H264EncoderConfig : public BaseEncoderConfig {
   Profile profile;
   Level level;
 
-  const uint32_t DEFAULT_BITRATE = 17000000;
+  // Static so the delegating default constructor can use it; a non-static
+  // member isn't initialized yet at that point
+  static constexpr uint32_t DEFAULT_BITRATE = 17000000;
 };
 
 struct PNGEncoderConfig : public BaseEncoderConfig {
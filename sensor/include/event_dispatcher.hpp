@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef EVENT_DISPATCHER_HPP
+#define EVENT_DISPATCHER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "analysis_tap.hpp"
+#include "frame_assembler.hpp"
+#include "image_sender.hpp"
+#include "sky_analyser.hpp"
+
+#include "picam.pb.h"
+
+/**
+ * Decides what goes over the network in event mode: for every analysed
+ * frame, an Image with only Detections in it (a few hundred bytes), plus the
+ * full frame or crops of it when a trigger fires.
+ *
+ * - STREAK, STAR_COUNT and PERIODIC send the encoded frame itself, with the
+ *   detections attached.
+ * - TRANSIENT sends a GRAY8 crop of the raw frame around each new bright
+ *   object, with the crop in the metadata's roi_* fields.
+ *
+ * Encoded frames and analysis results meet up by presentation timestamp:
+ * both sides of the camera's splitter carry the capture's PTS, so a frame
+ * lost on one side (a failed buffer, or one the analysis tap had no room
+ * for) doesn't throw off the pairing of the frames after it. Encoded frames
+ * wait (up to Config::pendingFrames of them) until their analysis is in,
+ * and are dropped if nothing wants them.
+ * Analysis results that want a frame that hasn't been encoded yet wait for
+ * it the same way. frameEncoded() and frameAnalysed() may be called from
+ * different threads.
+ */
+class EventDispatcher {
+  public:
+    /**
+     * Hands a message on to be sent, e.g. ImageSender::enqueue().
+     */
+    typedef std::function<bool(QueuedImage&&)> Sink;
+
+    struct Config {
+      // Brightest stars listed in each Detections message
+      size_t maxStars = 32;
+      // Send the frame when there's a streak in it
+      bool streakFrames = true;
+      // Objects at least this far above the background at their peak, with
+      // nothing within matchRadius of them in the previous frame, are
+      // transients; 0 to not look for them
+      uint32_t transientPeak = 100;
+      float matchRadius = 3.0f;
+      // Transients are point-like; bigger components are streaks (which
+      // have a trigger of their own) or the edges of clouds
+      uint32_t transientMaxArea = 64;
+      // Side of the square crop sent around each transient, and how many to
+      // send per frame
+      uint32_t cropSize = 128;
+      size_t maxCrops = 4;
+      // Send the frame when the star count moves more than this fraction
+      // away from its recent average; 0 to never
+      float starCountChange = 0.5f;
+      // Send every this many analysed frames regardless; 0 to never
+      unsigned periodicInterval = 0;
+      // Encoded frames, and analysed ones wanting theirs, kept waiting for
+      // each other
+      size_t pendingFrames = 4;
+    };
+
+    struct Stats {
+      uint64_t analysed;
+      uint64_t fullFrames;
+      uint64_t crops;
+      // Encoded frames nothing wanted
+      uint64_t framesSkipped;
+      // Everything handed to the sink, as it goes on the wire
+      uint64_t bytes;
+    };
+
+    EventDispatcher(const Config& config, Sink sink);
+
+    EventDispatcher(const EventDispatcher&) = delete;
+    EventDispatcher& operator=(const EventDispatcher&) = delete;
+
+    /**
+     * A frame from the encoder, with its metadata filled in. pts is the
+     * capture's, the same as the RawFrame's for it.
+     */
+    void frameEncoded(int64_t pts, QueuedImage&& image);
+
+    /**
+     * What the analysis found in frame, which is only looked at during the
+     * call (for crops). metadata goes into the messages sent for it.
+     */
+    void frameAnalysed(const RawFrame& frame, const SkyAnalyser::Result& result,
+                       const Image::Metadata& metadata);
+
+    Stats stats() const;
+
+  private:
+    struct Pending {
+      int64_t pts;
+      QueuedImage image;
+    };
+
+    // An analysed frame's message, waiting for the frame to go with it
+    struct Wanted {
+      int64_t pts;
+      QueuedImage image;
+    };
+
+    struct Point {
+      float x;
+      float y;
+    };
+
+    /**
+     * Build the Detections message for result, without triggers.
+     */
+    std::unique_ptr<Detections> describe(const RawFrame& frame,
+                                         const SkyAnalyser::Result& result) const;
+
+    /**
+     * Bright stars with nothing near them in the previous frame. Also
+     * remembers this frame's stars for next time.
+     */
+    void findTransients(const SkyAnalyser::Result& result,
+                        std::vector<const Component*>& transients);
+
+    bool starCountJumped(size_t count);
+
+    void sendCrop(const RawFrame& frame, const Component& component,
+                  const Image::Metadata& metadata);
+
+    void send(QueuedImage&& image);
+
+    const Config mConfig;
+    Sink mSink;
+
+    // Only touched by frameAnalysed()
+    std::vector<Point> mPrevious;
+    std::vector<Point> mCurrent;
+    double mStarCountAverage;
+    bool mHaveStarCount;
+    FrameAssembler mCropAssembler;
+
+    mutable std::mutex mMutex;
+    std::deque<Pending> mPending;
+    std::deque<Wanted> mWanted;
+    // Latest PTS each side has seen
+    int64_t mLastEncoded;
+    int64_t mLastAnalysed;
+    Stats mStats;
+};
+
+#endif // EVENT_DISPATCHER_HPP
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FILE_REPLAY_SOURCE_HPP
+#define FILE_REPLAY_SOURCE_HPP
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "frame_source.hpp"
+
+/**
+ * Replays previously captured files, one file per frame. The encoding is
+ * taken from the file extension (.png, .jpg/.jpeg, .h264/.264); PNG
+ * dimensions come from the file itself.
+ */
+class FileReplaySource : public PacedFrameSource {
+  public:
+    struct Config {
+      std::vector<std::string> paths;
+      Pacing pacing{};
+      // Start over after the last file
+      bool loop = false;
+      // Dimensions to report for files that don't carry their own
+      uint32_t width = 0;
+      uint32_t height = 0;
+    };
+
+    explicit FileReplaySource(const Config& config);
+    ~FileReplaySource();
+
+    uint32_t width() const override;
+    uint32_t height() const override;
+    std::string encoding() const override;
+    CameraState stateSnapshot() const override;
+
+    /**
+     * Guess the encoding name from a file's extension.
+     */
+    static std::string encodingForPath(const std::string& path);
+
+  protected:
+    bool produceFrame(FrameAssembler& assembler) override;
+
+  private:
+    const Config mConfig;
+    size_t mNext;
+    std::vector<uint8_t> mReadBuffer;
+
+    // Describes the frame most recently produced
+    mutable std::mutex mMutex;
+    uint32_t mWidth;
+    uint32_t mHeight;
+    std::string mEncoding;
+    CameraState mState;
+};
+
+#endif // FILE_REPLAY_SOURCE_HPP
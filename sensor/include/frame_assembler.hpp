@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAME_ASSEMBLER_HPP
+#define FRAME_ASSEMBLER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Nothing in here depends on MMAL, so frames can be assembled (and the
+// assembler exercised) on any host.
+
+/**
+ * A contiguous piece of an encoded frame.
+ */
+struct FrameChunk {
+  const uint8_t* data;
+  size_t size;
+};
+
+/**
+ * A pool of fixed-size, preallocated slabs. Slabs are handed out to frames
+ * while they are being assembled and come back to the pool when the last
+ * reference to the frame goes away. The pool only grows when it runs dry, so
+ * once it has seen the largest frame there is no more heap traffic.
+ */
+class SlabPool {
+  public:
+    using Slab = std::unique_ptr<uint8_t[]>;
+
+    SlabPool(size_t slabSize, size_t initialSlabs);
+
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    size_t slabSize() const {
+      return mSlabSize;
+    }
+
+    /**
+     * Take a slab from the pool, allocating a new one if none are free.
+     */
+    Slab acquire();
+
+    /**
+     * Return a slab to the pool.
+     */
+    void release(Slab slab);
+
+    /**
+     * Number of slabs currently sitting in the pool.
+     */
+    size_t available() const;
+
+    /**
+     * Number of slabs the pool has allocated over its lifetime.
+     */
+    size_t allocated() const;
+
+    /**
+     * Every slab the pool has allocated, in use or not. Slabs are only freed
+     * with the pool, so these stay valid for as long as it's alive (e.g. to
+     * register them with the kernel).
+     */
+    std::vector<const uint8_t*> slabs() const;
+
+  private:
+    const size_t mSlabSize;
+    mutable std::mutex mMutex;
+    std::vector<Slab> mFree;
+    std::vector<const uint8_t*> mAll;
+    size_t mAllocated;
+};
+
+/**
+ * A complete encoded frame, held as a list of chunks (a scatter/gather view)
+ * rather than one contiguous buffer. The chunks stay valid for as long as the
+ * frame is alive; the slabs backing them are returned to their pool when the
+ * frame is destroyed.
+ */
+class Frame {
+  public:
+    explicit Frame(std::shared_ptr<SlabPool> pool);
+    ~Frame();
+
+    Frame(const Frame&) = delete;
+    Frame& operator=(const Frame&) = delete;
+
+    const std::vector<FrameChunk>& chunks() const {
+      return mChunks;
+    }
+
+    /**
+     * Total number of bytes in the frame.
+     */
+    size_t size() const {
+      return mSize;
+    }
+
+    bool empty() const {
+      return mSize == 0;
+    }
+
+    /**
+     * Presentation timestamp in microseconds, as the source reported it; 0
+     * if it didn't.
+     */
+    int64_t pts() const {
+      return mPts;
+    }
+
+    /**
+     * The pool the frame's chunks come from; each chunk is at the start of
+     * one of its slabs.
+     */
+    const std::shared_ptr<SlabPool>& pool() const {
+      return mPool;
+    }
+
+    /**
+     * Flatten the frame into out (replacing its contents). Only for consumers
+     * that really need contiguous bytes.
+     */
+    void copyTo(std::string& out) const;
+
+  private:
+    friend class FrameAssembler;
+
+    void append(const uint8_t* data, size_t length);
+    void clear();
+
+    std::shared_ptr<SlabPool> mPool;
+    std::vector<SlabPool::Slab> mSlabs;
+    std::vector<FrameChunk> mChunks;
+    size_t mSize;
+    // Bytes used in the last slab
+    size_t mSlabFill;
+    int64_t mPts;
+};
+
+using FramePtr = std::shared_ptr<const Frame>;
+
+/**
+ * Accumulates encoder output buffers into a Frame until the end of the frame
+ * is signalled. Each buffer is copied exactly once, into a pooled slab; the
+ * finished frame is handed out without further copies.
+ *
+ * With a Stream set, buffers are passed straight on to it instead, and the
+ * frames handed out are empty: the stream sees each buffer as it arrives,
+ * and nothing waits for the end of the frame.
+ *
+ * Not thread-safe: buffers for one frame are expected to arrive from a single
+ * callback thread.
+ */
+class FrameAssembler {
+  public:
+    /**
+     * Takes buffers as they come out of the encoder. data is only valid
+     * for the duration of the call.
+     */
+    class Stream {
+      public:
+        virtual ~Stream() = default;
+        virtual void append(const uint8_t* data, size_t length) = 0;
+        /**
+         * The frame so far is no good.
+         */
+        virtual void discard() = 0;
+    };
+
+    /**
+     * @param slabSize Size of each slab in bytes. Should be a multiple of the
+     *                 encoder output buffer size.
+     * @param initialSlabs Number of slabs to preallocate.
+     */
+    FrameAssembler(size_t slabSize, size_t initialSlabs);
+
+    /**
+     * Append a buffer to the frame currently being assembled.
+     */
+    void append(const uint8_t* data, size_t length);
+
+    /**
+     * Finish the current frame and start a new one.
+     *
+     * @param pts The frame's presentation timestamp, if it has one.
+     */
+    FramePtr finish(int64_t pts = 0);
+
+    /**
+     * Drop the frame currently being assembled, e.g. after a failed
+     * transmission.
+     */
+    void discard();
+
+    /**
+     * Pass buffers on to stream from now on, or keep them again if nullptr.
+     */
+    void setStream(Stream* stream) {
+      mStream = stream;
+    }
+
+    /**
+     * Number of bytes in the frame currently being assembled.
+     */
+    size_t pending() const {
+      return mCurrent->size();
+    }
+
+    const SlabPool& pool() const {
+      return *mPool;
+    }
+
+  private:
+    std::shared_ptr<SlabPool> mPool;
+    std::unique_ptr<Frame> mCurrent;
+    Stream* mStream;
+};
+
+#endif // FRAME_ASSEMBLER_HPP
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAME_SOURCE_HPP
+#define FRAME_SOURCE_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "camera_state.hpp"
+#include "frame_assembler.hpp"
+
+/**
+ * Anything that produces encoded frames: the Pi camera, or a stand-in that
+ * lets the rest of the pipeline run on a machine without one.
+ */
+class FrameSource {
+  public:
+    /**
+     * Called once per complete frame, on the source's own thread.
+     */
+    typedef std::function<size_t(FrameSource&, const FramePtr& frame)> FrameCallback;
+
+    virtual ~FrameSource() = default;
+
+    /**
+     * Start delivering frames to callback.
+     */
+    virtual bool start(FrameCallback callback) = 0;
+
+    /**
+     * Stop delivering frames.
+     */
+    virtual bool stop() = 0;
+
+    /**
+     * Start capturing the next frame.
+     */
+    virtual bool requestCapture() = 0;
+
+    /**
+     * Hand encoder output to stream buffer by buffer as it comes out, rather
+     * than whole frames to the frame callback, which then gets an empty
+     * frame at the end of each one. nullptr to go back to whole frames. Call
+     * before start().
+     */
+    virtual void setStream(FrameAssembler::Stream* stream) = 0;
+
+    virtual uint32_t width() const = 0;
+    virtual uint32_t height() const = 0;
+
+    /**
+     * Encoding of the frames, as it goes into Image.Metadata.encoding.
+     */
+    virtual std::string encoding() const = 0;
+
+    /**
+     * Settings the frames were captured with.
+     */
+    virtual CameraState stateSnapshot() const = 0;
+};
+
+/**
+ * Base for sources that generate frames on their own thread at a fixed
+ * rate, either free-running (like video) or one per requestCapture() (like
+ * stills).
+ */
+class PacedFrameSource : public FrameSource {
+  public:
+    struct Pacing {
+      // Frames per second. For stills, the rate a requested frame is ready
+      // at, i.e. 1 / exposure time.
+      double frameRate = 1.0;
+      // Deliver frames continuously instead of waiting for requestCapture()
+      bool freeRunning = false;
+      // Frames are fed to the assembler in pieces this big, like encoder
+      // output buffers
+      size_t bufferSize = 81920;
+    };
+
+    virtual ~PacedFrameSource();
+
+    bool start(FrameCallback callback) override;
+    bool stop() override;
+    bool requestCapture() override;
+    void setStream(FrameAssembler::Stream* stream) override;
+
+    /**
+     * Number of frames delivered so far.
+     */
+    uint64_t framesDelivered() const {
+      return mFramesDelivered.load();
+    }
+
+  protected:
+    explicit PacedFrameSource(const Pacing& pacing);
+
+    /**
+     * Produce the next frame by appending it to assembler, at most
+     * bufferSize bytes at a time. Return false if there are no more frames.
+     */
+    virtual bool produceFrame(FrameAssembler& assembler) = 0;
+
+    /**
+     * Append data to assembler in bufferSize pieces.
+     */
+    void appendBuffers(FrameAssembler& assembler, const uint8_t* data,
+                       size_t size) const;
+
+    const Pacing mPacing;
+
+  private:
+    void run();
+
+    FrameCallback mCallback;
+    FrameAssembler mAssembler;
+    std::thread mThread;
+    std::mutex mMutex;
+    std::condition_variable mCv;
+    bool mRunning;
+    unsigned mRequested;
+    std::atomic<uint64_t> mFramesDelivered;
+};
+
+#endif // FRAME_SOURCE_HPP
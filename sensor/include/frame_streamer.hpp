@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef FRAME_STREAMER_HPP
+#define FRAME_STREAMER_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "frame_assembler.hpp"
+#include "image_sender.hpp"
+
+#include "picam.pb.h"
+
+/**
+ * Streams frames to an ImageSender (with Config::chunked set) buffer by
+ * buffer as the encoder produces them, instead of waiting for the whole
+ * frame. Set it as a FrameSource's stream, and call finish() from the frame
+ * callback with the frame's metadata.
+ *
+ * Each buffer is copied into a pooled piece of its own and queued as soon as
+ * it arrives, so the first bytes go out one encoder buffer after the frame
+ * starts, and a piece goes back to the pool once the receiver has
+ * acknowledged it: only the part of a frame that hasn't been acknowledged
+ * yet is ever held in memory. A piece that doesn't fit in the sender's
+ * queue is dropped, and the sender gives up on the rest of that frame.
+ *
+ * Called from the frame source's thread; stats() from anywhere.
+ */
+class FrameStreamer : public FrameAssembler::Stream {
+  public:
+    struct Stats {
+      uint64_t frames;
+      // Pieces of frame data
+      uint64_t pieces;
+      uint64_t bytes;
+      // Pieces (including ENDs) the sender's queue had no room for
+      uint64_t dropped;
+      // Pieces the pool has allocated; it only grows when the uplink falls
+      // behind
+      size_t piecesAllocated;
+    };
+
+    /**
+     * @param pieceSize Largest piece, e.g. the encoder's output buffer size.
+     *                  Bigger buffers are split.
+     * @param initialPieces Pieces to preallocate.
+     */
+    FrameStreamer(ImageSender& sender, size_t pieceSize, size_t initialPieces);
+
+    FrameStreamer(const FrameStreamer&) = delete;
+    FrameStreamer& operator=(const FrameStreamer&) = delete;
+
+    void append(const uint8_t* data, size_t length) override;
+    void discard() override;
+
+    /**
+     * The frame is complete; send its metadata (and detections) after it.
+     */
+    void finish(const Image::Metadata& metadata,
+                std::unique_ptr<Detections> detections = nullptr);
+
+    Stats stats() const;
+
+  private:
+    void startFrame();
+    void enqueue(QueuedImage&& piece);
+
+    ImageSender& mSender;
+    const size_t mPieceSize;
+    FrameAssembler mPieces;
+
+    // Frame being streamed; 0 between frames
+    uint64_t mFrameId;
+    uint32_t mIndex;
+    uint64_t mOffset;
+
+    std::atomic<uint64_t> mFrames;
+    std::atomic<uint64_t> mPiecesSent;
+    std::atomic<uint64_t> mBytes;
+    std::atomic<uint64_t> mDropped;
+};
+
+#endif // FRAME_STREAMER_HPP
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H264_STREAM_HPP
+#define H264_STREAM_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+#include "frame_assembler.hpp"
+
+namespace H264 {
+
+/**
+ * NAL unit types we care about (H.264 table 7-1).
+ */
+enum NalType : uint8_t {
+  NAL_SLICE = 1,
+  NAL_IDR_SLICE = 5,
+  NAL_SEI = 6,
+  NAL_SPS = 7,
+  NAL_PPS = 8,
+  NAL_AUD = 9,
+  NAL_END_OF_SEQUENCE = 10,
+  NAL_END_OF_STREAM = 11,
+  NAL_FILLER = 12,
+};
+
+/**
+ * Same value as MMAL_TIME_UNKNOWN.
+ */
+const int64_t PTS_UNKNOWN = INT64_MIN;
+
+/**
+ * One access unit (a coded picture, plus any parameter sets and SEI that
+ * precede it) as an Annex B byte stream, start codes included.
+ */
+struct AccessUnit {
+  FramePtr data;
+  // Presentation timestamp in microseconds, or PTS_UNKNOWN
+  int64_t ptsUs;
+  // Contains a coded picture, not just parameter sets or SEI
+  bool hasPicture;
+  // Contains an IDR slice: decoding can start here
+  bool keyframe;
+  // Contains an SPS or PPS
+  bool config;
+};
+
+} // namespace H264
+
+/**
+ * Splits an Annex B H.264 byte stream into access units as it arrives.
+ *
+ * Bytes go straight into a FrameAssembler (one copy, like still frames), and
+ * start codes are tracked as they go by, so a unit is handed out as soon as
+ * the next one starts--or as soon as endAccessUnit() is called, e.g. on
+ * MMAL_BUFFER_HEADER_FLAG_FRAME_END--rather than when a whole encoder frame
+ * has been collected. Start codes may be split across append() calls.
+ *
+ * Like FrameAssembler, not thread-safe.
+ */
+class AccessUnitSplitter {
+  public:
+    typedef std::function<void(H264::AccessUnit&& unit)> Callback;
+
+    /**
+     * @param slabSize, initialSlabs See FrameAssembler.
+     * @param callback Called with each complete access unit.
+     */
+    AccessUnitSplitter(size_t slabSize, size_t initialSlabs,
+                       Callback callback);
+
+    /**
+     * Append part of the byte stream.
+     *
+     * @param ptsUs Timestamp of the picture these bytes belong to, if known.
+     */
+    void append(const uint8_t* data, size_t size,
+                int64_t ptsUs = H264::PTS_UNKNOWN);
+
+    /**
+     * The stream is at an access unit boundary: hand out whatever has been
+     * appended.
+     */
+    void endAccessUnit();
+
+    /**
+     * Drop the access unit currently being assembled.
+     */
+    void discard();
+
+    uint64_t nalUnits() const {
+      return mNalUnits;
+    }
+
+    uint64_t accessUnits() const {
+      return mAccessUnits;
+    }
+
+  private:
+    enum class ScanState {
+      // Looking for a start code
+      SCAN,
+      // Saw a start code, next byte is the NAL header
+      HEADER,
+      // Saw a slice NAL header, next byte starts first_mb_in_slice
+      SLICE,
+    };
+
+    void hold(uint8_t byte);
+    void releaseHeld();
+    void startNal(uint8_t nalType, bool firstSliceInPicture);
+    void emit();
+    void reset();
+
+    FrameAssembler mAssembler;
+    Callback mCallback;
+
+    ScanState mState;
+    unsigned mZeros;
+    uint8_t mNalType;
+    // Bytes that might be the start of the next access unit (a start code, NAL
+    // header and first slice byte), held back until we know which unit they
+    // belong to.
+    uint8_t mHeld[8];
+    size_t mHeldSize;
+
+    // The access unit being assembled
+    int64_t mBufferPts;
+    int64_t mPts;
+    bool mHasSlice;
+    bool mKeyframe;
+    bool mConfig;
+
+    uint64_t mNalUnits;
+    uint64_t mAccessUnits;
+};
+
+#endif // H264_STREAM_HPP
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IMAGE_FRAMING_HPP
+#define IMAGE_FRAMING_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "frame_assembler.hpp"
+
+#include "picam.pb.h"
+
+/**
+ * Wire framing for Image messages.
+ *
+ * On the wire, each message is a 4-byte big-endian length followed by a
+ * serialized Image. Instead of building the Image and serializing it (which
+ * copies the image data twice), the small part of the message--the length
+ * prefix, the metadata field and the tag and length of the data field--is
+ * encoded by hand into a caller-provided buffer. The data field's payload is
+ * then the frame's chunks, so header and chunks can go to the kernel with a
+ * single writev()/sendmsg(). Detections, if any, come last, after the data.
+ *
+ * The bytes produced are identical to Image::SerializeToString() for a
+ * message with the same metadata and data.
+ */
+namespace ImageFraming {
+
+/**
+ * Header buffer size that's big enough for any metadata we send.
+ */
+const size_t MAX_HEADER_SIZE = 1024;
+
+/**
+ * Encode the length prefix and everything in the Image message that comes
+ * before the data bytes. The length covers detections too, if given; they
+ * have to be sent after the data with encodeTrailer().
+ *
+ * @return Number of bytes written to out, or 0 if out is too small.
+ */
+size_t encodeHeader(const Image::Metadata& metadata, size_t dataSize,
+                    uint8_t* out, size_t outSize,
+                    const Detections* detections = nullptr);
+
+/**
+ * Encode the detections field, which follows the data bytes, replacing the
+ * contents of out. Call after encodeHeader(), which caches the size.
+ */
+void encodeTrailer(const Detections& detections, std::string& out);
+
+/**
+ * Size of the serialized Image message (not counting the length prefix).
+ * detectionsSize is the size of the serialized Detections, or -1 for none.
+ */
+size_t messageSize(size_t metadataSize, size_t dataSize,
+                   ssize_t detectionsSize = -1);
+
+/**
+ * Write all of iov to fd with as few sendmsg() calls as possible, handling
+ * short writes.
+ *
+ * @param syscalls If not null, incremented once per sendmsg() call.
+ * @return Number of bytes written, or -1 on error.
+ */
+ssize_t writeAll(int fd, struct iovec* iov, size_t iovCount,
+                 uint64_t* syscalls = nullptr);
+
+/**
+ * Frame and write one Image (metadata plus the frame's chunks, and
+ * detections if not null) to fd.
+ *
+ * @return Number of bytes written including the length prefix, or -1 on
+ *         error.
+ */
+ssize_t writeImage(int fd, const Image::Metadata& metadata,
+                   const Frame* frame, uint64_t* syscalls = nullptr,
+                   const Detections* detections = nullptr);
+
+/**
+ * Frame one Image into memory instead, e.g. a shared-memory slot: the same
+ * bytes writeImage() would write.
+ *
+ * @return Number of bytes written including the length prefix, or -1 if it
+ *         doesn't fit in outSize.
+ */
+ssize_t copyImage(uint8_t* out, size_t outSize,
+                  const Image::Metadata& metadata, const Frame* frame,
+                  const Detections* detections = nullptr);
+
+} // namespace ImageFraming
+
+#endif // IMAGE_FRAMING_HPP
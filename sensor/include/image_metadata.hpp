@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IMAGE_METADATA_HPP
+#define IMAGE_METADATA_HPP
+
+#include "frame_source.hpp"
+
+#include "picam.pb.h"
+
+/**
+ * Fill in a frame's metadata from the source's cached state. Nothing is
+ * queried from the camera here, so this is cheap enough for every frame.
+ */
+void fillImageMetadata(Image::Metadata& imageMeta, const FrameSource& source);
+
+#endif // IMAGE_METADATA_HPP
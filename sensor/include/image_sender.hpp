@@ -0,0 +1,372 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IMAGE_SENDER_HPP
+#define IMAGE_SENDER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <sys/types.h>
+
+#include "bounded_queue.hpp"
+#include "chunk_framing.hpp"
+#include "frame_assembler.hpp"
+#include "local_transport.hpp"
+#include "spool.hpp"
+#include "uring_sender.hpp"
+#include "video_framing.hpp"
+
+#include "picam.pb.h"
+
+/**
+ * A completed frame waiting to be sent, along with its metadata.
+ */
+struct QueuedImage {
+  Image::Metadata metadata;
+  FramePtr frame;
+  // What was found in the frame, if it was analysed. The frame may then be
+  // empty, or a crop.
+  std::unique_ptr<Detections> detections;
+  // Set for streamed video: frame is an H.264 access unit, sent as a
+  // VideoFraming record instead of an Image message. The producer numbers
+  // access units consecutively in videoHeader.sequence so the sender can
+  // tell when some were dropped; the sequence number on the wire is the
+  // sender's own.
+  bool isVideo = false;
+  VideoFraming::RecordHeader videoHeader{};
+  // Set for a piece of a frame being streamed to a chunked sender (see
+  // FrameStreamer). chunkHeader gives the type, frame id, index and offset;
+  // frame holds a DATA piece, and metadata and detections go with END.
+  bool isChunk = false;
+  ChunkFraming::RecordHeader chunkHeader{};
+};
+
+/**
+ * Represents a TCP connection to the receiver service. Call connect() to
+ * establish the connection.
+ *
+ * Frames can either be sent synchronously with send(), or handed to
+ * enqueue(), which puts them on a bounded queue drained by a dedicated sender
+ * thread (see start()). The latter never blocks the caller unless the
+ * overflow policy is BLOCK, so a slow uplink doesn't stall the encoder.
+ *
+ * If the connection drops, the sender thread keeps trying to reconnect, with
+ * exponential backoff. With a spool directory configured, Image frames that
+ * can't be sent in the meantime go to a Spool on disk, and are sent again
+ * (backfilled) once the connection is back, rate limited and only when there
+ * are no live frames waiting.
+ *
+ * Queued H.264 access units are sent as VideoFraming records. A connection is
+ * expected to carry either Image messages or video, not both. Video isn't
+ * spooled: a late stream is little use, so after a reconnect it just picks
+ * up again at the next keyframe.
+ *
+ * With Config::chunked, frames go out as ChunkFraming records instead, and
+ * are kept until the receiver acknowledges them, with at most
+ * Config::chunkWindow bytes in flight. A frame cut short by a dropped
+ * connection carries on from where the receiver got to once the connection
+ * is back, instead of starting over. Frames can also be streamed in pieces
+ * as they're encoded (isChunk); a frame missing a piece is abandoned. Frames
+ * finished while disconnected go to the spool, if there is one.
+ *
+ * With Config::ioUring, Image messages and video records go through a
+ * UringSender instead of a sendmsg() each: frames that queue up while one is
+ * being sent go out together, and big frame chunks are sent zero-copy. A
+ * frame isn't counted as sent (or let go of) until its send has completed;
+ * frames whose sends fail are spooled, as with blocking sends.
+ */
+class ImageSender {
+  public:
+    /**
+     * What enqueue() does when the queue is full.
+     */
+    enum class OverflowPolicy {
+      // Throw away the oldest queued frame to make room
+      DROP_OLDEST,
+      // Throw away the frame being enqueued
+      DROP_NEWEST,
+      // Wait for the sender thread to make room
+      BLOCK,
+    };
+
+    enum class Transport {
+      TCP,
+      // Publish to readers on this host through a shared-memory ring, or
+      // a memfd per frame; see LocalTransport
+      SHM_RING,
+      UNIX_FD,
+    };
+
+    struct Config {
+      Transport transport = Transport::TCP;
+      std::string serverHostname;
+      int serverPort;
+      size_t queueCapacity = 4;
+      OverflowPolicy overflowPolicy = OverflowPolicy::DROP_OLDEST;
+      // Where to keep frames while disconnected. Empty to drop them instead.
+      std::string spoolDirectory;
+      size_t spoolSegmentSize = 16 << 20;
+      uint64_t spoolMaxBytes = 1ULL << 30;
+      // Spooled data sent per second once reconnected; 0 for no limit
+      uint64_t backfillRate = 1 << 20;
+      // Reconnect attempts start this far apart and double up to the max
+      std::chrono::milliseconds reconnectDelay{500};
+      std::chrono::milliseconds maxReconnectDelay{30000};
+      std::chrono::milliseconds connectTimeout{5000};
+      // A send that makes no progress for this long counts as a dropped
+      // connection
+      std::chrono::milliseconds sendTimeout{10000};
+      // Send ChunkFraming records, with acknowledgements, instead of Image
+      // messages
+      bool chunked = false;
+      // Unacknowledged bytes in flight; past this, sending waits for acks
+      size_t chunkWindow = 4 << 20;
+      // Unacknowledged bytes to hold on to while disconnected (and not
+      // spooled); past this, the oldest frames are given up on. Leave room
+      // above chunkWindow for what arrives before the connection is back.
+      size_t chunkMaxBytes = 16 << 20;
+      // Local transports: the socket readers connect to, and the ring's
+      // shape (or, passing fds, how many frames a reader may hold)
+      std::string localPath;
+      size_t localSlots = 4;
+      size_t localSlotSize = 16 << 20;
+      // TCP, not chunked: send through io_uring, falling back to blocking
+      // sends if it's not available. With ioUringSqPoll, a kernel thread
+      // picks up sends, so there's no syscall per batch while it's busy.
+      bool ioUring = false;
+      bool ioUringSqPoll = false;
+      // Frame chunks at least this big are sent zero-copy; 0 for never
+      size_t ioUringZeroCopyThreshold = 64 << 10;
+    };
+
+    struct Stats {
+      size_t queueDepth;
+      size_t queueHighWater;
+      uint64_t enqueued;
+      uint64_t sent;
+      uint64_t droppedOldest;
+      uint64_t droppedNewest;
+      uint64_t sendFailures;
+      uint64_t bytesSent;
+      uint64_t syscalls;
+      uint64_t reconnects;
+      uint64_t spooled;
+      uint64_t backfilled;
+      uint64_t spoolBytes;
+      // Chunked: bytes sent again after a reconnect or on request, frames
+      // given up on, and acks received
+      uint64_t chunkResentBytes;
+      uint64_t chunkFramesAborted;
+      uint64_t chunkAcks;
+      size_t chunkOutstandingBytes;
+      // Local transports: readers connected now
+      size_t localReaders;
+      // io_uring: batches submitted, and bytes sent zero-copy
+      uint64_t uringBatches;
+      uint64_t uringZeroCopyBytes;
+      // Time spent in blocking sends (and waiting on io_uring ones), for an
+      // idea of how much the link can take: bytesSent over this is close to
+      // its throughput once it's the bottleneck
+      uint64_t sendBusyUs;
+    };
+
+    ImageSender(const Config& config);
+    ~ImageSender();
+
+    ImageSender(const ImageSender&) = delete;
+    ImageSender& operator=(const ImageSender&) = delete;
+
+    /**
+     * Connect to the receiver, giving up after Config::connectTimeout. With
+     * a local transport, start listening for readers instead.
+     */
+    bool connect();
+
+    /**
+     * Close the socket (close the TCP connection).
+     */
+    void disconnect();
+
+    bool connected() const {
+      return mConnected.load();
+    }
+
+    /**
+     * Start the sender thread, opening the spool first if there is one.
+     */
+    bool start();
+
+    /**
+     * Send whatever is still queued, then stop the sender thread. Anything
+     * that can't be sent stays in the spool for next time.
+     */
+    void stop();
+
+    /**
+     * Queue a frame for the sender thread. Returns false if the frame was
+     * dropped. Several threads (e.g. pipelines sharing the sender) may call
+     * this; they take turns.
+     */
+    bool enqueue(QueuedImage&& image);
+
+    /**
+     * A new id for a chunked frame. Ids are seeded from the clock, so they
+     * don't repeat across restarts.
+     */
+    uint64_t newFrameId() {
+      return mNextFrameId++;
+    }
+
+    Stats stats() const;
+
+  private:
+    using Clock = std::chrono::steady_clock;
+    // Sends one video record: a header and its payload
+    typedef std::function<ssize_t(const VideoFraming::RecordHeader& header,
+                                  const FramePtr& payload)> RecordWriter;
+
+    // A frame handed to the UringSender whose send hasn't completed
+    struct InFlight {
+      QueuedImage image;
+      // Video: parameter sets repeated ahead of the frame
+      FramePtr config;
+      size_t bytes;
+    };
+
+    void run();
+    void sendQueued(QueuedImage& image);
+    ssize_t sendVideoRecord(QueuedImage& image, const RecordWriter& write);
+    bool spool(QueuedImage& image);
+    void connectionLost();
+    void reconnect(Clock::time_point now);
+    bool backfill(Clock::time_point now, Clock::time_point& wakeAt);
+    void waitForItems(Clock::time_point wakeAt);
+    void waitForSpace();
+
+    // Chunked transfer
+    void queueChunked(QueuedImage& image);
+    void queueChunk(QueuedImage& image);
+    void recordsAdded(size_t first);
+    bool sendRecords(size_t first, uint64_t onlyFrame, uint64_t fromOffset,
+                     bool resend);
+    void waitForWindow();
+    bool readAcks(std::chrono::milliseconds timeout);
+    void handleAck(const ChunkFraming::Ack& ack);
+    void eraseAcked(uint64_t frameId, uint64_t offset, bool complete);
+    void abandonFrame(uint64_t frameId);
+    void spoolOutstanding();
+    void trimOutstanding();
+    void checkAckProgress(Clock::time_point now);
+
+    // io_uring
+    void openUring();
+    void queueUring(QueuedImage& image);
+    void flushUring();
+    size_t completeUring(std::chrono::milliseconds timeout);
+    void reapUring(std::chrono::milliseconds timeout);
+    void drainUring();
+
+    Config mConfig;
+    std::atomic<bool> mConnected;
+    int mSocket;
+
+    // Reconnect and backfill state, only touched by the sender thread
+    std::unique_ptr<Spool> mSpool;
+    // Local transports only; then mSocket is unused
+    std::unique_ptr<LocalTransport::Publisher> mLocal;
+    std::chrono::milliseconds mReconnectDelay;
+    Clock::time_point mNextConnect;
+    // Token bucket for backfill; goes negative after a record bigger than
+    // what's in it
+    double mBackfillBudget;
+    Clock::time_point mBackfillRefilled;
+
+    BoundedQueue<QueuedImage> mQueue;
+    // Held for the whole of enqueue(), including a BLOCK wait for space.
+    // The queue itself takes any number of producers; this makes them take
+    // turns, so at most one is ever asleep on mSpaceCv and mProducerWaiting
+    // can be a flag rather than a count.
+    std::mutex mProducerMutex;
+    std::thread mThread;
+    std::atomic<bool> mRunning;
+
+    // Only used to put the sender thread (or the BLOCKing producer) to sleep;
+    // the sender thread pops without taking a lock.
+    std::mutex mWaitMutex;
+    std::condition_variable mItemsCv;
+    std::condition_variable mSpaceCv;
+    std::atomic<bool> mSenderWaiting;
+    std::atomic<bool> mProducerWaiting;
+
+    std::atomic<size_t> mQueueHighWater;
+    std::atomic<uint64_t> mEnqueued;
+    std::atomic<uint64_t> mSent;
+    std::atomic<uint64_t> mDroppedOldest;
+    std::atomic<uint64_t> mDroppedNewest;
+    std::atomic<uint64_t> mSendFailures;
+    std::atomic<uint64_t> mBytesSent;
+    std::atomic<uint64_t> mSyscalls;
+    std::atomic<uint64_t> mReconnects;
+    std::atomic<uint64_t> mSpooled;
+    std::atomic<uint64_t> mBackfilled;
+
+    // Video stream state, only touched by the sender thread
+    bool mVideoStarted;
+    uint32_t mNextVideoIndex;
+    uint32_t mVideoSequence;
+    bool mLastVideoWasConfig;
+    FramePtr mVideoConfig;
+
+    std::atomic<uint64_t> mNextFrameId;
+    std::atomic<uint64_t> mChunkResentBytes;
+    std::atomic<uint64_t> mChunkFramesAborted;
+    std::atomic<uint64_t> mChunkAcks;
+    std::atomic<size_t> mOutstandingBytes;
+
+    // Chunked state, only touched by the sender thread. Records are kept,
+    // oldest first, until acknowledged.
+    std::deque<ChunkFraming::Record> mOutstanding;
+    std::string mAckBuffer;
+    Clock::time_point mAckProgress;
+    // The receiver has said what it has since the last reconnect
+    bool mResumed;
+    // Frame being streamed in pieces, and where its next piece should start
+    uint64_t mStreamFrame;
+    uint32_t mStreamIndex;
+    uint64_t mStreamOffset;
+    // Pieces of this frame are dropped
+    uint64_t mAbandonedFrame;
+
+    // io_uring state, only touched by the sender thread. Frames are kept,
+    // oldest first, until their sends complete.
+    std::unique_ptr<UringSender> mUring;
+    std::deque<InFlight> mInFlight;
+    std::atomic<uint64_t> mUringBatches;
+    std::atomic<uint64_t> mUringZeroCopyBytes;
+
+    std::atomic<uint64_t> mSendBusyUs;
+};
+
+#endif // IMAGE_SENDER_HPP
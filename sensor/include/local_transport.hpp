@@ -0,0 +1,323 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOCAL_TRANSPORT_HPP
+#define LOCAL_TRANSPORT_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "frame_assembler.hpp"
+
+#include "picam.pb.h"
+
+/**
+ * Hands frames to readers on the same host (e.g. the processing service)
+ * without going through TCP loopback, which copies every frame into the
+ * kernel and back out again.
+ *
+ * Readers connect to a Unix-domain socket at a path, and are sent what they
+ * need to map frames as the sensor publishes them: each frame is copied once,
+ * into shared memory, and every reader reads it in place. Frames are stored
+ * as they'd go on the wire (see ImageFraming), length prefix and all.
+ *
+ * There are two ways of doing that, picked at runtime:
+ *
+ * RING: one memfd holds a ring of fixed-size slots, mapped by the publisher
+ * and every reader; a reader gets the memfd, and an eventfd of its own, with
+ * SCM_RIGHTS when it connects. A slot that's published carries a bit for
+ * each reader that was connected at the time, and goes back to the
+ * publisher once they've all cleared their bit. Publishing writes each
+ * reader's eventfd; a reader that clears a bit while the publisher is
+ * waiting for a slot wakes it with a futex.
+ *
+ * FD: each frame is written to a memfd that's passed to every reader with
+ * SCM_RIGHTS. Readers send back the frame's sequence number when they're
+ * done with it, so there's a limit to how far behind they can get, and the
+ * memfd is reused once they all have (it's sealed against shrinking, so a
+ * mapping of it stays valid). Readers keep their mappings of the memfds
+ * they've seen, so that in the steady state nothing is allocated or mapped
+ * per frame. Used when the ring can't be set up (e.g. there isn't the
+ * address space to map it all up front), or when asked for.
+ *
+ * Either way, there can be up to MAX_READERS readers.
+ *
+ * Socket messages are in host byte order: both ends are on the same host.
+ */
+namespace LocalTransport {
+
+enum class Mode : uint8_t {
+  RING = 1,
+  FD = 2,
+};
+
+const size_t MAX_READERS = 32;
+const size_t MAX_RING_SLOTS = 64;
+const uint8_t VERSION = 1;
+
+/**
+ * Sent to each reader when it connects, with the ring's memfd and the
+ * reader's eventfd in RING mode.
+ */
+struct Hello {
+  char magic[4];
+  uint8_t version;
+  uint8_t mode;
+  // RING: the reader's bit in Slot::readers
+  uint8_t readerBit;
+  uint8_t reserved;
+};
+
+/**
+ * FD: sent with each frame's memfd. The reader sends sequence back once it's
+ * done with the frame.
+ */
+struct FrameMessage {
+  char magic[4];
+  uint32_t size;
+  uint64_t sequence;
+};
+
+/**
+ * The start of the ring's memfd, followed by slotCount Slots; slot i's data
+ * is at dataOffset + i * slotSize.
+ */
+struct RingHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t slotCount;
+  uint32_t reserved;
+  uint64_t slotSize;
+  uint64_t dataOffset;
+  // Bumped by a reader each time it gives a slot back
+  std::atomic<uint32_t> releases;
+  // The publisher is waiting on releases; FUTEX_WAKE it
+  std::atomic<uint32_t> publisherWaiting;
+  // Sequence number of the latest frame
+  std::atomic<uint64_t> published;
+};
+
+struct Slot {
+  // Bit per reader that hasn't finished with the frame yet
+  std::atomic<uint32_t> readers;
+  uint32_t reserved;
+  // 0 while the slot is being written
+  std::atomic<uint64_t> sequence;
+  uint64_t size;
+  uint64_t reserved2;
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free &&
+              std::atomic<uint64_t>::is_always_lock_free,
+              "The ring needs lock-free (address-free) atomics");
+
+/**
+ * The sensor's end. Not thread-safe, apart from stats(): it's used from the
+ * sender thread.
+ */
+class Publisher {
+  public:
+    struct Config {
+      std::string path;
+      Mode mode = Mode::RING;
+      // RING: number of slots, and the biggest frame (as framed) that fits
+      // in one. FD: frames a reader can be holding on to.
+      size_t slots = 4;
+      size_t slotSize = 16 << 20;
+      // How long publish() waits for a slow reader to make room before
+      // dropping the frame (for that reader, in FD mode)
+      std::chrono::milliseconds waitTimeout{1000};
+    };
+
+    struct Stats {
+      size_t readers;
+      uint64_t published;
+      // Frames handed to readers: one per frame per reader
+      uint64_t delivered;
+      // Frames no reader got, or (FD) a reader missed, for lack of room
+      uint64_t dropped;
+      // Frames too big for a slot
+      uint64_t oversized;
+      uint64_t bytes;
+    };
+
+    explicit Publisher(const Config& config);
+    ~Publisher();
+
+    Publisher(const Publisher&) = delete;
+    Publisher& operator=(const Publisher&) = delete;
+
+    /**
+     * Start listening at Config::path, replacing whatever's there, and set
+     * up the ring. Falls back to FD mode if the ring can't be set up.
+     */
+    bool open();
+
+    Mode mode() const {
+      return mMode;
+    }
+
+    /**
+     * Publish one Image to every connected reader, first taking on any new
+     * ones.
+     *
+     * @return Bytes published (once, however many readers there are), 0 if
+     *         there were no readers or no room, or -1 on error.
+     */
+    ssize_t publish(const Image::Metadata& metadata, const Frame* frame,
+                    const Detections* detections = nullptr);
+
+    /**
+     * Take on new readers, and let go of ones that have gone, without
+     * publishing anything. A reader's connect() waits for this (or
+     * publish()).
+     *
+     * @return Readers connected now.
+     */
+    size_t refreshReaders();
+
+    Stats stats() const;
+
+  private:
+    struct Reader {
+      int fd;
+      // RING: the reader's eventfd
+      int eventFd;
+      // The reader's bit in Slot::readers or Buffer::holders
+      uint32_t bit;
+      // FD: frames passed and not yet given back
+      size_t holding;
+    };
+
+    // FD: a memfd frames are written to, free once holders is clear
+    struct Buffer {
+      int fd;
+      uint64_t sequence;
+      uint32_t holders;
+    };
+
+    bool setUpRing();
+    void tearDownRing();
+    void acceptReaders();
+    bool serviceReader(Reader& reader);
+    void release(Reader& reader, uint64_t sequence);
+    void serviceReaders();
+    void removeReader(size_t index);
+    Slot* slot(size_t index);
+    uint8_t* slotData(size_t index);
+    Slot* freeSlot();
+    Slot* waitForSlot();
+    ssize_t publishRing(const Image::Metadata& metadata, const Frame* frame,
+                        const Detections* detections);
+    ssize_t publishFd(const Image::Metadata& metadata, const Frame* frame,
+                      const Detections* detections);
+    bool waitForReaders();
+    Buffer* freeBuffer();
+
+    const Config mConfig;
+    Mode mMode;
+    int mListenFd;
+    std::vector<Reader> mReaders;
+    uint64_t mSequence;
+
+    int mRingFd;
+    uint8_t* mRing;
+    size_t mRingSize;
+    // Bounded by how many frames the readers can hold between them
+    std::vector<Buffer> mBuffers;
+    // Bits not taken by a connected reader
+    uint32_t mFreeBits;
+
+    std::atomic<size_t> mReaderCount;
+    std::atomic<uint64_t> mPublished;
+    std::atomic<uint64_t> mDelivered;
+    std::atomic<uint64_t> mDropped;
+    std::atomic<uint64_t> mOversized;
+    std::atomic<uint64_t> mBytes;
+};
+
+/**
+ * The reading end, for consumers on the same host; see the sensor's
+ * local_bench for an example.
+ */
+class Subscriber {
+  public:
+    /**
+     * Called with a framed Image (length prefix first) in shared memory,
+     * which is given back when this returns.
+     */
+    typedef std::function<void(uint64_t sequence, const uint8_t* data,
+                               size_t size)> Callback;
+
+    Subscriber();
+    ~Subscriber();
+
+    Subscriber(const Subscriber&) = delete;
+    Subscriber& operator=(const Subscriber&) = delete;
+
+    /**
+     * Connect to the publisher at path. Returns once it's taken us on,
+     * which it does whenever it publishes or refreshes its readers.
+     */
+    bool connect(const std::string& path);
+    void close();
+
+    Mode mode() const {
+      return mMode;
+    }
+
+    /**
+     * Wait up to timeout for frames, and pass each one to callback, oldest
+     * first.
+     *
+     * @return Number of frames received, or -1 if the publisher went away.
+     */
+    int receive(const Callback& callback, std::chrono::milliseconds timeout);
+
+  private:
+    // FD: a memfd mapped earlier
+    struct Mapping {
+      dev_t device;
+      ino_t inode;
+      uint8_t* data;
+      size_t size;
+    };
+
+    int receiveRing(const Callback& callback);
+    int receiveFd(const Callback& callback);
+    const uint8_t* map(int fd, size_t size);
+
+    Mode mMode;
+    int mFd;
+    int mEventFd;
+    uint32_t mBit;
+    int mRingFd;
+    uint8_t* mRing;
+    size_t mRingSize;
+    std::vector<Mapping> mMappings;
+};
+
+} // namespace LocalTransport
+
+#endif // LOCAL_TRANSPORT_HPP
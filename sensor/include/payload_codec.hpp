@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PAYLOAD_CODEC_HPP
+#define PAYLOAD_CODEC_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "picam.pb.h"
+
+/**
+ * Lossless compression of raw (GRAY8, I420, RGB24, RAW) frame payloads, so
+ * they fit through a slow uplink. PNG, JPEG and H.264 are compressed
+ * already and never go through it.
+ *
+ * A frame is cut into fixed-size blocks that are compressed independently,
+ * so they can be compressed (and decompressed) in parallel. With DELTA, each
+ * byte is first replaced by its difference (mod 256) from the same byte of
+ * an earlier frame, which turns a static scene into mostly zeros. A frame
+ * without DELTA is a key frame: it decodes on its own.
+ *
+ * The payload replaces the Image's data, and Metadata.encoding becomes the
+ * original encoding followed by "+delta" if DELTA is set, and "+" and the
+ * codec's name, e.g. "I420+delta+lz4". All fields are big-endian.
+ *
+ *   0  magic "PCPZ"
+ *   4  version (1)
+ *   5  codec (see Codec)
+ *   6  flags (see Flags)
+ *   7  reserved, 0
+ *   8  size of the raw frame
+ *  12  block size; every block but the last is this big before compression
+ *  16  sequence number of this frame, counted by the encoder
+ *  20  DELTA: sequence number of the frame it's the difference from
+ *  24  compressed size of each block, with STORED set for one that didn't
+ *      compress and is there as it is
+ *
+ * then the blocks themselves, back to back.
+ */
+namespace PayloadCodec {
+
+enum class Codec : uint8_t {
+  // Only used to say a frame isn't compressed; never on the wire
+  NONE = 0,
+  LZ4 = 1,
+  ZSTD = 2,
+  DEFLATE = 3,
+};
+
+enum Flags : uint8_t {
+  DELTA = 0x01,
+};
+
+const size_t HEADER_SIZE = 24;
+const uint8_t VERSION = 1;
+const uint32_t STORED = 0x80000000u;
+const uint32_t MAX_BLOCK_SIZE = 16 * 1024 * 1024;
+
+struct Header {
+  Codec codec;
+  uint8_t flags;
+  uint32_t rawSize;
+  uint32_t blockSize;
+  uint32_t sequence;
+  uint32_t reference;
+
+  uint32_t blockCount() const {
+    return (blockSize == 0) ? 0 : (rawSize + blockSize - 1) / blockSize;
+  }
+};
+
+/**
+ * Whether codec was compiled in. NONE always is.
+ */
+bool available(Codec codec);
+
+/**
+ * The codecs compiled in, fastest first.
+ */
+std::vector<Codec> availableCodecs();
+
+/**
+ * The codec's name as it goes into the encoding ("lz4", "zstd", "deflate",
+ * or "none").
+ */
+const char* name(Codec codec);
+
+/**
+ * @return false if name isn't a codec's name.
+ */
+bool parseName(const std::string& name, Codec& codec);
+
+/**
+ * Whether frames in this encoding are raw, and worth compressing.
+ */
+bool isRaw(const std::string& encoding);
+
+/**
+ * The encoding of a compressed frame whose original encoding was base.
+ */
+std::string encodingFor(const std::string& base, Codec codec, bool delta);
+
+/**
+ * Split a compressed frame's encoding into its parts.
+ *
+ * @return false if encoding isn't one encodingFor() would produce.
+ */
+bool parseEncoding(const std::string& encoding, std::string& base,
+                   Codec& codec, bool& delta);
+
+/**
+ * The most a block of size bytes can take up compressed.
+ */
+size_t blockBound(Codec codec, size_t size);
+
+/**
+ * Compress one block into out, which must have room for
+ * blockBound(codec, size) bytes.
+ *
+ * @param level Codec-specific; 0 for a fast default.
+ * @return the compressed size, or 0 on failure.
+ */
+size_t compressBlock(Codec codec, int level, const uint8_t* in, size_t size,
+                     uint8_t* out, size_t capacity);
+
+/**
+ * Decompress one block of exactly rawSize bytes into out.
+ */
+bool decompressBlock(Codec codec, const uint8_t* in, size_t size,
+                     uint8_t* out, size_t rawSize);
+
+/**
+ * Replace each byte of out[0, size) with in - reference (mod 256), or with
+ * in + reference when undoing it.
+ */
+void subtract(const uint8_t* in, const uint8_t* reference, uint8_t* out,
+              size_t size);
+void add(const uint8_t* reference, uint8_t* inOut, size_t size);
+
+/**
+ * Encode header into out, which must have room for HEADER_SIZE bytes.
+ */
+void encodeHeader(const Header& header, uint8_t* out);
+
+/**
+ * @return false if in doesn't look like a payload header.
+ */
+bool decodeHeader(const uint8_t* in, size_t size, Header& header);
+
+/**
+ * Block sizes, as they follow the header: 4 bytes each.
+ */
+void putBlockSize(uint32_t size, uint8_t* out);
+uint32_t getBlockSize(const uint8_t* in);
+
+/**
+ * The receiving end: turns compressed payloads back into raw frames. Delta
+ * frames are decoded against the last frame it decoded, so frames have to
+ * be fed to it in the order they were sent; one whose reference isn't that
+ * frame (because frames in between were dropped) can't be decoded, and
+ * neither can any after it until the next key frame.
+ */
+class Decoder {
+  public:
+    struct Stats {
+      uint64_t frames;
+      uint64_t keyFrames;
+      uint64_t deltaFrames;
+      // Delta frames without the frame they refer to
+      uint64_t missingReference;
+      uint64_t errors;
+    };
+
+    Decoder();
+
+    /**
+     * Decode the payload in data into out.
+     *
+     * @return false if it's malformed, or a delta frame whose reference
+     *         isn't the last frame decoded.
+     */
+    bool decode(const uint8_t* data, size_t size, std::string& out);
+
+    /**
+     * Decode image's data in place and put back its original encoding.
+     * Images whose encoding doesn't name a codec are left as they are.
+     */
+    bool decode(Image& image);
+
+    /**
+     * Forget the last frame, e.g. after a reconnect.
+     */
+    void reset();
+
+    Stats stats() const {
+      return mStats;
+    }
+
+  private:
+    std::string mPrevious;
+    uint32_t mPreviousSequence;
+    bool mHavePrevious;
+    std::string mDecoded;
+    Stats mStats;
+};
+
+} // namespace PayloadCodec
+
+#endif // PAYLOAD_CODEC_HPP
@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PAYLOAD_ENCODER_HPP
+#define PAYLOAD_ENCODER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bounded_queue.hpp"
+#include "frame_assembler.hpp"
+#include "image_sender.hpp"
+#include "payload_codec.hpp"
+#include "worker_pool.hpp"
+
+/**
+ * Compresses raw frames (see PayloadCodec) between the frame source and the
+ * sender, on a thread of its own, with the blocks of each frame spread over
+ * a WorkerPool. enqueue() never waits: if compression falls behind, the
+ * newest frame is dropped, as it would be at a full sender queue. Anything
+ * that isn't a raw frame (PNG, video, chunks, Detections-only messages, and
+ * frames under Config::minSize) goes through untouched, in order with the
+ * rest.
+ *
+ * With Config::adaptive, the codec (and whether to use delta frames) is
+ * picked frame by frame from how fast frames come in, how fast the link
+ * drains them (from a LinkMonitor), and how fast and how well each codec
+ * has been compressing them lately. Frames go out uncompressed as long as
+ * the link keeps up, and with the cheapest codec that gets them through it
+ * when it doesn't. Codecs that aren't in use are tried on a frame now and
+ * then, so their figures stay current.
+ */
+class PayloadEncoder {
+  public:
+    /**
+     * Hands a frame on to be sent, e.g. ImageSender::enqueue().
+     */
+    typedef std::function<bool(QueuedImage&&)> Sink;
+
+    /**
+     * Running totals from the sender, e.g. from ImageSender::Stats.
+     */
+    struct LinkStats {
+      uint64_t bytesSent;
+      // Time spent sending, which is mostly time waiting for the link
+      uint64_t busyUs;
+      // Frames the sender dropped or failed to send
+      uint64_t dropped;
+    };
+    typedef std::function<LinkStats()> LinkMonitor;
+
+    struct Config {
+      // Codec for every frame, unless adaptive
+      PayloadCodec::Codec codec = PayloadCodec::Codec::LZ4;
+      // Pick among every codec compiled in instead, or none at all
+      bool adaptive = false;
+      // Send frames as differences from the one before where that's
+      // possible (same size and encoding)
+      bool delta = false;
+      // With delta, every this many frames is a key frame
+      unsigned keyInterval = 30;
+      size_t blockSize = 1 << 20;
+      // Codec-specific compression level; 0 for a fast default
+      int level = 0;
+      // Threads compressing blocks (see WorkerPool)
+      unsigned threads = 0;
+      // Frames waiting to be compressed
+      size_t queueCapacity = 4;
+      // Smaller raw frames (e.g. event mode's crops) aren't worth it
+      size_t minSize = 16 << 10;
+      // Adaptive: try a codec that isn't in use every this many frames
+      unsigned probeInterval = 50;
+      // Adaptive: the link (or compression) has to keep up with this many
+      // times the rate frames come in
+      double headroom = 1.25;
+    };
+
+    struct Stats {
+      uint64_t enqueued;
+      // Compressed, and passed on untouched
+      uint64_t encoded;
+      uint64_t passed;
+      // The queue was full
+      uint64_t dropped;
+      uint64_t keyFrames;
+      uint64_t deltaFrames;
+      // Raw bytes of compressed frames, and what they came to
+      uint64_t rawBytes;
+      uint64_t encodedBytes;
+      // Time spent compressing
+      uint64_t encodeUs;
+      // Adaptive: times the choice changed, and what it is now
+      uint64_t switches;
+      PayloadCodec::Codec codec;
+      bool delta;
+      // Adaptive: link throughput and input rate estimates in bytes/s (0
+      // until there's something to go on)
+      double linkRate;
+      double inputRate;
+    };
+
+    PayloadEncoder(const Config& config, Sink sink,
+                   LinkMonitor monitor = nullptr);
+    ~PayloadEncoder();
+
+    PayloadEncoder(const PayloadEncoder&) = delete;
+    PayloadEncoder& operator=(const PayloadEncoder&) = delete;
+
+    /**
+     * Start the encoding thread. Fails if the codec wasn't compiled in.
+     */
+    bool start();
+
+    /**
+     * Encode and pass on whatever's queued, then stop the encoding thread.
+     */
+    void stop();
+
+    /**
+     * Queue a frame. Returns false if it was dropped.
+     */
+    bool enqueue(QueuedImage&& image);
+
+    Stats stats() const;
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Candidate {
+      PayloadCodec::Codec codec;
+      bool delta;
+      // Averages over recent frames: compressed size over raw size, and raw
+      // bytes compressed per second. speed is 0 until it's been tried.
+      double ratio;
+      double speed;
+      uint64_t lastUsed;
+    };
+
+    void run();
+    void process(QueuedImage& image);
+    void sampleLink();
+    size_t choose();
+    void pass(QueuedImage& image);
+    void encode(QueuedImage& image, const Candidate& candidate);
+
+    const Config mConfig;
+    Sink mSink;
+    LinkMonitor mMonitor;
+
+    BoundedQueue<QueuedImage> mQueue;
+    std::thread mThread;
+    std::atomic<bool> mRunning;
+
+    // Only used to put the encoding thread to sleep
+    std::mutex mWaitMutex;
+    std::condition_variable mReadyCv;
+    std::atomic<bool> mWaiting;
+
+    // Encoding state, only touched by the encoding thread
+    WorkerPool mPool;
+    FrameAssembler mAssembler;
+    std::vector<Candidate> mCandidates;
+    size_t mCurrent;
+    // Frames compressed so far; numbers them on the wire
+    uint32_t mSequence;
+    // The last frame compressed, raw, for delta frames against it
+    std::string mFrame;
+    std::string mPrevious;
+    std::string mPreviousEncoding;
+    bool mHavePrevious;
+    unsigned mSinceKey;
+    bool mForceKey;
+    std::vector<uint8_t> mDelta;
+    std::vector<std::vector<uint8_t>> mBlocks;
+    std::vector<uint32_t> mBlockSizes;
+    std::vector<uint8_t> mTable;
+    uint64_t mRawFrames;
+    // Input and link rate estimates
+    Clock::time_point mLastFrame;
+    double mInputRate;
+    LinkStats mLink;
+    double mLinkRate;
+
+    std::atomic<uint64_t> mEnqueued;
+    std::atomic<uint64_t> mEncoded;
+    std::atomic<uint64_t> mPassed;
+    std::atomic<uint64_t> mDropped;
+    std::atomic<uint64_t> mKeyFrames;
+    std::atomic<uint64_t> mDeltaFrames;
+    std::atomic<uint64_t> mRawBytes;
+    std::atomic<uint64_t> mEncodedBytes;
+    std::atomic<uint64_t> mEncodeUs;
+    std::atomic<uint64_t> mSwitches;
+    std::atomic<size_t> mChoice;
+    std::atomic<double> mLinkRateOut;
+    std::atomic<double> mInputRateOut;
+};
+
+#endif // PAYLOAD_ENCODER_HPP
@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "analysis_tap.hpp"
+#include "capture_scheduler.hpp"
+#include "event_dispatcher.hpp"
+#include "frame_assembler.hpp"
+#include "frame_source.hpp"
+#include "frame_streamer.hpp"
+#include "h264_stream.hpp"
+#include "image_sender.hpp"
+#include "payload_encoder.hpp"
+#include "preevent_buffer.hpp"
+#include "sky_analyser.hpp"
+#include "worker_pool.hpp"
+
+/**
+ * Everything between one camera (or a stand-in for one) and the sender:
+ * scheduling its captures, analysing its frames in event mode, compressing
+ * them, and handing them on with the pipeline's sensor id in their
+ * metadata.
+ *
+ * Pipelines can share an ImageSender, so one process can drive several
+ * cameras. Each has its own thread, which runs its captures, and its own
+ * buffers and workers; the only thing a frame shares with other pipelines'
+ * on its way from the source to the sender is the sender's queue.
+ */
+class Pipeline {
+  public:
+    struct Config {
+      // Goes into every frame's metadata, to tell the host's cameras apart
+      uint32_t sensorId = 0;
+      CaptureScheduler::Config scheduler{};
+      // Frames to capture; video frames with video
+      unsigned frameCount = 1;
+      // The source is the camera's H.264 stream, whose access units have to
+      // be passed to accessUnit()
+      bool video = false;
+      // Video: keep the last preEvent.seconds of it in memory, and only
+      // send it on sendClip()
+      bool preEventBuffer = false;
+      PreEventBuffer::Config preEvent{};
+      // Send what's detected in each frame instead of the frame (see
+      // EventDispatcher). The frames have to be passed to frameAnalysed()
+      // from an analysis tap, unless analyseEncoded.
+      bool events = false;
+      EventDispatcher::Config dispatcher{};
+      // Event mode: the source's frames are GRAY8, so analyse them as they
+      // come
+      bool analyseEncoded = false;
+      // Hand frames to the (chunked) sender as they're encoded. The sender
+      // takes one frame at a time like this, so only one pipeline can.
+      bool streaming = false;
+      // Compress raw frames on the way (see PayloadEncoder)
+      bool compress = false;
+      PayloadEncoder::Config codec{};
+    };
+
+    Pipeline(const Config& config, ImageSender& sender);
+    ~Pipeline();
+
+    Pipeline(const Pipeline&) = delete;
+    Pipeline& operator=(const Pipeline&) = delete;
+
+    /**
+     * The source to capture from. Set it before start().
+     */
+    void setSource(std::unique_ptr<FrameSource> source);
+
+    FrameSource* source() const {
+      return mSource.get();
+    }
+
+    uint32_t sensorId() const {
+      return mConfig.sensorId;
+    }
+
+    /**
+     * Start delivering frames, and the thread that captures frameCount of
+     * them and then stops the source.
+     */
+    bool start();
+
+    /**
+     * Wait for the thread to finish.
+     *
+     * @return true if every frame was captured and the source stopped.
+     */
+    bool wait();
+
+    /**
+     * Make the thread stop capturing as soon as it can.
+     */
+    void stop();
+
+    /**
+     * A complete frame from the encoder. Called on the source's thread.
+     */
+    size_t frameEncoded(FrameSource& source, const FramePtr& frame);
+
+    /**
+     * An access unit from the video encoder.
+     */
+    void accessUnit(H264::AccessUnit&& unit);
+
+    /**
+     * A raw frame from the source's analysis tap. Called on the tap's
+     * thread.
+     */
+    void frameAnalysed(const RawFrame& frame);
+
+    /**
+     * Send the last duration of video from the pre-event buffer. Only one
+     * thread may call this.
+     *
+     * @return the number of access units sent; 0 if there's no keyframe to
+     *         start from.
+     */
+    size_t sendClip(std::chrono::microseconds duration);
+
+    unsigned framesCaptured() const {
+      return mScheduler.framesCaptured();
+    }
+
+    /**
+     * Log what each stage did.
+     */
+    void logStats() const;
+
+  private:
+    void run();
+    void analyse(const RawFrame& frame);
+    void analyseEncoded(const FramePtr& frame);
+    bool send(QueuedImage&& image);
+
+    const Config mConfig;
+    ImageSender& mSender;
+    std::unique_ptr<FrameSource> mSource;
+    CaptureScheduler mScheduler;
+    bool mCapturing;
+    std::thread mThread;
+    bool mSucceeded;
+
+    // Stages in front of the sender; null when not in use
+    std::unique_ptr<FrameStreamer> mStreamer;
+    std::unique_ptr<PayloadEncoder> mEncoder;
+    std::unique_ptr<PreEventBuffer> mPreEventBuffer;
+    std::unique_ptr<WorkerPool> mAnalysisPool;
+    std::unique_ptr<SkyAnalyser> mSkyAnalyser;
+    std::unique_ptr<EventDispatcher> mDispatcher;
+
+    // Analysis state, only touched by the thread frames are analysed on
+    SkyAnalyser::Result mResult;
+    std::string mLuma;
+    uint64_t mLumaSequence;
+
+    // Video: access units sent so far, numbered for the sender, and where
+    // clips from the pre-event buffer are copied to
+    uint32_t mVideoIndex;
+    FrameAssembler mClipAssembler;
+};
+
+#endif // PIPELINE_HPP
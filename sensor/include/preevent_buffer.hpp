@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PREEVENT_BUFFER_HPP
+#define PREEVENT_BUFFER_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "frame_assembler.hpp"
+#include "h264_stream.hpp"
+
+/**
+ * Keeps the last few seconds of H.264 access units in memory, so that when
+ * something happens we can also send what led up to it.
+ *
+ * Units are copied into a single arena allocated up front (bitrate x seconds,
+ * plus headroom) and the oldest ones are evicted to make room, so push()
+ * never allocates. Keyframes are indexed as they go in; extract() finds the
+ * IDR to start from with a binary search over that index and copies out
+ * everything from there on.
+ *
+ * Thread-safe: units are usually pushed from the encoder callback and
+ * extracted from wherever the trigger comes from.
+ */
+class PreEventBuffer {
+  public:
+    struct Config {
+      // Same as H264EncoderConfig::DEFAULT_BITRATE
+      uint32_t bitrate = 17000000;
+      double frameRate = 30.0;
+      double seconds = 10.0;
+      // Room for bitrate overshoot: keyframes, busy scenes
+      double headroom = 1.5;
+    };
+
+    struct Stats {
+      size_t units;
+      size_t keyframes;
+      size_t bytesUsed;
+      size_t arenaSize;
+      uint64_t pushed;
+      uint64_t evicted;
+      // Units bigger than the whole arena
+      uint64_t rejected;
+    };
+
+    explicit PreEventBuffer(const Config& config);
+
+    PreEventBuffer(const PreEventBuffer&) = delete;
+    PreEventBuffer& operator=(const PreEventBuffer&) = delete;
+
+    /**
+     * Arena size for config, in bytes.
+     */
+    static size_t arenaSizeFor(const Config& config);
+
+    /**
+     * Copy an access unit into the buffer, evicting the oldest units as
+     * needed.
+     *
+     * @return false if the unit is too big to ever fit.
+     */
+    bool push(const H264::AccessUnit& unit);
+
+    /**
+     * Copy out at least the last duration of video, starting at the latest
+     * IDR that's old enough (or the oldest one we still have), with parameter
+     * sets in front of it. Each unit gets its own frame from assembler.
+     *
+     * Times are PTS if the encoder provides them, otherwise when the unit
+     * was pushed.
+     */
+    std::vector<H264::AccessUnit> extract(std::chrono::microseconds duration,
+                                          FrameAssembler& assembler) const;
+
+    Stats stats() const;
+
+  private:
+    struct Entry {
+      size_t offset;
+      size_t size;
+      int64_t timeUs;
+      int64_t ptsUs;
+      bool hasPicture;
+      bool keyframe;
+      bool config;
+    };
+
+    // SPS + PPS are a few dozen bytes
+    static const size_t MAX_CONFIG_SIZE = 256;
+
+    const Entry& entry(uint64_t sequence) const {
+      return mEntries[sequence % mEntries.size()];
+    }
+
+    /**
+     * Find room for size bytes, evicting as needed. Returns the offset.
+     */
+    size_t reserve(size_t size);
+    void evictOldest();
+
+    mutable std::mutex mMutex;
+
+    std::unique_ptr<uint8_t[]> mArena;
+    const size_t mArenaSize;
+    // Next write position; live data runs from the oldest entry's offset up
+    // to here, possibly wrapping around the end
+    size_t mHead;
+    size_t mBytesUsed;
+
+    // Units by sequence number; live ones are [mFirst, mNext)
+    std::vector<Entry> mEntries;
+    uint64_t mFirst;
+    uint64_t mNext;
+
+    // Sequence numbers of the live keyframes, oldest first
+    std::vector<uint64_t> mKeyframes;
+    size_t mKeyframeStart;
+    size_t mKeyframeCount;
+
+    // The last parameter sets that came in a unit of their own, for clips
+    // whose first keyframe doesn't carry them
+    uint8_t mConfig[MAX_CONFIG_SIZE];
+    size_t mConfigSize;
+
+    uint64_t mPushed;
+    uint64_t mEvicted;
+    uint64_t mRejected;
+};
+
+#endif // PREEVENT_BUFFER_HPP
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SENSOR_MODE_HPP
+#define SENSOR_MODE_HPP
+
+// Sensor modes live apart from camera.hpp so code that doesn't talk to MMAL
+// (benchmarks, synthetic sources) can use the same resolution table.
+
+// Assuming camera module v2
+// TODO
+// See https://picamera.readthedocs.io/en/release-1.13/fov.html
+typedef enum {
+  SM_INVALID = 0,
+  SM_1920x1080 = 1,
+  SM_3280x2464_0 = 2,
+  SM_3280x2464_1 = 3,
+  SM_1640x1232 = 4,
+  SM_1640x922 = 5,
+  SM_1282x720 = 6,
+  SM_640x480 = 7,
+  NUM_SENSOR_MODES,
+} SensorMode;
+
+extern const unsigned int SENSOR_MODE_WIDTH[NUM_SENSOR_MODES];
+extern const unsigned int SENSOR_MODE_HEIGHT[NUM_SENSOR_MODES];
+
+#endif // SENSOR_MODE_HPP
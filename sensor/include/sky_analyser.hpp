@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef SKY_ANALYSER_HPP
+#define SKY_ANALYSER_HPP
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "background.hpp"
+#include "connected_components.hpp"
+#include "plane.hpp"
+#include "streak_detector.hpp"
+#include "worker_pool.hpp"
+
+/**
+ * Runs detection on raw luminance frames on the sensor, with the processing
+ * library: a background and noise map, then stars (components above an
+ * adaptive threshold) and streaks (in the background-subtracted frame).
+ */
+class SkyAnalyser {
+  public:
+    struct Config {
+      // Star pixels are this many background RMS above the background
+      float sigma = 5.0f;
+      // Smaller components are noise or hot pixels
+      uint32_t minArea = 3;
+      BackgroundEstimator::Config background{};
+      // Look for streaks, in pixels at least this far above the background
+      bool streaks = true;
+      uint32_t streakThreshold = 40;
+    };
+
+    struct Result {
+      // Medians over the background mesh
+      float background;
+      float rms;
+      // In raster order
+      std::vector<Component> stars;
+      // Longest first
+      std::vector<Streak> streaks;
+    };
+
+    explicit SkyAnalyser(const Config& config, WorkerPool* pool = nullptr);
+
+    SkyAnalyser(const SkyAnalyser&) = delete;
+    SkyAnalyser& operator=(const SkyAnalyser&) = delete;
+
+    /**
+     * Analyse the next frame, replacing the contents of result. Streaks are
+     * only looked for where they weren't in the previous frame, so frames
+     * should come in order.
+     *
+     * @return false if the frame is empty.
+     */
+    bool analyse(Plane<const uint8_t> luma, Result& result);
+
+    const Config& config() const;
+
+  private:
+    static float meshMedian(Plane<const float> mesh, std::vector<float>& scratch);
+
+    const Config mConfig;
+    WorkerPool* const mPool;
+    BackgroundEstimator mBackground;
+    ComponentLabeller mLabeller;
+    // Made for the first frame, and again if the size changes
+    std::unique_ptr<StreakDetector> mStreakDetector;
+    std::vector<uint16_t> mThresholds;
+    std::vector<uint8_t> mSubtracted;
+    std::vector<float> mScratch;
+};
+
+#endif // SKY_ANALYSER_HPP
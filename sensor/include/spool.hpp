@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPOOL_HPP
+#define SPOOL_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "frame_assembler.hpp"
+
+#include "picam.pb.h"
+
+/**
+ * Holds frames on local storage while the receiver is unreachable, so they
+ * can be sent once it's back.
+ *
+ * Frames are appended to segment files in a directory, exactly as they'd go
+ * on the wire (see ImageFraming), so sending them later is just a sendfile()
+ * of each record and never comes back through userspace. A chunked spool
+ * holds frames as ChunkFraming records instead, each frame's records behind
+ * a length prefix of their own that isn't sent; its segments have a
+ * different suffix, so neither kind is ever sent in the other's place. Records are sent
+ * oldest first; a segment is deleted once all of it has been sent. Segments
+ * left behind by an earlier run are picked up by open(). If a connection
+ * drops partway through a record, the whole record is sent again, so the
+ * receiver may see a frame twice but never a torn one.
+ *
+ * Not thread-safe, except for stats(): everything else is called from the
+ * sender thread.
+ */
+class Spool {
+  public:
+    struct Config {
+      std::string directory;
+      // Start a new segment once the current one is this big
+      size_t segmentSize = 16 << 20;
+      // Delete the oldest segments (unsent) to stay under this
+      uint64_t maxBytes = 1ULL << 30;
+      // Frames are ChunkFraming records (appendChunked()) rather than Image
+      // messages
+      bool chunked = false;
+    };
+
+    struct Stats {
+      // Not yet sent, including the rest of a partly sent segment
+      uint64_t pendingBytes;
+      size_t segments;
+      uint64_t appended;
+      uint64_t sent;
+      // Records thrown away to stay under maxBytes
+      uint64_t discarded;
+    };
+
+    explicit Spool(const Config& config);
+    ~Spool();
+
+    Spool(const Spool&) = delete;
+    Spool& operator=(const Spool&) = delete;
+
+    /**
+     * Create the directory if needed and pick up any segments already in it.
+     */
+    bool open();
+
+    /**
+     * Append one framed Image.
+     */
+    bool append(const Image::Metadata& metadata, const Frame* frame,
+                const Detections* detections = nullptr);
+
+    /**
+     * Append one frame's already encoded ChunkFraming records.
+     */
+    bool appendChunked(const struct iovec* iov, size_t iovCount);
+
+    /**
+     * Size on the wire of the next record to send, or 0 if there's nothing
+     * to send.
+     */
+    size_t nextRecordSize();
+
+    /**
+     * Send the next record to fd with sendfile(). On failure, the same record
+     * is sent again next time.
+     *
+     * @param syscalls If not null, incremented once per sendfile() call.
+     * @return Bytes sent, or -1 on error.
+     */
+    ssize_t sendNext(int fd, uint64_t* syscalls = nullptr);
+
+    bool empty() {
+      return nextRecordSize() == 0;
+    }
+
+    Stats stats() const;
+
+  private:
+    struct Segment {
+      uint64_t id;
+      uint64_t size;
+      uint64_t records;
+    };
+
+    bool startAppend();
+    bool finishAppend(ssize_t rc);
+    std::string segmentPath(uint64_t id) const;
+    bool openWriteSegment();
+    bool openReadSegment();
+    void closeReadSegment();
+    void removeOldestSegment();
+    bool scanSegment(Segment& segment);
+
+    const Config mConfig;
+    const char* const mSuffix;
+
+    // Oldest first; appends go to the back one while mWriteFd is open
+    std::deque<Segment> mSegments;
+    uint64_t mNextId;
+    int mWriteFd;
+    int mReadFd;
+    // Offset of the next record in the front segment
+    uint64_t mReadOffset;
+    uint32_t mNextRecordSize;
+
+    std::atomic<uint64_t> mPendingBytes;
+    std::atomic<size_t> mSegmentCount;
+    std::atomic<uint64_t> mAppended;
+    std::atomic<uint64_t> mSent;
+    std::atomic<uint64_t> mDiscarded;
+};
+
+#endif // SPOOL_HPP
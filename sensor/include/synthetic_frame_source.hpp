@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SYNTHETIC_FRAME_SOURCE_HPP
+#define SYNTHETIC_FRAME_SOURCE_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "frame_source.hpp"
+#include "sensor_mode.hpp"
+
+/**
+ * Generates deterministic night-sky frames: a fixed star field (from the
+ * seed) over a noisy background that changes every frame. The same config
+ * always produces the same sequence of frames.
+ */
+class SyntheticFrameSource : public PacedFrameSource {
+  public:
+    enum class Encoding {
+      // 8-bit luminance plane
+      GRAY8,
+      // Planar YUV 4:2:0 with neutral chroma, like the camera's raw output
+      I420,
+      // Packed 8-bit RGB
+      RGB24,
+      // RGB PNG (uncompressed deflate, so it's cheap to produce)
+      PNG,
+    };
+
+    struct Config {
+      SensorMode sensorMode = SM_1640x1232;
+      Encoding encoding = Encoding::PNG;
+      Pacing pacing{};
+      unsigned starCount = 400;
+      uint32_t seed = 1;
+      uint8_t background = 16;
+      // Background noise amplitude (+/-)
+      uint8_t noise = 6;
+      // Star field drift in pixels per frame, e.g. to mimic Earth rotation
+      float driftX = 0.0f;
+      float driftY = 0.0f;
+    };
+
+    explicit SyntheticFrameSource(const Config& config);
+    ~SyntheticFrameSource();
+
+    uint32_t width() const override;
+    uint32_t height() const override;
+    std::string encoding() const override;
+    CameraState stateSnapshot() const override;
+
+    static std::string encodingName(Encoding encoding);
+
+  protected:
+    bool produceFrame(FrameAssembler& assembler) override;
+
+  private:
+    struct Star {
+      float x;
+      float y;
+      float peak;
+    };
+
+    void renderLuma(uint64_t frameIndex);
+    void encodeRGB();
+    void encodeI420();
+    void encodePNG();
+
+    const Config mConfig;
+    const uint32_t mWidth;
+    const uint32_t mHeight;
+    std::vector<Star> mStars;
+    std::vector<uint8_t> mLuma;
+    std::vector<uint8_t> mEncoded;
+    uint64_t mFrameIndex;
+    CameraState mState;
+};
+
+#endif // SYNTHETIC_FRAME_SOURCE_HPP
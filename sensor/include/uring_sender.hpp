@@ -0,0 +1,292 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef URING_SENDER_HPP
+#define URING_SENDER_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "frame_assembler.hpp"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/**
+ * Sends records down a stream socket through io_uring instead of one
+ * sendmsg() each, for ImageSender.
+ *
+ * Records (an Image message, or a video record) are built up with copy()
+ * and reference() and closed with endRecord(); submit() then hands every
+ * record built since the last submit to the kernel with one
+ * io_uring_enter(), or none at all with SQPOLL while the kernel's polling
+ * thread is awake. Completions are picked up from the completion ring
+ * without a syscall.
+ *
+ * Within a record, small pieces (headers, and frame chunks below
+ * zeroCopyThreshold) are gathered into one SENDMSG. A big chunk that's in a
+ * slab of a frame pool registered with the ring goes as a SEND_ZC from the
+ * registered buffer, so the kernel neither copies it nor pins its pages
+ * every time. Pools are registered as frames from them turn up, between
+ * batches.
+ *
+ * Every SQE of a batch is linked, so they go out in order and a failure
+ * cancels the rest of the batch, and a batch isn't handed to the kernel
+ * until the sends of the one before have completed (zero-copy notifications,
+ * which only come once the data's acknowledged, aren't waited for). While
+ * that's waiting, more records pile up for the next batch, much as they
+ * would behind a blocking send. Sends use MSG_WAITALL, which the kernel
+ * retries on short sends, so a send that's short has failed. Needs Linux
+ * 6.0 or later (SEND_ZC); open() fails on anything older, and ImageSender
+ * falls back to blocking sends.
+ *
+ * Only for use from one thread.
+ */
+class UringSender {
+  public:
+    struct Config {
+      // Submission queue entries; also the most SQEs in flight
+      unsigned entries = 128;
+      // Let a kernel thread poll the submission queue, so submitting needs
+      // no syscall while it's awake. It sleeps after sqIdleMs without work.
+      bool sqPoll = false;
+      unsigned sqIdleMs = 100;
+      // Registered chunks at least this big are sent zero-copy; 0 to never
+      // register pools
+      size_t zeroCopyThreshold = 64 << 10;
+      // Bytes copied into staging per batch before it's submitted
+      size_t stagingSize = 256 << 10;
+      // How long submit() waits for room in the ring before giving up on the
+      // batch, as a send that makes no progress
+      std::chrono::milliseconds sendTimeout{10000};
+    };
+
+    struct Stats {
+      uint64_t enters;
+      uint64_t batches;
+      uint64_t records;
+      uint64_t zeroCopySends;
+      uint64_t zeroCopyBytes;
+      size_t registeredBuffers;
+    };
+
+    explicit UringSender(const Config& config);
+    ~UringSender();
+
+    UringSender(const UringSender&) = delete;
+    UringSender& operator=(const UringSender&) = delete;
+
+    /**
+     * Set up the ring. Fails if io_uring isn't there, or is too old.
+     */
+    bool open();
+
+    /**
+     * The socket records go to; only change it with nothing in flight.
+     */
+    void setSocket(int fd) {
+      mSocket = fd;
+    }
+
+    /**
+     * Add bytes to the record being built, copying them now.
+     */
+    void copy(const void* data, size_t size);
+
+    /**
+     * Add a frame's chunks to the record being built. The frame has to stay
+     * alive until the record is complete (see reap()).
+     */
+    void reference(const Frame& frame);
+
+    void endRecord();
+
+    /**
+     * Whether the batch being built should be submitted before adding
+     * another record.
+     */
+    bool batchFull() const;
+
+    size_t pendingRecords() const {
+      return mRecordEnds.size();
+    }
+
+    /**
+     * Submit the batch built so far.
+     *
+     * @param syscalls Incremented once per io_uring_enter().
+     * @return false if the batch couldn't be submitted; its records are then
+     *         reported as failed by reap().
+     */
+    bool submit(uint64_t* syscalls = nullptr);
+
+    /**
+     * Collect completions, waiting up to timeout for at least one if
+     * anything's in flight.
+     *
+     * Records complete in the order they were added. Once one has failed,
+     * every record after it fails too, even if it was sent, since the
+     * stream is broken: drop the connection, reap until nothing's in
+     * flight, then reset().
+     *
+     * @param failed Set to how many of the records completed failed; they
+     *               come after the ones that were sent.
+     * @return Number of records completed since the last call.
+     */
+    size_t reap(std::chrono::milliseconds timeout, size_t& failed,
+                uint64_t* syscalls = nullptr);
+
+    /**
+     * Records submitted and not yet complete.
+     */
+    size_t inFlight() const {
+      return mRecords.size();
+    }
+
+    /**
+     * Start sending again after a failure, e.g. on a new connection.
+     */
+    void reset() {
+      mFailed = false;
+    }
+
+    Stats stats() const;
+
+  private:
+    enum class SegmentType : uint8_t {
+      STAGED,
+      REFERENCE,
+      FIXED,
+    };
+
+    struct Segment {
+      SegmentType type;
+      // Big enough to go zero-copy, if its slab is registered
+      bool zeroCopy;
+      uint16_t bufferIndex;
+      // STAGED: offset into the batch's staging
+      size_t offset;
+      const uint8_t* data;
+      size_t size;
+    };
+
+    struct Batch {
+      std::vector<uint8_t> staging;
+      std::vector<struct iovec> iov;
+      std::vector<struct msghdr> messages;
+      // Serial number of its last record
+      uint64_t lastRecord;
+    };
+
+    struct Record {
+      uint64_t serial;
+      // CQEs still to come: one per SQE, and a notification per zero-copy
+      // send
+      unsigned pending;
+      bool failed;
+    };
+
+    // The records each SQE in flight covers, by user_data
+    struct SqeInfo {
+      uint64_t firstRecord;
+      uint64_t lastRecord;
+      uint32_t expected;
+    };
+
+    struct RegisteredPool {
+      std::shared_ptr<SlabPool> pool;
+      size_t slabs;
+    };
+
+    size_t sqesNeeded() const;
+    void resolveSegments(bool allowZeroCopy);
+    void prepare(Batch& batch, uint64_t firstRecord);
+    void addSqe(uint8_t opcode, uint64_t firstRecord, uint64_t lastRecord,
+                uint64_t addr, uint32_t len, uint32_t expected,
+                uint16_t bufferIndex);
+    bool enter(unsigned toSubmit, unsigned flags, uint64_t* syscalls);
+    bool wait(std::chrono::milliseconds timeout, uint64_t* syscalls);
+    bool collect(std::chrono::milliseconds timeout, uint64_t* syscalls);
+    void handleCqe(const io_uring_cqe& cqe);
+    void updateRegistration();
+    void closeRing();
+
+    const Config mConfig;
+    unsigned mEntries;
+    int mRingFd;
+    int mSocket;
+    bool mZeroCopy;
+
+    // Ring mappings
+    void* mSqRing;
+    size_t mSqRingSize;
+    void* mCqRing;
+    size_t mCqRingSize;
+    io_uring_sqe* mSqes;
+    size_t mSqesSize;
+    unsigned* mSqHead;
+    unsigned* mSqTail;
+    unsigned* mSqMask;
+    unsigned* mSqFlags;
+    unsigned* mSqArray;
+    unsigned* mCqHead;
+    unsigned* mCqTail;
+    unsigned* mCqMask;
+    io_uring_cqe* mCqes;
+
+    // The batch being built
+    Batch mBuilding;
+    std::vector<Segment> mSegments;
+    // Index into mSegments after each record's last segment
+    std::vector<size_t> mRecordEnds;
+    size_t mRecordStart;
+
+    std::deque<Batch> mBatches;
+    std::vector<Batch> mSpareBatches;
+    std::deque<Record> mRecords;
+    uint64_t mNextRecord;
+    std::vector<SqeInfo> mSqeInfo;
+    std::vector<uint32_t> mFreeSqeInfo;
+    // SQEs without their last CQE yet; kept to mEntries, so the completion
+    // queue (twice as big) can't overflow
+    size_t mSqesInFlight;
+    // SQEs without their first CQE yet
+    size_t mSendsInFlight;
+    // SQEs of the batch being submitted, to be linked once all are in
+    std::vector<io_uring_sqe*> mBatchSqes;
+    bool mFailed;
+    // Since the last reap()
+    size_t mCompleted;
+    size_t mCompletedFailed;
+
+    std::vector<RegisteredPool> mPools;
+    bool mPoolsChanged;
+    // Slab address to registered buffer index
+    std::unordered_map<const uint8_t*, uint16_t> mBufferIndex;
+
+    Stats mStats;
+};
+
+#endif // URING_SENDER_HPP
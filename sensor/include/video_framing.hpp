@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VIDEO_FRAMING_HPP
+#define VIDEO_FRAMING_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include <sys/types.h>
+
+#include "frame_assembler.hpp"
+#include "h264_stream.hpp"
+
+/**
+ * Wire framing for streamed video.
+ *
+ * Each access unit goes out as one record: a fixed 24-byte header followed by
+ * the access unit's Annex B bytes. All fields are big-endian.
+ *
+ *   0  magic "PCVS"
+ *   4  version (1)
+ *   5  flags (see Flags)
+ *   6  reserved, 0
+ *   8  sequence number, one per record
+ *  12  PTS in microseconds (signed; INT64_MIN if unknown)
+ *  20  payload size
+ *
+ * The magic lets a receiver that joins (or loses its place) mid-stream find
+ * the next record, and the flags tell it where it can start decoding.
+ */
+namespace VideoFraming {
+
+enum Flags : uint8_t {
+  // Payload contains an IDR picture
+  KEYFRAME = 0x01,
+  // Payload contains SPS/PPS
+  CONFIG = 0x02,
+  // Records were lost before this one
+  DISCONTINUITY = 0x04,
+  // Last record of the stream
+  END_OF_STREAM = 0x08,
+};
+
+const size_t HEADER_SIZE = 24;
+const uint8_t VERSION = 1;
+const uint32_t MAX_PAYLOAD_SIZE = 16 * 1024 * 1024;
+
+struct RecordHeader {
+  uint8_t flags;
+  uint32_t sequence;
+  int64_t ptsUs;
+  uint32_t payloadSize;
+};
+
+/**
+ * Header for an access unit (payloadSize is filled in from its data).
+ */
+RecordHeader headerFor(const H264::AccessUnit& unit, uint32_t sequence);
+
+void encodeHeader(const RecordHeader& header, uint8_t* out);
+
+/**
+ * @return false if in doesn't look like a record header.
+ */
+bool decodeHeader(const uint8_t* in, RecordHeader& header);
+
+/**
+ * Write one record (header plus payload chunks) to fd with as few syscalls
+ * as possible.
+ *
+ * @return Number of bytes written, or -1 on error.
+ */
+ssize_t writeRecord(int fd, const RecordHeader& header, const Frame* payload,
+                    uint64_t* syscalls = nullptr);
+
+/**
+ * Incremental parser for the receiving end. Feed it bytes as they come off
+ * the socket; complete records are passed to the callback.
+ *
+ * If the stream doesn't start at a record boundary, or turns out to be
+ * corrupt, the parser skips ahead to the next header. Until it has seen a
+ * KEYFRAME or CONFIG record after that, records are dropped, since they can't
+ * be decoded. Records after a gap in sequence numbers are passed on with
+ * DISCONTINUITY set.
+ */
+class StreamParser {
+  public:
+    typedef std::function<void(const RecordHeader& header,
+                               const uint8_t* payload)> Callback;
+
+    explicit StreamParser(Callback callback);
+
+    void feed(const uint8_t* data, size_t size);
+
+    uint64_t records() const {
+      return mRecords;
+    }
+
+    uint64_t droppedRecords() const {
+      return mDroppedRecords;
+    }
+
+    uint64_t skippedBytes() const {
+      return mSkippedBytes;
+    }
+
+  private:
+    /**
+     * Skip to the next thing that could be a header.
+     */
+    void resync();
+
+    Callback mCallback;
+    std::vector<uint8_t> mBuffer;
+    size_t mStart;
+    bool mWaitForKeyframe;
+    bool mHaveSequence;
+    uint32_t mNextSequence;
+
+    uint64_t mRecords;
+    uint64_t mDroppedRecords;
+    uint64_t mSkippedBytes;
+};
+
+} // namespace VideoFraming
+
+#endif // VIDEO_FRAMING_HPP
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#include <cstring>
+
+#include "analysis_tap.hpp"
+
+// One buffer being analysed, and at least one to copy the next frame into
+static const size_t MIN_BUFFERS = 2;
+
+
+AnalysisTap::AnalysisTap(const Config& config, Callback callback)
+  : mConfig{std::max(config.bufferCount, MIN_BUFFERS), config.bufferSize}
+  , mCallback{std::move(callback)}
+  , mSlots(mConfig.bufferCount)
+  , mFree{mConfig.bufferCount}
+  , mReady{mConfig.bufferCount}
+  , mThread{}
+  , mRunning{false}
+  , mWaitMutex{}
+  , mReadyCv{}
+  , mWaiting{false}
+  , mSequence{0}
+  , mOffered{0}
+  , mDelivered{0}
+  , mDropped{0}
+  , mOversized{0}
+{
+  for (size_t i = 0; i < mSlots.size(); i++) {
+    mSlots[i].frame = RawFrame{};
+    mSlots[i].data.reset(new uint8_t[mConfig.bufferSize]);
+    size_t index = i;
+    mFree.tryPush(std::move(index));
+  }
+}
+
+AnalysisTap::~AnalysisTap() {
+  stop();
+}
+
+bool AnalysisTap::start() {
+  if (mRunning.load()) {
+    return false;
+  }
+  mRunning.store(true);
+  mThread = std::thread{&AnalysisTap::run, this};
+  return true;
+}
+
+void AnalysisTap::stop() {
+  if (!mRunning.exchange(false)) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock{mWaitMutex};
+    mReadyCv.notify_all();
+  }
+  mThread.join();
+
+  size_t index;
+  while (mReady.tryPop(index)) {
+    mDropped.fetch_add(1, std::memory_order_relaxed);
+    mFree.tryPush(std::move(index));
+  }
+}
+
+bool AnalysisTap::offer(const RawFrame& frame) {
+  mOffered.fetch_add(1, std::memory_order_relaxed);
+  const uint64_t sequence = mSequence++;
+  if ((frame.size > mConfig.bufferSize) || (frame.data == nullptr)) {
+    mOversized.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  size_t index;
+  if (!mFree.tryPop(index)) {
+    // The analysis thread is behind: reuse the oldest waiting frame's buffer
+    if (!mReady.tryPop(index)) {
+      // Every buffer is in use, which only happens when a frame is
+      // offered while the previous one is still being evicted
+      mDropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    mDropped.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  Slot& slot = mSlots[index];
+  memcpy(slot.data.get(), frame.data, frame.size);
+  slot.frame = frame;
+  slot.frame.sequence = sequence;
+  slot.frame.data = slot.data.get();
+  mReady.tryPush(std::move(index));
+
+  // Only take the lock if the analysis thread is (about to be) asleep. The
+  // fence pairs with the one in run().
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (mWaiting.load()) {
+    std::lock_guard<std::mutex> lock{mWaitMutex};
+    mReadyCv.notify_one();
+  }
+  return true;
+}
+
+AnalysisTap::Stats AnalysisTap::stats() const {
+  Stats stats{};
+  stats.offered = mOffered.load(std::memory_order_relaxed);
+  stats.delivered = mDelivered.load(std::memory_order_relaxed);
+  stats.dropped = mDropped.load(std::memory_order_relaxed);
+  stats.oversized = mOversized.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void AnalysisTap::run() {
+  while (mRunning.load()) {
+    size_t index;
+    if (!mReady.tryPop(index)) {
+      std::unique_lock<std::mutex> lock{mWaitMutex};
+      mWaiting.store(true);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      mReadyCv.wait(lock, [this] {
+        return !mReady.empty() || !mRunning.load();
+      });
+      mWaiting.store(false);
+      continue;
+    }
+
+    mCallback(mSlots[index].frame);
+    mDelivered.fetch_add(1, std::memory_order_relaxed);
+    mFree.tryPush(std::move(index));
+  }
+}
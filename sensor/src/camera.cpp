@@ -15,6 +15,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <ios>
 #include <fstream>
 
@@ -22,30 +23,20 @@
 #include "logging.hpp"
 
 
+static const std::string CAMERA_NS = "Camera: ";
 
-const unsigned int SENSOR_MODE_WIDTH[NUM_SENSOR_MODES] {
-  0,
-  1920,
-  3280,
-  3280,
-  1640,
-  1640,
-  1282,
-  640,
-};
+// Each frame assembler slab holds this many encoder output buffers
+static const size_t FRAME_SLAB_BUFFERS = 16;
+// Slabs to preallocate; the pool grows to fit the largest frame it sees
+static const size_t FRAME_INITIAL_SLABS = 4;
 
-const unsigned int SENSOR_MODE_HEIGHT[NUM_SENSOR_MODES] {
-  0,
-  1080,
-  2464,
-  2464,
-  1232,
-  922,
-  720,
-  480,
-};
+// Buffers for the analysis output port. The callback hands each one straight
+// back, so a few are enough to never leave the splitter without one.
+static const uint32_t ANALYSIS_PORT_BUFFERS = 3;
 
-static const std::string CAMERA_NS = "Camera: ";
+static inline uint32_t alignUp(uint32_t n, uint32_t alignment) {
+  return ((n + alignment - 1) / alignment) * alignment;
+}
 
 
 Camera::Camera(int mCameraNum)
@@ -55,8 +46,20 @@ Camera::Camera(int mCameraNum)
   , mCamera{nullptr}
   , mEncoder{nullptr}
   , mPreview{nullptr}
+  , mSplitter{nullptr}
+  , mResizer{nullptr}
   , mEncoderPool{nullptr}
+  , mFrameAssembler{nullptr}
+  , mStream{nullptr}
+  , mAccessUnitSplitter{nullptr}
+  , mAnalysisPool{nullptr}
+  , mAnalysisTap{nullptr}
+  , mAnalysisConfig{}
+  , mAnalysisCallback{}
   , mVideoEncoderConnection{nullptr}
+  , mPreviewNullConnection{nullptr}
+  , mCaptureSplitterConnection{nullptr}
+  , mSplitterResizerConnection{nullptr}
 {
 }
 
@@ -66,6 +69,11 @@ Camera::~Camera() {
     Logger::warning(__func__, "failed to disable encoder output\n");
   }
 
+  if ((analysisOutputPort() != nullptr) &&
+      (disableAnalysisOutput() != MMAL_SUCCESS)) {
+    Logger::warning(__func__, "failed to disable analysis output\n");
+  }
+
   if ((mCamera != nullptr) && (mmal_port_disable(getCamera()->control) != MMAL_SUCCESS)) {
     Logger::warning(__func__, "failed to disable encoder output\n");
   }
@@ -75,11 +83,25 @@ Camera::~Camera() {
     Logger::warning(__func__, "failed to destroy video -> encoder connection\n");
   }
 
+  if ((mCaptureSplitterConnection != nullptr) &&
+      (mmal_connection_destroy(mCaptureSplitterConnection) != MMAL_SUCCESS)) {
+    Logger::warning(__func__, "failed to destroy video -> splitter connection\n");
+  }
+
+  if ((mSplitterResizerConnection != nullptr) &&
+      (mmal_connection_destroy(mSplitterResizerConnection) != MMAL_SUCCESS)) {
+    Logger::warning(__func__, "failed to destroy splitter -> ISP connection\n");
+  }
+
   // Clean up pools
   if (mEncoderPool != nullptr) {
     mmal_pool_destroy(mEncoderPool);
   }
 
+  if (mAnalysisPool != nullptr) {
+    mmal_pool_destroy(mAnalysisPool);
+  }
+
   // Clean up components
   if ((mCamera != nullptr) && (mmal_component_destroy(mCamera) != MMAL_SUCCESS)) {
     Logger::warning(__func__, "failed to destroy camera component\n");
@@ -92,6 +114,14 @@ Camera::~Camera() {
   if ((mPreview != nullptr) && (mmal_component_destroy(mPreview) != MMAL_SUCCESS)) {
     Logger::warning(__func__, "failed to destroy null preview component\n");
   }
+
+  if ((mResizer != nullptr) && (mmal_component_destroy(mResizer) != MMAL_SUCCESS)) {
+    Logger::warning(__func__, "failed to destroy ISP component\n");
+  }
+
+  if ((mSplitter != nullptr) && (mmal_component_destroy(mSplitter) != MMAL_SUCCESS)) {
+    Logger::warning(__func__, "failed to destroy splitter component\n");
+  }
 }
 
 MMAL_STATUS_T Camera::open(SensorMode sensorMode, CaptureMode captureMode) {
@@ -129,6 +159,24 @@ MMAL_STATUS_T Camera::open(SensorMode sensorMode, CaptureMode captureMode) {
     return status;
   }
 
+  // Ask the firmware to tell us when gains or exposure change, so the
+  // cached state stays current without querying it for every frame
+  {
+    MMAL_PARAMETER_CHANGE_EVENT_REQUEST_T changeEvent = {
+      .hdr = {
+        MMAL_PARAMETER_CHANGE_EVENT_REQUEST,
+        sizeof(MMAL_PARAMETER_CHANGE_EVENT_REQUEST_T),
+      },
+      .change_id = MMAL_PARAMETER_CAMERA_SETTINGS,
+      .enable = 1,
+    };
+    status = mmal_port_parameter_set(mCamera->control, &changeEvent.hdr);
+    if (status != MMAL_SUCCESS) {
+      Logger::warning(__func__, "failed to request camera settings events\n");
+    }
+  }
+
+  getCamera()->control->userdata = reinterpret_cast<MMAL_PORT_USERDATA_T*>(this);
   status = mmal_port_enable(getCamera()->control, Camera::controlCallback);
   if (status != MMAL_SUCCESS) {
     Logger::error(__func__, "failed to enable control port\n");
@@ -223,6 +271,23 @@ uint32_t Camera::height() const {
   return SENSOR_MODE_HEIGHT[mSensorMode];
 }
 
+std::string Camera::encoding() const {
+  if ((mEncoder == nullptr) || (encoderOutputPort()->format == nullptr)) {
+    return "UNKNOWN";
+  }
+
+  switch (encoderOutputPort()->format->encoding) {
+    case MMAL_ENCODING_PNG:
+      return "PNG";
+    case MMAL_ENCODING_JPEG:
+      return "JPEG";
+    case MMAL_ENCODING_H264:
+      return "H264";
+    default:
+      return "UNKNOWN";
+  }
+}
+
 // Building with GCC 6.3.0, [[maybe_unused]] is not yet supported, even with
 // -std=c++17.
 __attribute__((unused)) static void printBufferFlags(const char* indent,
@@ -321,29 +386,118 @@ __attribute__((unused)) static void printBufferFlags(const char* indent,
 
 void Camera::controlCallback(MMAL_PORT_T* port, MMAL_BUFFER_HEADER_T* buffer) {
   Logger::debug(CAMERA_NS, "Camera::controlCallback called with cmd=0x%x\n", buffer->cmd);
+  Camera* pCamera = reinterpret_cast<Camera*>(port->userdata);
+
+  if (buffer->cmd == MMAL_EVENT_PARAMETER_CHANGED) {
+    MMAL_EVENT_PARAMETER_CHANGED_T* event =
+      reinterpret_cast<MMAL_EVENT_PARAMETER_CHANGED_T*>(buffer->data);
+    if ((pCamera != nullptr) &&
+        (event->hdr.id == MMAL_PARAMETER_CAMERA_SETTINGS)) {
+      pCamera->handleSettingsEvent(
+          *reinterpret_cast<MMAL_PARAMETER_CAMERA_SETTINGS_T*>(event));
+    }
+  }
+
+  mmal_buffer_header_release(buffer);
+}
+
+void Camera::handleSettingsEvent(const MMAL_PARAMETER_CAMERA_SETTINGS_T& settings) {
+  const auto now = CameraState::Clock::now();
+  std::lock_guard<std::mutex> lock{mStateMutex};
+  mState.exposureSpeed = settings.exposure;
+  mState.analogGain = Rational::fromMMAL(settings.analog_gain).toFloat();
+  mState.digitalGain = Rational::fromMMAL(settings.digital_gain).toFloat();
+  mState.awbGainRed = Rational::fromMMAL(settings.awb_red_gain).toFloat();
+  mState.awbGainBlue = Rational::fromMMAL(settings.awb_blue_gain).toFloat();
+  mState.touch(CameraState::EXPOSURE_SPEED, now);
+  mState.touch(CameraState::ANALOG_GAIN, now);
+  mState.touch(CameraState::DIGITAL_GAIN, now);
+  mState.touch(CameraState::AWB_GAIN_RED, now);
+  mState.touch(CameraState::AWB_GAIN_BLUE, now);
+}
+
+template <typename T>
+void Camera::cacheValue(CameraState::Field field, T CameraState::* member,
+                        T value) {
+  std::lock_guard<std::mutex> lock{mStateMutex};
+  mState.*member = value;
+  mState.touch(field);
+}
+
+CameraState Camera::stateSnapshot() const {
+  std::lock_guard<std::mutex> lock{mStateMutex};
+  return mState;
+}
+
+MMAL_STATUS_T Camera::refreshVolatileState() {
+  Rational analogGain, digitalGain, redGain, blueGain;
+  MMAL_STATUS_T status = getAnalogGain(analogGain);
+  if (status != MMAL_SUCCESS) {
+    return status;
+  }
+  cacheValue(CameraState::ANALOG_GAIN, &CameraState::analogGain,
+             analogGain.toFloat());
+
+  status = getDigitalGain(digitalGain);
+  if (status != MMAL_SUCCESS) {
+    return status;
+  }
+  cacheValue(CameraState::DIGITAL_GAIN, &CameraState::digitalGain,
+             digitalGain.toFloat());
+
+  status = getAWBGains(redGain, blueGain);
+  if (status != MMAL_SUCCESS) {
+    return status;
+  }
+  cacheValue(CameraState::AWB_GAIN_RED, &CameraState::awbGainRed,
+             redGain.toFloat());
+  cacheValue(CameraState::AWB_GAIN_BLUE, &CameraState::awbGainBlue,
+             blueGain.toFloat());
+
+  return status;
 }
 
-static std::string imageBuffer{};
 void Camera::encoderCallback(MMAL_PORT_T* port, MMAL_BUFFER_HEADER_T* buffer) {
   //Logger::debug(CAMERA_NS, "Camera::encoderCallback called\n");
   Camera* pCamera = reinterpret_cast<Camera*>(port->userdata);
 
-  size_t nBytes = 0;
-  static size_t nRcvd = 0;
-  mmal_buffer_header_mem_lock(buffer);
-  nBytes = buffer->length;
-  imageBuffer.append(reinterpret_cast<char*>(buffer->data + buffer->offset), nBytes);
-  mmal_buffer_header_mem_unlock(buffer);
-
-  nRcvd += nBytes;
-  if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED) {
-    Logger::warning("Buffer transmission failed\n");
-    nRcvd = 0;
-  } else if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) {
-    pCamera->mEncoderCallback(*pCamera, imageBuffer);
-    imageBuffer.clear();
-    Logger::info("Frame received: %u bytes\n", nRcvd);
-    nRcvd = 0;
+  if (pCamera->mAccessUnitSplitter) {
+    // Video: hand out access units as soon as they're complete
+    AccessUnitSplitter& splitter = *pCamera->mAccessUnitSplitter;
+    mmal_buffer_header_mem_lock(buffer);
+    splitter.append(buffer->data + buffer->offset, buffer->length,
+                    buffer->pts);
+    mmal_buffer_header_mem_unlock(buffer);
+
+    if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED) {
+      Logger::warning("Buffer transmission failed\n");
+      splitter.discard();
+    } else if (buffer->flags & (MMAL_BUFFER_HEADER_FLAG_FRAME_END |
+                                MMAL_BUFFER_HEADER_FLAG_CONFIG)) {
+      splitter.endAccessUnit();
+    }
+  } else {
+    FrameAssembler& assembler = *pCamera->mFrameAssembler;
+
+    // Copy the buffer into the assembler's slabs so it can go straight back
+    // to the encoder. Holding on to MMAL buffers until FRAME_END would
+    // starve the port: a full-resolution PNG is much bigger than the whole
+    // pool.
+    mmal_buffer_header_mem_lock(buffer);
+    assembler.append(buffer->data + buffer->offset, buffer->length);
+    mmal_buffer_header_mem_unlock(buffer);
+
+    if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED) {
+      Logger::warning("Buffer transmission failed\n");
+      assembler.discard();
+    } else if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) {
+      // The encoder passes the camera's PTS on, so it matches the raw frame
+      // the analysis tap gets for this capture
+      FramePtr frame = assembler.finish(buffer->pts);
+      Logger::info("Frame received: %zu bytes in %zu chunks\n", frame->size(),
+                   frame->chunks().size());
+      pCamera->mEncoderCallback(*pCamera, frame);
+    }
   }
 
   mmal_buffer_header_release(buffer);
@@ -359,6 +513,43 @@ void Camera::encoderCallback(MMAL_PORT_T* port, MMAL_BUFFER_HEADER_T* buffer) {
   }
 }
 
+void Camera::analysisCallback(MMAL_PORT_T* port, MMAL_BUFFER_HEADER_T* buffer) {
+  Camera* pCamera = reinterpret_cast<Camera*>(port->userdata);
+
+  // Copy the frame out and give the buffer straight back, whether or not
+  // the analysis thread has room for it; waiting here would hold up the
+  // splitter, and with it the encoder
+  if ((buffer->length > 0) &&
+      !(buffer->flags & MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED)) {
+    const MMAL_VIDEO_FORMAT_T& video = port->format->es->video;
+    mmal_buffer_header_mem_lock(buffer);
+    const RawFrame frame{
+      static_cast<uint32_t>(video.crop.width),
+      static_cast<uint32_t>(video.crop.height),
+      video.width,
+      video.height,
+      buffer->pts,
+      0,
+      buffer->data + buffer->offset,
+      buffer->length,
+    };
+    pCamera->mAnalysisTap->offer(frame);
+    mmal_buffer_header_mem_unlock(buffer);
+  }
+
+  mmal_buffer_header_release(buffer);
+
+  if (port->is_enabled) {
+    MMAL_BUFFER_HEADER_T* newBuffer =
+      mmal_queue_get(pCamera->mAnalysisPool->queue);
+    if (newBuffer == nullptr) {
+      Logger::warning(__func__, "Failed to get new buffer\n");
+    } else if (mmal_port_send_buffer(port, newBuffer) != MMAL_SUCCESS) {
+      Logger::warning(__func__, "Failed to send new buffer to port\n");
+    }
+  }
+}
+
 enum {
   PREVIEW_PORT = 0,
   VIDEO_PORT = 1,
@@ -428,6 +619,115 @@ MMAL_PORT_T* Camera::encoderOutputPort() const {
   return getEncoder()->output[0];
 }
 
+MMAL_PORT_T* Camera::analysisOutputPort() const {
+  if (mResizer != nullptr) {
+    return mResizer->output[0];
+  } else if (mSplitter != nullptr) {
+    return mSplitter->output[1];
+  }
+  return nullptr;
+}
+
+const AnalysisTap* Camera::analysisTap() const {
+  return mAnalysisTap.get();
+}
+
+MMAL_STATUS_T Camera::enableAnalysisTap(const AnalysisConfig& config,
+                                        AnalysisTap::Callback callback) {
+  if (mSplitter != nullptr) {
+    Logger::error(__func__, "Analysis tap already enabled\n");
+    return MMAL_EINVAL;
+  }
+
+  MMAL_STATUS_T status = mmal_component_create(
+      MMAL_COMPONENT_DEFAULT_VIDEO_SPLITTER, &mSplitter);
+  if (status != MMAL_SUCCESS) {
+    Logger::error(__func__, "Failed to create splitter component\n");
+    return status;
+  }
+  if ((mSplitter->input_num < 1) || (mSplitter->output_num < 2)) {
+    Logger::error(__func__, "invalid splitter input/output number\n");
+    return MMAL_ENOSYS;
+  }
+
+  // The splitter passes the capture format through to the encoder, and
+  // converts to I420 for the tap
+  MMAL_PORT_T* splitterInput = mSplitter->input[0];
+  mmal_format_copy(splitterInput->format, captureOutputPort()->format);
+  status = mmal_port_format_commit(splitterInput);
+  if (status != MMAL_SUCCESS) {
+    Logger::error(__func__, "Failed to set splitter input format\n");
+    return status;
+  }
+  for (unsigned i = 0; i < 2; i++) {
+    MMAL_PORT_T* output = mSplitter->output[i];
+    mmal_format_copy(output->format, splitterInput->format);
+    if (i == 1) {
+      output->format->encoding = MMAL_ENCODING_I420;
+      output->format->encoding_variant = MMAL_ENCODING_I420;
+    }
+    status = mmal_port_format_commit(output);
+    if (status != MMAL_SUCCESS) {
+      Logger::error(__func__, "Failed to set splitter output[%u] format\n", i);
+      return status;
+    }
+  }
+
+  const MMAL_VIDEO_FORMAT_T& captureVideo = splitterInput->format->es->video;
+  const bool scaled = (config.width != 0) && (config.height != 0) &&
+    ((config.width != static_cast<uint32_t>(captureVideo.crop.width)) ||
+     (config.height != static_cast<uint32_t>(captureVideo.crop.height)));
+  if (scaled) {
+    status = mmal_component_create("vc.ril.isp", &mResizer);
+    if (status != MMAL_SUCCESS) {
+      Logger::error(__func__, "Failed to create ISP component\n");
+      return status;
+    }
+
+    MMAL_PORT_T* resizerInput = mResizer->input[0];
+    MMAL_PORT_T* resizerOutput = mResizer->output[0];
+    mmal_format_copy(resizerInput->format, mSplitter->output[1]->format);
+    status = mmal_port_format_commit(resizerInput);
+    if (status != MMAL_SUCCESS) {
+      Logger::error(__func__, "Failed to set ISP input format\n");
+      return status;
+    }
+
+    mmal_format_copy(resizerOutput->format, resizerInput->format);
+    MMAL_VIDEO_FORMAT_T& video = resizerOutput->format->es->video;
+    video.width = alignUp(config.width, 32);
+    video.height = alignUp(config.height, 16);
+    video.crop = {0, 0, static_cast<int32_t>(config.width),
+                  static_cast<int32_t>(config.height)};
+    status = mmal_port_format_commit(resizerOutput);
+    if (status != MMAL_SUCCESS) {
+      Logger::error(__func__, "Failed to set ISP output format %ux%u\n",
+                    config.width, config.height);
+      return status;
+    }
+  }
+
+  status = mmal_component_enable(mSplitter);
+  if (status != MMAL_SUCCESS) {
+    Logger::error(__func__, "Failed to enable splitter component\n");
+    return status;
+  }
+  if (mResizer != nullptr) {
+    status = mmal_component_enable(mResizer);
+    if (status != MMAL_SUCCESS) {
+      Logger::error(__func__, "Failed to enable ISP component\n");
+      return status;
+    }
+  }
+
+  mAnalysisConfig = config;
+  mAnalysisCallback = std::move(callback);
+  const MMAL_VIDEO_FORMAT_T& tapVideo = analysisOutputPort()->format->es->video;
+  Logger::info(__func__, "Analysis tap: %dx%d I420%s\n", tapVideo.crop.width,
+               tapVideo.crop.height, scaled ? ", scaled by the ISP" : "");
+  return MMAL_SUCCESS;
+}
+
 MMAL_STATUS_T Camera::createBufferPools() {
   {
     MMAL_PORT_T* encoderOutput = encoderOutputPort();
@@ -440,6 +740,34 @@ MMAL_STATUS_T Camera::createBufferPools() {
     Logger::info(__func__, "Created encoder output buffer pool with %d "
                  "buffers of size %d B\n",
                  encoderOutput->buffer_num, encoderOutput->buffer_size);
+
+    mFrameAssembler = std::make_unique<FrameAssembler>(
+        encoderOutput->buffer_size * FRAME_SLAB_BUFFERS, FRAME_INITIAL_SLABS);
+    mFrameAssembler->setStream(mStream);
+  }
+
+  MMAL_PORT_T* analysisOutput = analysisOutputPort();
+  if (analysisOutput != nullptr) {
+    // One whole frame per buffer
+    analysisOutput->buffer_num = std::max(analysisOutput->buffer_num_recommended,
+                                          ANALYSIS_PORT_BUFFERS);
+    analysisOutput->buffer_size = analysisOutput->buffer_size_recommended;
+    mAnalysisPool = mmal_port_pool_create(analysisOutput,
+                                          analysisOutput->buffer_num,
+                                          analysisOutput->buffer_size);
+    if (mAnalysisPool == nullptr) {
+      Logger::error(__func__, "Failed to allocate analysis buffer pool\n");
+      return MMAL_ENOMEM;
+    }
+
+    AnalysisTap::Config tapConfig{};
+    tapConfig.bufferCount = mAnalysisConfig.bufferCount;
+    tapConfig.bufferSize = analysisOutput->buffer_size;
+    mAnalysisTap = std::make_unique<AnalysisTap>(tapConfig, mAnalysisCallback);
+    Logger::info(__func__, "Created analysis buffer pool with %d buffers, "
+                 "and %zu analysis buffers, of size %d B\n",
+                 analysisOutput->buffer_num, tapConfig.bufferCount,
+                 analysisOutput->buffer_size);
   }
 
   return MMAL_SUCCESS;
@@ -471,6 +799,68 @@ MMAL_STATUS_T Camera::enableEncoder() {
 }
 
 MMAL_STATUS_T Camera::enableCallbacks(encoderCallbackType encoderCallback) {
+  mAccessUnitSplitter.reset();
+  mEncoderCallback = std::move(encoderCallback);
+  MMAL_STATUS_T status = enableAnalysisOutput();
+  if (status != MMAL_SUCCESS) {
+    return status;
+  }
+  return enableEncoderOutput();
+}
+
+MMAL_STATUS_T Camera::enableVideoCallbacks(
+    AccessUnitSplitter::Callback callback) {
+  mAccessUnitSplitter = std::make_unique<AccessUnitSplitter>(
+      encoderOutputPort()->buffer_size * FRAME_SLAB_BUFFERS,
+      FRAME_INITIAL_SLABS, std::move(callback));
+  MMAL_STATUS_T status = enableAnalysisOutput();
+  if (status != MMAL_SUCCESS) {
+    return status;
+  }
+  return enableEncoderOutput();
+}
+
+MMAL_STATUS_T Camera::enableAnalysisOutput() {
+  MMAL_PORT_T* analysisOutput = analysisOutputPort();
+  if ((analysisOutput == nullptr) || !mAnalysisTap) {
+    return MMAL_SUCCESS;
+  }
+
+  mAnalysisTap->start();
+  analysisOutput->userdata = reinterpret_cast<MMAL_PORT_USERDATA_T*>(this);
+  MMAL_STATUS_T status = mmal_port_enable(analysisOutput,
+                                          Camera::analysisCallback);
+  if (status != MMAL_SUCCESS) {
+    Logger::error(__func__, "Failed to set up analysis output callback\n");
+    mAnalysisTap->stop();
+    return status;
+  }
+
+  int n = mmal_queue_length(mAnalysisPool->queue);
+  for (int q = 0; q < n; q++) {
+    MMAL_BUFFER_HEADER_T* buf = mmal_queue_get(mAnalysisPool->queue);
+    if (mmal_port_send_buffer(analysisOutput, buf) != MMAL_SUCCESS) {
+      Logger::warning(__func__, "Failed to send buffer to analysis output port\n");
+    }
+  }
+
+  return status;
+}
+
+MMAL_STATUS_T Camera::disableAnalysisOutput() {
+  MMAL_PORT_T* analysisOutput = analysisOutputPort();
+  MMAL_STATUS_T status = MMAL_SUCCESS;
+  if ((analysisOutput != nullptr) && analysisOutput->is_enabled) {
+    status = mmal_port_disable(analysisOutput);
+  }
+  // Nothing can be offered once the port is disabled
+  if (mAnalysisTap) {
+    mAnalysisTap->stop();
+  }
+  return status;
+}
+
+MMAL_STATUS_T Camera::enableEncoderOutput() {
   MMAL_STATUS_T status;
 
   encoderOutputPort()->userdata = reinterpret_cast<MMAL_PORT_USERDATA_T*>(this);
@@ -479,7 +869,6 @@ MMAL_STATUS_T Camera::enableCallbacks(encoderCallbackType encoderCallback) {
     Logger::error(__func__, "Failed to set up encoder output callback\n");
     return status;
   }
-  mEncoderCallback = std::move(encoderCallback);
 
   int n = mmal_queue_length(getEncoderBufferPool()->queue);
   for (int q = 0; q < n; q++) {
@@ -493,7 +882,50 @@ MMAL_STATUS_T Camera::enableCallbacks(encoderCallbackType encoderCallback) {
 }
 
 MMAL_STATUS_T Camera::disableCallbacks() {
-  return mmal_port_disable(encoderOutputPort());
+  MMAL_STATUS_T status = mmal_port_disable(encoderOutputPort());
+  MMAL_STATUS_T analysisStatus = disableAnalysisOutput();
+  return (status != MMAL_SUCCESS) ? status : analysisStatus;
+}
+
+bool Camera::start(FrameCallback callback) {
+  return enableCallbacks(std::move(callback)) == MMAL_SUCCESS;
+}
+
+bool Camera::stop() {
+  if (disableCapture() != MMAL_SUCCESS) {
+    return false;
+  }
+  return disableCallbacks() == MMAL_SUCCESS;
+}
+
+bool Camera::requestCapture() {
+  return enableCapture() == MMAL_SUCCESS;
+}
+
+void Camera::setStream(FrameAssembler::Stream* stream) {
+  mStream = stream;
+  if (mFrameAssembler) {
+    mFrameAssembler->setStream(stream);
+  }
+}
+
+MMAL_STATUS_T Camera::connectPorts(MMAL_CONNECTION_T*& connection,
+                                    MMAL_PORT_T* output, MMAL_PORT_T* input) {
+  MMAL_STATUS_T status = mmal_connection_create(&connection, output, input,
+                                                MMAL_CONNECTION_FLAG_TUNNELLING |
+                                                MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT);
+  if (status != MMAL_SUCCESS) {
+    Logger::error(__func__, "Failed to connect %s to %s\n", output->name,
+                  input->name);
+    return status;
+  }
+
+  status = mmal_connection_enable(connection);
+  if (status != MMAL_SUCCESS) {
+    Logger::error(__func__, "Failed to enable %s -> %s connection\n",
+                  output->name, input->name);
+  }
+  return status;
 }
 
 MMAL_STATUS_T Camera::setUpConnections() {
@@ -501,20 +933,32 @@ MMAL_STATUS_T Camera::setUpConnections() {
     MMAL_PORT_T* encoderInput = encoderInputPort();
     MMAL_PORT_T* captureOutput = captureOutputPort();
     MMAL_STATUS_T status;
-    // video -> encoder
-    status = mmal_connection_create(&mVideoEncoderConnection,
-                                    captureOutput, encoderInput,
-                                    MMAL_CONNECTION_FLAG_TUNNELLING |
-                                    MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT);
-    if (status != MMAL_SUCCESS) {
-      Logger::error(__func__, "Failed to connect video output to encoder input[0]\n");
-      return status;
-    }
-
-    status = mmal_connection_enable(mVideoEncoderConnection);
-    if (status != MMAL_SUCCESS) {
-      Logger::error(__func__, "Failed to enable video -> encoder connection\n");
-      return status;
+    if (mSplitter != nullptr) {
+      // video -> splitter -> encoder, and splitter -> ISP if there is one
+      status = connectPorts(mCaptureSplitterConnection, captureOutput,
+                            mSplitter->input[0]);
+      if (status != MMAL_SUCCESS) {
+        return status;
+      }
+      status = connectPorts(mVideoEncoderConnection, mSplitter->output[0],
+                            encoderInput);
+      if (status != MMAL_SUCCESS) {
+        return status;
+      }
+      if (mResizer != nullptr) {
+        status = connectPorts(mSplitterResizerConnection,
+                              mSplitter->output[1], mResizer->input[0]);
+        if (status != MMAL_SUCCESS) {
+          return status;
+        }
+      }
+    } else {
+      // video -> encoder
+      status = connectPorts(mVideoEncoderConnection, captureOutput,
+                            encoderInput);
+      if (status != MMAL_SUCCESS) {
+        return status;
+      }
     }
   }
 
@@ -567,7 +1011,14 @@ MMAL_STATUS_T Camera::setAWBGains(Rational redGain, Rational blueGain){
       .r_gain = redGain.toMMAL(),
       .b_gain = blueGain.toMMAL(),
   };
-  return mmal_port_parameter_set(mCamera->control, &param.hdr);
+  MMAL_STATUS_T status = mmal_port_parameter_set(mCamera->control, &param.hdr);
+  if (status == MMAL_SUCCESS) {
+    cacheValue(CameraState::AWB_GAIN_RED, &CameraState::awbGainRed,
+               redGain.toFloat());
+    cacheValue(CameraState::AWB_GAIN_BLUE, &CameraState::awbGainBlue,
+               blueGain.toFloat());
+  }
+  return status;
 }
 
 MMAL_STATUS_T Camera::getAWBGains(Rational& redGain, Rational& blueGain) {
@@ -634,9 +1085,14 @@ MMAL_STATUS_T Camera::setCameraConfig(const MMAL_PARAMETER_CAMERA_CONFIG_T& conf
 }
 
 MMAL_STATUS_T Camera::setSharpness(Rational sharpness) {
-  return mmal_port_parameter_set_rational(mCamera->control,
+  MMAL_STATUS_T status = mmal_port_parameter_set_rational(mCamera->control,
                                           MMAL_PARAMETER_SHARPNESS,
                                           sharpness.toMMAL());
+  if (status == MMAL_SUCCESS) {
+    cacheValue(CameraState::SHARPNESS, &CameraState::sharpness,
+               sharpness.toFloat());
+  }
+  return status;
 }
 
 MMAL_STATUS_T Camera::getSharpness(Rational& sharpness) {
@@ -649,9 +1105,14 @@ MMAL_STATUS_T Camera::getSharpness(Rational& sharpness) {
 }
 
 MMAL_STATUS_T Camera::setContrast(Rational contrast) {
-  return mmal_port_parameter_set_rational(mCamera->control,
+  MMAL_STATUS_T status = mmal_port_parameter_set_rational(mCamera->control,
                                           MMAL_PARAMETER_CONTRAST,
                                           contrast.toMMAL());
+  if (status == MMAL_SUCCESS) {
+    cacheValue(CameraState::CONTRAST, &CameraState::contrast,
+               contrast.toFloat());
+  }
+  return status;
 }
 
 MMAL_STATUS_T Camera::getContrast(Rational& contrast) {
@@ -664,9 +1125,14 @@ MMAL_STATUS_T Camera::getContrast(Rational& contrast) {
 }
 
 MMAL_STATUS_T Camera::setBrightness(Rational brightness) {
-  return mmal_port_parameter_set_rational(mCamera->control,
+  MMAL_STATUS_T status = mmal_port_parameter_set_rational(mCamera->control,
                                           MMAL_PARAMETER_BRIGHTNESS,
                                           brightness.toMMAL());
+  if (status == MMAL_SUCCESS) {
+    cacheValue(CameraState::BRIGHTNESS, &CameraState::brightness,
+               brightness.toFloat());
+  }
+  return status;
 }
 
 MMAL_STATUS_T Camera::getBrightness(Rational& brightness) {
@@ -679,9 +1145,14 @@ MMAL_STATUS_T Camera::getBrightness(Rational& brightness) {
 }
 
 MMAL_STATUS_T Camera::setSaturation(Rational saturation) {
-  return mmal_port_parameter_set_rational(mCamera->control,
+  MMAL_STATUS_T status = mmal_port_parameter_set_rational(mCamera->control,
                                           MMAL_PARAMETER_SATURATION,
                                           saturation.toMMAL());
+  if (status == MMAL_SUCCESS) {
+    cacheValue(CameraState::SATURATION, &CameraState::saturation,
+               saturation.toFloat());
+  }
+  return status;
 }
 
 MMAL_STATUS_T Camera::getSaturation(Rational& saturation) {
@@ -694,8 +1165,13 @@ MMAL_STATUS_T Camera::getSaturation(Rational& saturation) {
 }
 
 MMAL_STATUS_T Camera::setISO(uint32_t iso) {
-  return mmal_port_parameter_set_uint32(mCamera->control, MMAL_PARAMETER_ISO,
-                                        iso);
+  MMAL_STATUS_T status = mmal_port_parameter_set_uint32(mCamera->control,
+                                                        MMAL_PARAMETER_ISO,
+                                                        iso);
+  if (status == MMAL_SUCCESS) {
+    cacheValue(CameraState::ISO, &CameraState::iso, iso);
+  }
+  return status;
 }
 
 MMAL_STATUS_T Camera::getISO(uint32_t& iso) {
@@ -704,8 +1180,13 @@ MMAL_STATUS_T Camera::getISO(uint32_t& iso) {
 }
 
 MMAL_STATUS_T Camera::setShutterSpeed(uint32_t speed) {
-  return mmal_port_parameter_set_uint32(mCamera->control,
-                                        MMAL_PARAMETER_SHUTTER_SPEED, speed);
+  MMAL_STATUS_T status = mmal_port_parameter_set_uint32(mCamera->control,
+                                                        MMAL_PARAMETER_SHUTTER_SPEED,
+                                                        speed);
+  if (status == MMAL_SUCCESS) {
+    cacheValue(CameraState::SHUTTER_SPEED, &CameraState::shutterSpeed, speed);
+  }
+  return status;
 }
 
 MMAL_STATUS_T Camera::getShutterSpeed(uint32_t& speed) {
@@ -725,9 +1206,14 @@ MMAL_STATUS_T Camera::setCameraUseCase(MMAL_PARAM_CAMERA_USE_CASE_T useCase) {
 }
 
 MMAL_STATUS_T Camera::setAnalogGain(Rational gain) {
-  return mmal_port_parameter_set_rational(mCamera->control, 
+  MMAL_STATUS_T status = mmal_port_parameter_set_rational(mCamera->control, 
       MMAL_PARAMETER_ANALOG_GAIN,
       gain.toMMAL());
+  if (status == MMAL_SUCCESS) {
+    cacheValue(CameraState::ANALOG_GAIN, &CameraState::analogGain,
+               gain.toFloat());
+  }
+  return status;
 }
 
 MMAL_STATUS_T Camera::getAnalogGain(Rational& gain) {
@@ -740,9 +1226,14 @@ MMAL_STATUS_T Camera::getAnalogGain(Rational& gain) {
 }
 
 MMAL_STATUS_T Camera::setDigitalGain(Rational gain) {
-  return mmal_port_parameter_set_rational(mCamera->control, 
+  MMAL_STATUS_T status = mmal_port_parameter_set_rational(mCamera->control, 
       MMAL_PARAMETER_DIGITAL_GAIN,
       gain.toMMAL());
+  if (status == MMAL_SUCCESS) {
+    cacheValue(CameraState::DIGITAL_GAIN, &CameraState::digitalGain,
+               gain.toFloat());
+  }
+  return status;
 }
 
 MMAL_STATUS_T Camera::getDigitalGain(Rational& gain) {
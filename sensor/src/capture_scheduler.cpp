@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include "capture_scheduler.hpp"
+#include "logging.hpp"
+
+
+CaptureScheduler::CaptureScheduler(const Config& config, Trigger trigger)
+  : mConfig{config}
+  , mTrigger{std::move(trigger)}
+  , mMutex{}
+  , mCv{}
+  , mCaptured{0}
+  , mStopped{false}
+{
+}
+
+void CaptureScheduler::frameCaptured() {
+  {
+    std::lock_guard<std::mutex> lock{mMutex};
+    mCaptured++;
+  }
+  mCv.notify_all();
+}
+
+void CaptureScheduler::stop() {
+  {
+    std::lock_guard<std::mutex> lock{mMutex};
+    mStopped = true;
+  }
+  mCv.notify_all();
+}
+
+unsigned CaptureScheduler::framesCaptured() const {
+  std::lock_guard<std::mutex> lock{mMutex};
+  return mCaptured;
+}
+
+bool CaptureScheduler::sleepUntil(std::unique_lock<std::mutex>& lock,
+                                  Clock::time_point deadline) {
+  mCv.wait_until(lock, deadline, [this] { return mStopped; });
+  return !mStopped;
+}
+
+bool CaptureScheduler::run(unsigned frameCount) {
+  const unsigned burstCount = std::max(mConfig.burstCount, 1u);
+
+  std::unique_lock<std::mutex> lock{mMutex};
+  if (!sleepUntil(lock, Clock::now() + mConfig.initialDelay)) {
+    return false;
+  }
+
+  Clock::time_point nextBurst = Clock::now();
+  while (mCaptured < frameCount) {
+    if (!sleepUntil(lock, nextBurst)) {
+      return false;
+    }
+    nextBurst = Clock::now() + mConfig.interval;
+
+    for (unsigned i = 0; (i < burstCount) && (mCaptured < frameCount); i++) {
+      const unsigned expected = mCaptured + 1;
+
+      // Don't hold the lock while talking to the camera
+      lock.unlock();
+      bool triggered = mTrigger();
+      lock.lock();
+      if (!triggered) {
+        Logger::error(__func__, "Failed to trigger capture\n");
+        return false;
+      }
+
+      // The encoder callback wakes us up as soon as the frame is out, and the
+      // next capture in the burst starts right away
+      bool arrived = mCv.wait_for(lock, mConfig.frameTimeout, [&] {
+        return (mCaptured >= expected) || mStopped;
+      });
+      if (mStopped) {
+        return false;
+      }
+      if (!arrived) {
+        Logger::error(__func__, "Timed out waiting for frame %u\n", expected);
+        return false;
+      }
+    }
+
+    if (mCaptured < frameCount) {
+      nextBurst = std::max(nextBurst, Clock::now() + mConfig.settleTime);
+    }
+  }
+
+  return true;
+}
@@ -0,0 +1,390 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#include <cstring>
+
+#include "chunk_framing.hpp"
+#include "crc32c.hpp"
+#include "logging.hpp"
+
+namespace ChunkFraming {
+
+static const uint8_t MAGIC[4] = {'P', 'C', 'C', 'H'};
+static const uint8_t ACK_MAGIC[4] = {'P', 'C', 'A', 'K'};
+
+// The CRC covers everything in the header before it
+static const size_t CRC_OFFSET = 32;
+
+// Completed frame ids remembered, for records that turn up late
+static const size_t COMPLETED_HISTORY = 16;
+
+static uint8_t* putBE32(uint8_t* p, uint32_t value) {
+  p[0] = static_cast<uint8_t>(value >> 24);
+  p[1] = static_cast<uint8_t>(value >> 16);
+  p[2] = static_cast<uint8_t>(value >> 8);
+  p[3] = static_cast<uint8_t>(value);
+  return p + 4;
+}
+
+static uint8_t* putBE64(uint8_t* p, uint64_t value) {
+  p = putBE32(p, static_cast<uint32_t>(value >> 32));
+  return putBE32(p, static_cast<uint32_t>(value));
+}
+
+static uint32_t getBE32(const uint8_t* p) {
+  return (static_cast<uint32_t>(p[0]) << 24) |
+    (static_cast<uint32_t>(p[1]) << 16) |
+    (static_cast<uint32_t>(p[2]) << 8) |
+    static_cast<uint32_t>(p[3]);
+}
+
+static uint64_t getBE64(const uint8_t* p) {
+  return (static_cast<uint64_t>(getBE32(p)) << 32) | getBE32(p + 4);
+}
+
+static uint32_t recordCrc(const uint8_t* header, const uint8_t* payload,
+                          size_t payloadSize) {
+  uint32_t crc = crc32c(header, CRC_OFFSET);
+  return (payloadSize > 0) ? crc32c(payload, payloadSize, crc) : crc;
+}
+
+void encodeHeader(const RecordHeader& header, const uint8_t* payload,
+                  uint8_t* out) {
+  memcpy(out, MAGIC, sizeof(MAGIC));
+  out[4] = VERSION;
+  out[5] = header.type;
+  out[6] = 0;
+  out[7] = 0;
+  uint8_t* p = putBE32(out + 8, header.index);
+  p = putBE64(p, header.frameId);
+  p = putBE64(p, header.offset);
+  p = putBE32(p, header.payloadSize);
+  putBE32(p, recordCrc(out, payload, header.payloadSize));
+}
+
+bool decodeHeader(const uint8_t* in, RecordHeader& header) {
+  if ((memcmp(in, MAGIC, sizeof(MAGIC)) != 0) || (in[4] != VERSION) ||
+      (in[5] > ABORT) || (in[6] != 0) || (in[7] != 0)) {
+    return false;
+  }
+
+  header.type = in[5];
+  header.index = getBE32(in + 8);
+  header.frameId = getBE64(in + 12);
+  header.offset = getBE64(in + 20);
+  header.payloadSize = getBE32(in + 28);
+  return header.payloadSize <= MAX_PAYLOAD_SIZE;
+}
+
+bool checkCrc(const uint8_t* in, const uint8_t* payload, size_t payloadSize) {
+  return recordCrc(in, payload, payloadSize) == getBE32(in + CRC_OFFSET);
+}
+
+void encodeAck(const Ack& ack, uint8_t* out) {
+  memcpy(out, ACK_MAGIC, sizeof(ACK_MAGIC));
+  out[4] = VERSION;
+  out[5] = ack.flags;
+  out[6] = 0;
+  out[7] = 0;
+  uint8_t* p = putBE64(out + 8, ack.frameId);
+  putBE64(p, ack.offset);
+}
+
+bool decodeAck(const uint8_t* in, Ack& ack) {
+  if ((memcmp(in, ACK_MAGIC, sizeof(ACK_MAGIC)) != 0) || (in[4] != VERSION) ||
+      (in[6] != 0) || (in[7] != 0)) {
+    return false;
+  }
+  ack.flags = in[5];
+  ack.frameId = getBE64(in + 8);
+  ack.offset = getBE64(in + 16);
+  return true;
+}
+
+void encodeTrailer(const Image::Metadata& metadata,
+                   const Detections* detections, std::string& out) {
+  Image image{};
+  *image.mutable_metadata() = metadata;
+  if (detections != nullptr) {
+    *image.mutable_detections() = *detections;
+  }
+  image.SerializeToString(&out);
+}
+
+size_t appendData(uint64_t frameId, uint32_t index, uint64_t offset,
+                  const FramePtr& frame, std::deque<Record>& out) {
+  if (!frame) {
+    return 0;
+  }
+  size_t added = 0;
+  for (const auto& chunk : frame->chunks()) {
+    for (size_t done = 0; done < chunk.size;) {
+      const size_t size = std::min<size_t>(chunk.size - done, MAX_PAYLOAD_SIZE);
+      // Built in place: encoded and trailer have to stay where they are
+      out.emplace_back();
+      Record& record = out.back();
+      record.header = RecordHeader{DATA, index + static_cast<uint32_t>(added),
+                                   frameId, offset,
+                                   static_cast<uint32_t>(size)};
+      record.frame = frame;
+      record.data = chunk.data + done;
+      encodeHeader(record.header, record.data, record.encoded);
+      offset += size;
+      done += size;
+      added++;
+    }
+  }
+  return added;
+}
+
+void appendEnd(uint64_t frameId, uint32_t index, uint64_t frameSize,
+               const Image::Metadata& metadata, const Detections* detections,
+               std::deque<Record>& out) {
+  out.emplace_back();
+  Record& record = out.back();
+  encodeTrailer(metadata, detections, record.trailer);
+  record.header = RecordHeader{END, index, frameId, frameSize,
+                               static_cast<uint32_t>(record.trailer.size())};
+  record.data = nullptr;
+  encodeHeader(record.header, record.payload(), record.encoded);
+}
+
+void appendAbort(uint64_t frameId, std::deque<Record>& out) {
+  out.emplace_back();
+  Record& record = out.back();
+  record.header = RecordHeader{ABORT, 0, frameId, 0, 0};
+  record.data = nullptr;
+  encodeHeader(record.header, nullptr, record.encoded);
+}
+
+void appendIov(const Record& record, std::vector<struct iovec>& iov) {
+  iov.push_back({const_cast<uint8_t*>(record.encoded), HEADER_SIZE});
+  if (record.header.payloadSize > 0) {
+    iov.push_back({const_cast<uint8_t*>(record.payload()),
+                   record.header.payloadSize});
+  }
+}
+
+
+Receiver::Receiver(Callback callback, size_t maxFrames)
+  : mCallback{std::move(callback)}
+  , mMaxFrames{std::max<size_t>(maxFrames, 1)}
+  , mBuffer{}
+  , mStart{0}
+  , mFrames{}
+  , mCompleted{}
+  , mStats{}
+{
+}
+
+void Receiver::newConnection(std::string& acks) {
+  mBuffer.clear();
+  mStart = 0;
+  uint8_t out[ACK_SIZE];
+  for (auto& frame : mFrames) {
+    // Whatever was missing will be sent again, so ask again
+    frame.resendRequested = false;
+    encodeAck(Ack{0, frame.frameId, frame.data.size()}, out);
+    acks.append(reinterpret_cast<const char*>(out), sizeof(out));
+  }
+  encodeAck(Ack{0, 0, 0}, out);
+  acks.append(reinterpret_cast<const char*>(out), sizeof(out));
+}
+
+uint64_t Receiver::received(uint64_t frameId) const {
+  for (const auto& frame : mFrames) {
+    if (frame.frameId == frameId) {
+      return frame.data.size();
+    }
+  }
+  return 0;
+}
+
+void Receiver::feed(const uint8_t* data, size_t size, std::string& acks) {
+  // Drop what's been consumed before growing the buffer
+  if (mStart > 0) {
+    mBuffer.erase(mBuffer.begin(), mBuffer.begin() + mStart);
+    mStart = 0;
+  }
+  mBuffer.insert(mBuffer.end(), data, data + size);
+
+  while (mBuffer.size() - mStart >= HEADER_SIZE) {
+    RecordHeader header{};
+    if (!decodeHeader(&mBuffer[mStart], header)) {
+      resync();
+      continue;
+    }
+    if (mBuffer.size() - mStart - HEADER_SIZE < header.payloadSize) {
+      // Wait for the rest of the record
+      break;
+    }
+
+    const uint8_t* payload = &mBuffer[mStart + HEADER_SIZE];
+    if (!checkCrc(&mBuffer[mStart], payload, header.payloadSize)) {
+      // The header can't be trusted either; look for the next one. Whatever
+      // this was gets asked for again when the gap shows.
+      mStats.crcErrors++;
+      resync();
+      continue;
+    }
+    mStart += HEADER_SIZE + header.payloadSize;
+    mStats.records++;
+    handleRecord(header, payload, acks);
+  }
+}
+
+void Receiver::handleRecord(const RecordHeader& header,
+                            const uint8_t* payload, std::string& acks) {
+  auto ack = [&acks](uint8_t flags, uint64_t frameId, uint64_t offset) {
+    uint8_t out[ACK_SIZE];
+    encodeAck(Ack{flags, frameId, offset}, out);
+    acks.append(reinterpret_cast<const char*>(out), sizeof(out));
+  };
+
+  if (completed(header.frameId)) {
+    if (header.type == DATA) {
+      mStats.duplicateBytes += header.payloadSize;
+    }
+    ack(COMPLETE, header.frameId, header.offset);
+    return;
+  }
+
+  if (header.type == ABORT) {
+    if (find(header.frameId) != nullptr) {
+      mStats.aborted++;
+    }
+    forget(header.frameId);
+    ack(COMPLETE, header.frameId, 0);
+    return;
+  }
+
+  Partial* partial = find(header.frameId);
+  if (partial == nullptr) {
+    partial = &start(header.frameId);
+  }
+  const uint64_t received = partial->data.size();
+
+  if (header.type == DATA) {
+    const uint64_t end = header.offset + header.payloadSize;
+    if (end <= received) {
+      mStats.duplicateBytes += header.payloadSize;
+      ack(0, header.frameId, received);
+    } else if (header.offset > received) {
+      mStats.gapBytes += header.payloadSize;
+      if (!partial->resendRequested) {
+        partial->resendRequested = true;
+        ack(RESEND, header.frameId, received);
+      }
+    } else {
+      const size_t skip = received - header.offset;
+      mStats.duplicateBytes += skip;
+      partial->data.append(reinterpret_cast<const char*>(payload) + skip,
+                           header.payloadSize - skip);
+      partial->resendRequested = false;
+      ack(0, header.frameId, end);
+    }
+    return;
+  }
+
+  // END
+  if (header.offset > received) {
+    if (!partial->resendRequested) {
+      partial->resendRequested = true;
+      ack(RESEND, header.frameId, received);
+    }
+    return;
+  }
+
+  Image image{};
+  if ((header.offset < received) ||
+      !image.ParseFromArray(payload, header.payloadSize)) {
+    Logger::warning(__func__, "Dropping frame %llu: bad END record\n",
+                    static_cast<unsigned long long>(header.frameId));
+    mStats.aborted++;
+    forget(header.frameId);
+    ack(COMPLETE, header.frameId, received);
+    return;
+  }
+
+  image.set_data(std::move(partial->data));
+  forget(header.frameId);
+  mCompleted.push_back(header.frameId);
+  if (mCompleted.size() > COMPLETED_HISTORY) {
+    mCompleted.pop_front();
+  }
+  mStats.frames++;
+  ack(COMPLETE, header.frameId, received);
+  mCallback(header.frameId, std::move(image));
+}
+
+Receiver::Partial* Receiver::find(uint64_t frameId) {
+  for (auto& frame : mFrames) {
+    if (frame.frameId == frameId) {
+      return &frame;
+    }
+  }
+  return nullptr;
+}
+
+Receiver::Partial& Receiver::start(uint64_t frameId) {
+  if (mFrames.size() >= mMaxFrames) {
+    Logger::warning(__func__, "Giving up on frame %llu\n",
+                    static_cast<unsigned long long>(mFrames.front().frameId));
+    mStats.aborted++;
+    mFrames.pop_front();
+  }
+  mFrames.push_back(Partial{frameId, std::string{}, false});
+  return mFrames.back();
+}
+
+void Receiver::forget(uint64_t frameId) {
+  mFrames.erase(std::remove_if(mFrames.begin(), mFrames.end(),
+    [frameId](const Partial& p) { return p.frameId == frameId; }),
+    mFrames.end());
+}
+
+bool Receiver::completed(uint64_t frameId) const {
+  return std::find(mCompleted.begin(), mCompleted.end(), frameId) !=
+    mCompleted.end();
+}
+
+void Receiver::resync() {
+  const uint8_t* begin = &mBuffer[mStart];
+  const uint8_t* end = mBuffer.data() + mBuffer.size();
+  const uint8_t* p = begin + 1;
+  // A header could start in the last few bytes; keep them
+  while (p + sizeof(MAGIC) <= end) {
+    p = static_cast<const uint8_t*>(memchr(p, MAGIC[0], end - p));
+    if ((p == nullptr) || (p + sizeof(MAGIC) > end)) {
+      break;
+    }
+    if (memcmp(p, MAGIC, sizeof(MAGIC)) == 0) {
+      break;
+    }
+    p++;
+  }
+  if ((p == nullptr) || (p + sizeof(MAGIC) > end)) {
+    p = end - std::min<size_t>(end - begin - 1, sizeof(MAGIC) - 1);
+  }
+
+  mStats.skippedBytes += p - begin;
+  mStart += p - begin;
+}
+
+} // namespace ChunkFraming
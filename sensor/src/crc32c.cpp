@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include "crc32c.hpp"
+
+// Reversed Castagnoli polynomial
+static const uint32_t POLYNOMIAL = 0x82F63B78u;
+
+/**
+ * Slicing-by-8 tables: table[k][b] is the CRC of byte b followed by k zero
+ * bytes.
+ */
+static const std::array<std::array<uint32_t, 256>, 8>& crcTables() {
+  static const auto tables = [] {
+    std::array<std::array<uint32_t, 256>, 8> t{};
+    for (uint32_t n = 0; n < 256; n++) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; k++) {
+        c = (c & 1) ? (POLYNOMIAL ^ (c >> 1)) : (c >> 1);
+      }
+      t[0][n] = c;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+      for (size_t k = 1; k < 8; k++) {
+        t[k][n] = (t[k - 1][n] >> 8) ^ t[0][t[k - 1][n] & 0xFF];
+      }
+    }
+    return t;
+  }();
+  return tables;
+}
+
+uint32_t crc32cPortable(const uint8_t* data, size_t size, uint32_t crc) {
+  const auto& t = crcTables();
+  uint32_t c = ~crc;
+  while ((size > 0) && (reinterpret_cast<uintptr_t>(data) & 7)) {
+    c = t[0][(c ^ *data++) & 0xFF] ^ (c >> 8);
+    size--;
+  }
+  while (size >= 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, data, 4);
+    memcpy(&hi, data + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    lo = __builtin_bswap32(lo);
+    hi = __builtin_bswap32(hi);
+#endif
+    lo ^= c;
+    c = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^
+      t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+      t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^
+      t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+    data += 8;
+    size -= 8;
+  }
+  while (size > 0) {
+    c = t[0][(c ^ *data++) & 0xFF] ^ (c >> 8);
+    size--;
+  }
+  return ~c;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Compiled with a target attribute, and only called if the CPU has SSE4.2
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSSE42(const uint8_t* data, size_t size, uint32_t crc) {
+  uint32_t c = ~crc;
+  while ((size > 0) && (reinterpret_cast<uintptr_t>(data) & 7)) {
+    c = _mm_crc32_u8(c, *data++);
+    size--;
+  }
+#if defined(__x86_64__)
+  uint64_t c64 = c;
+  while (size >= 8) {
+    uint64_t word;
+    memcpy(&word, data, 8);
+    c64 = _mm_crc32_u64(c64, word);
+    data += 8;
+    size -= 8;
+  }
+  c = static_cast<uint32_t>(c64);
+#endif
+  while (size >= 4) {
+    uint32_t word;
+    memcpy(&word, data, 4);
+    c = _mm_crc32_u32(c, word);
+    data += 4;
+    size -= 4;
+  }
+  while (size > 0) {
+    c = _mm_crc32_u8(c, *data++);
+    size--;
+  }
+  return ~c;
+}
+
+static bool haveSSE42() {
+  static const bool have = __builtin_cpu_supports("sse4.2");
+  return have;
+}
+#endif
+
+#if defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32cARM(const uint8_t* data, size_t size, uint32_t crc) {
+  uint32_t c = ~crc;
+  while ((size > 0) && (reinterpret_cast<uintptr_t>(data) & 7)) {
+    c = __crc32cb(c, *data++);
+    size--;
+  }
+  while (size >= 8) {
+    uint64_t word;
+    memcpy(&word, data, 8);
+    c = __crc32cd(c, word);
+    data += 8;
+    size -= 8;
+  }
+  while (size > 0) {
+    c = __crc32cb(c, *data++);
+    size--;
+  }
+  return ~c;
+}
+#endif
+
+bool crc32cAccelerated() {
+#if defined(__ARM_FEATURE_CRC32)
+  return true;
+#elif defined(__x86_64__) || defined(__i386__)
+  return haveSSE42();
+#else
+  return false;
+#endif
+}
+
+uint32_t crc32c(const uint8_t* data, size_t size, uint32_t crc) {
+#if defined(__ARM_FEATURE_CRC32)
+  return crc32cARM(data, size, crc);
+#else
+#if defined(__x86_64__) || defined(__i386__)
+  if (haveSSE42()) {
+    return crc32cSSE42(data, size, crc);
+  }
+#endif
+  return crc32cPortable(data, size, crc);
+#endif
+}
@@ -0,0 +1,330 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <limits>
+
+#include "event_dispatcher.hpp"
+#include "image_framing.hpp"
+
+// Crops are small; one slab holds a few
+static const size_t CROP_SLAB_SIZE = 64 * 1024;
+static const size_t CROP_INITIAL_SLABS = 4;
+
+// Weight of each new frame in the star count's running average
+static const double STAR_COUNT_WEIGHT = 0.1;
+// Below this many stars on average, the count is too noisy to go by
+static const double MIN_STAR_COUNT = 10.0;
+
+static const char* const CROP_ENCODING = "GRAY8";
+
+
+EventDispatcher::EventDispatcher(const Config& config, Sink sink)
+  : mConfig{config}
+  , mSink{std::move(sink)}
+  , mPrevious{}
+  , mCurrent{}
+  , mStarCountAverage{0.0}
+  , mHaveStarCount{false}
+  , mCropAssembler{CROP_SLAB_SIZE, CROP_INITIAL_SLABS}
+  , mMutex{}
+  , mPending{}
+  , mWanted{}
+  , mLastEncoded{std::numeric_limits<int64_t>::min()}
+  , mLastAnalysed{std::numeric_limits<int64_t>::min()}
+  , mStats{}
+{
+}
+
+EventDispatcher::Stats EventDispatcher::stats() const {
+  std::lock_guard<std::mutex> lock{mMutex};
+  return mStats;
+}
+
+void EventDispatcher::frameEncoded(int64_t pts, QueuedImage&& image) {
+  std::vector<QueuedImage> out;
+  {
+    std::lock_guard<std::mutex> lock{mMutex};
+    mLastEncoded = std::max(mLastEncoded, pts);
+
+    // Analysis results still waiting for a frame that's now been passed by
+    // go out on their own
+    while (!mWanted.empty() && (mWanted.front().pts < pts)) {
+      out.emplace_back(std::move(mWanted.front().image));
+      mWanted.pop_front();
+    }
+
+    if (!mWanted.empty() && (mWanted.front().pts == pts)) {
+      image.detections = std::move(mWanted.front().image.detections);
+      mWanted.pop_front();
+      mStats.fullFrames++;
+      out.emplace_back(std::move(image));
+    } else if (pts <= mLastAnalysed) {
+      // Analysed already (or skipped by the analysis) and not wanted
+      mStats.framesSkipped++;
+    } else {
+      mPending.push_back(Pending{pts, std::move(image)});
+      while (mPending.size() > mConfig.pendingFrames) {
+        mPending.pop_front();
+        mStats.framesSkipped++;
+      }
+    }
+  }
+
+  for (auto& item : out) {
+    send(std::move(item));
+  }
+}
+
+void EventDispatcher::frameAnalysed(const RawFrame& frame,
+                                    const SkyAnalyser::Result& result,
+                                    const Image::Metadata& metadata) {
+  std::unique_ptr<Detections> detections = describe(frame, result);
+
+  std::vector<const Component*> transients;
+  findTransients(result, transients);
+
+  bool wantFrame = false;
+  if (mConfig.streakFrames && !result.streaks.empty()) {
+    detections->add_triggers(Detections::STREAK);
+    wantFrame = true;
+  }
+  if (!transients.empty()) {
+    detections->add_triggers(Detections::TRANSIENT);
+  }
+  if (starCountJumped(result.stars.size())) {
+    detections->add_triggers(Detections::STAR_COUNT);
+    wantFrame = true;
+  }
+
+  std::vector<QueuedImage> out;
+  {
+    std::lock_guard<std::mutex> lock{mMutex};
+    mStats.analysed++;
+    if ((mConfig.periodicInterval > 0) &&
+        (mStats.analysed % mConfig.periodicInterval == 1 % mConfig.periodicInterval)) {
+      detections->add_triggers(Detections::PERIODIC);
+      wantFrame = true;
+    }
+    mLastAnalysed = std::max(mLastAnalysed, frame.pts);
+
+    QueuedImage message{};
+    message.metadata = metadata;
+    message.detections = std::move(detections);
+
+    auto pending = std::find_if(mPending.begin(), mPending.end(),
+      [&frame](const Pending& p) { return p.pts == frame.pts; });
+    if (wantFrame && (pending != mPending.end())) {
+      pending->image.detections = std::move(message.detections);
+      mStats.fullFrames++;
+      out.emplace_back(std::move(pending->image));
+    } else if (wantFrame && (frame.pts > mLastEncoded)) {
+      // Not encoded yet; send it all when it is
+      mWanted.push_back(Wanted{frame.pts, std::move(message)});
+      while (mWanted.size() > mConfig.pendingFrames) {
+        out.emplace_back(std::move(mWanted.front().image));
+        mWanted.pop_front();
+      }
+    } else {
+      out.emplace_back(std::move(message));
+    }
+
+    // Nothing else wants the frames up to this one
+    while (!mPending.empty() && (mPending.front().pts <= frame.pts)) {
+      if (mPending.front().image.frame) {
+        mStats.framesSkipped++;
+      }
+      mPending.pop_front();
+    }
+  }
+
+  for (auto& item : out) {
+    send(std::move(item));
+  }
+
+  const size_t crops = std::min(transients.size(), mConfig.maxCrops);
+  for (size_t i = 0; i < crops; i++) {
+    sendCrop(frame, *transients[i], metadata);
+  }
+}
+
+std::unique_ptr<Detections> EventDispatcher::describe(
+    const RawFrame& frame, const SkyAnalyser::Result& result) const {
+  auto detections = std::make_unique<Detections>();
+  detections->set_sequence(frame.sequence);
+  detections->set_width(frame.width);
+  detections->set_height(frame.height);
+  detections->set_background(result.background);
+  detections->set_background_rms(result.rms);
+  detections->set_star_count(static_cast<int32_t>(result.stars.size()));
+
+  // Brightest first
+  std::vector<const Component*> stars;
+  stars.reserve(result.stars.size());
+  for (const auto& star : result.stars) {
+    stars.push_back(&star);
+  }
+  const size_t listed = std::min(stars.size(), mConfig.maxStars);
+  std::partial_sort(stars.begin(), stars.begin() + listed, stars.end(),
+    [](const Component* a, const Component* b) { return a->flux > b->flux; });
+
+  for (size_t i = 0; i < listed; i++) {
+    const Component& component = *stars[i];
+    const double flux = static_cast<double>(component.flux) -
+      static_cast<double>(result.background) * component.area;
+    Detections::Star* star = detections->add_stars();
+    star->set_x(static_cast<float>(component.x));
+    star->set_y(static_cast<float>(component.y));
+    star->set_flux(static_cast<uint32_t>(
+      std::min(std::max(flux, 0.0), static_cast<double>(UINT32_MAX))));
+    star->set_peak(component.peak);
+    star->set_area(component.area);
+  }
+
+  for (const auto& streak : result.streaks) {
+    Detections::Streak* out = detections->add_streaks();
+    out->set_x0(streak.x0);
+    out->set_y0(streak.y0);
+    out->set_x1(streak.x1);
+    out->set_y1(streak.y1);
+    out->set_width(streak.width);
+    out->set_brightness(streak.brightness);
+  }
+  return detections;
+}
+
+void EventDispatcher::findTransients(const SkyAnalyser::Result& result,
+                                     std::vector<const Component*>& transients) {
+  mCurrent.clear();
+  for (const auto& star : result.stars) {
+    mCurrent.push_back(Point{static_cast<float>(star.x),
+                             static_cast<float>(star.y)});
+  }
+  std::sort(mCurrent.begin(), mCurrent.end(),
+    [](const Point& a, const Point& b) { return a.y < b.y; });
+
+  if ((mConfig.transientPeak > 0) && !mPrevious.empty()) {
+    const float r = mConfig.matchRadius;
+    const float minPeak = result.background + mConfig.transientPeak;
+    for (const auto& star : result.stars) {
+      if ((star.peak < minPeak) || (star.area > mConfig.transientMaxArea)) {
+        continue;
+      }
+      // The previous frame's stars are sorted by y, so only look at the
+      // ones in range
+      const float x = static_cast<float>(star.x);
+      const float y = static_cast<float>(star.y);
+      auto it = std::lower_bound(mPrevious.begin(), mPrevious.end(), y - r,
+        [](const Point& p, float value) { return p.y < value; });
+      bool matched = false;
+      for (; (it != mPrevious.end()) && (it->y <= y + r); ++it) {
+        const float dx = it->x - x;
+        const float dy = it->y - y;
+        if (dx * dx + dy * dy <= r * r) {
+          matched = true;
+          break;
+        }
+      }
+      if (!matched) {
+        transients.push_back(&star);
+      }
+    }
+    // Brightest first, so those are the ones that get crops
+    std::sort(transients.begin(), transients.end(),
+      [](const Component* a, const Component* b) { return a->peak > b->peak; });
+  }
+
+  std::swap(mPrevious, mCurrent);
+}
+
+bool EventDispatcher::starCountJumped(size_t count) {
+  if (mConfig.starCountChange <= 0.0f) {
+    return false;
+  }
+  if (!mHaveStarCount) {
+    mStarCountAverage = static_cast<double>(count);
+    mHaveStarCount = true;
+    return false;
+  }
+
+  const double average = mStarCountAverage;
+  const double reference = std::max(average, MIN_STAR_COUNT);
+  if (std::fabs(count - average) > mConfig.starCountChange * reference) {
+    // Start over from the new count, so one change only fires once
+    mStarCountAverage = static_cast<double>(count);
+    return true;
+  }
+  mStarCountAverage += STAR_COUNT_WEIGHT * (count - average);
+  return false;
+}
+
+void EventDispatcher::sendCrop(const RawFrame& frame,
+                               const Component& component,
+                               const Image::Metadata& metadata) {
+  const uint32_t w = std::min(mConfig.cropSize, frame.width);
+  const uint32_t h = std::min(mConfig.cropSize, frame.height);
+  const int64_t cx = std::lround(component.x) - static_cast<int64_t>(w / 2);
+  const int64_t cy = std::lround(component.y) - static_cast<int64_t>(h / 2);
+  const uint32_t x0 = static_cast<uint32_t>(
+    std::min<int64_t>(std::max<int64_t>(cx, 0), frame.width - w));
+  const uint32_t y0 = static_cast<uint32_t>(
+    std::min<int64_t>(std::max<int64_t>(cy, 0), frame.height - h));
+
+  for (uint32_t y = y0; y < y0 + h; y++) {
+    mCropAssembler.append(
+      frame.luma() + static_cast<size_t>(y) * frame.stride + x0, w);
+  }
+
+  QueuedImage crop{};
+  crop.metadata = metadata;
+  crop.metadata.set_width(frame.width);
+  crop.metadata.set_height(frame.height);
+  crop.metadata.set_encoding(CROP_ENCODING);
+  crop.metadata.set_roi_x(x0);
+  crop.metadata.set_roi_y(y0);
+  crop.metadata.set_roi_w(w);
+  crop.metadata.set_roi_h(h);
+  crop.frame = mCropAssembler.finish();
+  // Just enough to tie it back to the frame's detections
+  crop.detections = std::make_unique<Detections>();
+  crop.detections->set_sequence(frame.sequence);
+  crop.detections->set_width(frame.width);
+  crop.detections->set_height(frame.height);
+  crop.detections->add_triggers(Detections::TRANSIENT);
+
+  {
+    std::lock_guard<std::mutex> lock{mMutex};
+    mStats.crops++;
+  }
+  send(std::move(crop));
+}
+
+void EventDispatcher::send(QueuedImage&& image) {
+  const ssize_t detectionsSize = image.detections
+    ? static_cast<ssize_t>(image.detections->ByteSizeLong()) : -1;
+  const size_t bytes = sizeof(uint32_t) + ImageFraming::messageSize(
+    image.metadata.ByteSizeLong(), image.frame ? image.frame->size() : 0,
+    detectionsSize);
+  {
+    std::lock_guard<std::mutex> lock{mMutex};
+    mStats.bytes += bytes;
+  }
+  mSink(std::move(image));
+}
@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "file_replay_source.hpp"
+#include "logging.hpp"
+
+// Signature, IHDR length and type, then width and height
+static const size_t PNG_IHDR_END = 24;
+
+
+FileReplaySource::FileReplaySource(const Config& config)
+  : PacedFrameSource{config.pacing}
+  , mConfig{config}
+  , mNext{0}
+  , mReadBuffer(std::max<size_t>(config.pacing.bufferSize, 1))
+  , mMutex{}
+  , mWidth{config.width}
+  , mHeight{config.height}
+  , mEncoding{}
+  , mState{}
+{
+  if (!config.paths.empty()) {
+    mEncoding = encodingForPath(config.paths.front());
+  }
+}
+
+FileReplaySource::~FileReplaySource() {
+  stop();
+}
+
+uint32_t FileReplaySource::width() const {
+  std::lock_guard<std::mutex> lock{mMutex};
+  return mWidth;
+}
+
+uint32_t FileReplaySource::height() const {
+  std::lock_guard<std::mutex> lock{mMutex};
+  return mHeight;
+}
+
+std::string FileReplaySource::encoding() const {
+  std::lock_guard<std::mutex> lock{mMutex};
+  return mEncoding;
+}
+
+CameraState FileReplaySource::stateSnapshot() const {
+  std::lock_guard<std::mutex> lock{mMutex};
+  return mState;
+}
+
+std::string FileReplaySource::encodingForPath(const std::string& path) {
+  auto dot = path.rfind('.');
+  if (dot == std::string::npos) {
+    return "RAW";
+  }
+
+  std::string ext = path.substr(dot + 1);
+  std::transform(ext.begin(), ext.end(), ext.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  if (ext == "png") {
+    return "PNG";
+  } else if ((ext == "jpg") || (ext == "jpeg")) {
+    return "JPEG";
+  } else if ((ext == "h264") || (ext == "264")) {
+    return "H264";
+  }
+  return "RAW";
+}
+
+bool FileReplaySource::produceFrame(FrameAssembler& assembler) {
+  if (mConfig.paths.empty()) {
+    return false;
+  }
+  if (mNext >= mConfig.paths.size()) {
+    if (!mConfig.loop) {
+      return false;
+    }
+    mNext = 0;
+  }
+
+  const std::string& path = mConfig.paths[mNext++];
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    Logger::error(__func__, "Failed to open %s: %s\n", path.c_str(),
+                  strerror(errno));
+    return false;
+  }
+
+  // Read one "encoder buffer" at a time, straight into the assembler
+  uint8_t header[PNG_IHDR_END];
+  size_t headerSize = 0;
+  bool ok = true;
+  for (;;) {
+    ssize_t rc = read(fd, mReadBuffer.data(), mReadBuffer.size());
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      Logger::error(__func__, "Failed to read %s: %s\n", path.c_str(),
+                    strerror(errno));
+      ok = false;
+      break;
+    }
+    if (rc == 0) {
+      break;
+    }
+
+    if (headerSize < sizeof(header)) {
+      size_t n = std::min(sizeof(header) - headerSize, static_cast<size_t>(rc));
+      memcpy(header + headerSize, mReadBuffer.data(), n);
+      headerSize += n;
+    }
+    assembler.append(mReadBuffer.data(), rc);
+  }
+  close(fd);
+
+  if (!ok) {
+    assembler.discard();
+    return false;
+  }
+
+  std::string encoding = encodingForPath(path);
+  std::lock_guard<std::mutex> lock{mMutex};
+  mEncoding = encoding;
+  if ((encoding == "PNG") && (headerSize == sizeof(header))) {
+    mWidth = (header[16] << 24) | (header[17] << 16) | (header[18] << 8) |
+      header[19];
+    mHeight = (header[20] << 24) | (header[21] << 16) | (header[22] << 8) |
+      header[23];
+  }
+  return true;
+}
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include "frame_assembler.hpp"
+
+// Enough chunk slots for a full-resolution PNG without growing the vector
+static const size_t INITIAL_CHUNK_CAPACITY = 64;
+
+
+SlabPool::SlabPool(size_t slabSize, size_t initialSlabs)
+  : mSlabSize{slabSize}
+  , mMutex{}
+  , mFree{}
+  , mAll{}
+  , mAllocated{initialSlabs}
+{
+  mFree.reserve(initialSlabs);
+  for (size_t i = 0; i < initialSlabs; i++) {
+    mFree.emplace_back(new uint8_t[mSlabSize]);
+    mAll.push_back(mFree.back().get());
+  }
+}
+
+SlabPool::Slab SlabPool::acquire() {
+  {
+    std::lock_guard<std::mutex> lock{mMutex};
+    if (!mFree.empty()) {
+      Slab slab = std::move(mFree.back());
+      mFree.pop_back();
+      return slab;
+    }
+  }
+
+  Slab slab{new uint8_t[mSlabSize]};
+  std::lock_guard<std::mutex> lock{mMutex};
+  mAll.push_back(slab.get());
+  mAllocated++;
+  return slab;
+}
+
+void SlabPool::release(Slab slab) {
+  if (!slab) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock{mMutex};
+  mFree.push_back(std::move(slab));
+}
+
+size_t SlabPool::available() const {
+  std::lock_guard<std::mutex> lock{mMutex};
+  return mFree.size();
+}
+
+size_t SlabPool::allocated() const {
+  std::lock_guard<std::mutex> lock{mMutex};
+  return mAllocated;
+}
+
+std::vector<const uint8_t*> SlabPool::slabs() const {
+  std::lock_guard<std::mutex> lock{mMutex};
+  return mAll;
+}
+
+
+Frame::Frame(std::shared_ptr<SlabPool> pool)
+  : mPool{std::move(pool)}
+  , mSlabs{}
+  , mChunks{}
+  , mSize{0}
+  , mSlabFill{0}
+  , mPts{0}
+{
+  mSlabs.reserve(INITIAL_CHUNK_CAPACITY);
+  mChunks.reserve(INITIAL_CHUNK_CAPACITY);
+}
+
+Frame::~Frame() {
+  clear();
+}
+
+void Frame::copyTo(std::string& out) const {
+  out.clear();
+  out.reserve(mSize);
+  for (const auto& chunk : mChunks) {
+    out.append(reinterpret_cast<const char*>(chunk.data), chunk.size);
+  }
+}
+
+void Frame::append(const uint8_t* data, size_t length) {
+  const size_t slabSize = mPool->slabSize();
+
+  while (length > 0) {
+    if (mSlabs.empty() || (mSlabFill == slabSize)) {
+      mSlabs.push_back(mPool->acquire());
+      mChunks.push_back({mSlabs.back().get(), 0});
+      mSlabFill = 0;
+    }
+
+    size_t n = std::min(length, slabSize - mSlabFill);
+    memcpy(mSlabs.back().get() + mSlabFill, data, n);
+    mSlabFill += n;
+    mChunks.back().size += n;
+    mSize += n;
+    data += n;
+    length -= n;
+  }
+}
+
+void Frame::clear() {
+  for (auto& slab : mSlabs) {
+    mPool->release(std::move(slab));
+  }
+  mSlabs.clear();
+  mChunks.clear();
+  mSize = 0;
+  mSlabFill = 0;
+  mPts = 0;
+}
+
+
+FrameAssembler::FrameAssembler(size_t slabSize, size_t initialSlabs)
+  : mPool{std::make_shared<SlabPool>(slabSize, initialSlabs)}
+  , mCurrent{std::make_unique<Frame>(mPool)}
+  , mStream{nullptr}
+{
+}
+
+void FrameAssembler::append(const uint8_t* data, size_t length) {
+  if (mStream != nullptr) {
+    mStream->append(data, length);
+    return;
+  }
+  mCurrent->append(data, length);
+}
+
+FramePtr FrameAssembler::finish(int64_t pts) {
+  mCurrent->mPts = pts;
+  FramePtr frame{std::move(mCurrent)};
+  mCurrent = std::make_unique<Frame>(mPool);
+  return frame;
+}
+
+void FrameAssembler::discard() {
+  if (mStream != nullptr) {
+    mStream->discard();
+  }
+  mCurrent->clear();
+}
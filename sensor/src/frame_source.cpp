@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <chrono>
+
+#include "frame_source.hpp"
+#include "logging.hpp"
+
+// Slabs hold this many buffers, as in Camera
+static const size_t FRAME_SLAB_BUFFERS = 16;
+static const size_t FRAME_INITIAL_SLABS = 4;
+
+
+PacedFrameSource::PacedFrameSource(const Pacing& pacing)
+  : mPacing{pacing}
+  , mCallback{}
+  , mAssembler{std::max<size_t>(pacing.bufferSize, 1) * FRAME_SLAB_BUFFERS,
+               FRAME_INITIAL_SLABS}
+  , mThread{}
+  , mMutex{}
+  , mCv{}
+  , mRunning{false}
+  , mRequested{0}
+  , mFramesDelivered{0}
+{
+}
+
+PacedFrameSource::~PacedFrameSource() {
+  // Subclasses must have stopped the thread already, since it calls back
+  // into them
+  stop();
+}
+
+bool PacedFrameSource::start(FrameCallback callback) {
+  std::lock_guard<std::mutex> lock{mMutex};
+  if (mRunning) {
+    return false;
+  }
+
+  mCallback = std::move(callback);
+  mRunning = true;
+  mRequested = 0;
+  mThread = std::thread{&PacedFrameSource::run, this};
+  return true;
+}
+
+bool PacedFrameSource::stop() {
+  {
+    std::lock_guard<std::mutex> lock{mMutex};
+    mRunning = false;
+  }
+  mCv.notify_all();
+
+  if (mThread.joinable() && (mThread.get_id() != std::this_thread::get_id())) {
+    mThread.join();
+  }
+  return true;
+}
+
+bool PacedFrameSource::requestCapture() {
+  {
+    std::lock_guard<std::mutex> lock{mMutex};
+    if (!mRunning) {
+      return false;
+    }
+    mRequested++;
+  }
+  mCv.notify_all();
+  return true;
+}
+
+void PacedFrameSource::setStream(FrameAssembler::Stream* stream) {
+  std::lock_guard<std::mutex> lock{mMutex};
+  mAssembler.setStream(stream);
+}
+
+void PacedFrameSource::appendBuffers(FrameAssembler& assembler,
+                                     const uint8_t* data, size_t size) const {
+  const size_t bufferSize = std::max<size_t>(mPacing.bufferSize, 1);
+  for (size_t offset = 0; offset < size; offset += bufferSize) {
+    assembler.append(data + offset, std::min(bufferSize, size - offset));
+  }
+}
+
+void PacedFrameSource::run() {
+  using Clock = std::chrono::steady_clock;
+  const auto period = std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>(
+        mPacing.frameRate > 0.0 ? 1.0 / mPacing.frameRate : 0.0));
+
+  Clock::time_point next = Clock::now();
+  // Frames are stamped with the time since start(), like the camera's PTS,
+  // and never two with the same one
+  const Clock::time_point started = next;
+  int64_t lastPts = -1;
+  std::unique_lock<std::mutex> lock{mMutex};
+  while (mRunning) {
+    if (!mPacing.freeRunning) {
+      mCv.wait(lock, [this] { return !mRunning || (mRequested > 0); });
+      if (!mRunning) {
+        break;
+      }
+      mRequested--;
+      // The "exposure" starts now
+      next = Clock::now() + period;
+    }
+
+    mCv.wait_until(lock, next, [this] { return !mRunning; });
+    if (!mRunning) {
+      break;
+    }
+
+    lock.unlock();
+    bool produced = produceFrame(mAssembler);
+    if (produced) {
+      lastPts = std::max(lastPts + 1, static_cast<int64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+          Clock::now() - started).count()));
+      FramePtr frame = mAssembler.finish(lastPts);
+      mFramesDelivered++;
+      mCallback(*this, frame);
+    } else {
+      mAssembler.discard();
+      Logger::info(__func__, "Frame source exhausted\n");
+    }
+    lock.lock();
+
+    if (!produced) {
+      mRunning = false;
+      break;
+    }
+
+    if (mPacing.freeRunning) {
+      // Don't try to catch up if we fell behind
+      next = std::max(next + period, Clock::now());
+    }
+  }
+}
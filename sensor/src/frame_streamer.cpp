@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+
+#include "frame_streamer.hpp"
+
+
+FrameStreamer::FrameStreamer(ImageSender& sender, size_t pieceSize,
+                             size_t initialPieces)
+  : mSender{sender}
+  , mPieceSize{std::max<size_t>(pieceSize, 1)}
+  , mPieces{mPieceSize, initialPieces}
+  , mFrameId{0}
+  , mIndex{0}
+  , mOffset{0}
+  , mFrames{0}
+  , mPiecesSent{0}
+  , mBytes{0}
+  , mDropped{0}
+{
+}
+
+void FrameStreamer::startFrame() {
+  mFrameId = mSender.newFrameId();
+  mIndex = 0;
+  mOffset = 0;
+}
+
+void FrameStreamer::append(const uint8_t* data, size_t length) {
+  if (mFrameId == 0) {
+    startFrame();
+  }
+
+  while (length > 0) {
+    // Each piece is exactly one slab
+    const size_t n = std::min(length, mPieceSize);
+    mPieces.append(data, n);
+
+    QueuedImage piece{};
+    piece.isChunk = true;
+    piece.chunkHeader.type = ChunkFraming::DATA;
+    piece.chunkHeader.index = mIndex++;
+    piece.chunkHeader.frameId = mFrameId;
+    piece.chunkHeader.offset = mOffset;
+    piece.frame = mPieces.finish();
+    enqueue(std::move(piece));
+
+    mOffset += n;
+    mPiecesSent++;
+    mBytes += n;
+    data += n;
+    length -= n;
+  }
+}
+
+void FrameStreamer::discard() {
+  if (mFrameId == 0) {
+    return;
+  }
+  QueuedImage piece{};
+  piece.isChunk = true;
+  piece.chunkHeader.type = ChunkFraming::ABORT;
+  piece.chunkHeader.frameId = mFrameId;
+  enqueue(std::move(piece));
+  mFrameId = 0;
+}
+
+void FrameStreamer::finish(const Image::Metadata& metadata,
+                           std::unique_ptr<Detections> detections) {
+  if (mFrameId == 0) {
+    // Nothing came out of the encoder; still a frame
+    startFrame();
+  }
+  QueuedImage piece{};
+  piece.isChunk = true;
+  piece.chunkHeader.type = ChunkFraming::END;
+  piece.chunkHeader.index = mIndex;
+  piece.chunkHeader.frameId = mFrameId;
+  piece.chunkHeader.offset = mOffset;
+  piece.metadata = metadata;
+  piece.detections = std::move(detections);
+  enqueue(std::move(piece));
+  mFrames++;
+  mFrameId = 0;
+}
+
+void FrameStreamer::enqueue(QueuedImage&& piece) {
+  if (!mSender.enqueue(std::move(piece))) {
+    mDropped++;
+  }
+}
+
+FrameStreamer::Stats FrameStreamer::stats() const {
+  return Stats{
+    mFrames.load(),
+    mPiecesSent.load(),
+    mBytes.load(),
+    mDropped.load(),
+    mPieces.pool().allocated(),
+  };
+}
@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+
+#include "h264_stream.hpp"
+
+using namespace H264;
+
+/**
+ * Whether a NAL unit of this type starts a new access unit when it follows a
+ * picture (H.264 7.4.1.2.3). Slices only do if they're the first slice of a
+ * picture.
+ */
+static bool startsAccessUnit(uint8_t nalType, bool firstSliceInPicture) {
+  switch (nalType) {
+    case NAL_SLICE:
+    case NAL_IDR_SLICE:
+      return firstSliceInPicture;
+    case NAL_SEI:
+    case NAL_SPS:
+    case NAL_PPS:
+    case NAL_AUD:
+      return true;
+    default:
+      // Prefix NAL, subset SPS and reserved types 16-18
+      return (nalType >= 14) && (nalType <= 18);
+  }
+}
+
+
+AccessUnitSplitter::AccessUnitSplitter(size_t slabSize, size_t initialSlabs,
+                                       Callback callback)
+  : mAssembler{slabSize, initialSlabs}
+  , mCallback{std::move(callback)}
+  , mState{ScanState::SCAN}
+  , mZeros{0}
+  , mNalType{0}
+  , mHeld{}
+  , mHeldSize{0}
+  , mBufferPts{PTS_UNKNOWN}
+  , mPts{PTS_UNKNOWN}
+  , mHasSlice{false}
+  , mKeyframe{false}
+  , mConfig{false}
+  , mNalUnits{0}
+  , mAccessUnits{0}
+{
+}
+
+void AccessUnitSplitter::append(const uint8_t* data, size_t size,
+                                int64_t ptsUs) {
+  mBufferPts = ptsUs;
+
+  // [spanStart, i) has been scanned and belongs to the current unit, but
+  // hasn't been appended yet
+  size_t spanStart = 0;
+  size_t i = 0;
+  while (i < size) {
+    const uint8_t byte = data[i];
+
+    if (mState == ScanState::SCAN) {
+      if ((byte != 0) && (mHeldSize == 0)) {
+        // Nothing pending: skip ahead to the next zero, which is where any
+        // start code has to begin
+        const void* zero = memchr(data + i, 0, size - i);
+        i = (zero == nullptr) ? size
+          : static_cast<const uint8_t*>(zero) - data;
+        continue;
+      }
+
+      if ((byte == 0) || ((byte == 1) && (mZeros >= 2))) {
+        mAssembler.append(data + spanStart, i - spanStart);
+        spanStart = i + 1;
+        if (byte == 0) {
+          if (mZeros == 3) {
+            // Only three zeros can be part of a start code; the oldest one is
+            // trailing padding of the current unit
+            mAssembler.append(mHeld, 1);
+            memmove(mHeld, mHeld + 1, --mHeldSize);
+          } else {
+            mZeros++;
+          }
+        } else {
+          mState = ScanState::HEADER;
+          mZeros = 0;
+        }
+        hold(byte);
+      } else {
+        // Zeros that weren't a start code after all (e.g. emulation
+        // prevention)
+        releaseHeld();
+        mZeros = 0;
+        spanStart = i;
+      }
+      i++;
+      continue;
+    }
+
+    // HEADER or SLICE: still holding
+    hold(byte);
+    spanStart = i + 1;
+    i++;
+    if (mState == ScanState::HEADER) {
+      mNalType = byte & 0x1F;
+      if ((mNalType == NAL_SLICE) || (mNalType == NAL_IDR_SLICE)) {
+        mState = ScanState::SLICE;
+        continue;
+      }
+      startNal(mNalType, false);
+    } else {
+      // first_mb_in_slice is ue(v): a leading 1 bit means it's 0
+      startNal(mNalType, (byte & 0x80) != 0);
+    }
+    mState = ScanState::SCAN;
+  }
+
+  mAssembler.append(data + spanStart, size - spanStart);
+}
+
+void AccessUnitSplitter::endAccessUnit() {
+  releaseHeld();
+  mState = ScanState::SCAN;
+  mZeros = 0;
+  if (mAssembler.pending() > 0) {
+    emit();
+  }
+}
+
+void AccessUnitSplitter::discard() {
+  mAssembler.discard();
+  mHeldSize = 0;
+  mState = ScanState::SCAN;
+  mZeros = 0;
+  reset();
+}
+
+void AccessUnitSplitter::hold(uint8_t byte) {
+  if (mHeldSize < sizeof(mHeld)) {
+    mHeld[mHeldSize++] = byte;
+  }
+}
+
+void AccessUnitSplitter::releaseHeld() {
+  if (mHeldSize > 0) {
+    mAssembler.append(mHeld, mHeldSize);
+    mHeldSize = 0;
+  }
+}
+
+void AccessUnitSplitter::startNal(uint8_t nalType, bool firstSliceInPicture) {
+  if (mHasSlice && startsAccessUnit(nalType, firstSliceInPicture)) {
+    emit();
+  }
+  // The start code and header go with the unit this NAL belongs to
+  releaseHeld();
+  mNalUnits++;
+
+  switch (nalType) {
+    case NAL_IDR_SLICE:
+      mKeyframe = true;
+      // Fall through
+    case NAL_SLICE:
+      if (!mHasSlice) {
+        mPts = mBufferPts;
+      }
+      mHasSlice = true;
+      break;
+    case NAL_SPS:
+    case NAL_PPS:
+      mConfig = true;
+      break;
+    default:
+      break;
+  }
+}
+
+void AccessUnitSplitter::emit() {
+  H264::AccessUnit unit{};
+  unit.data = mAssembler.finish();
+  unit.ptsUs = mHasSlice ? mPts : mBufferPts;
+  unit.hasPicture = mHasSlice;
+  unit.keyframe = mKeyframe;
+  unit.config = mConfig;
+  reset();
+
+  mAccessUnits++;
+  mCallback(std::move(unit));
+}
+
+void AccessUnitSplitter::reset() {
+  mPts = PTS_UNKNOWN;
+  mHasSlice = false;
+  mKeyframe = false;
+  mConfig = false;
+}
@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <vector>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "image_framing.hpp"
+#include "logging.hpp"
+
+// Protobuf wire types
+static const uint8_t WIRE_TYPE_LENGTH_DELIMITED = 2;
+
+// Field numbers in the Image message (see picam.proto)
+static const uint32_t IMAGE_METADATA_FIELD = 2;
+static const uint32_t IMAGE_DATA_FIELD = 3;
+static const uint32_t IMAGE_DETECTIONS_FIELD = 4;
+
+static constexpr uint8_t fieldTag(uint32_t field, uint8_t wireType) {
+  return static_cast<uint8_t>((field << 3) | wireType);
+}
+
+static size_t varintSize(uint64_t value) {
+  size_t n = 1;
+  while (value >= 0x80) {
+    value >>= 7;
+    n++;
+  }
+  return n;
+}
+
+static uint8_t* writeVarint(uint64_t value, uint8_t* out) {
+  while (value >= 0x80) {
+    *out++ = static_cast<uint8_t>(value | 0x80);
+    value >>= 7;
+  }
+  *out++ = static_cast<uint8_t>(value);
+  return out;
+}
+
+namespace ImageFraming {
+
+size_t messageSize(size_t metadataSize, size_t dataSize,
+                   ssize_t detectionsSize) {
+  // Metadata is always present (the sender always sets it), but proto3 leaves
+  // out an empty bytes field. A message field that's set is sent even if
+  // it's empty.
+  size_t size = 1 + varintSize(metadataSize) + metadataSize;
+  if (dataSize > 0) {
+    size += 1 + varintSize(dataSize) + dataSize;
+  }
+  if (detectionsSize >= 0) {
+    size += 1 + varintSize(detectionsSize) + detectionsSize;
+  }
+  return size;
+}
+
+size_t encodeHeader(const Image::Metadata& metadata, size_t dataSize,
+                    uint8_t* out, size_t outSize,
+                    const Detections* detections) {
+  const size_t metadataSize = metadata.ByteSizeLong();
+  const ssize_t detectionsSize = (detections != nullptr)
+    ? static_cast<ssize_t>(detections->ByteSizeLong()) : -1;
+  const size_t headerSize = sizeof(uint32_t)
+    + 1 + varintSize(metadataSize) + metadataSize
+    + (dataSize > 0 ? 1 + varintSize(dataSize) : 0);
+  if (headerSize > outSize) {
+    return 0;
+  }
+
+  const size_t size = messageSize(metadataSize, dataSize, detectionsSize);
+  if (size > UINT32_MAX) {
+    return 0;
+  }
+
+  uint8_t* p = out;
+  uint32_t sizeBE = htonl(static_cast<uint32_t>(size));
+  memcpy(p, &sizeBE, sizeof(sizeBE));
+  p += sizeof(sizeBE);
+
+  *p++ = fieldTag(IMAGE_METADATA_FIELD, WIRE_TYPE_LENGTH_DELIMITED);
+  p = writeVarint(metadataSize, p);
+  // ByteSizeLong() cached the sizes
+  p = metadata.SerializeWithCachedSizesToArray(p);
+
+  if (dataSize > 0) {
+    *p++ = fieldTag(IMAGE_DATA_FIELD, WIRE_TYPE_LENGTH_DELIMITED);
+    p = writeVarint(dataSize, p);
+  }
+
+  return p - out;
+}
+
+void encodeTrailer(const Detections& detections, std::string& out) {
+  const size_t size = detections.GetCachedSize();
+  out.resize(1 + varintSize(size) + size);
+  uint8_t* p = reinterpret_cast<uint8_t*>(&out[0]);
+  *p++ = fieldTag(IMAGE_DETECTIONS_FIELD, WIRE_TYPE_LENGTH_DELIMITED);
+  p = writeVarint(size, p);
+  detections.SerializeWithCachedSizesToArray(p);
+}
+
+ssize_t writeAll(int fd, struct iovec* iov, size_t iovCount,
+                 uint64_t* syscalls) {
+  ssize_t total = 0;
+  bool isSocket = true;
+
+  while (iovCount > 0) {
+    size_t batch = std::min<size_t>(iovCount, IOV_MAX);
+    ssize_t rc;
+    if (isSocket) {
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = batch;
+      rc = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } else {
+      rc = writev(fd, iov, batch);
+    }
+    if (syscalls != nullptr) {
+      (*syscalls)++;
+    }
+
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (isSocket && (errno == ENOTSOCK)) {
+        // Plain files (e.g. the spool) get the same framing
+        isSocket = false;
+        continue;
+      }
+      Logger::error(__func__, "Send failed: %s\n", strerror(errno));
+      return -1;
+    }
+
+    total += rc;
+
+    // Skip whatever was fully written, then trim a partially written iovec
+    size_t written = static_cast<size_t>(rc);
+    while ((iovCount > 0) && (written >= iov->iov_len)) {
+      written -= iov->iov_len;
+      iov++;
+      iovCount--;
+    }
+    if (iovCount > 0) {
+      iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + written;
+      iov->iov_len -= written;
+    }
+  }
+
+  return total;
+}
+
+ssize_t writeImage(int fd, const Image::Metadata& metadata,
+                   const Frame* frame, uint64_t* syscalls,
+                   const Detections* detections) {
+  const size_t dataSize = (frame != nullptr) ? frame->size() : 0;
+
+  uint8_t header[MAX_HEADER_SIZE];
+  size_t headerSize = encodeHeader(metadata, dataSize, header, sizeof(header),
+                                   detections);
+  if (headerSize == 0) {
+    Logger::error(__func__, "Image header doesn't fit in %zu bytes\n",
+                  sizeof(header));
+    return -1;
+  }
+
+  // Reused between calls so steady-state sends don't allocate
+  thread_local std::vector<struct iovec> iov{};
+  thread_local std::string trailer{};
+  iov.clear();
+  iov.push_back({header, headerSize});
+  if (frame != nullptr) {
+    for (const auto& chunk : frame->chunks()) {
+      if (chunk.size > 0) {
+        iov.push_back({const_cast<uint8_t*>(chunk.data), chunk.size});
+      }
+    }
+  }
+  if (detections != nullptr) {
+    encodeTrailer(*detections, trailer);
+    iov.push_back({&trailer[0], trailer.size()});
+  }
+
+  return writeAll(fd, iov.data(), iov.size(), syscalls);
+}
+
+ssize_t copyImage(uint8_t* out, size_t outSize,
+                  const Image::Metadata& metadata, const Frame* frame,
+                  const Detections* detections) {
+  const size_t dataSize = (frame != nullptr) ? frame->size() : 0;
+  size_t headerSize = encodeHeader(metadata, dataSize, out, outSize,
+                                   detections);
+  if (headerSize == 0) {
+    return -1;
+  }
+
+  thread_local std::string trailer{};
+  trailer.clear();
+  if (detections != nullptr) {
+    encodeTrailer(*detections, trailer);
+  }
+  if (headerSize + dataSize + trailer.size() > outSize) {
+    return -1;
+  }
+
+  uint8_t* p = out + headerSize;
+  if (frame != nullptr) {
+    for (const auto& chunk : frame->chunks()) {
+      memcpy(p, chunk.data, chunk.size);
+      p += chunk.size;
+    }
+  }
+  memcpy(p, trailer.data(), trailer.size());
+  p += trailer.size();
+  return p - out;
+}
+
+} // namespace ImageFraming
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctime>
+
+#include "image_metadata.hpp"
+
+void fillImageMetadata(Image::Metadata& imageMeta, const FrameSource& source) {
+  struct timespec now{};
+  // Ignore return value
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  imageMeta.set_time_s(now.tv_sec);
+  imageMeta.set_time_us(now.tv_nsec / 1000);
+  imageMeta.set_width(source.width());
+  imageMeta.set_height(source.height());
+  imageMeta.set_encoding(source.encoding());
+
+  const CameraState state = source.stateSnapshot();
+  const auto stateNow = CameraState::Clock::now();
+
+  imageMeta.set_analog_gain(state.analogGain);
+  imageMeta.set_digital_gain(state.digitalGain);
+  imageMeta.set_awb_gain_red(state.awbGainRed);
+  imageMeta.set_awb_gain_blue(state.awbGainBlue);
+  imageMeta.set_analog_gain_age_us(
+      state.ageUs(CameraState::ANALOG_GAIN, stateNow));
+  imageMeta.set_digital_gain_age_us(
+      state.ageUs(CameraState::DIGITAL_GAIN, stateNow));
+  imageMeta.set_awb_gains_age_us(
+      state.ageUs(CameraState::AWB_GAIN_RED, stateNow));
+  //imageMeta.set_awb_mode();
+  //imageMeta.set_exposure_mode();
+  //imageMeta.set_exposure_compensation();
+  if (state.valid(CameraState::EXPOSURE_SPEED)) {
+    imageMeta.set_exposure_speed(state.exposureSpeed);
+  }
+  imageMeta.set_exposure_speed_age_us(
+      state.ageUs(CameraState::EXPOSURE_SPEED, stateNow));
+  //imageMeta.set_hflip();
+  //imageMeta.set_image_denoise();
+
+  imageMeta.set_iso(state.iso);
+
+  //imageMeta.set_rotation();
+
+  imageMeta.set_brightness(state.brightness);
+  imageMeta.set_contrast(state.contrast);
+  imageMeta.set_saturation(state.saturation);
+  imageMeta.set_sharpness(state.sharpness);
+  imageMeta.set_shutter_speed(state.shutterSpeed);
+
+  //imageMeta.set_vflip();
+
+  //imageMeta.set_roi_x();
+  //imageMeta.set_roi_y();
+  //imageMeta.set_roi_w();
+  //imageMeta.set_roi_h();
+}
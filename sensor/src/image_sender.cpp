@@ -0,0 +1,1121 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+#include "image_framing.hpp"
+#include "image_sender.hpp"
+#include "logging.hpp"
+
+// How often the sender thread looks for acks while it has nothing else to do
+static const std::chrono::milliseconds ACK_POLL_INTERVAL{20};
+// How often a local publisher with nothing to send looks for new readers
+static const std::chrono::milliseconds LOCAL_POLL_INTERVAL{100};
+// How often the sender thread picks up io_uring completions while it has
+// nothing else to do
+static const std::chrono::milliseconds URING_REAP_INTERVAL{50};
+
+static size_t recordSize(const ChunkFraming::Record& record) {
+  return ChunkFraming::HEADER_SIZE + record.header.payloadSize;
+}
+
+static uint64_t microsecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+
+/**
+ * connect() that gives up after timeout. fd is left in blocking mode.
+ */
+static bool connectWithTimeout(int fd, const struct sockaddr* addr,
+                               socklen_t addrLen,
+                               std::chrono::milliseconds timeout) {
+  const int flags = fcntl(fd, F_GETFL, 0);
+  if ((flags < 0) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0)) {
+    return false;
+  }
+
+  int err = 0;
+  if (::connect(fd, addr, addrLen) != 0) {
+    if (errno != EINPROGRESS) {
+      return false;
+    }
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    int rc;
+    do {
+      rc = poll(&pfd, 1, static_cast<int>(timeout.count()));
+    } while ((rc < 0) && (errno == EINTR));
+    if (rc <= 0) {
+      return false;
+    }
+    socklen_t errLen = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errLen) != 0) {
+      return false;
+    }
+  }
+
+  return (err == 0) && (fcntl(fd, F_SETFL, flags) == 0);
+}
+
+
+ImageSender::ImageSender(const Config& config)
+  : mConfig{config}
+  , mConnected{false}
+  , mSocket{-1}
+  , mSpool{nullptr}
+  , mLocal{nullptr}
+  , mReconnectDelay{config.reconnectDelay}
+  , mNextConnect{}
+  , mBackfillBudget{0.0}
+  , mBackfillRefilled{}
+  , mQueue{config.queueCapacity}
+  , mProducerMutex{}
+  , mThread{}
+  , mRunning{false}
+  , mWaitMutex{}
+  , mItemsCv{}
+  , mSpaceCv{}
+  , mSenderWaiting{false}
+  , mProducerWaiting{false}
+  , mQueueHighWater{0}
+  , mEnqueued{0}
+  , mSent{0}
+  , mDroppedOldest{0}
+  , mDroppedNewest{0}
+  , mSendFailures{0}
+  , mBytesSent{0}
+  , mSyscalls{0}
+  , mReconnects{0}
+  , mSpooled{0}
+  , mBackfilled{0}
+  , mVideoStarted{false}
+  , mNextVideoIndex{0}
+  , mVideoSequence{0}
+  , mLastVideoWasConfig{false}
+  , mVideoConfig{}
+  , mNextFrameId{static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count())}
+  , mChunkResentBytes{0}
+  , mChunkFramesAborted{0}
+  , mChunkAcks{0}
+  , mOutstandingBytes{0}
+  , mOutstanding{}
+  , mAckBuffer{}
+  , mAckProgress{}
+  , mResumed{false}
+  , mStreamFrame{0}
+  , mStreamIndex{0}
+  , mStreamOffset{0}
+  , mAbandonedFrame{0}
+  , mUring{nullptr}
+  , mInFlight{}
+  , mUringBatches{0}
+  , mUringZeroCopyBytes{0}
+  , mSendBusyUs{0}
+{ }
+
+ImageSender::~ImageSender() {
+  stop();
+  disconnect();
+}
+
+bool ImageSender::connect() {
+  if (mConnected) {
+    return true;
+  }
+
+  if (mConfig.transport != Transport::TCP) {
+    LocalTransport::Publisher::Config localConfig{};
+    localConfig.path = mConfig.localPath;
+    localConfig.mode = (mConfig.transport == Transport::SHM_RING)
+      ? LocalTransport::Mode::RING : LocalTransport::Mode::FD;
+    localConfig.slots = mConfig.localSlots;
+    localConfig.slotSize = mConfig.localSlotSize;
+    auto local = std::make_unique<LocalTransport::Publisher>(localConfig);
+    if (!local->open()) {
+      return false;
+    }
+    // Readers come and go; as far as the rest of the sender is concerned,
+    // it's always connected
+    mLocal = std::move(local);
+    mConnected = true;
+    return true;
+  }
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = 0;
+  hints.ai_protocol = 0;
+
+  struct addrinfo* result = nullptr;
+  auto port = std::to_string(mConfig.serverPort);
+  int rc = getaddrinfo(mConfig.serverHostname.c_str(), port.c_str(),
+      &hints, &result);
+  if (rc != 0) {
+    Logger::error(__func__, "%s\n", gai_strerror(rc));
+    return false;
+  }
+
+  struct addrinfo* rp = nullptr;
+  int sfd;
+  for (rp = result; rp != nullptr; rp = rp->ai_next) {
+    sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+    if (sfd == -1) {
+      continue;
+    }
+
+    if (connectWithTimeout(sfd, rp->ai_addr, rp->ai_addrlen,
+                           mConfig.connectTimeout)) {
+      break;
+    }
+
+    close(sfd);
+  }
+
+  freeaddrinfo(result);
+
+  if (rp == nullptr) {
+    Logger::error(__func__, "Failed to connect\n");
+    return false;
+  }
+
+  // Without a timeout, a link that goes away without a RST would leave the
+  // sender stuck in sendmsg() until TCP gives up, many minutes later
+  struct timeval sendTimeout;
+  sendTimeout.tv_sec = mConfig.sendTimeout.count() / 1000;
+  sendTimeout.tv_usec = (mConfig.sendTimeout.count() % 1000) * 1000;
+  if (setsockopt(sfd, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout,
+                 sizeof(sendTimeout)) != 0) {
+    Logger::warning(__func__, "Failed to set send timeout: %s\n",
+                    strerror(errno));
+  }
+
+  mSocket = sfd;
+  mConnected = true;
+  if (mUring) {
+    mUring->setSocket(sfd);
+    mUring->reset();
+  }
+
+  Logger::info(__func__, "Successfully connected to %s:%s\n",
+      mConfig.serverHostname.c_str(), port.c_str());
+
+  return true;
+}
+
+void ImageSender::disconnect() {
+  if (!mConnected) {
+    return;
+  }
+
+  mLocal.reset();
+  if (mUring) {
+    drainUring();
+  }
+  if (mSocket >= 0) {
+    close(mSocket);
+  }
+  mSocket = -1;
+  mConnected = false;
+}
+
+bool ImageSender::start() {
+  if (mRunning.load()) {
+    return true;
+  }
+
+  if (!mConfig.spoolDirectory.empty() && !mSpool) {
+    Spool::Config spoolConfig{};
+    spoolConfig.directory = mConfig.spoolDirectory;
+    spoolConfig.segmentSize = mConfig.spoolSegmentSize;
+    spoolConfig.maxBytes = mConfig.spoolMaxBytes;
+    spoolConfig.chunked = mConfig.chunked;
+    auto spool = std::make_unique<Spool>(spoolConfig);
+    if (!spool->open()) {
+      return false;
+    }
+    mSpool = std::move(spool);
+  }
+
+  mRunning = true;
+  mThread = std::thread{&ImageSender::run, this};
+  return true;
+}
+
+void ImageSender::stop() {
+  if (!mRunning.exchange(false)) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock{mWaitMutex};
+    mItemsCv.notify_all();
+    mSpaceCv.notify_all();
+  }
+
+  if (mThread.joinable()) {
+    mThread.join();
+  }
+}
+
+bool ImageSender::enqueue(QueuedImage&& image) {
+  if (!mRunning.load()) {
+    Logger::warning(__func__, "Sender thread not running\n");
+    return false;
+  }
+
+  mEnqueued++;
+
+  // Uncontended unless several pipelines share the sender
+  std::lock_guard<std::mutex> producerLock{mProducerMutex};
+  while (!mQueue.tryPush(std::move(image))) {
+    switch (mConfig.overflowPolicy) {
+      case OverflowPolicy::DROP_NEWEST:
+        mDroppedNewest++;
+        return false;
+      case OverflowPolicy::DROP_OLDEST:
+        {
+          QueuedImage oldest{};
+          if (mQueue.tryPop(oldest)) {
+            mDroppedOldest++;
+          }
+        }
+        break;
+      case OverflowPolicy::BLOCK:
+        waitForSpace();
+        if (!mRunning.load()) {
+          return false;
+        }
+        break;
+    }
+  }
+
+  size_t depth = mQueue.size();
+  size_t highWater = mQueueHighWater.load(std::memory_order_relaxed);
+  while ((depth > highWater) &&
+         !mQueueHighWater.compare_exchange_weak(highWater, depth)) {
+  }
+
+  // Only take the lock if the sender thread is (about to be) asleep. The
+  // fence pairs with the one in waitForItems().
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (mSenderWaiting.load()) {
+    std::lock_guard<std::mutex> lock{mWaitMutex};
+    mItemsCv.notify_one();
+  }
+
+  return true;
+}
+
+ImageSender::Stats ImageSender::stats() const {
+  return Stats{
+    mQueue.size(),
+    mQueueHighWater.load(),
+    mEnqueued.load(),
+    mSent.load(),
+    mDroppedOldest.load(),
+    mDroppedNewest.load(),
+    mSendFailures.load(),
+    mBytesSent.load(),
+    mSyscalls.load(),
+    mReconnects.load(),
+    mSpooled.load(),
+    mBackfilled.load(),
+    mSpool ? mSpool->stats().pendingBytes : 0,
+    mChunkResentBytes.load(),
+    mChunkFramesAborted.load(),
+    mChunkAcks.load(),
+    mOutstandingBytes.load(),
+    mLocal ? mLocal->stats().readers : 0,
+    mUringBatches.load(),
+    mUringZeroCopyBytes.load(),
+    mSendBusyUs.load(),
+  };
+}
+
+void ImageSender::run() {
+  // sendfile() has no MSG_NOSIGNAL. With SIGPIPE blocked in this thread, a
+  // dropped connection makes it fail with EPIPE instead of killing us.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  if (mConfig.ioUring) {
+    openUring();
+  }
+
+  for (;;) {
+    const auto now = Clock::now();
+    if (!mConnected) {
+      reconnect(now);
+    }
+
+    if (mConnected && !mOutstanding.empty()) {
+      readAcks(std::chrono::milliseconds{0});
+      checkAckProgress(now);
+    }
+
+    QueuedImage image{};
+    if (mQueue.tryPop(image)) {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (mProducerWaiting.load()) {
+        std::lock_guard<std::mutex> lock{mWaitMutex};
+        mSpaceCv.notify_one();
+      }
+
+      sendQueued(image);
+      continue;
+    }
+
+    // Drain the queue before exiting. Whatever's in the spool stays there.
+    if (!mRunning.load()) {
+      break;
+    }
+
+    // Live frames go first; the spool only gets the gaps between them
+    auto wakeAt = Clock::time_point::max();
+    if (backfill(now, wakeAt)) {
+      continue;
+    }
+    if (!mConnected) {
+      wakeAt = std::min(wakeAt, mNextConnect);
+    } else if (!mOutstanding.empty()) {
+      wakeAt = std::min(wakeAt, now + ACK_POLL_INTERVAL);
+    } else if (mLocal) {
+      mLocal->refreshReaders();
+      wakeAt = std::min(wakeAt, now + LOCAL_POLL_INTERVAL);
+    } else if (mUring && (mUring->inFlight() > 0)) {
+      reapUring(std::chrono::milliseconds{0});
+      wakeAt = std::min(wakeAt, now + URING_REAP_INTERVAL);
+    }
+    waitForItems(wakeAt);
+  }
+
+  if (mUring) {
+    const auto giveUpAt = Clock::now() + mConfig.sendTimeout;
+    while (mConnected && (mUring->inFlight() > 0) &&
+           (Clock::now() < giveUpAt)) {
+      reapUring(URING_REAP_INTERVAL);
+    }
+  }
+
+  // Give the receiver a chance to acknowledge what's been sent, then keep
+  // whatever it didn't for next time
+  const auto giveUpAt = Clock::now() + mConfig.sendTimeout;
+  while (mConnected && !mOutstanding.empty() && (Clock::now() < giveUpAt)) {
+    readAcks(ACK_POLL_INTERVAL);
+  }
+  spoolOutstanding();
+}
+
+void ImageSender::sendQueued(QueuedImage& image) {
+  if (mLocal) {
+    // Copied into shared memory once, however many readers there are. No
+    // readers, or none with room, is a failure: nobody got the frame.
+    ssize_t rc = mLocal->publish(image.metadata, image.frame.get(),
+                                 image.detections.get());
+    if (rc > 0) {
+      mSent++;
+      mBytesSent += rc;
+    } else {
+      mSendFailures++;
+    }
+    return;
+  }
+
+  if (mConfig.chunked && !image.isVideo) {
+    queueChunked(image);
+    return;
+  }
+
+  if (!mConnected) {
+    if (!spool(image)) {
+      mSendFailures++;
+    }
+    return;
+  }
+
+  if (mUring) {
+    queueUring(image);
+    return;
+  }
+
+  // Header and frame chunks go out in one sendmsg(), without ever building
+  // the serialized Image
+  const auto started = Clock::now();
+  uint64_t syscalls = 0;
+  auto write = [this, &syscalls](const VideoFraming::RecordHeader& header,
+                                 const FramePtr& payload) {
+    return VideoFraming::writeRecord(mSocket, header, payload.get(),
+                                     &syscalls);
+  };
+  ssize_t rc = image.isVideo
+    ? sendVideoRecord(image, write)
+    : ImageFraming::writeImage(mSocket, image.metadata, image.frame.get(),
+                               &syscalls, image.detections.get());
+  mSyscalls += syscalls;
+  mSendBusyUs += microsecondsSince(started);
+  if (rc < 0) {
+    mSendFailures++;
+    connectionLost();
+    // The receiver may have got part of it, but a torn message is dropped
+    // along with the connection, so send it all again later
+    spool(image);
+  } else {
+    mSent++;
+    mBytesSent += rc;
+  }
+}
+
+bool ImageSender::spool(QueuedImage& image) {
+  if (!mSpool || image.isVideo) {
+    return false;
+  }
+  if (!mSpool->append(image.metadata, image.frame.get(),
+                      image.detections.get())) {
+    return false;
+  }
+  mSpooled++;
+  return true;
+}
+
+void ImageSender::connectionLost() {
+  Logger::warning(__func__, "Lost connection to %s:%d\n",
+                  mConfig.serverHostname.c_str(), mConfig.serverPort);
+  disconnect();
+  // Try again straight away, then back off
+  mNextConnect = Clock::now();
+  mReconnectDelay = mConfig.reconnectDelay;
+
+  // Unacknowledged records stay, to be sent again after reconnecting
+  mAckBuffer.clear();
+  trimOutstanding();
+}
+
+void ImageSender::reconnect(Clock::time_point now) {
+  if (now < mNextConnect) {
+    return;
+  }
+
+  if (connect()) {
+    mReconnects++;
+    mReconnectDelay = mConfig.reconnectDelay;
+    // A new connection is a new video stream: the receiver needs parameter
+    // sets and a keyframe before anything else
+    mVideoStarted = false;
+    mLastVideoWasConfig = false;
+    mBackfillBudget = 0.0;
+    mBackfillRefilled = Clock::now();
+    // Pick up where the receiver left off, once it's said what it has. A
+    // receiver that doesn't say skips what it already has anyway.
+    mAckProgress = Clock::now();
+    if (!mOutstanding.empty()) {
+      mResumed = false;
+      const auto giveUpAt = mAckProgress + mConfig.connectTimeout;
+      while (mConnected && !mResumed && (Clock::now() < giveUpAt)) {
+        readAcks(ACK_POLL_INTERVAL);
+      }
+      if (mConnected) {
+        sendRecords(0, 0, 0, true);
+      }
+    }
+    return;
+  }
+
+  Logger::info(__func__, "Retrying in %lld ms\n",
+               static_cast<long long>(mReconnectDelay.count()));
+  mNextConnect = Clock::now() + mReconnectDelay;
+  mReconnectDelay = std::min(mReconnectDelay * 2, mConfig.maxReconnectDelay);
+}
+
+bool ImageSender::backfill(Clock::time_point now, Clock::time_point& wakeAt) {
+  // Not while io_uring sends are going, or they'd interleave
+  if (!mConnected || !mSpool || (mUring && (mUring->inFlight() > 0))) {
+    return false;
+  }
+  const size_t size = mSpool->nextRecordSize();
+  if (size == 0) {
+    return false;
+  }
+
+  if (mConfig.backfillRate > 0) {
+    // Refill the bucket, holding at most a second's worth
+    const double rate = mConfig.backfillRate;
+    const double elapsed =
+      std::chrono::duration<double>(now - mBackfillRefilled).count();
+    mBackfillBudget = std::min(mBackfillBudget + rate * elapsed, rate);
+    mBackfillRefilled = now;
+    if (mBackfillBudget < 0.0) {
+      wakeAt = now + std::chrono::duration_cast<Clock::duration>(
+          std::chrono::duration<double>(-mBackfillBudget / rate));
+      return false;
+    }
+  }
+
+  const auto started = Clock::now();
+  uint64_t syscalls = 0;
+  ssize_t rc = mSpool->sendNext(mSocket, &syscalls);
+  mSyscalls += syscalls;
+  mSendBusyUs += microsecondsSince(started);
+  if (rc < 0) {
+    mSendFailures++;
+    connectionLost();
+    return true;
+  }
+  mBackfillBudget -= rc;
+  mBackfilled++;
+  mBytesSent += rc;
+  return true;
+}
+
+ssize_t ImageSender::sendVideoRecord(QueuedImage& image,
+                                     const RecordWriter& write) {
+  VideoFraming::RecordHeader header = image.videoHeader;
+  header.payloadSize = image.frame ? image.frame->size() : 0;
+  if (mVideoStarted && (header.sequence != mNextVideoIndex)) {
+    header.flags |= VideoFraming::DISCONTINUITY;
+  }
+  mVideoStarted = true;
+  mNextVideoIndex = header.sequence + 1;
+
+  const bool hasConfig = header.flags & VideoFraming::CONFIG;
+  const bool isKeyframe = header.flags & VideoFraming::KEYFRAME;
+  if (hasConfig && !isKeyframe) {
+    mVideoConfig = image.frame;
+  }
+
+  ssize_t total = 0;
+  if (isKeyframe && !hasConfig && !mLastVideoWasConfig && mVideoConfig) {
+    // Repeat the parameter sets so a receiver that joined after the start of
+    // the stream can decode from this keyframe
+    VideoFraming::RecordHeader configHeader{};
+    configHeader.flags = VideoFraming::CONFIG;
+    configHeader.sequence = mVideoSequence++;
+    configHeader.ptsUs = header.ptsUs;
+    configHeader.payloadSize = mVideoConfig->size();
+    ssize_t rc = write(configHeader, mVideoConfig);
+    if (rc < 0) {
+      return rc;
+    }
+    total += rc;
+  }
+
+  header.sequence = mVideoSequence++;
+  ssize_t rc = write(header, image.frame);
+  if (rc < 0) {
+    return rc;
+  }
+  mLastVideoWasConfig = hasConfig && !isKeyframe;
+  return total + rc;
+}
+
+void ImageSender::waitForItems(Clock::time_point wakeAt) {
+  std::unique_lock<std::mutex> lock{mWaitMutex};
+  mSenderWaiting.store(true);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  auto ready = [this] {
+    return !mQueue.empty() || !mRunning.load();
+  };
+  if (wakeAt == Clock::time_point::max()) {
+    mItemsCv.wait(lock, ready);
+  } else {
+    mItemsCv.wait_until(lock, wakeAt, ready);
+  }
+  mSenderWaiting.store(false);
+}
+
+void ImageSender::waitForSpace() {
+  std::unique_lock<std::mutex> lock{mWaitMutex};
+  mProducerWaiting.store(true);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  mSpaceCv.wait(lock, [this] {
+    return (mQueue.size() < mQueue.capacity()) || !mRunning.load();
+  });
+  mProducerWaiting.store(false);
+}
+
+void ImageSender::queueChunked(QueuedImage& image) {
+  if (image.isChunk) {
+    queueChunk(image);
+    return;
+  }
+
+  waitForWindow();
+  const size_t first = mOutstanding.size();
+  const uint64_t frameId = newFrameId();
+  const uint32_t count = ChunkFraming::appendData(frameId, 0, 0, image.frame,
+                                                  mOutstanding);
+  ChunkFraming::appendEnd(frameId, count,
+                          image.frame ? image.frame->size() : 0,
+                          image.metadata, image.detections.get(),
+                          mOutstanding);
+  recordsAdded(first);
+}
+
+void ImageSender::queueChunk(QueuedImage& image) {
+  const ChunkFraming::RecordHeader& header = image.chunkHeader;
+  if (header.frameId == mAbandonedFrame) {
+    return;
+  }
+
+  if (header.frameId != mStreamFrame) {
+    if (mStreamFrame != 0) {
+      // The last frame's END never arrived
+      abandonFrame(mStreamFrame);
+    }
+    mStreamFrame = header.frameId;
+    mStreamIndex = 0;
+    mStreamOffset = 0;
+  }
+
+  if ((header.type == ChunkFraming::ABORT) ||
+      (header.offset != mStreamOffset)) {
+    // Given up on at the source, or a piece went missing on the way here
+    abandonFrame(header.frameId);
+    return;
+  }
+
+  waitForWindow();
+  if (header.frameId == mAbandonedFrame) {
+    // Trimmed while disconnected
+    return;
+  }
+  const size_t first = mOutstanding.size();
+  if (header.type == ChunkFraming::DATA) {
+    const uint32_t count = ChunkFraming::appendData(
+        header.frameId, mStreamIndex, mStreamOffset, image.frame,
+        mOutstanding);
+    mStreamIndex += count;
+    mStreamOffset += image.frame ? image.frame->size() : 0;
+  } else {
+    ChunkFraming::appendEnd(header.frameId, mStreamIndex, mStreamOffset,
+                            image.metadata, image.detections.get(),
+                            mOutstanding);
+    mStreamFrame = 0;
+  }
+  recordsAdded(first);
+}
+
+void ImageSender::recordsAdded(size_t first) {
+  if (first == 0) {
+    // Nothing was waiting on acks until now
+    mAckProgress = Clock::now();
+  }
+  for (size_t i = first; i < mOutstanding.size(); i++) {
+    mOutstandingBytes += recordSize(mOutstanding[i]);
+  }
+
+  if (mConnected) {
+    sendRecords(first, 0, 0, false);
+  } else {
+    trimOutstanding();
+  }
+}
+
+bool ImageSender::sendRecords(size_t first, uint64_t onlyFrame,
+                              uint64_t fromOffset, bool resend) {
+  // Reused between calls so steady-state sends don't allocate
+  thread_local std::vector<struct iovec> iov{};
+  iov.clear();
+  uint64_t frames = 0;
+  for (size_t i = first; i < mOutstanding.size(); i++) {
+    const ChunkFraming::Record& record = mOutstanding[i];
+    if (onlyFrame != 0) {
+      if ((record.header.frameId != onlyFrame) ||
+          ((record.header.type == ChunkFraming::DATA) &&
+           (record.header.offset + record.header.payloadSize <= fromOffset))) {
+        continue;
+      }
+    }
+    ChunkFraming::appendIov(record, iov);
+    if (record.header.type == ChunkFraming::END) {
+      frames++;
+    }
+  }
+  if (iov.empty()) {
+    return true;
+  }
+
+  uint64_t syscalls = 0;
+  ssize_t rc = ImageFraming::writeAll(mSocket, iov.data(), iov.size(),
+                                      &syscalls);
+  mSyscalls += syscalls;
+  if (rc < 0) {
+    mSendFailures++;
+    connectionLost();
+    return false;
+  }
+  mBytesSent += rc;
+  if (resend) {
+    mChunkResentBytes += rc;
+  } else {
+    mSent += frames;
+  }
+  return true;
+}
+
+void ImageSender::waitForWindow() {
+  while (mConnected && !mOutstanding.empty() &&
+         (mOutstandingBytes.load() >= mConfig.chunkWindow)) {
+    readAcks(ACK_POLL_INTERVAL);
+    checkAckProgress(Clock::now());
+  }
+}
+
+bool ImageSender::readAcks(std::chrono::milliseconds timeout) {
+  if (!mConnected) {
+    return false;
+  }
+
+  struct pollfd pfd = {mSocket, POLLIN, 0};
+  int rc = poll(&pfd, 1, static_cast<int>(timeout.count()));
+  if (rc <= 0) {
+    return rc == 0 || errno == EINTR;
+  }
+
+  char buffer[4096];
+  for (;;) {
+    ssize_t n = recv(mSocket, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (n > 0) {
+      mAckBuffer.append(buffer, n);
+      continue;
+    }
+    if ((n < 0) && (errno == EINTR)) {
+      continue;
+    }
+    if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+      break;
+    }
+    // Closed by the receiver, or an error
+    mSendFailures++;
+    connectionLost();
+    return false;
+  }
+
+  size_t consumed = 0;
+  while (mConnected && (mAckBuffer.size() - consumed >= ChunkFraming::ACK_SIZE)) {
+    ChunkFraming::Ack ack{};
+    if (!ChunkFraming::decodeAck(
+          reinterpret_cast<const uint8_t*>(mAckBuffer.data()) + consumed, ack)) {
+      Logger::error(__func__, "Bad ack from receiver\n");
+      mSendFailures++;
+      connectionLost();
+      return false;
+    }
+    consumed += ChunkFraming::ACK_SIZE;
+    handleAck(ack);
+  }
+  if (!mConnected) {
+    return false;
+  }
+  mAckBuffer.erase(0, consumed);
+  return true;
+}
+
+void ImageSender::handleAck(const ChunkFraming::Ack& ack) {
+  mChunkAcks++;
+  mAckProgress = Clock::now();
+  if (ack.frameId == 0) {
+    // The end of the acks a new connection starts with
+    mResumed = true;
+    return;
+  }
+
+  if (ack.flags & ChunkFraming::COMPLETE) {
+    eraseAcked(ack.frameId, 0, true);
+    return;
+  }
+  eraseAcked(ack.frameId, ack.offset, false);
+  if (!(ack.flags & ChunkFraming::RESEND)) {
+    return;
+  }
+
+  // Records up to the ack's offset may already be gone, if the receiver had
+  // to forget the frame after acknowledging them
+  const ChunkFraming::Record* first = nullptr;
+  for (const auto& record : mOutstanding) {
+    if (record.header.frameId == ack.frameId) {
+      first = &record;
+      break;
+    }
+  }
+  if (first == nullptr) {
+    // Spooled, or already given up on
+    return;
+  }
+  if (first->header.offset > ack.offset) {
+    abandonFrame(ack.frameId);
+    return;
+  }
+  sendRecords(0, ack.frameId, ack.offset, true);
+}
+
+void ImageSender::eraseAcked(uint64_t frameId, uint64_t offset,
+                             bool complete) {
+  size_t erased = 0;
+  auto acked = [&](const ChunkFraming::Record& record) {
+    if ((record.header.frameId != frameId) ||
+        (!complete && ((record.header.type != ChunkFraming::DATA) ||
+                       (record.header.offset + record.header.payloadSize >
+                        offset)))) {
+      return false;
+    }
+    erased += recordSize(record);
+    return true;
+  };
+  mOutstanding.erase(std::remove_if(mOutstanding.begin(), mOutstanding.end(),
+                                    acked),
+                     mOutstanding.end());
+  mOutstandingBytes -= erased;
+}
+
+void ImageSender::abandonFrame(uint64_t frameId) {
+  eraseAcked(frameId, 0, true);
+  mChunkFramesAborted++;
+  mAbandonedFrame = frameId;
+  if (mStreamFrame == frameId) {
+    mStreamFrame = 0;
+  }
+
+  // The receiver may have some of it already
+  const size_t first = mOutstanding.size();
+  ChunkFraming::appendAbort(frameId, mOutstanding);
+  mOutstandingBytes += recordSize(mOutstanding.back());
+  if (mConnected) {
+    sendRecords(first, 0, 0, false);
+  }
+}
+
+void ImageSender::spoolOutstanding() {
+  if (!mSpool) {
+    return;
+  }
+
+  // Only whole frames (whatever's left of them) go in the spool; a frame
+  // still being streamed waits for the connection
+  std::vector<uint64_t> frames;
+  for (const auto& record : mOutstanding) {
+    if (record.header.type == ChunkFraming::END) {
+      frames.push_back(record.header.frameId);
+    }
+  }
+
+  std::vector<struct iovec> iov;
+  for (uint64_t frameId : frames) {
+    iov.clear();
+    for (const auto& record : mOutstanding) {
+      if (record.header.frameId == frameId) {
+        ChunkFraming::appendIov(record, iov);
+      }
+    }
+    if (!mSpool->appendChunked(iov.data(), iov.size())) {
+      break;
+    }
+    mSpooled++;
+    eraseAcked(frameId, 0, true);
+  }
+}
+
+void ImageSender::trimOutstanding() {
+  spoolOutstanding();
+
+  // Give up on the oldest frames. ABORTs are too small to matter, and
+  // dropping one would leave the receiver holding a partial frame.
+  while (mOutstandingBytes.load() > mConfig.chunkMaxBytes) {
+    auto it = std::find_if(mOutstanding.begin(), mOutstanding.end(),
+      [](const ChunkFraming::Record& record) {
+        return record.header.type != ChunkFraming::ABORT;
+      });
+    if (it == mOutstanding.end()) {
+      break;
+    }
+    abandonFrame(it->header.frameId);
+  }
+}
+
+void ImageSender::checkAckProgress(Clock::time_point now) {
+  if (!mConnected || mOutstanding.empty() ||
+      (now - mAckProgress < mConfig.sendTimeout)) {
+    return;
+  }
+  Logger::warning(__func__, "No acks for %lld ms\n",
+                  static_cast<long long>(mConfig.sendTimeout.count()));
+  mSendFailures++;
+  connectionLost();
+}
+
+void ImageSender::openUring() {
+  if ((mConfig.transport != Transport::TCP) || mConfig.chunked) {
+    Logger::warning(__func__, "io_uring is only used for plain TCP\n");
+    return;
+  }
+
+  UringSender::Config uringConfig{};
+  uringConfig.sqPoll = mConfig.ioUringSqPoll;
+  uringConfig.zeroCopyThreshold = mConfig.ioUringZeroCopyThreshold;
+  uringConfig.sendTimeout = mConfig.sendTimeout;
+  auto uring = std::make_unique<UringSender>(uringConfig);
+  if (!uring->open()) {
+    Logger::warning(__func__, "Falling back to blocking sends\n");
+    return;
+  }
+  uring->setSocket(mSocket);
+  mUring = std::move(uring);
+}
+
+void ImageSender::queueUring(QueuedImage& image) {
+  InFlight entry{};
+  if (image.isVideo) {
+    // Parameter sets repeated ahead of a keyframe go in the same record
+    auto write = [this, &image, &entry](
+        const VideoFraming::RecordHeader& header, const FramePtr& payload) {
+      uint8_t encoded[VideoFraming::HEADER_SIZE];
+      VideoFraming::encodeHeader(header, encoded);
+      mUring->copy(encoded, sizeof(encoded));
+      if (payload) {
+        mUring->reference(*payload);
+        if (payload != image.frame) {
+          entry.config = payload;
+        }
+      }
+      return static_cast<ssize_t>(sizeof(encoded) + header.payloadSize);
+    };
+    entry.bytes = sendVideoRecord(image, write);
+  } else {
+    const size_t dataSize = image.frame ? image.frame->size() : 0;
+    uint8_t header[ImageFraming::MAX_HEADER_SIZE];
+    const size_t headerSize = ImageFraming::encodeHeader(
+        image.metadata, dataSize, header, sizeof(header),
+        image.detections.get());
+    if (headerSize == 0) {
+      Logger::error(__func__, "Image header doesn't fit in %zu bytes\n",
+                    sizeof(header));
+      mSendFailures++;
+      return;
+    }
+    mUring->copy(header, headerSize);
+    if (image.frame) {
+      mUring->reference(*image.frame);
+    }
+    entry.bytes = headerSize + dataSize;
+    if (image.detections) {
+      thread_local std::string trailer{};
+      ImageFraming::encodeTrailer(*image.detections, trailer);
+      mUring->copy(trailer.data(), trailer.size());
+      entry.bytes += trailer.size();
+    }
+  }
+  mUring->endRecord();
+  entry.image = std::move(image);
+  mInFlight.push_back(std::move(entry));
+
+  // Whatever's queued up behind this frame goes in the same batch
+  if (mQueue.empty() || mUring->batchFull()) {
+    flushUring();
+  }
+}
+
+void ImageSender::flushUring() {
+  // Submitting waits for the previous batch's sends, so this is where a
+  // slow link holds things up
+  const auto started = Clock::now();
+  uint64_t syscalls = 0;
+  mUring->submit(&syscalls);
+  mSyscalls += syscalls;
+  mSendBusyUs += microsecondsSince(started);
+  const UringSender::Stats stats = mUring->stats();
+  mUringBatches = stats.batches;
+  mUringZeroCopyBytes = stats.zeroCopyBytes;
+  reapUring(std::chrono::milliseconds{0});
+}
+
+size_t ImageSender::completeUring(std::chrono::milliseconds timeout) {
+  uint64_t syscalls = 0;
+  size_t failed = 0;
+  const size_t completed = mUring->reap(timeout, failed, &syscalls);
+  mSyscalls += syscalls;
+
+  // Failures come last
+  for (size_t i = 0; i < completed; i++) {
+    InFlight& entry = mInFlight.front();
+    if (i < completed - failed) {
+      mSent++;
+      mBytesSent += entry.bytes;
+    } else {
+      mSendFailures++;
+      spool(entry.image);
+    }
+    mInFlight.pop_front();
+  }
+  return failed;
+}
+
+void ImageSender::reapUring(std::chrono::milliseconds timeout) {
+  if ((completeUring(timeout) > 0) && mConnected) {
+    connectionLost();
+  }
+}
+
+void ImageSender::drainUring() {
+  if (mUring->pendingRecords() + mUring->inFlight() == 0) {
+    return;
+  }
+
+  // Sends still waiting for room fail straight away once the socket's shut
+  // down; what's already been sent stays sent
+  if (mSocket >= 0) {
+    shutdown(mSocket, SHUT_RDWR);
+  }
+  uint64_t syscalls = 0;
+  mUring->submit(&syscalls);
+  mSyscalls += syscalls;
+  const auto giveUpAt = Clock::now() + mConfig.sendTimeout;
+  while ((mUring->inFlight() > 0) && (Clock::now() < giveUpAt)) {
+    completeUring(URING_REAP_INTERVAL);
+  }
+  if (mUring->inFlight() == 0) {
+    return;
+  }
+
+  // Zero-copy sends hold on to their buffers until TCP gives up on the
+  // data, which could be minutes; start over with a new ring instead
+  Logger::warning(__func__, "%zu sends didn't complete; resetting io_uring\n",
+                  mUring->inFlight());
+  mUring.reset();
+  for (auto& entry : mInFlight) {
+    mSendFailures++;
+    spool(entry.image);
+  }
+  mInFlight.clear();
+  openUring();
+}
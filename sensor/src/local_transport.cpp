@@ -0,0 +1,840 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+#include "image_framing.hpp"
+#include "local_transport.hpp"
+#include "logging.hpp"
+
+namespace LocalTransport {
+
+static const char HELLO_MAGIC[4] = {'P', 'C', 'L', 'H'};
+static const char FRAME_MAGIC[4] = {'P', 'C', 'L', 'F'};
+static const char RING_MAGIC[4] = {'P', 'C', 'R', 'G'};
+
+// How often a publisher waiting for room checks whether a reader has gone
+static const std::chrono::milliseconds READER_CHECK_INTERVAL{10};
+
+// FD: memfds a reader keeps mapped. More than the publisher uses in the
+// steady state, unless the readers hold on to a lot of frames.
+static const size_t MAX_MAPPINGS = 16;
+
+static size_t pageAlign(size_t size) {
+  const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  return (size + page - 1) / page * page;
+}
+
+static int futexWait(std::atomic<uint32_t>* word, uint32_t expected,
+                     std::chrono::milliseconds timeout) {
+  struct timespec ts;
+  ts.tv_sec = timeout.count() / 1000;
+  ts.tv_nsec = (timeout.count() % 1000) * 1000000;
+  return syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT,
+                 expected, &ts, nullptr, 0);
+}
+
+static void futexWake(std::atomic<uint32_t>* word) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, 1,
+          nullptr, nullptr, 0);
+}
+
+/**
+ * Send one message with up to two fds attached.
+ */
+static bool sendWithFds(int sock, const void* message, size_t size,
+                        const int* fds, size_t fdCount) {
+  struct iovec iov = {const_cast<void*>(message), size};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  alignas(struct cmsghdr) char control[CMSG_SPACE(2 * sizeof(int))];
+  if (fdCount > 0) {
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(fdCount * sizeof(int));
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(fdCount * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, fdCount * sizeof(int));
+  }
+
+  ssize_t rc;
+  do {
+    rc = sendmsg(sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+  } while ((rc < 0) && (errno == EINTR));
+  return rc == static_cast<ssize_t>(size);
+}
+
+/**
+ * Receive one message and up to two fds with it. Missing fds are -1.
+ *
+ * @return As recvmsg().
+ */
+static ssize_t receiveWithFds(int sock, void* message, size_t size, int* fds,
+                              size_t fdCount, int flags) {
+  struct iovec iov = {message, size};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  alignas(struct cmsghdr) char control[CMSG_SPACE(2 * sizeof(int))];
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  std::fill(fds, fds + fdCount, -1);
+  ssize_t rc;
+  do {
+    rc = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | flags);
+  } while ((rc < 0) && (errno == EINTR));
+  if (rc <= 0) {
+    return rc;
+  }
+
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if ((cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS)) {
+      continue;
+    }
+    const size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int received[2];
+    memcpy(received, CMSG_DATA(cmsg), std::min<size_t>(n, 2) * sizeof(int));
+    for (size_t i = 0; i < n && i < 2; i++) {
+      if (i < fdCount) {
+        fds[i] = received[i];
+      } else {
+        // More than we asked for; don't leak them
+        ::close(received[i]);
+      }
+    }
+  }
+  return rc;
+}
+
+
+Publisher::Publisher(const Config& config)
+  : mConfig{config}
+  , mMode{config.mode}
+  , mListenFd{-1}
+  , mReaders{}
+  , mSequence{0}
+  , mRingFd{-1}
+  , mRing{nullptr}
+  , mRingSize{0}
+  , mBuffers{}
+  , mFreeBits{(MAX_READERS >= 32) ? 0xFFFFFFFFu : ((1u << MAX_READERS) - 1)}
+  , mReaderCount{0}
+  , mPublished{0}
+  , mDelivered{0}
+  , mDropped{0}
+  , mOversized{0}
+  , mBytes{0}
+{
+}
+
+Publisher::~Publisher() {
+  while (!mReaders.empty()) {
+    removeReader(mReaders.size() - 1);
+  }
+  tearDownRing();
+  for (const auto& buffer : mBuffers) {
+    ::close(buffer.fd);
+  }
+  if (mListenFd >= 0) {
+    ::close(mListenFd);
+    unlink(mConfig.path.c_str());
+  }
+}
+
+bool Publisher::open() {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (mConfig.path.size() >= sizeof(addr.sun_path)) {
+    Logger::error(__func__, "Socket path too long: %s\n", mConfig.path.c_str());
+    return false;
+  }
+  strncpy(addr.sun_path, mConfig.path.c_str(), sizeof(addr.sun_path) - 1);
+
+  mListenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                     0);
+  // Left behind by an earlier run, most likely
+  unlink(mConfig.path.c_str());
+  if ((mListenFd < 0) ||
+      (bind(mListenFd, reinterpret_cast<struct sockaddr*>(&addr),
+            sizeof(addr)) != 0) ||
+      (listen(mListenFd, 8) != 0)) {
+    Logger::error(__func__, "Failed to listen on %s: %s\n",
+                  mConfig.path.c_str(), strerror(errno));
+    if (mListenFd >= 0) {
+      ::close(mListenFd);
+      mListenFd = -1;
+    }
+    return false;
+  }
+
+  if ((mMode == Mode::RING) && !setUpRing()) {
+    Logger::warning(__func__, "Passing frames as fds instead\n");
+    mMode = Mode::FD;
+  }
+  Logger::info(__func__, "Publishing to local readers on %s (%s)\n",
+               mConfig.path.c_str(), (mMode == Mode::RING) ? "ring" : "fds");
+  return true;
+}
+
+bool Publisher::setUpRing() {
+  const size_t slots = std::min(std::max<size_t>(mConfig.slots, 1),
+                                MAX_RING_SLOTS);
+  const size_t slotSize = pageAlign(mConfig.slotSize);
+  const size_t dataOffset = pageAlign(sizeof(RingHeader) + slots * sizeof(Slot));
+  mRingSize = dataOffset + slots * slotSize;
+
+  mRingFd = memfd_create("picam-ring", MFD_CLOEXEC);
+  if ((mRingFd < 0) || (ftruncate(mRingFd, mRingSize) != 0)) {
+    Logger::warning(__func__, "Failed to create the ring: %s\n",
+                    strerror(errno));
+    tearDownRing();
+    return false;
+  }
+  void* ring = mmap(nullptr, mRingSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    mRingFd, 0);
+  if (ring == MAP_FAILED) {
+    Logger::warning(__func__, "Failed to map %zu byte ring: %s\n", mRingSize,
+                    strerror(errno));
+    tearDownRing();
+    return false;
+  }
+  mRing = static_cast<uint8_t*>(ring);
+
+  RingHeader* header = new (mRing) RingHeader{};
+  memcpy(header->magic, RING_MAGIC, sizeof(RING_MAGIC));
+  header->version = VERSION;
+  header->slotCount = static_cast<uint32_t>(slots);
+  header->slotSize = slotSize;
+  header->dataOffset = dataOffset;
+  for (size_t i = 0; i < slots; i++) {
+    new (slot(i)) Slot{};
+  }
+  return true;
+}
+
+void Publisher::tearDownRing() {
+  if (mRing != nullptr) {
+    munmap(mRing, mRingSize);
+    mRing = nullptr;
+  }
+  if (mRingFd >= 0) {
+    ::close(mRingFd);
+    mRingFd = -1;
+  }
+}
+
+Slot* Publisher::slot(size_t index) {
+  return reinterpret_cast<Slot*>(mRing + sizeof(RingHeader)) + index;
+}
+
+uint8_t* Publisher::slotData(size_t index) {
+  const RingHeader* header = reinterpret_cast<const RingHeader*>(mRing);
+  return mRing + header->dataOffset + index * header->slotSize;
+}
+
+void Publisher::acceptReaders() {
+  for (;;) {
+    int fd = accept4(mListenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+
+    if (mFreeBits == 0) {
+      Logger::warning(__func__, "Too many local readers\n");
+      ::close(fd);
+      continue;
+    }
+    Reader reader{fd, -1, static_cast<uint32_t>(__builtin_ctz(mFreeBits)), 0};
+    Hello hello{};
+    memcpy(hello.magic, HELLO_MAGIC, sizeof(HELLO_MAGIC));
+    hello.version = VERSION;
+    hello.mode = static_cast<uint8_t>(mMode);
+    hello.readerBit = static_cast<uint8_t>(reader.bit);
+
+    bool ok;
+    if (mMode == Mode::RING) {
+      reader.eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+      const int fds[2] = {mRingFd, reader.eventFd};
+      ok = (reader.eventFd >= 0) &&
+        sendWithFds(fd, &hello, sizeof(hello), fds, 2);
+    } else {
+      ok = sendWithFds(fd, &hello, sizeof(hello), nullptr, 0);
+    }
+    if (!ok) {
+      Logger::warning(__func__, "Failed to set up local reader: %s\n",
+                      strerror(errno));
+      if (reader.eventFd >= 0) {
+        ::close(reader.eventFd);
+      }
+      ::close(fd);
+      continue;
+    }
+
+    mFreeBits &= ~(1u << reader.bit);
+    mReaders.push_back(reader);
+    mReaderCount = mReaders.size();
+    Logger::info(__func__, "Local reader connected (%zu now)\n",
+                 mReaders.size());
+  }
+}
+
+bool Publisher::serviceReader(Reader& reader) {
+  for (;;) {
+    uint64_t sequence;
+    ssize_t rc = recv(reader.fd, &sequence, sizeof(sequence), MSG_DONTWAIT);
+    if (rc == static_cast<ssize_t>(sizeof(sequence))) {
+      // FD: a frame given back. Ring readers have nothing to say.
+      release(reader, sequence);
+      continue;
+    }
+    if (rc > 0) {
+      continue;
+    }
+    if ((rc < 0) && (errno == EINTR)) {
+      continue;
+    }
+    return (rc < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+  }
+}
+
+void Publisher::release(Reader& reader, uint64_t sequence) {
+  const uint32_t mask = 1u << reader.bit;
+  for (auto& buffer : mBuffers) {
+    if ((buffer.sequence == sequence) && (buffer.holders & mask)) {
+      buffer.holders &= ~mask;
+      reader.holding--;
+      return;
+    }
+  }
+}
+
+void Publisher::serviceReaders() {
+  for (size_t i = mReaders.size(); i-- > 0;) {
+    if (!serviceReader(mReaders[i])) {
+      removeReader(i);
+    }
+  }
+}
+
+void Publisher::removeReader(size_t index) {
+  Reader& reader = mReaders[index];
+  // Whatever it was still holding goes back
+  const uint32_t mask = 1u << reader.bit;
+  if (mMode == Mode::RING) {
+    const RingHeader* header = reinterpret_cast<const RingHeader*>(mRing);
+    for (size_t i = 0; i < header->slotCount; i++) {
+      slot(i)->readers.fetch_and(~mask);
+    }
+  }
+  for (auto& buffer : mBuffers) {
+    buffer.holders &= ~mask;
+  }
+  mFreeBits |= mask;
+  if (reader.eventFd >= 0) {
+    ::close(reader.eventFd);
+  }
+  ::close(reader.fd);
+  mReaders.erase(mReaders.begin() + index);
+  mReaderCount = mReaders.size();
+  Logger::info(__func__, "Local reader disconnected (%zu left)\n",
+               mReaders.size());
+}
+
+Slot* Publisher::freeSlot() {
+  // The oldest free slot; never-used ones have sequence 0
+  const RingHeader* header = reinterpret_cast<const RingHeader*>(mRing);
+  Slot* best = nullptr;
+  for (size_t i = 0; i < header->slotCount; i++) {
+    Slot* s = slot(i);
+    if ((s->readers.load() == 0) &&
+        ((best == nullptr) || (s->sequence.load() < best->sequence.load()))) {
+      best = s;
+    }
+  }
+  return best;
+}
+
+Slot* Publisher::waitForSlot() {
+  RingHeader* header = reinterpret_cast<RingHeader*>(mRing);
+  const auto deadline = std::chrono::steady_clock::now() + mConfig.waitTimeout;
+  for (;;) {
+    if (Slot* s = freeSlot()) {
+      return s;
+    }
+    if (mReaders.empty() || (std::chrono::steady_clock::now() >= deadline)) {
+      return nullptr;
+    }
+
+    // Readers only wake us if we say we're waiting. Check again after
+    // saying so, in case one gave a slot back in between.
+    const uint32_t releases = header->releases.load();
+    header->publisherWaiting.store(1);
+    Slot* s = freeSlot();
+    if (s == nullptr) {
+      futexWait(&header->releases, releases, READER_CHECK_INTERVAL);
+    }
+    header->publisherWaiting.store(0);
+    if (s != nullptr) {
+      return s;
+    }
+    // A reader that's gone gives its slots back
+    serviceReaders();
+  }
+}
+
+ssize_t Publisher::publish(const Image::Metadata& metadata, const Frame* frame,
+                           const Detections* detections) {
+  if (mListenFd < 0) {
+    return -1;
+  }
+  if (refreshReaders() == 0) {
+    mDropped++;
+    return 0;
+  }
+
+  return (mMode == Mode::RING)
+    ? publishRing(metadata, frame, detections)
+    : publishFd(metadata, frame, detections);
+}
+
+size_t Publisher::refreshReaders() {
+  if (mListenFd >= 0) {
+    acceptReaders();
+    serviceReaders();
+  }
+  return mReaders.size();
+}
+
+ssize_t Publisher::publishRing(const Image::Metadata& metadata,
+                               const Frame* frame,
+                               const Detections* detections) {
+  Slot* s = waitForSlot();
+  if ((s == nullptr) || mReaders.empty()) {
+    mDropped++;
+    return 0;
+  }
+
+  const size_t index = s - slot(0);
+  RingHeader* header = reinterpret_cast<RingHeader*>(mRing);
+  s->sequence.store(0, std::memory_order_relaxed);
+  ssize_t size = ImageFraming::copyImage(slotData(index), header->slotSize,
+                                         metadata, frame, detections);
+  if (size < 0) {
+    Logger::warning(__func__, "Frame doesn't fit in a %llu byte slot\n",
+                    static_cast<unsigned long long>(header->slotSize));
+    mOversized++;
+    return 0;
+  }
+
+  uint32_t mask = 0;
+  for (const auto& reader : mReaders) {
+    mask |= 1u << reader.bit;
+  }
+  s->size = size;
+  // A reader that sees its bit sees the sequence reset above, and one that
+  // sees the new sequence sees the frame
+  s->readers.store(mask, std::memory_order_release);
+  s->sequence.store(++mSequence, std::memory_order_release);
+  header->published.store(mSequence, std::memory_order_release);
+
+  const uint64_t one = 1;
+  for (const auto& reader : mReaders) {
+    if (write(reader.eventFd, &one, sizeof(one)) < 0) {
+      // Only fails if the counter's about to overflow: it's been woken
+      // plenty
+    }
+  }
+
+  mPublished++;
+  mDelivered += mReaders.size();
+  mBytes += size;
+  return size;
+}
+
+bool Publisher::waitForReaders() {
+  const auto deadline = std::chrono::steady_clock::now() + mConfig.waitTimeout;
+  const size_t limit = std::max<size_t>(mConfig.slots, 1);
+  std::vector<struct pollfd> fds;
+  for (;;) {
+    fds.clear();
+    for (const auto& reader : mReaders) {
+      if (reader.holding >= limit) {
+        fds.push_back({reader.fd, POLLIN, 0});
+      }
+    }
+    const auto now = std::chrono::steady_clock::now();
+    if (fds.empty() || (now >= deadline)) {
+      return fds.empty();
+    }
+    const auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - now);
+    poll(fds.data(), fds.size(), static_cast<int>(wait.count()) + 1);
+    serviceReaders();
+  }
+}
+
+ssize_t Publisher::publishFd(const Image::Metadata& metadata,
+                             const Frame* frame,
+                             const Detections* detections) {
+  waitForReaders();
+  const size_t limit = std::max<size_t>(mConfig.slots, 1);
+
+  Buffer* buffer = freeBuffer();
+  if (buffer == nullptr) {
+    return -1;
+  }
+  // Grows the memfd if the frame's bigger than the last one in it
+  ssize_t size = -1;
+  if (lseek(buffer->fd, 0, SEEK_SET) == 0) {
+    size = ImageFraming::writeImage(buffer->fd, metadata, frame, nullptr,
+                                    detections);
+  }
+  if (size < 0) {
+    Logger::error(__func__, "Failed to write frame: %s\n", strerror(errno));
+    return -1;
+  }
+
+  FrameMessage message{};
+  memcpy(message.magic, FRAME_MAGIC, sizeof(FRAME_MAGIC));
+  message.size = static_cast<uint32_t>(size);
+  message.sequence = ++mSequence;
+  buffer->sequence = message.sequence;
+  uint64_t delivered = 0;
+  for (size_t i = mReaders.size(); i-- > 0;) {
+    Reader& reader = mReaders[i];
+    if (reader.holding >= limit) {
+      mDropped++;
+      continue;
+    }
+    if (sendWithFds(reader.fd, &message, sizeof(message), &buffer->fd, 1)) {
+      buffer->holders |= 1u << reader.bit;
+      reader.holding++;
+      delivered++;
+    } else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+      mDropped++;
+    } else {
+      removeReader(i);
+    }
+  }
+
+  mPublished++;
+  mDelivered += delivered;
+  mBytes += size;
+  return (delivered > 0) ? size : 0;
+}
+
+Publisher::Buffer* Publisher::freeBuffer() {
+  for (auto& buffer : mBuffers) {
+    if (buffer.holders == 0) {
+      return &buffer;
+    }
+  }
+
+  int fd = memfd_create("picam-frame", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  // Readers keep it mapped, so it can grow but mustn't shrink
+  if ((fd < 0) || (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) != 0)) {
+    Logger::error(__func__, "Failed to create a frame buffer: %s\n",
+                  strerror(errno));
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    return nullptr;
+  }
+  mBuffers.push_back(Buffer{fd, 0, 0});
+  return &mBuffers.back();
+}
+
+Publisher::Stats Publisher::stats() const {
+  return Stats{
+    mReaderCount.load(),
+    mPublished.load(),
+    mDelivered.load(),
+    mDropped.load(),
+    mOversized.load(),
+    mBytes.load(),
+  };
+}
+
+
+Subscriber::Subscriber()
+  : mMode{Mode::FD}
+  , mFd{-1}
+  , mEventFd{-1}
+  , mBit{0}
+  , mRingFd{-1}
+  , mRing{nullptr}
+  , mRingSize{0}
+  , mMappings{}
+{
+}
+
+Subscriber::~Subscriber() {
+  close();
+}
+
+void Subscriber::close() {
+  if (mRing != nullptr) {
+    munmap(mRing, mRingSize);
+    mRing = nullptr;
+  }
+  for (const auto& mapping : mMappings) {
+    munmap(mapping.data, mapping.size);
+  }
+  mMappings.clear();
+  for (int* fd : {&mFd, &mEventFd, &mRingFd}) {
+    if (*fd >= 0) {
+      ::close(*fd);
+      *fd = -1;
+    }
+  }
+}
+
+bool Subscriber::connect(const std::string& path) {
+  close();
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    return false;
+  }
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  mFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if ((mFd < 0) ||
+      (::connect(mFd, reinterpret_cast<struct sockaddr*>(&addr),
+                 sizeof(addr)) != 0)) {
+    Logger::error(__func__, "Failed to connect to %s: %s\n", path.c_str(),
+                  strerror(errno));
+    close();
+    return false;
+  }
+
+  Hello hello{};
+  int fds[2];
+  ssize_t rc = receiveWithFds(mFd, &hello, sizeof(hello), fds, 2, 0);
+  mRingFd = fds[0];
+  mEventFd = fds[1];
+  if ((rc != static_cast<ssize_t>(sizeof(hello))) ||
+      (memcmp(hello.magic, HELLO_MAGIC, sizeof(HELLO_MAGIC)) != 0) ||
+      (hello.version != VERSION)) {
+    Logger::error(__func__, "Bad hello from %s\n", path.c_str());
+    close();
+    return false;
+  }
+  mMode = static_cast<Mode>(hello.mode);
+  if (mMode != Mode::RING) {
+    return mMode == Mode::FD;
+  }
+
+  struct stat st;
+  if ((mRingFd < 0) || (mEventFd < 0) || (fstat(mRingFd, &st) != 0)) {
+    Logger::error(__func__, "No ring from %s\n", path.c_str());
+    close();
+    return false;
+  }
+  mRingSize = st.st_size;
+  void* ring = mmap(nullptr, mRingSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    mRingFd, 0);
+  if (ring == MAP_FAILED) {
+    Logger::error(__func__, "Failed to map the ring: %s\n", strerror(errno));
+    close();
+    return false;
+  }
+  mRing = static_cast<uint8_t*>(ring);
+  mBit = hello.readerBit;
+  const RingHeader* header = reinterpret_cast<const RingHeader*>(mRing);
+  if ((mRingSize < sizeof(RingHeader)) ||
+      (memcmp(header->magic, RING_MAGIC, sizeof(RING_MAGIC)) != 0) ||
+      (header->dataOffset + header->slotCount * header->slotSize > mRingSize)) {
+    Logger::error(__func__, "Bad ring from %s\n", path.c_str());
+    close();
+    return false;
+  }
+  return true;
+}
+
+int Subscriber::receive(const Callback& callback,
+                        std::chrono::milliseconds timeout) {
+  if (mFd < 0) {
+    return -1;
+  }
+
+  struct pollfd fds[2] = {
+    {mFd, POLLIN, 0},
+    {mEventFd, POLLIN, 0},
+  };
+  const nfds_t count = (mMode == Mode::RING) ? 2 : 1;
+  int rc = poll(fds, count, static_cast<int>(timeout.count()));
+  if ((rc < 0) && (errno != EINTR)) {
+    return -1;
+  }
+
+  if (mMode == Mode::FD) {
+    return receiveFd(callback);
+  }
+
+  if (fds[0].revents != 0) {
+    // The publisher never sends anything after the hello in RING mode
+    char c;
+    if (recv(mFd, &c, sizeof(c), MSG_DONTWAIT) <= 0 &&
+        !((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+      return -1;
+    }
+  }
+  if (fds[1].revents & POLLIN) {
+    uint64_t count;
+    if (read(mEventFd, &count, sizeof(count)) < 0) {
+      // Already reset
+    }
+  }
+  return receiveRing(callback);
+}
+
+int Subscriber::receiveRing(const Callback& callback) {
+  RingHeader* header = reinterpret_cast<RingHeader*>(mRing);
+  Slot* slots = reinterpret_cast<Slot*>(mRing + sizeof(RingHeader));
+  const uint32_t mask = 1u << mBit;
+
+  // Ours to read, oldest first
+  std::pair<uint64_t, size_t> ready[MAX_RING_SLOTS];
+  size_t readyCount = 0;
+  for (size_t i = 0; i < header->slotCount; i++) {
+    if (!(slots[i].readers.load(std::memory_order_acquire) & mask)) {
+      continue;
+    }
+    const uint64_t sequence = slots[i].sequence.load(std::memory_order_acquire);
+    if (sequence != 0) {
+      ready[readyCount++] = {sequence, i};
+    }
+  }
+  std::sort(ready, ready + readyCount);
+
+  for (size_t n = 0; n < readyCount; n++) {
+    Slot& slot = slots[ready[n].second];
+    const uint8_t* data = mRing + header->dataOffset +
+      ready[n].second * header->slotSize;
+    callback(ready[n].first, data, std::min<uint64_t>(slot.size,
+                                                       header->slotSize));
+
+    slot.readers.fetch_and(~mask);
+    header->releases.fetch_add(1);
+    if (header->publisherWaiting.load()) {
+      futexWake(&header->releases);
+    }
+  }
+  return static_cast<int>(readyCount);
+}
+
+int Subscriber::receiveFd(const Callback& callback) {
+  int received = 0;
+  for (;;) {
+    FrameMessage message{};
+    int fd;
+    ssize_t rc = receiveWithFds(mFd, &message, sizeof(message), &fd, 1,
+                                MSG_DONTWAIT);
+    if (rc == 0) {
+      return -1;
+    }
+    if (rc < 0) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        return received;
+      }
+      return -1;
+    }
+    if ((rc != static_cast<ssize_t>(sizeof(message))) || (fd < 0) ||
+        (memcmp(message.magic, FRAME_MAGIC, sizeof(FRAME_MAGIC)) != 0)) {
+      Logger::warning(__func__, "Bad frame message\n");
+      if (fd >= 0) {
+        ::close(fd);
+      }
+      continue;
+    }
+
+    const uint8_t* data = map(fd, message.size);
+    ::close(fd);
+    if (data != nullptr) {
+      callback(message.sequence, data, message.size);
+      received++;
+    }
+    // Give it back either way, or the publisher stops sending
+    if (::send(mFd, &message.sequence, sizeof(message.sequence),
+               MSG_NOSIGNAL) < 0) {
+      return -1;
+    }
+  }
+}
+
+const uint8_t* Subscriber::map(int fd, size_t size) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return nullptr;
+  }
+
+  // The publisher reuses its memfds, so this is usually one we've seen
+  auto it = std::find_if(mMappings.begin(), mMappings.end(),
+      [&st](const Mapping& m) {
+        return (m.device == st.st_dev) && (m.inode == st.st_ino);
+      });
+  if ((it != mMappings.end()) && (it->size >= size)) {
+    return it->data;
+  }
+  if (it != mMappings.end()) {
+    // It's grown since
+    munmap(it->data, it->size);
+    mMappings.erase(it);
+  } else if (mMappings.size() >= MAX_MAPPINGS) {
+    munmap(mMappings.front().data, mMappings.front().size);
+    mMappings.erase(mMappings.begin());
+  }
+
+  const size_t mapSize = std::max<size_t>(st.st_size, size);
+  void* data = mmap(nullptr, mapSize, PROT_READ, MAP_SHARED | MAP_POPULATE,
+                    fd, 0);
+  if (data == MAP_FAILED) {
+    Logger::warning(__func__, "Failed to map frame: %s\n", strerror(errno));
+    return nullptr;
+  }
+  mMappings.push_back(Mapping{st.st_dev, st.st_ino,
+                              static_cast<uint8_t*>(data), mapSize});
+  return static_cast<const uint8_t*>(data);
+}
+
+} // namespace LocalTransport
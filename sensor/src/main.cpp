@@ -16,15 +16,22 @@
  */
 
 
+#include <atomic>
+#include <csignal>
 #include <cstdio>
+#include <cstdlib>
+#include <pthread.h>
+#include <thread>
 #include <unistd.h>
 #include <iostream>
 #include <memory>
 #include <ctime>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netdb.h>
+#include <chrono>
+#include <algorithm>
+#include <string>
+#include <vector>
 
+#ifndef PICAM_NO_MMAL
 #include <bcm_host.h>
 #include <interface/vcos/vcos.h>
 #include <interface/mmal/mmal.h>
@@ -35,294 +42,92 @@
 #include <interface/mmal/util/mmal_connection.h>
 #include <interface/mmal/mmal_parameters_camera.h>
 
-#include "logging.hpp"
 #include "camera.hpp"
 #include "encoder_config.hpp"
+#endif
+
+#include "logging.hpp"
+#include "analysis_tap.hpp"
+#include "capture_scheduler.hpp"
+#include "file_replay_source.hpp"
+#include "frame_source.hpp"
+#include "h264_stream.hpp"
+#include "image_sender.hpp"
+#include "payload_encoder.hpp"
+#include "pipeline.hpp"
+#include "synthetic_frame_source.hpp"
 
 #include "picam.pb.h"
 
 
 /**
- * Represents a TCP connection to the receiver service. Call connect() to
- * establish the connection.
+ * Send a clip of the pre-event buffer every time SIGUSR1 comes in, until
+ * stop is set. SIGUSR1 has to be blocked in every thread.
  */
-class ImageSender {
-  public:
-    struct Config {
-      std::string serverHostname;
-      int serverPort;
-    };
-
-    ImageSender(const Config& config)
-      : mConfig{config},
-      mConnected{false},
-      mSocket{-1}
-    { }
-
-    ~ImageSender() {
-      disconnect();
+static void preEventTrigger(Pipeline& pipeline,
+                            std::chrono::microseconds duration,
+                            const std::atomic<bool>& stop) {
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+
+  for (;;) {
+    int signal;
+    if ((sigwait(&signals, &signal) != 0) || stop) {
+      return;
     }
 
-    bool connect() {
-      if (mConnected) {
-        return true;
-      }
-
-      struct addrinfo hints;
-      memset(&hints, 0, sizeof(hints));
-      hints.ai_family = AF_INET;
-      hints.ai_socktype = SOCK_STREAM;
-      hints.ai_flags = 0;
-      hints.ai_protocol = 0;
-
-      struct addrinfo* result = nullptr;
-      auto port = std::to_string(mConfig.serverPort);
-      int rc = getaddrinfo(mConfig.serverHostname.c_str(), port.c_str(),
-          &hints, &result);
-      if (rc != 0) {
-        Logger::error(__func__, "%s\n", gai_strerror(rc));
-        return false;
-      }
-
-      struct addrinfo* rp = nullptr;
-      int sfd;
-      for (rp = result; rp != nullptr; rp = rp->ai_next) {
-        sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if (sfd == -1) {
-          continue;
-        }
-
-        if (::connect(sfd, rp->ai_addr, rp->ai_addrlen) != -1) {
-          break;
-        }
-
-        close(sfd);
-      }
-
-      if (rp == nullptr) {
-        Logger::error(__func__, "Failed to connect\n");
-        return false;
-      }
-
-      freeaddrinfo(result);
-
-      mSocket = sfd;
-      mConnected = true;
-
-      Logger::info(__func__, "Successfully connected to %s:%s\n",
-          mConfig.serverHostname.c_str(), port.c_str());
-
-      return true;
+    const size_t units = pipeline.sendClip(duration);
+    if (units == 0) {
+      Logger::warning(__func__, "No keyframe buffered yet\n");
+      continue;
     }
-
-    /**
-     * Close the socket (close the TCP connection).
-     */
-    void disconnect() {
-      if (!mConnected) {
-        return;
-      }
-
-      close(mSocket);
-    }
-
-    ssize_t send(std::string& buffer) {
-      if (!mConnected) {
-        return -1;
-      }
-
-      // First send the size so the receiver knows what to expect
-      uint32_t size = htonl(buffer.size());
-      if (::send(mSocket, &size, sizeof(size), 0) < static_cast<ssize_t>(sizeof(size))) {
-        Logger::error(__func__, "Failed to send size\n");
-        return -1;
-      }
-
-      ssize_t sent = 0;
-      while (sent < static_cast<ssize_t>(buffer.size())) {
-        ssize_t rc = ::send(mSocket, buffer.data() + sent, buffer.size() - sent, 0);
-        if (rc < 0) {
-          Logger::error(__func__, "Send failed\n");
-          return -1;
-        }
-
-        sent += rc;
-      }
-
-      return sent;
-    }
-
-  private:
-    Config mConfig;
-    bool mConnected;
-    int mSocket;
-};
-
-
-static inline uint32_t align_up(uint32_t n, uint32_t alignment) {
-  return ((n + alignment - 1) / alignment) * alignment;
-}
-
-MMAL_STATUS_T getImageMetadata(Image::Metadata& imageMeta, Camera& camera) {
-  struct timespec now{};
-  // Ignore return value
-  clock_gettime(CLOCK_REALTIME, &now);
-
-  imageMeta.set_time_s(now.tv_sec);
-  imageMeta.set_time_us(now.tv_nsec / 1000);
-  imageMeta.set_width(camera.width());
-  imageMeta.set_height(camera.height());
-  imageMeta.set_encoding("PNG");
-
-#define GET_SET_OR_RETURN(get, set) {\
-    MMAL_STATUS_T status = get; \
-    if (status != MMAL_SUCCESS) {\
-      return status;\
-    }\
-    set; \
+    Logger::info(__func__, "Sent %zu units of pre-event video\n", units);
   }
-
-  Rational analogGain, digitalGain;
-  GET_SET_OR_RETURN(camera.getAnalogGain(analogGain),
-      imageMeta.set_analog_gain(analogGain.toFloat()));
-  GET_SET_OR_RETURN(camera.getDigitalGain(digitalGain),
-      imageMeta.set_digital_gain(digitalGain.toFloat()));
-
-  Rational redGain, blueGain;
-  {
-    MMAL_STATUS_T status = camera.getAWBGains(redGain, blueGain);
-    if (status != MMAL_SUCCESS) {
-      return status;
-    }
-    imageMeta.set_awb_gain_red(redGain.toFloat());
-    imageMeta.set_awb_gain_blue(blueGain.toFloat());
-  }
-  //imageMeta.set_awb_mode();
-  //imageMeta.set_exposure_mode();
-  //imageMeta.set_exposure_compensation();
-  //imageMeta.set_exposure_speed();
-  //imageMeta.set_hflip();
-  //imageMeta.set_image_denoise();
-  
-  uint32_t iso;
-  GET_SET_OR_RETURN(camera.getISO(iso),
-      imageMeta.set_iso(iso));
-
-  //imageMeta.set_rotation();
-
-  Rational brightness;
-  GET_SET_OR_RETURN(camera.getBrightness(brightness),
-      imageMeta.set_brightness(brightness.toFloat()));
-
-  Rational contrast;
-  GET_SET_OR_RETURN(camera.getContrast(contrast),
-      imageMeta.set_contrast(contrast.toFloat()));
-
-  Rational saturation;
-  GET_SET_OR_RETURN(camera.getSaturation(saturation),
-      imageMeta.set_saturation(saturation.toFloat()));
-
-  Rational sharpness;
-  GET_SET_OR_RETURN(camera.getSharpness(sharpness),
-      imageMeta.set_sharpness(sharpness.toFloat()));
-
-  uint32_t shutterSpeed;
-  GET_SET_OR_RETURN(camera.getShutterSpeed(shutterSpeed),
-      imageMeta.set_shutter_speed(shutterSpeed));
-
-  //imageMeta.set_vflip();
-
-  //imageMeta.set_roi_x();
-  //imageMeta.set_roi_y();
-  //imageMeta.set_roi_w();
-  //imageMeta.set_roi_h();
-#undef GET_SET_OR_RETURN
 }
 
-static std::unique_ptr<ImageSender> gImageSender{nullptr};
-static Camera* gCamera{nullptr};
-static int gFrameCount = 0;
-static bool gFrameCaptured = false;
-size_t encoderCallback(Camera& camera, std::string& data) {
-  if (!gImageSender) {
-    Logger::warning(__func__, "ImageSender not initialized\n");
-    return 0;
+static void stopPreEventTrigger(std::thread& thread, std::atomic<bool>& stop) {
+  if (!thread.joinable()) {
+    return;
   }
-
-  // TODO assuming we always get a whole image--this is not a given
-  auto imageMessage = std::make_unique<Image>();
-  auto imageMeta = imageMessage->mutable_metadata();
-
-  getImageMetadata(*imageMeta, camera);
-
-  imageMessage->set_data(data);
-
-  std::string buffer{};
-  imageMessage->SerializeToString(&buffer);
-
-  gImageSender->send(buffer);
-  gFrameCount++;
-  gFrameCaptured = true;
-
-  return data.size();
+  stop = true;
+  pthread_kill(thread.native_handle(), SIGUSR1);
+  thread.join();
 }
 
-static const int CAMERA_NUM = 0;
-static const SensorMode SENSOR_MODE = SM_3280x2464_1;
-//static const SensorMode SENSOR_MODE = SM_1920x1080;
-// 17 Mbits
-
-int main(int argc, char* argv[]) {
-
-  if (argc < 2) {
-    std::cout << "USAGE: " << argv[0] << " <frame_count>"
-      << std::endl;
-    return 1;
-  }
-
-  int frameCount = std::atoi(argv[1]);
-
-  //unsigned int time = 1;
-  //if (argc > 2) {
-  //  time = std::atoi(argv[2]);
-  //  // If we can't parse the time or it's invalid, reset to 1
-  //  if (time < 1) {
-  //    time = 1;
-  //  }
-  //}
+static const int VIDEO_FPS = 30;
 
-  Logger::setLogLevel(LogLevel::DEBUG);
-
-  const auto senderConfig = ImageSender::Config{
-    "seadra",
-    9000,
-  };
-  gImageSender = std::make_unique<ImageSender>(senderConfig);
-  if (!gImageSender->connect()) {
-    Logger::error("ImageSender failed to connect\n");
-    return 1;
-  }
+#ifndef PICAM_NO_MMAL
+static inline uint32_t align_up(uint32_t n, uint32_t alignment) {
+  return ((n + alignment - 1) / alignment) * alignment;
+}
 
+/**
+ * Open and configure Pi camera cameraNum, either for PNG stills or for H.264
+ * video at H264EncoderConfig::DEFAULT_BITRATE, with an analysis tap passing
+ * raw frames to pipeline if analysis isn't nullptr. Returns nullptr on
+ * failure.
+ */
+static std::unique_ptr<Camera> openCamera(int cameraNum, SensorMode sensorMode,
+    bool video, const Camera::AnalysisConfig* analysis, Pipeline& pipeline) {
   bcm_host_init();
   vcos_log_register("picam", VCOS_LOG_CATEGORY);
   Logger::info("bcm_host_init complete\n");
 
-  Camera camera{CAMERA_NUM};
-  gCamera = &camera;
-
-  unsigned int width = SENSOR_MODE_WIDTH[SENSOR_MODE];
-  unsigned int height = SENSOR_MODE_HEIGHT[SENSOR_MODE];
+  auto pCamera = std::make_unique<Camera>(cameraNum);
+  Camera& camera = *pCamera;
 
-  //const std::pair<int, int> fps = {1, 10};
-  const Rational fps{0, 1};
-  //const std::pair<int, int> fps = {1, 6};
+  unsigned int width = SENSOR_MODE_WIDTH[sensorMode];
+  unsigned int height = SENSOR_MODE_HEIGHT[sensorMode];
 
+  const Rational fps = video ? Rational{VIDEO_FPS, 1} : Rational{0, 1};
 
-  if (camera.open(SENSOR_MODE, CaptureMode::STILL) != MMAL_SUCCESS) {
+  if (camera.open(sensorMode, video ? CaptureMode::VIDEO : CaptureMode::STILL)
+      != MMAL_SUCCESS) {
     Logger::error("Failed to open camera device\n");
-    return 1;
+    return nullptr;
   }
-  Logger::info("Camera opened in still mode\n");
+  Logger::info("Camera opened in %s mode\n", video ? "video" : "still");
 
   {
     // Set the camera config
@@ -345,7 +150,7 @@ int main(int argc, char* argv[]) {
 
     if (camera.setCameraConfig(cameraConfig) != MMAL_SUCCESS) {
       Logger::error("Failed to set cameraConfig\n");
-      return 1;
+      return nullptr;
     }
     Logger::info("Camera configured. width=%u, height=%u\n", width, height);
   }
@@ -362,7 +167,7 @@ int main(int argc, char* argv[]) {
     if (camera.setPreviewFormat(MMAL_ENCODING_OPAQUE, MMAL_ENCODING_I420, formatIn)
         != MMAL_SUCCESS) {
       Logger::error("Failed to set preview format\n");
-      return 1;
+      return nullptr;
     }
 
     Logger::info("Preview configured. width=%u, height=%u @ %u fps\n",
@@ -370,7 +175,7 @@ int main(int argc, char* argv[]) {
                  formatIn.frame_rate.num / formatIn.frame_rate.den);
   }
 
-  {
+  if (!video) {
     // Configure still encoding
     const MMAL_VIDEO_FORMAT_T formatIn = {
       .width = align_up(width, 32),
@@ -382,13 +187,12 @@ int main(int argc, char* argv[]) {
     if (camera.setStillFormat(MMAL_ENCODING_OPAQUE, MMAL_ENCODING_I420, formatIn)
         != MMAL_SUCCESS) {
       Logger::error("Failed to set still format\n");
-      return 1;
+      return nullptr;
     }
-  }
-
-  Logger::info("Still output configured. width=%u, height=%u\n", width, height);
 
-  if (0) {
+    Logger::info("Still output configured. width=%u, height=%u\n", width,
+                 height);
+  } else {
     // Configure the video encoding
     const MMAL_VIDEO_FORMAT_T formatInVideo = {
       .width = align_up(width, 32),
@@ -406,7 +210,7 @@ int main(int argc, char* argv[]) {
                               formatInVideo)
         != MMAL_SUCCESS) {
       Logger::error("Failed to set video format\n");
-      return 1;
+      return nullptr;
     }
 
     Logger::info("Video format set. width=%u, height=%u\n",
@@ -414,43 +218,75 @@ int main(int argc, char* argv[]) {
   }
 
   if (camera.configurePreview() != MMAL_SUCCESS) {
-    return 1;
+    return nullptr;
   }
 
   // Set some parameters
   // TODO set more parameters
   //setColorEffect
   //setFocus
+  // Video can't use long exposures, so leave the shutter speed to auto
+  // exposure
   if (
       //(camera.setAWBMode(MMAL_PARAM_AWBMODE_OFF) != MMAL_SUCCESS)
       (camera.setAWBMode(MMAL_PARAM_AWBMODE_AUTO) != MMAL_SUCCESS)
-      || (camera.setExposureMode(MMAL_PARAM_EXPOSUREMODE_NIGHT) != MMAL_SUCCESS)
-      //|| (camera.setExposureMode(MMAL_PARAM_EXPOSUREMODE_AUTO) != MMAL_SUCCESS)
+      || (camera.setExposureMode(video ? MMAL_PARAM_EXPOSUREMODE_AUTO
+                                       : MMAL_PARAM_EXPOSUREMODE_NIGHT)
+          != MMAL_SUCCESS)
       || (camera.setSharpness({0, 1}) != MMAL_SUCCESS)
       || (camera.setContrast({0, 1}) != MMAL_SUCCESS)
       || (camera.setBrightness({50, 100}) != MMAL_SUCCESS)
       || (camera.setSaturation({0, 1}) != MMAL_SUCCESS)
       || (camera.setISO(800) != MMAL_SUCCESS)
-      || (camera.setShutterSpeed(60000000) != MMAL_SUCCESS)
-      || (camera.setCameraUseCase(MMAL_PARAM_CAMERA_USE_CASE_STILLS_CAPTURE) != MMAL_SUCCESS)) {
+      || (camera.setShutterSpeed(video ? 0 : 60000000) != MMAL_SUCCESS)
+      || (camera.setCameraUseCase(video ? MMAL_PARAM_CAMERA_USE_CASE_VIDEO_CAPTURE
+                                        : MMAL_PARAM_CAMERA_USE_CASE_STILLS_CAPTURE)
+          != MMAL_SUCCESS)) {
     Logger::error("Failed to set camera parameters\n");
-    return 1;
+    return nullptr;
   }
 
   // Set up the encoder
-  {
+  if (video) {
+    H264EncoderConfig encoderConfig{};
+    encoderConfig.framerate = {VIDEO_FPS, 1};
+    // Repeat SPS/PPS with every IDR frame so a receiver can start decoding
+    // mid-stream
+    encoderConfig.inlineHeaderEnabled = true;
+    if (encoderConfig.configure(camera.encoderInputPort(),
+                                camera.encoderOutputPort()) != MMAL_SUCCESS)
+    {
+      Logger::error("Failed to configure encoder\n");
+      return nullptr;
+    }
+  } else {
     PNGEncoderConfig encoderConfig{};
     if (encoderConfig.configure(camera.encoderInputPort(),
                                 camera.encoderOutputPort()) != MMAL_SUCCESS)
     {
       Logger::error("Failed to configure encoder\n");
-      return 1;
+      return nullptr;
     }
   }
 
+  auto analysisCallback = [&pipeline](const RawFrame& frame) {
+    pipeline.frameAnalysed(frame);
+  };
+  if ((analysis != nullptr) &&
+      (camera.enableAnalysisTap(*analysis, analysisCallback) != MMAL_SUCCESS)) {
+    Logger::error("Failed to set up the analysis tap\n");
+    return nullptr;
+  }
+
   if (camera.enableCamera() != MMAL_SUCCESS) {
     Logger::error("Failed to enable camera\n");
-    return 1;
+    return nullptr;
+  }
+
+  // Seed the gains in the cached state; settings events keep them current
+  // from here on
+  if (camera.refreshVolatileState() != MMAL_SUCCESS) {
+    Logger::warning("Failed to read initial camera gains\n");
   }
 
   // Now set up the buffers
@@ -458,12 +294,12 @@ int main(int argc, char* argv[]) {
   // send splitter output buffers to the port
   if (camera.createBufferPools() != MMAL_SUCCESS) {
     Logger::error("Failed to create video port buffer pool\n");
-    return 1;
+    return nullptr;
   }
 
   // Connect all the ports
   if (camera.setUpConnections() != MMAL_SUCCESS) {
-    return 1;
+    return nullptr;
   }
 
   {
@@ -493,48 +329,493 @@ int main(int argc, char* argv[]) {
                   );
   }
 
-  //
-  // Now that all the ports are set up, let's capture video
-  //
+  return pCamera;
+}
+#endif // PICAM_NO_MMAL
+
+static const SensorMode SENSOR_MODE = SM_3280x2464_1;
+static const SensorMode VIDEO_SENSOR_MODE = SM_1920x1080;
+static const uint16_t SERVER_PORT = 9000;
+// Video goes to its own port, since the stream isn't Image messages
+static const uint16_t VIDEO_SERVER_PORT = 9001;
+static const size_t EVENT_QUEUE_CAPACITY = 32;
+// Streamed frames are queued an encoder buffer at a time
+static const size_t STREAM_QUEUE_CAPACITY = 256;
+
+static void usage(const char* argv0) {
+  std::cout << "USAGE: " << argv0
+    << " [-s | -v [-e seconds]] [-m sensor_mode] [-f file]... [-r fps] [-h host] [-p port]"
+    << " [-d spool_dir] [-c] [-a WxH] [-D full_frame_interval]"
+    << " [-l socket_path [-L]] [-u | -U] [-z codec [-Z]] [-n cameras]"
+    << " <frame_count> [interval_ms [burst_count [settle_ms]]]" << std::endl
+    << "  -s  capture from a synthetic star field instead of the camera"
+    << std::endl
+    << "  -v  stream H.264 video; frame_count counts video frames" << std::endl
+    << "  -e  with -v, keep the last N seconds of video in memory and only"
+    << " send them on SIGUSR1" << std::endl
+    << "  -f  replay a captured file (repeat for more frames)" << std::endl
+    << "  -r  frame rate of the synthetic or replayed frames" << std::endl
+    << "  -d  keep frames here while the receiver is unreachable, and send"
+    << " them once it's back" << std::endl
+    << "  -c  send frames with the chunked protocol, which picks up where it"
+    << " left off after a dropped connection; stills are sent as they're"
+    << " encoded (the receiver has to speak it too)" << std::endl
+    << "  -a  also hand raw WxH frames to on-sensor analysis (0x0 for the"
+    << " capture size)" << std::endl
+    << "  -D  event mode: send what's detected in each frame, and the frame"
+    << " itself only when something triggers it (and every Nth frame, if N"
+    << " isn't 0)" << std::endl
+    << "  -l  publish frames to readers on this host through shared memory,"
+    << " instead of sending them to the receiver; readers connect to the"
+    << " Unix socket at socket_path" << std::endl
+    << "  -L  with -l, pass each frame as a file descriptor instead of"
+    << " sharing a ring of slots" << std::endl
+    << "  -u  send through io_uring, batching frames that queue up and"
+    << " sending big ones zero-copy (Linux 6.0 or later)" << std::endl
+    << "  -U  like -u, with a kernel thread polling for sends, which saves a"
+    << " syscall per frame but keeps a core busy while frames keep coming"
+    << std::endl
+    << "  -z  compress raw frames (GRAY8, I420, RGB24, RAW) with lz4, zstd or"
+    << " deflate, or \"auto\" to pick one by how much the link can take;"
+    << " with -s, frames are sent as I420" << std::endl
+    << "  -Z  with -z, send frames as differences from the one before, with a"
+    << " key frame every so often" << std::endl
+    << "  -n  capture from this many cameras (or synthetic sources) at once,"
+    << " each tagged with its number as the sensor id; frame_count is per"
+    << " camera" << std::endl;
+}
 
-  // Wait 30 seconds, then start capture
-  for (int i = 0; i < 30; i++) {
-    vcos_sleep(1000);
+int main(int argc, char* argv[]) {
+  bool synthetic = false;
+  bool video = false;
+  SensorMode sensorMode = SM_INVALID;
+  std::vector<std::string> replayPaths;
+  double frameRate = 1.0;
+  std::string serverHostname = "seadra";
+  uint16_t serverPort = 0;
+  double preEventSeconds = 0.0;
+  std::string spoolDirectory;
+  bool analysis = false;
+  unsigned analysisWidth = 0, analysisHeight = 0;
+  bool events = false;
+  unsigned fullFrameInterval = 0;
+  bool chunked = false;
+  std::string localPath;
+  bool localFds = false;
+  bool ioUring = false;
+  bool ioUringSqPoll = false;
+  bool compress = false;
+  PayloadEncoder::Config codecConfig{};
+  unsigned cameras = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "sve:m:f:r:h:p:d:ca:D:l:LuUz:Zn:")) != -1) {
+    switch (opt) {
+      case 's':
+        synthetic = true;
+        break;
+      case 'v':
+        video = true;
+        break;
+      case 'e':
+        preEventSeconds = std::atof(optarg);
+        break;
+      case 'm': {
+        int mode = std::atoi(optarg);
+        if ((mode <= SM_INVALID) || (mode >= NUM_SENSOR_MODES)) {
+          std::cout << "Invalid sensor mode " << optarg << std::endl;
+          return 1;
+        }
+        sensorMode = static_cast<SensorMode>(mode);
+        break;
+      }
+      case 'f':
+        replayPaths.emplace_back(optarg);
+        break;
+      case 'r':
+        frameRate = std::atof(optarg);
+        break;
+      case 'h':
+        serverHostname = optarg;
+        break;
+      case 'p':
+        serverPort = static_cast<uint16_t>(std::atoi(optarg));
+        break;
+      case 'd':
+        spoolDirectory = optarg;
+        break;
+      case 'c':
+        chunked = true;
+        break;
+      case 'a':
+        if (sscanf(optarg, "%ux%u", &analysisWidth, &analysisHeight) != 2) {
+          std::cout << "Invalid analysis size " << optarg << std::endl;
+          return 1;
+        }
+        analysis = true;
+        break;
+      case 'D':
+        events = true;
+        fullFrameInterval = static_cast<unsigned>(std::max(std::atoi(optarg), 0));
+        break;
+      case 'l':
+        localPath = optarg;
+        break;
+      case 'L':
+        localFds = true;
+        break;
+      case 'U':
+        ioUringSqPoll = true;
+        // fall through
+      case 'u':
+        ioUring = true;
+        break;
+      case 'z':
+        compress = true;
+        codecConfig.adaptive = std::string{optarg} == "auto";
+        if (!codecConfig.adaptive &&
+            (!PayloadCodec::parseName(optarg, codecConfig.codec) ||
+             (codecConfig.codec == PayloadCodec::Codec::NONE))) {
+          std::cout << "Unknown codec " << optarg << std::endl;
+          return 1;
+        }
+        break;
+      case 'Z':
+        codecConfig.delta = true;
+        break;
+      case 'n':
+        cameras = static_cast<unsigned>(std::max(std::atoi(optarg), 1));
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
   }
 
-  Logger::debug("Beginning capture\n");
+  if (optind >= argc) {
+    usage(argv[0]);
+    return 1;
+  }
 
-  if (camera.enableCallbacks(encoderCallback) != MMAL_SUCCESS) {
-    Logger::error("Failed to enable callbacks\n");
+  if (video && (synthetic || !replayPaths.empty())) {
+    std::cout << "Video mode needs the camera" << std::endl;
     return 1;
   }
-  Logger::debug("Enabled callbacks\n");
+  if (analysis && (synthetic || !replayPaths.empty())) {
+    std::cout << "The analysis tap needs the camera" << std::endl;
+    return 1;
+  }
+  if (events && (video || !replayPaths.empty())) {
+    std::cout << "Event mode needs stills from the camera or -s" << std::endl;
+    return 1;
+  }
+  if (events && !synthetic) {
+    // Analysed through the tap, at the capture size unless -a says otherwise
+    analysis = true;
+  }
+  if (chunked && video) {
+    std::cout << "Video has its own framing; -c is for stills" << std::endl;
+    return 1;
+  }
+  if (!localPath.empty() && (video || chunked || !spoolDirectory.empty())) {
+    // Readers on the same host only want live stills, and can't drop off
+    // the network
+    std::cout << "-l can't be used with -v, -c or -d" << std::endl;
+    return 1;
+  }
+  if (localFds && localPath.empty()) {
+    std::cout << "-L needs -l" << std::endl;
+    return 1;
+  }
+  if (ioUring && (chunked || !localPath.empty())) {
+    std::cout << "-u and -U are for plain TCP, not -c or -l" << std::endl;
+    return 1;
+  }
+  if (compress && (video || chunked || !localPath.empty())) {
+    // Video is compressed already, chunked frames go out before they're
+    // complete, and local readers don't need it
+    std::cout << "-z can't be used with -v, -c or -l" << std::endl;
+    return 1;
+  }
+  if (codecConfig.delta && (!compress || !spoolDirectory.empty())) {
+    // Spooled frames come back out of order with live ones, and a delta
+    // frame is no use without the one before it
+    std::cout << "-Z needs -z, and can't be used with -d" << std::endl;
+    return 1;
+  }
+  if ((cameras > 1) && video) {
+    // The sender carries one video stream, and SIGUSR1 asks for one clip
+    std::cout << "Video mode drives one camera" << std::endl;
+    return 1;
+  }
+  if ((preEventSeconds > 0.0) && !video) {
+    std::cout << "The pre-event buffer needs video mode" << std::endl;
+    return 1;
+  }
+  if (sensorMode == SM_INVALID) {
+    sensorMode = video ? VIDEO_SENSOR_MODE : SENSOR_MODE;
+  }
+  if (serverPort == 0) {
+    serverPort = video ? VIDEO_SERVER_PORT : SERVER_PORT;
+  }
+
+  int frameCount = std::atoi(argv[optind]);
+  const int nArgs = argc - optind;
+
+  CaptureScheduler::Config schedulerConfig{};
+  // Give auto exposure and white balance time to converge
+  schedulerConfig.initialDelay = std::chrono::seconds{30};
+  schedulerConfig.settleTime = std::chrono::milliseconds{1000};
+  if (synthetic || !replayPaths.empty() || video) {
+    // Nothing to converge, or auto exposure keeps adjusting anyway
+    schedulerConfig.initialDelay = std::chrono::milliseconds{0};
+    schedulerConfig.settleTime = std::chrono::milliseconds{0};
+  }
+  if (nArgs > 1) {
+    schedulerConfig.interval = std::chrono::milliseconds{
+      std::max(std::atoi(argv[optind + 1]), 0)};
+  }
+  if (nArgs > 2) {
+    schedulerConfig.burstCount = std::max(std::atoi(argv[optind + 2]), 1);
+  }
+  if (nArgs > 3) {
+    schedulerConfig.settleTime = std::chrono::milliseconds{
+      std::max(std::atoi(argv[optind + 3]), 0)};
+  }
+
+  Logger::setLogLevel(LogLevel::DEBUG);
+
+  std::thread preEventThread;
+  std::atomic<bool> preEventStop{false};
+  if (preEventSeconds > 0.0) {
+    // Only the trigger thread should see SIGUSR1, and threads inherit the
+    // mask, so block it before starting any
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+  }
+
+  // Video gets a second's worth of queue to ride out short stalls. Clips
+  // from the pre-event buffer come from their own thread, so that can wait
+  // for room rather than drop part of a clip.
+  ImageSender::Config senderConfig{};
+  senderConfig.serverHostname = serverHostname;
+  senderConfig.serverPort = serverPort;
+  senderConfig.queueCapacity = video ? static_cast<size_t>(VIDEO_FPS) : 4;
+  if (events) {
+    // Mostly small Detections messages, with the odd frame or crop among
+    // them
+    senderConfig.queueCapacity = EVENT_QUEUE_CAPACITY;
+  }
+  // Every camera gets the same room
+  senderConfig.queueCapacity *= cameras;
+  senderConfig.overflowPolicy = (preEventSeconds > 0.0)
+    ? ImageSender::OverflowPolicy::BLOCK
+    : ImageSender::OverflowPolicy::DROP_OLDEST;
+  senderConfig.spoolDirectory = spoolDirectory;
+  senderConfig.chunked = chunked;
+  senderConfig.ioUring = ioUring;
+  senderConfig.ioUringSqPoll = ioUringSqPoll;
+  if (!localPath.empty()) {
+    senderConfig.transport = localFds
+      ? ImageSender::Transport::UNIX_FD
+      : ImageSender::Transport::SHM_RING;
+    senderConfig.localPath = localPath;
+    // A slot has to hold the biggest still: uncompressed RGB (the synthetic
+    // PNG is barely more), plus room for the metadata
+    senderConfig.localSlotSize = static_cast<size_t>(
+      SENSOR_MODE_WIDTH[sensorMode]) * SENSOR_MODE_HEIGHT[sensorMode] * 3 +
+      (1 << 20);
+  }
+  // Event mode picks frames after they've been analysed, so those can't be
+  // streamed, and the sender only takes one streamed frame at a time
+  const bool streaming = chunked && !events && (cameras == 1);
+  if (streaming) {
+    // Dropping the oldest piece would only break the frame it belongs to
+    // and let the rest of it through for nothing; dropping the newest
+    // abandons the frame being encoded
+    senderConfig.queueCapacity = STREAM_QUEUE_CAPACITY;
+    senderConfig.overflowPolicy = ImageSender::OverflowPolicy::DROP_NEWEST;
+  }
+  // Shared by every camera's pipeline
+  auto sender = std::make_unique<ImageSender>(senderConfig);
+  // The sender thread keeps trying, so the receiver doesn't have to be up
+  // before the sensor
+  if (!sender->connect()) {
+    Logger::warning("ImageSender failed to connect; will keep trying\n");
+  }
+  if (!sender->start()) {
+    Logger::error("Failed to start ImageSender\n");
+    return 1;
+  }
+
+  Pipeline::Config pipelineConfig{};
+  pipelineConfig.scheduler = schedulerConfig;
+  pipelineConfig.frameCount = static_cast<unsigned>(std::max(frameCount, 0));
+  pipelineConfig.video = video;
+  pipelineConfig.preEventBuffer = preEventSeconds > 0.0;
+  pipelineConfig.preEvent.frameRate = VIDEO_FPS;
+  pipelineConfig.preEvent.seconds = preEventSeconds;
+  pipelineConfig.events = events;
+  pipelineConfig.dispatcher.periodicInterval = fullFrameInterval;
+  pipelineConfig.analyseEncoded = events && synthetic;
+  pipelineConfig.streaming = streaming;
+  pipelineConfig.compress = compress;
+  pipelineConfig.codec = codecConfig;
+  if (events) {
+    pipelineConfig.codec.queueCapacity = EVENT_QUEUE_CAPACITY;
+  }
 
-  //gFrameCaptured = true;
-  while (gFrameCount < frameCount) {
-    // Start the next capture
-    if (camera.enableCapture() != MMAL_SUCCESS) {
-      Logger::error("Failed to enable capture\n");
+  std::vector<std::unique_ptr<Pipeline>> pipelines;
+#ifndef PICAM_NO_MMAL
+  std::vector<Camera*> cameraSources;
+#endif
+  for (unsigned i = 0; i < cameras; i++) {
+    pipelineConfig.sensorId = i;
+    auto pipeline = std::make_unique<Pipeline>(pipelineConfig, *sender);
+
+    std::unique_ptr<FrameSource> source{nullptr};
+#ifndef PICAM_NO_MMAL
+    Camera* camera = nullptr;
+#endif
+    if (!replayPaths.empty()) {
+      FileReplaySource::Config replayConfig{};
+      replayConfig.paths = replayPaths;
+      // Keep going until frame_count frames have been sent
+      replayConfig.loop = true;
+      replayConfig.pacing.frameRate = frameRate;
+      replayConfig.width = SENSOR_MODE_WIDTH[sensorMode];
+      replayConfig.height = SENSOR_MODE_HEIGHT[sensorMode];
+      source = std::make_unique<FileReplaySource>(replayConfig);
+      Logger::info("Sensor %u: replaying %zu files\n", i, replayPaths.size());
+    } else if (synthetic) {
+      SyntheticFrameSource::Config syntheticConfig{};
+      syntheticConfig.sensorMode = sensorMode;
+      syntheticConfig.pacing.frameRate = frameRate;
+      // A different star field for each camera
+      syntheticConfig.seed = i + 1;
+      if (events) {
+        // Raw, so it can be analysed as is
+        syntheticConfig.encoding = SyntheticFrameSource::Encoding::GRAY8;
+      } else if (compress) {
+        // What the camera's raw output would look like
+        syntheticConfig.encoding = SyntheticFrameSource::Encoding::I420;
+      }
+      source = std::make_unique<SyntheticFrameSource>(syntheticConfig);
+      Logger::info("Sensor %u: synthetic source configured. width=%u, "
+                   "height=%u\n", i, source->width(), source->height());
+    } else {
+#ifdef PICAM_NO_MMAL
+      Logger::error("Built without MMAL; use -s or -f\n");
       return 1;
+#else
+      Camera::AnalysisConfig analysisConfig{};
+      analysisConfig.width = analysisWidth;
+      analysisConfig.height = analysisHeight;
+      auto pCamera = openCamera(static_cast<int>(i), sensorMode, video,
+                                analysis ? &analysisConfig : nullptr,
+                                *pipeline);
+      if (!pCamera) {
+        return 1;
+      }
+      camera = pCamera.get();
+      if (video) {
+        Pipeline* target = pipeline.get();
+        if (camera->enableVideoCallbacks([target](H264::AccessUnit&& unit) {
+              target->accessUnit(std::move(unit));
+            }) != MMAL_SUCCESS) {
+          Logger::error("Failed to enable callbacks\n");
+          return 1;
+        }
+      }
+      source = std::move(pCamera);
+#endif
     }
-    Logger::debug("Enabled capture\n");
 
-    gFrameCaptured = false;
+#ifndef PICAM_NO_MMAL
+    cameraSources.push_back(camera);
+#endif
+    pipeline->setSource(std::move(source));
+    pipelines.push_back(std::move(pipeline));
+  }
 
-    // Wait for the callback to be called, indicated a frame has been captured
-    while (!gFrameCaptured) {
-      vcos_sleep(100);
+  //
+  // Now that all the ports are set up, let's capture
+  //
+
+  Logger::debug("Beginning capture\n");
+  for (auto& pipeline : pipelines) {
+    if (!pipeline->start()) {
+      Logger::error("Failed to start sensor %u\n", pipeline->sensorId());
+      return 1;
     }
+  }
+  Logger::debug("Enabled callbacks\n");
 
-    // Wait for the camera to settle
-    vcos_sleep(1000);
+  if (preEventSeconds > 0.0) {
+    preEventThread = std::thread{preEventTrigger, std::ref(*pipelines.front()),
+      std::chrono::microseconds{static_cast<int64_t>(preEventSeconds * 1e6)},
+      std::cref(preEventStop)};
   }
 
-  if (camera.disableCapture() != MMAL_SUCCESS) {
-    Logger::error("Failed to disable capture\n");
+  bool succeeded = true;
+  for (auto& pipeline : pipelines) {
+    succeeded = pipeline->wait() && succeeded;
+  }
+  stopPreEventTrigger(preEventThread, preEventStop);
+  if (!succeeded) {
     return 1;
   }
 
+#ifndef PICAM_NO_MMAL
+  for (unsigned i = 0; i < cameraSources.size(); i++) {
+    Camera* camera = cameraSources[i];
+    if ((camera == nullptr) || (camera->analysisTap() == nullptr)) {
+      continue;
+    }
+    const auto stats = camera->analysisTap()->stats();
+    Logger::info("Sensor %u: analysis tap: %llu raw frames, %llu analysed, "
+                 "%llu dropped\n", i,
+                 static_cast<unsigned long long>(stats.offered),
+                 static_cast<unsigned long long>(stats.delivered),
+                 static_cast<unsigned long long>(stats.dropped +
+                                                 stats.oversized));
+  }
+#endif
+
+  for (const auto& pipeline : pipelines) {
+    pipeline->logStats();
+  }
+
+  // Flush anything still queued
+  sender->stop();
+  {
+    const auto stats = sender->stats();
+    Logger::info("Sent %llu frames, dropped %llu (oldest) + %llu (newest), "
+                 "%llu send failures, queue high water %zu\n",
+                 static_cast<unsigned long long>(stats.sent),
+                 static_cast<unsigned long long>(stats.droppedOldest),
+                 static_cast<unsigned long long>(stats.droppedNewest),
+                 static_cast<unsigned long long>(stats.sendFailures),
+                 stats.queueHighWater);
+    Logger::info("%llu reconnects; spooled %llu frames, backfilled %llu, "
+                 "%llu bytes left in the spool\n",
+                 static_cast<unsigned long long>(stats.reconnects),
+                 static_cast<unsigned long long>(stats.spooled),
+                 static_cast<unsigned long long>(stats.backfilled),
+                 static_cast<unsigned long long>(stats.spoolBytes));
+    if (chunked) {
+      Logger::info("Chunked: %llu acks, %llu bytes resent, %llu frames "
+                   "abandoned\n",
+                   static_cast<unsigned long long>(stats.chunkAcks),
+                   static_cast<unsigned long long>(stats.chunkResentBytes),
+                   static_cast<unsigned long long>(stats.chunkFramesAborted));
+    }
+    if (!localPath.empty()) {
+      Logger::info("%zu local readers still connected\n", stats.localReaders);
+    }
+  }
 
   Logger::debug("Done\n");
   return 0;
@@ -0,0 +1,412 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#ifndef PICAM_NO_LZ4
+#include <lz4.h>
+#endif
+#ifndef PICAM_NO_ZSTD
+#include <zstd.h>
+#endif
+#ifndef PICAM_NO_ZLIB
+#include <zlib.h>
+#endif
+
+#include "payload_codec.hpp"
+
+namespace PayloadCodec {
+
+static const uint8_t MAGIC[4] = {'P', 'C', 'P', 'Z'};
+
+static const char DELTA_SUFFIX[] = "delta";
+
+// Levels for level 0: the fastest each codec has that still compresses
+static const int LZ4_DEFAULT_ACCELERATION = 1;
+static const int ZSTD_DEFAULT_LEVEL = 1;
+static const int DEFLATE_DEFAULT_LEVEL = 1;
+
+static uint8_t* putBE32(uint8_t* p, uint32_t value) {
+  p[0] = static_cast<uint8_t>(value >> 24);
+  p[1] = static_cast<uint8_t>(value >> 16);
+  p[2] = static_cast<uint8_t>(value >> 8);
+  p[3] = static_cast<uint8_t>(value);
+  return p + 4;
+}
+
+static uint32_t getBE32(const uint8_t* p) {
+  return (static_cast<uint32_t>(p[0]) << 24) |
+    (static_cast<uint32_t>(p[1]) << 16) |
+    (static_cast<uint32_t>(p[2]) << 8) |
+    static_cast<uint32_t>(p[3]);
+}
+
+bool available(Codec codec) {
+  switch (codec) {
+    case Codec::NONE:
+      return true;
+    case Codec::LZ4:
+#ifdef PICAM_NO_LZ4
+      return false;
+#else
+      return true;
+#endif
+    case Codec::ZSTD:
+#ifdef PICAM_NO_ZSTD
+      return false;
+#else
+      return true;
+#endif
+    case Codec::DEFLATE:
+#ifdef PICAM_NO_ZLIB
+      return false;
+#else
+      return true;
+#endif
+  }
+  return false;
+}
+
+std::vector<Codec> availableCodecs() {
+  std::vector<Codec> codecs;
+  for (Codec codec : {Codec::LZ4, Codec::ZSTD, Codec::DEFLATE}) {
+    if (available(codec)) {
+      codecs.push_back(codec);
+    }
+  }
+  return codecs;
+}
+
+const char* name(Codec codec) {
+  switch (codec) {
+    case Codec::NONE:
+      return "none";
+    case Codec::LZ4:
+      return "lz4";
+    case Codec::ZSTD:
+      return "zstd";
+    case Codec::DEFLATE:
+      return "deflate";
+  }
+  return "unknown";
+}
+
+bool parseName(const std::string& codecName, Codec& codec) {
+  for (Codec candidate : {Codec::NONE, Codec::LZ4, Codec::ZSTD,
+                          Codec::DEFLATE}) {
+    if (codecName == name(candidate)) {
+      codec = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool isRaw(const std::string& encoding) {
+  return (encoding == "GRAY8") || (encoding == "I420") ||
+    (encoding == "RGB24") || (encoding == "RAW");
+}
+
+std::string encodingFor(const std::string& base, Codec codec, bool delta) {
+  std::string encoding = base;
+  if (delta) {
+    encoding += '+';
+    encoding += DELTA_SUFFIX;
+  }
+  encoding += '+';
+  encoding += name(codec);
+  return encoding;
+}
+
+bool parseEncoding(const std::string& encoding, std::string& base,
+                   Codec& codec, bool& delta) {
+  const size_t codecAt = encoding.rfind('+');
+  if ((codecAt == std::string::npos) || (codecAt == 0) ||
+      !parseName(encoding.substr(codecAt + 1), codec) ||
+      (codec == Codec::NONE)) {
+    return false;
+  }
+  base = encoding.substr(0, codecAt);
+  delta = false;
+  const size_t deltaAt = base.rfind('+');
+  if ((deltaAt != std::string::npos) &&
+      (base.compare(deltaAt + 1, std::string::npos, DELTA_SUFFIX) == 0)) {
+    delta = true;
+    base.resize(deltaAt);
+  }
+  return !base.empty();
+}
+
+size_t blockBound(Codec codec, size_t size) {
+  switch (codec) {
+    case Codec::NONE:
+      return size;
+    case Codec::LZ4:
+#ifndef PICAM_NO_LZ4
+      return LZ4_compressBound(static_cast<int>(size));
+#else
+      return 0;
+#endif
+    case Codec::ZSTD:
+#ifndef PICAM_NO_ZSTD
+      return ZSTD_compressBound(size);
+#else
+      return 0;
+#endif
+    case Codec::DEFLATE:
+#ifndef PICAM_NO_ZLIB
+      return compressBound(static_cast<uLong>(size));
+#else
+      return 0;
+#endif
+  }
+  return 0;
+}
+
+size_t compressBlock(Codec codec, int level, const uint8_t* in, size_t size,
+                     uint8_t* out, size_t capacity) {
+  // Unused when the codecs that need them are compiled out
+  (void) level;
+  (void) in;
+  (void) out;
+  (void) capacity;
+
+  if ((size == 0) || (size > MAX_BLOCK_SIZE)) {
+    return 0;
+  }
+
+  switch (codec) {
+    case Codec::NONE:
+      return 0;
+    case Codec::LZ4: {
+#ifndef PICAM_NO_LZ4
+      const int rc = LZ4_compress_fast(
+        reinterpret_cast<const char*>(in), reinterpret_cast<char*>(out),
+        static_cast<int>(size), static_cast<int>(capacity),
+        (level > 0) ? level : LZ4_DEFAULT_ACCELERATION);
+      return (rc > 0) ? static_cast<size_t>(rc) : 0;
+#else
+      return 0;
+#endif
+    }
+    case Codec::ZSTD: {
+#ifndef PICAM_NO_ZSTD
+      const size_t rc = ZSTD_compress(out, capacity, in, size,
+                                      (level > 0) ? level
+                                                  : ZSTD_DEFAULT_LEVEL);
+      return ZSTD_isError(rc) ? 0 : rc;
+#else
+      return 0;
+#endif
+    }
+    case Codec::DEFLATE: {
+#ifndef PICAM_NO_ZLIB
+      uLongf outSize = static_cast<uLongf>(capacity);
+      const int rc = compress2(out, &outSize, in, static_cast<uLong>(size),
+                               (level > 0) ? level : DEFLATE_DEFAULT_LEVEL);
+      return (rc == Z_OK) ? static_cast<size_t>(outSize) : 0;
+#else
+      return 0;
+#endif
+    }
+  }
+  return 0;
+}
+
+bool decompressBlock(Codec codec, const uint8_t* in, size_t size,
+                     uint8_t* out, size_t rawSize) {
+  (void) in;
+  (void) size;
+  (void) out;
+
+  switch (codec) {
+    case Codec::NONE:
+      return false;
+    case Codec::LZ4: {
+#ifndef PICAM_NO_LZ4
+      const int rc = LZ4_decompress_safe(
+        reinterpret_cast<const char*>(in), reinterpret_cast<char*>(out),
+        static_cast<int>(size), static_cast<int>(rawSize));
+      return (rc >= 0) && (static_cast<size_t>(rc) == rawSize);
+#else
+      return false;
+#endif
+    }
+    case Codec::ZSTD: {
+#ifndef PICAM_NO_ZSTD
+      const size_t rc = ZSTD_decompress(out, rawSize, in, size);
+      return !ZSTD_isError(rc) && (rc == rawSize);
+#else
+      return false;
+#endif
+    }
+    case Codec::DEFLATE: {
+#ifndef PICAM_NO_ZLIB
+      uLongf outSize = static_cast<uLongf>(rawSize);
+      const int rc = uncompress(out, &outSize, in, static_cast<uLong>(size));
+      return (rc == Z_OK) && (outSize == rawSize);
+#else
+      return false;
+#endif
+    }
+  }
+  return false;
+}
+
+void subtract(const uint8_t* in, const uint8_t* reference, uint8_t* out,
+              size_t size) {
+  // Simple enough for the compiler to vectorize
+  for (size_t i = 0; i < size; i++) {
+    out[i] = static_cast<uint8_t>(in[i] - reference[i]);
+  }
+}
+
+void add(const uint8_t* reference, uint8_t* inOut, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    inOut[i] = static_cast<uint8_t>(inOut[i] + reference[i]);
+  }
+}
+
+void encodeHeader(const Header& header, uint8_t* out) {
+  memcpy(out, MAGIC, sizeof(MAGIC));
+  out[4] = VERSION;
+  out[5] = static_cast<uint8_t>(header.codec);
+  out[6] = header.flags;
+  out[7] = 0;
+  uint8_t* p = putBE32(out + 8, header.rawSize);
+  p = putBE32(p, header.blockSize);
+  p = putBE32(p, header.sequence);
+  putBE32(p, header.reference);
+}
+
+bool decodeHeader(const uint8_t* in, size_t size, Header& header) {
+  if ((size < HEADER_SIZE) || (memcmp(in, MAGIC, sizeof(MAGIC)) != 0) ||
+      (in[4] != VERSION)) {
+    return false;
+  }
+  header.codec = static_cast<Codec>(in[5]);
+  header.flags = in[6];
+  header.rawSize = getBE32(in + 8);
+  header.blockSize = getBE32(in + 12);
+  header.sequence = getBE32(in + 16);
+  header.reference = getBE32(in + 20);
+  if ((header.codec == Codec::NONE) || !available(header.codec) ||
+      (header.blockSize == 0) || (header.blockSize > MAX_BLOCK_SIZE)) {
+    return false;
+  }
+  // Every block takes up 4 bytes in the table at least
+  return (size - HEADER_SIZE) / 4 >= header.blockCount();
+}
+
+void putBlockSize(uint32_t size, uint8_t* out) {
+  putBE32(out, size);
+}
+
+uint32_t getBlockSize(const uint8_t* in) {
+  return getBE32(in);
+}
+
+Decoder::Decoder()
+  : mPrevious{}
+  , mPreviousSequence{0}
+  , mHavePrevious{false}
+  , mDecoded{}
+  , mStats{}
+{ }
+
+bool Decoder::decode(const uint8_t* data, size_t size, std::string& out) {
+  Header header{};
+  if (!decodeHeader(data, size, header)) {
+    mStats.errors++;
+    return false;
+  }
+
+  const bool delta = (header.flags & DELTA) != 0;
+  if (delta && (!mHavePrevious || (header.reference != mPreviousSequence) ||
+                (mPrevious.size() != header.rawSize))) {
+    mStats.missingReference++;
+    return false;
+  }
+
+  const uint32_t blockCount = header.blockCount();
+  const uint8_t* sizes = data + HEADER_SIZE;
+  const uint8_t* block = sizes + 4 * static_cast<size_t>(blockCount);
+  const uint8_t* end = data + size;
+  out.resize(header.rawSize);
+  uint8_t* raw = reinterpret_cast<uint8_t*>(&out[0]);
+  for (uint32_t i = 0; i < blockCount; i++) {
+    const size_t offset = static_cast<size_t>(i) * header.blockSize;
+    const size_t rawSize = std::min<size_t>(header.blockSize,
+                                            header.rawSize - offset);
+    const uint32_t sizeField = getBlockSize(sizes + 4 * i);
+    const size_t blockSize = sizeField & ~STORED;
+    if (static_cast<size_t>(end - block) < blockSize) {
+      mStats.errors++;
+      return false;
+    }
+    if (sizeField & STORED) {
+      if (blockSize != rawSize) {
+        mStats.errors++;
+        return false;
+      }
+      memcpy(raw + offset, block, rawSize);
+    } else if (!decompressBlock(header.codec, block, blockSize, raw + offset,
+                                rawSize)) {
+      mStats.errors++;
+      return false;
+    }
+    block += blockSize;
+  }
+
+  if (delta) {
+    add(reinterpret_cast<const uint8_t*>(mPrevious.data()), raw,
+        header.rawSize);
+    mStats.deltaFrames++;
+  } else {
+    mStats.keyFrames++;
+  }
+  mStats.frames++;
+
+  mPrevious = out;
+  mPreviousSequence = header.sequence;
+  mHavePrevious = true;
+  return true;
+}
+
+bool Decoder::decode(Image& image) {
+  std::string base;
+  Codec codec;
+  bool delta;
+  if (!parseEncoding(image.metadata().encoding(), base, codec, delta)) {
+    return true;
+  }
+  if (!decode(reinterpret_cast<const uint8_t*>(image.data().data()),
+              image.data().size(), mDecoded)) {
+    return false;
+  }
+  image.mutable_data()->swap(mDecoded);
+  image.mutable_metadata()->set_encoding(base);
+  return true;
+}
+
+void Decoder::reset() {
+  mPrevious.clear();
+  mHavePrevious = false;
+}
+
+} // namespace PayloadCodec
@@ -0,0 +1,418 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#include "logging.hpp"
+#include "payload_encoder.hpp"
+
+// Compressed frames are assembled in slabs this big
+static const size_t ENCODED_SLAB_SIZE = 1 << 20;
+static const size_t ENCODED_INITIAL_SLABS = 4;
+
+// Weight of the newest sample in the running averages
+static const double SMOOTHING = 0.25;
+
+// Link throughput is worked out over at least this much time spent sending,
+// so one quick write into an empty socket buffer doesn't count for much
+static const uint64_t LINK_SAMPLE_US = 50000;
+
+static const double UNLIMITED = std::numeric_limits<double>::infinity();
+
+static double smooth(double average, double sample) {
+  return (average > 0.0) ? average + SMOOTHING * (sample - average) : sample;
+}
+
+
+PayloadEncoder::PayloadEncoder(const Config& config, Sink sink,
+                               LinkMonitor monitor)
+  : mConfig(config)
+  , mSink{std::move(sink)}
+  , mMonitor{std::move(monitor)}
+  , mQueue{config.queueCapacity}
+  , mThread{}
+  , mRunning{false}
+  , mWaitMutex{}
+  , mReadyCv{}
+  , mWaiting{false}
+  , mPool{config.threads}
+  , mAssembler{ENCODED_SLAB_SIZE, ENCODED_INITIAL_SLABS}
+  , mCandidates{}
+  , mCurrent{0}
+  , mSequence{0}
+  , mFrame{}
+  , mPrevious{}
+  , mPreviousEncoding{}
+  , mHavePrevious{false}
+  , mSinceKey{0}
+  , mForceKey{false}
+  , mDelta{}
+  , mBlocks{}
+  , mBlockSizes{}
+  , mTable{}
+  , mRawFrames{0}
+  , mLastFrame{}
+  , mInputRate{0.0}
+  , mLink{}
+  , mLinkRate{0.0}
+  , mEnqueued{0}
+  , mEncoded{0}
+  , mPassed{0}
+  , mDropped{0}
+  , mKeyFrames{0}
+  , mDeltaFrames{0}
+  , mRawBytes{0}
+  , mEncodedBytes{0}
+  , mEncodeUs{0}
+  , mSwitches{0}
+  , mChoice{0}
+  , mLinkRateOut{0.0}
+  , mInputRateOut{0.0}
+{
+  if (!mConfig.adaptive) {
+    mCandidates.push_back(Candidate{mConfig.codec, mConfig.delta, 0.0, 0.0, 0});
+    return;
+  }
+
+  // Not compressing at all costs nothing and saves nothing
+  mCandidates.push_back(Candidate{PayloadCodec::Codec::NONE, false, 1.0,
+                                  UNLIMITED, 0});
+  for (PayloadCodec::Codec codec : PayloadCodec::availableCodecs()) {
+    mCandidates.push_back(Candidate{codec, false, 0.0, 0.0, 0});
+    if (mConfig.delta) {
+      mCandidates.push_back(Candidate{codec, true, 0.0, 0.0, 0});
+    }
+  }
+}
+
+PayloadEncoder::~PayloadEncoder() {
+  stop();
+}
+
+bool PayloadEncoder::start() {
+  if (mRunning.load()) {
+    return false;
+  }
+  if (!mConfig.adaptive &&
+      ((mConfig.codec == PayloadCodec::Codec::NONE) ||
+       !PayloadCodec::available(mConfig.codec))) {
+    Logger::error(__func__, "Built without %s\n",
+                  PayloadCodec::name(mConfig.codec));
+    return false;
+  }
+
+  if (mMonitor) {
+    mLink = mMonitor();
+  }
+  mRunning.store(true);
+  mThread = std::thread{&PayloadEncoder::run, this};
+  return true;
+}
+
+void PayloadEncoder::stop() {
+  if (!mRunning.exchange(false)) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock{mWaitMutex};
+    mReadyCv.notify_all();
+  }
+  mThread.join();
+}
+
+bool PayloadEncoder::enqueue(QueuedImage&& image) {
+  mEnqueued.fetch_add(1, std::memory_order_relaxed);
+  if (!mQueue.tryPush(std::move(image))) {
+    mDropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  // Only take the lock if the encoder thread is (about to be) asleep. The
+  // fence pairs with the one in run().
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (mWaiting.load()) {
+    std::lock_guard<std::mutex> lock{mWaitMutex};
+    mReadyCv.notify_one();
+  }
+  return true;
+}
+
+PayloadEncoder::Stats PayloadEncoder::stats() const {
+  const Candidate& choice = mCandidates[mChoice.load()];
+  Stats stats{};
+  stats.enqueued = mEnqueued.load(std::memory_order_relaxed);
+  stats.encoded = mEncoded.load(std::memory_order_relaxed);
+  stats.passed = mPassed.load(std::memory_order_relaxed);
+  stats.dropped = mDropped.load(std::memory_order_relaxed);
+  stats.keyFrames = mKeyFrames.load(std::memory_order_relaxed);
+  stats.deltaFrames = mDeltaFrames.load(std::memory_order_relaxed);
+  stats.rawBytes = mRawBytes.load(std::memory_order_relaxed);
+  stats.encodedBytes = mEncodedBytes.load(std::memory_order_relaxed);
+  stats.encodeUs = mEncodeUs.load(std::memory_order_relaxed);
+  stats.switches = mSwitches.load(std::memory_order_relaxed);
+  stats.codec = choice.codec;
+  stats.delta = choice.delta;
+  stats.linkRate = mLinkRateOut.load();
+  stats.inputRate = mInputRateOut.load();
+  return stats;
+}
+
+void PayloadEncoder::run() {
+  for (;;) {
+    QueuedImage image{};
+    if (mQueue.tryPop(image)) {
+      process(image);
+      continue;
+    }
+
+    // Drain the queue before exiting
+    if (!mRunning.load()) {
+      break;
+    }
+
+    std::unique_lock<std::mutex> lock{mWaitMutex};
+    mWaiting.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    mReadyCv.wait(lock, [this] {
+      return !mQueue.empty() || !mRunning.load();
+    });
+    mWaiting.store(false);
+  }
+}
+
+void PayloadEncoder::process(QueuedImage& image) {
+  if (image.isVideo || image.isChunk || !image.frame ||
+      (image.frame->size() < mConfig.minSize) ||
+      (image.frame->size() > std::numeric_limits<uint32_t>::max()) ||
+      !PayloadCodec::isRaw(image.metadata.encoding())) {
+    pass(image);
+    return;
+  }
+
+  const auto now = Clock::now();
+  if (mRawFrames > 0) {
+    const double elapsed =
+      std::chrono::duration<double>(now - mLastFrame).count();
+    if (elapsed > 0.0) {
+      mInputRate = smooth(mInputRate, image.frame->size() / elapsed);
+      mInputRateOut.store(mInputRate);
+    }
+  }
+  mLastFrame = now;
+  mRawFrames++;
+  sampleLink();
+
+  const Candidate& candidate = mCandidates[mConfig.adaptive ? choose() : 0];
+  if (candidate.codec == PayloadCodec::Codec::NONE) {
+    pass(image);
+    return;
+  }
+  encode(image, candidate);
+}
+
+void PayloadEncoder::sampleLink() {
+  if (!mMonitor) {
+    return;
+  }
+  const LinkStats link = mMonitor();
+  if (link.dropped != mLink.dropped) {
+    // A frame after the dropped one may refer to it
+    mForceKey = true;
+    mLink.dropped = link.dropped;
+  }
+
+  const uint64_t busyUs = link.busyUs - mLink.busyUs;
+  if (busyUs < LINK_SAMPLE_US) {
+    return;
+  }
+  const double rate = (link.bytesSent - mLink.bytesSent) * 1e6 / busyUs;
+  mLinkRate = smooth(mLinkRate, rate);
+  mLinkRateOut.store(mLinkRate);
+  mLink = link;
+}
+
+size_t PayloadEncoder::choose() {
+  // Only candidates that have been tried are chosen; the rest get tried
+  // first, then whichever hasn't been for longest, every probeInterval
+  // frames. Delta candidates can only be tried against a previous frame.
+  size_t probe = 0;
+  for (size_t i = 1; i < mCandidates.size(); i++) {
+    const Candidate& candidate = mCandidates[i];
+    if ((candidate.speed == 0.0) && (!candidate.delta || mHavePrevious)) {
+      probe = i;
+      break;
+    }
+  }
+  if ((probe == 0) && (mConfig.probeInterval > 0) &&
+      (mRawFrames % mConfig.probeInterval == 0)) {
+    for (size_t i = 1; i < mCandidates.size(); i++) {
+      if ((probe == 0) ||
+          (mCandidates[i].lastUsed < mCandidates[probe].lastUsed)) {
+        probe = i;
+      }
+    }
+  }
+
+  // The cheapest candidate that keeps up with the frames coming in, or if
+  // none does, the one that comes closest
+  const double needed = mInputRate * mConfig.headroom;
+  const double link = (mLinkRate > 0.0) ? mLinkRate : UNLIMITED;
+  size_t cheapest = mCandidates.size();
+  size_t fastest = 0;
+  double fastestRate = 0.0;
+  for (size_t i = 0; i < mCandidates.size(); i++) {
+    const Candidate& candidate = mCandidates[i];
+    if (candidate.speed == 0.0) {
+      continue;
+    }
+    const double rate = std::min(candidate.speed, link / candidate.ratio);
+    if ((rate >= needed) && ((cheapest == mCandidates.size()) ||
+                             (candidate.speed > mCandidates[cheapest].speed))) {
+      cheapest = i;
+    }
+    if (rate > fastestRate) {
+      fastest = i;
+      fastestRate = rate;
+    }
+  }
+  const size_t best = (cheapest < mCandidates.size()) ? cheapest : fastest;
+  if (best != mCurrent) {
+    Logger::debug(__func__, "Switching to %s%s: link %.0f B/s, frames "
+                  "%.0f B/s\n", PayloadCodec::name(mCandidates[best].codec),
+                  mCandidates[best].delta ? "+delta" : "", mLinkRate,
+                  mInputRate);
+    mCurrent = best;
+    mChoice.store(best);
+    mSwitches.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  const size_t choice = (probe != 0) ? probe : mCurrent;
+  mCandidates[choice].lastUsed = mRawFrames;
+  return choice;
+}
+
+void PayloadEncoder::pass(QueuedImage& image) {
+  mPassed.fetch_add(1, std::memory_order_relaxed);
+  mSink(std::move(image));
+}
+
+void PayloadEncoder::encode(QueuedImage& image, const Candidate& candidate) {
+  using namespace PayloadCodec;
+
+  const auto started = Clock::now();
+  image.frame->copyTo(mFrame);
+  const size_t rawSize = mFrame.size();
+  const std::string& encoding = image.metadata.encoding();
+  const bool delta = candidate.delta && mHavePrevious && !mForceKey &&
+    ((mConfig.keyInterval == 0) || (mSinceKey + 1 < mConfig.keyInterval)) &&
+    (mPrevious.size() == rawSize) && (mPreviousEncoding == encoding);
+
+  const size_t blockSize = std::min<size_t>(
+    std::max<size_t>(mConfig.blockSize, 1), MAX_BLOCK_SIZE);
+  const size_t blockCount = (rawSize + blockSize - 1) / blockSize;
+  const size_t bound = blockBound(candidate.codec, blockSize);
+  const uint8_t* in = reinterpret_cast<const uint8_t*>(mFrame.data());
+  const uint8_t* previous = reinterpret_cast<const uint8_t*>(mPrevious.data());
+  if (delta) {
+    mDelta.resize(rawSize);
+  }
+  mBlocks.resize(std::max(mBlocks.size(), blockCount));
+  mBlockSizes.resize(blockCount);
+
+  // Blocks don't depend on each other, delta included
+  mPool.run(blockCount, [&](size_t i) {
+    const size_t offset = i * blockSize;
+    const size_t size = std::min(blockSize, rawSize - offset);
+    const uint8_t* src = in + offset;
+    if (delta) {
+      subtract(src, previous + offset, &mDelta[offset], size);
+      src = &mDelta[offset];
+    }
+    std::vector<uint8_t>& out = mBlocks[i];
+    if (out.size() < bound) {
+      out.resize(bound);
+    }
+    const size_t compressed = compressBlock(candidate.codec, mConfig.level,
+                                            src, size, out.data(), out.size());
+    mBlockSizes[i] = ((compressed == 0) || (compressed >= size))
+      ? static_cast<uint32_t>(size) | STORED
+      : static_cast<uint32_t>(compressed);
+  });
+
+  Header header{};
+  header.codec = candidate.codec;
+  header.flags = delta ? DELTA : 0;
+  header.rawSize = static_cast<uint32_t>(rawSize);
+  header.blockSize = static_cast<uint32_t>(blockSize);
+  header.sequence = mSequence;
+  header.reference = delta ? mSequence - 1 : 0;
+  mTable.resize(HEADER_SIZE + 4 * blockCount);
+  encodeHeader(header, mTable.data());
+  for (size_t i = 0; i < blockCount; i++) {
+    putBlockSize(mBlockSizes[i], &mTable[HEADER_SIZE + 4 * i]);
+  }
+
+  mAssembler.append(mTable.data(), mTable.size());
+  for (size_t i = 0; i < blockCount; i++) {
+    if (mBlockSizes[i] & STORED) {
+      const size_t offset = i * blockSize;
+      mAssembler.append(delta ? &mDelta[offset] : in + offset,
+                        mBlockSizes[i] & ~STORED);
+    } else {
+      mAssembler.append(mBlocks[i].data(), mBlockSizes[i]);
+    }
+  }
+  FramePtr encoded = mAssembler.finish();
+
+  const double elapsed =
+    std::chrono::duration<double>(Clock::now() - started).count();
+  mEncodeUs.fetch_add(static_cast<uint64_t>(elapsed * 1e6),
+                      std::memory_order_relaxed);
+  mEncoded.fetch_add(1, std::memory_order_relaxed);
+  mRawBytes.fetch_add(rawSize, std::memory_order_relaxed);
+  mEncodedBytes.fetch_add(encoded->size(), std::memory_order_relaxed);
+  (delta ? mDeltaFrames : mKeyFrames).fetch_add(1, std::memory_order_relaxed);
+
+  // What was done (a key frame, when a delta candidate couldn't have one)
+  // is what the figures are for
+  for (Candidate& done : mCandidates) {
+    if ((done.codec == candidate.codec) && (done.delta == delta)) {
+      done.ratio = smooth(done.ratio,
+                          static_cast<double>(encoded->size()) / rawSize);
+      if (elapsed > 0.0) {
+        done.speed = smooth(done.speed, rawSize / elapsed);
+      }
+      break;
+    }
+  }
+
+  // Keep this frame to diff the next one against
+  mPreviousEncoding = encoding;
+  image.metadata.set_encoding(encodingFor(encoding, candidate.codec, delta));
+  image.frame = std::move(encoded);
+  std::swap(mFrame, mPrevious);
+  mHavePrevious = true;
+  mSinceKey = delta ? mSinceKey + 1 : 0;
+  mForceKey = false;
+  mSequence++;
+
+  if (!mSink(std::move(image))) {
+    mForceKey = true;
+  }
+}
@@ -0,0 +1,362 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "image_metadata.hpp"
+#include "logging.hpp"
+#include "pipeline.hpp"
+#include "video_framing.hpp"
+
+// Streamed frames are queued an encoder buffer at a time
+static const size_t STREAM_PIECE_SIZE = 81920;
+static const size_t STREAM_INITIAL_PIECES = 64;
+
+// Clips are copied out of the pre-event buffer into slabs this big
+static const size_t PRE_EVENT_SLAB_SIZE = 1 << 20;
+
+// Without event mode, every this many pixels, in both directions, go into
+// the brightness figure logged for each raw frame
+static const uint32_t ANALYSIS_SAMPLE_STEP = 8;
+
+
+Pipeline::Pipeline(const Config& config, ImageSender& sender)
+  : mConfig(config)
+  , mSender(sender)
+  , mSource{nullptr}
+  , mScheduler{config.scheduler, [this] {
+      if (mConfig.video && mCapturing) {
+        // Video keeps capturing; the scheduler just counts frames
+        return true;
+      }
+      Logger::debug("Sensor %u: enabling capture\n", mConfig.sensorId);
+      mCapturing = mSource->requestCapture();
+      return mCapturing;
+    }}
+  , mCapturing{false}
+  , mThread{}
+  , mSucceeded{false}
+  , mStreamer{nullptr}
+  , mEncoder{nullptr}
+  , mPreEventBuffer{nullptr}
+  , mAnalysisPool{nullptr}
+  , mSkyAnalyser{nullptr}
+  , mDispatcher{nullptr}
+  , mResult{}
+  , mLuma{}
+  , mLumaSequence{0}
+  , mVideoIndex{0}
+  , mClipAssembler{PRE_EVENT_SLAB_SIZE, 0}
+{
+  if (mConfig.streaming) {
+    mStreamer = std::make_unique<FrameStreamer>(mSender, STREAM_PIECE_SIZE,
+                                                STREAM_INITIAL_PIECES);
+  }
+
+  if (mConfig.compress) {
+    ImageSender& shared = mSender;
+    mEncoder = std::make_unique<PayloadEncoder>(mConfig.codec,
+      [&shared](QueuedImage&& image) {
+        return shared.enqueue(std::move(image));
+      },
+      [&shared] {
+        // The link is shared, so this is the share every pipeline gets
+        const auto stats = shared.stats();
+        return PayloadEncoder::LinkStats{stats.bytesSent, stats.sendBusyUs,
+          stats.droppedOldest + stats.droppedNewest + stats.sendFailures};
+      });
+  }
+
+  if (mConfig.video && mConfig.preEventBuffer) {
+    mPreEventBuffer = std::make_unique<PreEventBuffer>(mConfig.preEvent);
+    Logger::info("Sensor %u: pre-event buffer: %.1f s in %zu bytes\n",
+                 mConfig.sensorId, mConfig.preEvent.seconds,
+                 PreEventBuffer::arenaSizeFor(mConfig.preEvent));
+  }
+
+  if (mConfig.events) {
+    mAnalysisPool = std::make_unique<WorkerPool>();
+    mSkyAnalyser = std::make_unique<SkyAnalyser>(SkyAnalyser::Config{},
+                                                 mAnalysisPool.get());
+    mDispatcher = std::make_unique<EventDispatcher>(mConfig.dispatcher,
+      [this](QueuedImage&& image) {
+        return send(std::move(image));
+      });
+  }
+}
+
+Pipeline::~Pipeline() {
+  stop();
+  wait();
+}
+
+void Pipeline::setSource(std::unique_ptr<FrameSource> source) {
+  mSource = std::move(source);
+}
+
+bool Pipeline::start() {
+  if (!mSource || mThread.joinable()) {
+    return false;
+  }
+  if (mEncoder && !mEncoder->start()) {
+    Logger::error("Sensor %u: failed to start the payload encoder\n",
+                  mConfig.sensorId);
+    return false;
+  }
+
+  // Video comes in through accessUnit(), which the caller has set up
+  if (!mConfig.video) {
+    if (mStreamer) {
+      mSource->setStream(mStreamer.get());
+    }
+    if (!mSource->start([this](FrameSource& source, const FramePtr& frame) {
+          return frameEncoded(source, frame);
+        })) {
+      Logger::error("Sensor %u: failed to start the frame source\n",
+                    mConfig.sensorId);
+      return false;
+    }
+  }
+
+  mThread = std::thread{&Pipeline::run, this};
+  return true;
+}
+
+bool Pipeline::wait() {
+  if (mThread.joinable()) {
+    mThread.join();
+  }
+  return mSucceeded;
+}
+
+void Pipeline::stop() {
+  mScheduler.stop();
+}
+
+void Pipeline::run() {
+  bool succeeded = mScheduler.run(mConfig.frameCount);
+  if (!succeeded) {
+    Logger::error("Sensor %u: capture stopped after %u frames\n",
+                  mConfig.sensorId, mScheduler.framesCaptured());
+  }
+  if (!mSource->stop()) {
+    Logger::error("Sensor %u: failed to stop frame source\n",
+                  mConfig.sensorId);
+    succeeded = false;
+  }
+  // Whatever's still being compressed goes to the sender
+  if (mEncoder) {
+    mEncoder->stop();
+  }
+  mSucceeded = succeeded;
+}
+
+bool Pipeline::send(QueuedImage&& image) {
+  return mEncoder ? mEncoder->enqueue(std::move(image))
+                  : mSender.enqueue(std::move(image));
+}
+
+size_t Pipeline::frameEncoded(FrameSource& source, const FramePtr& frame) {
+  QueuedImage image{};
+  fillImageMetadata(image.metadata, source);
+  image.metadata.set_sensor_id(mConfig.sensorId);
+  image.frame = frame;
+
+  // Let the scheduler start the next capture while this one is being sent
+  mScheduler.frameCaptured();
+
+  if (mStreamer) {
+    // The frame itself is on its way already
+    mStreamer->finish(image.metadata);
+    return frame->size();
+  }
+
+  if (mDispatcher) {
+    // Held until its analysis says whether to send it
+    mDispatcher->frameEncoded(frame->pts(), std::move(image));
+    if (mConfig.analyseEncoded) {
+      analyseEncoded(frame);
+    }
+    return frame->size();
+  }
+
+  // Hand the frame to the sender thread so a slow uplink can't stall the
+  // encoder
+  send(std::move(image));
+
+  return frame->size();
+}
+
+void Pipeline::accessUnit(H264::AccessUnit&& unit) {
+  // Parameter sets on their own don't count as a frame
+  if (unit.hasPicture) {
+    mScheduler.frameCaptured();
+  }
+
+  if (mPreEventBuffer) {
+    // Held until something asks for a clip
+    mPreEventBuffer->push(unit);
+    return;
+  }
+
+  QueuedImage item{};
+  item.isVideo = true;
+  item.videoHeader = VideoFraming::headerFor(unit, mVideoIndex++);
+  item.frame = std::move(unit.data);
+
+  mSender.enqueue(std::move(item));
+}
+
+void Pipeline::frameAnalysed(const RawFrame& frame) {
+  if (mDispatcher) {
+    analyse(frame);
+    return;
+  }
+
+  // Stand-in for on-sensor analysis: log the mean brightness
+  uint64_t sum = 0;
+  uint64_t count = 0;
+  for (uint32_t y = 0; y < frame.height; y += ANALYSIS_SAMPLE_STEP) {
+    const uint8_t* row = frame.luma() + static_cast<size_t>(y) * frame.stride;
+    for (uint32_t x = 0; x < frame.width; x += ANALYSIS_SAMPLE_STEP) {
+      sum += row[x];
+      count++;
+    }
+  }
+  Logger::debug(__func__, "Sensor %u: raw frame %llu (%ux%u, pts %lld): "
+                "mean luma %.1f\n", mConfig.sensorId,
+                static_cast<unsigned long long>(frame.sequence), frame.width,
+                frame.height, static_cast<long long>(frame.pts),
+                count > 0 ? static_cast<double>(sum) / count : 0.0);
+}
+
+size_t Pipeline::sendClip(std::chrono::microseconds duration) {
+  if (!mPreEventBuffer) {
+    return 0;
+  }
+  auto clip = mPreEventBuffer->extract(duration, mClipAssembler);
+  if (clip.empty()) {
+    return 0;
+  }
+
+  // Skip an index, so the receiver sees where one clip ends and the next
+  // begins
+  mVideoIndex++;
+  for (auto& unit : clip) {
+    QueuedImage item{};
+    item.isVideo = true;
+    item.videoHeader = VideoFraming::headerFor(unit, mVideoIndex++);
+    item.frame = std::move(unit.data);
+    mSender.enqueue(std::move(item));
+  }
+  return clip.size();
+}
+
+/**
+ * Find stars and streaks in a raw frame and let the dispatcher decide what
+ * to send for it.
+ */
+void Pipeline::analyse(const RawFrame& frame) {
+  Plane<const uint8_t> luma{frame.luma(), frame.width, frame.height,
+                            frame.stride};
+  if (!mSkyAnalyser->analyse(luma, mResult)) {
+    return;
+  }
+
+  Image::Metadata metadata{};
+  fillImageMetadata(metadata, *mSource);
+  metadata.set_sensor_id(mConfig.sensorId);
+  mDispatcher->frameAnalysed(frame, mResult, metadata);
+  Logger::debug(__func__, "Sensor %u: frame %llu: %zu stars, %zu streaks, "
+                "background %.1f +/- %.1f\n", mConfig.sensorId,
+                static_cast<unsigned long long>(frame.sequence),
+                mResult.stars.size(), mResult.streaks.size(),
+                mResult.background, mResult.rms);
+}
+
+/**
+ * GRAY8 frames are raw already, so analyse them as they come rather than
+ * through an analysis tap.
+ */
+void Pipeline::analyseEncoded(const FramePtr& frame) {
+  frame->copyTo(mLuma);
+  const uint32_t width = mSource->width();
+  const uint32_t height = mSource->height();
+  if (mLuma.size() < static_cast<size_t>(width) * height) {
+    Logger::warning(__func__, "Sensor %u: frame is %zu bytes, not %ux%u\n",
+                    mConfig.sensorId, mLuma.size(), width, height);
+    return;
+  }
+
+  RawFrame raw{};
+  raw.width = width;
+  raw.height = height;
+  raw.stride = width;
+  raw.sliceHeight = height;
+  raw.pts = frame->pts();
+  raw.sequence = mLumaSequence++;
+  raw.data = reinterpret_cast<const uint8_t*>(mLuma.data());
+  raw.size = mLuma.size();
+  analyse(raw);
+}
+
+void Pipeline::logStats() const {
+  const uint32_t id = mConfig.sensorId;
+
+  if (mDispatcher) {
+    const auto stats = mDispatcher->stats();
+    Logger::info("Sensor %u: event mode: %llu frames analysed, %llu sent in "
+                 "full, %llu crops, %llu bytes\n", id,
+                 static_cast<unsigned long long>(stats.analysed),
+                 static_cast<unsigned long long>(stats.fullFrames),
+                 static_cast<unsigned long long>(stats.crops),
+                 static_cast<unsigned long long>(stats.bytes));
+  }
+
+  if (mPreEventBuffer) {
+    const auto stats = mPreEventBuffer->stats();
+    Logger::info("Sensor %u: pre-event buffer held %zu units, %zu bytes; "
+                 "%llu evicted, %llu too big\n", id,
+                 stats.units, stats.bytesUsed,
+                 static_cast<unsigned long long>(stats.evicted),
+                 static_cast<unsigned long long>(stats.rejected));
+  }
+
+  if (mStreamer) {
+    const auto stats = mStreamer->stats();
+    Logger::info("Sensor %u: streamed %llu frames in %llu pieces, %llu "
+                 "bytes; %llu pieces dropped, %zu allocated\n", id,
+                 static_cast<unsigned long long>(stats.frames),
+                 static_cast<unsigned long long>(stats.pieces),
+                 static_cast<unsigned long long>(stats.bytes),
+                 static_cast<unsigned long long>(stats.dropped),
+                 stats.piecesAllocated);
+  }
+
+  if (mEncoder) {
+    const auto stats = mEncoder->stats();
+    Logger::info("Sensor %u: payload codec: %llu frames compressed (%llu "
+                 "key, %llu delta), %llu passed through, %llu dropped; %llu "
+                 "bytes down to %llu; last choice %s%s\n", id,
+                 static_cast<unsigned long long>(stats.encoded),
+                 static_cast<unsigned long long>(stats.keyFrames),
+                 static_cast<unsigned long long>(stats.deltaFrames),
+                 static_cast<unsigned long long>(stats.passed),
+                 static_cast<unsigned long long>(stats.dropped),
+                 static_cast<unsigned long long>(stats.rawBytes),
+                 static_cast<unsigned long long>(stats.encodedBytes),
+                 PayloadCodec::name(stats.codec), stats.delta ? "+delta" : "");
+  }
+}
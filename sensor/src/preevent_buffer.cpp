@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "preevent_buffer.hpp"
+
+static int64_t nowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+PreEventBuffer::PreEventBuffer(const Config& config)
+  : mMutex{}
+  , mArena{new uint8_t[arenaSizeFor(config)]}
+  , mArenaSize{arenaSizeFor(config)}
+  , mHead{0}
+  , mBytesUsed{0}
+  , mEntries(std::max<size_t>(
+        static_cast<size_t>(std::ceil(config.frameRate * config.seconds *
+                                      config.headroom)), 2))
+  , mFirst{0}
+  , mNext{0}
+  , mKeyframes(mEntries.size())
+  , mKeyframeStart{0}
+  , mKeyframeCount{0}
+  , mConfig{}
+  , mConfigSize{0}
+  , mPushed{0}
+  , mEvicted{0}
+  , mRejected{0}
+{
+  // Touch the arena now so page faults don't land on the encoder callback
+  memset(mArena.get(), 0, mArenaSize);
+}
+
+size_t PreEventBuffer::arenaSizeFor(const Config& config) {
+  const double bytes = config.bitrate / 8.0 * config.seconds * config.headroom;
+  return std::max<size_t>(static_cast<size_t>(bytes), 1);
+}
+
+bool PreEventBuffer::push(const H264::AccessUnit& unit) {
+  const size_t size = unit.data ? unit.data->size() : 0;
+
+  std::lock_guard<std::mutex> lock{mMutex};
+  mPushed++;
+  if ((size == 0) || (size > mArenaSize)) {
+    mRejected++;
+    return false;
+  }
+
+  if (unit.config && !unit.hasPicture && (size <= MAX_CONFIG_SIZE)) {
+    size_t offset = 0;
+    for (const auto& chunk : unit.data->chunks()) {
+      memcpy(mConfig + offset, chunk.data, chunk.size);
+      offset += chunk.size;
+    }
+    mConfigSize = size;
+  }
+
+  if (mNext - mFirst == mEntries.size()) {
+    evictOldest();
+  }
+
+  const size_t offset = reserve(size);
+  size_t pos = offset;
+  for (const auto& chunk : unit.data->chunks()) {
+    memcpy(&mArena[pos], chunk.data, chunk.size);
+    pos += chunk.size;
+  }
+  mHead = offset + size;
+  mBytesUsed += size;
+
+  Entry& e = mEntries[mNext % mEntries.size()];
+  e.offset = offset;
+  e.size = size;
+  e.ptsUs = unit.ptsUs;
+  e.timeUs = (unit.ptsUs != H264::PTS_UNKNOWN) ? unit.ptsUs : nowUs();
+  e.hasPicture = unit.hasPicture;
+  e.keyframe = unit.keyframe;
+  e.config = unit.config;
+
+  if (unit.keyframe) {
+    // Can't overflow: there are never more keyframes than entries
+    mKeyframes[(mKeyframeStart + mKeyframeCount) % mKeyframes.size()] = mNext;
+    mKeyframeCount++;
+  }
+  mNext++;
+  return true;
+}
+
+size_t PreEventBuffer::reserve(size_t size) {
+  for (;;) {
+    if (mFirst == mNext) {
+      // Empty: start over at the beginning
+      mHead = 0;
+      return 0;
+    }
+
+    const size_t tail = entry(mFirst).offset;
+    if (mHead > tail) {
+      // Live data is [tail, mHead); free space is after it and before it
+      if (size <= mArenaSize - mHead) {
+        return mHead;
+      }
+      if (size <= tail) {
+        return 0;
+      }
+    } else if (size <= tail - mHead) {
+      // Live data wraps: [tail, end of the last unit before 0) + [0, mHead)
+      return mHead;
+    }
+
+    evictOldest();
+  }
+}
+
+void PreEventBuffer::evictOldest() {
+  const Entry& e = entry(mFirst);
+  mBytesUsed -= e.size;
+  if ((mKeyframeCount > 0) && (mKeyframes[mKeyframeStart] == mFirst)) {
+    mKeyframeStart = (mKeyframeStart + 1) % mKeyframes.size();
+    mKeyframeCount--;
+  }
+  mFirst++;
+  mEvicted++;
+}
+
+std::vector<H264::AccessUnit> PreEventBuffer::extract(
+    std::chrono::microseconds duration, FrameAssembler& assembler) const {
+  std::vector<H264::AccessUnit> clip;
+
+  std::lock_guard<std::mutex> lock{mMutex};
+  if (mKeyframeCount == 0) {
+    return clip;
+  }
+
+  // Latest keyframe at or before the cutoff; the keyframe index is in time
+  // order, so binary search it
+  const int64_t cutoff = entry(mNext - 1).timeUs - duration.count();
+  auto keyframeAt = [this](size_t i) {
+    return mKeyframes[(mKeyframeStart + i) % mKeyframes.size()];
+  };
+  size_t lo = 0;
+  size_t hi = mKeyframeCount;
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    if (entry(keyframeAt(mid)).timeUs <= cutoff) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  uint64_t start = keyframeAt((lo > 0) ? lo - 1 : 0);
+
+  clip.reserve(mNext - start + 1);
+  const Entry& keyframe = entry(start);
+  if ((start > mFirst) && entry(start - 1).config &&
+      !entry(start - 1).hasPicture) {
+    // Parameter sets sent just before the keyframe
+    start--;
+  } else if (!keyframe.config && (mConfigSize > 0)) {
+    H264::AccessUnit config{};
+    assembler.append(mConfig, mConfigSize);
+    config.data = assembler.finish();
+    config.ptsUs = keyframe.ptsUs;
+    config.hasPicture = false;
+    config.keyframe = false;
+    config.config = true;
+    clip.push_back(std::move(config));
+  }
+
+  for (uint64_t sequence = start; sequence < mNext; sequence++) {
+    const Entry& e = entry(sequence);
+    H264::AccessUnit unit{};
+    assembler.append(&mArena[e.offset], e.size);
+    unit.data = assembler.finish();
+    unit.ptsUs = e.ptsUs;
+    unit.hasPicture = e.hasPicture;
+    unit.keyframe = e.keyframe;
+    unit.config = e.config;
+    clip.push_back(std::move(unit));
+  }
+  return clip;
+}
+
+PreEventBuffer::Stats PreEventBuffer::stats() const {
+  std::lock_guard<std::mutex> lock{mMutex};
+  Stats stats{};
+  stats.units = mNext - mFirst;
+  stats.keyframes = mKeyframeCount;
+  stats.bytesUsed = mBytesUsed;
+  stats.arenaSize = mArenaSize;
+  stats.pushed = mPushed;
+  stats.evicted = mEvicted;
+  stats.rejected = mRejected;
+  return stats;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sensor_mode.hpp"
+
+
+const unsigned int SENSOR_MODE_WIDTH[NUM_SENSOR_MODES] {
+  0,
+  1920,
+  3280,
+  3280,
+  1640,
+  1640,
+  1282,
+  640,
+};
+
+const unsigned int SENSOR_MODE_HEIGHT[NUM_SENSOR_MODES] {
+  0,
+  1080,
+  2464,
+  2464,
+  1232,
+  922,
+  720,
+  480,
+};
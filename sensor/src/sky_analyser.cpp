@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+
+#include "sky_analyser.hpp"
+
+
+static ComponentLabeller::Config labellerConfig(
+    const SkyAnalyser::Config& config) {
+  ComponentLabeller::Config labeller{};
+  labeller.minArea = config.minArea;
+  labeller.eightConnected = true;
+  return labeller;
+}
+
+SkyAnalyser::SkyAnalyser(const Config& config, WorkerPool* pool)
+  : mConfig{config}
+  , mPool{pool}
+  , mBackground{config.background, pool}
+  , mLabeller{labellerConfig(config), pool}
+  , mStreakDetector{nullptr}
+  , mThresholds{}
+  , mSubtracted{}
+  , mScratch{}
+{
+}
+
+const SkyAnalyser::Config& SkyAnalyser::config() const {
+  return mConfig;
+}
+
+float SkyAnalyser::meshMedian(Plane<const float> mesh,
+                              std::vector<float>& scratch) {
+  scratch.clear();
+  for (uint32_t y = 0; y < mesh.height; y++) {
+    const float* row = mesh.row(y);
+    scratch.insert(scratch.end(), row, row + mesh.width);
+  }
+  if (scratch.empty()) {
+    return 0.0f;
+  }
+  auto middle = scratch.begin() + scratch.size() / 2;
+  std::nth_element(scratch.begin(), middle, scratch.end());
+  return *middle;
+}
+
+bool SkyAnalyser::analyse(Plane<const uint8_t> luma, Result& result) {
+  result.stars.clear();
+  result.streaks.clear();
+  if (!mBackground.estimate(luma)) {
+    return false;
+  }
+  result.background = meshMedian(mBackground.meshBackground(), mScratch);
+  result.rms = meshMedian(mBackground.meshRms(), mScratch);
+
+  const size_t pixels = static_cast<size_t>(luma.width) * luma.height;
+  mThresholds.resize(pixels);
+  const Plane<uint16_t> thresholds{mThresholds.data(), luma.width,
+                                   luma.height};
+  mBackground.threshold(thresholds, mConfig.sigma);
+  mLabeller.label(luma, Plane<const uint16_t>{thresholds}, result.stars);
+
+  if (!mConfig.streaks) {
+    return true;
+  }
+  if (!mStreakDetector ||
+      (mStreakDetector->config().width != luma.width) ||
+      (mStreakDetector->config().height != luma.height)) {
+    StreakDetector::Config streakConfig{};
+    streakConfig.width = luma.width;
+    streakConfig.height = luma.height;
+    streakConfig.threshold = mConfig.streakThreshold;
+    mStreakDetector = std::make_unique<StreakDetector>(streakConfig, mPool);
+  }
+  mSubtracted.resize(pixels);
+  const Plane<uint8_t> subtracted{mSubtracted.data(), luma.width, luma.height};
+  mBackground.subtract(luma, subtracted);
+  mStreakDetector->detect(Plane<const uint8_t>{subtracted}, result.streaks);
+  return true;
+}
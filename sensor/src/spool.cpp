@@ -0,0 +1,375 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include "image_framing.hpp"
+#include "logging.hpp"
+#include "spool.hpp"
+
+static const char SEGMENT_SUFFIX[] = ".seg";
+static const char CHUNKED_SEGMENT_SUFFIX[] = ".chk";
+// 16 hex digits, then the suffix (both are the same length)
+static const size_t SEGMENT_NAME_LENGTH = 16 + sizeof(SEGMENT_SUFFIX) - 1;
+
+// Each record starts with the Image length prefix, or in a chunked spool a
+// prefix of its own
+static const size_t PREFIX_SIZE = 4;
+
+static uint32_t decodePrefix(const uint8_t* p) {
+  return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) |
+    p[3];
+}
+
+
+Spool::Spool(const Config& config)
+  : mConfig{config}
+  , mSuffix{config.chunked ? CHUNKED_SEGMENT_SUFFIX : SEGMENT_SUFFIX}
+  , mSegments{}
+  , mNextId{0}
+  , mWriteFd{-1}
+  , mReadFd{-1}
+  , mReadOffset{0}
+  , mNextRecordSize{0}
+  , mPendingBytes{0}
+  , mSegmentCount{0}
+  , mAppended{0}
+  , mSent{0}
+  , mDiscarded{0}
+{ }
+
+Spool::~Spool() {
+  if (mWriteFd >= 0) {
+    close(mWriteFd);
+  }
+  closeReadSegment();
+}
+
+bool Spool::open() {
+  if ((mkdir(mConfig.directory.c_str(), 0755) != 0) && (errno != EEXIST)) {
+    Logger::error(__func__, "Failed to create %s: %s\n",
+                  mConfig.directory.c_str(), strerror(errno));
+    return false;
+  }
+
+  DIR* dir = opendir(mConfig.directory.c_str());
+  if (dir == nullptr) {
+    Logger::error(__func__, "Failed to open %s: %s\n",
+                  mConfig.directory.c_str(), strerror(errno));
+    return false;
+  }
+  std::vector<uint64_t> ids;
+  while (struct dirent* entry = readdir(dir)) {
+    const char* name = entry->d_name;
+    if ((strlen(name) != SEGMENT_NAME_LENGTH) ||
+        (strcmp(name + 16, mSuffix) != 0)) {
+      continue;
+    }
+    char* end = nullptr;
+    uint64_t id = strtoull(name, &end, 16);
+    if (end == name + 16) {
+      ids.push_back(id);
+    }
+  }
+  closedir(dir);
+  std::sort(ids.begin(), ids.end());
+
+  // Left over from an earlier run. New frames go in a new segment.
+  for (uint64_t id : ids) {
+    Segment segment{id, 0, 0};
+    if (scanSegment(segment) && (segment.records > 0)) {
+      mSegments.push_back(segment);
+      mPendingBytes += segment.size;
+    } else {
+      unlink(segmentPath(id).c_str());
+    }
+    mNextId = id + 1;
+  }
+  mSegmentCount = mSegments.size();
+
+  if (!mSegments.empty()) {
+    Logger::info(__func__, "%zu segments, %" PRIu64 " bytes left to send\n",
+                 mSegments.size(), mPendingBytes.load());
+  }
+  return true;
+}
+
+bool Spool::scanSegment(Segment& segment) {
+  const std::string path = segmentPath(segment.id);
+  int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    Logger::warning(__func__, "Failed to open %s: %s\n", path.c_str(),
+                    strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return false;
+  }
+
+  // Walk the length prefixes; a record that runs off the end was cut short
+  // (e.g. by a power cut) and is dropped
+  const uint64_t fileSize = st.st_size;
+  uint64_t offset = 0;
+  uint8_t prefix[PREFIX_SIZE];
+  while (offset + PREFIX_SIZE <= fileSize) {
+    if (pread(fd, prefix, sizeof(prefix), offset) !=
+        static_cast<ssize_t>(sizeof(prefix))) {
+      break;
+    }
+    const uint64_t end = offset + PREFIX_SIZE + decodePrefix(prefix);
+    if (end > fileSize) {
+      break;
+    }
+    offset = end;
+    segment.records++;
+  }
+  if (offset < fileSize) {
+    Logger::warning(__func__, "Dropping %" PRIu64 " bytes from the end of %s\n",
+                    fileSize - offset, path.c_str());
+    if (ftruncate(fd, offset) != 0) {
+      Logger::warning(__func__, "Failed to truncate %s: %s\n", path.c_str(),
+                      strerror(errno));
+    }
+  }
+  close(fd);
+
+  segment.size = offset;
+  return true;
+}
+
+bool Spool::append(const Image::Metadata& metadata, const Frame* frame,
+                   const Detections* detections) {
+  if (mConfig.chunked || !startAppend()) {
+    return false;
+  }
+  return finishAppend(ImageFraming::writeImage(mWriteFd, metadata, frame,
+                                               nullptr, detections));
+}
+
+bool Spool::appendChunked(const struct iovec* iov, size_t iovCount) {
+  if (!mConfig.chunked || !startAppend()) {
+    return false;
+  }
+  size_t size = 0;
+  for (size_t i = 0; i < iovCount; i++) {
+    size += iov[i].iov_len;
+  }
+  uint8_t prefix[PREFIX_SIZE] = {
+    static_cast<uint8_t>(size >> 24), static_cast<uint8_t>(size >> 16),
+    static_cast<uint8_t>(size >> 8), static_cast<uint8_t>(size),
+  };
+  // writeAll() advances the iovecs as it goes, so work on a copy
+  std::vector<struct iovec> records;
+  records.reserve(iovCount + 1);
+  records.push_back({prefix, sizeof(prefix)});
+  records.insert(records.end(), iov, iov + iovCount);
+  return finishAppend(ImageFraming::writeAll(mWriteFd, records.data(),
+                                             records.size()));
+}
+
+bool Spool::startAppend() {
+  if ((mWriteFd < 0) || (mSegments.back().size >= mConfig.segmentSize)) {
+    return openWriteSegment();
+  }
+  return true;
+}
+
+bool Spool::finishAppend(ssize_t rc) {
+  Segment& segment = mSegments.back();
+  if (rc < 0) {
+    // Don't leave half a record behind for the reader to trip over
+    if (ftruncate(mWriteFd, segment.size) != 0) {
+      Logger::error(__func__, "Failed to truncate segment: %s\n",
+                    strerror(errno));
+    }
+    return false;
+  }
+  segment.size += rc;
+  segment.records++;
+  mPendingBytes += rc;
+  mAppended++;
+
+  // Make room by throwing away the oldest frames, but never the segment
+  // being written
+  while ((mPendingBytes > mConfig.maxBytes) && (mSegments.size() > 1)) {
+    removeOldestSegment();
+  }
+  return true;
+}
+
+size_t Spool::nextRecordSize() {
+  while (!mSegments.empty()) {
+    Segment& segment = mSegments.front();
+    if (mReadOffset >= segment.size) {
+      if ((mWriteFd >= 0) && (mSegments.size() == 1)) {
+        // Caught up with the writer. Start over with a fresh segment next
+        // time, so the spool doesn't keep a file around for nothing.
+        close(mWriteFd);
+        mWriteFd = -1;
+      }
+      closeReadSegment();
+      unlink(segmentPath(segment.id).c_str());
+      mSegments.pop_front();
+      mSegmentCount = mSegments.size();
+      mReadOffset = 0;
+      continue;
+    }
+
+    if ((mReadFd < 0) && !openReadSegment()) {
+      removeOldestSegment();
+      continue;
+    }
+
+    if (mNextRecordSize == 0) {
+      uint8_t prefix[PREFIX_SIZE];
+      if (pread(mReadFd, prefix, sizeof(prefix), mReadOffset) !=
+          static_cast<ssize_t>(sizeof(prefix))) {
+        Logger::error(__func__, "Failed to read segment %016" PRIx64 "\n",
+                      segment.id);
+        removeOldestSegment();
+        continue;
+      }
+      mNextRecordSize = PREFIX_SIZE + decodePrefix(prefix);
+    }
+    return mNextRecordSize;
+  }
+  return 0;
+}
+
+ssize_t Spool::sendNext(int fd, uint64_t* syscalls) {
+  const size_t size = nextRecordSize();
+  if (size == 0) {
+    return 0;
+  }
+
+  // A chunked spool's prefix is only for finding records in the segment
+  const size_t skip = mConfig.chunked ? PREFIX_SIZE : 0;
+  off_t offset = mReadOffset + skip;
+  size_t remaining = size - skip;
+  while (remaining > 0) {
+    ssize_t rc = sendfile(fd, mReadFd, &offset, remaining);
+    if (syscalls != nullptr) {
+      (*syscalls)++;
+    }
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      Logger::error(__func__, "sendfile failed: %s\n", strerror(errno));
+      return -1;
+    }
+    if (rc == 0) {
+      Logger::error(__func__, "Segment %016" PRIx64 " ended early\n",
+                    mSegments.front().id);
+      return -1;
+    }
+    remaining -= rc;
+  }
+
+  mReadOffset += size;
+  mNextRecordSize = 0;
+  mSegments.front().records--;
+  mPendingBytes -= size;
+  mSent++;
+  return size - skip;
+}
+
+Spool::Stats Spool::stats() const {
+  return Stats{
+    mPendingBytes.load(),
+    mSegmentCount.load(),
+    mAppended.load(),
+    mSent.load(),
+    mDiscarded.load(),
+  };
+}
+
+std::string Spool::segmentPath(uint64_t id) const {
+  char name[SEGMENT_NAME_LENGTH + 1];
+  snprintf(name, sizeof(name), "%016" PRIx64 "%s", id, mSuffix);
+  return mConfig.directory + "/" + name;
+}
+
+bool Spool::openWriteSegment() {
+  if (mWriteFd >= 0) {
+    close(mWriteFd);
+    mWriteFd = -1;
+  }
+
+  const uint64_t id = mNextId++;
+  const std::string path = segmentPath(id);
+  mWriteFd = ::open(path.c_str(),
+                    O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+  if (mWriteFd < 0) {
+    Logger::error(__func__, "Failed to create %s: %s\n", path.c_str(),
+                  strerror(errno));
+    return false;
+  }
+  mSegments.push_back(Segment{id, 0, 0});
+  mSegmentCount = mSegments.size();
+  return true;
+}
+
+bool Spool::openReadSegment() {
+  const std::string path = segmentPath(mSegments.front().id);
+  mReadFd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (mReadFd < 0) {
+    Logger::error(__func__, "Failed to open %s: %s\n", path.c_str(),
+                  strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+void Spool::closeReadSegment() {
+  if (mReadFd >= 0) {
+    close(mReadFd);
+    mReadFd = -1;
+  }
+  mNextRecordSize = 0;
+}
+
+void Spool::removeOldestSegment() {
+  const Segment& segment = mSegments.front();
+  mPendingBytes -= segment.size - mReadOffset;
+  mDiscarded += segment.records;
+  Logger::warning(__func__, "Discarding %" PRIu64 " spooled frames\n",
+                  segment.records);
+
+  if ((mWriteFd >= 0) && (mSegments.size() == 1)) {
+    close(mWriteFd);
+    mWriteFd = -1;
+  }
+  closeReadSegment();
+  unlink(segmentPath(segment.id).c_str());
+  mSegments.pop_front();
+  mSegmentCount = mSegments.size();
+  mReadOffset = 0;
+}
@@ -0,0 +1,325 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+
+#include "synthetic_frame_source.hpp"
+
+// Stars are drawn as a Gaussian with this sigma, out to +/- STAR_RADIUS
+static const float STAR_SIGMA = 0.9f;
+static const int STAR_RADIUS = 2;
+
+// Largest block an uncompressed deflate block can hold
+static const size_t DEFLATE_STORED_MAX = 65535;
+
+
+/**
+ * xorshift64*, so frames are the same on every platform.
+ */
+static uint64_t nextRandom(uint64_t& state) {
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t seedState(uint64_t seed, uint64_t stream) {
+  uint64_t state = (seed + 1) * 0x9E3779B97F4A7C15ULL ^ (stream + 1);
+  // Discard the first few outputs; nearby seeds start out correlated
+  for (int i = 0; i < 4; i++) {
+    nextRandom(state);
+  }
+  return state;
+}
+
+static const std::array<uint32_t, 256>& crcTable() {
+  static const std::array<uint32_t, 256> table = [] {
+    std::array<uint32_t, 256> t{};
+    for (uint32_t n = 0; n < 256; n++) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; k++) {
+        c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+      }
+      t[n] = c;
+    }
+    return t;
+  }();
+  return table;
+}
+
+static uint32_t crc32(const uint8_t* data, size_t size) {
+  const auto& table = crcTable();
+  uint32_t c = 0xFFFFFFFFu;
+  for (size_t i = 0; i < size; i++) {
+    c = table[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+  }
+  return c ^ 0xFFFFFFFFu;
+}
+
+static uint8_t* putBE32(uint8_t* p, uint32_t value) {
+  p[0] = static_cast<uint8_t>(value >> 24);
+  p[1] = static_cast<uint8_t>(value >> 16);
+  p[2] = static_cast<uint8_t>(value >> 8);
+  p[3] = static_cast<uint8_t>(value);
+  return p + 4;
+}
+
+/**
+ * Fill in the length and CRC of the PNG chunk starting at chunkStart, once
+ * its data is in place.
+ */
+static uint8_t* finishChunk(uint8_t* chunkStart, uint8_t* dataEnd) {
+  uint32_t length = static_cast<uint32_t>(dataEnd - chunkStart - 8);
+  putBE32(chunkStart, length);
+  return putBE32(dataEnd, crc32(chunkStart + 4, length + 4));
+}
+
+
+SyntheticFrameSource::SyntheticFrameSource(const Config& config)
+  : PacedFrameSource{config.pacing}
+  , mConfig{config}
+  , mWidth{SENSOR_MODE_WIDTH[config.sensorMode]}
+  , mHeight{SENSOR_MODE_HEIGHT[config.sensorMode]}
+  , mStars{}
+  , mLuma(static_cast<size_t>(mWidth) * mHeight)
+  , mEncoded{}
+  , mFrameIndex{0}
+  , mState{}
+{
+  uint64_t state = seedState(config.seed, 0);
+  mStars.reserve(config.starCount);
+  for (unsigned i = 0; i < config.starCount; i++) {
+    Star star;
+    star.x = static_cast<float>(nextRandom(state) % (mWidth * 16)) / 16.0f;
+    star.y = static_cast<float>(nextRandom(state) % (mHeight * 16)) / 16.0f;
+    // Mostly faint stars, a few bright ones
+    float u = static_cast<float>(nextRandom(state) % 10000) / 10000.0f;
+    star.peak = 20.0f + 235.0f * u * u * u;
+    mStars.push_back(star);
+  }
+
+  // Pretend to be the camera settings main() uses
+  const auto now = CameraState::Clock::now();
+  mState.analogGain = 1.0f;
+  mState.digitalGain = 1.0f;
+  mState.awbGainRed = 1.0f;
+  mState.awbGainBlue = 1.0f;
+  mState.iso = 800;
+  mState.brightness = 0.5f;
+  mState.shutterSpeed = config.pacing.frameRate > 0.0
+    ? static_cast<uint32_t>(1e6 / config.pacing.frameRate) : 0;
+  mState.exposureSpeed = mState.shutterSpeed;
+  for (int field = 0; field < CameraState::NUM_FIELDS; field++) {
+    mState.touch(static_cast<CameraState::Field>(field), now);
+  }
+}
+
+SyntheticFrameSource::~SyntheticFrameSource() {
+  stop();
+}
+
+uint32_t SyntheticFrameSource::width() const {
+  return mWidth;
+}
+
+uint32_t SyntheticFrameSource::height() const {
+  return mHeight;
+}
+
+std::string SyntheticFrameSource::encoding() const {
+  return encodingName(mConfig.encoding);
+}
+
+CameraState SyntheticFrameSource::stateSnapshot() const {
+  return mState;
+}
+
+std::string SyntheticFrameSource::encodingName(Encoding encoding) {
+  switch (encoding) {
+    case Encoding::GRAY8:
+      return "GRAY8";
+    case Encoding::I420:
+      return "I420";
+    case Encoding::RGB24:
+      return "RGB24";
+    case Encoding::PNG:
+      return "PNG";
+  }
+  return "UNKNOWN";
+}
+
+bool SyntheticFrameSource::produceFrame(FrameAssembler& assembler) {
+  renderLuma(mFrameIndex++);
+
+  switch (mConfig.encoding) {
+    case Encoding::GRAY8:
+      appendBuffers(assembler, mLuma.data(), mLuma.size());
+      return true;
+    case Encoding::I420:
+      encodeI420();
+      break;
+    case Encoding::RGB24:
+      encodeRGB();
+      break;
+    case Encoding::PNG:
+      encodePNG();
+      break;
+  }
+
+  appendBuffers(assembler, mEncoded.data(), mEncoded.size());
+  return true;
+}
+
+void SyntheticFrameSource::renderLuma(uint64_t frameIndex) {
+  // Background: uniform noise around the background level, 8 pixels per
+  // random number
+  uint64_t state = seedState(mConfig.seed, frameIndex + 1);
+  const int span = 2 * mConfig.noise + 1;
+  const int base = static_cast<int>(mConfig.background) - mConfig.noise;
+  uint8_t* out = mLuma.data();
+  const size_t n = mLuma.size();
+  for (size_t i = 0; i < n; i += 8) {
+    uint64_t r = nextRandom(state);
+    for (size_t j = 0; (j < 8) && (i + j < n); j++) {
+      int value = base + static_cast<int>((r >> (8 * j)) & 0xFF) % span;
+      out[i + j] = static_cast<uint8_t>(std::min(std::max(value, 0), 255));
+    }
+  }
+
+  const float dx = mConfig.driftX * frameIndex;
+  const float dy = mConfig.driftY * frameIndex;
+  const float twoSigmaSq = 2.0f * STAR_SIGMA * STAR_SIGMA;
+  for (const auto& star : mStars) {
+    const float sx = star.x + dx;
+    const float sy = star.y + dy;
+    const int cx = static_cast<int>(std::lround(sx));
+    const int cy = static_cast<int>(std::lround(sy));
+    for (int y = cy - STAR_RADIUS; y <= cy + STAR_RADIUS; y++) {
+      if ((y < 0) || (y >= static_cast<int>(mHeight))) {
+        continue;
+      }
+      for (int x = cx - STAR_RADIUS; x <= cx + STAR_RADIUS; x++) {
+        if ((x < 0) || (x >= static_cast<int>(mWidth))) {
+          continue;
+        }
+        const float rx = x - sx;
+        const float ry = y - sy;
+        const float value = star.peak * std::exp(-(rx * rx + ry * ry) / twoSigmaSq);
+        uint8_t& pixel = mLuma[static_cast<size_t>(y) * mWidth + x];
+        pixel = static_cast<uint8_t>(std::min(pixel + static_cast<int>(value), 255));
+      }
+    }
+  }
+}
+
+void SyntheticFrameSource::encodeRGB() {
+  mEncoded.resize(mLuma.size() * 3);
+  uint8_t* out = mEncoded.data();
+  for (uint8_t value : mLuma) {
+    *out++ = value;
+    *out++ = value;
+    *out++ = value;
+  }
+}
+
+void SyntheticFrameSource::encodeI420() {
+  const size_t chromaSize = static_cast<size_t>((mWidth + 1) / 2) *
+    ((mHeight + 1) / 2);
+  mEncoded.resize(mLuma.size() + 2 * chromaSize);
+  memcpy(mEncoded.data(), mLuma.data(), mLuma.size());
+  memset(mEncoded.data() + mLuma.size(), 128, 2 * chromaSize);
+}
+
+void SyntheticFrameSource::encodePNG() {
+  static const uint8_t PNG_SIGNATURE[8] = {
+    0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n',
+  };
+
+  const size_t rowSize = 1 + static_cast<size_t>(mWidth) * 3;
+  const size_t rawSize = rowSize * mHeight;
+  const size_t blocks = (rawSize + DEFLATE_STORED_MAX - 1) / DEFLATE_STORED_MAX;
+  const size_t zlibSize = 2 + blocks * 5 + rawSize + 4;
+  mEncoded.resize(sizeof(PNG_SIGNATURE) + (12 + 13) + (12 + zlibSize) + 12);
+
+  uint8_t* p = mEncoded.data();
+  memcpy(p, PNG_SIGNATURE, sizeof(PNG_SIGNATURE));
+  p += sizeof(PNG_SIGNATURE);
+
+  // IHDR: 8-bit RGB, no interlacing
+  uint8_t* chunk = p;
+  p += 4;
+  memcpy(p, "IHDR", 4);
+  p += 4;
+  p = putBE32(p, mWidth);
+  p = putBE32(p, mHeight);
+  *p++ = 8;
+  *p++ = 2;
+  *p++ = 0;
+  *p++ = 0;
+  *p++ = 0;
+  p = finishChunk(chunk, p);
+
+  // IDAT: a zlib stream of stored deflate blocks, each holding rows with
+  // filter type 0
+  chunk = p;
+  p += 4;
+  memcpy(p, "IDAT", 4);
+  p += 4;
+  *p++ = 0x78;
+  *p++ = 0x01;
+
+  uint32_t adlerA = 1, adlerB = 0;
+  size_t rawOffset = 0;
+  size_t blockLeft = 0;
+  for (uint32_t y = 0; y < mHeight; y++) {
+    const uint8_t* row = &mLuma[static_cast<size_t>(y) * mWidth];
+    for (size_t i = 0; i < rowSize; i++) {
+      if (blockLeft == 0) {
+        blockLeft = std::min(DEFLATE_STORED_MAX, rawSize - rawOffset);
+        const bool last = (rawOffset + blockLeft == rawSize);
+        *p++ = last ? 1 : 0;
+        *p++ = static_cast<uint8_t>(blockLeft);
+        *p++ = static_cast<uint8_t>(blockLeft >> 8);
+        *p++ = static_cast<uint8_t>(~blockLeft);
+        *p++ = static_cast<uint8_t>(~blockLeft >> 8);
+      }
+      const uint8_t value = (i == 0) ? 0 : row[(i - 1) / 3];
+      *p++ = value;
+      adlerA += value;
+      if (adlerA >= 65521) {
+        adlerA -= 65521;
+      }
+      adlerB += adlerA;
+      if (adlerB >= 65521) {
+        adlerB -= 65521;
+      }
+      rawOffset++;
+      blockLeft--;
+    }
+  }
+  p = putBE32(p, (adlerB << 16) | adlerA);
+  p = finishChunk(chunk, p);
+
+  chunk = p;
+  p += 4;
+  memcpy(p, "IEND", 4);
+  p += 4;
+  finishChunk(chunk, p);
+}
@@ -0,0 +1,672 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifndef PICAM_NO_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+#include "logging.hpp"
+#include "uring_sender.hpp"
+
+// Pools registered at once; frames from any more are sent without
+// registered buffers
+static const size_t MAX_POOLS = 4;
+// The kernel's limit on registered buffers
+static const size_t MAX_REGISTERED_BUFFERS = 1 << 14;
+
+
+UringSender::UringSender(const Config& config)
+  : mConfig{config}
+  , mEntries{0}
+  , mRingFd{-1}
+  , mSocket{-1}
+  , mZeroCopy{config.zeroCopyThreshold > 0}
+  , mSqRing{nullptr}
+  , mSqRingSize{0}
+  , mCqRing{nullptr}
+  , mCqRingSize{0}
+  , mSqes{nullptr}
+  , mSqesSize{0}
+  , mSqHead{nullptr}
+  , mSqTail{nullptr}
+  , mSqMask{nullptr}
+  , mSqFlags{nullptr}
+  , mSqArray{nullptr}
+  , mCqHead{nullptr}
+  , mCqTail{nullptr}
+  , mCqMask{nullptr}
+  , mCqes{nullptr}
+  , mBuilding{}
+  , mSegments{}
+  , mRecordEnds{}
+  , mRecordStart{0}
+  , mBatches{}
+  , mSpareBatches{}
+  , mRecords{}
+  , mNextRecord{1}
+  , mSqeInfo{}
+  , mFreeSqeInfo{}
+  , mSqesInFlight{0}
+  , mSendsInFlight{0}
+  , mBatchSqes{}
+  , mFailed{false}
+  , mCompleted{0}
+  , mCompletedFailed{0}
+  , mPools{}
+  , mPoolsChanged{false}
+  , mBufferIndex{}
+  , mStats{}
+{
+}
+
+UringSender::~UringSender() {
+  closeRing();
+}
+
+void UringSender::copy(const void* data, size_t size) {
+  if (size == 0) {
+    return;
+  }
+  auto& staging = mBuilding.staging;
+  const size_t offset = staging.size();
+  staging.insert(staging.end(), static_cast<const uint8_t*>(data),
+                 static_cast<const uint8_t*>(data) + size);
+
+  // Runs of copied bytes in a record go out as one piece
+  if ((mSegments.size() > mRecordStart) &&
+      (mSegments.back().type == SegmentType::STAGED) &&
+      (mSegments.back().offset + mSegments.back().size == offset)) {
+    mSegments.back().size += size;
+    return;
+  }
+  mSegments.push_back(Segment{SegmentType::STAGED, false, 0, offset, nullptr,
+                              size});
+}
+
+void UringSender::reference(const Frame& frame) {
+  if (frame.empty()) {
+    return;
+  }
+
+  if (mZeroCopy && frame.pool()) {
+    auto it = std::find_if(mPools.begin(), mPools.end(),
+        [&frame](const RegisteredPool& p) { return p.pool == frame.pool(); });
+    if (it == mPools.end()) {
+      if (mPools.size() < MAX_POOLS) {
+        mPools.push_back(RegisteredPool{frame.pool(), 0});
+        mPoolsChanged = true;
+      }
+    } else if (it->slabs != it->pool->allocated()) {
+      // It's grown since it was registered
+      mPoolsChanged = true;
+    }
+  }
+
+  for (const auto& chunk : frame.chunks()) {
+    if (chunk.size == 0) {
+      continue;
+    }
+    const bool zeroCopy = mZeroCopy && (chunk.size >= mConfig.zeroCopyThreshold);
+    mSegments.push_back(Segment{SegmentType::REFERENCE, zeroCopy, 0, 0,
+                                chunk.data, chunk.size});
+  }
+}
+
+void UringSender::endRecord() {
+  mRecordEnds.push_back(mSegments.size());
+  mRecordStart = mSegments.size();
+}
+
+bool UringSender::batchFull() const {
+  return (mBuilding.staging.size() >= mConfig.stagingSize) ||
+    (sqesNeeded() + mSqesInFlight >= mEntries);
+}
+
+size_t UringSender::sqesNeeded() const {
+  // A FIXED segment takes an SQE of its own; runs of the others are
+  // gathered into a SENDMSG (each of which can span records)
+  size_t sqes = 0;
+  size_t run = 0;
+  for (const auto& segment : mSegments) {
+    if (segment.type == SegmentType::FIXED) {
+      sqes++;
+      run = 0;
+    } else if ((run == 0) || (run == IOV_MAX)) {
+      sqes++;
+      run = 1;
+    } else {
+      run++;
+    }
+  }
+  return sqes;
+}
+
+void UringSender::resolveSegments(bool allowZeroCopy) {
+  for (auto& segment : mSegments) {
+    if (!segment.zeroCopy) {
+      continue;
+    }
+    auto it = allowZeroCopy ? mBufferIndex.find(segment.data)
+                            : mBufferIndex.end();
+    if (it != mBufferIndex.end()) {
+      segment.type = SegmentType::FIXED;
+      segment.bufferIndex = it->second;
+    } else {
+      segment.type = SegmentType::REFERENCE;
+    }
+  }
+}
+
+UringSender::Stats UringSender::stats() const {
+  return mStats;
+}
+
+#ifndef PICAM_NO_IO_URING
+
+static int ioUringSetup(unsigned entries, struct io_uring_params* params) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete,
+                        unsigned flags, const void* arg = nullptr,
+                        size_t argSize = 0) {
+  return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit,
+                                  minComplete, flags, arg, argSize));
+}
+
+static int ioUringRegister(int fd, unsigned opcode, const void* arg,
+                           unsigned count) {
+  return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg,
+                                  count));
+}
+
+bool UringSender::open() {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  if (mConfig.sqPoll) {
+    params.flags |= IORING_SETUP_SQPOLL;
+    params.sq_thread_idle = mConfig.sqIdleMs;
+  }
+  mRingFd = ioUringSetup(std::max(mConfig.entries, 2u), &params);
+  if (mRingFd < 0) {
+    Logger::warning(__func__, "io_uring_setup failed: %s\n", strerror(errno));
+    return false;
+  }
+
+  // SEND_ZC came with 6.0, by which time the kernel also retries short
+  // MSG_WAITALL sends, which the ordering here relies on
+  const size_t probeSize = sizeof(struct io_uring_probe) +
+    256 * sizeof(struct io_uring_probe_op);
+  std::vector<uint8_t> probeBuffer(probeSize);
+  auto* probe = reinterpret_cast<struct io_uring_probe*>(probeBuffer.data());
+  if ((ioUringRegister(mRingFd, IORING_REGISTER_PROBE, probe, 256) != 0) ||
+      (probe->last_op < IORING_OP_SEND_ZC) ||
+      !(probe->ops[IORING_OP_SENDMSG].flags & IO_URING_OP_SUPPORTED) ||
+      !(probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED)) {
+    Logger::warning(__func__, "io_uring is too old (needs SEND_ZC)\n");
+    closeRing();
+    return false;
+  }
+
+  mSqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  mCqRingSize = params.cq_off.cqes +
+    params.cq_entries * sizeof(struct io_uring_cqe);
+  const bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (singleMap) {
+    mSqRingSize = mCqRingSize = std::max(mSqRingSize, mCqRingSize);
+  }
+  mSqRing = mmap(nullptr, mSqRingSize, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_SQ_RING);
+  if (mSqRing == MAP_FAILED) {
+    mSqRing = nullptr;
+  } else if (singleMap) {
+    mCqRing = mSqRing;
+  } else {
+    mCqRing = mmap(nullptr, mCqRingSize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_CQ_RING);
+    if (mCqRing == MAP_FAILED) {
+      mCqRing = nullptr;
+    }
+  }
+  mSqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = mmap(nullptr, mSqesSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_SQES);
+  if ((mSqRing == nullptr) || (mCqRing == nullptr) || (sqes == MAP_FAILED)) {
+    Logger::warning(__func__, "Failed to map the ring: %s\n", strerror(errno));
+    if (sqes != MAP_FAILED) {
+      munmap(sqes, mSqesSize);
+    }
+    closeRing();
+    return false;
+  }
+  mSqes = static_cast<io_uring_sqe*>(sqes);
+
+  uint8_t* sq = static_cast<uint8_t*>(mSqRing);
+  uint8_t* cq = static_cast<uint8_t*>(mCqRing);
+  mSqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  mSqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  mSqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  mSqFlags = reinterpret_cast<unsigned*>(sq + params.sq_off.flags);
+  mSqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  mCqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  mCqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  mCqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  mCqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+  mEntries = params.sq_entries;
+  mSqeInfo.resize(mEntries);
+  mFreeSqeInfo.clear();
+  for (unsigned i = mEntries; i-- > 0;) {
+    mFreeSqeInfo.push_back(i);
+  }
+  Logger::info(__func__, "io_uring sender: %u entries%s\n", mEntries,
+               mConfig.sqPoll ? ", SQPOLL" : "");
+  return true;
+}
+
+void UringSender::closeRing() {
+  if (mSqes != nullptr) {
+    munmap(mSqes, mSqesSize);
+    mSqes = nullptr;
+  }
+  if ((mCqRing != nullptr) && (mCqRing != mSqRing)) {
+    munmap(mCqRing, mCqRingSize);
+  }
+  mCqRing = nullptr;
+  if (mSqRing != nullptr) {
+    munmap(mSqRing, mSqRingSize);
+    mSqRing = nullptr;
+  }
+  if (mRingFd >= 0) {
+    // Also drops the registered buffers
+    ::close(mRingFd);
+    mRingFd = -1;
+  }
+}
+
+void UringSender::updateRegistration() {
+  mPoolsChanged = false;
+  if (!mBufferIndex.empty()) {
+    ioUringRegister(mRingFd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+    mBufferIndex.clear();
+  }
+
+  std::vector<struct iovec> buffers;
+  for (auto& registered : mPools) {
+    // Slabs allocated from here on aren't registered until next time
+    auto slabs = registered.pool->slabs();
+    registered.slabs = slabs.size();
+    for (const uint8_t* slab : slabs) {
+      if (buffers.size() == MAX_REGISTERED_BUFFERS) {
+        break;
+      }
+      mBufferIndex[slab] = static_cast<uint16_t>(buffers.size());
+      buffers.push_back({const_cast<uint8_t*>(slab),
+                         registered.pool->slabSize()});
+    }
+  }
+  if (buffers.empty()) {
+    return;
+  }
+
+  if (ioUringRegister(mRingFd, IORING_REGISTER_BUFFERS, buffers.data(),
+                      buffers.size()) != 0) {
+    // Most likely RLIMIT_MEMLOCK: the buffers are pinned
+    Logger::warning(__func__, "Failed to register %zu frame buffers (%s); "
+                    "sending without\n", buffers.size(), strerror(errno));
+    mBufferIndex.clear();
+    mZeroCopy = false;
+  }
+  mStats.registeredBuffers = mBufferIndex.size();
+}
+
+void UringSender::addSqe(uint8_t opcode, uint64_t firstRecord,
+                         uint64_t lastRecord, uint64_t addr, uint32_t len,
+                         uint32_t expected, uint16_t bufferIndex) {
+  const unsigned tail = *mSqTail + mBatchSqes.size();
+  io_uring_sqe* sqe = &mSqes[tail & *mSqMask];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = mSocket;
+  sqe->addr = addr;
+  sqe->len = len;
+  sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+  if (opcode == IORING_OP_SEND_ZC) {
+    sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+    sqe->buf_index = bufferIndex;
+  }
+
+  const uint32_t info = mFreeSqeInfo.back();
+  mFreeSqeInfo.pop_back();
+  mSqeInfo[info] = SqeInfo{firstRecord, lastRecord, expected};
+  sqe->user_data = info;
+  mSqArray[tail & *mSqMask] = tail & *mSqMask;
+
+  for (uint64_t r = firstRecord; r <= lastRecord; r++) {
+    mRecords[r - mRecords.front().serial].pending++;
+  }
+  mBatchSqes.push_back(sqe);
+  mSendsInFlight++;
+}
+
+void UringSender::prepare(Batch& batch, uint64_t firstRecord) {
+  batch.iov.clear();
+  batch.messages.clear();
+  // Reserved up front: the kernel is handed pointers into them
+  batch.iov.reserve(mSegments.size());
+  batch.messages.reserve(mSegments.size());
+
+  size_t record = 0;
+  size_t runStart = 0;
+  uint64_t runFirstRecord = 0;
+  uint32_t runBytes = 0;
+  auto flushRun = [&](uint64_t lastRecord) {
+    const size_t count = batch.iov.size() - runStart;
+    if (count == 0) {
+      return;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &batch.iov[runStart];
+    msg.msg_iovlen = count;
+    batch.messages.push_back(msg);
+    addSqe(IORING_OP_SENDMSG, runFirstRecord, lastRecord,
+           reinterpret_cast<uint64_t>(&batch.messages.back()), 1, runBytes,
+           0);
+    runStart = batch.iov.size();
+    runBytes = 0;
+  };
+
+  for (size_t i = 0; i < mSegments.size(); i++) {
+    while (i >= mRecordEnds[record]) {
+      record++;
+    }
+    const uint64_t serial = firstRecord + record;
+    const Segment& segment = mSegments[i];
+    if (segment.type == SegmentType::FIXED) {
+      flushRun(serial);
+      addSqe(IORING_OP_SEND_ZC, serial, serial,
+             reinterpret_cast<uint64_t>(segment.data), segment.size,
+             segment.size, segment.bufferIndex);
+      mStats.zeroCopySends++;
+      mStats.zeroCopyBytes += segment.size;
+      continue;
+    }
+
+    if ((batch.iov.size() - runStart == IOV_MAX) ||
+        (runBytes + segment.size > INT_MAX)) {
+      flushRun(serial);
+    }
+    if (batch.iov.size() == runStart) {
+      runFirstRecord = serial;
+    }
+    void* base = (segment.type == SegmentType::STAGED)
+      ? static_cast<void*>(batch.staging.data() + segment.offset)
+      : const_cast<uint8_t*>(segment.data);
+    batch.iov.push_back({base, segment.size});
+    runBytes += segment.size;
+  }
+  flushRun(firstRecord + mRecordEnds.size() - 1);
+}
+
+bool UringSender::submit(uint64_t* syscalls) {
+  if (mRecordEnds.empty()) {
+    return true;
+  }
+
+  bool ok = !mFailed && (mRingFd >= 0) && (mSocket >= 0);
+  if (ok) {
+    // Buffer indexes can only change with nothing in flight
+    if (mPoolsChanged && (mSqesInFlight == 0)) {
+      updateRegistration();
+    }
+    resolveSegments(mZeroCopy);
+    if (sqesNeeded() > mEntries) {
+      // Too many pieces for one chain: gather them all instead
+      resolveSegments(false);
+    }
+    // Batches aren't linked to each other, so one only goes once the sends
+    // before it are done; their zero-copy notifications can come later
+    while (ok && ((mSendsInFlight > 0) ||
+                  (mSqesInFlight + sqesNeeded() > mEntries))) {
+      if (!collect(mConfig.sendTimeout, syscalls)) {
+        Logger::error(__func__, "No send completions for %lld ms\n",
+                      static_cast<long long>(mConfig.sendTimeout.count()));
+        ok = false;
+      }
+      ok = ok && !mFailed;
+    }
+  }
+
+  // Only now, so that waiting above doesn't take them for complete
+  const uint64_t firstRecord = mNextRecord;
+  for (size_t i = 0; i < mRecordEnds.size(); i++) {
+    mRecords.push_back(Record{mNextRecord++, 0, !ok});
+  }
+
+  const bool prepared = ok;
+  if (prepared) {
+    prepare(mBuilding, firstRecord);
+
+    // One chain, so the pieces go out in order and a failure cancels the
+    // rest
+    for (size_t i = 0; i + 1 < mBatchSqes.size(); i++) {
+      mBatchSqes[i]->flags |= IOSQE_IO_LINK;
+    }
+    const unsigned count = mBatchSqes.size();
+    mSqesInFlight += count;
+    __atomic_store_n(mSqTail, *mSqTail + count, __ATOMIC_RELEASE);
+    mBatchSqes.clear();
+
+    if (mConfig.sqPoll) {
+      // The polling thread may have gone to sleep
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if (__atomic_load_n(mSqFlags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP) {
+        ok = enter(0, IORING_ENTER_SQ_WAKEUP, syscalls);
+      }
+    } else {
+      ok = enter(count, 0, syscalls);
+    }
+    if (!ok) {
+      mFailed = true;
+    }
+    mStats.batches++;
+    mStats.records += mRecordEnds.size();
+  } else {
+    // Never sent, so they fail as soon as they're reaped
+    mFailed = true;
+  }
+
+  // Kept until its last record is complete: the kernel reads from it
+  if (prepared) {
+    mBuilding.lastRecord = mNextRecord - 1;
+    mBatches.push_back(std::move(mBuilding));
+    mBuilding = Batch{};
+    if (!mSpareBatches.empty()) {
+      mBuilding = std::move(mSpareBatches.back());
+      mSpareBatches.pop_back();
+    }
+  }
+  mBuilding.staging.clear();
+  mSegments.clear();
+  mRecordEnds.clear();
+  mRecordStart = 0;
+
+  // Completions that came in inline (most of them) are free to pick up
+  collect(std::chrono::milliseconds{0}, syscalls);
+  return ok;
+}
+
+bool UringSender::enter(unsigned toSubmit, unsigned flags,
+                        uint64_t* syscalls) {
+  for (;;) {
+    int rc = ioUringEnter(mRingFd, toSubmit, 0, flags);
+    mStats.enters++;
+    if (syscalls != nullptr) {
+      (*syscalls)++;
+    }
+    if (rc >= 0) {
+      if (static_cast<unsigned>(rc) >= toSubmit) {
+        return true;
+      }
+      // Shouldn't happen with the completion queue kept from overflowing
+      toSubmit -= rc;
+      continue;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    Logger::error(__func__, "io_uring_enter failed: %s\n", strerror(errno));
+    return false;
+  }
+}
+
+bool UringSender::wait(std::chrono::milliseconds timeout, uint64_t* syscalls) {
+  struct __kernel_timespec ts;
+  ts.tv_sec = timeout.count() / 1000;
+  ts.tv_nsec = (timeout.count() % 1000) * 1000000;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  arg.ts = reinterpret_cast<uint64_t>(&ts);
+
+  int rc = ioUringEnter(mRingFd, 0, 1,
+                       IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                       sizeof(arg));
+  mStats.enters++;
+  if (syscalls != nullptr) {
+    (*syscalls)++;
+  }
+  if ((rc < 0) && (errno != EINTR) && (errno != ETIME)) {
+    Logger::error(__func__, "io_uring_enter failed: %s\n", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+bool UringSender::collect(std::chrono::milliseconds timeout,
+                          uint64_t* syscalls) {
+  if (mRingFd < 0) {
+    return false;
+  }
+
+  unsigned head = *mCqHead;
+  unsigned tail = __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE);
+  if ((timeout.count() > 0) && (head == tail) && (mSqesInFlight > 0)) {
+    wait(timeout, syscalls);
+    tail = __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE);
+  }
+  const bool progress = head != tail;
+  for (; head != tail; head++) {
+    handleCqe(mCqes[head & *mCqMask]);
+  }
+  __atomic_store_n(mCqHead, head, __ATOMIC_RELEASE);
+
+  // In order: a record isn't done until everything before it is
+  while (!mRecords.empty() && (mRecords.front().pending == 0)) {
+    const Record& record = mRecords.front();
+    mFailed = mFailed || record.failed;
+    mCompleted++;
+    // Once the stream's broken, everything after it is lost too
+    if (mFailed) {
+      mCompletedFailed++;
+    }
+    if (!mBatches.empty() && (mBatches.front().lastRecord == record.serial)) {
+      mSpareBatches.push_back(std::move(mBatches.front()));
+      mBatches.pop_front();
+    }
+    mRecords.pop_front();
+  }
+  return progress;
+}
+
+void UringSender::handleCqe(const io_uring_cqe& cqe) {
+  SqeInfo& info = mSqeInfo[cqe.user_data];
+  bool finished = true;
+  bool failed = false;
+  int pendingChange = -1;
+  if (cqe.flags & IORING_CQE_F_NOTIF) {
+    // The kernel's done with a zero-copy send's buffer
+  } else {
+    // Anything short of the whole lot (cancelled by a failure earlier in
+    // the chain included) is a failure
+    failed = cqe.res != static_cast<int32_t>(info.expected);
+    if (failed && (cqe.res != -ECANCELED)) {
+      Logger::warning(__func__, "Send failed: %s\n",
+                      (cqe.res < 0) ? strerror(-cqe.res) : "short");
+    }
+    mSendsInFlight--;
+    if (cqe.flags & IORING_CQE_F_MORE) {
+      // A notification follows
+      finished = false;
+      pendingChange = 0;
+    }
+  }
+
+  if (!mRecords.empty()) {
+    const uint64_t front = mRecords.front().serial;
+    for (uint64_t r = std::max(info.firstRecord, front); r <= info.lastRecord;
+         r++) {
+      Record& record = mRecords[r - front];
+      record.pending += pendingChange;
+      record.failed = record.failed || failed;
+    }
+  }
+  if (finished) {
+    mFreeSqeInfo.push_back(static_cast<uint32_t>(cqe.user_data));
+    mSqesInFlight--;
+  }
+}
+
+size_t UringSender::reap(std::chrono::milliseconds timeout, size_t& failed,
+                         uint64_t* syscalls) {
+  collect(timeout, syscalls);
+  const size_t completed = mCompleted;
+  failed = mCompletedFailed;
+  mCompleted = 0;
+  mCompletedFailed = 0;
+  return completed;
+}
+
+#else // PICAM_NO_IO_URING
+
+bool UringSender::open() {
+  Logger::warning(__func__, "Built without io_uring\n");
+  return false;
+}
+
+void UringSender::closeRing() {
+}
+
+bool UringSender::submit(uint64_t*) {
+  return false;
+}
+
+size_t UringSender::reap(std::chrono::milliseconds, size_t& failed,
+                         uint64_t*) {
+  failed = 0;
+  return 0;
+}
+
+#endif // PICAM_NO_IO_URING
@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2019 Zack Marvel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <sys/uio.h>
+
+#include "image_framing.hpp"
+#include "logging.hpp"
+#include "video_framing.hpp"
+
+namespace VideoFraming {
+
+static const uint8_t MAGIC[4] = {'P', 'C', 'V', 'S'};
+
+static uint8_t* putBE32(uint8_t* p, uint32_t value) {
+  p[0] = static_cast<uint8_t>(value >> 24);
+  p[1] = static_cast<uint8_t>(value >> 16);
+  p[2] = static_cast<uint8_t>(value >> 8);
+  p[3] = static_cast<uint8_t>(value);
+  return p + 4;
+}
+
+static uint32_t getBE32(const uint8_t* p) {
+  return (static_cast<uint32_t>(p[0]) << 24) |
+    (static_cast<uint32_t>(p[1]) << 16) |
+    (static_cast<uint32_t>(p[2]) << 8) |
+    static_cast<uint32_t>(p[3]);
+}
+
+RecordHeader headerFor(const H264::AccessUnit& unit, uint32_t sequence) {
+  RecordHeader header{};
+  header.flags = (unit.keyframe ? KEYFRAME : 0) | (unit.config ? CONFIG : 0);
+  header.sequence = sequence;
+  header.ptsUs = unit.ptsUs;
+  header.payloadSize = unit.data ? unit.data->size() : 0;
+  return header;
+}
+
+void encodeHeader(const RecordHeader& header, uint8_t* out) {
+  memcpy(out, MAGIC, sizeof(MAGIC));
+  out[4] = VERSION;
+  out[5] = header.flags;
+  out[6] = 0;
+  out[7] = 0;
+  uint8_t* p = putBE32(out + 8, header.sequence);
+  const uint64_t pts = static_cast<uint64_t>(header.ptsUs);
+  p = putBE32(p, static_cast<uint32_t>(pts >> 32));
+  p = putBE32(p, static_cast<uint32_t>(pts));
+  putBE32(p, header.payloadSize);
+}
+
+bool decodeHeader(const uint8_t* in, RecordHeader& header) {
+  if ((memcmp(in, MAGIC, sizeof(MAGIC)) != 0) || (in[4] != VERSION) ||
+      (in[6] != 0) || (in[7] != 0)) {
+    return false;
+  }
+
+  header.flags = in[5];
+  header.sequence = getBE32(in + 8);
+  header.ptsUs = static_cast<int64_t>(
+      (static_cast<uint64_t>(getBE32(in + 12)) << 32) | getBE32(in + 16));
+  header.payloadSize = getBE32(in + 20);
+  return header.payloadSize <= MAX_PAYLOAD_SIZE;
+}
+
+ssize_t writeRecord(int fd, const RecordHeader& header, const Frame* payload,
+                    uint64_t* syscalls) {
+  uint8_t buf[HEADER_SIZE];
+  encodeHeader(header, buf);
+
+  // Reused between calls so steady-state sends don't allocate
+  thread_local std::vector<struct iovec> iov{};
+  iov.clear();
+  iov.push_back({buf, sizeof(buf)});
+  if (payload != nullptr) {
+    for (const auto& chunk : payload->chunks()) {
+      if (chunk.size > 0) {
+        iov.push_back({const_cast<uint8_t*>(chunk.data), chunk.size});
+      }
+    }
+  }
+
+  return ImageFraming::writeAll(fd, iov.data(), iov.size(), syscalls);
+}
+
+
+StreamParser::StreamParser(Callback callback)
+  : mCallback{std::move(callback)}
+  , mBuffer{}
+  , mStart{0}
+  , mWaitForKeyframe{true}
+  , mHaveSequence{false}
+  , mNextSequence{0}
+  , mRecords{0}
+  , mDroppedRecords{0}
+  , mSkippedBytes{0}
+{
+}
+
+void StreamParser::feed(const uint8_t* data, size_t size) {
+  // Drop what's been consumed before growing the buffer
+  if (mStart > 0) {
+    mBuffer.erase(mBuffer.begin(), mBuffer.begin() + mStart);
+    mStart = 0;
+  }
+  mBuffer.insert(mBuffer.end(), data, data + size);
+
+  while (mBuffer.size() - mStart >= HEADER_SIZE) {
+    RecordHeader header{};
+    if (!decodeHeader(&mBuffer[mStart], header)) {
+      resync();
+      continue;
+    }
+
+    if (mBuffer.size() - mStart - HEADER_SIZE < header.payloadSize) {
+      // Wait for the rest of the record
+      break;
+    }
+
+    const uint8_t* payload = &mBuffer[mStart + HEADER_SIZE];
+    mStart += HEADER_SIZE + header.payloadSize;
+
+    if (mHaveSequence && (header.sequence != mNextSequence)) {
+      header.flags |= DISCONTINUITY;
+    }
+    mHaveSequence = true;
+    mNextSequence = header.sequence + 1;
+
+    if (mWaitForKeyframe && !(header.flags & (KEYFRAME | CONFIG))) {
+      mDroppedRecords++;
+      continue;
+    }
+    mWaitForKeyframe = false;
+
+    mRecords++;
+    mCallback(header, payload);
+  }
+}
+
+void StreamParser::resync() {
+  const uint8_t* begin = &mBuffer[mStart];
+  const uint8_t* end = mBuffer.data() + mBuffer.size();
+  const uint8_t* p = begin + 1;
+  // A header could start in the last few bytes; keep them
+  while (p + sizeof(MAGIC) <= end) {
+    p = static_cast<const uint8_t*>(memchr(p, MAGIC[0], end - p));
+    if ((p == nullptr) || (p + sizeof(MAGIC) > end)) {
+      break;
+    }
+    if (memcmp(p, MAGIC, sizeof(MAGIC)) == 0) {
+      break;
+    }
+    p++;
+  }
+  if ((p == nullptr) || (p + sizeof(MAGIC) > end)) {
+    p = end - std::min<size_t>(end - begin - 1, sizeof(MAGIC) - 1);
+  }
+
+  if (!mWaitForKeyframe) {
+    Logger::warning(__func__, "Lost sync with the video stream\n");
+  }
+  mSkippedBytes += p - begin;
+  mStart += p - begin;
+  mWaitForKeyframe = true;
+  mHaveSequence = false;
+}
+
+} // namespace VideoFraming